@@ -1,25 +1,47 @@
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
 #include <stdlib.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "broadcast.h"
 #include "pool.h"
 #include "util.h"
 
 #define ESTIMATED_PUBLISHERS 16
+#define BROADCAST_MAGIC 0x7473616364616f72ul /* set once initialized */
 
+/* The read-mostly fields, head_idx and tail_idx are on their own cache lines:
+ * subscribers only read the slots and the messages, and head_idx when they
+ * were lapped, so that hundreds of them do not bounce the lines written by the
+ * publishers.
+ */
 struct __attribute__((aligned(CACHELINE_SIZE))) broadcast {
+    uint64_t magic;
     uint64_t depth_mask;
     uint64_t max_msg_size;
-    uint64_t head_idx, tail_idx;
-    size_t pool_off;
-    char padding[CACHELINE_SIZE - 5 * sizeof(uint64_t) - sizeof(size_t)];
+    size_t pool_off, mem_size;
+    char _pad0[CACHELINE_SIZE - 3 * sizeof(uint64_t) - 2 * sizeof(size_t)];
+    uint64_t head_idx;
+    char _pad1[CACHELINE_SIZE - sizeof(uint64_t)];
+    uint64_t tail_idx;
+    char _pad2[CACHELINE_SIZE - sizeof(uint64_t)];
 
     lf_ref_t slots[];
 };
-static_assert(sizeof(broadcast_t) == CACHELINE_SIZE, "");
+static_assert(sizeof(broadcast_t) == 3 * CACHELINE_SIZE, "");
 static_assert(alignof(broadcast_t) == CACHELINE_SIZE, "");
 
+/* "seq" is the index the message is published at, set by the publisher right
+ * before each attempt to append it, and cleared when the element is taken
+ * from the pool. A subscriber checks it around its copy: the element may
+ * have been dropped and reused while the slot still points to it.
+ */
 typedef struct __attribute__((aligned(alignof(uint128_t)))) msg {
     uint64_t size;
+    uint64_t seq;
     uint8_t payload[];
 } msg_t;
 
@@ -28,6 +50,83 @@ static inline pool_t *get_pool(broadcast_t *b)
     return (pool_t *) ((char *) b + b->pool_off);
 }
 
+/* Each publisher holds one element, and may have two magazines cached */
+static inline size_t get_pool_elts(size_t depth)
+{
+    return depth + ESTIMATED_PUBLISHERS * (1 + 2 * POOL_MAGAZINE_SIZE);
+}
+
+/* Publishers take elements from and give them back to a cache of the pool
+ * for each of the first PUB_CACHES broadcasts the thread publishes to, and
+ * go to the pool directly for the others. The caches are flushed when the
+ * thread exits.
+ */
+#define PUB_CACHES 4
+
+static __thread pool_cache_t pub_caches[PUB_CACHES];
+static pthread_key_t pub_cache_key;
+static pthread_once_t pub_cache_once = PTHREAD_ONCE_INIT;
+
+static void pub_cache_exit(void *caches)
+{
+    pool_cache_t *cache = caches;
+    for (int i = 0; i < PUB_CACHES; i++) {
+        if (cache[i].pool)
+            pool_cache_flush(&cache[i]);
+    }
+}
+
+static void pub_cache_key_init(void)
+{
+    pthread_key_create(&pub_cache_key, pub_cache_exit);
+}
+
+static pool_cache_t *pub_cache(broadcast_t *b)
+{
+    pool_t *pool = get_pool(b);
+    pool_cache_t *cache = NULL;
+
+    for (int i = 0; i < PUB_CACHES; i++) {
+        if (pub_caches[i].pool == pool)
+            return &pub_caches[i];
+        if (!pub_caches[i].pool && !cache)
+            cache = &pub_caches[i];
+    }
+    if (!cache)
+        return NULL;
+
+    pthread_once(&pub_cache_once, pub_cache_key_init);
+    pthread_setspecific(pub_cache_key, pub_caches);
+    pool_cache_init(cache, pool);
+    return cache;
+}
+
+static inline void *elt_acquire(broadcast_t *b)
+{
+    pool_cache_t *cache = pub_cache(b);
+    return cache ? pool_cache_acquire(cache) : pool_acquire(get_pool(b));
+}
+
+static inline void elt_release(broadcast_t *b, void *elt)
+{
+    pool_cache_t *cache = pub_cache(b);
+    if (cache)
+        pool_cache_release(cache, elt);
+    else
+        pool_release(get_pool(b), elt);
+}
+
+void broadcast_pub_flush(broadcast_t *b)
+{
+    pool_t *pool = get_pool(b);
+    for (int i = 0; i < PUB_CACHES; i++) {
+        if (pub_caches[i].pool == pool) {
+            pool_cache_flush(&pub_caches[i]);
+            pub_caches[i].pool = NULL;
+        }
+    }
+}
+
 static void broadcast_footprint(size_t depth,
                                 size_t max_msg_size,
                                 size_t *size,
@@ -54,6 +153,7 @@ broadcast_t *broadcast_new(size_t depth, size_t max_msg_size)
 
 void broadcast_delete(broadcast_t *bcast)
 {
+    broadcast_pub_flush(bcast);
     free(bcast);
 }
 
@@ -66,18 +166,31 @@ static void try_drop_head(broadcast_t *b, uint64_t head_idx)
     /* TODO: release the shared resources */
     uint64_t msg_off = head_cur.val;
     msg_t *msg = (msg_t *) ((char *) b + msg_off);
-    pool_release(get_pool(b), msg);
+    elt_release(b, msg);
 }
 
-bool broadcast_pub(broadcast_t *b, void *msg_buf, size_t msg_size)
+void *broadcast_pub_reserve(broadcast_t *b)
 {
-    msg_t *msg = (msg_t *) pool_acquire(get_pool(b));
+    msg_t *msg = (msg_t *) elt_acquire(b);
     if (!msg)
-        return false; /* out of elements */
+        return NULL; /* out of elements */
+
+    __atomic_store_n(&msg->seq, 0, __ATOMIC_RELAXED);
+    LF_BARRIER_RELEASE();
+    return msg->payload;
+}
+
+void broadcast_pub_cancel(broadcast_t *b, void *payload)
+{
+    elt_release(b, (char *) payload - offsetof(msg_t, payload));
+}
+
+void broadcast_pub_commit(broadcast_t *b, void *payload, size_t msg_size)
+{
+    msg_t *msg = (msg_t *) ((char *) payload - offsetof(msg_t, payload));
     uint64_t msg_off = (char *) msg - (char *) b;
 
     msg->size = msg_size;
-    memcpy(msg->payload, msg_buf, msg_size);
 
     while (1) {
         uint64_t head_idx = b->head_idx;
@@ -107,6 +220,7 @@ bool broadcast_pub(broadcast_t *b, void *msg_buf, size_t msg_size)
         }
 
         /* Otherwise, try to append the tail */
+        __atomic_store_n(&msg->seq, tail_idx, __ATOMIC_RELEASE);
         lf_ref_t tail_next = LF_REF_MAKE(tail_idx, msg_off);
         if (!LF_REF_CAS(tail_ptr, tail_cur, tail_next)) {
             LF_PAUSE();
@@ -115,15 +229,29 @@ bool broadcast_pub(broadcast_t *b, void *msg_buf, size_t msg_size)
 
         /* Success, try to update the tail. */
         LF_U64_CAS(&b->tail_idx, tail_idx, tail_idx + 1);
-        return true;
+        return;
     }
 }
 
+bool broadcast_pub(broadcast_t *b, void *msg_buf, size_t msg_size)
+{
+    void *payload = broadcast_pub_reserve(b);
+    if (!payload)
+        return false;
+
+    memcpy(payload, msg_buf, msg_size);
+    broadcast_pub_commit(b, payload, msg_size);
+    return true;
+}
+
 typedef struct sub_impl sub_impl_t;
 struct __attribute__((aligned(16))) sub_impl {
     broadcast_t *bcast;
     uint64_t idx;
-    char _extra[16];
+    uint64_t lapped;   /* messages skipped since broadcast_sub_begin() */
+    uint64_t overruns; /* times the subscriber was lapped */
+    uint64_t peek_off; /* the message returned by broadcast_sub_peek() */
+    char _extra[8];
 };
 static_assert(sizeof(sub_impl_t) == sizeof(broadcast_sub_t), "");
 static_assert(alignof(sub_impl_t) == alignof(broadcast_sub_t), "");
@@ -132,59 +260,130 @@ void broadcast_sub_begin(broadcast_sub_t *_sub, broadcast_t *b)
 {
     sub_impl_t *sub = (sub_impl_t *) _sub;
     sub->bcast = b;
-    sub->idx = b->head_idx;
+    sub->idx = LF_ATOMIC_LOAD_ACQUIRE(&b->head_idx);
+    sub->lapped = 0;
+    sub->overruns = 0;
 }
 
-bool broadcast_sub_next(broadcast_sub_t *_sub,
-                        void *msg_buf,
-                        size_t *_out_msg_size,
-                        size_t *_out_drops)
+/* The subscriber was lapped: move past "n" messages at least, up to the
+ * oldest one still in the ring.
+ */
+static void sub_skip(sub_impl_t *sub, uint64_t n, size_t *drops)
+{
+    uint64_t head_idx = LF_ATOMIC_LOAD_ACQUIRE(&sub->bcast->head_idx);
+    uint64_t idx = sub->idx + n;
+
+    if (head_idx > idx)
+        idx = head_idx;
+    *drops += idx - sub->idx;
+    sub->lapped += idx - sub->idx;
+    sub->overruns++;
+    sub->idx = idx;
+}
+
+const void *broadcast_sub_peek(broadcast_sub_t *_sub,
+                               size_t *_out_msg_size,
+                               size_t *_out_drops)
 {
     sub_impl_t *sub = (sub_impl_t *) _sub;
     broadcast_t *b = sub->bcast;
     size_t drops = 0;
 
     while (1) {
-        if (sub->idx == b->tail_idx)
-            return false;
-
-        lf_ref_t *ref_ptr = &b->slots[sub->idx & b->depth_mask];
-        lf_ref_t ref = *ref_ptr;
+        lf_ref_t ref = b->slots[sub->idx & b->depth_mask];
 
         LF_BARRIER_ACQUIRE();
 
+        /* Not published yet: the slot still holds an older message */
+        if (ref.tag < sub->idx) {
+            *_out_drops = drops;
+            return NULL;
+        }
+
         /* we have fallen behind and the message we wanted was dropped? */
         if (ref.tag != sub->idx) {
-            sub->idx++;
-            drops++;
+            sub_skip(sub, 1, &drops);
             LF_PAUSE();
             continue;
         }
         uint64_t msg_off = ref.val;
         msg_t *msg = (msg_t *) ((char *) b + msg_off);
+        if (LF_ATOMIC_LOAD_ACQUIRE(&msg->seq) != sub->idx) {
+            sub_skip(sub, 1, &drops);
+            continue;
+        }
         size_t msg_size = msg->size;
         if (msg_size > b->max_msg_size) { /* inconsistent */
-            LF_PAUSE();
+            sub_skip(sub, 1, &drops);
             continue;
         }
-        memcpy(msg_buf, msg->payload, msg_size);
 
-        LF_BARRIER_ACQUIRE();
+        sub->peek_off = msg_off;
+        *_out_msg_size = msg_size;
+        *_out_drops = drops;
+        return msg->payload;
+    }
+}
 
-        lf_ref_t ref2 = *ref_ptr;
-        /* Data hanged while reading? Drop it */
-        if (!LF_REF_EQUAL(ref, ref2)) {
-            sub->idx++;
-            drops++;
-            LF_PAUSE();
-            continue;
-        }
+bool broadcast_sub_validate(broadcast_sub_t *_sub, size_t *_out_drops)
+{
+    sub_impl_t *sub = (sub_impl_t *) _sub;
+    broadcast_t *b = sub->bcast;
+    msg_t *msg = (msg_t *) ((char *) b + sub->peek_off);
+    size_t drops = 0;
 
-        sub->idx++;
-        *_out_msg_size = msg_size;
+    LF_BARRIER_ACQUIRE();
+
+    lf_ref_t ref = b->slots[sub->idx & b->depth_mask];
+    /* Data changed while reading? Drop it */
+    if (ref.tag != sub->idx || ref.val != sub->peek_off ||
+        __atomic_load_n(&msg->seq, __ATOMIC_RELAXED) != sub->idx) {
+        sub_skip(sub, 1, &drops);
         *_out_drops = drops;
-        return true;
+        return false;
     }
+
+    sub->idx++;
+    *_out_drops = 0;
+    return true;
+}
+
+bool broadcast_sub_next(broadcast_sub_t *sub,
+                        void *msg_buf,
+                        size_t *_out_msg_size,
+                        size_t *_out_drops)
+{
+    size_t msg_size, drops = 0;
+
+    while (1) {
+        size_t d;
+        const void *payload = broadcast_sub_peek(sub, &msg_size, &d);
+        drops += d;
+        if (!payload) {
+            *_out_drops = drops;
+            return false;
+        }
+
+        memcpy(msg_buf, payload, msg_size);
+        bool valid = broadcast_sub_validate(sub, &d);
+        drops += d;
+        if (valid) {
+            *_out_msg_size = msg_size;
+            *_out_drops = drops;
+            return true;
+        }
+        LF_PAUSE();
+    }
+}
+
+void broadcast_sub_stats(broadcast_sub_t *_sub, broadcast_sub_stats_t *stats)
+{
+    sub_impl_t *sub = (sub_impl_t *) _sub;
+    uint64_t tail_idx = LF_ATOMIC_LOAD_ACQUIRE(&sub->bcast->tail_idx);
+
+    stats->lag = tail_idx > sub->idx ? tail_idx - sub->idx : 0;
+    stats->lapped = sub->lapped;
+    stats->overruns = sub->overruns;
 }
 
 static void broadcast_footprint(size_t depth,
@@ -194,7 +393,7 @@ static void broadcast_footprint(size_t depth,
 {
     size_t elt_size =
         LF_ALIGN_UP(sizeof(msg_t) + max_msg_size, alignof(uint128_t));
-    size_t pool_elts = depth + ESTIMATED_PUBLISHERS;
+    size_t pool_elts = get_pool_elts(depth);
 
     size_t pool_size, pool_align;
     pool_footprint(pool_elts, elt_size, &pool_size, &pool_align);
@@ -219,7 +418,7 @@ broadcast_t *broadcast_mem_init(void *mem, size_t depth, size_t max_msg_size)
 
     size_t elt_size =
         LF_ALIGN_UP(sizeof(msg_t) + max_msg_size, alignof(uint128_t));
-    size_t pool_elts = depth + ESTIMATED_PUBLISHERS;
+    size_t pool_elts = get_pool_elts(depth);
 
     size_t pool_size, pool_align;
     pool_footprint(pool_elts, elt_size, &pool_size, &pool_align);
@@ -229,6 +428,8 @@ broadcast_t *broadcast_mem_init(void *mem, size_t depth, size_t max_msg_size)
     void *pool_mem = (char *) mem + pool_off;
 
     broadcast_t *b = (broadcast_t *) mem;
+    b->magic = 0;
+    b->mem_size = pool_off + pool_size;
     b->depth_mask = depth - 1;
     b->max_msg_size = max_msg_size;
     /* Start from 1 because we use 0 to mean "unused" */
@@ -242,5 +443,80 @@ broadcast_t *broadcast_mem_init(void *mem, size_t depth, size_t max_msg_size)
         return NULL;
     assert(pool == pool_mem);
 
+    __atomic_store_n(&b->magic, BROADCAST_MAGIC, __ATOMIC_RELEASE);
     return b;
 }
+
+broadcast_t *broadcast_shm_create(const char *name,
+                                  size_t depth,
+                                  size_t max_msg_size)
+{
+    size_t mem_size;
+    broadcast_footprint(depth, max_msg_size, &mem_size, NULL);
+
+    int fd = shm_open(name, O_RDWR | O_CREAT | O_EXCL, 0600);
+    if (fd < 0)
+        return NULL;
+    if (ftruncate(fd, mem_size) != 0) {
+        close(fd);
+        shm_unlink(name);
+        return NULL;
+    }
+
+    /* Page aligned, which is more than alignof(broadcast_t) */
+    void *mem =
+        mmap(NULL, mem_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED) {
+        shm_unlink(name);
+        return NULL;
+    }
+
+    broadcast_t *b = broadcast_mem_init(mem, depth, max_msg_size);
+    if (!b) {
+        munmap(mem, mem_size);
+        shm_unlink(name);
+        errno = EINVAL;
+        return NULL;
+    }
+    return b;
+}
+
+broadcast_t *broadcast_shm_open(const char *name)
+{
+    int fd = shm_open(name, O_RDWR, 0);
+    if (fd < 0)
+        return NULL;
+
+    struct stat st;
+    if (fstat(fd, &st) != 0 || (size_t) st.st_size < sizeof(broadcast_t)) {
+        close(fd);
+        errno = EAGAIN; /* not sized by the creator yet */
+        return NULL;
+    }
+    void *mem =
+        mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    close(fd);
+    if (mem == MAP_FAILED)
+        return NULL;
+
+    broadcast_t *b = (broadcast_t *) mem;
+    if (LF_ATOMIC_LOAD_ACQUIRE(&b->magic) != BROADCAST_MAGIC ||
+        b->mem_size != (size_t) st.st_size) {
+        munmap(mem, st.st_size);
+        errno = EAGAIN;
+        return NULL;
+    }
+    return b;
+}
+
+void broadcast_shm_close(broadcast_t *b)
+{
+    broadcast_pub_flush(b);
+    munmap(b, b->mem_size);
+}
+
+int broadcast_shm_unlink(const char *name)
+{
+    return shm_unlink(name);
+}
@@ -8,16 +8,67 @@
 typedef struct broadcast broadcast_t;
 typedef struct broadcast_sub broadcast_sub_t;
 struct __attribute__((aligned(16))) broadcast_sub {
-    char _opaque[32];
+    char _opaque[48];
 };
 
 broadcast_t *broadcast_new(size_t depth, size_t max_msg_size);
 void broadcast_delete(broadcast_t *bcast);
 bool broadcast_pub(broadcast_t *b, void *msg, size_t msg_size);
+
+/* Zero-copy publishing: write up to max_msg_size bytes in place, then
+ * append them with broadcast_pub_commit(), or give the element back with
+ * broadcast_pub_cancel(). Returns NULL when out of elements.
+ */
+void *broadcast_pub_reserve(broadcast_t *b);
+void broadcast_pub_commit(broadcast_t *b, void *payload, size_t msg_size);
+void broadcast_pub_cancel(broadcast_t *b, void *payload);
+
+/* Publishers keep a few free elements in a per-thread cache. A thread done
+ * publishing gives them back with broadcast_pub_flush() or when it exits;
+ * the broadcast must not be deleted or unmapped until then, except by the
+ * thread itself, which flushes its cache first.
+ */
+void broadcast_pub_flush(broadcast_t *b);
+
 void broadcast_sub_begin(broadcast_sub_t *sub, broadcast_t *b);
 bool broadcast_sub_next(broadcast_sub_t *sub,
                         void *msg_buf,
                         size_t *_out_msg_size,
                         size_t *_out_drops);
 
+/* Zero-copy reading: broadcast_sub_peek() returns the next message in place,
+ * or NULL if there is none yet. It may be overwritten while being read, so
+ * whatever was taken from it only holds if broadcast_sub_validate() then
+ * returns true, which moves on to the next message either way.
+ */
+const void *broadcast_sub_peek(broadcast_sub_t *sub,
+                               size_t *_out_msg_size,
+                               size_t *_out_drops);
+bool broadcast_sub_validate(broadcast_sub_t *sub, size_t *_out_drops);
+
+/* Per-subscriber lag metrics */
+typedef struct broadcast_sub_stats {
+    size_t lag;      /* messages published and not read yet */
+    size_t lapped;   /* messages overwritten before they were read */
+    size_t overruns; /* times the subscriber was lapped */
+} broadcast_sub_stats_t;
+
+void broadcast_sub_stats(broadcast_sub_t *sub, broadcast_sub_stats_t *stats);
+
 broadcast_t *broadcast_mem_init(void *mem, size_t depth, size_t max_msg_size);
+
+/* Cross-process fan-out through POSIX shared memory. The creator makes the
+ * "name" object (e.g. "/md-feed"), failing if it exists, and initializes it;
+ * the other processes, publishers or subscribers, map it with
+ * broadcast_shm_open(), which fails with EAGAIN until the creator is done.
+ * The broadcast only holds offsets, so it may be mapped at any address.
+ * Each process unmaps it with broadcast_shm_close(); the name lasts until
+ * broadcast_shm_unlink(). Publishers that die while holding a reserved
+ * element leak it from the pool.
+ */
+broadcast_t *broadcast_shm_create(const char *name,
+                                  size_t depth,
+                                  size_t max_msg_size);
+broadcast_t *broadcast_shm_open(const char *name);
+void broadcast_shm_close(broadcast_t *b);
+int broadcast_shm_unlink(const char *name);
@@ -1,6 +1,17 @@
+#include <stdlib.h>
+
 #include "pool.h"
 #include "util.h"
 
+/* Full magazines go to the depot as batches of elements chained through
+ * their link field, the first one also holding the depot link and the count.
+ */
+struct pool_batch {
+    lf_ref_t next;
+    uint64_t n;
+    uint64_t link;
+};
+
 struct __attribute__((aligned(CACHELINE_SIZE))) pool {
     size_t num_elts;
     size_t elt_size;
@@ -10,17 +21,85 @@ struct __attribute__((aligned(CACHELINE_SIZE))) pool {
     char _pad2[CACHELINE_SIZE - 2 * sizeof(size_t) - 2 * sizeof(uint64_t) -
                sizeof(lf_ref_t)];
 
+    /* The depot on its own line, threads with a cache rarely go further */
+    lf_ref_t depot;
+    uint64_t depot_tag;
+    char _pad3[CACHELINE_SIZE - sizeof(lf_ref_t) - sizeof(uint64_t)];
+
     char mem[];
 };
-static_assert(sizeof(pool_t) == CACHELINE_SIZE, "");
+static_assert(sizeof(pool_t) == 2 * CACHELINE_SIZE, "");
 static_assert(alignof(pool_t) == CACHELINE_SIZE, "");
 
+static inline void *off_to_elt(pool_t *pool, uint64_t elt_off)
+{
+    return (char *) pool + elt_off;
+}
+
+static inline uint64_t elt_to_off(pool_t *pool, void *elt)
+{
+    return (uint64_t) ((char *) elt - (char *) pool);
+}
+
+static void depot_push(pool_t *pool, void **elts, size_t n)
+{
+    struct pool_batch *batch = elts[0];
+    for (size_t i = 0; i + 1 < n; i++)
+        ((struct pool_batch *) elts[i])->link = elt_to_off(pool, elts[i + 1]);
+    batch->n = n;
+
+    uint64_t tag = LF_ATOMIC_INC(&pool->depot_tag);
+    lf_ref_t next = LF_REF_MAKE(tag, elt_to_off(pool, batch));
+
+    while (1) {
+        lf_ref_t cur = pool->depot;
+        batch->next = cur;
+
+        if (!LF_REF_CAS(&pool->depot, cur, next)) {
+            LF_PAUSE();
+            continue;
+        }
+        return;
+    }
+}
+
+/* Take a batch of up to POOL_MAGAZINE_SIZE elements from the depot into
+ * @elts, return how many.
+ */
+static size_t depot_pop(pool_t *pool, void **elts)
+{
+    struct pool_batch *batch;
+
+    while (1) {
+        lf_ref_t cur = pool->depot;
+        if (LF_REF_IS_NULL(cur))
+            return 0;
+
+        batch = off_to_elt(pool, cur.val);
+        lf_ref_t next = batch->next;
+
+        if (!LF_REF_CAS(&pool->depot, cur, next)) {
+            LF_PAUSE();
+            continue;
+        }
+        break;
+    }
+
+    size_t n = batch->n;
+    struct pool_batch *elt = batch;
+    for (size_t i = 0; i < n; i++) {
+        elts[i] = elt;
+        elt = off_to_elt(pool, elt->link);
+    }
+    return n;
+}
+
 void *pool_acquire(pool_t *pool)
 {
     while (1) {
         lf_ref_t cur = pool->head;
         if (LF_REF_IS_NULL(cur))
-            return NULL;
+            break;
 
         uint64_t elt_off = cur.val;
         lf_ref_t *elt = (lf_ref_t *) ((char *) pool + elt_off);
@@ -32,6 +111,15 @@ void *pool_acquire(pool_t *pool)
         }
         return elt;
     }
+
+    /* Split a batch from the depot */
+    void *elts[POOL_MAGAZINE_SIZE];
+    size_t n = depot_pop(pool, elts);
+    if (n == 0)
+        return NULL;
+    if (n > 1)
+        depot_push(pool, elts + 1, n - 1);
+    return elts[0];
 }
 
 void pool_release(pool_t *pool, void *elt)
@@ -57,6 +145,8 @@ void pool_footprint(size_t num_elts,
                     size_t *_size,
                     size_t *_align)
 {
+    if (elt_size < sizeof(struct pool_batch))
+        elt_size = sizeof(struct pool_batch);
     elt_size = LF_ALIGN_UP(elt_size, alignof(uint128_t));
 
     if (_size)
@@ -69,6 +159,8 @@ pool_t *pool_mem_init(void *mem, size_t num_elts, size_t elt_size)
 {
     if (elt_size == 0)
         return NULL;
+    if (elt_size < sizeof(struct pool_batch))
+        elt_size = sizeof(struct pool_batch);
     elt_size = LF_ALIGN_UP(elt_size, alignof(uint128_t));
 
     pool_t *pool = (pool_t *) mem;
@@ -76,12 +168,96 @@ pool_t *pool_mem_init(void *mem, size_t num_elts, size_t elt_size)
     pool->elt_size = elt_size;
     pool->tag_next = 0;
     pool->head = LF_REF_NULL;
+    pool->depot = LF_REF_NULL;
+    pool->depot_tag = 0;
 
+    /* Everything starts in the depot, as full magazines */
+    void *elts[POOL_MAGAZINE_SIZE];
     char *ptr = pool->mem + num_elts * elt_size;
-    for (size_t i = num_elts; i > 0; i--) {
-        ptr -= elt_size;
-        pool_release(pool, ptr);
+    for (size_t i = num_elts; i > 0;) {
+        size_t n = i < POOL_MAGAZINE_SIZE ? i : POOL_MAGAZINE_SIZE;
+        for (size_t j = n; j > 0; j--) {
+            ptr -= elt_size;
+            elts[j - 1] = ptr;
+        }
+        depot_push(pool, elts, n);
+        i -= n;
     }
 
     return pool;
 }
+
+pool_t *pool_new(size_t num_elts, size_t elt_size)
+{
+    size_t size, align;
+    pool_footprint(num_elts, elt_size, &size, &align);
+
+    void *mem = NULL;
+    if (posix_memalign(&mem, align, size) != 0)
+        return NULL;
+
+    pool_t *pool = pool_mem_init(mem, num_elts, elt_size);
+    if (!pool)
+        free(mem);
+    return pool;
+}
+
+void pool_delete(pool_t *pool)
+{
+    free(pool);
+}
+
+void pool_cache_init(pool_cache_t *cache, pool_t *pool)
+{
+    cache->pool = pool;
+    cache->loaded_n = cache->prev_n = 0;
+    cache->loaded = cache->mags[0];
+    cache->prev = cache->mags[1];
+}
+
+static inline void pool_cache_swap(pool_cache_t *cache)
+{
+    void **mag = cache->loaded;
+    size_t n = cache->loaded_n;
+    cache->loaded = cache->prev, cache->loaded_n = cache->prev_n;
+    cache->prev = mag, cache->prev_n = n;
+}
+
+void *pool_cache_acquire(pool_cache_t *cache)
+{
+    if (cache->loaded_n)
+        return cache->loaded[--cache->loaded_n];
+
+    if (cache->prev_n == POOL_MAGAZINE_SIZE) {
+        pool_cache_swap(cache);
+        return cache->loaded[--cache->loaded_n];
+    }
+
+    /* Both empty: reload from the depot, else from single elements */
+    cache->loaded_n = depot_pop(cache->pool, cache->loaded);
+    if (cache->loaded_n)
+        return cache->loaded[--cache->loaded_n];
+    return pool_acquire(cache->pool);
+}
+
+void pool_cache_release(pool_cache_t *cache, void *elt)
+{
+    if (cache->loaded_n == POOL_MAGAZINE_SIZE) {
+        /* Both full: the previous one goes to the depot */
+        if (cache->prev_n == POOL_MAGAZINE_SIZE) {
+            depot_push(cache->pool, cache->prev, cache->prev_n);
+            cache->prev_n = 0;
+        }
+        pool_cache_swap(cache);
+    }
+    cache->loaded[cache->loaded_n++] = elt;
+}
+
+void pool_cache_flush(pool_cache_t *cache)
+{
+    if (cache->loaded_n)
+        depot_push(cache->pool, cache->loaded, cache->loaded_n);
+    if (cache->prev_n)
+        depot_push(cache->pool, cache->prev, cache->prev_n);
+    cache->loaded_n = cache->prev_n = 0;
+}
@@ -2,10 +2,16 @@
 
 #include <stddef.h>
 
-/* Lock-free Pool */
+/* Lock-free Pool
+ *
+ * A fixed-size object allocator over a preallocated block of elements. The
+ * pool only holds offsets, so the block may be shared between processes
+ * mapping it at different addresses. Elements are at least 32 bytes.
+ */
 
 typedef struct pool pool_t;
 
+pool_t *pool_new(size_t num_elts, size_t elt_size);
 void pool_delete(pool_t *pool);
 void *pool_acquire(pool_t *pool);
 void pool_release(pool_t *pool, void *elt);
@@ -15,3 +21,31 @@ void pool_footprint(size_t num_elts,
                     size_t *size,
                     size_t *align);
 pool_t *pool_mem_init(void *mem, size_t num_elts, size_t elt_size);
+
+/* Per-thread magazine cache, after Bonwick's magazine layer
+ *
+ * A thread keeps a loaded and a previous magazine of up to
+ * POOL_MAGAZINE_SIZE elements each, and acquires and releases from them
+ * without touching the shared pool. The previous magazine is always full or
+ * empty: when the loaded one runs dry or full, the two are swapped, and only
+ * when that does not help is a full magazine taken from, or given to, the
+ * depot of the pool, in a single CAS either way.
+ *
+ * A cache is owned by one thread. Up to 2 * POOL_MAGAZINE_SIZE elements sit
+ * in it and cannot be acquired by other threads until it is flushed.
+ */
+#define POOL_MAGAZINE_SIZE 8
+
+typedef struct pool_cache {
+    pool_t *pool;
+    size_t loaded_n, prev_n;
+    void **loaded, **prev;
+    void *mags[2][POOL_MAGAZINE_SIZE];
+} pool_cache_t;
+
+void pool_cache_init(pool_cache_t *cache, pool_t *pool);
+void *pool_cache_acquire(pool_cache_t *cache);
+void pool_cache_release(pool_cache_t *cache, void *elt);
+
+/* Give all the cached elements back to the pool */
+void pool_cache_flush(pool_cache_t *cache);
@@ -1,23 +1,29 @@
 #include <assert.h>
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <unistd.h>
 
 #include "broadcast.h"
+#include "pool.h"
 #include "test.h"
 
-#define MAX_THREADS 128
+#define MAX_THREADS 512
 
 typedef struct thread_state thread_state_t;
 struct thread_state {
     pthread_t thread;
     broadcast_t *bcast;
 
-    bool pub;
+    bool pub, yield, zero_copy;
     uint32_t pub_id;
     size_t pub_msgs, sub_msgs;
 
     size_t n_msgs, n_drops;
+    broadcast_sub_stats_t stats;
     int64_t dt;
 };
 
@@ -29,14 +35,45 @@ static void thread_func_pub(thread_state_t *t)
 
     for (size_t i = 0; i < t->pub_msgs; i++) {
         msg++;
-        bool success = broadcast_pub(b, &msg, sizeof(msg));
-        assert(success);
+        if (t->zero_copy) {
+            uint64_t *payload = broadcast_pub_reserve(b);
+            assert(payload);
+            *payload = msg;
+            broadcast_pub_commit(b, payload, sizeof(msg));
+        } else {
+            bool success = broadcast_pub(b, &msg, sizeof(msg));
+            assert(success);
+        }
         t->n_msgs++;
     }
 
     t->dt = wallclock() - start_time;
 }
 
+/* broadcast_sub_next() without the copy to the caller's buffer */
+static bool sub_next_zero_copy(broadcast_sub_t *sub,
+                               uint64_t *msg,
+                               size_t *msg_size,
+                               size_t *drops)
+{
+    size_t d;
+
+    *drops = 0;
+    while (1) {
+        const uint64_t *payload = broadcast_sub_peek(sub, msg_size, &d);
+        *drops += d;
+        if (!payload)
+            return false;
+        uint64_t m = *payload;
+        bool valid = broadcast_sub_validate(sub, &d);
+        *drops += d;
+        if (valid) {
+            *msg = m;
+            return true;
+        }
+    }
+}
+
 static void thread_func_sub(thread_state_t *t)
 {
     broadcast_t *b = t->bcast;
@@ -49,8 +86,18 @@ static void thread_func_sub(thread_state_t *t)
     size_t msg_size;
     size_t drops;
     for (size_t i = 0; i < (size_t) 1e9; i++) {
-        if (!broadcast_sub_next(sub, &msg, &msg_size, &drops))
+        bool got = t->zero_copy
+                       ? sub_next_zero_copy(sub, &msg, &msg_size, &drops)
+                       : broadcast_sub_next(sub, &msg, &msg_size, &drops);
+        if (!got) {
+            t->n_drops += drops;
+            if (t->n_msgs + t->n_drops == t->sub_msgs)
+                break;
+            /* More subscribers than CPUs: let the publishers run */
+            if (t->yield)
+                sched_yield();
             continue;
+        }
         assert(msg_size == sizeof(msg));
 
         uint32_t pub_id = msg >> 32;
@@ -63,6 +110,8 @@ static void thread_func_sub(thread_state_t *t)
     }
 
     t->dt = wallclock() - start_time;
+    broadcast_sub_stats(sub, &t->stats);
+    assert(t->stats.lapped == t->n_drops);
 }
 
 static void *thread_func(void *usr)
@@ -75,16 +124,17 @@ static void *thread_func(void *usr)
     return NULL;
 }
 
-static void run_test(const char *test_name,
-                     size_t num_pub,
-                     size_t num_sub,
-                     size_t num_elts)
+static void run_test_msgs(const char *test_name,
+                          size_t num_pub,
+                          size_t num_sub,
+                          size_t num_elts,
+                          size_t pub_msgs,
+                          bool zero_copy)
 {
     broadcast_t *b = broadcast_new(num_elts, sizeof(uint64_t));
     if (!b)
         FAIL("Failed to create new bcast");
 
-    size_t pub_msgs = (size_t) 1e5;
     size_t sub_msgs = num_pub * pub_msgs;
 
     assert(num_sub < MAX_THREADS);
@@ -93,6 +143,8 @@ static void run_test(const char *test_name,
         thread_state_t *t = &sub_threads[i];
         t->bcast = b;
         t->pub = false;
+        t->yield = num_sub > 8;
+        t->zero_copy = zero_copy;
         t->sub_msgs = sub_msgs;
         pthread_create(&t->thread, NULL, thread_func, t);
     }
@@ -104,6 +156,7 @@ static void run_test(const char *test_name,
         t->bcast = b;
         t->pub = true;
         t->pub_id = (uint32_t) i;
+        t->zero_copy = zero_copy;
         t->pub_msgs = pub_msgs;
         pthread_create(&t->thread, NULL, thread_func, t);
     }
@@ -117,10 +170,30 @@ static void run_test(const char *test_name,
 
     /* Report stats */
     printf("Test: %s\n", test_name);
-    for (size_t i = 0; i < num_sub; i++) {
+    if (num_sub > 8) {
+        /* Too many to list, summarize them */
+        size_t min_msgs = SIZE_MAX, max_msgs = 0, overruns = 0;
+        double ns = 0;
+        for (size_t i = 0; i < num_sub; i++) {
+            thread_state_t *t = &sub_threads[i];
+            if (t->n_msgs < min_msgs)
+                min_msgs = t->n_msgs;
+            if (t->n_msgs > max_msgs)
+                max_msgs = t->n_msgs;
+            overruns += t->stats.overruns;
+            ns += (double) t->dt / (t->n_msgs ? t->n_msgs : 1);
+        }
+        printf("  %zu Sub Threads | n_msgs: %7zu..%7zu overruns/sub: %7.1f | "
+               "%.f ns/msg\n",
+               num_sub, min_msgs, max_msgs, (double) overruns / num_sub,
+               ns / num_sub);
+    }
+    for (size_t i = 0; num_sub <= 8 && i < num_sub; i++) {
         thread_state_t *t = &sub_threads[i];
-        printf("  Sub Thread %zu | n_msgs: %7zu n_drops: %7zu | %.f ns/msg\n",
-               i, t->n_msgs, t->n_drops, (double) t->dt / t->n_msgs);
+        printf("  Sub Thread %zu | n_msgs: %7zu n_drops: %7zu overruns: %7zu | "
+               "%.f ns/msg\n",
+               i, t->n_msgs, t->n_drops, t->stats.overruns,
+               (double) t->dt / t->n_msgs);
     }
     for (size_t i = 0; i < num_pub; i++) {
         thread_state_t *t = &pub_threads[i];
@@ -129,8 +202,98 @@ static void run_test(const char *test_name,
     }
 }
 
+static void run_test(const char *test_name,
+                     size_t num_pub,
+                     size_t num_sub,
+                     size_t num_elts)
+{
+    run_test_msgs(test_name, num_pub, num_sub, num_elts, (size_t) 1e5, false);
+}
+
+/* A child process maps the broadcast by name and reads what the parent
+ * published, in place.
+ */
+static void run_test_shm(size_t num_msgs)
+{
+    const char *name = "/broadcast-stress";
+    broadcast_shm_unlink(name);
+
+    broadcast_t *b = broadcast_shm_create(name, 2048, sizeof(uint64_t));
+    if (!b)
+        FAIL("Failed to create shm bcast");
+    for (uint64_t i = 0; i < num_msgs; i++)
+        REQUIRE(broadcast_pub(b, &i, sizeof(i)));
+
+    pid_t pid = fork();
+    if (pid == 0) {
+        broadcast_t *child = broadcast_shm_open(name);
+        REQUIRE(child);
+
+        broadcast_sub_t sub[1];
+        broadcast_sub_begin(sub, child);
+        uint64_t msg;
+        size_t msg_size, drops;
+        for (uint64_t i = 0; i < num_msgs; i++) {
+            REQUIRE(sub_next_zero_copy(sub, &msg, &msg_size, &drops));
+            REQUIRE(drops == 0 && msg_size == sizeof(msg) && msg == i);
+        }
+        REQUIRE(!sub_next_zero_copy(sub, &msg, &msg_size, &drops));
+        broadcast_shm_close(child);
+        exit(0);
+    }
+
+    int status;
+    REQUIRE(pid > 0 && waitpid(pid, &status, 0) == pid);
+    REQUIRE(WIFEXITED(status) && WEXITSTATUS(status) == 0);
+    broadcast_shm_close(b);
+    REQUIRE(broadcast_shm_unlink(name) == 0);
+    printf("Test: shm %zu msgs\n", num_msgs);
+}
+
+/* Elements neither get lost nor handed out twice going through the
+ * magazines, the depot and the uncached calls.
+ */
+static void run_test_pool(void)
+{
+    enum { N = 100 };
+    void *elts[N];
+    pool_cache_t cache[1];
+
+    pool_t *pool = pool_new(N, 24);
+    REQUIRE(pool);
+    pool_cache_init(cache, pool);
+
+    for (int round = 0; round < 3; round++) {
+        for (int i = 0; i < N; i++) {
+            elts[i] = round == 1 ? pool_acquire(pool)
+                                 : pool_cache_acquire(cache);
+            REQUIRE(elts[i]);
+            memset(elts[i], round, 24);
+            for (int j = 0; j < i; j++)
+                REQUIRE(elts[j] != elts[i]);
+        }
+        REQUIRE(!pool_cache_acquire(cache) && !pool_acquire(pool));
+
+        /* Release some through the cache, some directly */
+        for (int i = 0; i < N; i++) {
+            if (i % 3 == round)
+                pool_release(pool, elts[i]);
+            else
+                pool_cache_release(cache, elts[i]);
+        }
+        if (round == 0)
+            pool_cache_flush(cache);
+    }
+
+    pool_cache_flush(cache);
+    pool_delete(pool);
+    printf("Test: pool %d elts\n", N);
+}
+
 int main()
 {
+    run_test_pool();
+
     /* Stress publishing, rolling around with lots of contention */
     run_test("1pub0sub", 1, 0, 128);
     run_test("2pub0sub", 2, 0, 128);
@@ -159,5 +322,20 @@ int main()
     run_test("1pub8sub", 1, 8, 2048);
     printf("\n");
 
+    /* Sweep over subscriber counts */
+    static const size_t sweep[] = {16, 64, 256, 500};
+    for (size_t i = 0; i < ARRAY_SIZE(sweep); i++) {
+        char name[32];
+        snprintf(name, sizeof(name), "2pub%zusub", sweep[i]);
+        run_test_msgs(name, 2, sweep[i], 2048, (size_t) 1e4, false);
+    }
+    printf("\n");
+
+    /* Zero-copy publishing and reading */
+    run_test_msgs("1pub2sub-zc", 1, 2, 2048, (size_t) 1e5, true);
+    run_test_msgs("4pub4sub-zc", 4, 4, 2048, (size_t) 1e5, true);
+    run_test_shm(1000);
+    printf("\n");
+
     return 0;
 }
@@ -1,67 +1,4 @@
-#include <linux/futex.h>
-#include <stdatomic.h>
-#include <stdint.h>
-#include <sys/syscall.h>
-#include <unistd.h>
-
-static inline long futex_wait(_Atomic uint32_t *uaddr, uint32_t val)
-{
-    return syscall(SYS_futex, uaddr, FUTEX_WAIT, val, NULL, NULL, 0);
-}
-
-static inline long futex_wake(_Atomic uint32_t *uaddr, uint32_t val)
-{
-    return syscall(SYS_futex, uaddr, FUTEX_WAKE, val, NULL, NULL, 0);
-}
-
-struct mutex {
-    _Atomic uint32_t val;
-};
-
-#define MUTEX_INITIALIZER \
-    (struct mutex) { .val = 0 }
-
-enum {
-    UNLOCKED = 0,
-    LOCKED_NO_WAITER = 1,
-    LOCKED = 2,
-};
-
-void mutex_init(struct mutex *mu)
-{
-    mu->val = UNLOCKED;
-}
-
-void mutex_unlock(struct mutex *mu)
-{
-    uint32_t orig =
-        atomic_fetch_sub_explicit(&mu->val, 1, memory_order_relaxed);
-    if (orig != LOCKED_NO_WAITER) {
-        mu->val = UNLOCKED;
-        futex_wake(&mu->val, 1);
-    }
-}
-
-static uint32_t cas(_Atomic uint32_t *ptr, uint32_t expect, uint32_t new)
-{
-    atomic_compare_exchange_strong_explicit(
-        ptr, &expect, new, memory_order_acq_rel, memory_order_acquire);
-    return expect;
-}
-
-void mutex_lock(struct mutex *mu)
-{
-    uint32_t val = cas(&mu->val, UNLOCKED, LOCKED_NO_WAITER);
-    if (val != UNLOCKED) {
-        do {
-            if (val == LOCKED ||
-                cas(&mu->val, LOCKED_NO_WAITER, LOCKED) != UNLOCKED)
-                futex_wait(&mu->val, LOCKED);
-        } while ((val = cas(&mu->val, UNLOCKED, LOCKED)) != UNLOCKED);
-    }
-}
-
-#include <stdbool.h>
+#include "mutex.h"
 
 struct chan_item {
     _Atomic uint32_t lap;
@@ -91,12 +28,34 @@ struct chan {
     /* Buffered channels only: number of waiting threads on the futexes. */
     _Atomic size_t send_waiters, recv_waiters;
 
+    /* chan_select() callers waiting on this channel, woken on any change */
+    struct mutex sel_mtx;
+    _Atomic size_t sel_count;
+    struct chan_sel_link *sel_list;
+
+    /* Unbuffered channels only: set by a chan_select() caller that found the
+     * send or recv mutex held, for the holder to wake it once unlocked.
+     */
+    _Atomic bool sel_busy;
+
     /* Ring buffer */
     size_t cap;
     _Atomic uint64_t head, tail;
     struct chan_item ring[0];
 };
 
+/* A chan_select() caller parks on its own futex, and is linked to every
+ * channel of its cases.
+ */
+struct chan_sel {
+    _Atomic uint32_t ftx;
+};
+
+struct chan_sel_link {
+    struct chan_sel *sel;
+    struct chan_sel_link *next, **pprev;
+};
+
 typedef void *(*chan_alloc_func_t)(size_t);
 
 #include <errno.h>
@@ -124,6 +83,10 @@ static void chan_init(struct chan *ch, size_t cap)
         ch->send_ftx = ch->recv_ftx = 0;
 
     ch->send_waiters = ch->recv_waiters = 0;
+    mutex_init(&ch->sel_mtx);
+    ch->sel_count = 0;
+    ch->sel_list = NULL;
+    ch->sel_busy = false;
     ch->cap = cap;
     ch->head = (uint64_t) 1 << 32;
     ch->tail = 0;
@@ -139,7 +102,62 @@ struct chan *chan_make(size_t cap, chan_alloc_func_t alloc)
     return ch;
 }
 
-static int chan_trysend_buf(struct chan *ch, void *data)
+/* Wake the chan_select() callers, once the fence below was issued */
+static void chan_wake_selectors(struct chan *ch)
+{
+    if (!atomic_load_explicit(&ch->sel_count, memory_order_relaxed))
+        return;
+
+    mutex_lock(&ch->sel_mtx);
+    for (struct chan_sel_link *l = ch->sel_list; l; l = l->next) {
+        atomic_fetch_add_explicit(&l->sel->ftx, 1, memory_order_release);
+        futex_wake(&l->sel->ftx, 1);
+    }
+    mutex_unlock(&ch->sel_mtx);
+}
+
+/* Wake the chan_select() callers, after a change they may be waiting for */
+static void chan_notify_selectors(struct chan *ch)
+{
+    /* Pairs with the fence in chan_select(): either the selector sees the
+     * change, or it is seen here.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    chan_wake_selectors(ch);
+}
+
+/* Take the send or recv mutex of an unbuffered channel for a chan_select()
+ * case. The holder may be about to do anything else than pairing with the
+ * caller, such as returning another case of its own chan_select(): then the
+ * caller must not sleep until the next change, which may never come. Ask
+ * the holder for a wakeup instead.
+ */
+static bool chan_trylock_unbuf(struct chan *ch, struct mutex *mtx)
+{
+    if (mutex_trylock(mtx))
+        return true;
+
+    atomic_store_explicit(&ch->sel_busy, true, memory_order_relaxed);
+    /* Pairs with the fence in chan_unlock_unbuf(): either the holder sees
+     * the request, or the mutex is seen released here.
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    return mutex_trylock(mtx);
+}
+
+static void chan_unlock_unbuf(struct chan *ch, struct mutex *mtx)
+{
+    mutex_unlock(mtx);
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&ch->sel_busy, memory_order_relaxed) &&
+        atomic_exchange_explicit(&ch->sel_busy, false, memory_order_relaxed))
+        chan_wake_selectors(ch);
+}
+
+/* Claim up to n free slots in a row with a single CAS, without wrapping
+ * around the end of the ring. Return how many were filled.
+ */
+static ssize_t chan_trysend_n_buf(struct chan *ch, void *const *data, size_t n)
 {
     if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
         errno = EPIPE;
@@ -147,120 +165,205 @@ static int chan_trysend_buf(struct chan *ch, void *data)
     }
 
     uint64_t tail, new_tail;
-    struct chan_item *item;
+    uint32_t pos;
+    size_t k;
 
     do {
         tail = atomic_load_explicit(&ch->tail, memory_order_acquire);
-        uint32_t pos = tail, lap = tail >> 32;
-        item = ch->ring + pos;
-
-        if (atomic_load_explicit(&item->lap, memory_order_acquire) != lap) {
+        pos = tail;
+        uint32_t lap = tail >> 32;
+        size_t max = ch->cap - pos < n ? ch->cap - pos : n;
+
+        for (k = 0; k < max; k++) {
+            if (atomic_load_explicit(&ch->ring[pos + k].lap,
+                                     memory_order_acquire) != lap)
+                break;
+        }
+        if (!k) {
             errno = EAGAIN;
             return -1;
         }
 
-        if (pos + 1 == ch->cap)
+        if (pos + k == ch->cap)
             new_tail = (uint64_t)(lap + 2) << 32;
         else
-            new_tail = tail + 1;
+            new_tail = tail + k;
     } while (!atomic_compare_exchange_weak_explicit(&ch->tail, &tail, new_tail,
                                                     memory_order_acq_rel,
                                                     memory_order_acquire));
 
-    item->data = data;
-    atomic_fetch_add_explicit(&item->lap, 1, memory_order_release);
+    for (size_t i = 0; i < k; i++) {
+        struct chan_item *item = ch->ring + pos + i;
+        item->data = data[i];
+        atomic_fetch_add_explicit(&item->lap, 1, memory_order_release);
+    }
 
-    return 0;
+    return k;
 }
 
-static int chan_send_buf(struct chan *ch, void *data)
+static int chan_trysend_buf(struct chan *ch, void *data)
 {
-    while (chan_trysend_buf(ch, data) == -1) {
-        if (errno != EAGAIN) return -1;
+    return chan_trysend_n_buf(ch, &data, 1) == -1 ? -1 : 0;
+}
 
-        uint32_t v = 1;
-        while (!atomic_compare_exchange_weak_explicit(&ch->send_ftx, &v, v - 1,
-                                                      memory_order_acq_rel,
-                                                      memory_order_acquire)) {
-            if (v == 0) {
-                atomic_fetch_add_explicit(&ch->send_waiters, 1,
-                                          memory_order_acq_rel);
-                futex_wait(&ch->send_ftx, 0);
-                atomic_fetch_sub_explicit(&ch->send_waiters, 1,
-                                          memory_order_acq_rel);
-                v = 1;
-            }
-        }
+/* The ring is lock-free, the futexes are only touched when it is full or
+ * empty. A waiter registers in the waiters count, then tries again before
+ * sleeping; the other side bumps the futex only when it sees a waiter. The
+ * seq_cst fences on both sides make sure that either the waiter sees the
+ * change, or its registration is seen.
+ */
+static void chan_wake_buf(struct chan *ch,
+                          _Atomic uint32_t *ftx,
+                          _Atomic size_t *waiters,
+                          size_t n)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(waiters, memory_order_relaxed) > 0) {
+        atomic_fetch_add_explicit(ftx, 1, memory_order_release);
+        futex_wake(ftx, n < INT_MAX ? n : INT_MAX);
     }
+    chan_wake_selectors(ch);
+}
 
-    atomic_fetch_add_explicit(&ch->recv_ftx, 1, memory_order_acq_rel);
+/* n items were sent, wake as many receivers at once */
+static void chan_sent_buf(struct chan *ch, size_t n)
+{
+    chan_wake_buf(ch, &ch->recv_ftx, &ch->recv_waiters, n);
+}
 
-    if (atomic_load_explicit(&ch->recv_waiters, memory_order_relaxed) > 0)
-        futex_wake(&ch->recv_ftx, 1);
+static ssize_t chan_send_n_buf(struct chan *ch, void *const *data, size_t n)
+{
+    ssize_t k;
 
-    return 0;
+    while ((k = chan_trysend_n_buf(ch, data, n)) == -1) {
+        if (errno != EAGAIN) return -1;
+
+        atomic_fetch_add_explicit(&ch->send_waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint32_t seq =
+            atomic_load_explicit(&ch->send_ftx, memory_order_acquire);
+        if ((k = chan_trysend_n_buf(ch, data, n)) != -1) {
+            atomic_fetch_sub_explicit(&ch->send_waiters, 1,
+                                      memory_order_relaxed);
+            break;
+        }
+        if (errno == EAGAIN) futex_wait(&ch->send_ftx, seq);
+        atomic_fetch_sub_explicit(&ch->send_waiters, 1, memory_order_relaxed);
+    }
+
+    chan_sent_buf(ch, k);
+    return k;
 }
 
-static int chan_tryrecv_buf(struct chan *ch, void **data)
+static int chan_send_buf(struct chan *ch, void *data)
 {
-    if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
-        errno = EPIPE;
-        return -1;
-    }
+    return chan_send_n_buf(ch, &data, 1) == -1 ? -1 : 0;
+}
 
+/* Claim up to n full slots in a row with a single CAS, as above. Items
+ * left in a closed channel are still received.
+ */
+static ssize_t chan_tryrecv_n_buf(struct chan *ch, void **data, size_t n)
+{
     uint64_t head, new_head;
-    struct chan_item *item;
+    uint32_t pos;
+    size_t k;
 
     do {
         head = atomic_load_explicit(&ch->head, memory_order_acquire);
-        uint32_t pos = head, lap = head >> 32;
-        item = ch->ring + pos;
-
-        if (atomic_load_explicit(&item->lap, memory_order_acquire) != lap) {
-            errno = EAGAIN;
+        pos = head;
+        uint32_t lap = head >> 32;
+        size_t max = ch->cap - pos < n ? ch->cap - pos : n;
+
+        for (k = 0; k < max; k++) {
+            if (atomic_load_explicit(&ch->ring[pos + k].lap,
+                                     memory_order_acquire) != lap)
+                break;
+        }
+        if (!k) {
+            if (atomic_load_explicit(&ch->closed, memory_order_relaxed))
+                errno = EPIPE;
+            else
+                errno = EAGAIN;
             return -1;
         }
 
-        if (pos + 1 == ch->cap)
+        if (pos + k == ch->cap)
             new_head = (uint64_t)(lap + 2) << 32;
         else
-            new_head = head + 1;
+            new_head = head + k;
     } while (!atomic_compare_exchange_weak_explicit(&ch->head, &head, new_head,
                                                     memory_order_acq_rel,
                                                     memory_order_acquire));
 
-    *data = item->data;
-    atomic_fetch_add_explicit(&item->lap, 1, memory_order_release);
+    for (size_t i = 0; i < k; i++) {
+        struct chan_item *item = ch->ring + pos + i;
+        data[i] = item->data;
+        atomic_fetch_add_explicit(&item->lap, 1, memory_order_release);
+    }
 
-    return 0;
+    return k;
 }
 
-static int chan_recv_buf(struct chan *ch, void **data)
+static int chan_tryrecv_buf(struct chan *ch, void **data)
 {
-    while (chan_tryrecv_buf(ch, data) == -1) {
+    return chan_tryrecv_n_buf(ch, data, 1) == -1 ? -1 : 0;
+}
+
+static void chan_received_buf(struct chan *ch, size_t n)
+{
+    chan_wake_buf(ch, &ch->send_ftx, &ch->send_waiters, n);
+}
+
+static ssize_t chan_recv_n_buf(struct chan *ch, void **data, size_t n)
+{
+    ssize_t k;
+
+    while ((k = chan_tryrecv_n_buf(ch, data, n)) == -1) {
         if (errno != EAGAIN) return -1;
 
-        uint32_t v = 1;
-        while (!atomic_compare_exchange_weak_explicit(&ch->recv_ftx, &v, v - 1,
-                                                      memory_order_acq_rel,
-                                                      memory_order_acquire)) {
-            if (v == 0) {
-                atomic_fetch_add_explicit(&ch->recv_waiters, 1,
-                                          memory_order_acq_rel);
-                futex_wait(&ch->recv_ftx, 0);
-                atomic_fetch_sub_explicit(&ch->recv_waiters, 1,
-                                          memory_order_acq_rel);
-                v = 1;
-            }
+        atomic_fetch_add_explicit(&ch->recv_waiters, 1, memory_order_relaxed);
+        atomic_thread_fence(memory_order_seq_cst);
+        uint32_t seq =
+            atomic_load_explicit(&ch->recv_ftx, memory_order_acquire);
+        if ((k = chan_tryrecv_n_buf(ch, data, n)) != -1) {
+            atomic_fetch_sub_explicit(&ch->recv_waiters, 1,
+                                      memory_order_relaxed);
+            break;
         }
+        if (errno == EAGAIN) futex_wait(&ch->recv_ftx, seq);
+        atomic_fetch_sub_explicit(&ch->recv_waiters, 1, memory_order_relaxed);
     }
 
-    atomic_fetch_add_explicit(&ch->send_ftx, 1, memory_order_acq_rel);
+    chan_received_buf(ch, k);
+    return k;
+}
 
-    if (atomic_load_explicit(&ch->send_waiters, memory_order_relaxed) > 0)
-        futex_wake(&ch->send_ftx, 1);
+static int chan_recv_buf(struct chan *ch, void **data)
+{
+    return chan_recv_n_buf(ch, data, 1) == -1 ? -1 : 0;
+}
 
-    return 0;
+/* Hand "data" over to the receiver waiting with "ptr" */
+static void chan_put_unbuf(struct chan *ch, void **ptr, void *data)
+{
+    *ptr = data;
+    atomic_store_explicit(&ch->datap, NULL, memory_order_release);
+
+    if (atomic_fetch_sub_explicit(&ch->recv_ftx, 1, memory_order_acquire) ==
+        CHAN_WAITING)
+        futex_wake(&ch->recv_ftx, 1);
+}
+
+/* Take the data from the sender waiting with "ptr" */
+static void chan_take_unbuf(struct chan *ch, void **ptr, void **data)
+{
+    *data = *ptr;
+    atomic_store_explicit(&ch->datap, NULL, memory_order_release);
+
+    if (atomic_fetch_sub_explicit(&ch->send_ftx, 1, memory_order_acquire) ==
+        CHAN_WAITING)
+        futex_wake(&ch->send_ftx, 1);
 }
 
 static int chan_send_unbuf(struct chan *ch, void *data)
@@ -271,18 +374,19 @@ static int chan_send_unbuf(struct chan *ch, void *data)
     }
 
     mutex_lock(&ch->send_mtx);
+    if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+        chan_unlock_unbuf(ch, &ch->send_mtx);
+        errno = EPIPE;
+        return -1;
+    }
 
     void **ptr = NULL;
     if (!atomic_compare_exchange_strong_explicit(&ch->datap, &ptr, &data,
                                                  memory_order_acq_rel,
                                                  memory_order_acquire)) {
-        *ptr = data;
-        atomic_store_explicit(&ch->datap, NULL, memory_order_release);
-
-        if (atomic_fetch_sub_explicit(&ch->recv_ftx, 1, memory_order_acquire) ==
-            CHAN_WAITING)
-            futex_wake(&ch->recv_ftx, 1);
+        chan_put_unbuf(ch, ptr, data);
     } else {
+        chan_notify_selectors(ch);
         if (atomic_fetch_add_explicit(&ch->send_ftx, 1, memory_order_acquire) ==
             CHAN_NOT_READY) {
             do {
@@ -291,13 +395,17 @@ static int chan_send_unbuf(struct chan *ch, void *data)
                          &ch->send_ftx, memory_order_acquire) == CHAN_WAITING);
 
             if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+                /* Withdraw, for the peers still waiting on the mutex */
+                ptr = &data;
+                atomic_compare_exchange_strong(&ch->datap, &ptr, NULL);
+                chan_unlock_unbuf(ch, &ch->send_mtx);
                 errno = EPIPE;
                 return -1;
             }
         }
     }
 
-    mutex_unlock(&ch->send_mtx);
+    chan_unlock_unbuf(ch, &ch->send_mtx);
     return 0;
 }
 
@@ -314,18 +422,19 @@ static int chan_recv_unbuf(struct chan *ch, void **data)
     }
 
     mutex_lock(&ch->recv_mtx);
+    if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+        chan_unlock_unbuf(ch, &ch->recv_mtx);
+        errno = EPIPE;
+        return -1;
+    }
 
     void **ptr = NULL;
     if (!atomic_compare_exchange_strong_explicit(&ch->datap, &ptr, data,
                                                  memory_order_acq_rel,
                                                  memory_order_acquire)) {
-        *data = *ptr;
-        atomic_store_explicit(&ch->datap, NULL, memory_order_release);
-
-        if (atomic_fetch_sub_explicit(&ch->send_ftx, 1, memory_order_acquire) ==
-            CHAN_WAITING)
-            futex_wake(&ch->send_ftx, 1);
+        chan_take_unbuf(ch, ptr, data);
     } else {
+        chan_notify_selectors(ch);
         if (atomic_fetch_add_explicit(&ch->recv_ftx, 1, memory_order_acquire) ==
             CHAN_NOT_READY) {
             do {
@@ -334,13 +443,68 @@ static int chan_recv_unbuf(struct chan *ch, void **data)
                          &ch->recv_ftx, memory_order_acquire) == CHAN_WAITING);
 
             if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+                /* Withdraw, for the peers still waiting on the mutex */
+                ptr = data;
+                atomic_compare_exchange_strong(&ch->datap, &ptr, NULL);
+                chan_unlock_unbuf(ch, &ch->recv_mtx);
                 errno = EPIPE;
                 return -1;
             }
         }
     }
 
-    mutex_unlock(&ch->recv_mtx);
+    chan_unlock_unbuf(ch, &ch->recv_mtx);
+    return 0;
+}
+
+/* Only succeed if a receiver is already waiting. The send mutex keeps the
+ * other senders away, so a pointer in datap can only be a receiver's.
+ */
+static int chan_trysend_unbuf(struct chan *ch, void *data)
+{
+    if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (!chan_trylock_unbuf(ch, &ch->send_mtx)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    void **ptr = atomic_load_explicit(&ch->datap, memory_order_acquire);
+    if (ptr)
+        chan_put_unbuf(ch, ptr, data);
+
+    chan_unlock_unbuf(ch, &ch->send_mtx);
+    if (!ptr) {
+        errno = EAGAIN;
+        return -1;
+    }
+    return 0;
+}
+
+static int chan_tryrecv_unbuf(struct chan *ch, void **data)
+{
+    if (atomic_load_explicit(&ch->closed, memory_order_relaxed)) {
+        errno = EPIPE;
+        return -1;
+    }
+
+    if (!chan_trylock_unbuf(ch, &ch->recv_mtx)) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    void **ptr = atomic_load_explicit(&ch->datap, memory_order_acquire);
+    if (ptr)
+        chan_take_unbuf(ch, ptr, data);
+
+    chan_unlock_unbuf(ch, &ch->recv_mtx);
+    if (!ptr) {
+        errno = EAGAIN;
+        return -1;
+    }
     return 0;
 }
 
@@ -350,9 +514,13 @@ void chan_close(struct chan *ch)
     if (!ch->cap) {
         atomic_store(&ch->recv_ftx, CHAN_CLOSED);
         atomic_store(&ch->send_ftx, CHAN_CLOSED);
+    } else {
+        atomic_fetch_add(&ch->recv_ftx, 1);
+        atomic_fetch_add(&ch->send_ftx, 1);
     }
     futex_wake(&ch->recv_ftx, INT_MAX);
     futex_wake(&ch->send_ftx, INT_MAX);
+    chan_notify_selectors(ch);
 }
 
 int chan_send(struct chan *ch, void *data)
@@ -365,11 +533,167 @@ int chan_recv(struct chan *ch, void **data)
     return !ch->cap ? chan_recv_unbuf(ch, data) : chan_recv_buf(ch, data);
 }
 
+/* Send all the n items, in runs claimed at once on buffered channels, each
+ * waking the receivers once. Return how many were sent before the channel
+ * was closed, or -1 if none.
+ */
+ssize_t chan_send_n(struct chan *ch, void *const *data, size_t n)
+{
+    size_t sent = 0;
+
+    while (sent < n) {
+        ssize_t k;
+        if (!ch->cap)
+            k = chan_send_unbuf(ch, data[sent]) == -1 ? -1 : 1;
+        else
+            k = chan_send_n_buf(ch, data + sent, n - sent);
+        if (k == -1)
+            return sent ? (ssize_t) sent : -1;
+        sent += k;
+    }
+    return sent;
+}
+
+/* Receive at least one item and up to n, whatever is ready in a row on
+ * buffered channels. Return how many, or -1 once the channel is closed and
+ * drained.
+ */
+ssize_t chan_recv_n(struct chan *ch, void **data, size_t n)
+{
+    if (!n) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!ch->cap)
+        return chan_recv_unbuf(ch, data) == -1 ? -1 : 1;
+    return chan_recv_n_buf(ch, data, n);
+}
+
+/* Receive into "data", a pointer type, until the channel is closed and the
+ * items left in it are received.
+ */
+#define chan_range(ch, data) while (chan_recv(ch, (void **) &(data)) == 0)
+
+enum {
+    CHAN_SEND,
+    CHAN_RECV,
+};
+
+struct chan_case {
+    struct chan *ch;
+    int op;     /* CHAN_SEND or CHAN_RECV */
+    void *data; /* the data to send, or the data received */
+};
+
+static int chan_try_case(struct chan_case *c)
+{
+    if (c->op == CHAN_SEND) {
+        if (!c->ch->cap)
+            return chan_trysend_unbuf(c->ch, c->data);
+        if (chan_trysend_buf(c->ch, c->data) == -1)
+            return -1;
+        chan_sent_buf(c->ch, 1);
+    } else {
+        if (!c->ch->cap)
+            return chan_tryrecv_unbuf(c->ch, &c->data);
+        if (chan_tryrecv_buf(c->ch, &c->data) == -1)
+            return -1;
+        chan_received_buf(c->ch, 1);
+    }
+    return 0;
+}
+
+/* Try the cases from a random one, so that none is starved. Return the index
+ * of the case done, or -1 with errno set, EPIPE if the channel of the case at
+ * *closed was closed.
+ */
+static int chan_try_cases(struct chan_case *cases, size_t n, size_t *closed)
+{
+    static _Thread_local uint32_t seed = 2463534242;
+
+    seed ^= seed << 13, seed ^= seed >> 17, seed ^= seed << 5;
+    for (size_t k = 0, i = seed % n; k < n; k++, i = (i + 1) % n) {
+        if (chan_try_case(&cases[i]) == 0)
+            return i;
+        if (errno == EPIPE) {
+            *closed = i;
+            return -1;
+        }
+    }
+    errno = EAGAIN;
+    return -1;
+}
+
+/* Do one of the n cases, whichever is ready first, and return its index.
+ * Without "block", behave as a default case: return -1 with errno set to
+ * EAGAIN if none of them is ready. A closed channel returns -1 with errno
+ * set to EPIPE, and the index of its case in *closed if not NULL.
+ *
+ * The caller parks on a single futex, registered with the channels of all
+ * the cases, which wake it on any change. On an unbuffered channel, a case
+ * only pairs with a peer blocked in chan_send() or chan_recv(), not with
+ * another chan_select().
+ */
+int chan_select(struct chan_case *cases, size_t n, bool block, size_t *closed)
+{
+    struct chan_sel sel = {.ftx = 0};
+    struct chan_sel_link links[n];
+    size_t dummy;
+    int ret;
+
+    if (!n) {
+        errno = EINVAL;
+        return -1;
+    }
+    if (!closed)
+        closed = &dummy;
+
+    if ((ret = chan_try_cases(cases, n, closed)) >= 0 || errno != EAGAIN ||
+        !block)
+        return ret;
+
+    for (size_t i = 0; i < n; i++) {
+        struct chan *ch = cases[i].ch;
+
+        links[i].sel = &sel;
+        mutex_lock(&ch->sel_mtx);
+        if ((links[i].next = ch->sel_list))
+            ch->sel_list->pprev = &links[i].next;
+        links[i].pprev = &ch->sel_list;
+        ch->sel_list = &links[i];
+        atomic_fetch_add(&ch->sel_count, 1);
+        mutex_unlock(&ch->sel_mtx);
+    }
+    /* Pairs with the fence in chan_notify_selectors() */
+    atomic_thread_fence(memory_order_seq_cst);
+
+    for (;;) {
+        uint32_t seq = atomic_load_explicit(&sel.ftx, memory_order_acquire);
+        if ((ret = chan_try_cases(cases, n, closed)) >= 0 || errno != EAGAIN)
+            break;
+        futex_wait(&sel.ftx, seq);
+    }
+
+    int saved = errno;
+    for (size_t i = 0; i < n; i++) {
+        struct chan *ch = cases[i].ch;
+
+        mutex_lock(&ch->sel_mtx);
+        if ((*links[i].pprev = links[i].next))
+            links[i].next->pprev = links[i].pprev;
+        atomic_fetch_sub(&ch->sel_count, 1);
+        mutex_unlock(&ch->sel_mtx);
+    }
+    errno = saved;
+    return ret;
+}
+
 #include <pthread.h>
 typedef void *(*thread_func_t)(void *);
 
 #include <assert.h>
 #include <err.h>
+#include <sched.h>
 #include <stdio.h>
 
 enum {
@@ -409,6 +733,51 @@ static void *reader(void *arg)
     return 0;
 }
 
+enum { BURST = 64 };
+
+static void *burst_writer(void *arg)
+{
+    struct thread_arg *a = arg;
+    void *burst[BURST];
+
+    for (size_t i = a->from; i < a->to;) {
+        size_t n = 0;
+        while (n < BURST && i < a->to)
+            burst[n++] = (void *) i++;
+        if (chan_send_n(a->ch, burst, n) != (ssize_t) n) break;
+    }
+    return 0;
+}
+
+static void *burst_reader(void *arg)
+{
+    struct thread_arg *a = arg;
+    size_t received = 0, expect = a->to - a->from;
+    void *burst[BURST];
+
+    while (received < expect) {
+        size_t want = expect - received < BURST ? expect - received : BURST;
+        ssize_t n = chan_recv_n(a->ch, burst, want);
+        if (n == -1) break;
+        for (ssize_t i = 0; i < n; i++)
+            atomic_fetch_add_explicit(&msg_count[(size_t) burst[i]], 1,
+                                      memory_order_relaxed);
+        received += n;
+    }
+    return 0;
+}
+
+static void *range_reader(void *arg)
+{
+    struct thread_arg *a = arg;
+    void *msg;
+
+    chan_range(a->ch, msg)
+        atomic_fetch_add_explicit(&msg_count[(size_t) msg], 1,
+                                  memory_order_relaxed);
+    return 0;
+}
+
 static void create_threads(const size_t n,
                            thread_func_t fn,
                            struct thread_arg *args,
@@ -474,10 +843,165 @@ static void test_chan(const size_t repeat,
     free(ch);
 }
 
+/* The readers range over the channel, which is closed with items left */
+static void test_range(const size_t repeat,
+                       const size_t cap,
+                       const size_t total,
+                       const size_t n_readers,
+                       const size_t n_writers)
+{
+    msg_total = total;
+    for (size_t rep = 0; rep < repeat; rep++) {
+        printf("range cap=%zu readers=%zu writers=%zu msgs=%zu ... %zu/%zu\n",
+               cap, n_readers, n_writers, msg_total, rep + 1, repeat);
+
+        struct chan *ch = chan_make(cap, malloc);
+        if (!ch) errx(1, "fail to create channel");
+
+        memset(msg_count, 0, sizeof(size_t) * msg_total);
+        create_threads(n_writers, burst_writer, writer_args, writer_tids, ch);
+        join_threads(n_writers, writer_tids);
+        create_threads(n_readers, range_reader, reader_args, reader_tids, ch);
+        chan_close(ch);
+        join_threads(n_readers, reader_tids);
+
+        for (size_t i = 0; i < msg_total; i++) assert(msg_count[i] == 1);
+        free(ch);
+    }
+}
+
+/* Fan-in: the writers, on every input, send with chan_send(), the readers
+ * wait on all the inputs with chan_select(). Fan-out: the reverse.
+ */
+#define N_INPUTS 3
+static const size_t input_caps[N_INPUTS] = {0, 1, 7};
+static struct chan *inputs[N_INPUTS];
+static _Atomic size_t msg_received;
+
+static void *select_reader(void *arg)
+{
+    struct thread_arg *a = arg;
+    struct chan_case cases[N_INPUTS];
+    size_t expect = a->to - a->from;
+
+    for (size_t i = 0; i < N_INPUTS; i++)
+        cases[i] = (struct chan_case){.ch = inputs[i], .op = CHAN_RECV};
+    for (size_t received = 0; received < expect; received++) {
+        int i = chan_select(cases, N_INPUTS, true, NULL);
+        if (i == -1)
+            break;
+        atomic_fetch_add_explicit(&msg_count[(size_t) cases[i].data], 1,
+                                  memory_order_relaxed);
+    }
+    return 0;
+}
+
+static void *input_writer(void *arg)
+{
+    struct thread_arg *a = arg;
+
+    for (size_t i = a->from; i < a->to; i++)
+        if (chan_send(inputs[i % N_INPUTS], (void *) i) == -1)
+            break;
+    return 0;
+}
+
+static void *select_writer(void *arg)
+{
+    struct thread_arg *a = arg;
+    struct chan_case cases[N_INPUTS];
+
+    for (size_t i = a->from; i < a->to; i++) {
+        for (size_t k = 0; k < N_INPUTS; k++)
+            cases[k] = (struct chan_case){
+                .ch = inputs[k], .op = CHAN_SEND, .data = (void *) i};
+        if (chan_select(cases, N_INPUTS, true, NULL) == -1)
+            break;
+    }
+    return 0;
+}
+
+static void *input_reader(void *arg)
+{
+    struct thread_arg *a = arg;
+    struct chan *ch = inputs[a->id % N_INPUTS];
+    size_t msg;
+
+    while (chan_recv(ch, (void **) &msg) != -1) {
+        atomic_fetch_add_explicit(&msg_count[msg], 1, memory_order_relaxed);
+        atomic_fetch_add(&msg_received, 1);
+    }
+    return 0;
+}
+
+static void test_select(const size_t repeat,
+                        const size_t total,
+                        const size_t n_readers,
+                        const size_t n_writers,
+                        bool fan_in)
+{
+    if (n_readers > THREAD_MAX || n_writers > THREAD_MAX)
+        errx(1, "too many threads to create");
+    if (total > MSG_MAX)
+        errx(1, "too many messages to send");
+
+    msg_total = total;
+    for (size_t rep = 0; rep < repeat; rep++) {
+        printf("select %s readers=%zu writers=%zu msgs=%zu ... %zu/%zu\n",
+               fan_in ? "fan-in" : "fan-out", n_readers, n_writers, msg_total,
+               rep + 1, repeat);
+
+        for (size_t i = 0; i < N_INPUTS; i++)
+            if (!(inputs[i] = chan_make(input_caps[i], malloc)))
+                errx(1, "fail to create channel");
+        memset(msg_count, 0, sizeof(size_t) * msg_total);
+        msg_received = 0;
+
+        create_threads(n_readers, fan_in ? select_reader : input_reader,
+                       reader_args, reader_tids, NULL);
+        create_threads(n_writers, fan_in ? input_writer : select_writer,
+                       writer_args, writer_tids, NULL);
+        if (fan_in) {
+            join_threads(n_readers, reader_tids);
+            join_threads(n_writers, writer_tids);
+        } else {
+            /* The readers stop once their channel is closed */
+            join_threads(n_writers, writer_tids);
+            while (atomic_load(&msg_received) < msg_total)
+                sched_yield();
+            for (size_t i = 0; i < N_INPUTS; i++)
+                chan_close(inputs[i]);
+            join_threads(n_readers, reader_tids);
+        }
+
+        for (size_t i = 0; i < msg_total; i++)
+            assert(msg_count[i] == 1);
+        for (size_t i = 0; i < N_INPUTS; i++)
+            free(inputs[i]);
+    }
+
+    /* The default case, with nothing to receive */
+    struct chan *ch = chan_make(1, malloc);
+    struct chan_case c = {.ch = ch, .op = CHAN_RECV};
+    if (!ch)
+        errx(1, "fail to create channel");
+    assert(chan_select(&c, 1, false, NULL) == -1 && errno == EAGAIN);
+    c.op = CHAN_SEND;
+    assert(chan_select(&c, 1, false, NULL) == 0);
+    assert(chan_select(&c, 1, false, NULL) == -1 && errno == EAGAIN);
+    chan_close(ch);
+    free(ch);
+}
+
 int main()
 {
     test_chan(50, 0, 500, 80, reader, 80, writer);
     test_chan(50, 7, 500, 80, reader, 80, writer);
+    test_chan(50, 7, 500, 8, burst_reader, 8, burst_writer);
+    test_chan(50, 100, 5000, 8, burst_reader, 8, burst_writer);
+    test_range(20, 1000, 1000, 4, 8);
+    test_select(20, 500, 4, 12, true);
+    test_select(20, 500, 12, 4, false);
 
     return 0;
 }
@@ -1,40 +1,73 @@
 #include "cmap.h"
 #include <stdbool.h>
 #include <stddef.h>
+#include <stdint.h>
 #include <stdlib.h>
 #include "locks.h"
 #include "util.h"
 
 #define MAP_INITIAL_SIZE 512
 
+/* Writers lock the stripe of the entry they modify, readers never lock */
+#define MAP_LOCK_STRIPES 64
+
+/* Entries of the old impl moved to the new one by each insert */
+#define MAP_MIGRATE_STEP 4
+
+/* Entries of the smaller impl walked by each cmap_scan */
+#define MAP_SCAN_STEP 64
+
 struct cmap_entry {
     struct cmap_node *first;
 };
 
+/* While expanding, the old and the new impl are both live: new->old points to
+ * old and old->successor to new. Entries of old are moved to new a few at a
+ * time by inserts, and lookups walk old before new.
+ */
 struct cmap_impl {
     struct cmap_entry *arr; /* Map entreis */
     size_t count;           /* Number of elements in this */
     size_t max;             /* Capacity of this */
     size_t utilization;     /* Number of utialized entries */
-    struct cond fence;      /* Prevent new reads while old still exist */
+    atomic_bool expanding;  /* Set by the writer expanding this */
+    struct spinlock locks[MAP_LOCK_STRIPES]; /* Serialize writers per entry */
+
+    struct cmap_impl *_Atomic old;       /* Impl being migrated to this */
+    struct cmap_impl *_Atomic successor; /* Impl this is migrated to */
+    struct cmap_retire *retire;          /* Release of "old" */
+    atomic_size_t migrate_next;          /* Next entry of "old" to move */
+    atomic_size_t migrated;              /* Entries of "old" moved */
 };
 
-struct cmap_impl_pair {
+/* The old impl is released once its migration is over and no reader or writer
+ * that started on it is left, whichever comes last.
+ */
+struct cmap_retire {
     struct cmap_impl *old, *new;
+    atomic_uint refs;
 };
 
-static void cmap_expand(struct cmap *cmap);
-static void cmap_expand_callback(void *args);
+static void cmap_expand(struct cmap *cmap,
+                        struct rcu *impl_rcu,
+                        size_t entry_num);
 static void cmap_destroy_callback(void *args);
 static size_t cmap_count__(const struct cmap *cmap);
-static void cmap_insert__(struct cmap_impl *, struct cmap_node *);
 
-/* Only a single concurrent writer to cmap is allowed */
-static void cmap_insert__(struct cmap_impl *impl, struct cmap_node *node)
+static inline struct spinlock *cmap_lock__(struct cmap_impl *impl, size_t i)
+{
+    return &impl->locks[i & (MAP_LOCK_STRIPES - 1)];
+}
+
+/* Link "node" first in its entry, with the stripe of the entry locked */
+static void cmap_link__(struct cmap_impl *impl, struct cmap_node *node)
 {
     size_t i = node->hash & impl->max;
-    node->next = impl->arr[i].first;
-    if (!impl->arr[i].first)
+    struct cmap_node *first = impl->arr[i].first;
+
+    /* "node" may be visible to readers already when migrating */
+    atomic_store(&node->next, first);
+    if (!first)
         atomic_fetch_add(&impl->utilization, 1);
     atomic_store(&impl->arr[i].first, node);
 }
@@ -42,7 +75,8 @@ static void cmap_insert__(struct cmap_impl *impl, struct cmap_node *node)
 static void cmap_destroy_callback(void *args)
 {
     struct cmap_impl *impl = (struct cmap_impl *) args;
-    cond_destroy(&impl->fence);
+    for (int i = 0; i < MAP_LOCK_STRIPES; ++i)
+        spinlock_destroy(&impl->locks[i]);
     free(impl);
 }
 
@@ -50,63 +84,122 @@ static struct cmap_impl *cmap_impl_init(size_t entry_num)
 {
     size_t size =
         sizeof(struct cmap_impl) + sizeof(struct cmap_entry) * entry_num;
-    struct cmap_impl *impl = xmalloc(size);
+    /* Zeroed pages come lazily from the kernel, expanding stays cheap for
+     * large maps
+     */
+    struct cmap_impl *impl = xzalloc(size);
     impl->max = entry_num - 1;
     impl->count = 0;
     impl->utilization = 0;
     impl->arr = OBJECT_END(struct cmap_entry *, impl);
-    cond_init(&impl->fence);
-
-    for (int i = 0; i < entry_num; ++i)
-        impl->arr[i].first = NULL;
+    atomic_init(&impl->expanding, false);
+    for (int i = 0; i < MAP_LOCK_STRIPES; ++i)
+        spinlock_init(&impl->locks[i]);
+
+    atomic_init(&impl->old, NULL);
+    atomic_init(&impl->successor, NULL);
+    impl->retire = NULL;
+    atomic_init(&impl->migrate_next, 0);
+    atomic_init(&impl->migrated, 0);
     return impl;
 }
 
-static void cmap_expand_callback(void *args)
+static void cmap_retire_callback(void *args)
 {
-    struct cmap_impl_pair *pair = (struct cmap_impl_pair *) args;
-    struct cmap_node *c, *n;
-
-    /* Rehash */
-    for (int i = 0; i <= pair->old->max; i++) {
-        for (c = pair->old->arr[i].first; c; c = n) {
-            n = c->next;
-            cmap_insert__(pair->new, c);
-        }
-    }
+    struct cmap_retire *retire = (struct cmap_retire *) args;
+    if (atomic_fetch_sub(&retire->refs, 1) != 1)
+        return;
 
-    /* Remove fence */
-    cond_unlock(&pair->new->fence);
-    free(pair->old);
-    free(pair);
+    /* Only now may new be expanded: until then, readers of old could reach
+     * new and then its successor, which would not wait for them
+     */
+    cmap_destroy_callback(retire->old);
+    atomic_store(&retire->new->expanding, false);
+    free(retire);
 }
 
-/* Only a single concurrent writer to cmap is allowed */
-static void cmap_expand(struct cmap *cmap)
+/* Move entry "i" of impl->old to impl. Its nodes are moved from the tail: the
+ * tail is linked first into impl, before being unlinked from old, so that
+ * readers walking old before impl see each node at least once.
+ */
+static void cmap_migrate_entry__(struct cmap_impl *impl,
+                                 struct cmap_impl *old,
+                                 size_t i)
 {
-    struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
-    struct cmap_impl_pair *pair = xmalloc(sizeof(*pair));
-    pair->old = rcu_get(impl_rcu, struct cmap_impl *);
-
-    /* Do not allow two expansions in parallel */
-    /* Prevent new reads while old still exist */
-    while (cond_is_locked(&pair->old->fence)) {
-        rcu_release(impl_rcu);
-        cond_wait(&pair->old->fence);
-        impl_rcu = rcu_acquire(cmap->impl->p);
-        pair->old = rcu_get(impl_rcu, struct cmap_impl *);
+    struct spinlock *old_lock = cmap_lock__(old, i);
+
+    spinlock_lock(old_lock);
+    while (old->arr[i].first) {
+        struct cmap_node **node_p = &old->arr[i].first;
+        while ((*node_p)->next)
+            node_p = &(*node_p)->next;
+
+        struct cmap_node *node = *node_p;
+        struct spinlock *lock = cmap_lock__(impl, node->hash & impl->max);
+        spinlock_lock(lock);
+        cmap_link__(impl, node);
+        spinlock_unlock(lock);
+        atomic_store(node_p, NULL);
+
+        atomic_fetch_sub(&old->count, 1);
+        atomic_fetch_add(&impl->count, 1);
     }
+    spinlock_unlock(old_lock);
+}
+
+/* Move up to "n" entries of impl->old. Whoever moves the last one detaches
+ * old from impl, and a new RCU pointer to impl makes sure that no reader
+ * still walks old when it is released.
+ */
+static void cmap_migrate__(struct cmap *cmap,
+                           struct rcu *impl_rcu,
+                           struct cmap_impl *impl,
+                           size_t n)
+{
+    struct cmap_impl *old = atomic_load(&impl->old);
+    if (!old)
+        return;
 
-    /* Initiate new rehash array */
-    pair->new = cmap_impl_init((pair->old->max + 1) * 2);
-    pair->new->count = pair->old->count;
+    for (size_t k = 0; k < n; k++) {
+        size_t i = atomic_fetch_add(&impl->migrate_next, 1);
+        if (i > old->max)
+            return;
+        cmap_migrate_entry__(impl, old, i);
+        if (atomic_fetch_add(&impl->migrated, 1) == old->max)
+            break;
+        if (k == n - 1)
+            return;
+    }
 
-    /* Prevent new reads/updates while old reads still exist */
-    cond_lock(&pair->new->fence);
+    atomic_store(&impl->old, NULL);
+    rcu_postpone(impl_rcu, cmap_retire_callback, impl->retire);
+    rcu_set(cmap->impl->p, impl);
+}
 
-    rcu_postpone(impl_rcu, cmap_expand_callback, pair);
-    rcu_release(impl_rcu);
-    rcu_set(cmap->impl->p, pair->new);
+/* Called by the writer that won impl->expanding, "entry_num" is the size of
+ * the new impl. The writers still holding impl after the swap see
+ * impl->successor and retry with the new impl.
+ */
+static void cmap_expand(struct cmap *cmap,
+                        struct rcu *impl_rcu,
+                        size_t entry_num)
+{
+    struct cmap_impl *old = rcu_get(impl_rcu, struct cmap_impl *);
+    struct cmap_impl *new = cmap_impl_init(entry_num);
+    struct cmap_retire *retire = xmalloc(sizeof(*retire));
+
+    retire->old = old;
+    retire->new = new;
+    atomic_init(&retire->refs, 2);
+
+    /* New is not expanded before old is released */
+    atomic_init(&new->expanding, true);
+    atomic_init(&new->old, old);
+    new->retire = retire;
+    atomic_store(&old->successor, new);
+
+    rcu_postpone(impl_rcu, cmap_retire_callback, retire);
+    rcu_set(cmap->impl->p, new);
 }
 
 void cmap_init(struct cmap *cmap)
@@ -121,8 +214,14 @@ void cmap_destroy(struct cmap *cmap)
     if (!cmap)
         return;
 
+    /* Finish a pending migration, which releases the old impl */
     struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
     struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
+    cmap_migrate__(cmap, impl_rcu, impl, SIZE_MAX);
+    rcu_release(impl_rcu);
+
+    impl_rcu = rcu_acquire(cmap->impl->p);
+    impl = rcu_get(impl_rcu, struct cmap_impl *);
     rcu_postpone(impl_rcu, cmap_destroy_callback, impl);
     rcu_release(impl_rcu);
     rcu_destroy(impl_rcu);
@@ -133,7 +232,12 @@ static size_t cmap_count__(const struct cmap *cmap)
 {
     struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
     struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
-    size_t count = impl->count;
+    struct cmap_impl *old = atomic_load(&impl->old);
+
+    /* Counts move along with nodes, only their sum is exact */
+    size_t count = atomic_load(&impl->count);
+    if (old)
+        count += atomic_load(&old->count);
     rcu_release(impl_rcu);
     return count;
 }
@@ -152,45 +256,176 @@ size_t cmap_size(const struct cmap *cmap)
     return cmap_count__(cmap);
 }
 
-/* Only one concurrent writer */
+/* Acquire the current impl, and lock the stripe of the entry of "hash". Retry
+ * when the impl was expanded meanwhile, as writes to it could be lost.
+ */
+static struct rcu *cmap_write_lock__(struct cmap *cmap,
+                                     uint32_t hash,
+                                     struct cmap_impl **impl_p,
+                                     struct spinlock **lock_p)
+{
+    while (true) {
+        struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
+        struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
+        struct spinlock *lock = cmap_lock__(impl, hash & impl->max);
+
+        spinlock_lock(lock);
+        if (!atomic_load(&impl->successor)) {
+            *impl_p = impl;
+            *lock_p = lock;
+            return impl_rcu;
+        }
+        spinlock_unlock(lock);
+        rcu_release(impl_rcu);
+    }
+}
+
+/* Any number of concurrent writers */
 size_t cmap_insert(struct cmap *cmap, struct cmap_node *node, uint32_t hash)
 {
+    struct cmap_impl *impl;
+    struct spinlock *lock;
     node->hash = hash;
 
-    struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
-    struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
-    cmap_insert__(impl, node);
-    impl->count++;
-    size_t count = impl->count;
-    bool expand = impl->count > impl->max * 2;
-    rcu_release(impl_rcu);
+    struct rcu *impl_rcu = cmap_write_lock__(cmap, hash, &impl, &lock);
+    cmap_link__(impl, node);
+    spinlock_unlock(lock);
+    size_t count = atomic_fetch_add(&impl->count, 1) + 1;
+
+    /* Amortize the migration of a pending expansion over inserts */
+    cmap_migrate__(cmap, impl_rcu, impl, MAP_MIGRATE_STEP);
+
+    /* A single writer expands, and not before the last expansion is over */
+    bool expected = false;
+    if (count > impl->max * 2 &&
+        atomic_compare_exchange_strong(&impl->expanding, &expected, true))
+        cmap_expand(cmap, impl_rcu, (impl->max + 1) * 2);
 
-    if (expand)
-        cmap_expand(cmap);
+    rcu_release(impl_rcu);
     return count;
 }
 
-/* Only one concurrent writer */
-size_t cmap_remove(struct cmap *cmap, struct cmap_node *node)
+/* The least number of entries, a power of two, holding "count" nodes without
+ * being expanded
+ */
+static size_t cmap_entries__(size_t count)
 {
-    struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
-    struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
-    size_t pos = node->hash & impl->max;
-    struct cmap_entry *cmap_entry = &impl->arr[pos];
-    size_t count = impl->count;
+    size_t entry_num = MAP_INITIAL_SIZE;
+    while (count > (entry_num - 1) * 2)
+        entry_num *= 2;
+    return entry_num;
+}
+
+size_t cmap_bulk_load(struct cmap *cmap,
+                      struct cmap_node *const nodes[],
+                      const uint32_t hashes[],
+                      size_t n)
+{
+    struct rcu *impl_rcu;
+    struct cmap_impl *impl;
+
+    /* Get an impl large enough for all of them first: a pending migration is
+     * finished at once, and a single expansion goes straight to the size
+     */
+    while (true) {
+        impl_rcu = rcu_acquire(cmap->impl->p);
+        impl = rcu_get(impl_rcu, struct cmap_impl *);
+
+        if (!atomic_load(&impl->successor)) {
+            if (atomic_load(&impl->old)) {
+                cmap_migrate__(cmap, impl_rcu, impl, SIZE_MAX);
+            } else {
+                size_t total = atomic_load(&impl->count) + n;
+                bool expected = false;
+                if (total <= impl->max * 2)
+                    break;
+                if (atomic_compare_exchange_strong(&impl->expanding,
+                                                   &expected, true))
+                    cmap_expand(cmap, impl_rcu, cmap_entries__(total));
+            }
+        }
+        rcu_release(impl_rcu);
+    }
 
-    struct cmap_node **node_p = &cmap_entry->first;
+    /* Counted at once, the impl does not need to expand for them */
+    size_t count = atomic_fetch_add(&impl->count, n) + n;
+    size_t i;
+    for (i = 0; i < n; i++) {
+        struct cmap_node *node = nodes[i];
+        node->hash = hashes[i];
+
+        struct spinlock *lock = cmap_lock__(impl, node->hash & impl->max);
+        spinlock_lock(lock);
+        if (atomic_load(&impl->successor)) {
+            spinlock_unlock(lock);
+            break;
+        }
+        cmap_link__(impl, node);
+        spinlock_unlock(lock);
+    }
+    if (i < n)
+        atomic_fetch_sub(&impl->count, n - i);
+    rcu_release(impl_rcu);
+
+    /* Other writers expanded it meanwhile, insert the rest one by one */
+    for (; i < n; i++)
+        count = cmap_insert(cmap, nodes[i], hashes[i]);
+    return count;
+}
+
+/* Unlink "node" from its entry of "impl", with the stripe of the entry locked */
+static bool cmap_unlink__(struct cmap_impl *impl, struct cmap_node *node)
+{
+    struct cmap_node **node_p = &impl->arr[node->hash & impl->max].first;
     while (*node_p) {
         if (*node_p == node) {
             atomic_store(node_p, node->next);
-            count--;
-            break;
+            atomic_fetch_sub(&impl->count, 1);
+            return true;
         }
         node_p = &(*node_p)->next;
     }
-    impl->count = count;
-    rcu_release(impl_rcu);
-    return count;
+    return false;
+}
+
+/* Any number of concurrent writers */
+size_t cmap_remove(struct cmap *cmap, struct cmap_node *node)
+{
+    while (true) {
+        struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
+        struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
+        struct cmap_impl *old = atomic_load(&impl->old);
+        struct spinlock *lock;
+        bool removed = false;
+
+        /* Nodes only move from the old impl to the new one, so look in the
+         * old impl before the new one
+         */
+        if (old) {
+            lock = cmap_lock__(old, node->hash & old->max);
+            spinlock_lock(lock);
+            removed = cmap_unlink__(old, node);
+            spinlock_unlock(lock);
+        }
+        if (!removed) {
+            lock = cmap_lock__(impl, node->hash & impl->max);
+            spinlock_lock(lock);
+            if (atomic_load(&impl->successor)) {
+                /* Expanded meanwhile, the node may have moved */
+                spinlock_unlock(lock);
+                rcu_release(impl_rcu);
+                continue;
+            }
+            cmap_unlink__(impl, node);
+            spinlock_unlock(lock);
+        }
+
+        size_t count = atomic_load(&impl->count);
+        if (old)
+            count += atomic_load(&old->count);
+        rcu_release(impl_rcu);
+        return count;
+    }
 }
 
 struct cmap_state cmap_state_acquire(struct cmap *cmap)
@@ -204,56 +439,69 @@ void cmap_state_release(struct cmap_state state)
     rcu_release(state.p);
 }
 
-struct cmap_cursor cmap_find__(struct cmap_state state, uint32_t hash)
+/* Lookups walk the impl being migrated from, then the impl migrated to */
+static struct cmap_cursor cmap_cursor_init__(struct cmap_state state,
+                                             uint32_t hash,
+                                             bool accross_entries)
 {
     struct cmap_impl *impl = rcu_get(state.p, struct cmap_impl *);
-
-    /* Prevent new reads while old still exist */
-    while (cond_is_locked(&impl->fence))
-        cond_wait(&impl->fence);
+    struct cmap_impl *old = atomic_load(&impl->old);
+    struct cmap_impl *first = old ? old : impl;
 
     struct cmap_cursor cursor = {
-        .entry_idx = hash & impl->max,
-        .node = atomic_load(&impl->arr[hash & impl->max].first),
+        .entry_idx = hash & first->max,
+        .node = atomic_load(&first->arr[hash & first->max].first),
         .next = NULL,
-        .accross_entries = false,
+        .accross_entries = accross_entries,
+        .impl = first,
+        .next_impl = old ? impl : atomic_load(&impl->successor),
+        .hash = hash,
     };
     if (cursor.node)
-        cursor.next = cursor.node->next;
+        cursor.next = atomic_load(&cursor.node->next);
+    else
+        cmap_next__(state, &cursor);
 
     return cursor;
 }
 
+struct cmap_cursor cmap_find__(struct cmap_state state, uint32_t hash)
+{
+    return cmap_cursor_init__(state, hash, false);
+}
+
 struct cmap_cursor cmap_start__(struct cmap_state state)
 {
-    struct cmap_cursor cursor = cmap_find__(state, 0);
-    cursor.accross_entries = true;
-    /* Don't start with an empty node */
-    if (!cursor.node)
-        cmap_next__(state, &cursor);
-    return cursor;
+    return cmap_cursor_init__(state, 0, true);
 }
 
 void cmap_next__(struct cmap_state state, struct cmap_cursor *cursor)
 {
-    struct cmap_impl *impl = rcu_get(state.p, struct cmap_impl *);
-
     cursor->node = cursor->next;
     if (cursor->node) {
-        cursor->next = cursor->node->next;
+        cursor->next = atomic_load(&cursor->node->next);
         return;
     }
 
     /* We got to the end of the current entry. Try to find
-     * a valid node in next entries
+     * a valid node in next entries, then in the next impl
      */
-    while (cursor->accross_entries) {
-        cursor->entry_idx++;
-        if (cursor->entry_idx > impl->max)
+    while (true) {
+        const struct cmap_impl *impl = cursor->impl;
+        if (cursor->accross_entries && cursor->entry_idx < impl->max) {
+            cursor->entry_idx++;
+        } else if (cursor->next_impl) {
+            impl = cursor->impl = cursor->next_impl;
+            cursor->next_impl = NULL;
+            cursor->entry_idx =
+                cursor->accross_entries ? 0 : cursor->hash & impl->max;
+        } else {
             break;
-        cursor->node = impl->arr[cursor->entry_idx].first;
+        }
+
+        cursor->node = atomic_load(&impl->arr[cursor->entry_idx].first);
         if (cursor->node) {
-            cursor->next = cursor->node->next;
+            cursor->next = atomic_load(&cursor->node->next);
             return;
         }
     }
@@ -261,3 +509,70 @@ void cmap_next__(struct cmap_state state, struct cmap_cursor *cursor)
     cursor->node = NULL;
     cursor->next = NULL;
 }
+
+/* Reverse the bits of "v" */
+static inline uint64_t cmap_rev__(uint64_t v)
+{
+    const uint64_t m1 = 0x5555555555555555ULL, m2 = 0x3333333333333333ULL,
+                   m4 = 0x0F0F0F0F0F0F0F0FULL;
+    v = ((v >> 1) & m1) | ((v & m1) << 1);
+    v = ((v >> 2) & m2) | ((v & m2) << 2);
+    v = ((v >> 4) & m4) | ((v & m4) << 4);
+    return __builtin_bswap64(v);
+}
+
+/* Next position after "pos" with the entries of "mask". Positions count up
+ * from the high bits of the mask, so that when the map doubles, the entries
+ * that entry "i" splits into, "i" and "i + max + 1", are both still ahead if
+ * "i" was, and both behind otherwise.
+ */
+static inline uint64_t cmap_scan_next__(uint64_t pos, uint64_t mask)
+{
+    return cmap_rev__(cmap_rev__(pos | ~mask) + 1);
+}
+
+static void cmap_scan_entry__(const struct cmap_impl *impl,
+                              size_t i,
+                              cmap_scan_fn fn,
+                              void *aux)
+{
+    struct cmap_node *node = atomic_load(&impl->arr[i].first);
+    while (node) {
+        /* "fn" may remove "node" */
+        struct cmap_node *next = atomic_load(&node->next);
+        fn(node, aux);
+        node = next;
+    }
+}
+
+/* While expanding, each entry of the smaller impl is walked before those of
+ * the larger one it splits into, as nodes are moved from the former to the
+ * latter. The successor is checked after walking the entry, so that nodes
+ * already moved out of it are not missed.
+ */
+uint64_t cmap_scan(struct cmap *cmap, uint64_t pos, cmap_scan_fn fn, void *aux)
+{
+    struct rcu *impl_rcu = rcu_acquire(cmap->impl->p);
+    struct cmap_impl *impl = rcu_get(impl_rcu, struct cmap_impl *);
+    struct cmap_impl *old = atomic_load(&impl->old);
+    const struct cmap_impl *small = old ? old : impl;
+
+    for (int k = 0; k < MAP_SCAN_STEP; k++) {
+        cmap_scan_entry__(small, pos & small->max, fn, aux);
+
+        const struct cmap_impl *large = atomic_load(&small->successor);
+        if (!large) {
+            pos = cmap_scan_next__(pos, small->max);
+        } else {
+            do {
+                cmap_scan_entry__(large, pos & large->max, fn, aux);
+                pos = cmap_scan_next__(pos, large->max);
+            } while (pos & (small->max ^ large->max));
+        }
+        if (!pos)
+            break;
+    }
+
+    rcu_release(impl_rcu);
+    return pos;
+}
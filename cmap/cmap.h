@@ -8,7 +8,8 @@
 #include "util.h"
 
 /* Concurrent cmap.
- * It supports multiple concurrent readers and a single concurrent writer.
+ * It supports multiple concurrent readers and writers. Readers never lock,
+ * writers serialize on a lock striped over the entries they modify.
  * To iterate, the user needs to acquire a "cmap state" (snapshot).
  */
 struct cmap_node {
@@ -22,6 +23,9 @@ struct cmap_cursor {
     struct cmap_node *next; /* Pointer to cmap_node */
     size_t entry_idx;       /* Current entry */
     bool accross_entries;   /* Hold cursor accross cmap entries */
+    const void *impl;       /* Map being walked */
+    const void *next_impl;  /* Map to walk next, while expanding */
+    uint32_t hash;          /* Hash looked up */
 };
 
 /* Map state (snapshot), must be acquired before cmap iteration, and released
@@ -48,6 +52,16 @@ double cmap_utilization(const struct cmap *cmap);
 size_t cmap_insert(struct cmap *, struct cmap_node *, uint32_t hash);
 size_t cmap_remove(struct cmap *, struct cmap_node *);
 
+/* Insert "n" nodes at once, "nodes[i]" with hash "hashes[i]", for rebuilding
+ * a large map. The map is sized for all of them up front, so it is expanded
+ * at most once and the inserts skip the expansion checks. Other writers may
+ * run meanwhile. Return the current count after the operation.
+ */
+size_t cmap_bulk_load(struct cmap *,
+                      struct cmap_node *const nodes[],
+                      const uint32_t hashes[],
+                      size_t n);
+
 /* Acquire/release cmap concurrent state. Use with iteration macros.
  * Each acquired state must be released. */
 struct cmap_state cmap_state_acquire(struct cmap *cmap);
@@ -71,6 +85,24 @@ void cmap_state_release(struct cmap_state state);
 #define MAP_FOREACH_WITH_HASH(NODE, MEMBER, HASH, STATE) \
     MAP_FOREACH__(NODE, MEMBER, MAP, cmap_find__(STATE, HASH), STATE)
 
+/* Resumable walk over the whole map, in steps of a few entries. Unlike a
+ * "cmap state", which is held for the whole iteration, each step is a
+ * read-side critical section of its own, so a long walk does not hold back
+ * the reclamation of expanded maps. Usage example:
+ *
+ * uint64_t pos = 0;
+ * do {
+ *     pos = cmap_scan(&cmap, pos, export_node, file);
+ * } while (pos);
+ *
+ * "fn" runs in the critical section and may remove the node it is given.
+ * Every node that is in the map over the whole walk is visited, possibly
+ * twice if the map expands meanwhile. Nodes inserted or removed during the
+ * walk may be visited or not.
+ */
+typedef void (*cmap_scan_fn)(struct cmap_node *, void *aux);
+uint64_t cmap_scan(struct cmap *, uint64_t pos, cmap_scan_fn fn, void *aux);
+
 /* Ieration, private methods. Use iteration macros instead */
 struct cmap_cursor cmap_start__(struct cmap_state state);
 struct cmap_cursor cmap_find__(struct cmap_state state, uint32_t hash);
@@ -80,8 +80,8 @@ static inline void spinlock_unlock(struct spinlock *spin)
     if (!spin)
         return;
     ASSERT(atomic_load(&spin->value) == 1);
-    atomic_store(&spin->value, 0);
     spin->where = NULL;
+    atomic_store(&spin->value, 0);
 }
 
 static inline void mutex_init(struct mutex *mutex)
@@ -1,5 +1,10 @@
+#include <linux/membarrier.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include "list.h"
 #include "locks.h"
@@ -12,13 +17,57 @@ struct rcu_cb {
     void *args;
 };
 
+static atomic_uint_fast64_t global_epoch = 0;
+
+/* Retired "struct rcu", oldest last. Retiring is as rare as rcu_set, so a
+ * single list is enough, readers only check whether it is empty.
+ */
+static pthread_mutex_t retired_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct rcu *retired = NULL;
+static atomic_uint retired_count = 0;
+
+/* Asymmetric barriers, as in ../thread-rcu: with membarrier(), the barrier
+ * of the readers entering a read-side critical section is left to the
+ * update-side, which forces one on every running thread after unpublishing.
+ * It is enabled before the first "struct rcu" exists, so that both sides
+ * agree on it.
+ */
+static atomic_bool rcu_has_membarrier;
+static pthread_once_t rcu_membarrier_once = PTHREAD_ONCE_INIT;
+
+static void rcu_membarrier_init(void)
+{
+    long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+                 0))
+        atomic_store_explicit(&rcu_has_membarrier, true, memory_order_release);
+}
+
+static inline void smp_mb_light(void)
+{
+    if (atomic_load_explicit(&rcu_has_membarrier, memory_order_relaxed))
+        __asm__ __volatile__("" ::: "memory");
+    else
+        atomic_thread_fence(memory_order_seq_cst);
+}
+
+static inline void smp_mb_heavy(void)
+{
+    if (atomic_load_explicit(&rcu_has_membarrier, memory_order_relaxed) &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+        return;
+    atomic_thread_fence(memory_order_seq_cst);
+}
+
 static inline struct rcu *rcu_allocate_new(void *val)
 {
     struct rcu *new_rcu = xmalloc(sizeof(*new_rcu));
     list_init(&new_rcu->cb_list);
     spinlock_init(&new_rcu->lock);
-    atomic_init(&new_rcu->counter, 1);
     new_rcu->ptr = val;
+    new_rcu->retired = NULL;
+    new_rcu->epoch = 0;
     return new_rcu;
 }
 
@@ -33,41 +82,278 @@ static void rcu_free(struct rcu *rcu)
     free(rcu);
 }
 
+#ifdef RCU_PERCPU
+
+/* Per-CPU flavor: rather than a record per thread, readers count their
+ * outermost rcu_acquire and rcu_release on the CPU they run on, in restartable
+ * sequences (see ../percpu), in the counters of the parity of the epoch they
+ * saw. rcu_advance sums them over the CPUs instead of walking the threads.
+ *
+ * Sums may be taken before the "struct rcu" is even retired, so the advance
+ * after it is not a grace period, and the two next ones make sure that the
+ * readers of both parities are gone: a third epoch is waited for.
+ */
+#include "../percpu/percpu.h"
+
+#define RCU_GRACE_EPOCHS 3
+#define RCU_LOCKS(parity) (parity)
+#define RCU_UNLOCKS(parity) (2 + (parity))
+
+static struct percpu rcu_readers;
+static __thread unsigned int rcu_nesting; /* Nested rcu_acquire calls */
+static __thread unsigned int rcu_parity;  /* Of the outermost one */
+
+/* The unlocks are summed first, as a reader counts its lock before its
+ * unlock, so the sums only match once every reader counted left.
+ */
+static bool rcu_readers_gone(unsigned int parity)
+{
+    uint64_t unlocks = percpu_sum(&rcu_readers, RCU_UNLOCKS(parity));
+    atomic_thread_fence(memory_order_seq_cst);
+    return percpu_sum(&rcu_readers, RCU_LOCKS(parity)) == unlocks;
+}
+
+/* Advance the global epoch if no reader is left from the one before. Return
+ * the global epoch.
+ */
+static uint64_t rcu_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    if (!rcu_readers_gone((epoch + 1) & 1))
+        return epoch;
+
+    /* A failed CAS means that another thread did advance it */
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        epoch++;
+    return epoch;
+}
+
+#else
+
+#define RCU_GRACE_EPOCHS 2
+
+/* Set in the local epoch of a thread inside a read-side critical section */
+#define RCU_ACTIVE (1ULL << 63)
+
+/* Per-thread reader state, on its own cache line */
+struct rcu_thread {
+    atomic_uint_fast64_t local_epoch; /* RCU_ACTIVE | epoch, or 0 outside */
+    unsigned int nesting;             /* Nested rcu_acquire calls */
+    atomic_bool in_use;               /* Owned by a live thread */
+    struct rcu_thread *next;
+} __attribute__((aligned(64)));
+
+/* Registered threads, records of exited threads are reused */
+static struct rcu_thread *_Atomic rcu_threads = NULL;
+
+static __thread struct rcu_thread *rcu_self = NULL;
+static pthread_key_t rcu_key;
+static pthread_once_t rcu_key_once = PTHREAD_ONCE_INIT;
+
+static void rcu_thread_exit(void *arg)
+{
+    struct rcu_thread *thread = (struct rcu_thread *) arg;
+    atomic_store_explicit(&thread->in_use, false, memory_order_release);
+}
+
+static void rcu_key_init(void)
+{
+    if (pthread_key_create(&rcu_key, rcu_thread_exit))
+        abort_msg("pthread_key_create fail");
+}
+
+static struct rcu_thread *rcu_thread_register(void)
+{
+    struct rcu_thread *thread;
+
+    pthread_once(&rcu_key_once, rcu_key_init);
+
+    /* Take over the record of an exited thread if there is one */
+    for (thread = atomic_load(&rcu_threads); thread; thread = thread->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&thread->in_use, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&thread->in_use, &expected, true))
+            goto out;
+    }
+
+    if (posix_memalign((void **) &thread, sizeof(*thread), sizeof(*thread)))
+        abort_msg("Out of memory");
+    atomic_init(&thread->local_epoch, 0);
+    thread->nesting = 0;
+    atomic_init(&thread->in_use, true);
+    thread->next = atomic_load(&rcu_threads);
+    while (!atomic_compare_exchange_weak(&rcu_threads, &thread->next, thread))
+        ;
+
+out:
+    pthread_setspecific(rcu_key, thread);
+    return rcu_self = thread;
+}
+
+/* Advance the global epoch if every thread inside a read-side critical
+ * section has seen the current one. Return the global epoch.
+ */
+static uint64_t rcu_advance(void)
+{
+    uint64_t epoch = atomic_load(&global_epoch);
+
+    for (struct rcu_thread *t = atomic_load(&rcu_threads); t; t = t->next) {
+        uint64_t local = atomic_load(&t->local_epoch);
+        if ((local & RCU_ACTIVE) && local != (epoch | RCU_ACTIVE))
+            return epoch;
+    }
+
+    /* A failed CAS means that another thread did advance it */
+    if (atomic_compare_exchange_strong(&global_epoch, &epoch, epoch + 1))
+        epoch++;
+    return epoch;
+}
+
+#endif /* RCU_PERCPU */
+
+/* Free retired "struct rcu" whose grace period is over. With "wait", keep
+ * going until none is left.
+ */
+static void rcu_reclaim(bool wait)
+{
+    if (wait)
+        pthread_mutex_lock(&retired_lock);
+    else if (pthread_mutex_trylock(&retired_lock))
+        return;
+
+    struct rcu *ready = NULL;
+    do {
+        uint64_t epoch = rcu_advance();
+
+        /* Retired later ones come first, cut the list at the first ready */
+        struct rcu **rcu_p = &retired;
+        while (*rcu_p && (*rcu_p)->epoch + RCU_GRACE_EPOCHS > epoch)
+            rcu_p = &(*rcu_p)->retired;
+        ready = *rcu_p;
+        *rcu_p = NULL;
+
+        /* Callbacks may retire more, do not hold the list meanwhile */
+        pthread_mutex_unlock(&retired_lock);
+        while (ready) {
+            struct rcu *next = ready->retired;
+            atomic_fetch_sub(&retired_count, 1);
+            rcu_free(ready);
+            ready = next;
+        }
+
+        if (!wait)
+            return;
+        sched_yield();
+        pthread_mutex_lock(&retired_lock);
+    } while (retired);
+    pthread_mutex_unlock(&retired_lock);
+}
+
+static void rcu_retire(struct rcu *rcu)
+{
+    /* "rcu" was unpublished before the epoch it is retired in is read. It is
+     * read with the list locked, which keeps the list sorted by epoch. Pairs
+     * with smp_mb_light() in rcu_acquire__.
+     */
+    smp_mb_heavy();
+    pthread_mutex_lock(&retired_lock);
+    rcu->epoch = atomic_load(&global_epoch);
+    rcu->retired = retired;
+    retired = rcu;
+    atomic_fetch_add(&retired_count, 1);
+    pthread_mutex_unlock(&retired_lock);
+}
+
 void rcu_init__(struct rcu **rcu_p, void *val)
 {
+    pthread_once(&rcu_membarrier_once, rcu_membarrier_init);
     struct rcu *new_rcu = rcu_allocate_new(val);
     atomic_init(rcu_p, new_rcu);
 }
 
+/* The caller makes sure that no reader is left, earlier retired ones are
+ * released first as their callbacks may still use what "rcu" points to.
+ */
 void rcu_destroy__(struct rcu *rcu)
 {
-    uint32_t counter = atomic_fetch_sub(&rcu->counter, 1);
-    ASSERT(counter == 1);
+    rcu_reclaim(true);
     rcu_free(rcu);
 }
 
+#ifdef RCU_PERCPU
+
+struct rcu *rcu_acquire__(struct rcu **rcu_p)
+{
+    if (!rcu_nesting++) {
+        rcu_parity = atomic_load_explicit(&global_epoch,
+                                          memory_order_relaxed) & 1;
+        percpu_add(&rcu_readers, RCU_LOCKS(rcu_parity), 1);
+
+        /* Count the reader before loading the pointer */
+        smp_mb_light();
+    }
+    return atomic_load_explicit(rcu_p, memory_order_acquire);
+}
+
+void rcu_release__(struct rcu *rcu)
+{
+    if (--rcu_nesting)
+        return;
+    atomic_thread_fence(memory_order_release);
+    percpu_add(&rcu_readers, RCU_UNLOCKS(rcu_parity), 1);
+
+    if (atomic_load_explicit(&retired_count, memory_order_relaxed))
+        rcu_reclaim(false);
+}
+
+#else
+
 struct rcu *rcu_acquire__(struct rcu **rcu_p)
 {
-    struct rcu *rcu = atomic_load(rcu_p);
-    atomic_fetch_add(&rcu->counter, 1);
-    return rcu;
+    struct rcu_thread *thread = rcu_self ? rcu_self : rcu_thread_register();
+
+    if (!thread->nesting++) {
+        uint64_t epoch = atomic_load_explicit(&global_epoch,
+                                              memory_order_relaxed);
+        atomic_store_explicit(&thread->local_epoch, epoch | RCU_ACTIVE,
+                              memory_order_relaxed);
+
+        /* Publish the epoch before loading the pointer */
+        smp_mb_light();
+    }
+    return atomic_load_explicit(rcu_p, memory_order_acquire);
 }
 
 void rcu_release__(struct rcu *rcu)
 {
-    uint32_t counter = atomic_fetch_sub(&rcu->counter, 1);
-    if (counter == 1)
-        rcu_free(rcu);
+    struct rcu_thread *thread = rcu_self;
+
+    if (--thread->nesting)
+        return;
+    atomic_store_explicit(&thread->local_epoch, 0, memory_order_release);
+
+    /* Readers help the grace periods along when something waits for them */
+    if (atomic_load_explicit(&retired_count, memory_order_relaxed))
+        rcu_reclaim(false);
 }
 
+#endif /* RCU_PERCPU */
+
 void rcu_set__(struct rcu **rcu_p, void *val)
 {
-    struct rcu *old_rcu = atomic_load(rcu_p);
     struct rcu *new_rcu = rcu_allocate_new(val);
-    atomic_store(rcu_p, new_rcu);
-    uint32_t counter = atomic_fetch_sub(&old_rcu->counter, 1);
-    if (counter == 1)
-        rcu_free(old_rcu);
+    struct rcu *old_rcu = atomic_exchange(rcu_p, new_rcu);
+    rcu_retire(old_rcu);
+    rcu_reclaim(false);
+}
+
+void rcu_set_and_wait__(struct rcu **rcu_p, void *val)
+{
+    struct rcu *new_rcu = rcu_allocate_new(val);
+    struct rcu *old_rcu = atomic_exchange(rcu_p, new_rcu);
+    rcu_retire(old_rcu);
+    rcu_reclaim(true);
 }
 
 void rcu_postpone__(struct rcu *rcu,
@@ -9,11 +9,19 @@
 /* Callback method for RCU type */
 typedef void (*rcu_callback_t)(void *);
 
+/* Read-side critical sections only touch per-thread state: a thread publishes
+ * the global epoch it observed on its outermost rcu_acquire, and clears it on
+ * the matching rcu_release. rcu_set retires the previous "struct rcu", whose
+ * callbacks run once the global epoch advanced twice, i.e. once every thread
+ * that could still hold it released it. Built with RCU_PERCPU, readers are
+ * counted per CPU instead, and it takes three advances.
+ */
 struct rcu {
     struct list cb_list;  /* Holds "struct rcu_cb" */
     struct spinlock lock; /* Locks on "cb_list" */
     void *ptr;            /* Pointer to data */
-    atomic_uint counter;  /* Number of active pointers to this */
+    struct rcu *retired;  /* Next retired, waiting for a grace period */
+    uint64_t epoch;       /* Global epoch when retired */
 };
 
 /* Initiate VAR to VAL */
@@ -13,6 +13,7 @@
 
 #define DEFAULT_SECONDS 5
 #define DEFAULT_READERS 3
+#define DEFAULT_WRITERS 1
 
 struct elem {
     struct cmap_node node;
@@ -20,7 +21,7 @@ struct elem {
     struct elem *next;
 };
 
-static struct elem *freelist = NULL;
+static struct elem *_Atomic freelist = NULL;
 static size_t num_values;
 static uint32_t max_value;
 static uint32_t *values;
@@ -30,8 +31,10 @@ static volatile bool running;
 static volatile bool error;
 
 static atomic_size_t checks;
+static atomic_size_t scans;
 static volatile uint32_t inserts;
 static volatile uint32_t removes;
+static uint32_t writers;
 
 /* Insert new value to cmap */
 static void insert_value(uint32_t value)
@@ -55,11 +58,19 @@ static void initiate_values(uint32_t seed)
     values = xmalloc(sizeof(*values) * num_values);
     cmap_init(&cmap_values);
     atomic_init(&checks, 0);
+    atomic_init(&scans, 0);
 
+    struct cmap_node **nodes = xmalloc(sizeof(*nodes) * num_values);
+    uint32_t *hashes = xmalloc(sizeof(*hashes) * num_values);
     for (int i = 0; i < num_values; i++) {
-        values[i] = random_uint32() & max_value;
-        insert_value(values[i]);
+        struct elem *elem = xmalloc(sizeof(*elem));
+        elem->value = values[i] = random_uint32() & max_value;
+        nodes[i] = &elem->node;
+        hashes[i] = hash_int(elem->value, hash_base);
     }
+    cmap_bulk_load(&cmap_values, nodes, hashes, num_values);
+    free(nodes);
+    free(hashes);
 }
 
 /* Destroy all static variables */
@@ -110,15 +121,22 @@ static inline void wait()
     usleep(1);
 }
 
-/* Constantly writes and removes values from cmap */
+/* Constantly writes and removes values from cmap. Each writer only removes
+ * the values it inserted, which are congruent to its id modulo "writers".
+ */
 static void *update_cmap(void *args)
 {
+    uint32_t id = (uintptr_t) args;
     struct elem *elem;
     struct cmap_state cmap_state;
 
+    random_set_seed(id + 1);
     while (atomic_load_explicit(&running, memory_order_relaxed)) {
         /* Insert */
         uint32_t value = random_uint32() + max_value + 1;
+        value = value - value % writers + id;
+        if (value <= max_value)
+            continue;
         insert_value(value);
         atomic_fetch_add_explicit(&inserts, 1, memory_order_relaxed);
         wait();
@@ -127,7 +145,7 @@ static void *update_cmap(void *args)
         uint32_t hash = hash_int(random_uint32(), hash_base);
         cmap_state = cmap_state_acquire(&cmap_values);
         MAP_FOREACH_WITH_HASH (elem, node, hash, cmap_state) {
-            if (elem->value > max_value) {
+            if (elem->value > max_value && elem->value % writers == id) {
                 cmap_remove(&cmap_values, &elem->node);
                 /* FIXME: If we free 'elem' directly, it may lead to
                  * use-after-free when the reader thread obtains it. To deal
@@ -137,8 +155,10 @@ static void *update_cmap(void *args)
                  * We should consider better strategy like reference counting or
                  * hazard pointer, which allow us to free each chunk of memory
                  * at the correct time */
-                elem->next = freelist;
-                freelist = elem;
+                elem->next = atomic_load(&freelist);
+                while (!atomic_compare_exchange_weak(&freelist, &elem->next,
+                                                     elem))
+                    ;
                 atomic_fetch_add_explicit(&removes, 1, memory_order_relaxed);
                 break;
             }
@@ -149,6 +169,81 @@ static void *update_cmap(void *args)
     return NULL;
 }
 
+static void mark_value(struct cmap_node *node, void *aux)
+{
+    struct elem *elem;
+    INIT_CONTAINER(elem, node, node);
+    if (elem->value <= max_value)
+        ((bool *) aux)[elem->value] = true;
+}
+
+/* Constantly walk the whole cmap, which must go past every initial value
+ * while the writers insert and remove others, and expand it
+ */
+static void *scan_cmap(void *args)
+{
+    bool *seen = xmalloc(sizeof(*seen) * (max_value + 1));
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        uint64_t pos = 0;
+        memset(seen, 0, sizeof(*seen) * (max_value + 1));
+        do {
+            pos = cmap_scan(&cmap_values, pos, mark_value, seen);
+        } while (pos);
+
+        for (int i = 0; i < num_values; i++) {
+            if (!seen[values[i]]) {
+                atomic_store_explicit(&running, false, memory_order_relaxed);
+                atomic_store_explicit(&error, true, memory_order_relaxed);
+                break;
+            }
+        }
+        atomic_fetch_add(&scans, 1);
+        wait();
+    }
+    free(seen);
+    return NULL;
+}
+
+static void count_node(struct cmap_node *node, void *aux)
+{
+    ++*(size_t *) aux;
+}
+
+/* A large map loaded at once is sized up front, and a walk over it without
+ * concurrent writers sees each node once
+ */
+static bool check_bulk_load(size_t n)
+{
+    struct cmap cmap;
+    struct elem *elems = xmalloc(sizeof(*elems) * n);
+    struct cmap_node **nodes = xmalloc(sizeof(*nodes) * n);
+    uint32_t *hashes = xmalloc(sizeof(*hashes) * n);
+    size_t visited = 0;
+    uint64_t pos = 0;
+
+    cmap_init(&cmap);
+    for (size_t i = 0; i < n; i++) {
+        elems[i].value = i;
+        nodes[i] = &elems[i].node;
+        hashes[i] = hash_int(i, 0);
+    }
+    bool ok = cmap_bulk_load(&cmap, nodes, hashes, n / 2) == n / 2 &&
+              cmap_bulk_load(&cmap, nodes + n / 2, hashes + n / 2,
+                             n - n / 2) == n &&
+              cmap_size(&cmap) == n && cmap_utilization(&cmap) > 0.5;
+    do {
+        pos = cmap_scan(&cmap, pos, count_node, &visited);
+    } while (pos);
+    ok = ok && visited == n;
+
+    cmap_destroy(&cmap);
+    free(elems);
+    free(nodes);
+    free(hashes);
+    return ok;
+}
+
 /* Constantly check whever values in cmap can be composed */
 static void *read_cmap(void *args)
 {
@@ -179,33 +274,43 @@ int main(int argc, char **argv)
         if (!strcmp("--help", argv[i]) || !strcmp("-h", argv[i])) {
             printf(
                 "Tests performance and correctness of cmap.\n"
-                "Usage: %s [SECONDS] [READERS]\n"
-                "Defaults: %d seconds, %d reader threads.\n",
-                argv[0], DEFAULT_SECONDS, DEFAULT_READERS);
+                "Usage: %s [SECONDS] [READERS] [WRITERS]\n"
+                "Defaults: %d seconds, %d reader threads, %d writer threads.\n",
+                argv[0], DEFAULT_SECONDS, DEFAULT_READERS, DEFAULT_WRITERS);
             exit(1);
         }
     }
 
     int seconds = argc >= 2 ? atoi(argv[1]) : DEFAULT_SECONDS;
     int readers = argc >= 3 ? atoi(argv[2]) : DEFAULT_READERS;
+    writers = argc >= 4 ? atoi(argv[3]) : DEFAULT_WRITERS;
+    if (writers < 1)
+        writers = 1;
+
+    if (!check_bulk_load(1 << 20)) {
+        printf("Error: bulk load\n");
+        return 1;
+    }
 
     /* Initiate */
     initiate_values(1);
-    pthread_t *threads = xmalloc(sizeof(*threads) * (readers + 1));
+    pthread_t *threads = xmalloc(sizeof(*threads) * (readers + writers + 1));
 
     /* Start threads */
     for (int i = 0; i < readers; ++i)
         pthread_create(&threads[i], NULL, read_cmap, NULL);
-    pthread_create(&threads[readers], NULL, update_cmap, NULL);
+    for (uintptr_t i = 0; i < writers; ++i)
+        pthread_create(&threads[readers + i], NULL, update_cmap, (void *) i);
+    pthread_create(&threads[readers + writers], NULL, scan_cmap, NULL);
 
     /* Print stats to user */
     size_t dst = get_time_ns() + 1e9 * seconds;
     while (get_time_ns() < dst) {
         size_t current_checks = atomic_load(&checks);
         printf(
-            "#checks: %u, #inserts: %u, #removes: %u, "
+            "#checks: %u, #scans: %u, #inserts: %u, #removes: %u, "
             "cmap elements: %u, utilization: %.2lf \n",
-            (uint32_t) current_checks,
+            (uint32_t) current_checks, (uint32_t) atomic_load(&scans),
             atomic_load_explicit(&inserts, memory_order_relaxed),
             atomic_load_explicit(&removes, memory_order_relaxed),
             (uint32_t) cmap_size(&cmap_values), cmap_utilization(&cmap_values));
@@ -214,7 +319,7 @@ int main(int argc, char **argv)
 
     /* Stop threads */
     atomic_store_explicit(&running, false, memory_order_relaxed);
-    for (int i = 0; i <= readers; ++i)
+    for (int i = 0; i < readers + writers + 1; ++i)
         pthread_join(threads[i], NULL);
 
     /* Delete memory */
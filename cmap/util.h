@@ -147,3 +147,11 @@ static inline void *xmalloc(size_t size)
         abort_msg("Out of memory");
     return p;
 }
+
+static inline void *xzalloc(size_t size)
+{
+    void *p = calloc(1, size ? size : 1);
+    if (!p)
+        abort_msg("Out of memory");
+    return p;
+}
@@ -0,0 +1,136 @@
+#include <stdint.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "context.h"
+
+#if defined(__x86_64__)
+/* rbx, rbp and r12-r15 are callee-saved. A new context pops the entry and its
+ * argument into r12 and r13, then returns into the trampoline.
+ */
+#define CONTEXT_FRAME_WORDS 7
+#define CONTEXT_ENTRY 3
+#define CONTEXT_ARG 2
+#define CONTEXT_RET 6
+
+__asm__(
+    ".text\n"
+    ".globl context_switch\n"
+    ".type context_switch, @function\n"
+    "context_switch:\n"
+    "    pushq %rbp\n"
+    "    pushq %rbx\n"
+    "    pushq %r12\n"
+    "    pushq %r13\n"
+    "    pushq %r14\n"
+    "    pushq %r15\n"
+    "    movq %rsp, (%rdi)\n"
+    "    movq (%rsi), %rsp\n"
+    "    popq %r15\n"
+    "    popq %r14\n"
+    "    popq %r13\n"
+    "    popq %r12\n"
+    "    popq %rbx\n"
+    "    popq %rbp\n"
+    "    ret\n"
+    ".size context_switch, .-context_switch\n"
+    "context_trampoline:\n"
+    "    movq %r13, %rdi\n"
+    "    callq *%r12\n"
+    "    ud2\n");
+#elif defined(__aarch64__)
+/* x19-x29, the link register x30 and the low halves of v8-v15 are
+ * callee-saved. A new context loads the entry and its argument into x19 and
+ * x20, then returns into the trampoline.
+ */
+#define CONTEXT_FRAME_WORDS 20
+#define CONTEXT_ENTRY 0
+#define CONTEXT_ARG 1
+#define CONTEXT_RET 11
+
+__asm__(
+    ".text\n"
+    ".globl context_switch\n"
+    ".type context_switch, %function\n"
+    "context_switch:\n"
+    "    sub sp, sp, #160\n"
+    "    stp x19, x20, [sp, #0]\n"
+    "    stp x21, x22, [sp, #16]\n"
+    "    stp x23, x24, [sp, #32]\n"
+    "    stp x25, x26, [sp, #48]\n"
+    "    stp x27, x28, [sp, #64]\n"
+    "    stp x29, x30, [sp, #80]\n"
+    "    stp d8, d9, [sp, #96]\n"
+    "    stp d10, d11, [sp, #112]\n"
+    "    stp d12, d13, [sp, #128]\n"
+    "    stp d14, d15, [sp, #144]\n"
+    "    mov x9, sp\n"
+    "    str x9, [x0]\n"
+    "    ldr x9, [x1]\n"
+    "    mov sp, x9\n"
+    "    ldp x19, x20, [sp, #0]\n"
+    "    ldp x21, x22, [sp, #16]\n"
+    "    ldp x23, x24, [sp, #32]\n"
+    "    ldp x25, x26, [sp, #48]\n"
+    "    ldp x27, x28, [sp, #64]\n"
+    "    ldp x29, x30, [sp, #80]\n"
+    "    ldp d8, d9, [sp, #96]\n"
+    "    ldp d10, d11, [sp, #112]\n"
+    "    ldp d12, d13, [sp, #128]\n"
+    "    ldp d14, d15, [sp, #144]\n"
+    "    add sp, sp, #160\n"
+    "    ret\n"
+    ".size context_switch, .-context_switch\n"
+    "context_trampoline:\n"
+    "    mov x0, x20\n"
+    "    blr x19\n"
+    "    brk #0\n");
+#else
+#error "context_switch is only implemented for x86-64 and AArch64"
+#endif
+
+extern char context_trampoline[];
+
+void context_init(context_t *ctx,
+                  void *stack,
+                  size_t size,
+                  void (*entry)(void *),
+                  void *arg)
+{
+    /* The stack is 16-byte aligned once the frame is popped */
+    uintptr_t top = ((uintptr_t) stack + size) & ~(uintptr_t) 15;
+    void **frame = (void **) top - CONTEXT_FRAME_WORDS;
+
+    for (int i = 0; i < CONTEXT_FRAME_WORDS; i++)
+        frame[i] = NULL;
+    frame[CONTEXT_ENTRY] = (void *) entry;
+    frame[CONTEXT_ARG] = arg;
+    frame[CONTEXT_RET] = context_trampoline;
+    ctx->sp = frame;
+}
+
+int coro_stack_alloc(struct coro_stack *stack, size_t size)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    size = (size + page - 1) & ~(page - 1);
+    char *map = mmap(NULL, size + page, PROT_READ | PROT_WRITE,
+                     MAP_PRIVATE | MAP_ANONYMOUS | MAP_STACK, -1, 0);
+    if (map == MAP_FAILED)
+        return -1;
+    if (mprotect(map, page, PROT_NONE)) {
+        munmap(map, size + page);
+        return -1;
+    }
+    stack->base = map + page;
+    stack->size = size;
+    return 0;
+}
+
+void coro_stack_free(struct coro_stack *stack)
+{
+    size_t page = sysconf(_SC_PAGESIZE);
+
+    munmap((char *) stack->base - page, stack->size + page);
+    stack->base = NULL;
+}
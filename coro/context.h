@@ -0,0 +1,37 @@
+/* Minimal context switch for coroutines on their own stacks */
+
+#pragma once
+
+#include <stddef.h>
+
+/* A suspended context is its stack pointer, with its callee-saved registers
+ * pushed on its stack. The caller-saved ones are spilled by the compiler
+ * around the call to context_switch(), as for any other function.
+ */
+typedef struct {
+    void *sp;
+} context_t;
+
+/* Save the current context into "from" and resume "to" */
+void context_switch(context_t *from, context_t *to);
+
+/* Make "ctx" start entry(arg) on the stack [stack, stack + size) when it is
+ * first switched to. The entry must never return, it switches away for good.
+ */
+void context_init(context_t *ctx,
+                  void *stack,
+                  size_t size,
+                  void (*entry)(void *),
+                  void *arg);
+
+/* A stack mapped with a guard page below it, so that an overflow faults
+ * instead of running into other memory.
+ */
+struct coro_stack {
+    void *base; /* of the usable part, above the guard page */
+    size_t size;
+};
+
+/* Return 0, or -1 with errno set */
+int coro_stack_alloc(struct coro_stack *stack, size_t size);
+void coro_stack_free(struct coro_stack *stack);
@@ -1,18 +1,27 @@
-/* Implementing coroutines with setjmp/longjmp */
+/* Implementing coroutines with a context switch and a stack per task */
+
+#define _GNU_SOURCE
 
-#include <setjmp.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <time.h>
+
+#include "context.h"
 #include "list.h"
 
+#define TASK_STACK (64 * 1024)
+
 struct task {
-    jmp_buf env;
+    context_t ctx;
+    struct coro_stack stack;
     struct list_head list;
+    void (*fn)(void *);
     char task_name[10];
     int n;
     int i;
+    int done;
 };
 
 struct arg {
@@ -22,10 +31,7 @@ struct arg {
 };
 
 static LIST_HEAD(tasklist);
-static void (**tasks)(void *);
-static struct arg *args;
-static int ntasks;
-static jmp_buf sched;
+static context_t sched;
 static struct task *cur_task;
 
 static void task_add(struct task *task)
@@ -33,29 +39,60 @@ static void task_add(struct task *task)
     list_add_tail(&task->list, &tasklist);
 }
 
-static void task_switch()
+/* Go back to the scheduler, which resumes the next task */
+static void task_switch(void)
 {
-    if (!list_empty(&tasklist)) {
-        struct task *t = list_first_entry(&tasklist, struct task, list);
-        list_del(&t->list);
-        cur_task = t;
-        longjmp(t->env, 1);
-    }
+    context_switch(&cur_task->ctx, &sched);
 }
 
-void schedule(void)
+static void task_yield(void)
+{
+    task_add(cur_task);
+    task_switch();
+}
+
+static void task_entry(void *arg)
 {
-    static int i;
+    struct task *task = arg;
 
-    setjmp(sched);
+    task->fn(task);
+    task->done = 1;
+    task_switch();
+}
 
-    while (ntasks-- > 0) {
-        struct arg arg = args[i];
-        tasks[i++](&arg);
-        printf("Never reached\n");
+static struct task *task_create(void (*fn)(void *), const struct arg *arg)
+{
+    struct task *task = malloc(sizeof(struct task));
+    if (!task)
+        return NULL;
+    if (coro_stack_alloc(&task->stack, TASK_STACK)) {
+        free(task);
+        return NULL;
     }
+    context_init(&task->ctx, task->stack.base, task->stack.size, task_entry,
+                 task);
+    task->fn = fn;
+    snprintf(task->task_name, sizeof(task->task_name), "%s", arg->task_name);
+    task->n = arg->n;
+    task->i = arg->i;
+    task->done = 0;
+    INIT_LIST_HEAD(&task->list);
+    return task;
+}
 
-    task_switch();
+/* Run the tasks round robin until all of them are complete */
+void schedule(void)
+{
+    while (!list_empty(&tasklist)) {
+        struct task *t = list_first_entry(&tasklist, struct task, list);
+        list_del(&t->list);
+        cur_task = t;
+        context_switch(&sched, &t->ctx);
+        if (t->done) {
+            coro_stack_free(&t->stack);
+            free(t);
+        }
+    }
 }
 
 static long long fib_sequence(long long k)
@@ -77,65 +114,66 @@ static long long fib_sequence(long long k)
 
 void task0(void *arg)
 {
-    struct task *task = malloc(sizeof(struct task));
-    strcpy(task->task_name, ((struct arg *) arg)->task_name);
-    task->n = ((struct arg *) arg)->n;
-    task->i = ((struct arg *) arg)->i;
-    INIT_LIST_HEAD(&task->list);
+    struct task *task = arg;
 
     printf("%s: n = %d\n", task->task_name, task->n);
-
-    if (setjmp(task->env) == 0) {
-        task_add(task);
-        longjmp(sched, 1);
-    }
-
-    task = cur_task;
+    task_yield();
 
     for (; task->i < task->n; task->i += 2) {
-        if (setjmp(task->env) == 0) {
-            long long res = fib_sequence(task->i);
-            printf("%s fib(%d) = %lld\n", task->task_name, task->i, res);
-            task_add(task);
-            task_switch();
-        }
-        task = cur_task;
+        long long res = fib_sequence(task->i);
+        printf("%s fib(%d) = %lld\n", task->task_name, task->i, res);
+        task_yield();
         printf("%s: resume\n", task->task_name);
     }
 
     printf("%s: complete\n", task->task_name);
-    longjmp(sched, 1);
 }
 
 void task1(void *arg)
 {
-    struct task *task = malloc(sizeof(struct task));
-    strcpy(task->task_name, ((struct arg *) arg)->task_name);
-    task->n = ((struct arg *) arg)->n;
-    task->i = ((struct arg *) arg)->i;
-    INIT_LIST_HEAD(&task->list);
+    struct task *task = arg;
 
     printf("%s: n = %d\n", task->task_name, task->n);
-
-    if (setjmp(task->env) == 0) {
-        task_add(task);
-        longjmp(sched, 1);
-    }
-
-    task = cur_task;
+    task_yield();
 
     for (; task->i < task->n; task->i++) {
-        if (setjmp(task->env) == 0) {
-            printf("%s %d\n", task->task_name, task->i);
-            task_add(task);
-            task_switch();
-        }
-        task = cur_task;
+        printf("%s %d\n", task->task_name, task->i);
+        task_yield();
         printf("%s: resume\n", task->task_name);
     }
 
     printf("%s: complete\n", task->task_name);
-    longjmp(sched, 1);
+}
+
+#define N_SWITCHES 1000000
+
+static void bench_task(void *arg)
+{
+    (void) arg;
+    while (1)
+        task_switch();
+}
+
+/* Time round trips between the scheduler and a task */
+static void bench_switch(void)
+{
+    struct arg arg = {.task_name = "bench"};
+    struct task *task = task_create(bench_task, &arg);
+    struct timespec start, end;
+
+    if (!task)
+        return;
+    cur_task = task;
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < N_SWITCHES; i++)
+        context_switch(&sched, &task->ctx);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    double ns = (end.tv_sec - start.tv_sec) * 1e9 + end.tv_nsec - start.tv_nsec;
+    printf("%d switches: %.1f ns each\n", 2 * N_SWITCHES,
+           ns / (2 * N_SWITCHES));
+    coro_stack_free(&task->stack);
+    free(task);
 }
 
 #define ARRAY_SIZE(arr) (sizeof(arr) / sizeof((arr)[0]))
@@ -146,11 +184,18 @@ int main(void)
     struct arg arg1 = {.n = 70, .i = 1, .task_name = "Task 1"};
     struct arg arg2 = {.n = 70, .i = 0, .task_name = "Task 2"};
     struct arg registered_arg[] = {arg0, arg1, arg2};
-    tasks = registered_task;
-    args = registered_arg;
-    ntasks = ARRAY_SIZE(registered_task);
+
+    for (size_t i = 0; i < ARRAY_SIZE(registered_task); i++) {
+        struct task *task = task_create(registered_task[i], &registered_arg[i]);
+        if (!task) {
+            perror("task_create");
+            return 1;
+        }
+        task_add(task);
+    }
 
     schedule();
+    bench_switch();
 
     return 0;
 }
@@ -0,0 +1,115 @@
+/* Tests of the M:N coroutines: yields across workers, a tree of spawns that
+ * the idle workers steal from, and messages over socket pairs that park the
+ * coroutines in the reactor.
+ */
+
+#define _GNU_SOURCE
+
+#include <stdatomic.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "mn.h"
+
+#define CHECK(exp)                                                     \
+    do {                                                               \
+        if (!(exp)) {                                                  \
+            fprintf(stderr, "%s:%d: %s failed\n", __FILE__, __LINE__, \
+                    #exp);                                             \
+            abort();                                                   \
+        }                                                              \
+    } while (0)
+
+#define N_WORKERS 4
+#define N_YIELDERS 64
+#define N_YIELDS 1000
+#define TREE_DEPTH 10
+#define N_PAIRS 16
+#define N_MESSAGES 1000
+
+static atomic_long n_yields, n_nodes, n_messages;
+static atomic_int worker_seen[N_WORKERS];
+
+static void yielder(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < N_YIELDS; i++) {
+        atomic_store(&worker_seen[mn_worker_id()], 1);
+        mn_yield();
+        atomic_fetch_add(&n_yields, 1);
+    }
+}
+
+/* Every node spawns two children down to the depth */
+static void tree(void *arg)
+{
+    long depth = (long) arg;
+
+    atomic_fetch_add(&n_nodes, 1);
+    if (depth < TREE_DEPTH) {
+        CHECK(!mn_spawn(tree, (void *) (depth + 1)));
+        CHECK(!mn_spawn(tree, (void *) (depth + 1)));
+    }
+}
+
+/* One message at a time, so that the reader waits for each of them */
+static void writer(void *arg)
+{
+    int fd = (long) arg;
+
+    for (int i = 0; i < N_MESSAGES; i++) {
+        CHECK(mn_write(fd, &i, sizeof(i)) == sizeof(i));
+        if (i % 16 == 0)
+            mn_yield();
+    }
+    close(fd);
+}
+
+static void reader(void *arg)
+{
+    int fd = (long) arg, i, expected = 0;
+    ssize_t n;
+
+    while ((n = mn_read(fd, &i, sizeof(i))) > 0) {
+        CHECK(n == sizeof(i) && i == expected);
+        expected++;
+        atomic_fetch_add(&n_messages, 1);
+    }
+    CHECK(n == 0 && expected == N_MESSAGES);
+    close(fd);
+}
+
+static void root(void *arg)
+{
+    (void) arg;
+    for (int i = 0; i < N_YIELDERS; i++)
+        CHECK(!mn_spawn(yielder, NULL));
+    CHECK(!mn_spawn(tree, (void *) 0L));
+    for (int i = 0; i < N_PAIRS; i++) {
+        int sv[2];
+        CHECK(!socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK, 0, sv));
+        CHECK(!mn_spawn(reader, (void *) (long) sv[0]));
+        CHECK(!mn_spawn(writer, (void *) (long) sv[1]));
+    }
+}
+
+int main(void)
+{
+    if (mn_run(N_WORKERS, root, NULL)) {
+        perror("mn_run");
+        return 1;
+    }
+
+    CHECK(n_yields == N_YIELDERS * N_YIELDS);
+    CHECK(n_nodes == (2L << TREE_DEPTH) - 1);
+    CHECK(n_messages == N_PAIRS * N_MESSAGES);
+
+    int workers = 0;
+    for (int i = 0; i < N_WORKERS; i++)
+        workers += worker_seen[i];
+    printf("%ld yields, %ld spawns and %ld messages on %d workers\n",
+           (long) n_yields, (long) n_nodes, (long) n_messages, workers);
+    return 0;
+}
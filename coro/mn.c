@@ -0,0 +1,419 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <unistd.h>
+
+#include "context.h"
+#include "deque.h"
+#include "mn.h"
+
+#define MN_STACK (64 * 1024)
+#define MN_QUEUE_SIZE 64
+#define MN_EVENTS 64
+#define MN_SPIN 16 /* rounds of stealing and polling before sleeping */
+
+enum {
+    MN_READY,
+    MN_BLOCKED,
+    MN_DONE,
+};
+
+struct mn_coro {
+    context_t ctx;
+    struct coro_stack stack;
+    mn_fn_t fn;
+    void *arg;
+    int state;
+    int wait_fd, wait_error;
+    unsigned int wait_events;
+    struct mn_coro *next; /* among the yielded ones */
+};
+
+/* The deque holds coroutines in place of work items, it never dereferences
+ * them.
+ */
+#define CORO_WORK(c) ((work_t *) (c))
+#define WORK_CORO(x) ((struct mn_coro *) (x))
+
+struct mn_worker {
+    deque_t queue;
+    context_t sched;
+    struct mn_coro *current;
+    /* Yielded in this round, run again once the queue is empty */
+    struct mn_coro *yield_head, **yield_tail;
+    pthread_t thread;
+    int id;
+    unsigned int seed;
+} __attribute__((aligned(64)));
+
+static struct {
+    struct mn_worker *workers;
+    int n_workers;
+    int epfd, wakefd;
+    atomic_long n_coros;
+    atomic_int n_sleeping;
+    atomic_bool stop;
+} rt;
+
+static __thread struct mn_worker *mn_worker_tls;
+
+/* The worker running the current coroutine. mn_yield() and mn_wait_fd()
+ * return on whichever worker popped the coroutine, so every caller reads
+ * mn_worker_tls again through this call rather than through an address
+ * computed before its context_switch(); noinline and the clobber keep GCC
+ * from sharing one call between both sides of a switch.
+ */
+static __attribute__((noinline)) struct mn_worker *mn_self(void)
+{
+    struct mn_worker *w = mn_worker_tls;
+    __asm__ __volatile__("" ::: "memory");
+    return w;
+}
+
+/* errno is thread-local as well, and its address is just as cacheable: it is
+ * only touched through these after a switch
+ */
+static __attribute__((noinline)) bool mn_would_block(void)
+{
+    int e = errno;
+    __asm__ __volatile__("" ::: "memory");
+    return e == EAGAIN || e == EWOULDBLOCK;
+}
+
+static __attribute__((noinline)) void mn_set_errno(int e)
+{
+    errno = e;
+    __asm__ __volatile__("" ::: "memory");
+}
+
+/* Wake the workers sleeping in the reactor. Called after pushing work, the
+ * fence pairs with the one of a worker going to sleep, so that either it
+ * sees the work or it is counted as sleeping here.
+ */
+static void mn_wake(void)
+{
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&rt.n_sleeping, memory_order_relaxed)) {
+        uint64_t one = 1;
+        (void) !write(rt.wakefd, &one, sizeof(one));
+    }
+}
+
+static void mn_push(struct mn_worker *w, struct mn_coro *c)
+{
+    push(&w->queue, CORO_WORK(c));
+    mn_wake();
+}
+
+static struct mn_coro *mn_take(struct mn_worker *w)
+{
+    work_t *x = take(&w->queue);
+
+    if (x != EMPTY)
+        return WORK_CORO(x);
+
+    /* Start the next round with the coroutines that yielded in this one */
+    if (!w->yield_head)
+        return NULL;
+    for (struct mn_coro *c = w->yield_head; c; c = c->next)
+        push(&w->queue, CORO_WORK(c));
+    w->yield_head = NULL;
+    w->yield_tail = &w->yield_head;
+    mn_wake();
+    x = take(&w->queue);
+    return x == EMPTY ? NULL : WORK_CORO(x);
+}
+
+static struct mn_coro *mn_steal(struct mn_worker *w)
+{
+    int start = rand_r(&w->seed) % rt.n_workers;
+
+    for (int i = 0; i < rt.n_workers; i++) {
+        struct mn_worker *victim = &rt.workers[(start + i) % rt.n_workers];
+        work_t *x;
+
+        if (victim == w)
+            continue;
+        do {
+            x = steal(&victim->queue);
+        } while (x == ABORT);
+        if (x != EMPTY)
+            return WORK_CORO(x);
+    }
+    return NULL;
+}
+
+/* Queue the coroutines whose descriptor is ready on "w", and return how many
+ * there were.
+ */
+static int mn_poll(struct mn_worker *w, int timeout)
+{
+    struct epoll_event events[MN_EVENTS];
+    int n = epoll_wait(rt.epfd, events, MN_EVENTS, timeout), found = 0;
+
+    for (int i = 0; i < n; i++) {
+        if (!events[i].data.ptr) {
+            /* Leave it set on stop, so that every worker wakes up */
+            uint64_t v;
+            if (!atomic_load(&rt.stop))
+                (void) !read(rt.wakefd, &v, sizeof(v));
+            continue;
+        }
+        push(&w->queue, events[i].data.ptr);
+        found++;
+    }
+    /* The others may steal what this worker will not run soon */
+    if (found > 1)
+        mn_wake();
+    return found;
+}
+
+static struct mn_coro *mn_next(struct mn_worker *w)
+{
+    struct mn_coro *c;
+
+    if ((c = mn_take(w)))
+        return c;
+    for (int spin = 0; spin < MN_SPIN; spin++) {
+        if ((c = mn_steal(w)))
+            return c;
+        if (mn_poll(w, 0))
+            return mn_take(w);
+    }
+
+    /* Sleep in the reactor until a descriptor is ready or work is pushed */
+    atomic_fetch_add(&rt.n_sleeping, 1);
+    if (!(c = mn_steal(w)) && !atomic_load(&rt.stop))
+        mn_poll(w, -1);
+    atomic_fetch_sub(&rt.n_sleeping, 1);
+    return c ? c : mn_take(w);
+}
+
+static void mn_done(struct mn_coro *c)
+{
+    coro_stack_free(&c->stack);
+    free(c);
+    if (atomic_fetch_sub(&rt.n_coros, 1) == 1) {
+        uint64_t one = 1;
+        atomic_store(&rt.stop, true);
+        (void) !write(rt.wakefd, &one, sizeof(one));
+    }
+}
+
+/* Arm the descriptor once the coroutine is off its stack, so that no other
+ * worker may resume it before.
+ */
+static void mn_park(struct mn_worker *w, struct mn_coro *c)
+{
+    struct epoll_event ev = {.events = c->wait_events | EPOLLONESHOT,
+                             .data.ptr = c};
+
+    if (!epoll_ctl(rt.epfd, EPOLL_CTL_MOD, c->wait_fd, &ev))
+        return;
+    if (errno == ENOENT && !epoll_ctl(rt.epfd, EPOLL_CTL_ADD, c->wait_fd, &ev))
+        return;
+    c->wait_error = errno;
+    mn_push(w, c);
+}
+
+static void mn_resume(struct mn_worker *w, struct mn_coro *c)
+{
+    w->current = c;
+    context_switch(&w->sched, &c->ctx);
+    w->current = NULL;
+
+    switch (c->state) {
+    case MN_READY:
+        c->next = NULL;
+        *w->yield_tail = c;
+        w->yield_tail = &c->next;
+        break;
+    case MN_BLOCKED:
+        mn_park(w, c);
+        break;
+    case MN_DONE:
+        mn_done(c);
+        break;
+    }
+}
+
+static void *mn_worker_main(void *arg)
+{
+    struct mn_worker *w = arg;
+
+    mn_worker_tls = w;
+    while (!atomic_load(&rt.stop)) {
+        struct mn_coro *c = mn_next(w);
+        if (c)
+            mn_resume(w, c);
+    }
+    return NULL;
+}
+
+static void mn_entry(void *arg)
+{
+    struct mn_coro *c = arg;
+
+    c->fn(c->arg);
+    c->state = MN_DONE;
+    context_switch(&c->ctx, &mn_self()->sched);
+}
+
+static struct mn_coro *mn_create(mn_fn_t fn, void *arg)
+{
+    struct mn_coro *c = malloc(sizeof(struct mn_coro));
+
+    if (!c)
+        return NULL;
+    if (coro_stack_alloc(&c->stack, MN_STACK)) {
+        free(c);
+        return NULL;
+    }
+    context_init(&c->ctx, c->stack.base, c->stack.size, mn_entry, c);
+    c->fn = fn;
+    c->arg = arg;
+    c->state = MN_READY;
+    atomic_fetch_add(&rt.n_coros, 1);
+    return c;
+}
+
+int mn_spawn(mn_fn_t fn, void *arg)
+{
+    struct mn_coro *c = mn_create(fn, arg);
+
+    if (!c)
+        return -1;
+    mn_push(mn_self(), c);
+    return 0;
+}
+
+void mn_yield(void)
+{
+    struct mn_worker *w = mn_self();
+    struct mn_coro *c = w->current;
+
+    c->state = MN_READY;
+    context_switch(&c->ctx, &w->sched);
+}
+
+int mn_wait_fd(int fd, unsigned int events)
+{
+    struct mn_worker *w = mn_self();
+    struct mn_coro *c = w->current;
+
+    c->state = MN_BLOCKED;
+    c->wait_fd = fd;
+    c->wait_events = events;
+    c->wait_error = 0;
+    context_switch(&c->ctx, &w->sched);
+
+    if (c->wait_error) {
+        mn_set_errno(c->wait_error);
+        return -1;
+    }
+    return 0;
+}
+
+ssize_t mn_read(int fd, void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ((n = read(fd, buf, len)) < 0 &&
+           mn_would_block()) {
+        if (mn_wait_fd(fd, EPOLLIN))
+            return -1;
+    }
+    return n;
+}
+
+ssize_t mn_write(int fd, const void *buf, size_t len)
+{
+    ssize_t n;
+
+    while ((n = write(fd, buf, len)) < 0 &&
+           mn_would_block()) {
+        if (mn_wait_fd(fd, EPOLLOUT))
+            return -1;
+    }
+    return n;
+}
+
+int mn_accept(int fd, struct sockaddr *addr, socklen_t *len)
+{
+    int n;
+
+    while ((n = accept4(fd, addr, len, SOCK_NONBLOCK)) < 0 &&
+           mn_would_block()) {
+        if (mn_wait_fd(fd, EPOLLIN))
+            return -1;
+    }
+    return n;
+}
+
+int mn_worker_id(void)
+{
+    return mn_self()->id;
+}
+
+int mn_run(int n_workers, mn_fn_t fn, void *arg)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    int started = 0, ret = -1;
+
+    rt.n_workers = n_workers;
+    atomic_init(&rt.n_coros, 0);
+    atomic_init(&rt.n_sleeping, 0);
+    atomic_init(&rt.stop, false);
+    rt.workers = aligned_alloc(64, n_workers * sizeof(struct mn_worker));
+    rt.epfd = epoll_create1(EPOLL_CLOEXEC);
+    rt.wakefd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (!rt.workers || rt.epfd < 0 || rt.wakefd < 0 ||
+        epoll_ctl(rt.epfd, EPOLL_CTL_ADD, rt.wakefd, &ev))
+        goto out;
+
+    for (int i = 0; i < n_workers; i++) {
+        struct mn_worker *w = &rt.workers[i];
+        init(&w->queue, MN_QUEUE_SIZE);
+        w->current = NULL;
+        w->yield_head = NULL;
+        w->yield_tail = &w->yield_head;
+        w->id = i;
+        w->seed = i + 1;
+    }
+
+    /* Before any worker runs, so pushing from here is safe */
+    struct mn_coro *root = mn_create(fn, arg);
+    if (!root)
+        goto free_queues;
+    push(&rt.workers[0].queue, CORO_WORK(root));
+
+    for (; started < n_workers; started++) {
+        struct mn_worker *w = &rt.workers[started];
+        if (pthread_create(&w->thread, NULL, mn_worker_main, w))
+            break;
+    }
+    /* The started workers run every coroutine to completion anyway */
+    ret = started ? 0 : -1;
+    if (!started)
+        mn_done(root);
+    for (int i = 0; i < started; i++)
+        pthread_join(rt.workers[i].thread, NULL);
+
+free_queues:
+    for (int i = 0; i < n_workers; i++)
+        destroy(&rt.workers[i].queue);
+out:
+    if (rt.wakefd >= 0)
+        close(rt.wakefd);
+    if (rt.epfd >= 0)
+        close(rt.epfd);
+    free(rt.workers);
+    return ret;
+}
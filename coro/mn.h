@@ -0,0 +1,48 @@
+/* M:N coroutines
+ *
+ * N worker threads run the coroutines from run queues of their own, the
+ * Chase-Lev deques of work-steal, and steal from the others when theirs is
+ * empty. A coroutine that waits for a file descriptor is parked in an epoll
+ * instance shared by the workers, which poll it when they run out of work and
+ * resume the coroutines whose descriptor is ready.
+ *
+ * A coroutine may resume on another worker after any of the calls below, and
+ * must not keep thread-local state across them.
+ */
+
+#pragma once
+
+#include <stddef.h>
+#include <sys/socket.h>
+#include <sys/types.h>
+
+typedef void (*mn_fn_t)(void *arg);
+
+/* Run fn(arg) as the first coroutine on "n_workers" threads, and return once
+ * every coroutine is complete. Return 0, or -1 with errno set.
+ */
+int mn_run(int n_workers, mn_fn_t fn, void *arg);
+
+/* The functions below may only be called from a coroutine */
+
+/* Start fn(arg) in a new coroutine. Return 0, or -1 with errno set. */
+int mn_spawn(mn_fn_t fn, void *arg);
+
+/* Let the other coroutines of the worker run */
+void mn_yield(void);
+
+/* Park until "fd" is ready for "events", EPOLLIN or EPOLLOUT. A descriptor may
+ * only be waited for by one coroutine at a time. Return 0, or -1 with errno
+ * set if it cannot be polled.
+ */
+int mn_wait_fd(int fd, unsigned int events);
+
+/* Like read(), write() and accept() on a non-blocking descriptor, parking
+ * instead of failing with EAGAIN.
+ */
+ssize_t mn_read(int fd, void *buf, size_t len);
+ssize_t mn_write(int fd, const void *buf, size_t len);
+int mn_accept(int fd, struct sockaddr *addr, socklen_t *len);
+
+/* The worker running the calling coroutine, from 0 to n_workers - 1 */
+int mn_worker_id(void);
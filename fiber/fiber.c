@@ -1,23 +1,35 @@
 #define FIBER_NOERROR 0
-#define FIBER_MAXFIBERS 1
+#define FIBER_MAXFIBERS 1 /* No longer returned, there is no limit */
 #define FIBER_MALLOC_ERROR 2
 #define FIBER_CLONE_ERROR 3
 #define FIBER_INFIBER 4
 
-/* The maximum number of fibers that can be active at once. */
-#define MAX_FIBERS 10
-
-/* The size of the stack for each fiber. */
+/* The size of the stack for each fiber. The stacks are mapped without
+ * reserving swap, so only the pages a fiber touches cost memory.
+ */
 #define FIBER_STACK (1024 * 1024)
 
+/* The stacks are mapped by regions of that many, each below a guard page
+ * unless fiber_stack_guard(false) was called. The guard pages split the
+ * region into two mappings per stack, so vm.max_map_count (65530 by default)
+ * caps the fibers around 32K with them.
+ */
+#define FIBER_REGION_STACKS 64
+
 #define _GNU_SOURCE
 
+#include <pthread.h>
 #include <sched.h> /* For clone */
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/mman.h>  /* For mmap */
 #include <sys/types.h> /* For pid_t */
 #include <sys/wait.h>  /* For wait */
-#include <unistd.h>    /* For getpid */
+#include <time.h>
+#include <unistd.h> /* For getpid */
+
+#include "context.h"
 
 /* A simple solution to avoid unexpected output by the buffered I/O 'printf' is
  * using low-level I/O interface 'write'. It works because 'printf' will wait to
@@ -44,8 +56,11 @@ typedef struct {
     void *stack; /* The stack pointer */
 } fiber_t;
 
-/* The fiber "queue" */
-static fiber_t fiber_list[MAX_FIBERS];
+/* The active fibers, in a hash table by pid with linear probing. A pid of 0
+ * marks an empty slot.
+ */
+static fiber_t *fiber_list;
+static size_t fiber_list_size; /* a power of two */
 
 /* The pid of the parent process */
 static pid_t parent;
@@ -53,16 +68,338 @@ static pid_t parent;
 /* The number of active fibers */
 static int num_fibers = 0;
 
+/* The number of kernel threads running the fibers, 0 in clone mode */
+static int user_threads;
+
+/* The stacks of the fibers that quit, linked through their top word, which
+ * they touched anyway.
+ */
+static void *stack_pool;
+static size_t page_size;
+static bool stack_guard = true;
+
+#define stack_link(stack) ((void **) ((char *) (stack) + FIBER_STACK) - 1)
+
+static void stack_put(void *stack)
+{
+    *stack_link(stack) = stack_pool;
+    stack_pool = stack;
+}
+
+/* Take a stack from the pool, or map a new region of them */
+static void *stack_get(void)
+{
+    size_t guard_size = stack_guard ? page_size : 0;
+    size_t stride = FIBER_STACK + guard_size;
+
+    if (!stack_pool) {
+        char *region = mmap(NULL, FIBER_REGION_STACKS * stride,
+                            PROT_READ | PROT_WRITE,
+                            MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE |
+                                MAP_STACK,
+                            -1, 0);
+        if (region == MAP_FAILED)
+            return NULL;
+        for (int i = FIBER_REGION_STACKS - 1; i >= 0; i--) {
+            char *guard = region + i * stride;
+            if (guard_size && mprotect(guard, guard_size, PROT_NONE)) {
+                munmap(region, FIBER_REGION_STACKS * stride);
+                return NULL;
+            }
+            stack_put(guard + guard_size);
+        }
+    }
+
+    void *stack = stack_pool;
+    stack_pool = *stack_link(stack);
+    return stack;
+}
+
+static inline size_t fiber_hash(pid_t pid)
+{
+    return ((size_t) pid * 2654435761U) & (fiber_list_size - 1);
+}
+
+static void fiber_insert(pid_t pid, void *stack)
+{
+    size_t i = fiber_hash(pid);
+
+    while (fiber_list[i].pid)
+        i = (i + 1) & (fiber_list_size - 1);
+    fiber_list[i].pid = pid;
+    fiber_list[i].stack = stack;
+}
+
+/* Keep the table at most half full */
+static int fiber_reserve(void)
+{
+    fiber_t *old = fiber_list;
+    size_t old_size = fiber_list_size;
+
+    if ((size_t) (num_fibers + 1) * 2 <= fiber_list_size)
+        return 0;
+    fiber_t *list = calloc(old_size ? old_size * 2 : 16, sizeof(fiber_t));
+    if (!list)
+        return -1;
+    fiber_list = list;
+    fiber_list_size = old_size ? old_size * 2 : 16;
+    for (size_t i = 0; i < old_size; i++) {
+        if (old[i].pid)
+            fiber_insert(old[i].pid, old[i].stack);
+    }
+    free(old);
+    return 0;
+}
+
+/* Remove the fiber "pid" and return its stack, or NULL if it is not ours.
+ * The entries after it move back into the hole if their slot allows it.
+ */
+static void *fiber_remove(pid_t pid)
+{
+    size_t mask = fiber_list_size - 1, i, j;
+    void *stack;
+
+    if (!fiber_list_size)
+        return NULL;
+    for (i = fiber_hash(pid); fiber_list[i].pid != pid; i = (i + 1) & mask) {
+        if (!fiber_list[i].pid)
+            return NULL;
+    }
+    stack = fiber_list[i].stack;
+
+    for (j = (i + 1) & mask; fiber_list[j].pid; j = (j + 1) & mask) {
+        size_t k = fiber_hash(fiber_list[j].pid);
+        /* Stays put if its slot is cyclically within (i, j] */
+        if (i <= j ? (i < k && k <= j) : (i < k || k <= j))
+            continue;
+        fiber_list[i] = fiber_list[j];
+        i = j;
+    }
+    fiber_list[i].pid = 0;
+    return stack;
+}
+
 void fiber_init()
 {
-    for (int i = 0; i < MAX_FIBERS; ++i)
-        fiber_list[i].pid = 0, fiber_list[i].stack = 0;
+    free(fiber_list);
+    fiber_list = NULL;
+    fiber_list_size = 0;
+    num_fibers = 0;
+    user_threads = 0;
+    page_size = sysconf(_SC_PAGESIZE);
     parent = getpid();
 }
 
+/* User mode: the fibers are coroutines on their own stacks instead of kernel
+ * tasks, run by a few kernel threads taking them from a shared ready queue. A
+ * yield switches straight to the next ready fiber, without a system call.
+ */
+struct ufiber {
+    context_t ctx;
+    void *stack;
+    void (*func)(void);
+    struct ufiber *next; /* in the ready queue */
+};
+
+/* A kernel thread running fibers. The fiber it switched away from is only
+ * queued again, or reclaimed if it quit, once its context is saved: until
+ * then another thread must not resume it.
+ */
+struct uthread {
+    context_t sched;
+    struct ufiber *current;
+    struct ufiber *prev;
+    bool prev_done;
+};
+
+/* Protects the ready queue, the stack pool and num_fibers, with more than one
+ * thread.
+ */
+static pthread_mutex_t ready_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct ufiber *ready_head, *ready_tail;
+
+static __thread struct uthread uthread_tls;
+
+/* The uthread of the kernel thread running the caller. Any uthread_run() may
+ * take a yielded fiber off the ready queue, so ufiber_yield() and
+ * ufiber_start() look their uthread up again after switching back in; the
+ * call stays out of line so that &uthread_tls is not taken once per fiber.
+ */
+static __attribute__((noinline)) struct uthread *uthread_self(void)
+{
+    struct uthread *t = &uthread_tls;
+    __asm__ __volatile__("" ::: "memory");
+    return t;
+}
+
+static inline void ready_lock_acquire(void)
+{
+    if (user_threads > 1)
+        pthread_mutex_lock(&ready_lock);
+}
+
+static inline void ready_lock_release(void)
+{
+    if (user_threads > 1)
+        pthread_mutex_unlock(&ready_lock);
+}
+
+static void ready_push(struct ufiber *f)
+{
+    f->next = NULL;
+    if (ready_tail)
+        ready_tail->next = f;
+    else
+        ready_head = f;
+    ready_tail = f;
+}
+
+static struct ufiber *ready_pop(void)
+{
+    struct ufiber *f = ready_head;
+
+    if (f && !(ready_head = f->next))
+        ready_tail = NULL;
+    return f;
+}
+
+static struct ufiber *ready_take(void)
+{
+    ready_lock_acquire();
+    struct ufiber *f = ready_pop();
+    ready_lock_release();
+    return f;
+}
+
+/* Run on the other side of every switch, for the fiber switched away from */
+static void ufiber_switched(struct uthread *t)
+{
+    struct ufiber *prev = t->prev;
+    bool done = t->prev_done;
+
+    if (!prev)
+        return;
+    t->prev = NULL;
+
+    ready_lock_acquire();
+    if (done) {
+        stack_put(prev->stack);
+        num_fibers--;
+    } else {
+        ready_push(prev);
+    }
+    ready_lock_release();
+    if (done)
+        free(prev);
+}
+
+static void ufiber_start(void *arg)
+{
+    struct ufiber *f = (struct ufiber *) arg;
+
+    ufiber_switched(uthread_self());
+    f->func();
+
+    struct uthread *t = uthread_self();
+    struct ufiber *next = ready_take();
+    t->prev = f;
+    t->prev_done = true;
+    t->current = next;
+    context_switch(&f->ctx, next ? &next->ctx : &t->sched);
+}
+
+static int ufiber_spawn(void (*func)(void))
+{
+    struct ufiber *f = malloc(sizeof(struct ufiber));
+    if (!f)
+        return FIBER_MALLOC_ERROR;
+    f->func = func;
+
+    ready_lock_acquire();
+    if ((f->stack = stack_get()) != 0) {
+        context_init(&f->ctx, f->stack, FIBER_STACK, ufiber_start, f);
+        ready_push(f);
+        num_fibers++;
+    }
+    ready_lock_release();
+
+    if (!f->stack) {
+        free(f);
+        return FIBER_MALLOC_ERROR;
+    }
+    return FIBER_NOERROR;
+}
+
+static void ufiber_yield(void)
+{
+    struct uthread *t = uthread_self();
+    struct ufiber *self = t->current, *next;
+
+    /* Outside of a fiber, or nothing else to run */
+    if (!self || !(next = ready_take()))
+        return;
+
+    t->prev = self;
+    t->prev_done = false;
+    t->current = next;
+    context_switch(&self->ctx, &next->ctx);
+    ufiber_switched(uthread_self());
+}
+
+/* Run the ready fibers on this thread until they all quit */
+static void *uthread_run(void *arg)
+{
+    struct uthread *t = uthread_self();
+
+    (void) arg;
+    while (1) {
+        ready_lock_acquire();
+        struct ufiber *f = ready_pop();
+        bool done = !f && num_fibers == 0;
+        ready_lock_release();
+
+        if (done)
+            break;
+        /* The remaining fibers are running on the other threads */
+        if (!f) {
+            sched_yield();
+            continue;
+        }
+
+        t->current = f;
+        context_switch(&t->sched, &f->ctx);
+        t->current = NULL;
+        ufiber_switched(t);
+    }
+    return NULL;
+}
+
+/* Fibers spawned after this run in user mode, on "threads" kernel threads
+ * during fiber_wait_all().
+ */
+void fiber_init_user(int threads)
+{
+    fiber_init();
+    user_threads = threads > 1 ? threads : 1;
+}
+
+/* Stacks mapped after fiber_stack_guard(false) have no guard pages: a region
+ * of them is then a single mapping, and a stack overflow runs silently into
+ * the stack below.
+ */
+void fiber_stack_guard(bool on)
+{
+    stack_guard = on;
+}
+
 /* Yield control to another execution context */
 void fiber_yield()
 {
+    if (user_threads) {
+        ufiber_yield();
+        return;
+    }
+
     /* move the current process to the end of the process queue. */
     sched_yield();
 }
@@ -84,28 +421,32 @@ static int fiber_start(void *arg)
 /* Creates a new fiber, running the func that is passed as an argument. */
 int fiber_spawn(void (*func)(void))
 {
-    if (num_fibers == MAX_FIBERS)
-        return FIBER_MAXFIBERS;
+    if (user_threads)
+        return ufiber_spawn(func);
 
-    if ((fiber_list[num_fibers].stack = malloc(FIBER_STACK)) == 0)
+    void *stack;
+    if (fiber_reserve() || (stack = stack_get()) == 0)
         return FIBER_MALLOC_ERROR;
 
     struct fiber_args *args;
     if ((args = malloc(sizeof(*args))) == 0) {
-        free(fiber_list[num_fibers].stack);
+        stack_put(stack);
         return FIBER_MALLOC_ERROR;
     }
     args->func = func;
 
-    fiber_list[num_fibers].pid = clone(
-        fiber_start, (char *) fiber_list[num_fibers].stack + FIBER_STACK,
-        SIGCHLD | CLONE_FS | CLONE_FILES | CLONE_SIGHAND | CLONE_VM, args);
-    if (fiber_list[num_fibers].pid == -1) {
-        free(fiber_list[num_fibers].stack);
+    pid_t pid = clone(fiber_start, (char *) stack + FIBER_STACK,
+                      SIGCHLD | CLONE_FS | CLONE_FILES | CLONE_SIGHAND |
+                          CLONE_VM,
+                      args);
+    if (pid == -1) {
+        stack_put(stack);
         free(args);
         return FIBER_CLONE_ERROR;
     }
 
+    /* The fiber may have quit already, it is only reaped by this thread */
+    fiber_insert(pid, stack);
     num_fibers++;
     return FIBER_NOERROR;
 }
@@ -113,6 +454,21 @@ int fiber_spawn(void (*func)(void))
 /* Execute the fibers until they all quit. */
 int fiber_wait_all()
 {
+    if (user_threads) {
+        if (uthread_self()->current)
+            return FIBER_INFIBER;
+
+        pthread_t threads[user_threads];
+        int n = 0;
+        while (n < user_threads - 1 &&
+               !pthread_create(&threads[n], NULL, uthread_run, NULL))
+            n++;
+        uthread_run(NULL);
+        while (n > 0)
+            pthread_join(threads[--n], NULL);
+        return FIBER_NOERROR;
+    }
+
     /* Check to see if we are in a fiber, since we do not get signals in the
      * child threads
      */
@@ -120,19 +476,15 @@ int fiber_wait_all()
     if (pid != parent)
         return FIBER_INFIBER;
 
-    /* Wait for the fibers to quit, then free the stacks */
+    /* Wait for the fibers to quit, then put their stacks back in the pool */
     while (num_fibers > 0) {
         if ((pid = wait(0)) == -1)
             exit(1);
 
-        /* Find the fiber, free the stack, and swap it with the last one */
-        for (int i = 0; i < num_fibers; ++i) {
-            if (fiber_list[i].pid == pid) {
-                free(fiber_list[i].stack);
-                if (i != --num_fibers)
-                    fiber_list[i] = fiber_list[num_fibers];
-                break;
-            }
+        void *stack = fiber_remove(pid);
+        if (stack) {
+            stack_put(stack);
+            num_fibers--;
         }
     }
 
@@ -160,9 +512,75 @@ static void squares()
     }
 }
 
-int main()
+static void nop() {}
+
+static int yields;
+
+static void yielder()
 {
+    for (int i = 0; i < yields; i++)
+        fiber_yield();
+}
+
+/* Usage: fiber [-g] [-u threads] [-n count] [-y yields]
+ *
+ * -g maps the stacks without guard pages, for more than about 32K fibers. -u
+ * runs the fibers in user mode on that many threads. -n spawns that many
+ * fibers twice: the second round reuses the stacks of the first one. -y times
+ * two fibers yielding to each other that many times each.
+ */
+int main(int argc, char *argv[])
+{
+    int opt, count = 0;
+
     fiber_init();
+    while ((opt = getopt(argc, argv, "gu:n:y:")) != -1) {
+        switch (opt) {
+        case 'g':
+            fiber_stack_guard(false);
+            break;
+        case 'u':
+            fiber_init_user(atoi(optarg));
+            break;
+        case 'n':
+            count = atoi(optarg);
+            break;
+        case 'y':
+            yields = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    if (yields > 0) {
+        struct timespec start, end;
+        clock_gettime(CLOCK_MONOTONIC, &start);
+        fiber_spawn(&yielder);
+        fiber_spawn(&yielder);
+        fiber_wait_all();
+        clock_gettime(CLOCK_MONOTONIC, &end);
+        long ns = (end.tv_sec - start.tv_sec) * 1000000000L +
+                  (end.tv_nsec - start.tv_nsec);
+        printf("%s: %ld ns per yield\n", user_threads ? "user" : "clone",
+               ns / (2L * yields));
+        return 0;
+    }
+
+    if (count > 0) {
+        for (int round = 0; round < 2; round++) {
+            for (int i = 0; i < count; i++) {
+                int err = fiber_spawn(&nop);
+                if (err) {
+                    printf("fiber_spawn failed at %d: %d\n", i, err);
+                    return 1;
+                }
+            }
+            fiber_wait_all();
+            printf("round %d: %d fibers\n", round, count);
+        }
+        return 0;
+    }
 
     fiber_spawn(&fibonacci);
     fiber_spawn(&squares);
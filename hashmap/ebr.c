@@ -0,0 +1,224 @@
+#include <pthread.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#include "ebr.h"
+#include "../hotstat/hotstat.h"
+
+HOTSTAT_COUNTER(epochs, "ebr.epochs");
+HOTSTAT_HISTOGRAM(backlog, "ebr.backlog");
+
+/* set in the local epoch of a thread inside a critical section */
+#define EBR_ACTIVE (1ULL << 63)
+
+/* lists of retired memory per thread, memory retired in epoch e is safe to
+ * release at e + 2, so the list of e is reused at e + 3
+ */
+#define EBR_EPOCHS 3
+
+/* try to advance the epoch once this many vars went to the same list */
+#define EBR_BATCH 64
+
+typedef struct {
+    void *var;
+    void (*release)(void *var);
+} ebr_entry_t;
+
+typedef struct {
+    uint64_t epoch; /* when the entries were retired */
+    uint32_t count, size;
+    ebr_entry_t *entries;
+} ebr_list_t;
+
+typedef struct ebr_tls {
+    uint64_t local_epoch; /* EBR_ACTIVE | epoch, or 0 outside */
+    uint32_t depth;       /* nesting of critical sections */
+    bool in_use;          /* owned by a live thread */
+    struct ebr_tls *next;
+    ebr_list_t retired[EBR_EPOCHS];
+} __attribute__((aligned(64))) ebr_tls_t;
+
+static uint64_t global_epoch = 0;
+
+/* registered threads, records of exited threads are reused */
+static ebr_tls_t *ebr_threads = NULL;
+
+static __thread ebr_tls_t *ebr_self = NULL;
+static pthread_key_t ebr_key;
+
+static void list_release(ebr_list_t *l)
+{
+    for (uint32_t i = 0; i < l->count; i++)
+        l->entries[i].release(l->entries[i].var);
+    l->count = 0;
+}
+
+/* Advance the global epoch if every thread inside a critical section has seen
+ * the current one. Return the global epoch.
+ */
+static uint64_t ebr_advance(void)
+{
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    /* pairs with the fence in ebr_enter */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (ebr_tls_t *t = __atomic_load_n(&ebr_threads, __ATOMIC_ACQUIRE); t;
+         t = t->next) {
+        uint64_t local = __atomic_load_n(&t->local_epoch, __ATOMIC_ACQUIRE);
+        if ((local & EBR_ACTIVE) && local != (epoch | EBR_ACTIVE))
+            return epoch;
+    }
+
+    /* a failed CAS means that another thread did advance it */
+    if (__atomic_compare_exchange_n(&global_epoch, &epoch, epoch + 1, false,
+                                    __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+        HOTSTAT_INC(epochs);
+        epoch++;
+    }
+    return epoch;
+}
+
+static void release_safe(ebr_tls_t *t, uint64_t epoch)
+{
+    for (int i = 0; i < EBR_EPOCHS; i++) {
+        ebr_list_t *l = &t->retired[i];
+        if (l->count && l->epoch + 2 <= epoch)
+            list_release(l);
+    }
+}
+
+/* Release the lists of @t that no thread can reference anymore, and those
+ * left behind by exited threads.
+ */
+static void ebr_collect(ebr_tls_t *t)
+{
+    /* the memory this thread still holds back */
+    HOTSTAT_RECORD(backlog, t->retired[0].count + t->retired[1].count +
+                                t->retired[2].count);
+
+    uint64_t epoch = ebr_advance();
+    release_safe(t, epoch);
+
+    for (ebr_tls_t *p = __atomic_load_n(&ebr_threads, __ATOMIC_ACQUIRE); p;
+         p = p->next) {
+        bool expected = false;
+        if (p == t || __atomic_load_n(&p->in_use, __ATOMIC_RELAXED) ||
+            !__atomic_compare_exchange_n(&p->in_use, &expected, true, false,
+                                         __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            continue;
+        release_safe(p, epoch);
+        __atomic_store_n(&p->in_use, false, __ATOMIC_RELEASE);
+    }
+}
+
+static void ebr_unregister(void *arg)
+{
+    ebr_tls_t *t = arg;
+
+    /* memory retired in the last epochs is safe once they are over, unless a
+     * thread is stuck in a critical section: then whatever is left is
+     * released by the next collection of another thread
+     */
+    for (int i = 0; i < EBR_EPOCHS; i++)
+        ebr_collect(t);
+    __atomic_store_n(&t->in_use, false, __ATOMIC_RELEASE);
+}
+
+static ebr_tls_t *ebr_register(void)
+{
+    ebr_tls_t *t;
+
+    /* take over the record of an exited thread if there is one */
+    for (t = __atomic_load_n(&ebr_threads, __ATOMIC_ACQUIRE); t; t = t->next) {
+        bool expected = false;
+        if (!__atomic_load_n(&t->in_use, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&t->in_use, &expected, true, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            goto out;
+    }
+
+    if (posix_memalign((void **) &t, sizeof(ebr_tls_t), sizeof(ebr_tls_t)))
+        abort();
+    *t = (ebr_tls_t){.in_use = true};
+    t->next = __atomic_load_n(&ebr_threads, __ATOMIC_RELAXED);
+    while (!__atomic_compare_exchange_n(&ebr_threads, &t->next, t, false,
+                                        __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+        ;
+
+out:
+    pthread_setspecific(ebr_key, t);
+    return ebr_self = t;
+}
+
+int ebr_init()
+{
+    return pthread_key_create(&ebr_key, ebr_unregister);
+}
+
+void ebr_enter(void)
+{
+    ebr_tls_t *t = ebr_self ? ebr_self : ebr_register();
+    if (t->depth++)
+        return;
+
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&t->local_epoch, epoch | EBR_ACTIVE, __ATOMIC_RELAXED);
+
+    /* publish the epoch before any shared data is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+void ebr_leave(void)
+{
+    ebr_tls_t *t = ebr_self;
+    if (--t->depth)
+        return;
+
+    __atomic_store_n(&t->local_epoch, 0, __ATOMIC_RELEASE);
+}
+
+void ebr_retire(void *var, void release(void *var))
+{
+    ebr_tls_t *t = ebr_self ? ebr_self : ebr_register();
+
+    /* @var is unlinked before the epoch it is retired in is read */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    uint64_t epoch = __atomic_load_n(&global_epoch, __ATOMIC_ACQUIRE);
+
+    /* a list last used 3 or more epochs ago is safe to release */
+    ebr_list_t *l = &t->retired[epoch % EBR_EPOCHS];
+    if (l->epoch != epoch) {
+        list_release(l);
+        l->epoch = epoch;
+    }
+
+    if (l->count == l->size) {
+        l->size = l->size ? l->size * 2 : EBR_BATCH;
+        l->entries = realloc(l->entries, l->size * sizeof(ebr_entry_t));
+        if (!l->entries)
+            abort();
+    }
+    l->entries[l->count++] = (ebr_entry_t){var, release};
+
+    /* amortize the scan of all threads over a batch of retires */
+    if (l->count % EBR_BATCH == 0)
+        ebr_collect(t);
+}
+
+int ebr_exit()
+{
+    ebr_tls_t *t = __atomic_exchange_n(&ebr_threads, NULL, __ATOMIC_ACQ_REL);
+    while (t) {
+        ebr_tls_t *next = t->next;
+        for (int i = 0; i < EBR_EPOCHS; i++) {
+            list_release(&t->retired[i]);
+            free(t->retired[i].entries);
+        }
+        free(t);
+        t = next;
+    }
+
+    ebr_self = NULL;
+    return pthread_key_delete(ebr_key);
+}
@@ -0,0 +1,39 @@
+/* Epoch-based reclamation
+ *
+ * Lock-free deletes such as `hashmap_del` unlink memory that other threads may
+ * still be reading, so it can only be released once every thread that might
+ * hold a reference has moved on. Threads bracket their accesses to shared data
+ * with `ebr_enter()` and `ebr_leave()`, and hand unlinked memory to
+ * `ebr_retire(var, release)` instead of freeing it.
+ *
+ * There is one global epoch. A thread inside a critical section publishes the
+ * epoch it observed on entry, and the global epoch only advances once every
+ * thread inside a critical section has observed the current one. Memory
+ * retired in epoch e is therefore unreachable once the global epoch is e + 2.
+ *
+ * Retired memory is kept on thread-local lists, one per epoch modulo 3, and no
+ * global quiescent point is needed: every so many retires, the retiring thread
+ * tries to advance the epoch and releases its lists that became safe. The
+ * memory pending per thread stays bounded as long as no thread stalls inside a
+ * critical section.
+ *
+ * Threads are registered on their first use and unregistered when they exit.
+ * `ebr_init()` must be called before use, and `ebr_exit()` at the end once no
+ * other thread is using it, which releases anything still pending.
+ */
+
+#ifndef _EBR_H_
+#define _EBR_H_
+
+/* _init() must be called before use and _exit() once at the end */
+int ebr_init(void);
+int ebr_exit(void);
+
+/* critical sections may nest, retired memory is not released while inside */
+void ebr_enter(void);
+void ebr_leave(void);
+
+/* call release(var) once no thread can hold a reference to var anymore */
+void ebr_retire(void *var, void release(void *var));
+
+#endif
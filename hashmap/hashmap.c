@@ -1,11 +1,54 @@
 #include "hashmap.h"
-#include "free_later.h"
+#include "ebr.h"
+#include "../hotstat/hotstat.h"
 
-/* TODO: make these variables conditionally built for benchmarking */
-/* used for testing CAS-retries in tests */
-volatile uint32_t hashmap_put_retries = 0, hashmap_put_replace_fail = 0;
-volatile uint32_t hashmap_put_head_fail = 0;
-volatile uint32_t hashmap_del_fail = 0, hashmap_del_fail_new_head = 0;
+/* CAS retries, per thread and only built with HOTSTAT */
+HOTSTAT_COUNTER(put_retries, "hashmap.put_retries");
+HOTSTAT_COUNTER(del_fail, "hashmap.del_fail");
+HOTSTAT_COUNTER(del_fail_new_head, "hashmap.del_fail_new_head");
+
+/* Split-ordered lists
+ *
+ * Entries are sorted by their hash with the bits reversed, so that the entries
+ * of bucket b (hash % n_buckets == b) form a contiguous run of the list, which
+ * starts with the dummy node of the bucket. Doubling n_buckets splits every
+ * run in two and never moves an entry: each new bucket is initialized on first
+ * use by inserting its dummy node in the run of its parent bucket, which is b
+ * with its top bit cleared.
+ *
+ * Deletes mark the low bit of the next pointer of an entry before unlinking it
+ * (Harris and Michael). Traversals help unlinking marked entries, and whoever
+ * unlinks an entry hands it to destroy_node. Every operation runs inside an
+ * epoch critical section, so an unlinked entry stays readable until the
+ * threads that may still be walking over it are done.
+ */
+
+/* grow once there are more than this many entries per bucket on average */
+#define LOAD_FACTOR 2
+#define MAX_BUCKETS (1U << 31)
+
+#define IS_MARKED(p) ((uintptr_t)(p) &1)
+#define MARKED(p) ((hashmap_kv_t *) ((uintptr_t)(p) | 1))
+#define UNMARKED(p) ((hashmap_kv_t *) ((uintptr_t)(p) & ~(uintptr_t) 1))
+
+static inline uint64_t reverse_bits(uint64_t x)
+{
+    x = (x >> 1 & 0x5555555555555555ULL) | (x & 0x5555555555555555ULL) << 1;
+    x = (x >> 2 & 0x3333333333333333ULL) | (x & 0x3333333333333333ULL) << 2;
+    x = (x >> 4 & 0x0f0f0f0f0f0f0f0fULL) | (x & 0x0f0f0f0f0f0f0f0fULL) << 4;
+    return __builtin_bswap64(x);
+}
+
+/* entries have the low bit set, to sort after the dummy node of a bucket */
+static inline uint64_t so_regular(uint64_t hash)
+{
+    return reverse_bits(hash | 1ULL << 63);
+}
+
+static inline uint64_t so_dummy(uint32_t bucket)
+{
+    return reverse_bits(bucket);
+}
 
 static hashmap_kv_t *create_node_with_malloc(void *opaque,
                                              const void *key,
@@ -19,10 +62,107 @@ static hashmap_kv_t *create_node_with_malloc(void *opaque,
 
 static void destroy_node_later(void *opaque, hashmap_kv_t *node)
 {
-    /* free all of these later in case other threads are using them */
-    free_later((void *) node->key, free);
-    free_later(node->value, opaque);
-    free_later(node, free);
+    /* free it later in case other threads are using it */
+    ebr_retire(node, free);
+}
+
+/* Return the slot of bucket @b, allocating its segment if needed */
+static hashmap_kv_t **bucket_slot(hashmap_t *map, uint32_t b)
+{
+    unsigned seg = b ? 32 - __builtin_clz(b) : 0;
+    size_t base = seg ? 1U << (seg - 1) : 0;
+
+    hashmap_kv_t **s =
+        __atomic_load_n(&map->segments[seg], __ATOMIC_ACQUIRE);
+    if (!s) {
+        hashmap_kv_t **fresh = calloc(seg ? base : 1, sizeof(hashmap_kv_t *));
+        if (__atomic_compare_exchange_n(&map->segments[seg], &s, fresh, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            s = fresh;
+        else
+            free(fresh);
+    }
+    return &s[b - base];
+}
+
+/* Search the list from dummy node @head for @key, or for the dummy node with
+ * @so_key if @key is NULL. Return the node if found. Either way, *prev_out is
+ * the link where the node is or would be inserted, and *cur_out the node that
+ * link points to.
+ */
+static hashmap_kv_t *list_find(hashmap_t *map,
+                               hashmap_kv_t *head,
+                               uint64_t so_key,
+                               const void *key,
+                               hashmap_kv_t ***prev_out,
+                               hashmap_kv_t **cur_out)
+{
+retry:;
+    hashmap_kv_t **prev = &head->next;
+    hashmap_kv_t *cur = __atomic_load_n(prev, __ATOMIC_ACQUIRE);
+    while (cur) {
+        hashmap_kv_t *next = __atomic_load_n(&cur->next, __ATOMIC_ACQUIRE);
+        if (IS_MARKED(next)) {
+            /* help unlinking a deleted node, restart if prev changed */
+            hashmap_kv_t *expected = cur;
+            if (!__atomic_compare_exchange_n(prev, &expected, UNMARKED(next),
+                                             false, __ATOMIC_ACQ_REL,
+                                             __ATOMIC_ACQUIRE))
+                goto retry;
+            map->destroy_node(map->opaque, cur);
+            cur = UNMARKED(next);
+            continue;
+        }
+        if (cur->so_key > so_key)
+            break;
+        if (cur->so_key == so_key && (!key || map->cmp(cur->key, key) == 0)) {
+            *prev_out = prev, *cur_out = cur;
+            return cur;
+        }
+        prev = &cur->next;
+        cur = next;
+    }
+    *prev_out = prev, *cur_out = cur;
+    return NULL;
+}
+
+/* Return the dummy node of bucket @b, initializing the bucket if needed */
+static hashmap_kv_t *get_bucket(hashmap_t *map, uint32_t b)
+{
+    hashmap_kv_t **slot = bucket_slot(map, b);
+    hashmap_kv_t *dummy = __atomic_load_n(slot, __ATOMIC_ACQUIRE);
+    if (dummy)
+        return dummy;
+
+    /* bucket 0 always exists, others split the run of their parent */
+    hashmap_kv_t *parent = get_bucket(map, b & ~(1U << (31 - __builtin_clz(b))));
+
+    dummy = malloc(sizeof(hashmap_kv_t));
+    dummy->key = NULL;
+    dummy->value = NULL;
+    dummy->so_key = so_dummy(b);
+    while (true) {
+        hashmap_kv_t **prev, *cur;
+        hashmap_kv_t *found =
+            list_find(map, parent, dummy->so_key, NULL, &prev, &cur);
+        if (found) { /* another thread initialized it first */
+            free(dummy);
+            dummy = found;
+            break;
+        }
+        dummy->next = cur;
+        if (__atomic_compare_exchange_n(prev, &cur, dummy, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+    }
+    __atomic_store_n(slot, dummy, __ATOMIC_RELEASE);
+    return dummy;
+}
+
+static inline hashmap_kv_t *bucket_of(hashmap_t *map, uint64_t hash)
+{
+    uint32_t n_buckets = __atomic_load_n(&map->n_buckets, __ATOMIC_ACQUIRE);
+    return get_bucket(map, hash & (n_buckets - 1));
 }
 
 void *hashmap_new(uint32_t n_buckets,
@@ -30,8 +170,15 @@ void *hashmap_new(uint32_t n_buckets,
                   uint64_t hash(const void *key))
 {
     hashmap_t *map = calloc(1, sizeof(hashmap_t));
-    map->n_buckets = n_buckets;
-    map->buckets = calloc(n_buckets, sizeof(hashmap_kv_t *));
+
+    /* round up to a power of 2, as buckets are split by halves */
+    map->n_buckets = 1;
+    while (map->n_buckets < n_buckets && map->n_buckets < MAX_BUCKETS)
+        map->n_buckets <<= 1;
+
+    /* bucket 0 heads the whole list */
+    hashmap_kv_t *head = calloc(1, sizeof(hashmap_kv_t));
+    *bucket_slot(map, 0) = head;
 
     /* keep local reference of the two utility functions */
     map->hash = hash;
@@ -46,16 +193,26 @@ void *hashmap_new(uint32_t n_buckets,
 
 void *hashmap_get(hashmap_t *map, const void *key)
 {
-    /* hash to convert key to a bucket index where value would be stored */
-    uint32_t index = map->hash(key) % map->n_buckets;
+    uint64_t hash = map->hash(key), so_key = so_regular(hash);
+    void *value = NULL;
 
-    /* walk through the linked list nodes to find any matches */
-    for (hashmap_kv_t *n = map->buckets[index]; n; n = n->next) {
-        if (map->cmp(n->key, key) == 0)
-            return n->value;
+    ebr_enter();
+
+    /* walk through the run of the bucket, skipping deleted nodes */
+    hashmap_kv_t *n = __atomic_load_n(&bucket_of(map, hash)->next,
+                                      __ATOMIC_ACQUIRE);
+    for (n = UNMARKED(n); n && n->so_key <= so_key;) {
+        hashmap_kv_t *next = __atomic_load_n(&n->next, __ATOMIC_ACQUIRE);
+        if (n->so_key == so_key && !IS_MARKED(next) &&
+            map->cmp(n->key, key) == 0) {
+            value = __atomic_load_n(&n->value, __ATOMIC_ACQUIRE);
+            break;
+        }
+        n = UNMARKED(next);
     }
 
-    return NULL; /* no matches found */
+    ebr_leave();
+    return value; /* NULL if no matches found */
 }
 
 bool hashmap_put(hashmap_t *map, const void *key, void *value)
@@ -63,87 +220,56 @@ bool hashmap_put(hashmap_t *map, const void *key, void *value)
     if (!map)
         return NULL;
 
-    /* hash to convert key to a bucket index where value would be stored */
-    uint32_t bucket_index = map->hash(key) % map->n_buckets;
+    ebr_enter();
 
-    hashmap_kv_t *kv = NULL, *prev = NULL;
-
-    /* known head and next entry to add to the list */
-    hashmap_kv_t *head = NULL, *next = NULL;
+    uint64_t hash = map->hash(key), so_key = so_regular(hash);
+    hashmap_kv_t *head = bucket_of(map, hash);
+    hashmap_kv_t *next = NULL;
 
     while (true) {
-        /* copy the head of the list before checking entries for equality */
-        head = map->buckets[bucket_index];
-
-        /* find any existing matches to this key */
-        prev = NULL;
-        if (head) {
-            for (kv = head; kv; kv = kv->next) {
-                if (map->cmp(key, kv->key) == 0)
-                    break;
-                prev = kv;
-            }
+        hashmap_kv_t **prev, *cur;
+        hashmap_kv_t *kv = list_find(map, head, so_key, key, &prev, &cur);
+
+        if (kv) { /* if the key exists, swap the value in place */
+            void *old = __atomic_exchange_n(&kv->value, value,
+                                            __ATOMIC_ACQ_REL);
+
+            /* the old value and the unused key are never again used */
+            if (!next)
+                next = map->create_node(map->opaque, key, old);
+            else
+                next->value = old;
+            map->destroy_node(map->opaque, next);
+            ebr_leave();
+            return true;
         }
 
-        if (kv) {      /* if the key exists, update and return it */
-            if (!next) /* lazy make the next key-value pair to append */
-                next = map->create_node(map->opaque, key, value);
-
-            /* ensure the linked list's existing node chain persists */
-            next->next = kv->next;
-
-            /* CAS-update the reference in the previous node */
-            if (prev) {
-                /* replace this link, assuming it has not changed by another
-                 * thread
-                 */
-                if (__atomic_compare_exchange(&prev->next, &kv, &next, false,
-                                              __ATOMIC_SEQ_CST,
-                                              __ATOMIC_SEQ_CST)) {
-                    /* this node, key and value are never again used by this */
-                    map->destroy_node(map->opaque, kv);
-                    return true;
-                }
-                hashmap_put_replace_fail += 1;
-            } else { /* no previous link, update the head of the list */
-                /* set the head of the list to be whatever this node points to
-                 * (NULL or other links)
-                 */
-                if (__atomic_compare_exchange(&map->buckets[bucket_index], &kv,
-                                              &next, false, __ATOMIC_SEQ_CST,
-                                              __ATOMIC_SEQ_CST)) {
-                    map->destroy_node(map->opaque, kv);
-                    return true;
-                }
-
-                /* failure means at least one new entry was added, retry the
-                 * whole match/del process
-                 */
-                hashmap_put_head_fail += 1;
-            }
-        } else {       /* if the key does not exist, try adding it */
-            if (!next) /* make the next key-value pair to append */
-                next = map->create_node(map->opaque, key, value);
-            next->next = NULL;
-
-            if (head) /* make sure the reference to existing nodes is kept */
-                next->next = head;
-
-            /* prepend the kv-pair or lazy-make the bucket */
-            if (__atomic_compare_exchange(&map->buckets[bucket_index], &head,
-                                          &next, false, __ATOMIC_SEQ_CST,
-                                          __ATOMIC_SEQ_CST)) {
-                __atomic_fetch_add(&map->length, 1, __ATOMIC_SEQ_CST);
-                return false;
-            }
-
-            /* failure means another thead updated head before this.
-             * track the CAS failure for tests -- non-atomic to minimize
-             * thread contention
-             */
-            hashmap_put_retries += 1;
+        /* if the key does not exist, try adding it before @cur */
+        if (!next) { /* lazy make the next key-value pair to append */
+            next = map->create_node(map->opaque, key, value);
+            next->so_key = so_key;
         }
+        next->next = cur;
+        if (__atomic_compare_exchange_n(prev, &cur, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE))
+            break;
+
+        /* failure means another thead updated the link before this */
+        HOTSTAT_INC(put_retries);
     }
+
+    /* double the buckets once the load factor is exceeded, new buckets are
+     * initialized lazily by the operations touching them
+     */
+    uint32_t length = __atomic_add_fetch(&map->length, 1, __ATOMIC_SEQ_CST);
+    uint32_t n_buckets = __atomic_load_n(&map->n_buckets, __ATOMIC_RELAXED);
+    if (length > LOAD_FACTOR * n_buckets && n_buckets < MAX_BUCKETS)
+        __atomic_compare_exchange_n(&map->n_buckets, &n_buckets,
+                                    n_buckets * 2, false, __ATOMIC_RELEASE,
+                                    __ATOMIC_RELAXED);
+
+    ebr_leave();
+    return false;
 }
 
 bool hashmap_del(hashmap_t *map, const void *key)
@@ -151,45 +277,58 @@ bool hashmap_del(hashmap_t *map, const void *key)
     if (!map)
         return false;
 
-    uint32_t bucket_index = map->hash(key) % map->n_buckets;
+    ebr_enter();
+
+    uint64_t hash = map->hash(key), so_key = so_regular(hash);
+    hashmap_kv_t *head = bucket_of(map, hash);
 
     /* try to find a match, loop in case a delete attempt fails */
     while (true) {
-        hashmap_kv_t *match, *prev = NULL;
-        for (match = map->buckets[bucket_index]; match; match = match->next) {
-            if ((*map->cmp)(key, match->key) == 0)
-                break;
-            prev = match;
+        hashmap_kv_t **prev, *match;
+        if (!list_find(map, head, so_key, key, &prev, &match)) {
+            ebr_leave();
+            return false; /* exit if no match was found */
+        }
+
+        /* logically delete by marking the link to the next node, which fails
+         * if another thread did delete, or inserted after this node
+         */
+        hashmap_kv_t *next = __atomic_load_n(&match->next, __ATOMIC_ACQUIRE);
+        if (IS_MARKED(next) ||
+            !__atomic_compare_exchange_n(&match->next, &next, MARKED(next),
+                                         false, __ATOMIC_ACQ_REL,
+                                         __ATOMIC_ACQUIRE)) {
+            HOTSTAT_INC(del_fail);
+            continue;
         }
+        __atomic_fetch_sub(&map->length, 1, __ATOMIC_SEQ_CST);
 
-        /* exit if no match was found */
-        if (!match)
-            return false;
-
-        /* previous means this not the head but a link in the list */
-        if (prev) { /* try the delete but fail if another thread did delete */
-            if (__atomic_compare_exchange(&prev->next, &match, &match->next,
-                                          false, __ATOMIC_SEQ_CST,
-                                          __ATOMIC_SEQ_CST)) {
-                __atomic_fetch_sub(&map->length, 1, __ATOMIC_SEQ_CST);
-                map->destroy_node(map->opaque, match);
-                return true;
-            }
-            hashmap_del_fail += 1;
-        } else { /* no previous link means this needs to leave empty bucket */
-            /* copy the next link in the list (may be NULL) to the head */
-            if (__atomic_compare_exchange(&map->buckets[bucket_index], &match,
-                                          &match->next, false, __ATOMIC_SEQ_CST,
-                                          __ATOMIC_SEQ_CST)) {
-                __atomic_fetch_sub(&map->length, 1, __ATOMIC_SEQ_CST);
-                map->destroy_node(map->opaque, match);
-                return true;
-            }
-
-            /* failure means whole match/del process needs another attempt */
-            hashmap_del_fail_new_head += 1;
+        /* unlink it, or let a traversal do it when the link has changed */
+        if (__atomic_compare_exchange_n(prev, &match, next, false,
+                                        __ATOMIC_ACQ_REL, __ATOMIC_ACQUIRE)) {
+            map->destroy_node(map->opaque, match);
+        } else {
+            HOTSTAT_INC(del_fail_new_head);
+            list_find(map, head, so_key, key, &prev, &match);
         }
+        ebr_leave();
+        return true;
     }
+}
 
-    return false;
+void hashmap_free(hashmap_t *map)
+{
+    if (!map)
+        return;
+
+    /* the dummy nodes are in the list along with the entries */
+    hashmap_kv_t *n = *bucket_slot(map, 0);
+    while (n) {
+        hashmap_kv_t *next = UNMARKED(n->next);
+        free(n);
+        n = next;
+    }
+    for (int i = 0; i < HASHMAP_SEGMENTS; i++)
+        free(map->segments[i]);
+    free(map);
 }
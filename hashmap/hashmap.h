@@ -1,7 +1,13 @@
 /* Lock-Free Hashmap
  *
- * This implementation is thread-safe and lock-free. It will perform well as
- * long as the initial bucket size is large enough.
+ * This implementation is thread-safe and lock-free. The entries are kept in
+ * split-ordered lists (Shalev and Shavit): one lock-free linked list sorted by
+ * bit-reversed hash, with buckets pointing to dummy nodes of that list. The
+ * number of buckets doubles as entries are added, without moving any entry
+ * and without blocking concurrent operations.
+ *
+ * Deleted nodes are reclaimed with epoch-based reclamation (see ebr.h), which
+ * needs ebr_init() to be called before any map is used.
  */
 
 #ifndef _HASHMAP_H_
@@ -11,17 +17,21 @@
 #include <stdint.h>
 #include <stdlib.h>
 
-/* links in the linked lists that each bucket uses */
+/* links in the split-ordered list, dummy nodes have a NULL key */
 typedef struct hashmap_keyval {
     struct hashmap_keyval *next;
     const void *key;
     void *value;
+    uint64_t so_key; /* split-order key, set by the hashmap */
 } hashmap_kv_t;
 
-/* main hashmap struct with buckets of linked lists */
+/* Bucket b is in segment log2(b) + 1, or 0 for bucket 0 */
+#define HASHMAP_SEGMENTS 32
+
+/* main hashmap struct with buckets pointing into the split-ordered list */
 typedef struct {
-    hashmap_kv_t **buckets;
-    uint32_t n_buckets;
+    hashmap_kv_t **segments[HASHMAP_SEGMENTS];
+    uint32_t n_buckets; /* power of 2, grown from length */
 
     uint32_t length; /* total count of entries */
 
@@ -29,13 +39,17 @@ typedef struct {
     uint64_t (*hash)(const void *key);
     uint8_t (*cmp)(const void *x, const void *y);
 
-    /* custom memory management of internal linked lists */
+    /* custom memory management of internal linked lists, the default only
+     * retires the node with ebr_retire(), keys and values are not owned
+     */
     void *opaque;
     hashmap_kv_t *(*create_node)(void *opaque, const void *key, void *data);
     void (*destroy_node)(void *opaque, hashmap_kv_t *node);
 } hashmap_t;
 
-/* Create and initialize a new hashmap */
+/* Create and initialize a new hashmap. @hint is the initial number of buckets,
+ * which grows as needed.
+ */
 void *hashmap_new(uint32_t hint,
                   uint8_t cmp(const void *x, const void *y),
                   uint64_t hash(const void *key));
@@ -55,4 +69,10 @@ bool hashmap_put(hashmap_t *map, const void *key, void *value);
  */
 bool hashmap_del(hashmap_t *map, const void *key);
 
+/* Free the map and the nodes still in it with free(), once no thread uses it
+ * anymore. Keys and values are not owned, nodes already deleted are left to
+ * EBR.
+ */
+void hashmap_free(hashmap_t *map);
+
 #endif
@@ -0,0 +1,194 @@
+#include <stdlib.h>
+
+#include "hashmap_cl.h"
+
+_Static_assert(sizeof(hashmap_cl_line_t) == 64,
+               "a bucket line must fill exactly one cache line");
+
+static void bucket_lock(hashmap_cl_line_t *b)
+{
+    while (true) {
+        uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+        if (!(seq & 1) &&
+            __atomic_compare_exchange_n(&b->seq, &seq, seq + 1, false,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        hashmap_cpu_relax();
+    }
+
+    /* order the lock before the slot updates, for optimistic readers */
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+static void bucket_unlock(hashmap_cl_line_t *b)
+{
+    uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);
+    __atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELEASE);
+}
+
+/* Look for @key in a locked bucket, return its line and set *slot_out */
+static hashmap_cl_line_t *bucket_find(hashmap_cl_t *map,
+                                      hashmap_cl_line_t *b,
+                                      uint8_t fp,
+                                      const void *key,
+                                      int *slot_out)
+{
+    for (hashmap_cl_line_t *line = b; line; line = line->next) {
+        for (uint32_t m = hashmap_match_tags(line->tags, fp); m; m &= m - 1) {
+            int i = hashmap_first_slot(m);
+            if (i < HASHMAP_CL_SLOTS && line->tag[i] == fp &&
+                map->cmp(line->key[i], key) == 0) {
+                *slot_out = i;
+                return line;
+            }
+        }
+    }
+    return NULL;
+}
+
+hashmap_cl_t *hashmap_cl_new(uint32_t hint,
+                             uint8_t cmp(const void *x, const void *y),
+                             uint64_t hash(const void *key))
+{
+    hashmap_cl_t *map = calloc(1, sizeof(hashmap_cl_t));
+    if (!map)
+        return NULL;
+
+    uint32_t n_buckets = 1;
+    while (n_buckets < hint && n_buckets < (1U << 31))
+        n_buckets <<= 1;
+
+    if (posix_memalign((void **) &map->buckets, sizeof(hashmap_cl_line_t),
+                       n_buckets * sizeof(hashmap_cl_line_t))) {
+        free(map);
+        return NULL;
+    }
+    for (uint32_t i = 0; i < n_buckets; i++)
+        map->buckets[i] = (hashmap_cl_line_t){.seq = 0};
+    map->mask = n_buckets - 1;
+
+    /* keep local reference of the two utility functions */
+    map->hash = hash;
+    map->cmp = cmp;
+    return map;
+}
+
+void hashmap_cl_free(hashmap_cl_t *map)
+{
+    for (uint32_t i = 0; i <= map->mask; i++) {
+        hashmap_cl_line_t *line = map->buckets[i].next;
+        while (line) {
+            hashmap_cl_line_t *next = line->next;
+            free(line);
+            line = next;
+        }
+    }
+    free(map->buckets);
+    free(map);
+}
+
+void *hashmap_cl_get(hashmap_cl_t *map, const void *key)
+{
+    uint64_t hash = map->hash(key);
+    uint8_t fp = hashmap_fingerprint(hash);
+    hashmap_cl_line_t *b = &map->buckets[hash & map->mask];
+
+retry:;
+    uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);
+    if (seq & 1) { /* a writer holds the bucket */
+        hashmap_cpu_relax();
+        goto retry;
+    }
+
+    for (hashmap_cl_line_t *line = b; line;
+         line = __atomic_load_n(&line->next, __ATOMIC_ACQUIRE)) {
+        uint32_t tags = __atomic_load_n(&line->tags, __ATOMIC_RELAXED);
+        for (uint32_t m = hashmap_match_tags(tags, fp); m; m &= m - 1) {
+            int i = hashmap_first_slot(m);
+            if (i >= HASHMAP_CL_SLOTS)
+                break;
+            const void *k = __atomic_load_n(&line->key[i], __ATOMIC_RELAXED);
+            void *v = __atomic_load_n(&line->value[i], __ATOMIC_RELAXED);
+
+            /* the slot is consistent only if no writer came by */
+            __atomic_thread_fence(__ATOMIC_ACQUIRE);
+            if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+                goto retry;
+            if (((tags >> (i * 8)) & 0xff) == fp && map->cmp(k, key) == 0)
+                return v;
+        }
+    }
+
+    /* a miss is only a miss if the bucket did not change meanwhile */
+    __atomic_thread_fence(__ATOMIC_ACQUIRE);
+    if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)
+        goto retry;
+    return NULL;
+}
+
+bool hashmap_cl_put(hashmap_cl_t *map, const void *key, void *value)
+{
+    uint64_t hash = map->hash(key);
+    uint8_t fp = hashmap_fingerprint(hash);
+    hashmap_cl_line_t *b = &map->buckets[hash & map->mask];
+    int i;
+
+    bucket_lock(b);
+
+    /* if the key exists, swap the value in place */
+    hashmap_cl_line_t *line = bucket_find(map, b, fp, key, &i);
+    if (line) {
+        __atomic_store_n(&line->value[i], value, __ATOMIC_RELAXED);
+        bucket_unlock(b);
+        return true;
+    }
+
+    /* take the first empty slot, or chain a new line at the end */
+    hashmap_cl_line_t *last = NULL;
+    for (line = b; line; last = line, line = line->next) {
+        for (i = 0; i < HASHMAP_CL_SLOTS; i++)
+            if (!line->tag[i])
+                goto found;
+    }
+    if (posix_memalign((void **) &line, sizeof(hashmap_cl_line_t),
+                       sizeof(hashmap_cl_line_t))) {
+        bucket_unlock(b);
+        abort();
+    }
+    *line = (hashmap_cl_line_t){.seq = 0};
+    i = 0;
+    line->key[0] = key;
+    line->value[0] = value;
+    line->tag[0] = fp;
+    __atomic_store_n(&last->next, line, __ATOMIC_RELEASE);
+    goto out;
+
+found:
+    __atomic_store_n(&line->key[i], key, __ATOMIC_RELAXED);
+    __atomic_store_n(&line->value[i], value, __ATOMIC_RELAXED);
+    __atomic_store_n(&line->tag[i], fp, __ATOMIC_RELAXED);
+
+out:
+    __atomic_fetch_add(&map->length, 1, __ATOMIC_RELAXED);
+    bucket_unlock(b);
+    return false;
+}
+
+bool hashmap_cl_del(hashmap_cl_t *map, const void *key)
+{
+    uint64_t hash = map->hash(key);
+    uint8_t fp = hashmap_fingerprint(hash);
+    hashmap_cl_line_t *b = &map->buckets[hash & map->mask];
+    int i;
+
+    bucket_lock(b);
+    hashmap_cl_line_t *line = bucket_find(map, b, fp, key, &i);
+    if (line) {
+        __atomic_store_n(&line->tag[i], 0, __ATOMIC_RELAXED);
+        __atomic_store_n(&line->key[i], NULL, __ATOMIC_RELAXED);
+        __atomic_store_n(&line->value[i], NULL, __ATOMIC_RELAXED);
+        __atomic_fetch_sub(&map->length, 1, __ATOMIC_RELAXED);
+    }
+    bucket_unlock(b);
+    return line != NULL;
+}
@@ -0,0 +1,77 @@
+/* Cache-line Hashmap
+ *
+ * An alternative layout of the hashmap for lookup-heavy workloads. Each bucket
+ * is a chain of 64-byte cache lines, and each line holds a version, an 8-bit
+ * fingerprint per slot of the line, the link to an overflow line and the keys
+ * and values of its slots inline. A lookup loads the bucket line and compares
+ * all fingerprints at once, and only dereferences and compares the keys whose
+ * fingerprint matches.
+ *
+ * The version of a bucket's first line is a sequence lock. Insertions and
+ * deletions lock the bucket they modify with its low bit, so writers on
+ * other buckets never wait for each other. Lookups take no lock: they read
+ * the slots optimistically and retry if the version changed meanwhile, and
+ * so wait while a writer holds the bucket.
+ *
+ * The number of buckets is set at creation time from @hint and buckets grow
+ * by overflow lines instead. Overflow lines are only released by
+ * hashmap_cl_free(), and slots emptied by deletions are reused.
+ */
+
+#ifndef _HASHMAP_CL_H_
+#define _HASHMAP_CL_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+
+#include "hashmap_define.h"
+
+/* a fingerprint always has the top bit set, 0 marks an empty slot */
+typedef struct hashmap_cl_line {
+    uint32_t seq; /* odd while locked, only used in the first line */
+    union {
+        uint8_t tag[4];
+        uint32_t tags;
+    };
+    struct hashmap_cl_line *next;
+    const void *key[HASHMAP_CL_SLOTS];
+    void *value[HASHMAP_CL_SLOTS];
+} __attribute__((aligned(64))) hashmap_cl_line_t;
+
+typedef struct {
+    hashmap_cl_line_t *buckets;
+    uint32_t mask; /* number of buckets - 1 */
+
+    uint32_t length; /* total count of entries */
+
+    /* pointer to the hash and comparison functions */
+    uint64_t (*hash)(const void *key);
+    uint8_t (*cmp)(const void *x, const void *y);
+} hashmap_cl_t;
+
+/* Create and initialize a new hashmap, with @hint rounded up to a power of 2
+ * buckets.
+ */
+hashmap_cl_t *hashmap_cl_new(uint32_t hint,
+                             uint8_t cmp(const void *x, const void *y),
+                             uint64_t hash(const void *key));
+
+/* Free the hashmap, which must no longer be in use. Keys and values are owned
+ * by the caller.
+ */
+void hashmap_cl_free(hashmap_cl_t *map);
+
+/* Return a value mapped to key or NULL, if no entry exists for the given */
+void *hashmap_cl_get(hashmap_cl_t *map, const void *key);
+
+/* Put the given key-value pair in the map.
+ * @return true if an existing matching key was replaced.
+ */
+bool hashmap_cl_put(hashmap_cl_t *map, const void *key, void *value);
+
+/* Remove the given key-value pair in the map.
+ * @return true if a key was found.
+ */
+bool hashmap_cl_del(hashmap_cl_t *map, const void *key);
+
+#endif
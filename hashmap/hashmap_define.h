@@ -0,0 +1,274 @@
+/* Type-specialized Hashmap
+ *
+ * HASHMAP_DEFINE(name, key_t, hash_fn, eq_fn) defines a cache-line hashmap
+ * (see hashmap_cl.h) for keys of type @key_t, stored by value in the lines.
+ * @hash_fn(key_t) returns a uint64_t hash and @eq_fn(key_t, key_t) is true if
+ * both keys are equal. Both are called directly, so the compiler can inline
+ * them, which matters for small keys such as integers and fixed-length
+ * strings where the indirect calls would dominate a lookup.
+ *
+ * The following are defined, all static:
+ *
+ *   name_t *name_new(uint32_t hint);
+ *   void name_free(name_t *map);
+ *   void *name_get(name_t *map, key_t key);
+ *   bool name_put(name_t *map, key_t key, void *value);
+ *   bool name_del(name_t *map, key_t key);
+ *
+ * with the same semantics as their hashmap_cl_ counterparts.
+ *
+ * A line keeps 16 bytes of header and fits as many slots, up to
+ * HASHMAP_CL_SLOTS, as there is room for a key and a value pointer in the
+ * other 48: 3 for keys of up to 8 bytes, 2 up to 16 bytes, 1 up to 40 bytes.
+ * Larger keys do not fit in a line and fail to compile, store pointers to
+ * them instead.
+ */
+
+#ifndef _HASHMAP_DEFINE_H_
+#define _HASHMAP_DEFINE_H_
+
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+
+#define HASHMAP_CL_SLOTS 3
+
+#if defined(__x86_64__) || defined(__i386__)
+#define hashmap_cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define hashmap_cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+/* the low bits of the hash select the bucket, so take the fingerprint from the
+ * top bits of a multiplicative mix, which also works for identity hashes. A
+ * fingerprint always has the top bit set, 0 marks an empty slot.
+ */
+static inline uint8_t hashmap_fingerprint(uint64_t hash)
+{
+    return 0x80 | (uint8_t)((hash * 0x9E3779B97F4A7C15ULL) >> 57);
+}
+
+/* Compare the 4 fingerprints of a line at once, SIMD within a register: a
+ * byte of the result has its top bit set where tags match @fp. Bytes above a
+ * match may be reported as well, so matches are confirmed by comparing keys.
+ */
+static inline uint32_t hashmap_match_tags(uint32_t tags, uint8_t fp)
+{
+    uint32_t x = tags ^ (0x01010101U * fp);
+    return (x - 0x01010101U) & ~x & 0x80808080U;
+}
+
+/* slot of the lowest byte set in a hashmap_match_tags() result */
+static inline int hashmap_first_slot(uint32_t m)
+{
+    return __builtin_ctz(m) >> 3;
+}
+
+/* hash and equality of integer keys, usable with HASHMAP_DEFINE */
+static inline uint64_t hashmap_hash_u64(uint64_t key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdULL;
+    key ^= key >> 33;
+    return key;
+}
+
+static inline bool hashmap_eq_u64(uint64_t x, uint64_t y)
+{
+    return x == y;
+}
+
+/* slots per line for keys of type @key_t, see above */
+#define HASHMAP_LINE_SLOTS(key_t)                                    \
+    (48 / (sizeof(key_t) + sizeof(void *)) < HASHMAP_CL_SLOTS        \
+         ? 48 / (sizeof(key_t) + sizeof(void *))                     \
+         : HASHMAP_CL_SLOTS)
+
+/* Readers copy keys out of a line without locking it, as for the pointers of
+ * the generic map the copy is only used once the bucket version validated it.
+ */
+#define HASHMAP_DEFINE(name, key_t, hash_fn, eq_fn)                           \
+    enum { name##_slots = HASHMAP_LINE_SLOTS(key_t) };                         \
+    _Static_assert(name##_slots > 0, #key_t " is too large for a line");       \
+                                                                               \
+    typedef struct name##_line {                                               \
+        uint32_t seq;                                                          \
+        union {                                                                \
+            uint8_t tag[4];                                                    \
+            uint32_t tags;                                                     \
+        };                                                                     \
+        struct name##_line *next;                                              \
+        key_t key[name##_slots];                                               \
+        void *value[name##_slots];                                             \
+    } __attribute__((aligned(64))) name##_line_t;                              \
+    _Static_assert(sizeof(name##_line_t) == 64,                                \
+                   #name " lines must be a single cache line");                \
+                                                                               \
+    typedef struct {                                                           \
+        name##_line_t *buckets;                                                \
+        uint32_t mask;                                                         \
+        uint32_t length;                                                       \
+    } name##_t;                                                                \
+                                                                               \
+    static inline void name##_lock(name##_line_t *b)                           \
+    {                                                                          \
+        while (true) {                                                         \
+            uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);         \
+            if (!(seq & 1) &&                                                  \
+                __atomic_compare_exchange_n(&b->seq, &seq, seq + 1, false,     \
+                                            __ATOMIC_ACQUIRE,                  \
+                                            __ATOMIC_RELAXED))                 \
+                break;                                                         \
+            hashmap_cpu_relax();                                               \
+        }                                                                      \
+        __atomic_thread_fence(__ATOMIC_RELEASE);                               \
+    }                                                                          \
+                                                                               \
+    static inline void name##_unlock(name##_line_t *b)                         \
+    {                                                                          \
+        uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_RELAXED);             \
+        __atomic_store_n(&b->seq, seq + 1, __ATOMIC_RELEASE);                  \
+    }                                                                          \
+                                                                               \
+    static inline name##_line_t *name##_find(name##_line_t *b, uint8_t fp,     \
+                                             key_t key, int *slot_out)         \
+    {                                                                          \
+        for (name##_line_t *line = b; line; line = line->next) {               \
+            for (uint32_t m = hashmap_match_tags(line->tags, fp); m;           \
+                 m &= m - 1) {                                                 \
+                int i = hashmap_first_slot(m);                                 \
+                if (i < name##_slots && line->tag[i] == fp &&                  \
+                    eq_fn(line->key[i], key)) {                                \
+                    *slot_out = i;                                             \
+                    return line;                                               \
+                }                                                              \
+            }                                                                  \
+        }                                                                      \
+        return NULL;                                                           \
+    }                                                                          \
+                                                                               \
+    static __attribute__((unused)) name##_t *name##_new(uint32_t hint)         \
+    {                                                                          \
+        name##_t *map = calloc(1, sizeof(name##_t));                           \
+        if (!map)                                                              \
+            return NULL;                                                       \
+        uint32_t n_buckets = 1;                                                \
+        while (n_buckets < hint && n_buckets < (1U << 31))                     \
+            n_buckets <<= 1;                                                   \
+        if (posix_memalign((void **) &map->buckets, sizeof(name##_line_t),     \
+                           n_buckets * sizeof(name##_line_t))) {               \
+            free(map);                                                         \
+            return NULL;                                                       \
+        }                                                                      \
+        for (uint32_t i = 0; i < n_buckets; i++)                               \
+            map->buckets[i] = (name##_line_t){.seq = 0};                       \
+        map->mask = n_buckets - 1;                                             \
+        return map;                                                            \
+    }                                                                          \
+                                                                               \
+    static __attribute__((unused)) void name##_free(name##_t *map)             \
+    {                                                                          \
+        for (uint32_t i = 0; i <= map->mask; i++) {                            \
+            name##_line_t *line = map->buckets[i].next;                        \
+            while (line) {                                                     \
+                name##_line_t *next = line->next;                              \
+                free(line);                                                    \
+                line = next;                                                   \
+            }                                                                  \
+        }                                                                      \
+        free(map->buckets);                                                    \
+        free(map);                                                             \
+    }                                                                          \
+                                                                               \
+    static __attribute__((unused)) void *name##_get(name##_t *map, key_t key)  \
+    {                                                                          \
+        uint64_t hash = hash_fn(key);                                          \
+        uint8_t fp = hashmap_fingerprint(hash);                                \
+        name##_line_t *b = &map->buckets[hash & map->mask];                    \
+    retry:;                                                                    \
+        uint32_t seq = __atomic_load_n(&b->seq, __ATOMIC_ACQUIRE);             \
+        if (seq & 1) {                                                         \
+            hashmap_cpu_relax();                                               \
+            goto retry;                                                        \
+        }                                                                      \
+        for (name##_line_t *line = b; line;                                    \
+             line = __atomic_load_n(&line->next, __ATOMIC_ACQUIRE)) {          \
+            uint32_t tags = __atomic_load_n(&line->tags, __ATOMIC_RELAXED);    \
+            for (uint32_t m = hashmap_match_tags(tags, fp); m; m &= m - 1) {   \
+                int i = hashmap_first_slot(m);                                 \
+                if (i >= name##_slots)                                         \
+                    break;                                                     \
+                key_t k = line->key[i];                                        \
+                void *v = __atomic_load_n(&line->value[i], __ATOMIC_RELAXED);  \
+                __atomic_thread_fence(__ATOMIC_ACQUIRE);                       \
+                if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)         \
+                    goto retry;                                                \
+                if (((tags >> (i * 8)) & 0xff) == fp && eq_fn(k, key))         \
+                    return v;                                                  \
+            }                                                                  \
+        }                                                                      \
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);                               \
+        if (__atomic_load_n(&b->seq, __ATOMIC_RELAXED) != seq)                 \
+            goto retry;                                                        \
+        return NULL;                                                           \
+    }                                                                          \
+                                                                               \
+    static __attribute__((unused)) bool name##_put(name##_t *map, key_t key,   \
+                                                   void *value)                \
+    {                                                                          \
+        uint64_t hash = hash_fn(key);                                          \
+        uint8_t fp = hashmap_fingerprint(hash);                                \
+        name##_line_t *b = &map->buckets[hash & map->mask];                    \
+        int i;                                                                 \
+        name##_lock(b);                                                        \
+        name##_line_t *line = name##_find(b, fp, key, &i);                     \
+        if (line) {                                                            \
+            __atomic_store_n(&line->value[i], value, __ATOMIC_RELAXED);        \
+            name##_unlock(b);                                                  \
+            return true;                                                       \
+        }                                                                      \
+        name##_line_t *last = NULL;                                            \
+        for (line = b; line; last = line, line = line->next) {                 \
+            for (i = 0; i < name##_slots; i++)                                 \
+                if (!line->tag[i])                                             \
+                    goto found;                                                \
+        }                                                                      \
+        if (posix_memalign((void **) &line, sizeof(name##_line_t),             \
+                           sizeof(name##_line_t))) {                           \
+            name##_unlock(b);                                                  \
+            abort();                                                           \
+        }                                                                      \
+        *line = (name##_line_t){.seq = 0};                                     \
+        line->key[0] = key;                                                    \
+        line->value[0] = value;                                                \
+        line->tag[0] = fp;                                                     \
+        __atomic_store_n(&last->next, line, __ATOMIC_RELEASE);                 \
+        goto out;                                                              \
+    found:                                                                     \
+        line->key[i] = key;                                                    \
+        __atomic_store_n(&line->value[i], value, __ATOMIC_RELAXED);            \
+        __atomic_store_n(&line->tag[i], fp, __ATOMIC_RELAXED);                 \
+    out:                                                                       \
+        __atomic_fetch_add(&map->length, 1, __ATOMIC_RELAXED);                 \
+        name##_unlock(b);                                                      \
+        return false;                                                          \
+    }                                                                          \
+                                                                               \
+    static __attribute__((unused)) bool name##_del(name##_t *map, key_t key)   \
+    {                                                                          \
+        uint64_t hash = hash_fn(key);                                          \
+        uint8_t fp = hashmap_fingerprint(hash);                                \
+        name##_line_t *b = &map->buckets[hash & map->mask];                    \
+        int i;                                                                 \
+        name##_lock(b);                                                        \
+        name##_line_t *line = name##_find(b, fp, key, &i);                     \
+        if (line) {                                                            \
+            __atomic_store_n(&line->tag[i], 0, __ATOMIC_RELAXED);              \
+            __atomic_store_n(&line->value[i], NULL, __ATOMIC_RELAXED);         \
+            __atomic_fetch_sub(&map->length, 1, __ATOMIC_RELAXED);             \
+        }                                                                      \
+        name##_unlock(b);                                                      \
+        return line != NULL;                                                   \
+    }
+
+#endif
@@ -3,10 +3,14 @@
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <unistd.h>
 
-#include "free_later.h"
+#include "ebr.h"
 #include "hashmap.h"
+#include "hashmap_cl.h"
+#include "hashmap_define.h"
+#include "../hotstat/hotstat.h"
 
 /* global hash map */
 static hashmap_t *map = NULL;
@@ -25,9 +29,11 @@ static pthread_t threads_del[N_THREADS * 2];
 
 static uint32_t MAX_VAL_PLUS_ONE = N_THREADS * N_LOOPS + 1;
 
-extern volatile uint32_t hashmap_del_fail, hashmap_del_fail_new_head;
-extern volatile uint32_t hashmap_put_retries, hashmap_put_replace_fail;
-extern volatile uint32_t hashmap_put_head_fail;
+/* the CAS retries of the map since @base, from its hotstat counters */
+static uint64_t retries_since(const char *name, uint64_t base)
+{
+    return hotstat_value(name) - base;
+}
 
 static uint8_t cmp_uint32(const void *x, const void *y)
 {
@@ -115,12 +121,304 @@ bool mt_del_vals(void)
     return true;
 }
 
+/* Grow a map created with a single bucket from several threads at once */
+#define N_GROW 20000
+
+static void *add_grow_vals(void *args)
+{
+    int *offset = args;
+    for (int j = 0; j < N_GROW; j++) {
+        uint32_t *val = malloc(sizeof(uint32_t));
+        *val = (*offset * N_GROW) + j;
+        hashmap_put(map, val, val);
+    }
+    return NULL;
+}
+
+bool test_grow()
+{
+    map = hashmap_new(1, cmp_uint32, hash_uint32);
+
+    int offsets[4];
+    for (int i = 0; i < 4; i++) {
+        offsets[i] = i;
+        if (pthread_create(&threads[i], NULL, add_grow_vals, &offsets[i])) {
+            printf("Failed to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    uint32_t TOTAL = 4 * N_GROW, found = 0;
+    for (uint32_t i = 0; i < TOTAL; i++) {
+        uint32_t *v = hashmap_get(map, &i);
+        if (v && *v == i)
+            found++;
+    }
+    if (found != TOTAL || map->length != TOTAL) {
+        printf("Found %u of %u values after growing\n", found, TOTAL);
+        return false;
+    }
+
+    /* delete every other key, which must not affect the others */
+    for (uint32_t i = 0; i < TOTAL; i += 2) {
+        if (!hashmap_del(map, &i)) {
+            printf("Could not delete %u\n", i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < TOTAL; i++) {
+        uint32_t *v = hashmap_get(map, &i);
+        if ((i % 2 == 0) != (v == NULL)) {
+            printf("Unexpected lookup result for %u\n", i);
+            return false;
+        }
+    }
+
+    printf("Done. Grew to %u buckets for %u entries\n", map->n_buckets,
+           TOTAL);
+    return true;
+}
+
+/* Churn a few keys from several threads and count the reclaimed nodes */
+#define N_CHURN 50000
+
+static uint32_t n_retired = 0, n_released = 0;
+
+static void release_counted(void *node)
+{
+    __atomic_fetch_add(&n_released, 1, __ATOMIC_RELAXED);
+    free(node);
+}
+
+static void destroy_node_counted(void *opaque, hashmap_kv_t *node)
+{
+    __atomic_fetch_add(&n_retired, 1, __ATOMIC_RELAXED);
+    ebr_retire(node, release_counted);
+}
+
+static void *churn_vals(void *args)
+{
+    uint32_t *keys = args;
+    for (int j = 0; j < N_CHURN; j++) {
+        uint32_t *k = &keys[j % 8];
+        hashmap_put(map, k, k);
+        hashmap_del(map, k);
+    }
+    return NULL;
+}
+
+bool test_reclaim()
+{
+    map = hashmap_new(8, cmp_uint32, hash_uint32);
+    map->destroy_node = destroy_node_counted;
+
+    uint32_t keys[4][8];
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < 8; j++)
+            keys[i][j] = i * 8 + j;
+        if (pthread_create(&threads[i], NULL, churn_vals, keys[i])) {
+            printf("Failed to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    /* without any global quiescent point, almost everything is released */
+    uint32_t pending = n_retired - n_released;
+    if (n_retired < 4 * N_CHURN || pending > n_retired / 100) {
+        printf("%u of %u retired nodes are not released\n", pending,
+               n_retired);
+        return false;
+    }
+
+    printf("Done. Released %u of %u retired nodes\n", n_released, n_retired);
+    return true;
+}
+
+/* Fill a cache-line map with few buckets while a reader looks up keys that
+ * were there from the start, which must never go missing
+ */
+#define N_CL 5000
+
+static hashmap_cl_t *cl_map = NULL;
+static uint32_t cl_keys[5][N_CL];
+static bool cl_done = false;
+
+static void *cl_add_vals(void *args)
+{
+    uint32_t *keys = args;
+    for (int j = 0; j < N_CL; j++)
+        hashmap_cl_put(cl_map, &keys[j], &keys[j]);
+    return NULL;
+}
+
+static void *cl_get_vals(void *args)
+{
+    intptr_t missing = 0;
+    while (!__atomic_load_n(&cl_done, __ATOMIC_ACQUIRE)) {
+        for (uint32_t j = 0; j < N_CL; j++) {
+            uint32_t *v = hashmap_cl_get(cl_map, &j);
+            if (!v || *v != j)
+                missing++;
+        }
+    }
+    return (void *) missing;
+}
+
+bool test_cl()
+{
+    cl_map = hashmap_cl_new(64, cmp_uint32, hash_uint32);
+    for (int i = 0; i < 5; i++)
+        for (int j = 0; j < N_CL; j++)
+            cl_keys[i][j] = i * N_CL + j;
+    cl_add_vals(cl_keys[0]);
+
+    pthread_t reader;
+    pthread_create(&reader, NULL, cl_get_vals, NULL);
+    for (int i = 0; i < 4; i++) {
+        if (pthread_create(&threads[i], NULL, cl_add_vals, cl_keys[i + 1])) {
+            printf("Failed to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+    __atomic_store_n(&cl_done, true, __ATOMIC_RELEASE);
+    void *missing;
+    pthread_join(reader, &missing);
+    if (missing) {
+        printf("Lookups missed %ld values during inserts\n", (long) missing);
+        return false;
+    }
+
+    uint32_t TOTAL = 5 * N_CL;
+    for (uint32_t i = 0; i < TOTAL; i++) {
+        uint32_t *v = hashmap_cl_get(cl_map, &i);
+        if (!v || *v != i || cl_map->length != TOTAL) {
+            printf("Cound not find %u in the map\n", i);
+            return false;
+        }
+    }
+
+    /* delete every other key, then re-add them into the freed slots */
+    for (uint32_t i = 0; i < TOTAL; i += 2)
+        hashmap_cl_del(cl_map, &i);
+    for (uint32_t i = 0; i < TOTAL; i++) {
+        if ((i % 2 == 0) != (hashmap_cl_get(cl_map, &i) == NULL)) {
+            printf("Unexpected lookup result for %u\n", i);
+            return false;
+        }
+    }
+    for (uint32_t i = 0; i < TOTAL; i += 2) {
+        uint32_t *k = &cl_keys[i / N_CL][i % N_CL];
+        if (hashmap_cl_put(cl_map, k, k)) {
+            printf("Deleted key %u was replaced\n", i);
+            return false;
+        }
+    }
+    if (cl_map->length != TOTAL) {
+        printf("Found %u of %u values\n", cl_map->length, TOTAL);
+        return false;
+    }
+
+    hashmap_cl_free(cl_map);
+    printf("Done. Cache-line map holds %u entries\n", TOTAL);
+    return true;
+}
+
+/* Specialized maps for integer and fixed-length string keys */
+HASHMAP_DEFINE(u64map, uint64_t, hashmap_hash_u64, hashmap_eq_u64)
+
+typedef struct {
+    char s[16];
+} name16_t;
+
+static inline uint64_t hash_name16(name16_t k)
+{
+    uint64_t a, b;
+    memcpy(&a, k.s, 8);
+    memcpy(&b, k.s + 8, 8);
+    return hashmap_hash_u64(a ^ hashmap_hash_u64(b));
+}
+
+static inline bool eq_name16(name16_t x, name16_t y)
+{
+    return memcmp(x.s, y.s, sizeof(x.s)) == 0;
+}
+
+HASHMAP_DEFINE(namemap, name16_t, hash_name16, eq_name16)
+
+static u64map_t *u64_map = NULL;
+
+static void *u64_add_vals(void *args)
+{
+    uint64_t *keys = args;
+    for (int j = 0; j < N_CL; j++)
+        u64map_put(u64_map, keys[j], &keys[j]);
+    return NULL;
+}
+
+bool test_define()
+{
+    static uint64_t keys[4][N_CL];
+
+    u64_map = u64map_new(256);
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < N_CL; j++)
+            keys[i][j] = (uint64_t) (i * N_CL + j) << 32;
+        if (pthread_create(&threads[i], NULL, u64_add_vals, keys[i])) {
+            printf("Failed to create thread %d\n", i);
+            exit(1);
+        }
+    }
+    for (int i = 0; i < 4; i++)
+        pthread_join(threads[i], NULL);
+
+    for (int i = 0; i < 4; i++) {
+        for (int j = 0; j < N_CL; j++) {
+            uint64_t *v = u64map_get(u64_map, keys[i][j]);
+            if (!v || *v != keys[i][j]) {
+                printf("Cound not find %lu in the map\n",
+                       (unsigned long) keys[i][j]);
+                return false;
+            }
+        }
+    }
+    if (u64_map->length != 4 * N_CL || !u64map_del(u64_map, keys[0][0]) ||
+        u64map_get(u64_map, keys[0][0]) || u64map_del(u64_map, keys[0][0])) {
+        printf("Unexpected integer map state\n");
+        return false;
+    }
+    u64map_free(u64_map);
+
+    namemap_t *names = namemap_new(4);
+    name16_t a = {"alpha"}, b = {"beta"}, c = {"alpha"};
+    int va = 1, vb = 2, vc = 3;
+    if (namemap_put(names, a, &va) || namemap_put(names, b, &vb) ||
+        !namemap_put(names, c, &vc) || namemap_get(names, a) != &vc ||
+        namemap_get(names, b) != &vb || names->length != 2) {
+        printf("Unexpected string map state\n");
+        return false;
+    }
+    namemap_free(names);
+
+    printf("Done. Specialized maps hold %u entries\n", 4 * N_CL);
+    return true;
+}
+
 bool test_add()
 {
     map = hashmap_new(10, cmp_uint32, hash_uint32);
 
     int loops = 0;
-    while (hashmap_put_retries == 0) {
+
+    /* only count the retries of this test */
+    uint64_t put_retries = hotstat_value("hashmap.put_retries");
+
+    while (retries_since("hashmap.put_retries", put_retries) == 0) {
         loops += 1;
         if (!mt_add_vals()) {
             printf("Error. Failed to add values!\n");
@@ -139,11 +437,8 @@ bool test_add()
             }
         }
         if (found == TOTAL) {
-            printf(
-                "Loop %d. All values found. hashmap_put_retries=%u, "
-                "hashmap_put_head_fail=%u, hashmap_put_replace_fail=%u\n",
-                loops, hashmap_put_retries, hashmap_put_head_fail,
-                hashmap_put_replace_fail);
+            printf("Loop %d. All values found. hashmap.put_retries=%lu\n",
+                   loops, retries_since("hashmap.put_retries", put_retries));
         } else {
             printf("Found %u of %u values. Where are the missing?", found,
                    TOTAL);
@@ -159,10 +454,13 @@ bool test_del()
     /* keep looping until a CAS retry was needed by hashmap_del */
     uint32_t loops = 0;
 
-    /* make sure test counters are zeroed */
-    hashmap_del_fail = hashmap_del_fail_new_head = 0;
+    /* only count the retries of this test */
+    uint64_t del_fail = hotstat_value("hashmap.del_fail");
+    uint64_t del_fail_new_head = hotstat_value("hashmap.del_fail_new_head");
 
-    while (hashmap_del_fail == 0 || hashmap_del_fail_new_head == 0) {
+    while (retries_since("hashmap.del_fail", del_fail) == 0 ||
+           retries_since("hashmap.del_fail_new_head", del_fail_new_head) ==
+               0) {
         map = hashmap_new(10, cmp_uint32, hash_uint32);
 
         /* multi-threaded add values */
@@ -193,7 +491,24 @@ bool test_del()
 
 int main()
 {
-    free_later_init();
+    ebr_init();
+
+    if (!test_grow()) {
+        printf("Failed to run multi-threaded growth test.");
+        return 3;
+    }
+    if (!test_reclaim()) {
+        printf("Failed to run multi-threaded reclamation test.");
+        return 4;
+    }
+    if (!test_cl()) {
+        printf("Failed to run cache-line hashmap test.");
+        return 5;
+    }
+    if (!test_define()) {
+        printf("Failed to run specialized hashmap test.");
+        return 6;
+    }
 
     if (!test_add()) {
         printf("Failed to run multi-threaded addition test.");
@@ -204,6 +519,6 @@ int main()
         return 2;
     }
 
-    free_later_exit();
+    ebr_exit();
     return 0;
 }
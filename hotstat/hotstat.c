@@ -0,0 +1,350 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+/* Whatever the flags of the program it is linked into */
+#ifndef HOTSTAT
+#define HOTSTAT
+#endif
+#include "hotstat.h"
+
+#define DEFAULT_PERIOD_MS 100
+
+__thread struct hotstat_thread *hotstat_self;
+
+/* The names, the blocks of the live threads, and the totals of the threads
+ * that exited, all under the lock
+ */
+static struct {
+    pthread_mutex_t lock;
+    pthread_once_t once;
+    pthread_key_t key;
+    int n_counters, n_histograms;
+    const char *counters[HOTSTAT_MAX_COUNTERS];
+    const char *histograms[HOTSTAT_MAX_HISTOGRAMS];
+    struct hotstat_thread *threads;
+    int n_threads;
+    struct hotstat_thread gone;
+} reg = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .once = PTHREAD_ONCE_INIT,
+};
+
+static void hist_add(struct hotstat_hist *to, const struct hotstat_hist *from)
+{
+    to->count += __atomic_load_n(&from->count, __ATOMIC_RELAXED);
+    to->sum += __atomic_load_n(&from->sum, __ATOMIC_RELAXED);
+    for (int b = 0; b < HOTSTAT_BUCKETS; b++)
+        to->buckets[b] += __atomic_load_n(&from->buckets[b], __ATOMIC_RELAXED);
+}
+
+static void block_add(struct hotstat_thread *to, const struct hotstat_thread *t)
+{
+    for (int i = 0; i < reg.n_counters; i++)
+        to->counters[i] += __atomic_load_n(&t->counters[i], __ATOMIC_RELAXED);
+    for (int i = 0; i < reg.n_histograms; i++)
+        hist_add(&to->histograms[i], &t->histograms[i]);
+}
+
+static void thread_exit(void *arg)
+{
+    struct hotstat_thread *t = arg, **p;
+
+    pthread_mutex_lock(&reg.lock);
+    block_add(&reg.gone, t);
+    for (p = &reg.threads; *p != t; p = &(*p)->next)
+        ;
+    *p = t->next;
+    reg.n_threads--;
+    pthread_mutex_unlock(&reg.lock);
+
+    hotstat_self = NULL;
+    free(t);
+}
+
+static void key_init(void)
+{
+    if (pthread_key_create(&reg.key, thread_exit))
+        abort();
+}
+
+struct hotstat_thread *hotstat_thread_init(void)
+{
+    struct hotstat_thread *t;
+
+    pthread_once(&reg.once, key_init);
+    if (posix_memalign((void **) &t, 64, sizeof(*t)))
+        abort();
+    memset(t, 0, sizeof(*t));
+
+    pthread_mutex_lock(&reg.lock);
+    t->next = reg.threads;
+    reg.threads = t;
+    reg.n_threads++;
+    pthread_mutex_unlock(&reg.lock);
+
+    pthread_setspecific(reg.key, t);
+    return hotstat_self = t;
+}
+
+/* Find @name among the @n first of @names, or append it. Returns its slot
+ * + 1, or -1 if there is no room.
+ */
+static int attach(const char **names, int *n, int max, const char *name)
+{
+    for (int i = 0; i < *n; i++)
+        if (!strcmp(names[i], name))
+            return i + 1;
+    if (*n == max) {
+        fprintf(stderr, "hotstat: no room for %s\n", name);
+        return -1;
+    }
+    names[*n] = name;
+    return ++*n;
+}
+
+int hotstat_attach_counter(hotstat_counter_t *c)
+{
+    pthread_mutex_lock(&reg.lock);
+    int id = c->id ? c->id
+                   : attach(reg.counters, &reg.n_counters,
+                            HOTSTAT_MAX_COUNTERS, c->name);
+    __atomic_store_n(&c->id, id, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reg.lock);
+    return id;
+}
+
+int hotstat_attach_histogram(hotstat_histogram_t *h)
+{
+    pthread_mutex_lock(&reg.lock);
+    int id = h->id ? h->id
+                   : attach(reg.histograms, &reg.n_histograms,
+                            HOTSTAT_MAX_HISTOGRAMS, h->name);
+    __atomic_store_n(&h->id, id, __ATOMIC_RELAXED);
+    pthread_mutex_unlock(&reg.lock);
+    return id;
+}
+
+void hotstat_snapshot(struct hotstat_page *page)
+{
+    static struct hotstat_thread sum;
+
+    pthread_mutex_lock(&reg.lock);
+    memset(&sum, 0, sizeof(sum));
+    block_add(&sum, &reg.gone);
+    for (struct hotstat_thread *t = reg.threads; t; t = t->next)
+        block_add(&sum, t);
+
+    memset(page, 0, sizeof(*page));
+    page->magic = HOTSTAT_MAGIC;
+    page->time_ns = hotstat_now_ns();
+    page->n_threads = reg.n_threads;
+    page->n_counters = reg.n_counters;
+    page->n_histograms = reg.n_histograms;
+    for (int i = 0; i < reg.n_counters; i++) {
+        strncpy(page->counter_names[i], reg.counters[i], HOTSTAT_NAME_LEN - 1);
+        page->counters[i] = sum.counters[i];
+    }
+    for (int i = 0; i < reg.n_histograms; i++) {
+        strncpy(page->histogram_names[i], reg.histograms[i],
+                HOTSTAT_NAME_LEN - 1);
+        page->histograms[i] = sum.histograms[i];
+    }
+    pthread_mutex_unlock(&reg.lock);
+}
+
+uint64_t hotstat_value(const char *name)
+{
+    struct hotstat_page *page = malloc(sizeof(*page));
+    uint64_t value = 0;
+
+    if (!page)
+        return 0;
+    hotstat_snapshot(page);
+    for (uint32_t i = 0; i < page->n_counters; i++)
+        if (!strcmp(page->counter_names[i], name))
+            value = page->counters[i];
+    for (uint32_t i = 0; i < page->n_histograms; i++)
+        if (!strcmp(page->histogram_names[i], name))
+            value = page->histograms[i].count;
+    free(page);
+    return value;
+}
+
+/* Upper bound of the bucket of the value at @p of the histogram */
+static uint64_t hist_percentile(const struct hotstat_hist *h, double p)
+{
+    uint64_t rank = h->count * p, seen = 0;
+
+    if (rank == h->count && rank)
+        rank--;
+    for (int b = 0; b < HOTSTAT_BUCKETS; b++) {
+        seen += h->buckets[b];
+        if (seen > rank)
+            return b ? (b < 64 ? (1ULL << b) : 0) - 1 : 0;
+    }
+    return 0;
+}
+
+void hotstat_print(const struct hotstat_page *page, FILE *out)
+{
+    for (uint32_t i = 0; i < page->n_counters; i++)
+        fprintf(out, "%s %lu\n", page->counter_names[i], page->counters[i]);
+    for (uint32_t i = 0; i < page->n_histograms; i++) {
+        const struct hotstat_hist *h = &page->histograms[i];
+        fprintf(out, "%s count %lu mean %lu p50 %lu p99 %lu max %lu\n",
+                page->histogram_names[i], h->count,
+                h->count ? h->sum / h->count : 0, hist_percentile(h, 0.5),
+                hist_percentile(h, 0.99), hist_percentile(h, 1));
+    }
+}
+
+void hotstat_dump(FILE *out)
+{
+    struct hotstat_page *page = malloc(sizeof(*page));
+
+    if (!page)
+        return;
+    hotstat_snapshot(page);
+    hotstat_print(page, out);
+    free(page);
+}
+
+/* The publisher of the shared-memory page */
+static struct {
+    char name[64];
+    struct hotstat_page *page, *next;
+    unsigned period_ms;
+    pthread_t thread;
+    pthread_mutex_t lock;
+    pthread_cond_t stop_cond;
+    bool stop, running;
+} shm = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .stop_cond = PTHREAD_COND_INITIALIZER,
+};
+
+/* What follows the magic and the sequence */
+#define BODY offsetof(struct hotstat_page, time_ns)
+
+static void publish(void)
+{
+    uint32_t seq = shm.page->seq;
+
+    hotstat_snapshot(shm.next);
+    __atomic_store_n(&shm.page->seq, seq + 1, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+    memcpy((char *) shm.page + BODY, (char *) shm.next + BODY,
+           sizeof(struct hotstat_page) - BODY);
+    shm.page->magic = HOTSTAT_MAGIC;
+    __atomic_store_n(&shm.page->seq, seq + 2, __ATOMIC_RELEASE);
+}
+
+static void *publisher(void *arg)
+{
+    pthread_mutex_lock(&shm.lock);
+    while (!shm.stop) {
+        struct timespec deadline;
+        clock_gettime(CLOCK_REALTIME, &deadline);
+        deadline.tv_nsec += (shm.period_ms % 1000) * 1000000L;
+        deadline.tv_sec += shm.period_ms / 1000;
+        deadline.tv_sec += deadline.tv_nsec / 1000000000L;
+        deadline.tv_nsec %= 1000000000L;
+
+        pthread_mutex_unlock(&shm.lock);
+        publish();
+        pthread_mutex_lock(&shm.lock);
+        while (!shm.stop &&
+               pthread_cond_timedwait(&shm.stop_cond, &shm.lock, &deadline) !=
+                   ETIMEDOUT)
+            ;
+    }
+    pthread_mutex_unlock(&shm.lock);
+    return NULL;
+}
+
+int hotstat_shm_open(const char *name, unsigned period_ms)
+{
+    if (shm.running || strlen(name) >= sizeof(shm.name)) {
+        errno = EINVAL;
+        return -1;
+    }
+
+    int fd = shm_open(name, O_CREAT | O_RDWR, 0644);
+    if (fd < 0)
+        return -1;
+    if (ftruncate(fd, sizeof(struct hotstat_page))) {
+        close(fd);
+        shm_unlink(name);
+        return -1;
+    }
+    shm.page = mmap(NULL, sizeof(struct hotstat_page), PROT_READ | PROT_WRITE,
+                    MAP_SHARED, fd, 0);
+    close(fd);
+    if (shm.page == MAP_FAILED || !(shm.next = malloc(sizeof(*shm.next)))) {
+        if (shm.page != MAP_FAILED)
+            munmap(shm.page, sizeof(struct hotstat_page));
+        shm_unlink(name);
+        errno = ENOMEM;
+        return -1;
+    }
+
+    strcpy(shm.name, name);
+    shm.period_ms = period_ms ? period_ms : DEFAULT_PERIOD_MS;
+    shm.stop = false;
+    if ((errno = pthread_create(&shm.thread, NULL, publisher, NULL))) {
+        munmap(shm.page, sizeof(struct hotstat_page));
+        free(shm.next);
+        shm_unlink(name);
+        return -1;
+    }
+    shm.running = true;
+    return 0;
+}
+
+void hotstat_shm_close(void)
+{
+    if (!shm.running)
+        return;
+
+    pthread_mutex_lock(&shm.lock);
+    shm.stop = true;
+    pthread_cond_signal(&shm.stop_cond);
+    pthread_mutex_unlock(&shm.lock);
+    pthread_join(shm.thread, NULL);
+    shm.running = false;
+
+    munmap(shm.page, sizeof(struct hotstat_page));
+    free(shm.next);
+    shm_unlink(shm.name);
+}
+
+/* For the programs that know nothing of hotstat: HOTSTAT_DUMP dumps the
+ * totals to stderr at exit, and HOTSTAT_SHM names a shared-memory page to
+ * publish to every HOTSTAT_PERIOD_MS.
+ */
+static void dump_at_exit(void)
+{
+    hotstat_shm_close();
+    if (getenv("HOTSTAT_DUMP"))
+        hotstat_dump(stderr);
+}
+
+__attribute__((constructor)) static void hotstat_env(void)
+{
+    const char *name = getenv("HOTSTAT_SHM");
+    const char *period = getenv("HOTSTAT_PERIOD_MS");
+
+    if (name && hotstat_shm_open(name, period ? atoi(period) : 0))
+        perror("hotstat: HOTSTAT_SHM");
+    if (name || getenv("HOTSTAT_DUMP"))
+        atexit(dump_at_exit);
+}
@@ -0,0 +1,172 @@
+/* Hot-path statistics
+ *
+ * Counters and histograms for the fast paths of the other directories: CAS
+ * retries, steals, parks, grace periods, reclamation backlogs. Each thread
+ * updates a block of its own, cache aligned, with plain relaxed stores, so
+ * that counting takes no atomic read-modify-write and touches no shared
+ * cache line. The blocks are only summed on demand, by hotstat_value(),
+ * hotstat_dump() or the publisher of the shared-memory page, and the block
+ * of an exiting thread is folded into a global one.
+ *
+ * Everything compiles away unless HOTSTAT is defined, in which case
+ * hotstat.c has to be linked in. A statistic is a static descriptor, at the
+ * file scope or in a function:
+ *
+ *     HOTSTAT_COUNTER(put_retries, "hashmap.put_retries");
+ *     HOTSTAT_HISTOGRAM(gp_ns, "rcu.gp_ns");
+ *
+ *     HOTSTAT_INC(put_retries);
+ *     HOTSTAT_RECORD(gp_ns, HOTSTAT_NOW() - start);
+ *
+ * It gets its slot on its first update, and descriptors of the same name,
+ * such as those of a header included by several files, share it.
+ */
+
+#pragma once
+
+#include <stdint.h>
+#include <stdio.h>
+
+#define HOTSTAT_MAX_COUNTERS 64
+#define HOTSTAT_MAX_HISTOGRAMS 16
+#define HOTSTAT_NAME_LEN 48
+
+/* Histograms are log2: bucket 0 counts the zeros and bucket b > 0 the values
+ * of [2^(b - 1), 2^b).
+ */
+#define HOTSTAT_BUCKETS 65
+
+struct hotstat_hist {
+    uint64_t count, sum;
+    uint64_t buckets[HOTSTAT_BUCKETS];
+};
+
+/* Snapshot of the totals, and layout of the shared-memory page. The
+ * publisher makes seq odd while it writes, a reader copies the page and
+ * retries until it saw the same even seq before and after.
+ */
+#define HOTSTAT_MAGIC 0x31545348 /* "HST1" */
+
+struct hotstat_page {
+    uint32_t magic;
+    uint32_t seq;
+    uint64_t time_ns; /* CLOCK_MONOTONIC */
+    uint32_t n_threads, n_counters, n_histograms, unused;
+    char counter_names[HOTSTAT_MAX_COUNTERS][HOTSTAT_NAME_LEN];
+    uint64_t counters[HOTSTAT_MAX_COUNTERS];
+    char histogram_names[HOTSTAT_MAX_HISTOGRAMS][HOTSTAT_NAME_LEN];
+    struct hotstat_hist histograms[HOTSTAT_MAX_HISTOGRAMS];
+};
+
+/* Print a snapshot, one statistic per line */
+void hotstat_print(const struct hotstat_page *page, FILE *out);
+
+#ifdef HOTSTAT
+
+#include <time.h>
+
+/* id is 0 until the first update, then the slot + 1, or -1 if there was no
+ * slot left
+ */
+typedef struct {
+    const char *name;
+    int id;
+} hotstat_counter_t, hotstat_histogram_t;
+
+struct hotstat_thread {
+    uint64_t counters[HOTSTAT_MAX_COUNTERS];
+    struct hotstat_hist histograms[HOTSTAT_MAX_HISTOGRAMS];
+    struct hotstat_thread *next;
+} __attribute__((aligned(64)));
+
+extern __thread struct hotstat_thread *hotstat_self;
+struct hotstat_thread *hotstat_thread_init(void);
+int hotstat_attach_counter(hotstat_counter_t *c);
+int hotstat_attach_histogram(hotstat_histogram_t *h);
+
+#define HOTSTAT_COUNTER(var, name)                             \
+    static hotstat_counter_t hotstat_##var                     \
+        __attribute__((unused)) = {name, 0}
+#define HOTSTAT_HISTOGRAM(var, name)                           \
+    static hotstat_histogram_t hotstat_##var                   \
+        __attribute__((unused)) = {name, 0}
+
+#define HOTSTAT_ADD(var, n) hotstat_add(&hotstat_##var, n)
+#define HOTSTAT_INC(var) hotstat_add(&hotstat_##var, 1)
+#define HOTSTAT_RECORD(var, value) hotstat_record(&hotstat_##var, value)
+#define HOTSTAT_NOW() hotstat_now_ns()
+
+static inline struct hotstat_thread *hotstat_thread(void)
+{
+    struct hotstat_thread *t = hotstat_self;
+    return __builtin_expect(!!t, 1) ? t : hotstat_thread_init();
+}
+
+/* Only the owner thread writes its block, the readers may see a stale
+ * value but never a torn one.
+ */
+static inline void hotstat_bump__(uint64_t *v, uint64_t n)
+{
+    __atomic_store_n(v, __atomic_load_n(v, __ATOMIC_RELAXED) + n,
+                     __ATOMIC_RELAXED);
+}
+
+static inline void hotstat_add(hotstat_counter_t *c, uint64_t n)
+{
+    int id = __atomic_load_n(&c->id, __ATOMIC_RELAXED);
+    if (__builtin_expect(id <= 0, 0) &&
+        (id = id ? id : hotstat_attach_counter(c)) < 0)
+        return;
+    hotstat_bump__(&hotstat_thread()->counters[id - 1], n);
+}
+
+static inline void hotstat_record(hotstat_histogram_t *h, uint64_t value)
+{
+    int id = __atomic_load_n(&h->id, __ATOMIC_RELAXED);
+    if (__builtin_expect(id <= 0, 0) &&
+        (id = id ? id : hotstat_attach_histogram(h)) < 0)
+        return;
+
+    struct hotstat_hist *hist = &hotstat_thread()->histograms[id - 1];
+    hotstat_bump__(&hist->count, 1);
+    hotstat_bump__(&hist->sum, value);
+    hotstat_bump__(&hist->buckets[value ? 64 - __builtin_clzll(value) : 0], 1);
+}
+
+static inline uint64_t hotstat_now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* Sum the blocks of every thread, live or gone, into @page */
+void hotstat_snapshot(struct hotstat_page *page);
+
+/* Total of the counter @name, or number of values of the histogram @name */
+uint64_t hotstat_value(const char *name);
+
+void hotstat_dump(FILE *out);
+
+/* Publish a snapshot every @period_ms in the POSIX shared memory object
+ * @name, until hotstat_shm_close(), which unlinks it. Returns 0, or -1 with
+ * errno set.
+ */
+int hotstat_shm_open(const char *name, unsigned period_ms);
+void hotstat_shm_close(void);
+
+#else
+
+#define HOTSTAT_COUNTER(var, name) \
+    extern int hotstat_unused_##var __attribute__((unused))
+#define HOTSTAT_HISTOGRAM(var, name) \
+    extern int hotstat_unused_##var __attribute__((unused))
+#define HOTSTAT_ADD(var, n) ((void) sizeof(n))
+#define HOTSTAT_INC(var) ((void) 0)
+#define HOTSTAT_RECORD(var, value) ((void) sizeof(value))
+#define HOTSTAT_NOW() ((uint64_t) 0)
+
+#define hotstat_value(name) ((uint64_t) 0)
+#define hotstat_dump(out) ((void) (out))
+
+#endif /* HOTSTAT */
@@ -0,0 +1,70 @@
+/* Print the statistics a running program publishes with hotstat_shm_open()
+ * or HOTSTAT_SHM, once or every few milliseconds.
+ */
+
+#include <fcntl.h>
+#include <sched.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "hotstat.h"
+
+/* Copy the page once the publisher is done with it */
+static int read_page(const struct hotstat_page *shared,
+                     struct hotstat_page *page)
+{
+    for (int tries = 0; tries < 1000; tries++) {
+        uint32_t seq = __atomic_load_n(&shared->seq, __ATOMIC_ACQUIRE);
+        if (seq & 1) {
+            sched_yield();
+            continue;
+        }
+        memcpy(page, (const void *) shared, sizeof(*page));
+        __atomic_thread_fence(__ATOMIC_ACQUIRE);
+        if (__atomic_load_n(&shared->seq, __ATOMIC_RELAXED) == seq)
+            return page->magic == HOTSTAT_MAGIC ? 0 : -1;
+    }
+    return -1;
+}
+
+int main(int argc, char *argv[])
+{
+    if (argc < 2 || argc > 3) {
+        fprintf(stderr, "Usage: %s name [period_ms]\n", argv[0]);
+        return EXIT_FAILURE;
+    }
+    int period_ms = argc == 3 ? atoi(argv[2]) : 0;
+
+    int fd = shm_open(argv[1], O_RDONLY, 0);
+    if (fd < 0) {
+        perror(argv[1]);
+        return EXIT_FAILURE;
+    }
+    const struct hotstat_page *shared =
+        mmap(NULL, sizeof(*shared), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (shared == MAP_FAILED) {
+        perror("mmap");
+        return EXIT_FAILURE;
+    }
+
+    struct hotstat_page page;
+    do {
+        if (read_page(shared, &page)) {
+            fprintf(stderr, "%s: no statistics\n", argv[1]);
+            return EXIT_FAILURE;
+        }
+        printf("# %lu.%09lu %u threads\n", page.time_ns / 1000000000,
+               page.time_ns % 1000000000, page.n_threads);
+        hotstat_print(&page, stdout);
+        fflush(stdout);
+        if (period_ms)
+            usleep(period_ms * 1000);
+    } while (period_ms);
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,108 @@
+/* Threads bump counters and fill a histogram, while the main thread checks
+ * the totals with some threads alive and after they all exited, and reads
+ * them back from the shared-memory page.
+ */
+
+#include <assert.h>
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <unistd.h>
+
+#include "hotstat.h"
+
+#define N_THREADS 8
+#define N_LOOPS (1 << 17)
+
+HOTSTAT_COUNTER(ops, "test.ops");
+HOTSTAT_COUNTER(ops_too, "test.ops"); /* shares the slot of "ops" */
+HOTSTAT_HISTOGRAM(values, "test.values");
+
+static pthread_barrier_t started, checked;
+
+static void *worker(void *arg)
+{
+    HOTSTAT_COUNTER(local, "test.local");
+
+    for (uint64_t i = 0; i < N_LOOPS; i++) {
+        if (i & 1)
+            HOTSTAT_INC(ops);
+        else
+            HOTSTAT_ADD(ops_too, 1);
+        HOTSTAT_RECORD(values, i & 1023);
+    }
+    HOTSTAT_INC(local);
+
+    /* Stay alive until the totals of the live threads are checked */
+    pthread_barrier_wait(&started);
+    pthread_barrier_wait(&checked);
+    return NULL;
+}
+
+static void check_totals(void)
+{
+    assert(hotstat_value("test.ops") == (uint64_t) N_THREADS * N_LOOPS);
+    assert(hotstat_value("test.values") == (uint64_t) N_THREADS * N_LOOPS);
+    assert(hotstat_value("test.local") == N_THREADS);
+    assert(hotstat_value("test.none") == 0);
+}
+
+static void check_shm(const char *name)
+{
+    int fd = shm_open(name, O_RDONLY, 0);
+    assert(fd >= 0);
+    const struct hotstat_page *page =
+        mmap(NULL, sizeof(*page), PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    assert(page != MAP_FAILED);
+
+    /* Wait for a publication past the first one */
+    while (__atomic_load_n(&page->seq, __ATOMIC_ACQUIRE) < 4)
+        usleep(1000);
+
+    uint64_t ops = 0, values = 0;
+    for (uint32_t i = 0; i < page->n_counters; i++)
+        if (!strcmp(page->counter_names[i], "test.ops"))
+            ops = page->counters[i];
+    for (uint32_t i = 0; i < page->n_histograms; i++) {
+        if (strcmp(page->histogram_names[i], "test.values"))
+            continue;
+        const struct hotstat_hist *h = &page->histograms[i];
+        values = h->count;
+        assert(h->buckets[0] == (uint64_t) N_THREADS * N_LOOPS / 1024);
+        assert(h->buckets[10] == (uint64_t) N_THREADS * N_LOOPS / 2);
+    }
+    assert(ops == (uint64_t) N_THREADS * N_LOOPS);
+    assert(values == (uint64_t) N_THREADS * N_LOOPS);
+    munmap((void *) page, sizeof(*page));
+}
+
+int main(void)
+{
+    pthread_t threads[N_THREADS];
+    char name[64];
+
+    pthread_barrier_init(&started, NULL, N_THREADS + 1);
+    pthread_barrier_init(&checked, NULL, N_THREADS + 1);
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_create(&threads[i], NULL, worker, NULL);
+
+    pthread_barrier_wait(&started);
+    check_totals();
+    pthread_barrier_wait(&checked);
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    check_totals();
+
+    snprintf(name, sizeof(name), "/hotstat-test-%d", getpid());
+    assert(!hotstat_shm_open(name, 1));
+    check_shm(name);
+    hotstat_shm_close();
+
+    hotstat_dump(stdout);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,135 @@
+/* Hazard pointer domain benchmark
+ *
+ * Readers protect a few shared objects at a time while a writer keeps
+ * replacing them, deferring the deallocation and cleaning up in batches.
+ * Build with -DDOMAIN_LIST to measure the linked list domain instead of the
+ * slot array.
+ */
+
+#ifdef DOMAIN_LIST
+#include "domain_list.h"
+#define DOMAIN_NAME "list"
+#else
+#include "domain.h"
+#define DOMAIN_NAME "slots"
+#endif
+
+#include <err.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <time.h>
+
+#define N_READERS 8
+#define N_SHARED 16
+#define N_HELD 4           /* objects a reader protects at once */
+#define CLEANUP_BATCH 4096 /* swaps between two cleanups */
+#define DURATION 2         /* seconds */
+
+#define MAGIC 0xDEADBEEF
+
+typedef struct {
+    unsigned int magic;
+} obj_t;
+
+static uintptr_t shared[N_SHARED];
+static domain_t *dom;
+static atomic_bool stop;
+
+static uintptr_t obj_new(void)
+{
+    obj_t *obj = malloc(sizeof(obj_t));
+    if (!obj)
+        err(EXIT_FAILURE, "malloc");
+    obj->magic = MAGIC;
+    return (uintptr_t) obj;
+}
+
+static void obj_free(void *arg)
+{
+    obj_t *obj = arg;
+    obj->magic = 0;
+    free(obj);
+}
+
+static void *reader_thread(void *arg)
+{
+    unsigned int seed = (uintptr_t) arg;
+    uint64_t *n_loads = calloc(1, sizeof(uint64_t));
+    uintptr_t held[N_HELD];
+
+    while (!stop) {
+        for (int i = 0; i < N_HELD; i++) {
+            held[i] = load(dom, &shared[rand_r(&seed) % N_SHARED]);
+            if (!held[i])
+                err(EXIT_FAILURE, "load");
+            if (((obj_t *) held[i])->magic != MAGIC)
+                abort();
+        }
+        for (int i = N_HELD - 1; i >= 0; i--)
+            drop(dom, held[i]);
+        *n_loads += N_HELD;
+    }
+    return n_loads;
+}
+
+static void *writer_thread(void *arg)
+{
+    unsigned int seed = (uintptr_t) arg;
+    uint64_t *n_swaps = calloc(1, sizeof(uint64_t));
+    wconfig_t *wconfig = calloc(1, sizeof(wconfig_t));
+    if (!n_swaps || !wconfig)
+        err(EXIT_FAILURE, "calloc");
+
+    while (!stop) {
+        swap(dom, wconfig, &shared[rand_r(&seed) % N_SHARED], obj_new(),
+             DEFER_DEALLOC);
+        if (++*n_swaps % CLEANUP_BATCH == 0)
+            cleanup(dom, wconfig, DEFER_DEALLOC);
+    }
+    cleanup(dom, wconfig, 0);
+    wconfig_free(wconfig);
+    return n_swaps;
+}
+
+int main(void)
+{
+    pthread_t readers[N_READERS], writer;
+    uint64_t n_loads = 0, n_swaps;
+    void *ret;
+
+    dom = domain_new(obj_free);
+    if (!dom)
+        err(EXIT_FAILURE, "domain_new");
+    for (int i = 0; i < N_SHARED; i++)
+        shared[i] = obj_new();
+
+    for (int i = 0; i < N_READERS; i++) {
+        if (pthread_create(&readers[i], NULL, reader_thread,
+                           (void *) (uintptr_t) i))
+            err(EXIT_FAILURE, "pthread_create");
+    }
+    if (pthread_create(&writer, NULL, writer_thread, (void *) N_READERS))
+        err(EXIT_FAILURE, "pthread_create");
+
+    struct timespec duration = {.tv_sec = DURATION};
+    nanosleep(&duration, NULL);
+    stop = true;
+
+    for (int i = 0; i < N_READERS; i++) {
+        pthread_join(readers[i], &ret);
+        n_loads += *(uint64_t *) ret;
+        free(ret);
+    }
+    pthread_join(writer, &ret);
+    n_swaps = *(uint64_t *) ret;
+    free(ret);
+
+    printf("%-5s: %10.0f loads/s, %10.0f swaps/s\n", DOMAIN_NAME,
+           (double) n_loads / DURATION, (double) n_swaps / DURATION);
+
+    for (int i = 0; i < N_SHARED; i++)
+        obj_free((void *) shared[i]);
+    domain_free(dom);
+    return EXIT_SUCCESS;
+}
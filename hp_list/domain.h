@@ -0,0 +1,404 @@
+/* Hazard pointer domain backed by an array of slots.
+ *
+ * The hazard pointers live in chunks of cache-aligned slots, and a thread
+ * keeps the slots it has released for its next loads, so that load() and
+ * drop() only touch the shared array when a thread protects more pointers
+ * than ever before. Retired objects are kept in an array, and a cleanup
+ * takes a sorted snapshot of the hazard pointers once and looks every retired
+ * object up in it, which is O((H + R) log H) instead of O(H * R).
+ */
+
+#ifndef _DOMAIN_H_
+#define _DOMAIN_H_
+
+#include <assert.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+#include <unistd.h>
+
+#define DEFER_DEALLOC 1
+
+#define DOMAIN_CHUNK_SLOTS 64 /* slots added to the domain at once */
+#define DOMAIN_CACHE_SLOTS 8  /* released slots a thread keeps */
+
+/* A deferred swap scans the hazard pointers once this many times as many
+ * objects as there are slots are retired, so that a scan frees at least as
+ * many objects as it reads slots.
+ */
+#define DOMAIN_THRESHOLD_FACTOR 2
+
+typedef struct {
+    alignas(64) atomic_uintptr_t ptr;
+    atomic_bool in_use; /* owned by a thread */
+} domain_slot_t;
+
+typedef struct domain_chunk {
+    domain_slot_t slots[DOMAIN_CHUNK_SLOTS];
+    struct domain_chunk *next;
+} domain_chunk_t;
+
+typedef struct {
+    _Atomic(domain_chunk_t *) chunks;
+    atomic_size_t n_slots;
+    void (*deallocator)(void *);
+} domain_t;
+
+typedef struct {
+    uintptr_t *retired;
+    uint32_t r_count, r_capacity;
+    uintptr_t *snapshot; /* scratch space for the scan */
+    size_t s_capacity;
+} wconfig_t;
+
+/* Slots of a thread in one domain */
+typedef struct domain_tls {
+    domain_t *dom;
+    struct domain_tls *next;
+    domain_slot_t **held; /* protecting a pointer */
+    size_t n_held, h_capacity;
+    domain_slot_t *cache[DOMAIN_CACHE_SLOTS];
+    size_t n_cache;
+} domain_tls_t;
+
+static thread_local domain_tls_t *domain_tls;
+static tss_t domain_tls_key;
+static once_flag domain_tls_once = ONCE_FLAG_INIT;
+
+static void domain_slot_put(domain_slot_t *slot)
+{
+    atomic_store_explicit(&slot->in_use, false, memory_order_release);
+}
+
+static void domain_tls_free(domain_tls_t *t)
+{
+    for (size_t i = 0; i < t->n_held; i++) {
+        atomic_store_explicit(&t->held[i]->ptr, 0, memory_order_release);
+        domain_slot_put(t->held[i]);
+    }
+    for (size_t i = 0; i < t->n_cache; i++)
+        domain_slot_put(t->cache[i]);
+    free(t->held);
+    free(t);
+}
+
+/* Give the slots of an exiting thread back to their domains */
+static void domain_tls_release(void *arg)
+{
+    domain_tls_t *t = arg;
+    while (t) {
+        domain_tls_t *next = t->next;
+        domain_tls_free(t);
+        t = next;
+    }
+    domain_tls = NULL;
+}
+
+static void domain_tls_init(void)
+{
+    if (tss_create(&domain_tls_key, domain_tls_release) != thrd_success)
+        abort();
+}
+
+static domain_tls_t *domain_tls_get(domain_t *dom)
+{
+    domain_tls_t **tp = &domain_tls, *t;
+
+    if (domain_tls && domain_tls->dom == dom)
+        return domain_tls;
+
+    /* Move the entry of the domain to the front */
+    while ((t = *tp) && t->dom != dom)
+        tp = &t->next;
+    if (t) {
+        *tp = t->next;
+    } else {
+        call_once(&domain_tls_once, domain_tls_init);
+        t = calloc(1, sizeof(*t));
+        if (!t)
+            return NULL;
+        t->dom = dom;
+    }
+    t->next = domain_tls;
+    domain_tls = t;
+    tss_set(domain_tls_key, t);
+    return t;
+}
+
+/* Take a free slot of the domain, or add a chunk if there is none */
+static domain_slot_t *domain_slot_get(domain_t *dom)
+{
+    domain_chunk_t *chunk;
+
+    for (chunk = atomic_load(&dom->chunks); chunk; chunk = chunk->next) {
+        for (int i = 0; i < DOMAIN_CHUNK_SLOTS; i++) {
+            domain_slot_t *slot = &chunk->slots[i];
+            bool expected = false;
+            if (!atomic_load_explicit(&slot->in_use, memory_order_relaxed) &&
+                atomic_compare_exchange_strong(&slot->in_use, &expected, true))
+                return slot;
+        }
+    }
+
+    chunk = aligned_alloc(alignof(domain_chunk_t), sizeof(*chunk));
+    if (!chunk)
+        return NULL;
+    for (int i = 0; i < DOMAIN_CHUNK_SLOTS; i++) {
+        atomic_init(&chunk->slots[i].ptr, 0);
+        atomic_init(&chunk->slots[i].in_use, i == 0);
+    }
+    chunk->next = atomic_load(&dom->chunks);
+    while (!atomic_compare_exchange_weak(&dom->chunks, &chunk->next, chunk))
+        ;
+    atomic_fetch_add(&dom->n_slots, DOMAIN_CHUNK_SLOTS);
+    return &chunk->slots[0];
+}
+
+/* Create a new domain on the heap */
+static inline domain_t *domain_new(void (*deallocator)(void *))
+{
+    domain_t *dom = calloc(1, sizeof(domain_t));
+    if (!dom)
+        return NULL;
+
+    atomic_init(&dom->chunks, NULL);
+    atomic_init(&dom->n_slots, 0);
+    dom->deallocator = deallocator;
+    return dom;
+}
+
+/* Free a previously allocated domain. The threads that used it must have
+ * exited, except for the caller.
+ */
+static inline void domain_free(domain_t *dom)
+{
+    if (!dom)
+        return;
+
+    for (domain_tls_t **tp = &domain_tls; *tp; tp = &(*tp)->next) {
+        if ((*tp)->dom == dom) {
+            domain_tls_t *t = *tp;
+            *tp = t->next;
+            domain_tls_free(t);
+            tss_set(domain_tls_key, domain_tls);
+            break;
+        }
+    }
+
+    domain_chunk_t *chunk = atomic_load(&dom->chunks);
+    while (chunk) {
+        domain_chunk_t *next = chunk->next;
+        free(chunk);
+        chunk = next;
+    }
+    free(dom);
+}
+
+/* Free wconfig */
+static inline void wconfig_free(wconfig_t *wcfig)
+{
+    if (!wcfig)
+        return;
+
+    free(wcfig->retired);
+    free(wcfig->snapshot);
+    free(wcfig);
+}
+
+/*
+ * Load a safe pointer to a shared object. This pointer must be passed to
+ * `drop` once it is no longer needed. Returns 0 (NULL) on error.
+ */
+static inline uintptr_t load(domain_t *dom, const uintptr_t *prot_ptr)
+{
+    domain_tls_t *t = domain_tls_get(dom);
+    if (!t)
+        return 0;
+
+    if (t->n_held == t->h_capacity) {
+        size_t capacity = t->h_capacity ? t->h_capacity * 2 : 4;
+        domain_slot_t **held = realloc(t->held, capacity * sizeof(*held));
+        if (!held)
+            return 0;
+        t->held = held;
+        t->h_capacity = capacity;
+    }
+
+    domain_slot_t *slot =
+        t->n_cache ? t->cache[--t->n_cache] : domain_slot_get(dom);
+    if (!slot)
+        return 0;
+
+    uintptr_t val = atomic_load(prot_ptr);
+    while (1) {
+        atomic_store(&slot->ptr, val);
+
+        /* Hazard pointer published before the pointer was retired */
+        uintptr_t tmp = atomic_load(prot_ptr);
+        if (tmp == val)
+            break;
+        val = tmp;
+    }
+
+    if (!val) {
+        t->cache[t->n_cache++] = slot;
+        return 0;
+    }
+    t->held[t->n_held++] = slot;
+    return val;
+}
+
+/*
+ * Drop a safe pointer to a shared object. This pointer (`safe_val`) must have
+ * come from `load`
+ */
+static inline void drop(domain_t *dom, uintptr_t safe_val)
+{
+    domain_tls_t *t = domain_tls_get(dom);
+    size_t i = t->n_held;
+
+    /* The last loaded pointer is usually the first dropped */
+    while (i-- > 0) {
+        if (atomic_load_explicit(&t->held[i]->ptr, memory_order_relaxed) ==
+            safe_val)
+            break;
+    }
+    assert(i < t->n_held);
+
+    domain_slot_t *slot = t->held[i];
+    t->held[i] = t->held[--t->n_held];
+    atomic_store_explicit(&slot->ptr, 0, memory_order_release);
+    if (t->n_cache < DOMAIN_CACHE_SLOTS)
+        t->cache[t->n_cache++] = slot;
+    else
+        domain_slot_put(slot);
+}
+
+static int uintptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+static bool domain_protected(domain_t *dom, uintptr_t ptr)
+{
+    for (domain_chunk_t *chunk = atomic_load(&dom->chunks); chunk;
+         chunk = chunk->next) {
+        for (int i = 0; i < DOMAIN_CHUNK_SLOTS; i++) {
+            if (atomic_load(&chunk->slots[i].ptr) == ptr)
+                return true;
+        }
+    }
+    return false;
+}
+
+/* Deallocate the retired objects that no hazard pointer protects */
+static void domain_scan(domain_t *dom, wconfig_t *wconfig)
+{
+    size_t need = atomic_load(&dom->n_slots), n = 0;
+    if (need > wconfig->s_capacity) {
+        free(wconfig->snapshot);
+        wconfig->snapshot = malloc(need * 2 * sizeof(uintptr_t));
+        assert(wconfig->snapshot);
+        wconfig->s_capacity = need * 2;
+    }
+
+    /* Chunks added after "need" was read come first, and cannot protect an
+     * object retired before.
+     */
+    for (domain_chunk_t *chunk = atomic_load(&dom->chunks); chunk;
+         chunk = chunk->next) {
+        for (int i = 0; i < DOMAIN_CHUNK_SLOTS; i++) {
+            uintptr_t ptr = atomic_load(&chunk->slots[i].ptr);
+            if (ptr && n < wconfig->s_capacity)
+                wconfig->snapshot[n++] = ptr;
+        }
+    }
+    qsort(wconfig->snapshot, n, sizeof(uintptr_t), uintptr_cmp);
+
+    uint32_t kept = 0;
+    for (uint32_t i = 0; i < wconfig->r_count; i++) {
+        uintptr_t ptr = wconfig->retired[i];
+        if (bsearch(&ptr, wconfig->snapshot, n, sizeof(uintptr_t),
+                    uintptr_cmp))
+            wconfig->retired[kept++] = ptr;
+        else
+            dom->deallocator((void *) ptr);
+    }
+    wconfig->r_count = kept;
+}
+
+static void domain_retire(wconfig_t *wconfig, uintptr_t ptr)
+{
+    if (wconfig->r_count == wconfig->r_capacity) {
+        wconfig->r_capacity = wconfig->r_capacity ? wconfig->r_capacity * 2 : 64;
+        wconfig->retired = realloc(wconfig->retired,
+                                   wconfig->r_capacity * sizeof(uintptr_t));
+        assert(wconfig->retired);
+    }
+    wconfig->retired[wconfig->r_count++] = ptr;
+}
+
+/* Forces the cleanup of old objects that have not been deallocated yet. Just
+ * like `swap`, if `flags` is 0, this function will wait until there are no
+ * more references to each object. If `flags` is `DEFER_DEALLOC`, only
+ * objects that already have no living references will be deallocated.
+ */
+static inline void cleanup(domain_t *dom, wconfig_t *wconfig, int flags)
+{
+    domain_scan(dom, wconfig);
+    while (wconfig->r_count && !(flags & DEFER_DEALLOC)) {
+        usleep(10);
+        domain_scan(dom, wconfig);
+    }
+}
+
+/* Swaps the contents of a shared pointer with a new pointer. The old value will
+ * be deallocated by calling the `deallocator` function for the domain, provided
+ * when `domain_new` was called. If `flags` is 0, this function will wait
+ * until no more references to the old object are held in order to deallocate
+ * it. If flags is `DEFER_DEALLOC`, the old object is retired, and the retired
+ * objects are deallocated by a scan once there are enough of them.
+ */
+static inline void swap(domain_t *dom,
+                        wconfig_t *wconfig,
+                        uintptr_t *prot_ptr,
+                        uintptr_t new_val,
+                        int flags)
+{
+    const uintptr_t old_obj = atomic_exchange(prot_ptr, new_val);
+
+    if (!(flags & DEFER_DEALLOC)) {
+        while (domain_protected(dom, old_obj))
+            usleep(10);
+        dom->deallocator((void *) old_obj);
+        return;
+    }
+
+    domain_retire(wconfig, old_obj);
+    if (wconfig->r_count >=
+        DOMAIN_THRESHOLD_FACTOR *
+            atomic_load_explicit(&dom->n_slots, memory_order_relaxed))
+        domain_scan(dom, wconfig);
+}
+
+/* Swaps "n" shared pointers at once, and retires the old values with a single
+ * cleanup, see `cleanup` for "flags".
+ */
+static inline void swap_n(domain_t *dom,
+                          wconfig_t *wconfig,
+                          uintptr_t **prot_ptrs,
+                          const uintptr_t *new_vals,
+                          size_t n,
+                          int flags)
+{
+    for (size_t i = 0; i < n; i++)
+        domain_retire(wconfig, atomic_exchange(prot_ptrs[i], new_vals[i]));
+    cleanup(dom, wconfig, flags);
+}
+
+#endif /* _DOMAIN_H_ */
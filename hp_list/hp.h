@@ -0,0 +1,353 @@
+/*
+ * Hazard pointers are a mechanism for protecting objects in memory from
+ * being deleted by other threads while in use. This allows safe lock-free
+ * data structures.
+ */
+
+#ifndef _HP_H_
+#define _HP_H_
+
+#include <assert.h>
+#include <inttypes.h>
+#include <stdalign.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <threads.h>
+
+/*
+ * Reference :
+ * A more Pragmatic Implementation of the Lock-free, Ordered, Linked List
+ * https://arxiv.org/abs/2010.15755
+ */
+
+/* Runtime statistics, kept by the per-thread counters of hotstat once
+ * RUNTIME_STAT or HOTSTAT is defined, and compiled away otherwise.
+ */
+#if defined(RUNTIME_STAT) && !defined(HOTSTAT)
+#define HOTSTAT
+#endif
+#include "../hotstat/hotstat.h"
+
+/* the number of retries in the __list_find function. */
+HOTSTAT_COUNTER(retry, "hp.retry");
+/* the number of wait-free contains in the __list_find function that curr
+ * pointer pointed.
+ */
+HOTSTAT_COUNTER(contains, "hp.contains");
+/* the number of list element traversal in the __list_find function. */
+HOTSTAT_COUNTER(traversal, "hp.traversal");
+/* the number of CAS() failures. */
+HOTSTAT_COUNTER(fail, "hp.fail");
+/* the number of list_delete operation failed and restart again. */
+HOTSTAT_COUNTER(del, "hp.del");
+/* the number of list_insert operation failed and restart again. */
+HOTSTAT_COUNTER(ins, "hp.ins");
+/* the number of atomic_load operation in list_delete, list_insert and
+ * __list_find.
+ */
+HOTSTAT_COUNTER(load, "hp.load");
+/* the number of atomic_store operation in list_delete, list_insert and
+ * __list_find.
+ */
+HOTSTAT_COUNTER(store, "hp.store");
+/* the number of list elements created and deleted. */
+HOTSTAT_COUNTER(inserts, "hp.inserts");
+HOTSTAT_COUNTER(deletes, "hp.deletes");
+/* the retired objects of a thread when it scans the hazard pointers. */
+HOTSTAT_HISTOGRAM(backlog, "hp.backlog");
+
+#define CAS(obj, expected, desired)                                          \
+    ({                                                                       \
+        bool __ret = atomic_compare_exchange_strong(obj, expected, desired); \
+        if (!__ret)                                                          \
+            HOTSTAT_INC(fail);                                               \
+        __ret;                                                               \
+    })
+#define ATOMIC_LOAD(obj)   \
+    ({                     \
+        HOTSTAT_INC(load); \
+        atomic_load(obj);  \
+    })
+#define ATOMIC_STORE_EXPLICIT(obj, desired, order)  \
+    do {                                            \
+        HOTSTAT_INC(store);                         \
+        atomic_store_explicit(obj, desired, order); \
+    } while (0)
+#define TRACE(ops) HOTSTAT_INC(ops)
+
+/* Without hotstat, the elements created and deleted are still summed up,
+ * in shared atomics
+ */
+#ifdef HOTSTAT
+#define COUNT(ops) HOTSTAT_INC(ops)
+
+static void do_analysis(void)
+{
+    hotstat_dump(stdout);
+}
+#else
+static atomic_uint_fast64_t deletes = 0, inserts = 0;
+#define COUNT(ops) ((void) atomic_fetch_add(&ops, 1))
+
+static void do_analysis(void)
+{
+    fprintf(stderr, "inserts = %zu, deletes = %zu\n",
+            (size_t) atomic_load(&inserts), (size_t) atomic_load(&deletes));
+}
+#endif
+
+#define RUNTIME_STAT_INIT() atexit(do_analysis)
+
+#ifndef HP_MAX_HPS
+#define HP_MAX_HPS 5 /* This is named 'K' in the HP paper */
+#endif
+
+/* A thread scans the hazard pointers once it has retired R objects, with R
+ * this many times the number of hazard pointers H, so that each scan frees
+ * at least R - H objects and the scan cost is amortized over them.
+ */
+#define HP_THRESHOLD_FACTOR 2 /* R = HP_THRESHOLD_FACTOR * H */
+
+typedef struct {
+    size_t size, capacity;
+    uintptr_t *list;
+} retirelist_t;
+
+typedef struct list_hp list_hp_t;
+typedef void(list_hp_deletefunc_t)(void *);
+
+/* Per-thread record. Records are never freed before the domain, a record
+ * released by an exiting thread is taken over by the next one, along with its
+ * retired objects.
+ */
+typedef struct list_hp_rec {
+    alignas(128) atomic_uintptr_t hp[HP_MAX_HPS];
+    alignas(128) atomic_bool active;
+    struct list_hp_rec *next;
+    retirelist_t rl;
+    uintptr_t *snapshot; /* scratch space for the scan, HP_MAX_HPS per rec */
+    size_t snapshot_capacity;
+} list_hp_rec_t;
+
+struct list_hp {
+    int max_hps;
+    _Atomic(list_hp_rec_t *) recs;
+    atomic_size_t n_recs;
+    tss_t key; /* record of the current thread */
+    list_hp_deletefunc_t *deletefunc;
+};
+
+/* The last domain used by the thread, to skip tss_get() */
+static thread_local list_hp_t *hp_cached;
+static thread_local list_hp_rec_t *rec_cached;
+
+static void list_hp_rec_release(void *arg)
+{
+    list_hp_rec_t *rec = arg;
+
+    for (int i = 0; i < HP_MAX_HPS; i++)
+        atomic_store_explicit(&rec->hp[i], 0, memory_order_release);
+    atomic_store_explicit(&rec->active, false, memory_order_release);
+}
+
+static list_hp_rec_t *list_hp_rec_acquire(list_hp_t *hp)
+{
+    list_hp_rec_t *rec;
+
+    /* Take over the record of an exited thread if there is one */
+    for (rec = atomic_load(&hp->recs); rec; rec = rec->next) {
+        bool expected = false;
+        if (!atomic_load_explicit(&rec->active, memory_order_relaxed) &&
+            atomic_compare_exchange_strong(&rec->active, &expected, true))
+            goto out;
+    }
+
+    rec = aligned_alloc(128, sizeof(*rec));
+    assert(rec);
+    memset(rec, 0, sizeof(*rec));
+    for (int i = 0; i < HP_MAX_HPS; i++)
+        atomic_init(&rec->hp[i], 0);
+    atomic_init(&rec->active, true);
+    atomic_fetch_add(&hp->n_recs, 1);
+    rec->next = atomic_load(&hp->recs);
+    while (!atomic_compare_exchange_weak(&hp->recs, &rec->next, rec))
+        ;
+
+out:
+    tss_set(hp->key, rec);
+    return rec;
+}
+
+static inline list_hp_rec_t *list_hp_rec(list_hp_t *hp)
+{
+    if (hp_cached == hp)
+        return rec_cached;
+
+    list_hp_rec_t *rec = tss_get(hp->key);
+    if (!rec)
+        rec = list_hp_rec_acquire(hp);
+    hp_cached = hp;
+    rec_cached = rec;
+    return rec;
+}
+
+/* Create a new hazard pointer array of size 'max_hps' (or a reasonable
+ * default value if 'max_hps' is 0). The function 'deletefunc' will be
+ * used to delete objects protected by hazard pointers when it becomes
+ * safe to retire them.
+ */
+static inline list_hp_t *list_hp_new(size_t max_hps,
+                                     list_hp_deletefunc_t *deletefunc)
+{
+    list_hp_t *hp = malloc(sizeof(*hp));
+    assert(hp);
+
+    if (max_hps == 0 || max_hps > HP_MAX_HPS)
+        max_hps = HP_MAX_HPS;
+
+    *hp = (list_hp_t){.max_hps = max_hps, .deletefunc = deletefunc};
+    atomic_init(&hp->recs, NULL);
+    atomic_init(&hp->n_recs, 0);
+    if (tss_create(&hp->key, list_hp_rec_release) != thrd_success)
+        abort();
+
+    return hp;
+}
+
+/* Destroy a hazard pointer array and clean up all objects protected
+ * by hazard pointers.
+ */
+static inline void list_hp_destroy(list_hp_t *hp)
+{
+    list_hp_rec_t *rec = atomic_load(&hp->recs);
+    while (rec) {
+        list_hp_rec_t *next = rec->next;
+        for (size_t j = 0; j < rec->rl.size; j++) {
+            void *data = (void *) rec->rl.list[j];
+            hp->deletefunc(data);
+        }
+        free(rec->rl.list);
+        free(rec->snapshot);
+        free(rec);
+        rec = next;
+    }
+    tss_delete(hp->key);
+    if (hp_cached == hp)
+        hp_cached = NULL;
+    free(hp);
+}
+
+/* Clear all hazard pointers in the array for the current thread.
+ * Progress condition: wait-free bounded (by max_hps)
+ */
+static inline void list_hp_clear(list_hp_t *hp)
+{
+    list_hp_rec_t *rec = list_hp_rec(hp);
+    for (int i = 0; i < hp->max_hps; i++)
+        atomic_store_explicit(&rec->hp[i], 0, memory_order_release);
+}
+
+/* This returns the same value that is passed as ptr.
+ * Progress condition: wait-free population oblivious.
+ */
+static inline uintptr_t list_hp_protect_ptr(list_hp_t *hp,
+                                            int ihp,
+                                            uintptr_t ptr)
+{
+    atomic_store(&list_hp_rec(hp)->hp[ihp], ptr);
+    return ptr;
+}
+
+/* Same as list_hp_protect_ptr(), but explicitly uses memory_order_release.
+ * Progress condition: wait-free population oblivious.
+ */
+static inline uintptr_t list_hp_protect_release(list_hp_t *hp,
+                                                int ihp,
+                                                uintptr_t ptr)
+{
+    atomic_store_explicit(&list_hp_rec(hp)->hp[ihp], ptr, memory_order_release);
+    return ptr;
+}
+
+static int uintptr_cmp(const void *a, const void *b)
+{
+    uintptr_t x = *(const uintptr_t *) a, y = *(const uintptr_t *) b;
+    return (x > y) - (x < y);
+}
+
+/* Delete the retired objects of 'rec' that no hazard pointer protects. The
+ * hazard pointers are copied and sorted once, then each retired object is
+ * looked up in the copy.
+ */
+static void list_hp_scan(list_hp_t *hp, list_hp_rec_t *rec)
+{
+    size_t need = atomic_load(&hp->n_recs) * hp->max_hps, n = 0;
+    HOTSTAT_RECORD(backlog, rec->rl.size);
+    if (need > rec->snapshot_capacity) {
+        free(rec->snapshot);
+        rec->snapshot = malloc(need * 2 * sizeof(uintptr_t));
+        assert(rec->snapshot);
+        rec->snapshot_capacity = need * 2;
+    }
+
+    /* Records added after "need" was read are too young to protect any of
+     * the objects retired so far, and are skipped.
+     */
+    for (list_hp_rec_t *r = atomic_load(&hp->recs); r; r = r->next) {
+        for (int ihp = 0; ihp < hp->max_hps; ihp++) {
+            uintptr_t ptr = atomic_load(&r->hp[ihp]);
+            if (ptr && n < rec->snapshot_capacity)
+                rec->snapshot[n++] = ptr;
+        }
+    }
+    qsort(rec->snapshot, n, sizeof(uintptr_t), uintptr_cmp);
+
+    retirelist_t *rl = &rec->rl;
+    size_t kept = 0;
+    for (size_t iret = 0; iret < rl->size; iret++) {
+        uintptr_t obj = rl->list[iret];
+        if (bsearch(&obj, rec->snapshot, n, sizeof(uintptr_t), uintptr_cmp))
+            rl->list[kept++] = obj;
+        else
+            hp->deletefunc((void *) obj);
+    }
+    rl->size = kept;
+}
+
+/* Retire an object that is no longer in use by any thread, calling
+ * the delete function that was specified in list_hp_new().
+ *
+ * Progress condition: wait-free bounded (by the number of threads squared),
+ * amortized O(log H) per retired object
+ */
+static inline void list_hp_retire(list_hp_t *hp, uintptr_t ptr)
+{
+    list_hp_rec_t *rec = list_hp_rec(hp);
+    retirelist_t *rl = &rec->rl;
+
+    if (rl->size == rl->capacity) {
+        rl->capacity = rl->capacity ? rl->capacity * 2 : 64;
+        rl->list = realloc(rl->list, rl->capacity * sizeof(uintptr_t));
+        assert(rl->list);
+    }
+    rl->list[rl->size++] = ptr;
+
+    size_t threshold =
+        HP_THRESHOLD_FACTOR * atomic_load_explicit(&hp->n_recs,
+                                                   memory_order_relaxed) *
+        hp->max_hps;
+    if (rl->size < threshold)
+        return;
+
+    list_hp_scan(hp, rec);
+}
+
+/* The low bit of a link marks its node as logically deleted */
+#define is_marked(p) (bool) ((uintptr_t)(p) &0x01)
+#define get_marked(p) ((uintptr_t)(p) | (0x01))
+#define get_unmarked(p) ((uintptr_t)(p) & (~0x01))
+
+#endif /* _HP_H_ */
@@ -0,0 +1,402 @@
+/*
+ * A lock-free skip list protected by hazard pointers.
+ *
+ * Each node is linked in a sorted list at every level up to its own, from
+ * level 0 up. A node is deleted by marking its links top-down, and it is
+ * logically gone once its level 0 link is marked. Marked nodes are unlinked
+ * by whoever finds them on its path, as in the Harris-style list.
+ *
+ * Reference:
+ * The Art of Multiprocessor Programming, 14.4 "A Lock-Free Concurrent
+ * Skiplist", M. Herlihy and N. Shavit
+ *
+ * The search keeps a hazard pointer on the predecessor and the successor at
+ * each level, so that the insertion can link a node between them. A node is
+ * retired once neither its deleter nor its inserter, which may still be
+ * linking its upper levels, references it anymore.
+ */
+
+#define SKIPLIST_MAX_LEVEL 16
+#define HP_MAX_HPS (2 * SKIPLIST_MAX_LEVEL)
+
+#include "hp.h"
+
+#include <pthread.h>
+#include <time.h>
+
+#define HP_PRED(l) (l)
+#define HP_SUCC(l) (SKIPLIST_MAX_LEVEL + (l))
+
+typedef uintptr_t skiplist_key_t;
+
+typedef struct skiplist_node {
+    uint32_t magic;
+    int level;
+    atomic_int refs; /* the list and the inserter */
+    skiplist_key_t key;
+    atomic_uintptr_t next[];
+} skiplist_node_t;
+
+typedef struct skiplist {
+    skiplist_node_t *head, *tail;
+    list_hp_t *hp;
+} skiplist_t;
+
+#define SKIPLIST_MAGIC (0xDEADBEAF)
+
+#define get_unmarked_node(p) ((skiplist_node_t *) get_unmarked(p))
+
+static skiplist_node_t *skiplist_node_new(skiplist_key_t key, int level)
+{
+    skiplist_node_t *node =
+        malloc(sizeof(*node) + level * sizeof(atomic_uintptr_t));
+    assert(node);
+    node->magic = SKIPLIST_MAGIC;
+    node->level = level;
+    node->key = key;
+    atomic_init(&node->refs, 2);
+    for (int l = 0; l < level; l++)
+        atomic_init(&node->next[l], 0);
+    COUNT(inserts);
+    return node;
+}
+
+static void skiplist_node_destroy(skiplist_node_t *node)
+{
+    assert(node->magic == SKIPLIST_MAGIC);
+    free(node);
+    COUNT(deletes);
+}
+
+static void __skiplist_node_delete(void *arg)
+{
+    skiplist_node_destroy((skiplist_node_t *) arg);
+}
+
+/* Drop a reference, the last one retires the node */
+static void skiplist_node_put(skiplist_t *sl, skiplist_node_t *node)
+{
+    if (atomic_fetch_sub(&node->refs, 1) == 1)
+        list_hp_retire(sl->hp, (uintptr_t) node);
+}
+
+/* Geometric distribution, each level is half as likely as the one below */
+static int skiplist_random_level(void)
+{
+    static thread_local uint32_t seed;
+    if (!seed)
+        seed = (uint32_t) (uintptr_t) &seed | 1;
+
+    /* xorshift32 */
+    seed ^= seed << 13;
+    seed ^= seed >> 17;
+    seed ^= seed << 5;
+    return __builtin_ctz(seed | (1U << (SKIPLIST_MAX_LEVEL - 1))) + 1;
+}
+
+/* Fill preds[] and succs[] with the nodes around @key at every level, and
+ * unlink the marked nodes on the way. The nodes stay protected by the hazard
+ * pointers HP_PRED(l) and HP_SUCC(l) until the next search.
+ * @return true if succs[0] holds @key.
+ */
+static bool __skiplist_find(skiplist_t *sl,
+                            skiplist_key_t key,
+                            skiplist_node_t **preds,
+                            skiplist_node_t **succs)
+{
+    list_hp_t *hp = sl->hp;
+    skiplist_node_t *pred, *curr;
+    uintptr_t succ;
+
+try_again:
+    pred = sl->head;
+    for (int l = SKIPLIST_MAX_LEVEL - 1; l >= 0; l--) {
+        /* pred is already protected as the predecessor one level up */
+        (void) list_hp_protect_release(hp, HP_PRED(l), (uintptr_t) pred);
+        curr = (skiplist_node_t *) ATOMIC_LOAD(&pred->next[l]);
+        if (is_marked(curr))
+            goto retry;
+        (void) list_hp_protect_ptr(hp, HP_SUCC(l), (uintptr_t) curr);
+        if (ATOMIC_LOAD(&pred->next[l]) != (uintptr_t) curr)
+            goto retry;
+
+        while (curr != sl->tail) {
+            succ = ATOMIC_LOAD(&curr->next[l]);
+            if (is_marked(succ)) {
+                /* curr is deleted, unlink it at this level */
+                uintptr_t tmp = (uintptr_t) curr;
+                if (!CAS(&pred->next[l], &tmp, get_unmarked(succ)))
+                    goto retry;
+            } else if (curr->key < key) {
+                pred = curr;
+                (void) list_hp_protect_release(hp, HP_PRED(l),
+                                               (uintptr_t) pred);
+                TRACE(traversal);
+            } else {
+                break;
+            }
+
+            curr = get_unmarked_node(succ);
+            (void) list_hp_protect_ptr(hp, HP_SUCC(l), (uintptr_t) curr);
+            if (ATOMIC_LOAD(&pred->next[l]) != (uintptr_t) curr)
+                goto retry;
+        }
+        preds[l] = pred;
+        succs[l] = curr;
+    }
+    return succs[0] != sl->tail && succs[0]->key == key;
+
+retry:
+    TRACE(retry);
+    goto try_again;
+}
+
+bool skiplist_insert(skiplist_t *sl, skiplist_key_t key)
+{
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    int top = skiplist_random_level();
+    skiplist_node_t *node = skiplist_node_new(key, top);
+
+    while (true) {
+        if (__skiplist_find(sl, key, preds, succs)) {
+            skiplist_node_destroy(node);
+            list_hp_clear(sl->hp);
+            return false;
+        }
+        for (int l = 0; l < top; l++)
+            ATOMIC_STORE_EXPLICIT(&node->next[l], (uintptr_t) succs[l],
+                                  memory_order_relaxed);
+
+        /* Linking level 0 makes the node part of the set */
+        uintptr_t tmp = (uintptr_t) succs[0];
+        if (CAS(&preds[0]->next[0], &tmp, (uintptr_t) node))
+            break;
+        TRACE(ins);
+    }
+
+    for (int l = 1; l < top; l++) {
+        while (true) {
+            /* Stop if a deleter started marking the node */
+            uintptr_t next = ATOMIC_LOAD(&node->next[l]);
+            if (is_marked(next))
+                goto out;
+            if (next != (uintptr_t) succs[l] &&
+                !CAS(&node->next[l], &next, (uintptr_t) succs[l]))
+                goto out;
+
+            uintptr_t tmp = (uintptr_t) succs[l];
+            if (CAS(&preds[l]->next[l], &tmp, (uintptr_t) node))
+                break;
+            TRACE(ins);
+            __skiplist_find(sl, key, preds, succs);
+            if (succs[0] != node)
+                goto out;
+        }
+    }
+
+out:
+    /* A deleter may have finished unlinking before the upper levels were
+     * linked, then unlink them again.
+     */
+    if (is_marked(ATOMIC_LOAD(&node->next[0])))
+        __skiplist_find(sl, key, preds, succs);
+    list_hp_clear(sl->hp);
+    skiplist_node_put(sl, node);
+    return true;
+}
+
+bool skiplist_delete(skiplist_t *sl, skiplist_key_t key)
+{
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+
+    if (!__skiplist_find(sl, key, preds, succs)) {
+        list_hp_clear(sl->hp);
+        return false;
+    }
+
+    skiplist_node_t *node = succs[0];
+    for (int l = node->level - 1; l > 0; l--) {
+        uintptr_t next = ATOMIC_LOAD(&node->next[l]);
+        while (!is_marked(next) &&
+               !CAS(&node->next[l], &next, get_marked(next)))
+            ;
+    }
+
+    /* Whoever marks level 0 deletes the node */
+    uintptr_t next = ATOMIC_LOAD(&node->next[0]);
+    while (true) {
+        if (is_marked(next)) {
+            list_hp_clear(sl->hp);
+            return false;
+        }
+        if (CAS(&node->next[0], &next, get_marked(next)))
+            break;
+        TRACE(del);
+    }
+
+    /* Unlink it at every level, the reference keeps it from being freed */
+    __skiplist_find(sl, key, preds, succs);
+    list_hp_clear(sl->hp);
+    skiplist_node_put(sl, node);
+    return true;
+}
+
+bool skiplist_contains(skiplist_t *sl, skiplist_key_t key)
+{
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    bool found = __skiplist_find(sl, key, preds, succs);
+    list_hp_clear(sl->hp);
+    return found;
+}
+
+/* Call @fn on the keys in [@lo, @hi] in ascending order. Each key is
+ * reported once, keys inserted or deleted meanwhile may or may not be.
+ * @return the number of keys reported.
+ */
+size_t skiplist_range(skiplist_t *sl,
+                      skiplist_key_t lo,
+                      skiplist_key_t hi,
+                      void (*fn)(skiplist_key_t key, void *arg),
+                      void *arg)
+{
+    skiplist_node_t *preds[SKIPLIST_MAX_LEVEL], *succs[SKIPLIST_MAX_LEVEL];
+    skiplist_key_t from = lo;
+    size_t count = 0;
+
+restart:
+    __skiplist_find(sl, from, preds, succs);
+
+    /* Walk level 0, hand over hand between two hazard pointers */
+    skiplist_node_t *curr = succs[0];
+    int hp_curr = HP_SUCC(0), hp_next = HP_PRED(0);
+    while (curr != sl->tail && curr->key <= hi) {
+        uintptr_t next = ATOMIC_LOAD(&curr->next[0]);
+        if (is_marked(next)) {
+            /* Its successor may be gone already, search again */
+            from = curr->key;
+            TRACE(retry);
+            goto restart;
+        }
+        fn(curr->key, arg);
+        count++;
+        if (curr->key == hi)
+            break;
+        from = curr->key + 1;
+
+        (void) list_hp_protect_ptr(sl->hp, hp_next, next);
+        if (ATOMIC_LOAD(&curr->next[0]) != next) {
+            TRACE(retry);
+            goto restart;
+        }
+        curr = (skiplist_node_t *) next;
+        int tmp = hp_curr;
+        hp_curr = hp_next;
+        hp_next = tmp;
+        TRACE(traversal);
+    }
+    list_hp_clear(sl->hp);
+    return count;
+}
+
+skiplist_t *skiplist_new(void)
+{
+    skiplist_t *sl = calloc(1, sizeof(*sl));
+    assert(sl);
+    sl->head = skiplist_node_new(0, SKIPLIST_MAX_LEVEL);
+    sl->tail = skiplist_node_new(UINTPTR_MAX, SKIPLIST_MAX_LEVEL);
+    for (int l = 0; l < SKIPLIST_MAX_LEVEL; l++)
+        atomic_init(&sl->head->next[l], (uintptr_t) sl->tail);
+    sl->hp = list_hp_new(HP_MAX_HPS, __skiplist_node_delete);
+    return sl;
+}
+
+void skiplist_destroy(skiplist_t *sl)
+{
+    skiplist_node_t *node = sl->head;
+    while (node) {
+        skiplist_node_t *next = get_unmarked_node(atomic_load(&node->next[0]));
+        skiplist_node_destroy(node);
+        node = next;
+    }
+    list_hp_destroy(sl->hp);
+    free(sl);
+}
+
+/* Test program starts here */
+
+#define N_THREADS 16
+#define N_OPS 20000
+#define KEY_RANGE 1024
+#define RANGE_WIDTH 32
+
+static atomic_uint_fast64_t ops;
+
+static void count_key(skiplist_key_t key, void *arg)
+{
+    skiplist_key_t *last = arg;
+    assert(key > *last);
+    *last = key;
+}
+
+static void *worker(void *arg)
+{
+    skiplist_t *sl = arg;
+    uint32_t r = (uint32_t) (uintptr_t) &r;
+
+    for (int i = 0; i < N_OPS; i++) {
+        r = r * 1103515245 + 12345;
+        skiplist_key_t key = (r >> 8) % KEY_RANGE + 1;
+        switch ((r >> 4) % 5) {
+        case 0:
+        case 1:
+            (void) skiplist_insert(sl, key);
+            break;
+        case 2:
+        case 3:
+            (void) skiplist_delete(sl, key);
+            break;
+        default: {
+            skiplist_key_t last = key - 1;
+            (void) skiplist_range(sl, key, key + RANGE_WIDTH, count_key, &last);
+        }
+        }
+    }
+    atomic_fetch_add(&ops, N_OPS);
+    return NULL;
+}
+
+int main(void)
+{
+    RUNTIME_STAT_INIT();
+    skiplist_t *sl = skiplist_new();
+    pthread_t thr[N_THREADS];
+    struct timespec start, end;
+
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (size_t i = 0; i < N_THREADS; i++)
+        pthread_create(&thr[i], NULL, worker, sl);
+    for (size_t i = 0; i < N_THREADS; i++)
+        pthread_join(thr[i], NULL);
+    clock_gettime(CLOCK_MONOTONIC, &end);
+
+    /* Every level must be sorted and free of marked nodes */
+    for (int l = 0; l < SKIPLIST_MAX_LEVEL; l++) {
+        skiplist_node_t *node = sl->head;
+        while (node != sl->tail) {
+            uintptr_t next = atomic_load(&node->next[l]);
+            assert(!is_marked(next));
+            assert(node->key < ((skiplist_node_t *) next)->key);
+            node = (skiplist_node_t *) next;
+        }
+    }
+
+    skiplist_key_t last = 0;
+    size_t n = skiplist_range(sl, 1, KEY_RANGE, count_key, &last);
+    double sec =
+        (end.tv_sec - start.tv_sec) + (end.tv_nsec - start.tv_nsec) / 1e9;
+    printf("%" PRIuFAST64 " ops in %.3f s, %.0f ops/s, %zu keys left\n",
+           atomic_load(&ops), sec, atomic_load(&ops) / sec, n);
+
+    skiplist_destroy(sl);
+    return 0;
+}
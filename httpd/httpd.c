@@ -1,8 +1,11 @@
+#define _GNU_SOURCE
+
 /* System parameters */
 const int PORT = 9000;
 #define BACKLOG 1024
 #define N_THREADS 24 * sysconf(_SC_NPROCESSORS_ONLN)
 #define MAXMSG 1024
+#define MAX_EVENTS 64 /* events fetched per epoll_wait() in epoll mode */
 
 /* File parameters */
 const char *DOCUMENT_ROOT;
@@ -23,6 +26,7 @@ typedef struct {
 } queue_t;
 
 #include <errno.h>
+#include <stdbool.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -112,6 +116,7 @@ static void dequeue(queue_t *q, int *fd)
 
 typedef int status_t;
 enum {
+    STATUS_AGAIN = 0, /* internal: request is not complete yet */
     STATUS_OK = 200,
     STATUS_BAD_REQUEST = 400,
     STATUS_FORBIDDEN = 403,
@@ -143,15 +148,13 @@ typedef struct {
 #include <string.h>
 
 /* A collection of useful functions for parsing HTTP messages.
- * See function parse_request for high-level control flow and work upward.
+ * See function http_parse for high-level control flow and work upward.
  */
 
-/* TRY_CATCH and TRY_CATCH_S are private macros that "throw" appropriate
- * status codes whenever a parsing method encounters an error. By wrapping
- * every parsing method call in a TRY_CATCH, errors may be piped up to the
- * original parse_request call. The second TRY_CATCH_S macro is for specially
- * translating the error outputs of the string.h function strsep into the
- * BAD_REQUEST (400) status code.
+/* TRY_CATCH is a private macro that "throws" appropriate status codes
+ * whenever a parsing method encounters an error. By wrapping every parsing
+ * method call in a TRY_CATCH, errors may be piped up to the original
+ * http_parse call.
  */
 #define TRY_CATCH(STATEMENT)      \
     do {                          \
@@ -160,12 +163,6 @@ typedef struct {
             return s;             \
     } while (0)
 
-#define TRY_CATCH_S(STATEMENT)         \
-    do {                               \
-        if (!(STATEMENT))              \
-            return STATUS_BAD_REQUEST; \
-    } while (0)
-
 static const char *type_to_str(const content_type_t type)
 {
     switch (type) {
@@ -209,33 +206,6 @@ static const char *status_to_str(status_t status)
     }
 }
 
-/* Private utility method that acts like strsep(s," \t"), but also advances
- * s so that it skips any additional whitespace.
- */
-static char *strsep_whitespace(char **s)
-{
-    char *ret = strsep(s, " \t");
-    while (*s && (**s == ' ' || **s == '\t'))
-        (*s)++; /* extra whitespace */
-    return ret;
-}
-
-/* Same as strsep_whitespace, but for newlines. */
-static char *strsep_newline(char **s)
-{
-    char *ret;
-    char *r = strchr(*s, '\r');
-    char *n = strchr(*s, '\n');
-
-    if (!r || n < r)
-        ret = strsep(s, "\n");
-    else {
-        ret = strsep(s, "\r");
-        (*s)++; /* advance past the trailing \n */
-    }
-    return ret;
-}
-
 static status_t parse_method(char *token, http_request_t *request)
 {
     if (strcmp(token, "GET") == 0)
@@ -268,35 +238,157 @@ static status_t parse_protocol_version(char *token, http_request_t *request)
     return STATUS_OK;
 }
 
-static status_t parse_initial_line(char *line, http_request_t *request)
+/* Resumable HTTP request parser.
+ *
+ * The parser walks the receive buffer in place and remembers its position,
+ * so a request split over several recv() calls is scanned only once. The
+ * tokens of the request line are NUL-terminated inside the buffer and handed
+ * to the parse_* methods above. Header lines are skipped as they go by and
+ * never need to be retained, so they may be arbitrarily large: the caller
+ * compacts away everything before http_keep() between reads. Once a request
+ * is complete, @pos points just past it, which is where the next pipelined
+ * request begins.
+ */
+typedef enum {
+    PS_METHOD,
+    PS_PATH,
+    PS_VERSION,
+    PS_LINE_WS,  /* trailing whitespace after the protocol version */
+    PS_LINE_LF,  /* saw '\r' ending the request line */
+    PS_HEADER,   /* start of a header line (or the blank line) */
+    PS_FIELD,    /* inside a header line */
+    PS_FIELD_LF, /* saw '\r' ending a header line */
+    PS_END_LF,   /* saw '\r' of the terminating blank line */
+} parse_state_t;
+
+typedef struct {
+    parse_state_t state;
+    size_t pos;    /* next byte to examine */
+    size_t mark;   /* start of the token being scanned */
+    bool in_token; /* whether @mark is meaningful */
+} http_parser_t;
+
+static void http_parser_init(http_parser_t *p)
+{
+    p->state = PS_METHOD;
+    p->pos = p->mark = 0;
+    p->in_token = false;
+}
+
+/* Offset of the first byte the parser still needs */
+static size_t http_keep(const http_parser_t *p)
 {
-    char *token;
-    TRY_CATCH_S(token = strsep_whitespace(&line));
-    TRY_CATCH(parse_method(token, request));
-    TRY_CATCH_S(token = strsep_whitespace(&line));
-    TRY_CATCH(parse_path(token, request));
-    TRY_CATCH_S(token = strsep_whitespace(&line));
-    TRY_CATCH(parse_protocol_version(token, request));
+    return p->in_token ? p->mark : p->pos;
+}
 
-    return STATUS_OK;
+/* Whether the parser sits between two requests */
+static bool http_idle(const http_parser_t *p)
+{
+    return p->state == PS_METHOD && !p->in_token;
 }
 
-/* FIXME: Currently ignores any request headers */
-static status_t parse_header(char *line, http_request_t *request)
+/* Discard the first @n bytes of the buffer the parser is working on */
+static void http_shift(http_parser_t *p, size_t n)
 {
-    (void) line, (void) request;
-    return STATUS_OK;
+    p->pos -= n;
+    if (p->in_token)
+        p->mark -= n;
 }
 
-static status_t parse_request(char *msg, http_request_t *request)
+static inline bool is_blank(char c)
 {
-    char *line;
-    TRY_CATCH_S(line = strsep_newline(&msg));
-    TRY_CATCH(parse_initial_line(line, request));
-    while ((line = strsep_newline(&msg)) != NULL && *line != '\0')
-        TRY_CATCH(parse_header(line, request));
+    return c == ' ' || c == '\t';
+}
 
-    return STATUS_OK;
+/* Close the token that ends at @pos and hand it to @parse */
+#define TOKEN_END(parse)                                \
+    do {                                                \
+        buf[p->pos] = '\0';                             \
+        p->in_token = false;                            \
+        TRY_CATCH(parse(buf + p->mark, request));       \
+    } while (0)
+
+/* Scan buf[p->pos..len). Return STATUS_AGAIN if more input is needed,
+ * STATUS_OK once a whole request has been parsed into @request, or an error
+ * status.
+ */
+static status_t http_parse(http_parser_t *p,
+                           char *buf,
+                           size_t len,
+                           http_request_t *request)
+{
+    if (p->state == PS_METHOD && !p->in_token)
+        request->protocol_version = 1; /* until told otherwise */
+
+    for (; p->pos < len; p->pos++) {
+        char c = buf[p->pos];
+        switch (p->state) {
+        case PS_METHOD:
+        case PS_PATH:
+        case PS_VERSION:
+            if (!p->in_token) {
+                if (is_blank(c))
+                    continue; /* extra whitespace */
+                if (c == '\r' || c == '\n')
+                    return STATUS_BAD_REQUEST;
+                p->mark = p->pos, p->in_token = true;
+                continue;
+            }
+            if (p->state == PS_METHOD && is_blank(c)) {
+                TOKEN_END(parse_method);
+                p->state = PS_PATH;
+            } else if (p->state == PS_PATH && is_blank(c)) {
+                TOKEN_END(parse_path);
+                p->state = PS_VERSION;
+            } else if (p->state == PS_VERSION &&
+                       (is_blank(c) || c == '\r' || c == '\n')) {
+                TOKEN_END(parse_protocol_version);
+                p->state = c == '\r'   ? PS_LINE_LF
+                           : c == '\n' ? PS_HEADER
+                                       : PS_LINE_WS;
+            } else if (c == '\r' || c == '\n') {
+                return STATUS_BAD_REQUEST; /* truncated request line */
+            }
+            break;
+        case PS_LINE_WS:
+            if (c == '\r')
+                p->state = PS_LINE_LF;
+            else if (c == '\n')
+                p->state = PS_HEADER;
+            else if (!is_blank(c))
+                return STATUS_BAD_REQUEST;
+            break;
+        case PS_LINE_LF:
+        case PS_FIELD_LF:
+            if (c != '\n')
+                return STATUS_BAD_REQUEST;
+            p->state = PS_HEADER;
+            break;
+        case PS_HEADER:
+            if (c == '\r') {
+                p->state = PS_END_LF;
+                break;
+            }
+            if (c == '\n') {
+                p->pos++;
+                return STATUS_OK;
+            }
+            p->state = PS_FIELD;
+            /* fall through */
+        case PS_FIELD: /* FIXME: Currently ignores any request headers */
+            if (c == '\r')
+                p->state = PS_FIELD_LF;
+            else if (c == '\n')
+                p->state = PS_HEADER;
+            break;
+        case PS_END_LF:
+            if (c != '\n')
+                return STATUS_BAD_REQUEST;
+            p->pos++;
+            return STATUS_OK;
+        }
+    }
+    return STATUS_AGAIN;
 }
 
 #include <arpa/inet.h>
@@ -342,8 +434,12 @@ static int listen_(int socket, int backlog)
     return ret;
 }
 
-/* Initialize listening socket */
-static int listening_socket()
+/* Initialize listening socket. With @reuseport set, the socket is
+ * non-blocking and bound with SO_REUSEPORT, so that every epoll worker can
+ * own a private listener and the kernel spreads incoming connections among
+ * them.
+ */
+static int listening_socket(bool reuseport)
 {
     struct sockaddr_in serveraddr;
     memset(&serveraddr, 0, sizeof(serveraddr));
@@ -352,93 +448,985 @@ static int listening_socket()
     serveraddr.sin_addr.s_addr = htonl(INADDR_ANY);
 
     int listenfd = socket_(AF_INET, SOCK_STREAM, 0);
+    int one = 1;
+    setsockopt(listenfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (reuseport) {
+        if (setsockopt(listenfd, SOL_SOCKET, SO_REUSEPORT, &one,
+                       sizeof(one)) < 0) {
+            perror("SO_REUSEPORT");
+            exit(1);
+        }
+        fcntl(listenfd, F_SETFL, fcntl(listenfd, F_GETFL) | O_NONBLOCK);
+    }
     bind_(listenfd, (struct sockaddr *) &serveraddr, sizeof(serveraddr));
     listen_(listenfd, BACKLOG);
     return listenfd;
 }
 
+/* Outcome of sending as much as the socket takes. Connections owned by an
+ * epoll worker are non-blocking, what is left of a response is sent once
+ * the socket is writable again.
+ */
+typedef enum { SEND_DONE, SEND_AGAIN, SEND_ERROR } send_status_t;
+
+#include <stdatomic.h>
+#include <stdint.h>
+#include <sys/sendfile.h>
+
+/* Bounded cache of open files and their stat results, keyed by request
+ * path. The cache is direct-mapped: each path hashes to one slot guarded by
+ * its own mutex, and a colliding path simply evicts the previous occupant.
+ * An entry is revalidated against the file's mtime at most once per second,
+ * so a hit normally costs no syscall at all besides the sendfile() itself.
+ *
+ * Entries are reference counted because a worker may still be streaming
+ * from a descriptor that another worker has just evicted.
+ */
+#define FILE_CACHE_SLOTS 256 /* must be a power of 2 */
+
+typedef struct {
+    int fd;
+    struct stat st;
+    atomic_int refcnt;
+    int length_len;
+    char length_hdr[32]; /* precomputed "Content-Length:" header line */
+} file_t;
+
+typedef struct {
+    pthread_mutex_t lock;
+    char path[MAXPATH];
+    file_t *file;
+    time_t checked; /* last time the entry was revalidated */
+} file_slot_t;
+
+static file_slot_t file_cache[FILE_CACHE_SLOTS];
+static bool use_sendfile = true;
+
+static void file_cache_init(void)
+{
+    for (int i = 0; i < FILE_CACHE_SLOTS; i++)
+        pthread_mutex_init(&file_cache[i].lock, NULL);
+}
+
+static void file_put(file_t *f)
+{
+    if (atomic_fetch_sub_explicit(&f->refcnt, 1, memory_order_acq_rel) == 1) {
+        close(f->fd);
+        free(f);
+    }
+}
+
+static file_t *file_open(const char *path)
+{
+    file_t *f = malloc(sizeof(file_t));
+    if (!f)
+        return NULL;
+    if ((f->fd = open(path, O_RDONLY | O_CLOEXEC)) < 0)
+        goto fail;
+    if (fstat(f->fd, &f->st) < 0 || !S_ISREG(f->st.st_mode)) {
+        close(f->fd);
+        goto fail;
+    }
+    f->length_len = snprintf(f->length_hdr, sizeof(f->length_hdr),
+                             "Content-Length: %lld\r\n",
+                             (long long) f->st.st_size);
+    atomic_init(&f->refcnt, 1); /* reference owned by the cache */
+    return f;
+
+fail:
+    free(f);
+    return NULL;
+}
+
+static bool file_changed(const struct stat *old, const struct stat *st)
+{
+    return old->st_ino != st->st_ino || old->st_dev != st->st_dev ||
+           old->st_size != st->st_size ||
+           old->st_mtim.tv_sec != st->st_mtim.tv_sec ||
+           old->st_mtim.tv_nsec != st->st_mtim.tv_nsec;
+}
+
+/* FNV-1a */
+static uint32_t path_hash(const char *path)
+{
+    uint32_t h = 2166136261u;
+    while (*path)
+        h = (h ^ (unsigned char) *path++) * 16777619u;
+    return h;
+}
+
+/* Look up (or open and insert) @path. The returned file holds a reference
+ * that must be dropped with file_put(). Return NULL if the file cannot be
+ * opened.
+ */
+static file_t *file_get(const char *path)
+{
+    file_slot_t *slot = &file_cache[path_hash(path) & (FILE_CACHE_SLOTS - 1)];
+    time_t now = time(NULL);
+    file_t *f;
+
+    pthread_mutex_lock(&slot->lock);
+    if ((f = slot->file) && !strcmp(slot->path, path)) {
+        if (slot->checked != now) {
+            struct stat st;
+            if (stat(path, &st) < 0 || file_changed(&f->st, &st)) {
+                slot->file = NULL;
+                file_put(f);
+                goto miss;
+            }
+            slot->checked = now;
+        }
+        atomic_fetch_add_explicit(&f->refcnt, 1, memory_order_relaxed);
+        pthread_mutex_unlock(&slot->lock);
+        return f;
+    }
+
+    if (f) { /* evict the colliding path */
+        slot->file = NULL;
+        file_put(f);
+    }
+miss:
+    if ((f = file_open(path))) {
+        snprintf(slot->path, MAXPATH, "%s", path);
+        slot->file = f;
+        slot->checked = now;
+        atomic_fetch_add_explicit(&f->refcnt, 1, memory_order_relaxed);
+    }
+    pthread_mutex_unlock(&slot->lock);
+    return f;
+}
+
+/* Stream the file from *@off to its end with sendfile(), which copies from
+ * the page cache straight into the socket without a round trip through
+ * userspace.
+ */
+static send_status_t sendfile_all(int connfd, file_t *f, off_t *off)
+{
+    while (*off < f->st.st_size) {
+        ssize_t n = sendfile(connfd, f->fd, off, f->st.st_size - *off);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SEND_AGAIN;
+            return SEND_ERROR;
+        }
+        if (n == 0) /* file was truncated underneath us */
+            return SEND_ERROR;
+    }
+    return SEND_DONE;
+}
+
+#include <sys/uio.h>
+#include "seqlock.h"
+
+/* Write the iovec array, coping with short writes, and advance *@iov and
+ * *@iovcnt past what was written. @flags is passed to sendmsg(), e.g.
+ * MSG_MORE when a body follows the headers.
+ */
+static send_status_t sendmsg_all(int connfd,
+                                 struct iovec **iov,
+                                 int *iovcnt,
+                                 int flags)
+{
+    while (*iovcnt > 0) {
+        struct msghdr mh = {.msg_iov = *iov, .msg_iovlen = *iovcnt};
+        ssize_t n = sendmsg(connfd, &mh, flags | MSG_NOSIGNAL);
+        if (n < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return SEND_AGAIN;
+            return SEND_ERROR;
+        }
+        /* Skip what has been written */
+        while (*iovcnt > 0 && (size_t) n >= (*iov)->iov_len) {
+            n -= (*iov)->iov_len;
+            (*iov)++, (*iovcnt)--;
+        }
+        if (*iovcnt > 0) {
+            (*iov)->iov_base = (char *) (*iov)->iov_base + n;
+            (*iov)->iov_len -= n;
+        }
+    }
+    return SEND_DONE;
+}
+
+/* The "Date:" header only changes once per second, so it is formatted once
+ * and shared by all workers. Whichever worker first notices that the clock
+ * has moved on regenerates it; everyone else copies it out under the
+ * seqlock and never observes a half-written string.
+ */
+typedef struct {
+    time_t now;
+    size_t len;
+    char str[48];
+} date_cache_t;
+
+static seqlock_t date_lock;
+static date_cache_t date_cache;
+
+static void date_header(date_cache_t *d)
+{
+    time_t now = time(NULL);
+    seqlock_read(&date_lock, d, &date_cache, sizeof(*d));
+    if (d->now == now)
+        return;
+
+    seqlock_acquire_wr(&date_lock);
+    if (date_cache.now != now) { /* nobody beat us to it */
+        struct tm tm;
+        date_cache.len = strftime(date_cache.str, sizeof(date_cache.str),
+                                  "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
+                                  gmtime_r(&now, &tm));
+        date_cache.now = now;
+    }
+    *d = date_cache;
+    seqlock_release_wr(&date_lock);
+}
+
+/* "Content-Type:" header lines, built once at startup */
+static char type_hdr[VIDEO + 1][40];
+
+static void header_cache_init(void)
+{
+    seqlock_init(&date_lock);
+    for (content_type_t t = APPLICATION; t <= VIDEO; t++)
+        snprintf(type_hdr[t], sizeof(type_hdr[t]), "Content-Type: %s\r\n",
+                 type_to_str(t));
+}
+
+/* Status line and header lines of a response, one per iovec, pointing to
+ * the lines formatted on the fly in here or to the caches
+ */
+typedef struct {
+    char line[64], length[32];
+    date_cache_t date;
+    struct iovec iov[6];
+    int iovcnt;
+} response_head_t;
+
+/* Lay out the head of the response. The body of a successful GET is the
+ * cached file @f, or the file of @st if @f is NULL.
+ */
+static void response_head(response_head_t *h,
+                          status_t status,
+                          http_request_t *request,
+                          file_t *f,
+                          const struct stat *st)
+{
+    struct iovec *iov = h->iov;
+    int len;
+
+    h->iovcnt = 0;
+
+    /* Initial line */
+    len = snprintf(h->line, sizeof(h->line), "HTTP/1.%d %d %s\r\n",
+                   request->protocol_version, status, status_to_str(status));
+    iov[h->iovcnt++] = (struct iovec){h->line, len};
+
+    /* Header lines */
+    date_header(&h->date);
+    iov[h->iovcnt++] = (struct iovec){h->date.str, h->date.len};
+    if (status == STATUS_OK && request->method == GET) {
+        if (f) {
+            iov[h->iovcnt++] = (struct iovec){f->length_hdr, f->length_len};
+        } else {
+            len = snprintf(h->length, sizeof(h->length),
+                           "Content-Length: %d\r\n", (int) st->st_size);
+            iov[h->iovcnt++] = (struct iovec){h->length, len};
+        }
+        const char *type = type_hdr[request->type];
+        iov[h->iovcnt++] = (struct iovec){(void *) type, strlen(type)};
+    }
+    iov[h->iovcnt++] = (struct iovec){"\r\n", 2};
+}
+
+/* A response on its way out. The head, and the chunks of a body read from
+ * an uncached file, go out of iov, which is advanced as they are sent. A
+ * cached body goes out with sendfile() from off. The socket may take only
+ * part of it at a time: in epoll mode, the rest is sent once the socket is
+ * writable again, rather than waited for in the worker.
+ */
+typedef struct {
+    bool pending; /* between response_start() and response_end() */
+    bool keep;    /* whether the connection outlives the response */
+    response_head_t h;
+    struct iovec *iov; /* what is left of h.iov */
+    int iovcnt;
+    file_t *f;       /* cached body */
+    int file;        /* uncached body */
+    off_t off, size; /* of the body, sent or read so far and in all */
+    char chunk[MAXMSG];
+} response_t;
+
+/* Lay out the status line, the headers and, for a GET, find the body */
+static void response_start(response_t *r,
+                           status_t status,
+                           http_request_t *request)
+{
+    struct stat st;
+
+    r->f = NULL;
+    r->file = -1;
+    r->off = r->size = 0;
+    if (status == STATUS_OK && request->method == GET) {
+        if (use_sendfile) {
+            if (!(r->f = file_get(request->path)))
+                status = STATUS_NOT_FOUND;
+            else
+                r->size = r->f->st.st_size;
+        } else if ((r->file = open(request->path, O_RDONLY)) < 0) {
+            perror("open");
+            status = STATUS_NOT_FOUND;
+        } else if (fstat(r->file, &st) < 0 || !S_ISREG(st.st_mode)) {
+            /* Only regular files have a body of st_size bytes */
+            close(r->file);
+            r->file = -1;
+            status = STATUS_NOT_FOUND;
+        } else {
+            r->size = st.st_size;
+        }
+    }
+
+    response_head(&r->h, status, request, r->f, &st);
+    r->iov = r->h.iov;
+    r->iovcnt = r->h.iovcnt;
+
+    /* Piggyback the first chunk of an uncached file on the headers */
+    if (r->file >= 0 && r->size > 0) {
+        ssize_t len = read(r->file, r->chunk, MAXMSG);
+        if (len > 0) {
+            if (len > r->size)
+                len = r->size;
+            r->h.iov[r->iovcnt++] = (struct iovec){r->chunk, len};
+            r->off = len;
+        }
+    }
+
+    /* If HTTP/1.0 or recv error, close connection. */
+    r->keep = request->protocol_version != 0 && status == STATUS_OK;
+    r->pending = true;
+}
+
+/* Send what is left of @r. All header lines go out in a single sendmsg();
+ * the body follows under MSG_MORE so that small files share a segment with
+ * the headers. Once Content-Length went out, a short body leaves the client
+ * out of sync with what follows on the connection, so a file that cannot be
+ * sent in full is an error.
+ */
+static send_status_t response_send(int connfd, response_t *r)
+{
+    while (1) {
+        if (r->iovcnt > 0) {
+            send_status_t ret = sendmsg_all(connfd, &r->iov, &r->iovcnt,
+                                            r->off < r->size ? MSG_MORE : 0);
+            if (ret != SEND_DONE)
+                return ret;
+        }
+        if (r->off == r->size)
+            return SEND_DONE;
+        if (r->f)
+            return sendfile_all(connfd, r->f, &r->off);
+
+        /* Next chunk of the uncached file */
+        ssize_t len = read(r->file, r->chunk, MAXMSG);
+        if (len < 0 && errno == EINTR)
+            continue;
+        if (len <= 0) { /* read error, or truncated underneath us */
+            if (len < 0)
+                perror("read");
+            return SEND_ERROR;
+        }
+        if (len > r->size - r->off)
+            len = r->size - r->off;
+        r->h.iov[0] = (struct iovec){r->chunk, len};
+        r->iov = r->h.iov;
+        r->iovcnt = 1;
+        r->off += len;
+    }
+}
+
+static void response_end(response_t *r)
+{
+    if (r->f)
+        file_put(r->f);
+    if (r->file >= 0)
+        close(r->file);
+    r->pending = false;
+}
+
+/* Send a whole response, as far as the socket takes it without blocking.
+ * Return true if it all went out and the connection may be kept alive.
+ */
+static bool send_response(int connfd,
+                          status_t status,
+                          http_request_t *request)
+{
+    static __thread response_t r;
+
+    response_start(&r, status, request);
+    bool keep = response_send(connfd, &r) == SEND_DONE && r.keep;
+    response_end(&r);
+    return keep;
+}
+
+/* Per-connection receive state. In epoll mode a connection is owned by the
+ * worker that accepted it for its whole lifetime, so no locking is needed.
+ */
+typedef struct {
+    int fd;
+    size_t recv_bytes;
+    http_parser_t parser;
+    char msg[MAXMSG];
+} conn_t;
+
+static void conn_init(conn_t *c, int fd)
+{
+    c->fd = fd, c->recv_bytes = 0;
+    http_parser_init(&c->parser);
+}
+
+/* Parse the next request buffered in @c. Return STATUS_AGAIN, with room
+ * made for the next recv(), if it is not complete yet.
+ */
+static status_t conn_parse(conn_t *c, http_request_t *request)
+{
+    http_parser_t *p = &c->parser;
+    status_t status = http_parse(p, c->msg, c->recv_bytes, request);
+    if (status == STATUS_AGAIN) {
+        size_t keep = http_keep(p);
+        memmove(c->msg, c->msg + keep, c->recv_bytes - keep);
+        c->recv_bytes -= keep;
+        http_shift(p, keep);
+        if (c->recv_bytes == MAXMSG)
+            status = STATUS_REQUEST_TOO_LARGE; /* a single token fills it */
+    }
+    return status;
+}
+
+/* Drop the answered request, keeping any pipelined bytes */
+static void conn_drop(conn_t *c)
+{
+    c->recv_bytes -= c->parser.pos;
+    memmove(c->msg, c->msg + c->parser.pos, c->recv_bytes);
+    http_parser_init(&c->parser);
+}
+
+/* What a connection waits for after conn_serve() */
+typedef enum { CONN_RECV, CONN_SEND, CONN_CLOSE } conn_next_t;
+
+/* Answer every complete request buffered in @c, including pipelined ones,
+ * and make room for the next recv(). The responses go out through @r, and
+ * CONN_SEND tells that the socket would block on the pending one, to be
+ * resumed by calling again once it is writable.
+ */
+static conn_next_t conn_serve(conn_t *c,
+                              response_t *r,
+                              http_request_t *request)
+{
+    while (1) {
+        if (r->pending) {
+            send_status_t sent = response_send(c->fd, r);
+            if (sent == SEND_AGAIN)
+                return CONN_SEND;
+            bool keep = sent == SEND_DONE && r->keep;
+            response_end(r);
+            if (!keep)
+                return CONN_CLOSE;
+
+            conn_drop(c);
+            if (c->recv_bytes == 0)
+                return CONN_RECV;
+        }
+
+        status_t status = conn_parse(c, request);
+        if (status == STATUS_AGAIN)
+            return CONN_RECV;
+        response_start(r, status, request);
+    }
+}
+
 static void *worker_routine(void *arg)
 {
     pthread_detach(pthread_self());
 
-    int connfd, file, len, recv_bytes;
-    char msg[MAXMSG], buf[1024];
-    status_t status;
+    int len;
+    conn_t conn;
+    response_t *resp = calloc(1, sizeof(response_t));
     http_request_t *request = malloc(sizeof(http_request_t));
     queue_t *q = (queue_t *) arg;
-    struct stat st;
 
     while (1) {
-    loopstart:
+        int connfd;
         dequeue(q, &connfd);
-        memset(msg, 0, MAXMSG);
-        recv_bytes = 0;
-
-        /* Loop until full HTTP msg is received */
-        while (strstr(strndup(msg, recv_bytes), "\r\n\r\n") == NULL &&
-               strstr(strndup(msg, recv_bytes), "\n\n") == NULL &&
-               recv_bytes < MAXMSG) {
-            if ((len = recv(connfd, msg + recv_bytes, MAXMSG - recv_bytes,
-                            0)) <= 0) {
+        conn_init(&conn, connfd);
+
+        /* Loop until every buffered request is answered. A connection is
+         * only handed back to the queue between requests, since the partial
+         * input of a pipelined request lives in this worker's buffer.
+         */
+        while (1) {
+            if ((len = recv(connfd, conn.msg + conn.recv_bytes,
+                            MAXMSG - conn.recv_bytes, 0)) <= 0) {
                 /* If client has closed, then close and move on */
-                if (len == 0) {
-                    close(connfd);
-                    goto loopstart;
-                }
+                if (len == 0)
+                    goto close;
                 /* If timeout or error, skip parsing and send appropriate
                  * error message
                  */
                 if (errno == EWOULDBLOCK) {
-                    status = STATUS_REQUEST_TIMEOUT;
+                    send_response(connfd, STATUS_REQUEST_TIMEOUT, request);
                 } else {
-                    status = STATUS_SERVER_ERROR;
                     perror("recv");
+                    send_response(connfd, STATUS_SERVER_ERROR, request);
                 }
-                goto send;
+                goto close;
+            }
+            conn.recv_bytes += len;
+
+            /* The sockets are blocking here, a send can only fail */
+            if (conn_serve(&conn, resp, request) != CONN_RECV)
+                goto close;
+            if (conn.recv_bytes == 0 && http_idle(&conn.parser)) {
+                enqueue(q, connfd); /* keep connection alive and re-enqueue */
+                break;
             }
-            recv_bytes += len;
         }
+        continue;
+    close:
+        if (resp->pending)
+            response_end(resp);
+        close(connfd);
+    }
+    return NULL;
+}
+
+#include <sched.h>
+#include <sys/epoll.h>
+
+/* A connection of an epoll worker, and what it waits for */
+typedef struct {
+    conn_t conn;
+    response_t resp;
+    uint32_t events; /* EPOLLIN or EPOLLOUT */
+} econn_t;
+
+static bool econn_wait(int epfd, econn_t *e, uint32_t events)
+{
+    if (e->events == events)
+        return true;
+
+    struct epoll_event ev = {.events = events | EPOLLRDHUP | EPOLLET,
+                             .data.ptr = e};
+    if (epoll_ctl(epfd, EPOLL_CTL_MOD, e->conn.fd, &ev) < 0) {
+        perror("epoll_ctl");
+        return false;
+    }
+    e->events = events;
+    return true;
+}
+
+static void econn_close(econn_t *e)
+{
+    if (e->resp.pending)
+        response_end(&e->resp);
+    /* close() removes the fd from the epoll set */
+    close(e->conn.fd);
+    free(e);
+}
 
-        /* Parse (complete) message */
-        status = parse_request(msg, request);
-
-    send:
-        /* Send initial line */
-        len = sprintf(msg, "HTTP/1.%d %d %s\r\n", request->protocol_version,
-                      status, status_to_str(status));
-        send(connfd, msg, len, 0);
-
-        /* Send header lines */
-        time_t now;
-        time(&now);
-        len = strftime(buf, 1024, "Date: %a, %d %b %Y %H:%M:%S GMT\r\n",
-                       gmtime(&now));
-        send(connfd, buf, len, 0);
-        if (status == STATUS_OK && request->method == GET) {
-            stat(request->path, &st);
-            len = sprintf(msg, "Content-Length: %d\r\n", (int) st.st_size);
-            send(connfd, msg, len, 0);
-            len = sprintf(msg, "Content-Type: %s\r\n",
-                          type_to_str(request->type));
-            send(connfd, msg, len, 0);
+/* Serve an edge-triggered connection until recv() or send() would block,
+ * then wait for the socket to be readable or writable again. Input is left
+ * in the socket while a response is pending, so that a client reading
+ * slowly only ever holds back its own connection. Return false once the
+ * connection should be closed.
+ */
+static bool econn_run(int epfd, econn_t *e, http_request_t *request)
+{
+    conn_t *c = &e->conn;
+    conn_next_t next =
+        e->resp.pending ? conn_serve(c, &e->resp, request) : CONN_RECV;
+
+    while (next == CONN_RECV) {
+        int len = recv(c->fd, c->msg + c->recv_bytes, MAXMSG - c->recv_bytes,
+                       0);
+        if (len == 0)
+            return false; /* client has closed */
+        if (len < 0) {
+            if (errno == EINTR)
+                continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK)
+                return econn_wait(epfd, e, EPOLLIN); /* the next edge */
+            perror("recv");
+            send_response(c->fd, STATUS_SERVER_ERROR, request);
+            return false;
         }
-        send(connfd, "\r\n", 2, 0);
-
-        /* If request was well-formed GET, then send file */
-        if (status == STATUS_OK && request->method == GET) {
-            if ((file = open(request->path, O_RDONLY)) < 0)
-                perror("open");
-            while ((len = read(file, msg, MAXMSG)) > 0)
-                if (send(connfd, msg, len, 0) < 0)
-                    perror("sending file");
-            close(file);
+        c->recv_bytes += len;
+        next = conn_serve(c, &e->resp, request);
+    }
+    return next == CONN_SEND && econn_wait(epfd, e, EPOLLOUT);
+}
+
+/* Accept every pending connection on the (non-blocking) listener and
+ * register it with this worker's epoll instance. Out of descriptors, the
+ * connection would stay pending and the level-triggered listener would fire
+ * again at once: the @spare descriptor is given up to accept and close it.
+ */
+static void accept_all(int epfd, int listfd, int *spare)
+{
+    while (1) {
+        int connfd = accept4(listfd, NULL, NULL, SOCK_NONBLOCK);
+        if (connfd < 0) {
+            if (errno == EINTR)
+                continue;
+            if ((errno == EMFILE || errno == ENFILE) && *spare >= 0) {
+                /* EMFILE comes before EAGAIN, the queue may be empty */
+                close(*spare);
+                connfd = accept4(listfd, NULL, NULL, 0);
+                if (connfd >= 0)
+                    close(connfd);
+                *spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+                if (connfd >= 0)
+                    continue;
+                return;
+            }
+            if (errno != EAGAIN && errno != EWOULDBLOCK)
+                perror("accept");
+            if (*spare < 0) /* try to get it back for the next time */
+                *spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+            return;
         }
 
-        /* If HTTP/1.0 or recv error, close connection. */
-        if (request->protocol_version == 0 || status != STATUS_OK)
+        econn_t *e = malloc(sizeof(econn_t));
+        if (!e) {
             close(connfd);
-        else /* Otherwise, keep connection alive and re-enqueue */
-            enqueue(q, connfd);
+            continue;
+        }
+        conn_init(&e->conn, connfd);
+        e->resp.pending = false;
+        e->events = EPOLLIN;
+
+        struct epoll_event ev = {.events = EPOLLIN | EPOLLRDHUP | EPOLLET,
+                                 .data.ptr = e};
+        if (epoll_ctl(epfd, EPOLL_CTL_ADD, connfd, &ev) < 0) {
+            perror("epoll_ctl");
+            close(connfd);
+            free(e);
+        }
+    }
+}
+
+/* Event-driven worker: one per core, each with its own SO_REUSEPORT
+ * listener and edge-triggered epoll loop. Connections never leave the
+ * worker that accepted them.
+ */
+static void *epoll_worker_routine(void *arg)
+{
+    long cpu = (long) arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    int listfd = listening_socket(true);
+    int spare = open("/dev/null", O_RDONLY | O_CLOEXEC);
+    int epfd = epoll_create1(0);
+    if (epfd < 0) {
+        perror("epoll_create1");
+        exit(1);
+    }
+
+    /* The listener is tagged with a NULL pointer to tell it apart */
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    epoll_ctl(epfd, EPOLL_CTL_ADD, listfd, &ev);
+
+    struct epoll_event events[MAX_EVENTS];
+    http_request_t request;
+    while (1) {
+        int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+        if (n < 0) {
+            if (errno != EINTR)
+                perror("epoll_wait");
+            continue;
+        }
+        for (int i = 0; i < n; i++) {
+            econn_t *e = events[i].data.ptr;
+            if (!e) {
+                accept_all(epfd, listfd, &spare);
+                continue;
+            }
+            if ((events[i].events & (EPOLLERR | EPOLLHUP)) ||
+                !econn_run(epfd, e, &request))
+                econn_close(e);
+        }
+    }
+    return NULL;
+}
+
+#include "uring.h"
+
+/* io_uring mode: one worker per core with its own SO_REUSEPORT listener, as
+ * in the epoll mode, but every operation goes through a ring. A multishot
+ * accept puts the connections straight into the file table of the ring,
+ * requests are read into buffers registered with it, and a response is its
+ * head sent from the connection, then its body spliced from the cached file
+ * through a pipe of the connection. A connection has one operation in flight
+ * at a time, and the operations that all the completions of a loop call for
+ * go to the kernel in one io_uring_enter().
+ */
+#define UR_CONNS 1024   /* connections of a worker, slots of its file table */
+#define UR_ENTRIES 256  /* SQEs of a ring */
+#define UR_CHUNK 65536  /* bytes spliced at once, the size of a pipe */
+#define UR_ACCEPT (~0ULL)
+#define UR_CLOSE (~1ULL)
+
+typedef enum { UC_RECV, UC_HEAD, UC_SPLICE_IN, UC_SPLICE_OUT } uconn_state_t;
+
+typedef struct {
+    conn_t conn; /* conn.fd is the slot in the file table */
+    uconn_state_t state;
+    bool keep; /* whether the connection outlives the response */
+    file_t *file;
+    off_t off;     /* of the body, spliced into the pipe so far */
+    size_t piped;  /* bytes in the pipe */
+    int pipe[2];   /* made on the first body */
+    size_t head_len, head_sent;
+    char head[256];
+} uconn_t;
+
+typedef struct {
+    struct uring ring;
+    uconn_t conns[UR_CONNS]; /* by slot, registered as buffer 0 */
+    bool fixed;              /* whether the registration went through */
+    http_request_t request;
+} uworker_t;
+
+static struct io_uring_sqe *uworker_sqe(uworker_t *w, uint64_t user_data)
+{
+    struct io_uring_sqe *sqe;
+
+    /* Flush a full ring, the completions are reaped by the next loop */
+    while (!(sqe = uring_sqe(&w->ring)))
+        uring_submit(&w->ring, 0);
+    sqe->user_data = user_data;
+    return sqe;
+}
+
+static void uconn_recv(uworker_t *w, uconn_t *c)
+{
+    int slot = c->conn.fd;
+    char *buf = c->conn.msg + c->conn.recv_bytes;
+    size_t len = MAXMSG - c->conn.recv_bytes;
+    struct io_uring_sqe *sqe = uworker_sqe(w, slot);
+
+    if (w->fixed)
+        uring_prep_read_fixed(sqe, slot, buf, len, -1, 0);
+    else
+        uring_prep_rw(sqe, IORING_OP_RECV, slot, buf, len, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    c->state = UC_RECV;
+}
+
+static void uconn_send_head(uworker_t *w, uconn_t *c)
+{
+    int more = c->file && c->file->st.st_size ? MSG_MORE : 0;
+    struct io_uring_sqe *sqe = uworker_sqe(w, c->conn.fd);
+
+    uring_prep_send(sqe, c->conn.fd, c->head + c->head_sent,
+                    c->head_len - c->head_sent, MSG_NOSIGNAL | more);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    c->state = UC_HEAD;
+}
+
+static void uconn_splice_in(uworker_t *w, uconn_t *c)
+{
+    off_t left = c->file->st.st_size - c->off;
+    struct io_uring_sqe *sqe = uworker_sqe(w, c->conn.fd);
+
+    uring_prep_splice(sqe, c->file->fd, c->off, c->pipe[1], -1,
+                      left < UR_CHUNK ? left : UR_CHUNK, 0);
+    c->state = UC_SPLICE_IN;
+}
+
+static void uconn_splice_out(uworker_t *w, uconn_t *c)
+{
+    struct io_uring_sqe *sqe = uworker_sqe(w, c->conn.fd);
+
+    uring_prep_splice(sqe, c->pipe[0], -1, c->conn.fd, -1, c->piped, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    c->state = UC_SPLICE_OUT;
+}
+
+static void uconn_close(uworker_t *w, uconn_t *c)
+{
+    if (c->file)
+        file_put(c->file);
+    if (c->pipe[0] >= 0) {
+        close(c->pipe[0]);
+        close(c->pipe[1]);
+    }
+    uring_prep_close_direct(uworker_sqe(w, UR_CLOSE), c->conn.fd);
+}
+
+/* Answer the next request buffered in @c, or read more of it */
+static void uconn_next(uworker_t *w, uconn_t *c)
+{
+    http_request_t *request = &w->request;
+    status_t status;
+    response_head_t h;
+
+    if (!c->conn.recv_bytes ||
+        (status = conn_parse(&c->conn, request)) == STATUS_AGAIN) {
+        uconn_recv(w, c);
+        return;
+    }
+
+    c->file = NULL;
+    if (status == STATUS_OK && request->method == GET &&
+        !(c->file = file_get(request->path)))
+        status = STATUS_NOT_FOUND;
+    if (c->file && c->file->st.st_size && c->pipe[0] < 0 &&
+        pipe2(c->pipe, O_CLOEXEC) < 0) {
+        perror("pipe");
+        c->pipe[0] = -1;
+        uconn_close(w, c);
+        return;
+    }
+
+    response_head(&h, status, request, c->file, NULL);
+    c->head_len = c->head_sent = 0;
+    for (int i = 0; i < h.iovcnt; i++) {
+        memcpy(c->head + c->head_len, h.iov[i].iov_base, h.iov[i].iov_len);
+        c->head_len += h.iov[i].iov_len;
+    }
+    c->off = c->piped = 0;
+    c->keep = request->protocol_version != 0 && status == STATUS_OK;
+    uconn_send_head(w, c);
+}
+
+/* The response went out */
+static void uconn_done(uworker_t *w, uconn_t *c)
+{
+    if (c->file)
+        file_put(c->file);
+    c->file = NULL;
+    if (!c->keep) {
+        uconn_close(w, c);
+        return;
+    }
+    conn_drop(&c->conn);
+    uconn_next(w, c);
+}
+
+/* Move @c on with the result @res of its operation in flight */
+static void uconn_complete(uworker_t *w, uconn_t *c, int res)
+{
+    if (res <= 0) { /* an error, the client closed, or a truncated file */
+        if (res < 0 && res != -ECONNRESET && res != -EPIPE)
+            fprintf(stderr, "io_uring: %s\n", strerror(-res));
+        uconn_close(w, c);
+        return;
+    }
+
+    switch (c->state) {
+    case UC_RECV:
+        c->conn.recv_bytes += res;
+        uconn_next(w, c);
+        break;
+    case UC_HEAD:
+        if ((c->head_sent += res) < c->head_len)
+            uconn_send_head(w, c);
+        else if (c->file && c->file->st.st_size)
+            uconn_splice_in(w, c);
+        else
+            uconn_done(w, c);
+        break;
+    case UC_SPLICE_IN:
+        c->off += res;
+        c->piped = res;
+        uconn_splice_out(w, c);
+        break;
+    case UC_SPLICE_OUT:
+        if ((c->piped -= res))
+            uconn_splice_out(w, c);
+        else if (c->off < c->file->st.st_size)
+            uconn_splice_in(w, c);
+        else
+            uconn_done(w, c);
+        break;
+    }
+}
+
+static void uworker_accept(uworker_t *w, int listfd)
+{
+    struct io_uring_sqe *sqe = uworker_sqe(w, UR_ACCEPT);
+    uring_prep_accept_direct(sqe, listfd, 0, IORING_ACCEPT_MULTISHOT);
+}
+
+static void *uring_worker_routine(void *arg)
+{
+    long cpu = (long) arg;
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+    /* The ring waits for the connections, the listener may block */
+    int listfd = listening_socket(true);
+    fcntl(listfd, F_SETFL, fcntl(listfd, F_GETFL) & ~O_NONBLOCK);
+
+    uworker_t *w = malloc(sizeof(uworker_t));
+    if (!w || uring_init(&w->ring, UR_ENTRIES, 2 * UR_CONNS)) {
+        perror("io_uring_setup");
+        exit(1);
+    }
+
+    /* A sparse file table for the accepted connections */
+    static int none[UR_CONNS] = {[0 ... UR_CONNS - 1] = -1};
+    if (uring_register_files(&w->ring, none, UR_CONNS) < 0) {
+        perror("io_uring_register");
+        exit(1);
+    }
+    /* Pinned memory may be short, fall back to plain recv() then */
+    struct iovec iov = {w->conns, sizeof(w->conns)};
+    w->fixed = uring_register_buffers(&w->ring, &iov, 1) == 0;
+
+    uworker_accept(w, listfd);
+    while (1) {
+        if (uring_submit(&w->ring, 1) < 0 && errno != EBUSY) {
+            perror("io_uring_enter");
+            exit(1);
+        }
+
+        struct io_uring_cqe *cqe;
+        while ((cqe = uring_cqe(&w->ring))) {
+            uint64_t tag = cqe->user_data;
+            int res = cqe->res;
+            unsigned flags = cqe->flags;
+            uring_cqe_seen(&w->ring);
+
+            if (tag == UR_CLOSE)
+                continue;
+            if (tag != UR_ACCEPT) {
+                uconn_complete(w, &w->conns[tag], res);
+                continue;
+            }
+            if (res >= 0) {
+                uconn_t *c = &w->conns[res];
+                conn_init(&c->conn, res);
+                c->file = NULL;
+                c->pipe[0] = c->pipe[1] = -1;
+                uconn_recv(w, c);
+            } else if (res == -EINVAL) { /* a kernel older than 5.19 */
+                fprintf(stderr, "accept: %s\n", strerror(-res));
+                exit(1);
+            } else if (res != -ENFILE) { /* the table is full for now */
+                fprintf(stderr, "accept: %s\n", strerror(-res));
+            }
+            if (!(flags & IORING_CQE_F_MORE))
+                uworker_accept(w, listfd);
+        }
     }
     return NULL;
 }
@@ -481,10 +1469,41 @@ void *greeter_routine(void *arg)
     }
 }
 
-int main()
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-e | -u] [-r]\n"
+            "  -e  event-driven mode: one epoll worker per core, each with\n"
+            "      its own SO_REUSEPORT listener\n"
+            "  -u  io_uring mode: one ring per core, with the same listeners,\n"
+            "      fixed files and buffers, and splice() for the bodies\n"
+            "  -r  copy file bodies with read()/send() instead of\n"
+            "      sendfile() and the open file cache, but for -u\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
 {
     queue_t *connections;
-    pthread_t workers[N_THREADS / 2], greeters[N_THREADS / 2];
+    void *(*per_core_routine)(void *) = NULL;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "eur")) != -1) {
+        switch (opt) {
+        case 'e':
+            per_core_routine = epoll_worker_routine;
+            break;
+        case 'u':
+            per_core_routine = uring_worker_routine;
+            break;
+        case 'r':
+            use_sendfile = false;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
 
     /* Get current working directory */
     char cwd[1024];
@@ -495,12 +1514,25 @@ int main()
     /* Assign document root */
     DOCUMENT_ROOT = strcat(cwd, RESOURCES);
 
+    file_cache_init();
+    header_cache_init();
+
+    if (per_core_routine) {
+        long nprocs = sysconf(_SC_NPROCESSORS_ONLN);
+        pthread_t workers[nprocs];
+        for (long i = 0; i < nprocs; i++)
+            pthread_create(&workers[i], NULL, per_core_routine, (void *) i);
+        pthread_exit(NULL);
+    }
+
+    pthread_t workers[N_THREADS / 2], greeters[N_THREADS / 2];
+
     /* Initalize connections queue */
     connections = malloc(sizeof(queue_t));
     queue_init(connections);
 
     /* Initialize listening socket */
-    int listfd = listening_socket();
+    int listfd = listening_socket(false);
 
     /* Package arguments for greeter threads */
     struct greeter_args ga = {.listfd = listfd, .q = connections};
@@ -0,0 +1,261 @@
+/* Closed-loop HTTP load generator for httpd.
+ *
+ * Every client thread owns one keep-alive connection and keeps exactly one
+ * request in flight: it sends a GET, reads the complete response, records
+ * the round-trip latency and immediately issues the next request. Latencies
+ * go into a per-thread log-linear (HDR-style) histogram, merged once the run
+ * is over, so recording never contends between threads.
+ */
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+
+/* Each power of two is split into 2^(SUB_BITS - 1) linear sub-buckets, which
+ * bounds the relative error of a recorded value to about 3%.
+ */
+#define SUB_BITS 5
+#define SUB_COUNT (1U << SUB_BITS)
+#define HALF_COUNT (SUB_COUNT / 2)
+#define N_BUCKETS ((64 - SUB_BITS + 1) * HALF_COUNT + HALF_COUNT)
+
+typedef struct {
+    uint64_t counts[N_BUCKETS];
+    uint64_t total, max;
+} histogram_t;
+
+static unsigned hist_index(uint64_t v)
+{
+    if (v < SUB_COUNT)
+        return v;
+    unsigned shift = 63 - __builtin_clzll(v) - SUB_BITS + 1;
+    return shift * HALF_COUNT + (v >> shift);
+}
+
+/* Lowest value that maps to bucket @idx */
+static uint64_t hist_value(unsigned idx)
+{
+    if (idx < SUB_COUNT)
+        return idx;
+    unsigned shift = idx / HALF_COUNT - 1;
+    return (uint64_t) (idx - shift * HALF_COUNT) << shift;
+}
+
+static void hist_record(histogram_t *h, uint64_t v)
+{
+    h->counts[hist_index(v)]++;
+    h->total++;
+    if (v > h->max)
+        h->max = v;
+}
+
+static void hist_merge(histogram_t *dst, const histogram_t *src)
+{
+    for (unsigned i = 0; i < N_BUCKETS; i++)
+        dst->counts[i] += src->counts[i];
+    dst->total += src->total;
+    if (src->max > dst->max)
+        dst->max = src->max;
+}
+
+static uint64_t hist_percentile(const histogram_t *h, double p)
+{
+    uint64_t rank = (uint64_t) (p / 100.0 * h->total + 0.5), seen = 0;
+    if (rank == 0)
+        rank = 1;
+    for (unsigned i = 0; i < N_BUCKETS; i++) {
+        if ((seen += h->counts[i]) >= rank)
+            return hist_value(i);
+    }
+    return h->max;
+}
+
+static struct sockaddr_in server;
+static char request[256];
+static int request_len;
+static atomic_bool running = true;
+
+typedef struct {
+    pthread_t tid;
+    uint64_t errors, reconnects;
+    histogram_t hist;
+    char buf[65536];
+} client_t;
+
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int connect_server(void)
+{
+    int fd = socket(AF_INET, SOCK_STREAM, 0);
+    if (fd < 0)
+        return -1;
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    if (connect(fd, (struct sockaddr *) &server, sizeof(server)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/* Read one complete response. Return its status code, 0 if the server
+ * closed the connection cleanly, or -1 on error.
+ */
+static int read_response(int fd, char *buf, size_t size)
+{
+    size_t got = 0, need = 0;
+    while (!need || got < need) {
+        ssize_t n = recv(fd, buf + got, size - got - 1, 0);
+        if (n <= 0)
+            return n == 0 && got == 0 ? 0 : -1;
+        got += n;
+        if (need)
+            continue;
+
+        buf[got] = '\0';
+        char *end = strstr(buf, "\r\n\r\n");
+        if (!end) {
+            if (got == size - 1)
+                return -1; /* absurdly large header */
+            continue;
+        }
+        const char *cl = strstr(buf, "Content-Length:");
+        need = (end - buf) + 4;
+        if (cl && cl < end)
+            need += strtoul(cl + 15, NULL, 10);
+        if (need >= size)
+            return -1;
+    }
+    return got >= 12 ? atoi(buf + 9) : -1;
+}
+
+static void *client_routine(void *arg)
+{
+    client_t *c = arg;
+    int fd = -1;
+
+    while (atomic_load_explicit(&running, memory_order_relaxed)) {
+        if (fd < 0 && (fd = connect_server()) < 0) {
+            c->errors++;
+            usleep(1000);
+            continue;
+        }
+
+        uint64_t start = now_ns();
+        int status = -1;
+        if (send(fd, request, request_len, MSG_NOSIGNAL) == request_len)
+            status = read_response(fd, c->buf, sizeof(c->buf));
+        if (status != 200) {
+            /* A clean close is just the server ending keep-alive */
+            if (status != 0)
+                c->errors++;
+            close(fd);
+            fd = -1;
+            c->reconnects++;
+            continue;
+        }
+        hist_record(&c->hist, (now_ns() - start) / 1000);
+    }
+    if (fd >= 0)
+        close(fd);
+    return NULL;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-a addr] [-p port] [-c connections] [-d seconds] "
+            "[-u path]\n",
+            prog);
+    exit(1);
+}
+
+int main(int argc, char *argv[])
+{
+    const char *addr = "127.0.0.1", *path = "/";
+    int port = 9000, n_clients = 32, duration = 5, opt;
+
+    while ((opt = getopt(argc, argv, "a:p:c:d:u:")) != -1) {
+        switch (opt) {
+        case 'a':
+            addr = optarg;
+            break;
+        case 'p':
+            port = atoi(optarg);
+            break;
+        case 'c':
+            n_clients = atoi(optarg);
+            break;
+        case 'd':
+            duration = atoi(optarg);
+            break;
+        case 'u':
+            path = optarg;
+            break;
+        default:
+            usage(argv[0]);
+        }
+    }
+    if (n_clients <= 0 || duration <= 0)
+        usage(argv[0]);
+
+    server.sin_family = AF_INET;
+    server.sin_port = htons(port);
+    if (inet_pton(AF_INET, addr, &server.sin_addr) != 1) {
+        fprintf(stderr, "Invalid address: %s\n", addr);
+        return 1;
+    }
+    request_len = snprintf(request, sizeof(request),
+                           "GET %s HTTP/1.1\r\nHost: %s\r\n\r\n", path, addr);
+
+    client_t *clients = calloc(n_clients, sizeof(client_t));
+    if (!clients) {
+        perror("calloc");
+        return 1;
+    }
+
+    uint64_t start = now_ns();
+    for (int i = 0; i < n_clients; i++)
+        pthread_create(&clients[i].tid, NULL, client_routine, &clients[i]);
+    sleep(duration);
+    atomic_store(&running, false);
+
+    static histogram_t hist;
+    uint64_t errors = 0, reconnects = 0;
+    for (int i = 0; i < n_clients; i++) {
+        pthread_join(clients[i].tid, NULL);
+        hist_merge(&hist, &clients[i].hist);
+        errors += clients[i].errors;
+        reconnects += clients[i].reconnects;
+    }
+    double elapsed = (now_ns() - start) / 1e9;
+
+    printf("%d connections, %.2f s: %lu requests, %lu errors, %lu reconnects\n",
+           n_clients, elapsed, (unsigned long) hist.total,
+           (unsigned long) errors, (unsigned long) reconnects);
+    printf("throughput: %.0f req/s\n", hist.total / elapsed);
+    if (hist.total)
+        printf("latency (us): p50 %lu  p99 %lu  p999 %lu  max %lu\n",
+               (unsigned long) hist_percentile(&hist, 50),
+               (unsigned long) hist_percentile(&hist, 99),
+               (unsigned long) hist_percentile(&hist, 99.9),
+               (unsigned long) hist.max);
+
+    free(clients);
+    return errors ? 1 : 0;
+}
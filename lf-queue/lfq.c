@@ -1,21 +1,106 @@
 #include <assert.h>
 #include <errno.h>
+#include <pthread.h>
 #include <stdbool.h>
 
 #include "atomics.h"
 #include "lfq.h"
 
 #define MAX_FREE 150
+#define DEFAULT_HP_SIZE 16
 
+/* Node cache
+ *
+ * The nodes no consumer can reference anymore are pushed on ctx->recycled.
+ * An enqueuer takes the whole stack at once into its own cache, and then
+ * allocates from it without atomics. Taking every node at once avoids the
+ * ABA problem of popping a single node off a lock-free stack. The cache of a
+ * thread holds nodes of any queue, and is freed when the thread exits.
+ */
+struct node_cache {
+    struct lfq_node *head;
+    bool registered;
+};
+
+static _Thread_local struct node_cache node_cache;
+static pthread_key_t node_cache_key;
+static pthread_once_t node_cache_once = PTHREAD_ONCE_INIT;
+
+static void free_node_list(struct lfq_node *p)
+{
+    while (p) {
+        struct lfq_node *next = p->free_next;
+        free(p);
+        p = next;
+    }
+}
+
+static void node_cache_destroy(void *arg)
+{
+    struct node_cache *c = arg;
+    free_node_list(c->head);
+    c->head = NULL;
+}
+
+static void node_cache_key_init(void)
+{
+    pthread_key_create(&node_cache_key, node_cache_destroy);
+}
+
+static struct lfq_node *alloc_node(struct lfq_ctx *ctx)
+{
+    struct node_cache *c = &node_cache;
+
+    if (!c->head) {
+        c->head = XCHG(&ctx->recycled, NULL);
+        if (c->head && !c->registered) {
+            /* free the cache when the thread exits */
+            pthread_once(&node_cache_once, node_cache_key_init);
+            pthread_setspecific(node_cache_key, c);
+            c->registered = true;
+        }
+    }
+
+    struct lfq_node *node = c->head;
+    if (!node)
+        return calloc(1, sizeof(struct lfq_node));
+
+    c->head = node->free_next;
+    node->next = NULL;
+    node->can_free = false;
+    return node;
+}
+
+static void recycle_node(struct lfq_ctx *ctx, struct lfq_node *node)
+{
+    struct lfq_node *top = atomic_load(&ctx->recycled);
+    do {
+        atomic_store(&node->free_next, top);
+    } while (!CAS(&ctx->recycled, &top, node));
+}
+
+/* The chunks are only appended, with a seq_cst store ordered before the
+ * hazard pointer stores of their consumers.
+ */
 static bool in_hp(struct lfq_ctx *ctx, struct lfq_node *node)
 {
-    for (int i = 0; i < ctx->MAX_HP_SIZE; i++) {
-        if (atomic_load(&ctx->HP[i]) == node)
-            return true;
+    for (struct lfq_hp_chunk *c = ctx->hp_chunks; c; c = atomic_load(&c->next)) {
+        for (int i = 0; i < LFQ_HP_CHUNK; i++) {
+            if (atomic_load(&c->HP[i]) == node)
+                return true;
+        }
     }
     return false;
 }
 
+static struct lfq_hp_chunk *hp_chunk(struct lfq_ctx *ctx, int *tid)
+{
+    struct lfq_hp_chunk *c = ctx->hp_chunks;
+    for (; *tid >= LFQ_HP_CHUNK; *tid -= LFQ_HP_CHUNK)
+        c = atomic_load(&c->next);
+    return c;
+}
+
 /* add to tail of the free list */
 static void insert_pool(struct lfq_ctx *ctx, struct lfq_node *node)
 {
@@ -36,7 +121,10 @@ static void free_pool(struct lfq_ctx *ctx, bool freeall)
             in_hp(ctx, (struct lfq_node *) p))
             break;
         ctx->fph = p->free_next;
-        free(p);
+        if (freeall)
+            free(p);
+        else
+            recycle_node(ctx, p);
     }
     atomic_store(&ctx->is_freeing, false);
     smp_mb();
@@ -44,61 +132,94 @@ static void free_pool(struct lfq_ctx *ctx, bool freeall)
 
 static void safe_free(struct lfq_ctx *ctx, struct lfq_node *node)
 {
-    if (atomic_load(&node->can_free) && !in_hp(ctx, node)) {
-        /* free is not thread-safe */
-        bool old = 0;
-        if (CAS(&ctx->is_freeing, &old, 1)) {
-            /* poison the pointer to detect use-after-free */
-            node->next = (void *) -1;
-            free(node); /* we got the lock; actually free */
-            atomic_store(&ctx->is_freeing, false);
-            smp_mb();
-        } else /* we did not get the lock; only add to a freelist */
-            insert_pool(ctx, node);
-    } else
+    if (atomic_load(&node->can_free) && !in_hp(ctx, node))
+        recycle_node(ctx, node); /* back to the enqueuers */
+    else
         insert_pool(ctx, node);
     free_pool(ctx, false);
 }
 
-static int alloc_tid(struct lfq_ctx *ctx)
+int lfq_register_consumer(struct lfq_ctx *ctx)
 {
-    for (int i = 0; i < ctx->MAX_HP_SIZE; i++) {
-        if (ctx->tid_map[i] == 0) {
-            int old = 0;
-            if (CAS(&ctx->tid_map[i], &old, 1))
-                return i;
+    struct lfq_hp_chunk *c = ctx->hp_chunks;
+
+    for (int base = 0;; base += LFQ_HP_CHUNK) {
+        for (int i = 0; i < LFQ_HP_CHUNK; i++) {
+            if (atomic_load(&c->tid_map[i]) == 0) {
+                int old = 0;
+                if (CAS(&c->tid_map[i], &old, 1))
+                    return base + i;
+            }
         }
-    }
 
-    return -1;
+        /* every id is taken, append a chunk unless another thread did */
+        struct lfq_hp_chunk *next = atomic_load(&c->next);
+        if (!next) {
+            struct lfq_hp_chunk *new = calloc(1, sizeof(struct lfq_hp_chunk));
+            if (!new)
+                return -errno;
+            if (CAS(&c->next, &next, new)) {
+                ATOMIC_ADD(&ctx->MAX_HP_SIZE, LFQ_HP_CHUNK);
+                next = new;
+            } else
+                free(new);
+        }
+        c = next;
+    }
 }
 
-static void free_tid(struct lfq_ctx *ctx, int tid)
+void lfq_unregister_consumer(struct lfq_ctx *ctx, int tid)
 {
-    ctx->tid_map[tid] = 0;
+    struct lfq_hp_chunk *c = hp_chunk(ctx, &tid);
+    atomic_store(&c->tid_map[tid], 0);
 }
 
-int lfq_init(struct lfq_ctx *ctx, int max_consume_thread)
+int lfq_init_bounded(struct lfq_ctx *ctx, int max_consume_thread, int capacity)
 {
     struct lfq_node *tmp = calloc(1, sizeof(struct lfq_node));
     if (!tmp)
         return -errno;
 
     struct lfq_node *node = calloc(1, sizeof(struct lfq_node));
-    if (!node)
+    if (!node) {
+        free(tmp);
         return -errno;
+    }
 
     tmp->can_free = node->can_free = true;
     memset(ctx, 0, sizeof(struct lfq_ctx));
-    ctx->MAX_HP_SIZE = max_consume_thread;
-    ctx->HP = calloc(max_consume_thread, sizeof(struct lfq_node));
-    ctx->tid_map = calloc(max_consume_thread, sizeof(struct lfq_node));
+    if (max_consume_thread <= 0)
+        max_consume_thread = DEFAULT_HP_SIZE;
+
+    /* the ids below max_consume_thread can be used without registering */
+    struct lfq_hp_chunk **pc = &ctx->hp_chunks;
+    do {
+        if (!(*pc = calloc(1, sizeof(struct lfq_hp_chunk)))) {
+            int ret = -errno;
+            for (struct lfq_hp_chunk *c = ctx->hp_chunks, *next; c; c = next) {
+                next = c->next;
+                free(c);
+            }
+            free(tmp);
+            free(node);
+            return ret;
+        }
+        pc = &(*pc)->next;
+        ctx->MAX_HP_SIZE += LFQ_HP_CHUNK;
+    } while (ctx->MAX_HP_SIZE < max_consume_thread);
+
+    ctx->capacity = capacity;
     ctx->head = ctx->tail = tmp;
     ctx->fph = ctx->fpt = node;
 
     return 0;
 }
 
+int lfq_init(struct lfq_ctx *ctx, int max_consume_thread)
+{
+    return lfq_init_bounded(ctx, max_consume_thread, 0);
+}
+
 long lfg_count_freelist(const struct lfq_ctx *ctx)
 {
     long count = 0;
@@ -127,8 +248,11 @@ int lfq_release(struct lfq_ctx *ctx)
     if (ctx->fph || ctx->fpt)
         return -1;
 
-    free(ctx->HP);
-    free(ctx->tid_map);
+    free_node_list(ctx->recycled);
+    for (struct lfq_hp_chunk *c = ctx->hp_chunks, *next; c; c = next) {
+        next = c->next;
+        free(c);
+    }
     memset(ctx, 0, sizeof(struct lfq_ctx));
 
     return 0;
@@ -136,9 +260,19 @@ int lfq_release(struct lfq_ctx *ctx)
 
 int lfq_enqueue(struct lfq_ctx *ctx, void *data)
 {
-    struct lfq_node *insert_node = calloc(1, sizeof(struct lfq_node));
-    if (!insert_node)
-        return -errno;
+    /* backpressure: the caller retries once consumers made room */
+    if (ctx->capacity && ATOMIC_ADD(&ctx->count, 1) >= ctx->capacity) {
+        ATOMIC_SUB(&ctx->count, 1);
+        return -EAGAIN;
+    }
+
+    struct lfq_node *insert_node = alloc_node(ctx);
+    if (!insert_node) {
+        int ret = -errno;
+        if (ctx->capacity)
+            ATOMIC_SUB(&ctx->count, 1);
+        return ret;
+    }
 
     insert_node->data = data;
     struct lfq_node *old_tail = XCHG(&ctx->tail, insert_node);
@@ -158,6 +292,8 @@ int lfq_enqueue(struct lfq_ctx *ctx, void *data)
 void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid)
 {
     struct lfq_node *old_head, *new_head;
+    struct lfq_hp_chunk *chunk = hp_chunk(ctx, &tid);
+    struct lfq_node **hp = &chunk->HP[tid];
 
     /* HP[tid] is necessary for deallocation. */
     do {
@@ -167,7 +303,7 @@ void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid)
          */
         old_head = atomic_load(&ctx->head);
 
-        atomic_store(&ctx->HP[tid], old_head);
+        atomic_store(hp, old_head);
         mb();
 
         /* another thread freed it before seeing our HP[tid] store */
@@ -176,7 +312,7 @@ void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid)
         new_head = atomic_load(&old_head->next);
 
         if (new_head == 0) {
-            atomic_store(&ctx->HP[tid], 0);
+            atomic_store(hp, 0);
             return NULL; /* never remove the last node */
         }
     } while (!CAS(&ctx->head, &old_head, new_head));
@@ -186,9 +322,11 @@ void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid)
      * off with a dummy node, so the current head is always a node that is
      * already been read.
      */
-    atomic_store(&ctx->HP[tid], 0);
+    atomic_store(hp, 0);
     void *ret = new_head->data;
     atomic_store(&new_head->can_free, true);
+    if (ctx->capacity)
+        ATOMIC_SUB(&ctx->count, 1);
 
     /* we need to avoid freeing until other readers are definitely not going to
      * load its ->next in the CAS loop
@@ -200,12 +338,12 @@ void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid)
 
 void *lfq_dequeue(struct lfq_ctx *ctx)
 {
-    int tid = alloc_tid(ctx);
-    /* To many thread race */
-    if (tid == -1)
+    int tid = lfq_register_consumer(ctx);
+    /* out of memory for a new id */
+    if (tid < 0)
         return (void *) -1;
 
     void *ret = lfq_dequeue_tid(ctx, tid);
-    free_tid(ctx, tid);
+    lfq_unregister_consumer(ctx, tid);
     return ret;
 }
\ No newline at end of file
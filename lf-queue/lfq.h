@@ -12,16 +12,25 @@ struct lfq_node {
     bool can_free;
 };
 
+/* Hazard pointers of the consumers, in chunks appended as they register */
+#define LFQ_HP_CHUNK 16
+
+struct lfq_hp_chunk {
+    struct lfq_node *HP[LFQ_HP_CHUNK];
+    int tid_map[LFQ_HP_CHUNK];
+    struct lfq_hp_chunk *next;
+};
+
 struct lfq_ctx {
     alignas(64) struct lfq_node *head;
-    int count;
-    struct lfq_node **HP; /* hazard pointers */
-    int *tid_map;
+    int count;    /* elements in the queue, only kept with a capacity */
+    int capacity; /* zero if unbounded */
+    struct lfq_hp_chunk *hp_chunks;
     bool is_freeing;
     struct lfq_node *fph, *fpt; /* free pool head/tail */
+    struct lfq_node *recycled;  /* nodes safe to reuse, for the enqueuers */
 
-    /* FIXME: get rid of struct. Make it configurable */
-    int MAX_HP_SIZE;
+    int MAX_HP_SIZE; /* slots in hp_chunks, grows with the consumers */
 
     /* avoid cacheline contention */
     alignas(64) struct lfq_node *tail;
@@ -30,12 +39,23 @@ struct lfq_ctx {
 /**
  * lfq_init - Initialize lock-free queue.
  * @ctx: Lock-free queue handler.
- * @max_consume_thread: Max consume thread numbers. If this value set to zero,
- *                      use default value (16).
+ * @max_consume_thread: Consumer thread ids available up front, from 0 to
+ *                      this value minus one. If this value set to zero, use
+ *                      default value (16). More consumers can register later.
  * Return zero on success. On error, negative errno.
  */
 int lfq_init(struct lfq_ctx *ctx, int max_consume_thread);
 
+/**
+ * lfq_init_bounded - Initialize lock-free queue with a capacity.
+ * @ctx: Lock-free queue handler.
+ * @max_consume_thread: Same as lfq_init().
+ * @capacity: Max elements in the queue, lfq_enqueue() fails with -EAGAIN
+ *            beyond it until consumers catch up. Zero means unbounded.
+ * Return zero on success. On error, negative errno.
+ */
+int lfq_init_bounded(struct lfq_ctx *ctx, int max_consume_thread, int capacity);
+
 /**
  * lfq_release - Release lock-free queue from ctx.
  * @ctx: Lock-free queue handler.
@@ -50,14 +70,31 @@ long lfg_count_freelist(const struct lfq_ctx *ctx);
  * lfq_enqueue - Push data into queue.
  * @ctx: Lock-free queue handler.
  * @data: User data
- * Return zero on success. On error, negative errno.
+ * Return zero on success. On error, negative errno: -EAGAIN if the queue is
+ * full.
  */
 int lfq_enqueue(struct lfq_ctx *ctx, void *data);
 
+/**
+ * lfq_register_consumer - Get a thread id for lfq_dequeue_tid().
+ * @ctx: Lock-free queue handler.
+ * Return the thread id, which is not used by any other consumer. On error,
+ * negative errno.
+ */
+int lfq_register_consumer(struct lfq_ctx *ctx);
+
+/**
+ * lfq_unregister_consumer - Give back a thread id.
+ * @ctx: Lock-free queue handler.
+ * @tid: Thread id from lfq_register_consumer().
+ */
+void lfq_unregister_consumer(struct lfq_ctx *ctx, int tid);
+
 /**
  * lfq_dequeue_tid - Pop data from queue.
  * @ctx: Lock-free queue handler.
- * @tid: Unique thread id.
+ * @tid: Unique thread id, from lfq_register_consumer() or below the
+ *       max_consume_thread of lfq_init(). Do not mix both ways.
  * Return zero if empty queue. On error, negative errno.
  */
 void *lfq_dequeue_tid(struct lfq_ctx *ctx, int tid);
@@ -1,4 +1,5 @@
 #define _GNU_SOURCE
+#include <errno.h>
 #include <inttypes.h>
 #include <pthread.h>
 #include <stdint.h>
@@ -17,13 +18,15 @@
 #ifndef MAX_CONSUMER
 #define MAX_CONSUMER 10
 #endif
+#ifndef CAPACITY
+#define CAPACITY 0 /* unbounded */
+#endif
 
 #define SOME_ID 667814649
 
 static uint64_t cnt_added = 0;
 static uint64_t cnt_removed = 0;
 
-static int cnt_thread = 0;
 static int cnt_producer = 0;
 
 struct user_data {
@@ -38,7 +41,9 @@ void *add_queue(void *data)
     for (added = 0; added < 500000; added++) {
         struct user_data *p = malloc(sizeof(struct user_data));
         p->data = SOME_ID;
-        if ((ret = lfq_enqueue(ctx, p)) != 0) {
+        while ((ret = lfq_enqueue(ctx, p)) == -EAGAIN)
+            sched_yield(); /* queue is full, let the consumers catch up */
+        if (ret != 0) {
             printf("lfq_enqueue failed, reason:%s\n", strerror(-ret));
             ATOMIC_ADD(&cnt_added, added);
             ATOMIC_SUB(&cnt_producer, 1);
@@ -56,8 +61,12 @@ void *remove_queue(void *data)
 {
     struct lfq_ctx *ctx = data;
     struct user_data *p;
-    int tid = ATOMIC_ADD(&cnt_thread, 1);
+    int tid = lfq_register_consumer(ctx);
     long deleted = 0;
+    if (tid < 0) {
+        printf("lfq_register_consumer failed, reason:%s\n", strerror(-tid));
+        exit(1);
+    }
     while (1) {
         p = lfq_dequeue_tid(ctx, tid);
         if (p) {
@@ -69,12 +78,13 @@ void *remove_queue(void *data)
             free(p);
             deleted++;
         } else {
-            if (ctx->count || atomic_load(&cnt_producer))
+            if (atomic_load(&ctx->count) || atomic_load(&cnt_producer))
                 sched_yield(); /* queue is empty, release CPU slice */
             else
                 break; /* queue is empty and no more producers */
         }
     }
+    lfq_unregister_consumer(ctx, tid);
     ATOMIC_ADD(&cnt_removed, deleted);
 
     printf("Consumer thread [%lu] exited %d\n", pthread_self(), cnt_producer);
@@ -84,7 +94,8 @@ void *remove_queue(void *data)
 int main()
 {
     struct lfq_ctx ctx;
-    lfq_init(&ctx, MAX_CONSUMER);
+    /* the consumers register, more than the ids available up front */
+    lfq_init_bounded(&ctx, 0, CAPACITY);
 
     pthread_t thread_cons[MAX_CONSUMER], thread_pros[MAX_PRODUCER];
 
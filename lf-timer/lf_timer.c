@@ -1,4 +1,5 @@
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
@@ -7,7 +8,6 @@
 #include "lf_timer.h"
 
 #define CACHE_LINE 64
-#define MAXTIMERS 8192
 
 /* Parameters for smp_fence() */
 enum {
@@ -29,9 +29,49 @@ static inline void smp_fence(unsigned int mask)
 #include "common.h"
 #include "lockfree.h"
 
+/* Hierarchical timing wheel
+ *
+ * Level l has WHEEL_SLOTS slots of WHEEL_SLOTS^l ticks each. A timer is filed
+ * at the level of the most significant base-WHEEL_SLOTS digit in which its
+ * expiration differs from the wheel time, in the slot of that digit. When the
+ * wheel time reaches a slot, its timers expire or are filed again at a lower
+ * level, so every timer is touched at most once per level. Empty slots are
+ * skipped with a bitmap per level, whatever the distance between two ticks.
+ *
+ * The timers are split into shards, one per thread as long as there are
+ * enough of them, and a timer belongs to the shard of the thread that
+ * allocated it. Each shard has its own wheel, which belongs to the thread
+ * expiring the timers of the shard, one at a time. Setting a timer stays
+ * lock-free and only touches its shard: the expiration is stored in the
+ * timer, which is then pushed on the stack of pending timers of the shard for
+ * lf_timer_expire() to file. Cancelling only clears the expiration, the timer
+ * leaves the wheel once its slot is reached. A freed timer is unlinked from
+ * the wheel of its shard before it returns to the freelist: by the freeing
+ * thread if the shard is idle, else by the next lf_timer_expire() of the shard.
+ *
+ * The earliest expirations of the shards are gathered in a min-heap, which
+ * only lf_timer_next() updates: the shards whose earliest moved are marked in
+ * a bitmap.
+ */
+#define WHEEL_BITS 6
+#define WHEEL_SLOTS (1 << WHEEL_BITS)
+#define WHEEL_LEVELS ((64 + WHEEL_BITS - 1) / WHEEL_BITS)
+
+#define NIL UINT32_MAX /* End of a list of timers */
+#define NOT_FILED UINT16_MAX
+
+/* Expired timers whose callbacks are invoked together */
+#define EXPIRE_BATCH 64
+
 struct timer {
-    lf_timer_cb cb; /* User-defined callback */
-    void *arg;      /* User-defined argument to callback */
+    lf_tick_t expiration; /* LF_TIMER_TICK_INVALID when inactive */
+    lf_timer_cb cb;       /* User-defined callback */
+    void *arg;            /* User-defined argument to callback */
+    uint32_t next, prev;  /* In the slot of the wheel */
+    uint16_t slot;        /* level * WHEEL_SLOTS + slot, or NOT_FILED */
+    uint16_t shard;
+    bool pending; /* On the stack of pending timers */
+    uint32_t pending_next;
 };
 
 struct freelist {
@@ -39,42 +79,197 @@ struct freelist {
     uintptr_t count; /* For ABA protection */
 };
 
-static struct {
+struct shard {
+    /* Written by the threads setting timers of the shard */
     lf_tick_t earliest ALIGNED(CACHE_LINE);
-    lf_tick_t current;
+    uint32_t pending;    /* Stack of timers to file */
+    struct timer *freed; /* Stack of timers to unlink and free, through arg */
+
+    /* Only used by the thread that set "expiring" */
+    bool expiring ALIGNED(CACHE_LINE);
+    lf_tick_t wheel_now; /* Every slot before it has been processed */
+    uint64_t occupied[WHEEL_LEVELS];
+    uint32_t slots[WHEEL_LEVELS][WHEEL_SLOTS];
+};
+
+static struct {
+    lf_tick_t current ALIGNED(CACHE_LINE);
     uint32_t hi_watermark;
+    uint32_t n_timers, n_shards;
+    struct timer *timers;
+    struct shard *shards;
 
-    /* +4 for sentinels */
-    lf_tick_t expirations[MAXTIMERS + 4] ALIGNED(CACHE_LINE);
-    struct timer timers[MAXTIMERS] ALIGNED(CACHE_LINE);
-    struct freelist freelist;
-} g_timer;
+    struct freelist freelist ALIGNED(CACHE_LINE);
+    uint32_t next_thread; /* Serial number of the next thread */
 
-INIT_FUNCTION
-static void init_timers(void)
+    uint64_t dirty[LF_TIMER_MAX_SHARDS / 64] ALIGNED(CACHE_LINE);
+
+    /* Min-heap of the shards by their earliest expiration */
+    pthread_mutex_t heap_lock ALIGNED(CACHE_LINE);
+    uint32_t heap[LF_TIMER_MAX_SHARDS];
+    uint32_t heap_pos[LF_TIMER_MAX_SHARDS];
+    lf_tick_t heap_key[LF_TIMER_MAX_SHARDS];
+} g_timer = {.heap_lock = PTHREAD_MUTEX_INITIALIZER};
+
+bool lf_timer_init(uint32_t n_timers, uint32_t n_shards)
 {
-    g_timer.earliest = LF_TIMER_TICK_INVALID;
+    /* Indexes must fit in lf_timer_t */
+    if (n_timers == 0 || n_timers > INT32_MAX || n_shards == 0 ||
+        n_shards > LF_TIMER_MAX_SHARDS)
+        return false;
+    struct timer *timers = malloc(n_timers * sizeof(struct timer));
+    struct shard *shards =
+        aligned_alloc(CACHE_LINE, n_shards * sizeof(struct shard));
+    if (!timers || !shards) {
+        free(timers);
+        free(shards);
+        return false;
+    }
+
+    free(g_timer.timers);
+    free(g_timer.shards);
+    g_timer.timers = timers;
+    g_timer.shards = shards;
+    g_timer.n_timers = n_timers;
+    g_timer.n_shards = n_shards;
     g_timer.current = 0;
     g_timer.hi_watermark = 0;
-    for (uint32_t i = 0; i < MAXTIMERS; i++) {
-        /* All timers beyond hi_watermark <= now */
-        g_timer.expirations[i] = 0;
-        g_timer.timers[i].cb = NULL;
-        g_timer.timers[i].arg = &g_timer.timers[i + 1];
+    for (uint32_t i = 0; i < n_shards; i++) {
+        struct shard *sh = &shards[i];
+        sh->earliest = LF_TIMER_TICK_INVALID;
+        sh->pending = NIL;
+        sh->freed = NULL;
+        sh->expiring = false;
+        sh->wheel_now = 0;
+        for (uint32_t l = 0; l < WHEEL_LEVELS; l++) {
+            sh->occupied[l] = 0;
+            for (uint32_t s = 0; s < WHEEL_SLOTS; s++)
+                sh->slots[l][s] = NIL;
+        }
+        g_timer.heap[i] = g_timer.heap_pos[i] = i;
+        g_timer.heap_key[i] = LF_TIMER_TICK_INVALID;
+    }
+    for (uint32_t w = 0; w < LF_TIMER_MAX_SHARDS / 64; w++)
+        g_timer.dirty[w] = 0;
+    for (uint32_t i = 0; i < n_timers; i++) {
+        timers[i].expiration = LF_TIMER_TICK_INVALID;
+        timers[i].cb = NULL;
+        timers[i].arg = &timers[i + 1];
+        timers[i].slot = NOT_FILED;
+        timers[i].pending = false;
     }
-
-    /* Ensure sentinels trigger expiration compare and loop termination */
-    g_timer.expirations[MAXTIMERS + 0] = 0;
-    g_timer.expirations[MAXTIMERS + 1] = 0;
-    g_timer.expirations[MAXTIMERS + 2] = 0;
-    g_timer.expirations[MAXTIMERS + 3] = 0;
 
     /* Last timer must end freelist */
-    g_timer.timers[MAXTIMERS - 1].arg = NULL;
+    timers[n_timers - 1].arg = NULL;
 
     /* Initialize head of freelist */
-    g_timer.freelist.head = g_timer.timers;
+    g_timer.freelist.head = timers;
     g_timer.freelist.count = 0;
+    return true;
+}
+
+INIT_FUNCTION
+static void init_timers(void)
+{
+    if (!lf_timer_init(LF_TIMER_DEFAULT_TIMERS, LF_TIMER_DEFAULT_SHARDS))
+        abort();
+}
+
+/* The threads are spread over the shards in the order they first use them */
+static inline uint32_t my_shard(void)
+{
+    static __thread uint32_t serial = UINT32_MAX;
+
+    if (UNLIKELY(serial == UINT32_MAX))
+        serial = __atomic_fetch_add(&g_timer.next_thread, 1, __ATOMIC_RELAXED);
+    return serial % g_timer.n_shards;
+}
+
+static inline uint32_t tick_digit(lf_tick_t tck, uint32_t level)
+{
+    return (tck >> (level * WHEEL_BITS)) & (WHEEL_SLOTS - 1);
+}
+
+static void wheel_file(struct shard *sh, uint32_t idx, lf_tick_t exp)
+{
+    /* exp > wheel_now, so their first different digit is higher in exp */
+    uint32_t level = (63 - __builtin_clzll(exp ^ sh->wheel_now)) / WHEEL_BITS;
+    uint32_t s = tick_digit(exp, level);
+    uint32_t *head = &sh->slots[level][s];
+    struct timer *t = &g_timer.timers[idx];
+
+    t->slot = level * WHEEL_SLOTS + s;
+    t->prev = NIL;
+    t->next = *head;
+    if (*head != NIL)
+        g_timer.timers[*head].prev = idx;
+    *head = idx;
+    sh->occupied[level] |= UINT64_C(1) << s;
+}
+
+static void wheel_unlink(struct shard *sh, uint32_t idx)
+{
+    struct timer *t = &g_timer.timers[idx];
+    if (t->slot == NOT_FILED)
+        return;
+
+    uint32_t level = t->slot / WHEEL_SLOTS, s = t->slot % WHEEL_SLOTS;
+    if (t->prev != NIL) {
+        g_timer.timers[t->prev].next = t->next;
+    } else {
+        sh->slots[level][s] = t->next;
+        if (t->next == NIL)
+            sh->occupied[level] &= ~(UINT64_C(1) << s);
+    }
+    if (t->next != NIL)
+        g_timer.timers[t->next].prev = t->prev;
+    t->slot = NOT_FILED;
+}
+
+/* Return the first tick of the first occupied slot, which is a lower bound of
+ * the expirations in the wheel, or LF_TIMER_TICK_INVALID if it is empty. The
+ * slots of a level all come before those of the levels above it.
+ */
+static lf_tick_t wheel_next(struct shard *sh, uint32_t *level)
+{
+    for (uint32_t l = 0; l < WHEEL_LEVELS; l++) {
+        /* The slots up to the digit of the wheel time are empty */
+        uint32_t from = tick_digit(sh->wheel_now, l) + 1;
+        uint64_t bits = from < WHEEL_SLOTS
+                            ? sh->occupied[l] & (~UINT64_C(0) << from)
+                            : 0;
+        if (!bits)
+            continue;
+
+        uint32_t shift = l * WHEEL_BITS;
+        lf_tick_t prefix = 0;
+        if (shift + WHEEL_BITS < 64)
+            prefix =
+                sh->wheel_now & ~((UINT64_C(1) << (shift + WHEEL_BITS)) - 1);
+        *level = l;
+        return prefix | (lf_tick_t) __builtin_ctzll(bits) << shift;
+    }
+    return LF_TIMER_TICK_INVALID;
+}
+
+struct expired {
+    uint32_t n;
+    struct {
+        lf_timer_t tim;
+        lf_tick_t tmo;
+        lf_timer_cb cb;
+        void *arg;
+    } timers[EXPIRE_BATCH];
+};
+
+static void expired_flush(struct expired *batch)
+{
+    for (uint32_t i = 0; i < batch->n; i++)
+        PREFETCH_FOR_READ(batch->timers[i].arg);
+    for (uint32_t i = 0; i < batch->n; i++)
+        batch->timers[i].cb(batch->timers[i].tim, batch->timers[i].tmo,
+                            batch->timers[i].arg);
+    batch->n = 0;
 }
 
 /* There might be user-defined data associated with a timer
@@ -82,128 +277,246 @@ static void init_timers(void)
  * Set (and reset) a timer has release semantics wrt this data
  * Expire a timer thus needs acquire semantics
  */
-static void expire_one_timer(lf_tick_t now, lf_tick_t *ptr)
+static void expire_or_file(struct shard *sh,
+                           struct expired *batch,
+                           lf_tick_t now,
+                           uint32_t idx)
 {
+    struct timer *t = &g_timer.timers[idx];
     lf_tick_t exp;
     do {
         /* Explicit reloading => smaller code */
-        exp = __atomic_load_n(ptr, __ATOMIC_RELAXED);
+        exp = __atomic_load_n(&t->expiration, __ATOMIC_RELAXED);
+        if (exp == LF_TIMER_TICK_INVALID) /* Cancelled */
+            return;
         if (!(exp <= now)) { /* exp > now */
-            /* If timer does not expire anymore it means some thread has
-             * (re-)set the timer and then also updated g_timer.earliest
-             */
+            wheel_file(sh, idx, exp);
             return;
         }
-    } while (!__atomic_compare_exchange_n(ptr, &exp, LF_TIMER_TICK_INVALID,
+    } while (!__atomic_compare_exchange_n(&t->expiration, &exp,
+                                          LF_TIMER_TICK_INVALID,
                                           /* weak = */ true, __ATOMIC_ACQUIRE,
                                           __ATOMIC_RELAXED));
-    uint32_t tim = ptr - &g_timer.expirations[0];
-    g_timer.timers[tim].cb(tim, exp, g_timer.timers[tim].arg);
+
+    if (batch->n == EXPIRE_BATCH)
+        expired_flush(batch);
+    batch->timers[batch->n].tim = idx;
+    batch->timers[batch->n].tmo = exp;
+    batch->timers[batch->n].cb = t->cb;
+    batch->timers[batch->n].arg = t->arg;
+    batch->n++;
 }
 
-static lf_tick_t scan_timers(lf_tick_t now, lf_tick_t *cur, lf_tick_t *top)
+static void push_pending(struct shard *sh, uint32_t idx)
 {
-    lf_tick_t earliest = LF_TIMER_TICK_INVALID;
-    lf_tick_t *ptr = cur;
-    lf_tick_t pair0 = *ptr++;
-    lf_tick_t pair1 = *ptr++;
+    struct timer *t = &g_timer.timers[idx];
 
-    /* Optimize: Interleave loads and compares in order to hide load-to-use
-     * latencies. Sentinel will ensure we eventually terminate the loop
+    /* Pairs with the exchange in drain_pending(), after the expiration was
+     * stored
      */
-    for (;;) {
-        lf_tick_t w0 = pair0;
-        lf_tick_t w1 = pair1;
-        pair0 = *ptr++;
-        pair1 = *ptr++;
-        if (UNLIKELY(w0 <= now)) {
-            lf_tick_t *pw0 = (lf_tick_t *) (ptr - 4);
-            if (pw0 >= top)
-                break;
-
-            expire_one_timer(now, pw0);
-            /* If timer did not actually expire, it was reset by some thread
-             * and g_timer.earliest updated which means we do not have to
-             * include it in our update of earliest.
-             */
-        } else { /* 'w0' > 'now' */
-            earliest = MIN(earliest, w0);
-        }
-        if (UNLIKELY(w1 <= now)) {
-            lf_tick_t *pw1 = (lf_tick_t *) (ptr - 4) + 1;
-            if (pw1 >= top)
-                break;
-            expire_one_timer(now, pw1);
-        } else { /* 'w1' > 'now' */
-            earliest = MIN(earliest, w1);
-        }
-        w0 = pair0;
-        w1 = pair1;
-        pair0 = *ptr++;
-        pair1 = *ptr++;
-        if (UNLIKELY(w0 <= now)) {
-            lf_tick_t *pw0 = (lf_tick_t *) (ptr - 4);
-            if (pw0 >= top)
-                break;
-            expire_one_timer(now, pw0);
-        } else { /* 'w0' > 'now' */
-            earliest = MIN(earliest, w0);
-        }
-        if (UNLIKELY(w1 <= now)) {
-            lf_tick_t *pw1 = (lf_tick_t *) (ptr - 4) + 1;
-            if (pw1 >= top)
-                break;
-            expire_one_timer(now, pw1);
-        } else { /* 'w1' > 'now' */
-            earliest = MIN(earliest, w1);
+    if (__atomic_exchange_n(&t->pending, true, __ATOMIC_SEQ_CST))
+        return;
+
+    uint32_t head = __atomic_load_n(&sh->pending, __ATOMIC_RELAXED);
+    do {
+        t->pending_next = head;
+    } while (UNLIKELY(!__atomic_compare_exchange_n(
+        &sh->pending, &head, idx,
+        /* weak = */ true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+}
+
+/* File the timers that were set since the last call, or expire them */
+static void drain_pending(struct shard *sh,
+                          struct expired *batch,
+                          lf_tick_t now)
+{
+    uint32_t idx = __atomic_exchange_n(&sh->pending, NIL, __ATOMIC_ACQUIRE);
+    while (idx != NIL) {
+        struct timer *t = &g_timer.timers[idx];
+        uint32_t next = t->pending_next;
+
+        /* A set from now on pushes the timer again, and the expiration is
+         * read after this full barrier
+         */
+        (void) __atomic_exchange_n(&t->pending, false, __ATOMIC_SEQ_CST);
+        wheel_unlink(sh, idx);
+        expire_or_file(sh, batch, now, idx);
+        idx = next;
+    }
+}
+
+/* Process the occupied slots up to "now" */
+static void wheel_advance(struct shard *sh,
+                          struct expired *batch,
+                          lf_tick_t now)
+{
+    uint32_t level;
+    lf_tick_t tck;
+
+    while ((tck = wheel_next(sh, &level)) <= now) {
+        uint32_t s = tick_digit(tck, level);
+        uint32_t idx = sh->slots[level][s];
+
+        sh->slots[level][s] = NIL;
+        sh->occupied[level] &= ~(UINT64_C(1) << s);
+        sh->wheel_now = tck;
+        while (idx != NIL) {
+            struct timer *t = &g_timer.timers[idx];
+            uint32_t next = t->next;
+            t->slot = NOT_FILED;
+            expire_or_file(sh, batch, now, idx);
+            idx = next;
         }
     }
-    return earliest;
+    /* No slot starts before "now", the timers stay at their level */
+    sh->wheel_now = now;
 }
 
-/* Perform an atomic-min operation on g_timer.earliest */
-static inline void update_earliest(lf_tick_t exp)
+static inline void mark_dirty(uint32_t shard)
 {
+    __atomic_fetch_or(&g_timer.dirty[shard / 64], UINT64_C(1) << (shard % 64),
+                      __ATOMIC_RELEASE);
+}
+
+/* Perform an atomic-min operation on the earliest of the shard */
+static inline void update_earliest(uint32_t shard, lf_tick_t exp)
+{
+    struct shard *sh = &g_timer.shards[shard];
     lf_tick_t old;
     do {
         /* Explicit reloading => smaller code */
-        old = __atomic_load_n(&g_timer.earliest, __ATOMIC_RELAXED);
+        old = __atomic_load_n(&sh->earliest, __ATOMIC_RELAXED);
         if (exp >= old) {
             /* Our expiration time is same or later => no update */
             return;
         }
         /* Else our expiration time is earlier than the previous 'earliest' */
     } while (UNLIKELY(!__atomic_compare_exchange_n(
-        &g_timer.earliest, &old, exp,
+        &sh->earliest, &old, exp,
+        /* weak = */ true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+    mark_dirty(shard);
+}
+
+static void freelist_push(struct timer *tim)
+{
+    union {
+        struct freelist fl;
+        ptrpair_t pp;
+    } old, neu;
+
+    do {
+        old.fl = g_timer.freelist;
+        tim->arg = old.fl.head;
+        neu.fl.head = tim;
+        neu.fl.count = old.fl.count + 1;
+    } while (UNLIKELY(!lockfree_compare_exchange_pp(
+        (ptrpair_t *) &g_timer.freelist, &old.pp, neu.pp,
         /* weak = */ true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
 }
 
 void lf_timer_expire(void)
 {
+    uint32_t shard = my_shard();
+    struct shard *sh = &g_timer.shards[shard];
     lf_tick_t now = __atomic_load_n(&g_timer.current, __ATOMIC_RELAXED);
-    lf_tick_t earliest = __atomic_load_n(&g_timer.earliest, __ATOMIC_RELAXED);
-    if (earliest <= now) {
-        /* There exists at least one timer that is due for expiration */
-        PREFETCH_FOR_READ(&g_timer.expirations[0]);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 1 * CACHE_LINE);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 2 * CACHE_LINE);
-        PREFETCH_FOR_READ((char *) &g_timer.expirations[0] + 3 * CACHE_LINE);
-
-        /* Reset 'earliest' */
-        __atomic_store_n(&g_timer.earliest, LF_TIMER_TICK_INVALID,
-                         __ATOMIC_RELAXED);
-
-        /* We need our g_timer.earliest reset to be visible before we start to
-         * scan the timer array
-         */
-        smp_fence(StoreLoad);
+    lf_tick_t earliest = __atomic_load_n(&sh->earliest, __ATOMIC_RELAXED);
+    if (earliest > now)
+        return; /* No timers due for expiration */
+
+    /* Another thread is expiring timers of the shard, it leaves "earliest"
+     * due if it stopped short of our "now"
+     */
+    if (__atomic_exchange_n(&sh->expiring, true, __ATOMIC_ACQUIRE))
+        return;
+
+    /* Reset 'earliest' */
+    __atomic_store_n(&sh->earliest, LF_TIMER_TICK_INVALID, __ATOMIC_RELAXED);
+
+    /* We need our reset of earliest to be visible before we take the pending
+     * timers, whose setters update it after pushing them
+     */
+    smp_fence(StoreLoad);
+
+    /* Take the freed timers before the pending ones: those that were set
+     * before being freed are drained first and are no longer pending
+     */
+    struct timer *freed =
+        __atomic_exchange_n(&sh->freed, NULL, __ATOMIC_ACQUIRE);
+
+    struct expired batch = {.n = 0};
+    uint32_t level;
+    drain_pending(sh, &batch, now);
+    while (freed != NULL) {
+        struct timer *next = freed->arg;
+        wheel_unlink(sh, freed - g_timer.timers);
+        freelist_push(freed);
+        freed = next;
+    }
+    wheel_advance(sh, &batch, now);
+    update_earliest(shard, wheel_next(sh, &level));
+    mark_dirty(shard);
+
+    /* The callbacks may set timers of the shard again */
+    expired_flush(&batch);
+    __atomic_store_n(&sh->expiring, false, __ATOMIC_RELEASE);
+}
 
-        /* Scan expiration ticks looking for expired timers */
-        earliest = scan_timers(now, &g_timer.expirations[0],
-                               &g_timer.expirations[g_timer.hi_watermark]);
-        update_earliest(earliest);
+static void heap_swap(uint32_t i, uint32_t j)
+{
+    uint32_t a = g_timer.heap[i], b = g_timer.heap[j];
+    g_timer.heap[i] = b;
+    g_timer.heap[j] = a;
+    g_timer.heap_pos[a] = j;
+    g_timer.heap_pos[b] = i;
+}
+
+/* Move the shard to its place after its key changed */
+static void heap_fix(uint32_t shard)
+{
+    uint32_t i = g_timer.heap_pos[shard], n = g_timer.n_shards;
+    lf_tick_t key = g_timer.heap_key[shard];
+
+    while (i > 0 && key < g_timer.heap_key[g_timer.heap[(i - 1) / 2]]) {
+        heap_swap(i, (i - 1) / 2);
+        i = (i - 1) / 2;
+    }
+    for (;;) {
+        uint32_t c = 2 * i + 1;
+        if (c >= n)
+            break;
+        if (c + 1 < n && g_timer.heap_key[g_timer.heap[c + 1]] <
+                             g_timer.heap_key[g_timer.heap[c]])
+            c++;
+        if (g_timer.heap_key[g_timer.heap[c]] >= key)
+            break;
+        heap_swap(i, c);
+        i = c;
     }
-    /* Else: no timers due for expiration */
+}
+
+lf_tick_t lf_timer_next_local(void)
+{
+    return __atomic_load_n(&g_timer.shards[my_shard()].earliest,
+                           __ATOMIC_RELAXED);
+}
+
+lf_tick_t lf_timer_next(void)
+{
+    pthread_mutex_lock(&g_timer.heap_lock);
+    for (uint32_t w = 0; w < (g_timer.n_shards + 63) / 64; w++) {
+        uint64_t bits =
+            __atomic_exchange_n(&g_timer.dirty[w], 0, __ATOMIC_ACQUIRE);
+        while (bits) {
+            uint32_t shard = w * 64 + __builtin_ctzll(bits);
+            bits &= bits - 1;
+            g_timer.heap_key[shard] = __atomic_load_n(
+                &g_timer.shards[shard].earliest, __ATOMIC_RELAXED);
+            heap_fix(shard);
+        }
+    }
+    lf_tick_t earliest = g_timer.heap_key[g_timer.heap[0]];
+    pthread_mutex_unlock(&g_timer.heap_lock);
+    return earliest;
 }
 
 void lf_timer_tick_set(lf_tick_t tck)
@@ -250,9 +563,10 @@ lf_timer_t lf_timer_alloc(lf_timer_cb cb, void *arg)
         /* weak = */ true, __ATOMIC_RELAXED, __ATOMIC_RELAXED)));
 
     uint32_t idx = old.fl.head - g_timer.timers;
-    g_timer.expirations[idx] = LF_TIMER_TICK_INVALID;
+    g_timer.timers[idx].expiration = LF_TIMER_TICK_INVALID;
     g_timer.timers[idx].cb = cb;
     g_timer.timers[idx].arg = arg;
+    g_timer.timers[idx].shard = my_shard();
 
     /* Update high watermark of allocated timers */
     lockfree_fetch_umax_4(&g_timer.hi_watermark, idx + 1, __ATOMIC_RELEASE);
@@ -266,27 +580,38 @@ void lf_timer_free(lf_timer_t idx)
         return;
     }
 
-    if (__atomic_load_n(&g_timer.expirations[idx], __ATOMIC_ACQUIRE) !=
+    if (__atomic_load_n(&g_timer.timers[idx].expiration, __ATOMIC_ACQUIRE) !=
         LF_TIMER_TICK_INVALID) {
         fprintf(stderr, "cannot free active timer: %d\n", idx);
         return;
     }
 
+    /* A cancelled timer may still be in the wheel of its shard, or on its
+     * stack of pending timers, and must not be reused before it left them
+     */
     struct timer *tim = &g_timer.timers[idx];
-    union {
-        struct freelist fl;
-        ptrpair_t pp;
-    } old, neu;
+    uint32_t shard = tim->shard;
+    struct shard *sh = &g_timer.shards[shard];
+    tim->cb = NULL;
+    if (!__atomic_exchange_n(&sh->expiring, true, __ATOMIC_ACQUIRE)) {
+        bool pending = __atomic_load_n(&tim->pending, __ATOMIC_ACQUIRE);
+        if (!pending)
+            wheel_unlink(sh, idx);
+        __atomic_store_n(&sh->expiring, false, __ATOMIC_RELEASE);
+        if (!pending) {
+            freelist_push(tim);
+            return;
+        }
+    }
 
+    /* Leave it to the next lf_timer_expire() of the shard, which is due now */
+    struct timer *head = __atomic_load_n(&sh->freed, __ATOMIC_RELAXED);
     do {
-        old.fl = g_timer.freelist;
-        tim->cb = NULL;
-        tim->arg = old.fl.head;
-        neu.fl.head = tim;
-        neu.fl.count = old.fl.count + 1;
-    } while (UNLIKELY(!lockfree_compare_exchange_pp(
-        (ptrpair_t *) &g_timer.freelist, &old.pp, neu.pp,
+        tim->arg = head;
+    } while (UNLIKELY(!__atomic_compare_exchange_n(
+        &sh->freed, &head, tim,
         /* weak = */ true, __ATOMIC_RELEASE, __ATOMIC_RELAXED)));
+    update_earliest(shard, __atomic_load_n(&g_timer.current, __ATOMIC_RELAXED));
 }
 
 static inline bool update_expiration(lf_timer_t idx,
@@ -302,16 +627,25 @@ static inline bool update_expiration(lf_timer_t idx,
     lf_tick_t old;
     do {
         /* Explicit reloading => smaller code */
-        old = __atomic_load_n(&g_timer.expirations[idx], __ATOMIC_RELAXED);
+        old = __atomic_load_n(&g_timer.timers[idx].expiration,
+                              __ATOMIC_RELAXED);
         if (active ? old == LF_TIMER_TICK_INVALID :  // Timer inactive/expired
                 old != LF_TIMER_TICK_INVALID) {      // Timer already active
             return false;
         }
     } while (UNLIKELY(
-        !__atomic_compare_exchange_n(&g_timer.expirations[idx], &old, exp,
-                                     /* weak = */ true, mo, __ATOMIC_RELAXED)));
-    if (exp != LF_TIMER_TICK_INVALID)
-        update_earliest(exp);
+        !__atomic_compare_exchange_n(&g_timer.timers[idx].expiration, &old,
+                                     exp, /* weak = */ true, mo,
+                                     __ATOMIC_RELAXED)));
+
+    /* A cancelled timer is left in the wheel until its slot is reached, the
+     * others are filed by the next lf_timer_expire()
+     */
+    if (exp != LF_TIMER_TICK_INVALID) {
+        uint32_t shard = g_timer.timers[idx].shard;
+        push_pending(&g_timer.shards[shard], idx);
+        update_earliest(shard, exp);
+    }
     return true;
 }
 
@@ -11,12 +11,28 @@ typedef uint64_t lf_tick_t;
 
 typedef void (*lf_timer_cb)(lf_timer_t tim, lf_tick_t tmo, void *arg);
 
+/* Number of timers and of shards available at startup */
+#define LF_TIMER_DEFAULT_TIMERS 8192
+#define LF_TIMER_DEFAULT_SHARDS 64
+#define LF_TIMER_MAX_SHARDS 1024
+
+/** (Re)initialize with room for @n_timers timers, spread over @n_shards
+ * shards. A timer belongs to the shard of the thread that allocated it, the
+ * threads being spread over the shards. This drops every timer and must not
+ * be called concurrently with any other function.
+ * @return false if @n_timers is 0 or above INT32_MAX, @n_shards is 0 or above
+ * LF_TIMER_MAX_SHARDS, or without memory
+ */
+bool lf_timer_init(uint32_t n_timers, uint32_t n_shards);
+
 /** Allocate a timer and associate with the callback and user argument
  * @return LF_TIMER_NULL if no timer available
  */
 lf_timer_t lf_timer_alloc(lf_timer_cb cb, void *arg);
 
-/** Free a timer */
+/** Free an inactive timer. It can be allocated again once it left the wheel
+ * of its shard, which may wait for the next lf_timer_expire() of the shard.
+ */
 void lf_timer_free(lf_timer_t tim);
 
 /** Set (activate) an inactive (expired or cancelled) timer
@@ -40,5 +56,17 @@ lf_tick_t lf_timer_tick_get(void);
 /** Set current timer tick */
 void lf_timer_tick_set(lf_tick_t now);
 
-/** Expire timers <= current tick and invoke callbacks */
+/** Expire the timers <= current tick of the shard of the calling thread, and
+ * invoke their callbacks in batches
+ * Returns at once if another thread is expiring timers of the shard
+ */
 void lf_timer_expire(void);
+
+/** Return a lower bound of the expirations of all the shards, or
+ * LF_TIMER_TICK_INVALID if no timer is active. Cancelled timers may still
+ * count until their expiration is reached.
+ */
+lf_tick_t lf_timer_next(void);
+
+/** Same as lf_timer_next() for the shard of the calling thread only */
+lf_tick_t lf_timer_next_local(void);
@@ -0,0 +1,83 @@
+#include <errno.h>
+#include <stdint.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "lf_timer_fd.h"
+
+#define NS_PER_SEC 1000000000ULL
+
+int lf_timer_fd_init(lf_timer_fd_t *drv, uint64_t ns_per_tick)
+{
+    if (ns_per_tick == 0) {
+        errno = EINVAL;
+        return -1;
+    }
+    drv->fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (drv->fd < 0)
+        return -1;
+    drv->ns_per_tick = ns_per_tick;
+    drv->armed = LF_TIMER_TICK_INVALID;
+    return 0;
+}
+
+void lf_timer_fd_close(lf_timer_fd_t *drv)
+{
+    close(drv->fd);
+    drv->fd = -1;
+}
+
+int lf_timer_fd_add(lf_timer_fd_t *drv, int epfd, void *data)
+{
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = data};
+    return epoll_ctl(epfd, EPOLL_CTL_ADD, drv->fd, &ev);
+}
+
+lf_tick_t lf_timer_fd_now(const lf_timer_fd_t *drv)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((uint64_t) ts.tv_sec * NS_PER_SEC + ts.tv_nsec) / drv->ns_per_tick;
+}
+
+/* Arm to @tck, or disarm with LF_TIMER_TICK_INVALID */
+static void arm(lf_timer_fd_t *drv, lf_tick_t tck)
+{
+    struct itimerspec its = {0};
+
+    /* Beyond the range of the clock, it is never due */
+    if (tck != LF_TIMER_TICK_INVALID && tck <= UINT64_MAX / drv->ns_per_tick) {
+        uint64_t ns = tck * drv->ns_per_tick;
+        its.it_value.tv_sec = ns / NS_PER_SEC;
+        its.it_value.tv_nsec = ns % NS_PER_SEC;
+        /* Zero would disarm it, and the tick is already due */
+        if (!its.it_value.tv_sec && !its.it_value.tv_nsec)
+            its.it_value.tv_nsec = 1;
+    }
+    timerfd_settime(drv->fd, TFD_TIMER_ABSTIME, &its, NULL);
+    drv->armed = tck;
+}
+
+void lf_timer_fd_rearm(lf_timer_fd_t *drv)
+{
+    lf_tick_t next = lf_timer_next_local();
+    if (next < drv->armed)
+        arm(drv, next);
+}
+
+void lf_timer_fd_expire(lf_timer_fd_t *drv)
+{
+    uint64_t n;
+
+    /* Nothing to read after a spurious wake-up, the timers are still checked */
+    if (read(drv->fd, &n, sizeof(n)) < 0 && errno != EAGAIN)
+        return;
+
+    lf_timer_tick_set(lf_timer_fd_now(drv));
+    lf_timer_expire();
+
+    /* The timerfd fired, or will for a tick that may be gone: arm it anew */
+    arm(drv, lf_timer_next_local());
+}
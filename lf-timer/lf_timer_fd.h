@@ -0,0 +1,50 @@
+#pragma once
+
+#include <stdint.h>
+
+#include "lf_timer.h"
+
+/* Drive the timers of the calling thread's shard from a timerfd, armed to the
+ * earliest pending expiration, so that nothing runs until a timer is due.
+ * One tick is @ns_per_tick nanoseconds of CLOCK_MONOTONIC.
+ *
+ * The fd is made readable when a timer is due. Add it to an epoll set with
+ * lf_timer_fd_add(), or start an ev_io watcher on lf_timer_fd_get() with the
+ * loop of redirect/, and call lf_timer_fd_expire() from it. All the calls must
+ * be made by the same thread.
+ */
+typedef struct {
+    int fd;
+    uint64_t ns_per_tick;
+    lf_tick_t armed; /* Tick the timerfd is armed to */
+} lf_timer_fd_t;
+
+/** @return -1 and errno set on failure */
+int lf_timer_fd_init(lf_timer_fd_t *drv, uint64_t ns_per_tick);
+
+/** Close the timerfd */
+void lf_timer_fd_close(lf_timer_fd_t *drv);
+
+static inline int lf_timer_fd_get(const lf_timer_fd_t *drv)
+{
+    return drv->fd;
+}
+
+/** Add the timerfd to @epfd for reading, with @data as its epoll data
+ * @return -1 and errno set on failure
+ */
+int lf_timer_fd_add(lf_timer_fd_t *drv, int epfd, void *data);
+
+/** Return the current tick according to the clock */
+lf_tick_t lf_timer_fd_now(const lf_timer_fd_t *drv);
+
+/** Advance the tick to the clock, expire the due timers and rearm the
+ * timerfd. Called when the fd is readable.
+ */
+void lf_timer_fd_expire(lf_timer_fd_t *drv);
+
+/** Arm the timerfd earlier if the timers set since the last call need it.
+ * To call once timers were set outside of the callbacks of the expiration,
+ * e.g. at the end of an iteration of the event loop.
+ */
+void lf_timer_fd_rearm(lf_timer_fd_t *drv);
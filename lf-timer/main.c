@@ -1,8 +1,12 @@
 #include <inttypes.h>
+#include <pthread.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <sys/epoll.h>
+#include <unistd.h>
 
 #include "lf_timer.h"
+#include "lf_timer_fd.h"
 
 #define EX_HASHSTR(s) #s
 #define EX_STR(s) EX_HASHSTR(s)
@@ -23,6 +27,234 @@ static void callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
     *(lf_tick_t *) arg = tck;
 }
 
+/* Many timers over a long span: each one that is not cancelled expires once,
+ * at the first call to lf_timer_expire() past its expiration
+ */
+#define N_TIMERS (1 << 20)
+#define SPAN 100000
+#define MAX_STEP 1000
+
+static lf_tick_t fired[N_TIMERS];
+
+static void count_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    EXPECT(*(lf_tick_t *) arg == LF_TIMER_TICK_INVALID);
+    EXPECT(tmo <= lf_timer_tick_get());
+    *(lf_tick_t *) arg = lf_timer_tick_get();
+}
+
+static void test_many(void)
+{
+    static lf_tick_t exps[N_TIMERS];
+    static lf_timer_t tims[N_TIMERS];
+
+    EXPECT(lf_timer_init(N_TIMERS, 1));
+    srand(1);
+    for (uint32_t i = 0; i < N_TIMERS; i++) {
+        fired[i] = LF_TIMER_TICK_INVALID;
+        tims[i] = lf_timer_alloc(count_callback, &fired[i]);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        exps[i] = 1 + rand() % SPAN;
+        EXPECT(lf_timer_set(tims[i], exps[i]));
+    }
+    EXPECT(lf_timer_alloc(count_callback, NULL) == LF_TIMER_NULL);
+    for (uint32_t i = 0; i < N_TIMERS; i += 3)
+        EXPECT(lf_timer_cancel(tims[i]));
+    for (uint32_t i = 1; i < N_TIMERS; i += 3)
+        EXPECT(lf_timer_reset(tims[i], exps[i] += rand() % 64));
+    EXPECT(lf_timer_next() == 1);
+
+    for (lf_tick_t tck = 0; tck <= SPAN + 64;) {
+        tck += 1 + rand() % MAX_STEP;
+        lf_timer_tick_set(tck);
+        lf_timer_expire();
+    }
+    for (uint32_t i = 0; i < N_TIMERS; i++) {
+        if (i % 3 == 0) {
+            EXPECT(fired[i] == LF_TIMER_TICK_INVALID);
+        } else {
+            EXPECT(fired[i] >= exps[i] && fired[i] < exps[i] + MAX_STEP);
+        }
+        lf_timer_free(tims[i]);
+    }
+    printf("%d timers expired\n", N_TIMERS - (N_TIMERS + 2) / 3);
+}
+
+/* Each thread has its own shard, and gets the callbacks of its timers */
+#define N_THREADS 4
+#define THREAD_TIMERS 10000
+
+struct worker {
+    pthread_t thread;
+    _Atomic uint32_t n_fired;
+};
+
+static _Atomic uint32_t workers_done;
+static __thread struct worker *self;
+
+static void worker_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    struct worker *w = arg;
+    EXPECT(w == self);
+    EXPECT(tmo <= lf_timer_tick_get());
+    w->n_fired++;
+}
+
+static void *worker(void *arg)
+{
+    static __thread lf_timer_t tims[THREAD_TIMERS];
+    struct worker *w = self = arg;
+
+    for (uint32_t i = 0; i < THREAD_TIMERS; i++) {
+        tims[i] = lf_timer_alloc(worker_callback, w);
+        EXPECT(tims[i] != LF_TIMER_NULL);
+        EXPECT(lf_timer_set(tims[i], lf_timer_tick_get() + 1 + i % 1000));
+    }
+    while (w->n_fired < THREAD_TIMERS)
+        lf_timer_expire();
+    for (uint32_t i = 0; i < THREAD_TIMERS; i++)
+        lf_timer_free(tims[i]);
+    workers_done++;
+    return NULL;
+}
+
+static void test_shards(void)
+{
+    static struct worker workers[N_THREADS];
+
+    EXPECT(lf_timer_init(N_THREADS * THREAD_TIMERS, N_THREADS));
+    for (int i = 0; i < N_THREADS; i++)
+        EXPECT(pthread_create(&workers[i].thread, NULL, worker, &workers[i]) ==
+               0);
+    for (lf_tick_t tck = 1; workers_done < N_THREADS; tck++) {
+        lf_timer_tick_set(tck);
+        sched_yield();
+    }
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_join(workers[i].thread, NULL);
+    EXPECT(lf_timer_next() == LF_TIMER_TICK_INVALID);
+    printf("%d timers expired on %d shards\n", N_THREADS * THREAD_TIMERS,
+           N_THREADS);
+}
+
+/* A timer cancelled while filed in the wheel of one shard, freed, then
+ * allocated again from the next shard only fires there
+ */
+static pthread_barrier_t reuse_barrier;
+static lf_timer_t reuse_tim;
+static _Atomic uint32_t reuse_fired;
+static pthread_t reuse_fired_on;
+
+static void reuse_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    reuse_fired_on = pthread_self();
+    reuse_fired++;
+}
+
+static void *reuse_first(void *arg)
+{
+    lf_tick_t now = lf_timer_tick_get(), exp = LF_TIMER_TICK_INVALID;
+    lf_timer_t due = lf_timer_alloc(callback, &exp);
+    reuse_tim = lf_timer_alloc(reuse_callback, NULL);
+    EXPECT(due != LF_TIMER_NULL && reuse_tim != LF_TIMER_NULL);
+    EXPECT(lf_timer_set(due, now + 1));
+    EXPECT(lf_timer_set(reuse_tim, now + 10));
+    lf_timer_tick_set(now + 1);
+    lf_timer_expire(); /* Expires "due" and files reuse_tim */
+    EXPECT(exp == now + 1);
+    EXPECT(lf_timer_cancel(reuse_tim));
+    lf_timer_free(due);
+    lf_timer_free(reuse_tim);
+    pthread_barrier_wait(&reuse_barrier);
+
+    /* The second thread set it again */
+    pthread_barrier_wait(&reuse_barrier);
+    lf_timer_tick_set(now + 10);
+    lf_timer_expire();
+    pthread_barrier_wait(&reuse_barrier);
+    return NULL;
+}
+
+static void *reuse_second(void *arg)
+{
+    pthread_barrier_wait(&reuse_barrier);
+    EXPECT(lf_timer_alloc(reuse_callback, NULL) == reuse_tim);
+    EXPECT(lf_timer_set(reuse_tim, lf_timer_tick_get() + 9));
+    pthread_barrier_wait(&reuse_barrier);
+
+    pthread_barrier_wait(&reuse_barrier);
+    lf_timer_expire();
+    lf_timer_free(reuse_tim);
+    return NULL;
+}
+
+static void test_reuse(void)
+{
+    pthread_t first, second;
+
+    /* Consecutive threads get different shards */
+    EXPECT(lf_timer_init(2, 2));
+    EXPECT(pthread_barrier_init(&reuse_barrier, NULL, 2) == 0);
+    EXPECT(pthread_create(&first, NULL, reuse_first, NULL) == 0);
+    EXPECT(pthread_create(&second, NULL, reuse_second, NULL) == 0);
+    pthread_join(first, NULL);
+    pthread_join(second, NULL);
+    EXPECT(reuse_fired == 1);
+    EXPECT(pthread_equal(reuse_fired_on, second));
+    pthread_barrier_destroy(&reuse_barrier);
+    printf("freed timer reused on another shard\n");
+}
+
+/* The timerfd only wakes the loop up when a timer is due */
+#define FD_TIMERS 3
+
+static void fd_callback(lf_timer_t tim, lf_tick_t tmo, void *arg)
+{
+    EXPECT(tmo <= lf_timer_tick_get());
+    ++*(int *) arg;
+}
+
+static void test_timerfd(void)
+{
+    lf_timer_fd_t drv;
+    lf_timer_t tims[FD_TIMERS];
+    int n_fired = 0, n_wakeups = 0;
+
+    EXPECT(lf_timer_init(FD_TIMERS, 1));
+    EXPECT(lf_timer_fd_init(&drv, 1000000) == 0); /* 1 ms */
+    int epfd = epoll_create1(0);
+    EXPECT(epfd >= 0);
+    EXPECT(lf_timer_fd_add(&drv, epfd, &drv) == 0);
+
+    lf_tick_t now = lf_timer_fd_now(&drv);
+    for (int i = 0; i < FD_TIMERS; i++) {
+        tims[i] = lf_timer_alloc(fd_callback, &n_fired);
+        EXPECT(lf_timer_set(tims[i], now + 5 * (i + 1)));
+    }
+    EXPECT(lf_timer_cancel(tims[1]));
+    lf_timer_fd_rearm(&drv);
+
+    while (n_fired < FD_TIMERS - 1) {
+        struct epoll_event ev;
+        if (epoll_wait(epfd, &ev, 1, 1000) <= 0)
+            break;
+        EXPECT(ev.data.ptr == &drv);
+        n_wakeups++;
+        lf_timer_fd_expire(&drv);
+    }
+    EXPECT(n_fired == FD_TIMERS - 1);
+    EXPECT(lf_timer_fd_now(&drv) >= now + 5 * FD_TIMERS);
+
+    /* Nothing left: no more wake-ups */
+    struct epoll_event ev;
+    EXPECT(epoll_wait(epfd, &ev, 1, 20) == 0);
+    for (int i = 0; i < FD_TIMERS; i++)
+        lf_timer_free(tims[i]);
+    close(epfd);
+    lf_timer_fd_close(&drv);
+    printf("%d timers expired in %d wake-ups\n", n_fired, n_wakeups);
+}
+
 int main(void)
 {
     lf_tick_t exp_a = LF_TIMER_TICK_INVALID;
@@ -62,6 +294,11 @@ int main(void)
 
     lf_timer_free(tim_a);
 
+    test_many();
+    test_shards();
+    test_reuse();
+    test_timerfd();
+
     printf("timer tests complete\n");
     return 0;
 }
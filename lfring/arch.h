@@ -14,6 +14,11 @@ static inline void smp_fence(unsigned int mask)
         __asm__ volatile("" ::: "memory");
     }
 }
+
+static inline void spin_pause(void)
+{
+    __asm__ volatile("pause" ::: "memory");
+}
 #else
 #error "Unsupported architecture"
 #endif
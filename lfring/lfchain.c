@@ -0,0 +1,193 @@
+#include <assert.h>
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "common.h"
+#include "lfchain.h"
+#include "qsbr.h"
+
+#define SUPPORTED_FLAGS \
+    (LFRING_FLAG_SP | LFRING_FLAG_SC | LFRING_FLAG_MP_BATCH)
+
+struct segment {
+    struct segment *next;
+    lfring_t *ring;
+    lfchain_t *q;
+};
+
+struct lfchain {
+    struct segment *head ALIGNED(CACHE_LINE); /* consumers */
+    struct segment *tail ALIGNED(CACHE_LINE); /* producers */
+    qsbr_t *qs ALIGNED(CACHE_LINE);
+    uint32_t seg_elems;
+    uint32_t flags;
+    uint32_t n_segments;
+};
+
+static struct segment *segment_alloc(lfchain_t *q)
+{
+    struct segment *seg = malloc(sizeof(struct segment));
+    if (!seg)
+        return NULL;
+    seg->ring = lfring_alloc(q->seg_elems, q->flags | LFRING_FLAG_ONCE);
+    if (!seg->ring) {
+        free(seg);
+        return NULL;
+    }
+    seg->next = NULL;
+    seg->q = q;
+    __atomic_fetch_add(&q->n_segments, 1, __ATOMIC_RELAXED);
+    return seg;
+}
+
+/* What a segment accounts for in the limbo, with ring slots of two words */
+static size_t segment_bytes(const lfchain_t *q)
+{
+    return sizeof(struct segment) + q->seg_elems * 2 * sizeof(void *);
+}
+
+static void segment_free(void *ptr)
+{
+    struct segment *seg = ptr;
+    __atomic_fetch_sub(&seg->q->n_segments, 1, __ATOMIC_RELAXED);
+    lfring_free(seg->ring);
+    free(seg);
+}
+
+lfchain_t *lfchain_alloc(uint32_t seg_elems, uint32_t flags)
+{
+    if ((flags & ~SUPPORTED_FLAGS) != 0) {
+        assert(0 && "invalid flags");
+        return NULL;
+    }
+
+    lfchain_t *q = osal_alloc(sizeof(lfchain_t), CACHE_LINE);
+    if (!q)
+        return NULL;
+    q->seg_elems = seg_elems;
+    q->flags = flags;
+    q->n_segments = 0;
+    if (!(q->qs = qsbr_create()))
+        goto free_queue;
+    if (!(q->head = q->tail = segment_alloc(q)))
+        goto free_qsbr;
+    return q;
+
+free_qsbr:
+    qsbr_destroy(q->qs);
+free_queue:
+    osal_free(q);
+    return NULL;
+}
+
+void lfchain_free(lfchain_t *q)
+{
+    if (!q)
+        return;
+
+    /* The limbo first, it may point to the queue */
+    qsbr_destroy(q->qs);
+    for (struct segment *seg = q->head, *next; seg; seg = next) {
+        next = seg->next;
+        segment_free(seg);
+    }
+    osal_free(q);
+}
+
+struct qsbr_tls *lfchain_register(lfchain_t *q)
+{
+    return qsbr_register(q->qs);
+}
+
+void lfchain_unregister(struct qsbr_tls *t)
+{
+    qsbr_unregister(t);
+}
+
+/* Make the closed 'seg' have a next segment, and return it */
+static struct segment *segment_extend(lfchain_t *q, struct segment *seg)
+{
+    struct segment *next = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+    if (next)
+        return next;
+
+    struct segment *neu = segment_alloc(q);
+    if (!neu)
+        return NULL;
+    if (__atomic_compare_exchange_n(&seg->next, &next, /* Updated on failure */
+                                    neu,
+                                    /* weak */ false, __ATOMIC_RELEASE,
+                                    __ATOMIC_ACQUIRE))
+        return neu;
+    /* Another producer linked its segment first, ours was never seen */
+    segment_free(neu);
+    return next;
+}
+
+uint32_t lfchain_enqueue(lfchain_t *q,
+                         struct qsbr_tls *t,
+                         void *const elems[],
+                         uint32_t n_elems)
+{
+    uint32_t actual = 0;
+
+    while (actual < n_elems) {
+        struct segment *seg = __atomic_load_n(&q->tail, __ATOMIC_ACQUIRE);
+        actual += lfring_enqueue(seg->ring, elems + actual, n_elems - actual);
+        if (actual == n_elems)
+            break;
+
+        /* The segment is closed, move the tail on to its successor */
+        struct segment *next = segment_extend(q, seg);
+        if (!next)
+            break;
+        (void) __atomic_compare_exchange_n(&q->tail, &seg, next,
+                                           /* weak */ false, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED);
+    }
+    qsbr_checkpoint(t);
+    return actual;
+}
+
+uint32_t lfchain_dequeue(lfchain_t *q,
+                         struct qsbr_tls *t,
+                         void *elems[],
+                         uint32_t n_elems)
+{
+    uint32_t actual = 0;
+
+    while (actual < n_elems) {
+        struct segment *seg = __atomic_load_n(&q->head, __ATOMIC_ACQUIRE);
+        uint32_t index;
+        uint32_t n = lfring_dequeue(seg->ring, elems + actual,
+                                    n_elems - actual, &index);
+        actual += n;
+        if (n != 0)
+            continue;
+
+        /* Only a drained segment with a successor is done with */
+        struct segment *next = __atomic_load_n(&seg->next, __ATOMIC_ACQUIRE);
+        if (!next || !lfring_exhausted(seg->ring))
+            break;
+
+        /* No thread should find the segment from the queue after it is
+         * retired: when the tail lags behind, push it past the segment
+         * before moving the head.
+         */
+        struct segment *tail = seg;
+        (void) __atomic_compare_exchange_n(&q->tail, &tail, next,
+                                           /* weak */ false, __ATOMIC_RELEASE,
+                                           __ATOMIC_RELAXED);
+        if (__atomic_compare_exchange_n(&q->head, &seg, next,
+                                        /* weak */ false, __ATOMIC_RELEASE,
+                                        __ATOMIC_RELAXED))
+            qsbr_retire(t, seg, segment_bytes(q), segment_free);
+    }
+    qsbr_checkpoint(t);
+    return actual;
+}
+
+uint32_t lfchain_segments(lfchain_t *q)
+{
+    return __atomic_load_n(&q->n_segments, __ATOMIC_RELAXED);
+}
@@ -0,0 +1,50 @@
+/* Unbounded lock-free queue of linked lfring segments, in the spirit of
+ * LCRQ.
+ *
+ * Each segment is a LFRING_FLAG_ONCE ring: once producers used all its slots
+ * it is closed, and they link a new segment after it and move on. Consumers
+ * move on once they drained a closed segment, and retire it to QSBR, so the
+ * threads using the queue have to register with it. Every call is a
+ * quiescent state of the calling thread, a registered thread that no longer
+ * uses the queue for a while should go qsbr_offline() to not hold the
+ * reclamation back.
+ */
+
+#pragma once
+
+#include <stdint.h>
+
+#include "lfring.h"
+
+struct qsbr_tls;
+
+typedef struct lfchain lfchain_t;
+
+/* Allocate a queue of segments of at least 'seg_elems' elements. Only
+ * LFRING_FLAG_SP, LFRING_FLAG_SC and LFRING_FLAG_MP_BATCH apply to it.
+ */
+lfchain_t *lfchain_alloc(uint32_t seg_elems, uint32_t flags);
+
+/* Free the queue. It must be empty, and all threads unregistered */
+void lfchain_free(lfchain_t *q);
+
+/* Register the calling thread, before it uses the queue */
+struct qsbr_tls *lfchain_register(lfchain_t *q);
+void lfchain_unregister(struct qsbr_tls *t);
+
+/* Enqueue elements. Fewer than 'n_elems' are only enqueued if there is no
+ * memory for a new segment.
+ */
+uint32_t lfchain_enqueue(lfchain_t *q,
+                         struct qsbr_tls *t,
+                         void *const elems[],
+                         uint32_t n_elems);
+
+/* Dequeue up to 'n_elems' elements, return how many were dequeued */
+uint32_t lfchain_dequeue(lfchain_t *q,
+                         struct qsbr_tls *t,
+                         void *elems[],
+                         uint32_t n_elems);
+
+/* Segments allocated and not reclaimed yet */
+uint32_t lfchain_segments(lfchain_t *q);
@@ -1,14 +1,21 @@
 #include <assert.h>
+#include <errno.h>
 #include <inttypes.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <stdbool.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "arch.h"
 #include "common.h"
 #include "lfring.h"
 
-#define SUPPORTED_FLAGS \
-    (LFRING_FLAG_SP | LFRING_FLAG_MP | LFRING_FLAG_SC | LFRING_FLAG_MC)
+#define SUPPORTED_FLAGS                                               \
+    (LFRING_FLAG_SP | LFRING_FLAG_MP | LFRING_FLAG_SC | LFRING_FLAG_MC | \
+     LFRING_FLAG_MP_BATCH | LFRING_FLAG_WAIT | LFRING_FLAG_ONCE)
 
 #define MIN(a, b)                      \
     ({                                 \
@@ -26,6 +33,12 @@ struct element {
 struct lfring {
     ringidx_t head;
     ringidx_t tail ALIGNED(CACHE_LINE);
+    ringidx_t reserve ALIGNED(CACHE_LINE); /* LFRING_FLAG_MP_BATCH only */
+    /* LFRING_FLAG_WAIT only. Producers read n_waiters and leave the line
+     * shared until a consumer goes to sleep.
+     */
+    uint32_t wait_seq ALIGNED(CACHE_LINE); /* futex word, bumped on wakeup */
+    uint32_t n_waiters;
     uint32_t mask;
     uint32_t flags;
     struct element ring[] ALIGNED(CACHE_LINE);
@@ -42,13 +55,18 @@ lfring_t *lfring_alloc(uint32_t n_elems, uint32_t flags)
         assert(0 && "invalid flags");
         return NULL;
     }
+    if ((flags & LFRING_FLAG_SP) && (flags & LFRING_FLAG_MP_BATCH)) {
+        assert(0 && "invalid flags");
+        return NULL;
+    }
 
     size_t nbytes = sizeof(lfring_t) + ringsz * sizeof(struct element);
     lfring_t *lfr = osal_alloc(nbytes, CACHE_LINE);
     if (!lfr)
         return NULL;
 
-    lfr->head = 0, lfr->tail = 0;
+    lfr->head = 0, lfr->tail = 0, lfr->reserve = 0;
+    lfr->wait_seq = 0, lfr->n_waiters = 0;
     lfr->mask = ringsz - 1;
     lfr->flags = flags;
     for (ringidx_t i = 0; i < ringsz; i++) {
@@ -101,20 +119,94 @@ static inline ringidx_t cond_reload(ringidx_t idx, const ringidx_t *loc)
     return idx;
 }
 
+/* The first index producers cannot enqueue at yet */
+static inline ringidx_t enqueue_limit(lfring_t *lfr)
+{
+    ringidx_t size = lfr->mask + 1;
+    if (UNLIKELY(lfr->flags & LFRING_FLAG_ONCE))
+        return size;
+    return __atomic_load_n(&lfr->head, __ATOMIC_ACQUIRE) + size;
+}
+
+bool lfring_exhausted(lfring_t *lfr)
+{
+    assert(lfr->flags & LFRING_FLAG_ONCE);
+    return __atomic_load_n(&lfr->head, __ATOMIC_ACQUIRE) == lfr->mask + 1;
+}
+
+/* Spin this many rounds, then back off with up to WAIT_PAUSE_MAX pauses per
+ * round, before going to sleep in lfring_dequeue_wait().
+ */
+#define WAIT_SPIN 64
+#define WAIT_PAUSE_MAX 1024
+
+/* Wake up to 'n' sleeping consumers after releasing 'n' elements */
+static inline void wake_consumers(lfring_t *lfr, uint32_t n)
+{
+    /* Either we see the waiter, or the waiter sees our elements */
+    smp_fence(StoreLoad);
+    if (LIKELY(__atomic_load_n(&lfr->n_waiters, __ATOMIC_RELAXED) == 0))
+        return;
+    __atomic_fetch_add(&lfr->wait_seq, 1, __ATOMIC_RELEASE);
+    syscall(SYS_futex, &lfr->wait_seq, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Enqueue a batch of elements with a single CAS on the reservation index.
+ * The reserved slots are owned by the caller until it writes them, so no
+ * per-slot CAS is needed. Tail is only moved if every slot before the batch
+ * is written; otherwise consumers catch up by scanning, see find_tail().
+ */
+static uint32_t enqueue_mp_batch(lfring_t *lfr,
+                                 void *const *restrict elems,
+                                 uint32_t n_elems,
+                                 bool bulk)
+{
+    intptr_t actual;
+    ringidx_t mask = lfr->mask;
+    ringidx_t size = mask + 1;
+    ringidx_t tail = __atomic_load_n(&lfr->reserve, __ATOMIC_RELAXED);
+    do {
+        actual = MIN((intptr_t)(enqueue_limit(lfr) - tail), (intptr_t) n_elems);
+        if (actual <= 0 || (bulk && actual != (intptr_t) n_elems))
+            return 0;
+    } while (!__atomic_compare_exchange_n(&lfr->reserve,
+                                          &tail, /* Updated on failure */
+                                          tail + actual,
+                                          /* weak */ true, __ATOMIC_RELAXED,
+                                          __ATOMIC_RELAXED));
+
+    for (uint32_t i = 0; i < (uint32_t) actual; i++) {
+        struct element *slot = &lfr->ring[(tail + i) & mask];
+        assert(__atomic_load_n(&slot->idx, __ATOMIC_RELAXED) ==
+               tail + i - size);
+        slot->ptr = elems[i];
+        __atomic_store_n(&slot->idx, tail + i, __ATOMIC_RELEASE);
+    }
+
+    ringidx_t expected = tail;
+    (void) __atomic_compare_exchange_n(&lfr->tail, &expected, tail + actual,
+                                       /* weak */ false, __ATOMIC_RELEASE,
+                                       __ATOMIC_RELAXED);
+    return (uint32_t) actual;
+}
+
 /* Enqueue elements at tail */
-uint32_t lfring_enqueue(lfring_t *lfr,
+static uint32_t enqueue(lfring_t *lfr,
                         void *const *restrict elems,
-                        uint32_t n_elems)
+                        uint32_t n_elems,
+                        bool bulk)
 {
     intptr_t actual = 0;
     ringidx_t mask = lfr->mask;
     ringidx_t size = mask + 1;
     ringidx_t tail = __atomic_load_n(&lfr->tail, __ATOMIC_RELAXED);
 
+    if (lfr->flags & LFRING_FLAG_MP_BATCH)
+        return enqueue_mp_batch(lfr, elems, n_elems, bulk);
+
     if (lfr->flags & LFRING_FLAG_SP) { /* single-producer */
-        ringidx_t head = __atomic_load_n(&lfr->head, __ATOMIC_ACQUIRE);
-        actual = MIN((intptr_t)(head + size - tail), (intptr_t) n_elems);
-        if (actual <= 0)
+        actual = MIN((intptr_t)(enqueue_limit(lfr) - tail), (intptr_t) n_elems);
+        if (actual <= 0 || (bulk && actual != (intptr_t) n_elems))
             return 0;
 
         for (uint32_t i = 0; i < (uint32_t) actual; i++) {
@@ -128,9 +220,13 @@ uint32_t lfring_enqueue(lfring_t *lfr,
     }
 
     /* else: lock-free multi-producer */
+    if (bulk) {
+        assert(0 && "bulk enqueue needs SP or MP_BATCH");
+        return 0;
+    }
 restart:
     while ((uint32_t) actual < n_elems &&
-           before(tail, __atomic_load_n(&lfr->head, __ATOMIC_ACQUIRE) + size)) {
+           before(tail, enqueue_limit(lfr))) {
         union {
             struct element e;
             ptrpair_t pp;
@@ -166,6 +262,38 @@ restart:
     return (uint32_t) actual;
 }
 
+static inline uint32_t enqueue_wake(lfring_t *lfr,
+                                    void *const *restrict elems,
+                                    uint32_t n_elems,
+                                    bool bulk)
+{
+    uint32_t actual = enqueue(lfr, elems, n_elems, bulk);
+    if (UNLIKELY(lfr->flags & LFRING_FLAG_WAIT) && actual != 0)
+        wake_consumers(lfr, actual);
+    return actual;
+}
+
+uint32_t lfring_enqueue(lfring_t *lfr,
+                        void *const *restrict elems,
+                        uint32_t n_elems)
+{
+    return enqueue_wake(lfr, elems, n_elems, false);
+}
+
+uint32_t lfring_enqueue_bulk(lfring_t *lfr,
+                             void *const *restrict elems,
+                             uint32_t n_elems)
+{
+    return enqueue_wake(lfr, elems, n_elems, true);
+}
+
+uint32_t lfring_enqueue_burst(lfring_t *lfr,
+                              void *const *restrict elems,
+                              uint32_t n_elems)
+{
+    return enqueue_wake(lfr, elems, n_elems, false);
+}
+
 static inline ringidx_t find_tail(lfring_t *lfr, ringidx_t head, ringidx_t tail)
 {
     if (lfr->flags & LFRING_FLAG_SP) /* single-producer enqueue */
@@ -177,7 +305,7 @@ static inline ringidx_t find_tail(lfring_t *lfr, ringidx_t head, ringidx_t tail)
     ringidx_t mask = lfr->mask;
     ringidx_t size = mask + 1;
     while (before(tail, head + size) &&
-           __atomic_load_n(&lfr->ring[tail & mask].idx, __ATOMIC_RELAXED) ==
+           __atomic_load_n(&lfr->ring[tail & mask].idx, __ATOMIC_ACQUIRE) ==
                tail)
         tail++;
     tail = cond_update(&lfr->tail, tail);
@@ -185,10 +313,11 @@ static inline ringidx_t find_tail(lfring_t *lfr, ringidx_t head, ringidx_t tail)
 }
 
 /* Dequeue elements from head */
-uint32_t lfring_dequeue(lfring_t *lfr,
+static uint32_t dequeue(lfring_t *lfr,
                         void **restrict elems,
                         uint32_t n_elems,
-                        uint32_t *index)
+                        uint32_t *index,
+                        bool bulk)
 {
     ringidx_t mask = lfr->mask;
     intptr_t actual;
@@ -203,11 +332,17 @@ uint32_t lfring_dequeue(lfring_t *lfr,
             if (actual <= 0)
                 return 0;
         }
+        if (bulk && actual != (intptr_t) n_elems) {
+            tail = find_tail(lfr, head, tail);
+            if ((intptr_t)(tail - head) < (intptr_t) n_elems)
+                return 0;
+            actual = n_elems;
+        }
         for (uint32_t i = 0; i < (uint32_t) actual; i++)
             elems[i] = lfr->ring[(head + i) & mask].ptr;
         smp_fence(LoadStore);                        // Order loads only
         if (UNLIKELY(lfr->flags & LFRING_FLAG_SC)) { /* Single-consumer */
-            __atomic_store_n(&lfr->head, head + actual, __ATOMIC_RELAXED);
+            __atomic_store_n(&lfr->head, head + actual, __ATOMIC_RELEASE);
             break;
         }
 
@@ -219,3 +354,145 @@ uint32_t lfring_dequeue(lfring_t *lfr,
     *index = (uint32_t) head;
     return (uint32_t) actual;
 }
+
+uint32_t lfring_dequeue(lfring_t *lfr,
+                        void **restrict elems,
+                        uint32_t n_elems,
+                        uint32_t *index)
+{
+    return dequeue(lfr, elems, n_elems, index, false);
+}
+
+uint32_t lfring_dequeue_wait(lfring_t *lfr,
+                             void **restrict elems,
+                             uint32_t n_elems,
+                             uint32_t *index,
+                             int timeout_ms)
+{
+    assert(lfr->flags & LFRING_FLAG_WAIT);
+    uint32_t actual;
+
+    for (int i = 0; i < WAIT_SPIN; i++) {
+        if ((actual = dequeue(lfr, elems, n_elems, index, false)))
+            return actual;
+    }
+    for (int pause = 1; pause <= WAIT_PAUSE_MAX; pause <<= 1) {
+        for (int i = 0; i < pause; i++)
+            spin_pause();
+        if ((actual = dequeue(lfr, elems, n_elems, index, false)))
+            return actual;
+    }
+
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+            deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+    }
+    for (;;) {
+        uint32_t seq = __atomic_load_n(&lfr->wait_seq, __ATOMIC_ACQUIRE);
+        /* Announce ourselves before the last look, see wake_consumers() */
+        __atomic_fetch_add(&lfr->n_waiters, 1, __ATOMIC_SEQ_CST);
+        actual = dequeue(lfr, elems, n_elems, index, false);
+        long ret = 0;
+        if (!actual)
+            ret = syscall(SYS_futex, &lfr->wait_seq,
+                          FUTEX_WAIT_BITSET_PRIVATE, seq,
+                          timeout_ms >= 0 ? &deadline : NULL, NULL,
+                          FUTEX_BITSET_MATCH_ANY);
+        __atomic_fetch_sub(&lfr->n_waiters, 1, __ATOMIC_RELAXED);
+        if (actual)
+            return actual;
+        if (ret == -1 && errno == ETIMEDOUT)
+            return dequeue(lfr, elems, n_elems, index, false);
+    }
+}
+
+uint32_t lfring_dequeue_bulk(lfring_t *lfr,
+                             void **restrict elems,
+                             uint32_t n_elems,
+                             uint32_t *index)
+{
+    return dequeue(lfr, elems, n_elems, index, true);
+}
+
+uint32_t lfring_dequeue_burst(lfring_t *lfr,
+                              void **restrict elems,
+                              uint32_t n_elems,
+                              uint32_t *index)
+{
+    return dequeue(lfr, elems, n_elems, index, false);
+}
+
+/* Zero-copy enqueue: the single producer owns the slots between tail and
+ * head + size, so they can be filled in place and released at once by
+ * moving tail.
+ */
+uint32_t lfring_enqueue_reserve(lfring_t *lfr,
+                                uint32_t n_elems,
+                                lfring_zc_t *zc)
+{
+    assert(lfr->flags & LFRING_FLAG_SP);
+    ringidx_t tail = __atomic_load_n(&lfr->tail, __ATOMIC_RELAXED);
+    intptr_t actual =
+        MIN((intptr_t)(enqueue_limit(lfr) - tail), (intptr_t) n_elems);
+    zc->index = tail;
+    zc->n_elems = actual > 0 ? (uint32_t) actual : 0;
+    return zc->n_elems;
+}
+
+void lfring_zc_store(lfring_t *lfr,
+                     const lfring_zc_t *zc,
+                     uint32_t i,
+                     void *elem)
+{
+    assert(i < zc->n_elems);
+    lfr->ring[(zc->index + i) & lfr->mask].ptr = elem;
+}
+
+void lfring_enqueue_commit(lfring_t *lfr,
+                           const lfring_zc_t *zc,
+                           uint32_t n_elems)
+{
+    assert(n_elems <= zc->n_elems);
+    for (uint32_t i = 0; i < n_elems; i++)
+        lfr->ring[(zc->index + i) & lfr->mask].idx = zc->index + i;
+    __atomic_store_n(&lfr->tail, zc->index + n_elems, __ATOMIC_RELEASE);
+    if (UNLIKELY(lfr->flags & LFRING_FLAG_WAIT) && n_elems != 0)
+        wake_consumers(lfr, n_elems);
+}
+
+/* Zero-copy dequeue: the single consumer reads the slots in place, and only
+ * gives them back to producers when it moves head on commit.
+ */
+uint32_t lfring_dequeue_reserve(lfring_t *lfr,
+                                uint32_t n_elems,
+                                lfring_zc_t *zc)
+{
+    assert(lfr->flags & LFRING_FLAG_SC);
+    ringidx_t head = __atomic_load_n(&lfr->head, __ATOMIC_RELAXED);
+    ringidx_t tail = __atomic_load_n(&lfr->tail, __ATOMIC_ACQUIRE);
+    if ((intptr_t)(tail - head) < (intptr_t) n_elems)
+        tail = find_tail(lfr, head, tail);
+    intptr_t actual = MIN((intptr_t)(tail - head), (intptr_t) n_elems);
+    zc->index = head;
+    zc->n_elems = actual > 0 ? (uint32_t) actual : 0;
+    return zc->n_elems;
+}
+
+void *lfring_zc_load(lfring_t *lfr, const lfring_zc_t *zc, uint32_t i)
+{
+    assert(i < zc->n_elems);
+    return lfr->ring[(zc->index + i) & lfr->mask].ptr;
+}
+
+void lfring_dequeue_commit(lfring_t *lfr,
+                           const lfring_zc_t *zc,
+                           uint32_t n_elems)
+{
+    assert(n_elems <= zc->n_elems);
+    /* Release: our reads of the slots are done before producers reuse them */
+    __atomic_store_n(&lfr->head, zc->index + n_elems, __ATOMIC_RELEASE);
+}
@@ -2,6 +2,7 @@
 
 #pragma once
 
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdint.h>
 
@@ -10,6 +11,21 @@ enum {
     LFRING_FLAG_SP = 0x0001 /* Single producer */,
     LFRING_FLAG_MC = 0x0000 /* Multi consumer */,
     LFRING_FLAG_SC = 0x0002 /* Single consumer */,
+    /* Multiple producers reserving a whole batch of slots with a single CAS,
+     * instead of one CAS per element. Producers no longer are lock-free: a
+     * producer stalled between reserving and writing its slots holds back
+     * consumers (but not other producers) until it resumes.
+     */
+    LFRING_FLAG_MP_BATCH = 0x0004,
+    /* Let consumers sleep in lfring_dequeue_wait(). Producers then pay for a
+     * full fence per enqueue call, and a futex wake while anyone sleeps.
+     */
+    LFRING_FLAG_WAIT = 0x0008,
+    /* Use every slot once: the ring takes as many elements as it has slots
+     * over its lifetime, then stays closed to producers even once consumers
+     * drain it. Segments of the unbounded lfchain queue are such rings.
+     */
+    LFRING_FLAG_ONCE = 0x0010,
 };
 
 typedef struct lfring lfring_t;
@@ -24,6 +40,11 @@ lfring_t *lfring_alloc(uint32_t n_elems, uint32_t flags);
  */
 void lfring_free(lfring_t *lfr);
 
+/* True once a LFRING_FLAG_ONCE ring has taken and given out all the elements
+ * it ever will.
+ */
+bool lfring_exhausted(lfring_t *lfr);
+
 /* Enqueue elements on ring buffer.
  * The number of actually enqueued elements is returned.
  */
@@ -36,3 +57,64 @@ uint32_t lfring_dequeue(lfring_t *lfr,
                         void *elems[],
                         uint32_t n_elems,
                         uint32_t *index);
+
+/* Dequeue like lfring_dequeue, but wait for at least one element if the ring
+ * is empty: spin, then back off with pause, then sleep on a futex until a
+ * producer releases elements. Give up after 'timeout_ms' milliseconds and
+ * return 0, or never if it is negative. Needs LFRING_FLAG_WAIT.
+ */
+uint32_t lfring_dequeue_wait(lfring_t *lfr,
+                             void *elems[],
+                             uint32_t n_elems,
+                             uint32_t *index,
+                             int timeout_ms);
+
+/* Bulk and burst variants, as in DPDK rte_ring.
+ * Bulk calls move all 'n_elems' elements or none, returning 'n_elems' or 0.
+ * Burst calls move as many as possible, like lfring_enqueue/lfring_dequeue.
+ * Bulk enqueue needs a single producer or LFRING_FLAG_MP_BATCH: lock-free
+ * producers claim slots one by one and cannot back out of a partial batch.
+ */
+uint32_t lfring_enqueue_bulk(lfring_t *lfr,
+                             void *const elems[],
+                             uint32_t n_elems);
+uint32_t lfring_enqueue_burst(lfring_t *lfr,
+                              void *const elems[],
+                              uint32_t n_elems);
+uint32_t lfring_dequeue_bulk(lfring_t *lfr,
+                             void *elems[],
+                             uint32_t n_elems,
+                             uint32_t *index);
+uint32_t lfring_dequeue_burst(lfring_t *lfr,
+                              void *elems[],
+                              uint32_t n_elems,
+                              uint32_t *index);
+
+/* Zero-copy access, for a single producer or a single consumer.
+ * Reserve up to 'n_elems' slots, access them in place through the returned
+ * range, then commit the first 'n_elems' (up to the reserved count) of them.
+ * Only one range may be reserved on each side at a time.
+ */
+typedef struct {
+    uintptr_t index; /* ring index of the first slot */
+    uint32_t n_elems;
+} lfring_zc_t;
+
+uint32_t lfring_enqueue_reserve(lfring_t *lfr,
+                                uint32_t n_elems,
+                                lfring_zc_t *zc);
+void lfring_zc_store(lfring_t *lfr,
+                     const lfring_zc_t *zc,
+                     uint32_t i,
+                     void *elem);
+void lfring_enqueue_commit(lfring_t *lfr,
+                           const lfring_zc_t *zc,
+                           uint32_t n_elems);
+
+uint32_t lfring_dequeue_reserve(lfring_t *lfr,
+                                uint32_t n_elems,
+                                lfring_zc_t *zc);
+void *lfring_zc_load(lfring_t *lfr, const lfring_zc_t *zc, uint32_t i);
+void lfring_dequeue_commit(lfring_t *lfr,
+                           const lfring_zc_t *zc,
+                           uint32_t n_elems);
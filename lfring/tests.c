@@ -1,7 +1,13 @@
+#include <pthread.h>
+#include <sched.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <unistd.h>
 
+#include "lfchain.h"
 #include "lfring.h"
+#include "qsbr.h"
 
 #define EX_HASHSTR(s) #s
 #define EX_STR(s) EX_HASHSTR(s)
@@ -52,6 +58,281 @@ static void test_ringbuffer(uint32_t flags)
     lfring_free(rb);
 }
 
+#define BATCH 32
+
+static void test_bulk_burst(uint32_t flags)
+{
+    void *in[BATCH], *out[BATCH];
+    uint32_t ret;
+    uint32_t idx;
+
+    for (uintptr_t i = 0; i < BATCH; i++)
+        in[i] = (void *) (i + 1);
+
+    lfring_t *rb = lfring_alloc(2 * BATCH, flags);
+    EXPECT(rb != NULL);
+
+    ret = lfring_dequeue_bulk(rb, out, 1, &idx);
+    EXPECT(ret == 0);
+    ret = lfring_enqueue_burst(rb, in, BATCH);
+    EXPECT(ret == BATCH);
+    ret = lfring_enqueue_burst(rb, in, BATCH - 1);
+    EXPECT(ret == BATCH - 1);
+
+    /* One slot left: bulk refuses, burst takes what fits */
+    if (flags & (LFRING_FLAG_SP | LFRING_FLAG_MP_BATCH)) {
+        ret = lfring_enqueue_bulk(rb, in, 2);
+        EXPECT(ret == 0);
+    }
+    ret = lfring_enqueue_burst(rb, in, 2);
+    EXPECT(ret == 1);
+
+    ret = lfring_dequeue_bulk(rb, out, BATCH, &idx);
+    EXPECT(ret == BATCH);
+    EXPECT(idx == 0);
+    for (uint32_t i = 0; i < BATCH; i++)
+        EXPECT(out[i] == in[i]);
+
+    ret = lfring_dequeue_bulk(rb, out, BATCH + 1, &idx);
+    EXPECT(ret == 0);
+    ret = lfring_dequeue_burst(rb, out, BATCH + 1, &idx);
+    EXPECT(ret == BATCH);
+    EXPECT(idx == BATCH);
+    EXPECT(out[BATCH - 2] == in[BATCH - 2]);
+    EXPECT(out[BATCH - 1] == in[0]);
+
+    lfring_free(rb);
+}
+
+static void test_zero_copy(void)
+{
+    lfring_zc_t zc;
+    uint32_t ret;
+
+    lfring_t *rb = lfring_alloc(BATCH, LFRING_FLAG_SP | LFRING_FLAG_SC);
+    EXPECT(rb != NULL);
+
+    ret = lfring_dequeue_reserve(rb, 1, &zc);
+    EXPECT(ret == 0);
+
+    ret = lfring_enqueue_reserve(rb, BATCH + 1, &zc);
+    EXPECT(ret == BATCH);
+    for (uintptr_t i = 0; i < ret; i++)
+        lfring_zc_store(rb, &zc, i, (void *) (i + 1));
+    lfring_enqueue_commit(rb, &zc, BATCH / 2);
+
+    ret = lfring_enqueue_reserve(rb, BATCH, &zc);
+    EXPECT(ret == BATCH / 2);
+    EXPECT(zc.index == BATCH / 2);
+
+    ret = lfring_dequeue_reserve(rb, BATCH, &zc);
+    EXPECT(ret == BATCH / 2);
+    EXPECT(zc.index == 0);
+    for (uintptr_t i = 0; i < ret; i++)
+        EXPECT(lfring_zc_load(rb, &zc, i) == (void *) (i + 1));
+    lfring_dequeue_commit(rb, &zc, ret);
+
+    ret = lfring_dequeue_reserve(rb, 1, &zc);
+    EXPECT(ret == 0);
+
+    lfring_free(rb);
+}
+
+/* Several producers pushing batches of BATCH elements, one consumer */
+#define N_PRODUCERS 4
+#define N_BATCHES 2000
+
+static lfring_t *stress_rb;
+
+static void *producer(void *arg)
+{
+    uintptr_t id = (uintptr_t) arg;
+    void *batch[BATCH];
+
+    for (uint32_t b = 0; b < N_BATCHES; b++) {
+        for (uint32_t i = 0; i < BATCH; i++)
+            batch[i] = (void *) (id << 32 | (b * BATCH + i));
+        while (lfring_enqueue_bulk(stress_rb, batch, BATCH) == 0)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void test_mp_batch(void)
+{
+    pthread_t tid[N_PRODUCERS];
+    uint64_t next[N_PRODUCERS] = {0};
+    uint64_t total = 0;
+    void *out[BATCH];
+    uint32_t idx;
+
+    stress_rb = lfring_alloc(4 * BATCH, LFRING_FLAG_MP_BATCH | LFRING_FLAG_SC);
+    EXPECT(stress_rb != NULL);
+    for (uintptr_t i = 0; i < N_PRODUCERS; i++)
+        pthread_create(&tid[i], NULL, producer, (void *) i);
+
+    while (total < (uint64_t) N_PRODUCERS * N_BATCHES * BATCH) {
+        uint32_t n = lfring_dequeue_burst(stress_rb, out, BATCH, &idx);
+        if (n == 0)
+            sched_yield();
+        for (uint32_t i = 0; i < n; i++) {
+            uintptr_t v = (uintptr_t) out[i];
+            /* Elements of each producer come out in order */
+            EXPECT((v & 0xffffffff) == next[v >> 32]);
+            next[v >> 32]++;
+        }
+        total += n;
+    }
+
+    for (int i = 0; i < N_PRODUCERS; i++)
+        pthread_join(tid[i], NULL);
+    lfring_free(stress_rb);
+}
+
+/* A bursty producer, with idle gaps long enough for the consumer to sleep */
+#define N_BURSTS 20
+
+static lfring_t *wait_rb;
+
+static void *bursty_producer(void *arg)
+{
+    (void) arg;
+    for (uintptr_t b = 0; b < N_BURSTS; b++) {
+        usleep(2000);
+        for (uintptr_t i = 0; i < BATCH; i++)
+            while (lfring_enqueue(wait_rb, (void *[]){(void *) i}, 1) == 0)
+                sched_yield();
+    }
+    return NULL;
+}
+
+static void test_wait(uint32_t flags)
+{
+    void *out[BATCH];
+    uint32_t idx, total = 0;
+    pthread_t tid;
+
+    wait_rb = lfring_alloc(2 * BATCH, flags | LFRING_FLAG_WAIT);
+    EXPECT(wait_rb != NULL);
+
+    /* Times out on an empty ring */
+    EXPECT(lfring_dequeue_wait(wait_rb, out, 1, &idx, 10) == 0);
+
+    pthread_create(&tid, NULL, bursty_producer, NULL);
+    while (total < N_BURSTS * BATCH) {
+        uint32_t n = lfring_dequeue_wait(wait_rb, out, BATCH, &idx, -1);
+        EXPECT(n != 0);
+        for (uint32_t i = 0; i < n; i++)
+            EXPECT((uintptr_t) out[i] == (total + i) % BATCH);
+        total += n;
+    }
+    pthread_join(tid, NULL);
+    lfring_free(wait_rb);
+}
+
+static void test_chain_fifo(void)
+{
+    void *in[BATCH], *out[BATCH];
+    uintptr_t next_in = 0, next_out = 0;
+
+    lfchain_t *q = lfchain_alloc(4, 0);
+    EXPECT(q != NULL);
+    qsbr_tls_t *t = lfchain_register(q);
+    EXPECT(t != NULL);
+
+    EXPECT(lfchain_dequeue(q, t, out, 1) == 0);
+
+    /* Many segments' worth of elements, in and out in uneven batches */
+    for (uint32_t round = 1; round <= BATCH; round++) {
+        for (uint32_t i = 0; i < round; i++)
+            in[i] = (void *) ++next_in;
+        EXPECT(lfchain_enqueue(q, t, in, round) == round);
+        uint32_t n = lfchain_dequeue(q, t, out, (round + 1) / 2);
+        EXPECT(n == (round + 1) / 2);
+        for (uint32_t i = 0; i < n; i++)
+            EXPECT(out[i] == (void *) ++next_out);
+    }
+    EXPECT(lfchain_segments(q) > 1);
+
+    uint32_t n;
+    while ((n = lfchain_dequeue(q, t, out, BATCH)) != 0) {
+        for (uint32_t i = 0; i < n; i++)
+            EXPECT(out[i] == (void *) ++next_out);
+    }
+    EXPECT(next_out == next_in);
+
+    lfchain_unregister(t);
+    lfchain_free(q);
+}
+
+/* Producers and consumers crossing many small segments */
+#define N_CHAIN_CONSUMERS 2
+#define N_CHAIN_ELEMS 20000
+
+static lfchain_t *chain;
+static uint64_t chain_sum, chain_total;
+
+static void *chain_producer(void *arg)
+{
+    uintptr_t id = (uintptr_t) arg;
+    qsbr_tls_t *t = lfchain_register(chain);
+    void *batch[BATCH];
+
+    for (uintptr_t v = 1; v <= N_CHAIN_ELEMS; v += BATCH) {
+        uint32_t n = 0;
+        for (; n < BATCH && v + n <= N_CHAIN_ELEMS; n++)
+            batch[n] = (void *) (id << 32 | (v + n));
+        EXPECT(lfchain_enqueue(chain, t, batch, n) == n);
+    }
+    lfchain_unregister(t);
+    return NULL;
+}
+
+static void *chain_consumer(void *arg)
+{
+    (void) arg;
+    qsbr_tls_t *t = lfchain_register(chain);
+    void *out[BATCH];
+    uint64_t expected = (uint64_t) N_PRODUCERS * N_CHAIN_ELEMS;
+
+    while (__atomic_load_n(&chain_total, __ATOMIC_RELAXED) < expected) {
+        uint32_t n = lfchain_dequeue(chain, t, out, BATCH);
+        if (n == 0) {
+            sched_yield();
+            continue;
+        }
+        uint64_t sum = 0;
+        for (uint32_t i = 0; i < n; i++)
+            sum += (uintptr_t) out[i] & 0xffffffff;
+        __atomic_fetch_add(&chain_sum, sum, __ATOMIC_RELAXED);
+        __atomic_fetch_add(&chain_total, n, __ATOMIC_RELAXED);
+    }
+    lfchain_unregister(t);
+    return NULL;
+}
+
+static void test_chain_mpmc(void)
+{
+    pthread_t prod[N_PRODUCERS], cons[N_CHAIN_CONSUMERS];
+
+    chain = lfchain_alloc(64, 0);
+    EXPECT(chain != NULL);
+    for (uintptr_t i = 0; i < N_CHAIN_CONSUMERS; i++)
+        pthread_create(&cons[i], NULL, chain_consumer, NULL);
+    for (uintptr_t i = 0; i < N_PRODUCERS; i++)
+        pthread_create(&prod[i], NULL, chain_producer, (void *) i);
+    for (int i = 0; i < N_PRODUCERS; i++)
+        pthread_join(prod[i], NULL);
+    for (int i = 0; i < N_CHAIN_CONSUMERS; i++)
+        pthread_join(cons[i], NULL);
+
+    /* Every element came out once */
+    EXPECT(chain_total == (uint64_t) N_PRODUCERS * N_CHAIN_ELEMS);
+    EXPECT(chain_sum == (uint64_t) N_PRODUCERS * N_CHAIN_ELEMS *
+                            (N_CHAIN_ELEMS + 1) / 2);
+    lfchain_free(chain);
+}
+
 int main(void)
 {
     printf("testing MPMC lock-free ring\n");
@@ -66,5 +347,27 @@ int main(void)
     printf("testing SPSC lock-free ring\n");
     test_ringbuffer(LFRING_FLAG_SP | LFRING_FLAG_SC);
 
+    printf("testing bulk and burst calls\n");
+    test_bulk_burst(LFRING_FLAG_MP | LFRING_FLAG_MC);
+    test_bulk_burst(LFRING_FLAG_MP_BATCH | LFRING_FLAG_MC);
+    test_bulk_burst(LFRING_FLAG_MP_BATCH | LFRING_FLAG_SC);
+    test_bulk_burst(LFRING_FLAG_SP | LFRING_FLAG_MC);
+    test_bulk_burst(LFRING_FLAG_SP | LFRING_FLAG_SC);
+
+    printf("testing zero-copy SPSC ring\n");
+    test_zero_copy();
+
+    printf("testing batched multi-producer ring\n");
+    test_mp_batch();
+
+    printf("testing blocking consumers\n");
+    test_wait(LFRING_FLAG_MP | LFRING_FLAG_MC);
+    test_wait(LFRING_FLAG_MP_BATCH | LFRING_FLAG_SC);
+    test_wait(LFRING_FLAG_SP | LFRING_FLAG_SC);
+
+    printf("testing unbounded queue of segments\n");
+    test_chain_fifo();
+    test_chain_mpmc();
+
     return 0;
 }
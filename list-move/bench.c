@@ -1,6 +1,21 @@
+/* List move benchmark
+ *
+ * Sweeps a matrix of thread counts, key ranges, move percentages and batch
+ * sizes, given on the command line or in a config file. Every point of the
+ * matrix runs a warmup then several trials on a fresh pair of lists, and is
+ * printed as a CSV line with the mean throughput, its standard deviation and
+ * latency percentiles.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <math.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
-#include <sys/time.h>
+#include <string.h>
+#include <time.h>
 #include <unistd.h>
 
 #include "bench.h"
@@ -26,124 +41,429 @@ static void barrier_cross(barrier_t *b)
     pthread_mutex_unlock(&b->mutex);
 }
 
-#define DEFAULT_DURATION 1000
+#define DEFAULT_DURATION 1000 /* ms */
+#define DEFAULT_WARMUP 200    /* ms */
+#define DEFAULT_TRIALS 3
 #define DEFAULT_NTHREADS 64
-#define DEFAULT_ISIZE 256
 #define DEFAULT_VRANGE 512
+#define DEFAULT_BATCH 16
+#define MAX_BATCH 64
+#define MAX_VALUES 32 /* per dimension of the matrix */
 
-static volatile bool should_stop = false;
+/* Log-linear latency histogram: values below LAT_SUB ns have their own
+ * bucket, then every power of two is split into LAT_SUB buckets, which keeps
+ * the percentiles within 1/LAT_SUB of the measured latency.
+ */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
 
-static void *bench_thread(void *data)
+static inline int lat_bucket(uint64_t ns)
 {
-    pthread_data_t *d = (pthread_data_t *) data;
+    if (ns < LAT_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
 
-    barrier_cross(d->barrier);
-    while (!should_stop) {
-        int from = rand_r(&d->seed) & 0x1;
-        int key = rand_r(&d->seed) % d->range;
-        list_move(key, d, from);
-        d->n_move++;
-    }
+/* Lowest latency that falls in bucket "b" */
+static uint64_t lat_value(int b)
+{
+    if (b < LAT_SUB)
+        return b;
+    int shift = b / LAT_SUB - 1;
+    return (uint64_t) (LAT_SUB + b % LAT_SUB) << shift;
+}
 
-    return NULL;
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t) ceil(total * p), seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen)
+            return lat_value(b);
+    }
+    return 0;
 }
 
-int main(void)
+static inline uint64_t now_ns(void)
 {
-    int duration = DEFAULT_DURATION;
-    int n_threads = DEFAULT_NTHREADS;
-    int init_size = DEFAULT_ISIZE;
-    int value_range = DEFAULT_VRANGE;
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
 
-    printf("List move benchmark\n");
-    printf("Test time:     %d\n", duration);
-    printf("Thread number: %d\n", n_threads);
-    printf("Initial size:  %d\n", init_size);
-    printf("Value range:   %d\n", value_range);
+typedef struct {
+    int n;
+    int v[MAX_VALUES];
+} values_t;
 
-    struct timespec timeout = {.tv_sec = duration / 1000,
-                               .tv_nsec = (duration % 1000) * 1000000};
+typedef struct {
+    values_t threads, ranges, move_pcts, batches;
+    int duration, warmup, trials;
+    int pin;
+} config_t;
 
-    pthread_t *threads;
-    if (!(threads = malloc(n_threads * sizeof(pthread_t)))) {
-        printf("Failed to allocate pthread_t\n");
-        goto out;
-    }
+static _Atomic bool should_stop = false;
 
-    pthread_data_t **data;
-    if (!(data = malloc(n_threads * sizeof(pthread_data_t *)))) {
-        printf("Failed to allocate pthread_data_t\n");
-        goto out;
+static int int_cmp(const void *a, const void *b)
+{
+    int x = *(const int *) a, y = *(const int *) b;
+    return (x > y) - (x < y);
+}
+
+static void *bench_thread(void *data)
+{
+    pthread_data_t *d = (pthread_data_t *) data;
+    int keys[MAX_BATCH];
+
+    if (d->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(d->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
     }
-    for (int i = 0; i < n_threads; i++) {
-        if ((data[i] = alloc_pthread_data()) == NULL) {
-            printf("Failed to allocate pthread_data_t %d\n", i);
-            goto out;
+
+    barrier_cross(d->barrier);
+    while (!should_stop) {
+        int from = rand_r(&d->seed) & 0x1;
+        bool move = (int) (rand_r(&d->seed) % 100) < d->move_pct;
+        int n = 1;
+        uint64_t start;
+
+        if (!move) {
+            int key = rand_r(&d->seed) % d->range;
+            start = now_ns();
+            list_contains(key, d, from);
+        } else if (!d->batch) {
+            int key = rand_r(&d->seed) % d->range;
+            start = now_ns();
+            list_move(key, d, from);
+        } else {
+            n = d->batch;
+            for (int i = 0; i < n; i++)
+                keys[i] = rand_r(&d->seed) % d->range;
+            qsort(keys, n, sizeof(int), int_cmp);
+            start = now_ns();
+            list_move_batch(keys, n, d, from);
         }
+        /* A batch counts as that many operations of the average latency */
+        d->lat[lat_bucket((now_ns() - start) / n)] += n;
+        d->n_ops += n;
     }
 
-    srand(getpid() ^ (uintptr_t) main);
+    return NULL;
+}
 
-    void *list;
-    if (!(list = list_global_init(init_size, value_range))) {
-        printf("Failed to do list_global_init\n");
-        goto out;
-    }
+/* Run every thread for "duration" ms, and return the operations per second
+ * or a negative value on failure.
+ */
+static double run_trial(pthread_t *threads,
+                        pthread_data_t **data,
+                        int n_threads,
+                        int duration)
+{
+    struct timespec timeout = {.tv_sec = duration / 1000,
+                               .tv_nsec = (duration % 1000) * 1000000};
 
     barrier_t barrier;
     pthread_attr_t attr;
     barrier_init(&barrier, n_threads + 1);
     pthread_attr_init(&attr);
     pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_JOINABLE);
+    should_stop = false;
     for (int i = 0; i < n_threads; i++) {
-        data[i]->id = i;
-        data[i]->n_move = 0;
-        data[i]->range = value_range;
-        data[i]->seed = rand();
+        data[i]->n_ops = 0;
+        memset(data[i]->lat, 0, LAT_BUCKETS * sizeof(uint64_t));
         data[i]->barrier = &barrier;
-        data[i]->list = list;
-        if (list_thread_init(data[i])) {
-            printf("Failed to do list_thread_init\n");
-            goto out;
-        }
         if (pthread_create(&threads[i], &attr, bench_thread,
                            (void *) (data[i])) != 0) {
-            printf("Failed to create thread %d\n", i);
-            goto out;
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return -1;
         }
     }
     pthread_attr_destroy(&attr);
 
     barrier_cross(&barrier);
 
-    struct timeval start, end;
-    gettimeofday(&start, NULL);
+    uint64_t start = now_ns();
     nanosleep(&timeout, NULL);
     should_stop = true;
-    gettimeofday(&end, NULL);
+    uint64_t end = now_ns();
 
     for (int i = 0; i < n_threads; i++) {
         if (pthread_join(threads[i], NULL) != 0) {
-            printf("Failed to join child thread %d\n", i);
-            goto out;
+            fprintf(stderr, "Failed to join child thread %d\n", i);
+            return -1;
         }
     }
 
-    duration = (end.tv_sec * 1000 + end.tv_usec / 1000) -
-               (start.tv_sec * 1000 + start.tv_usec / 1000);
-    unsigned long n_move = 0;
+    unsigned long n_ops = 0;
     for (int i = 0; i < n_threads; i++)
-        n_move += (data[i]->n_move);
+        n_ops += data[i]->n_ops;
+    return n_ops * 1e9 / (end - start);
+}
 
-    printf("\tduration:     %d ms\n", duration);
-    printf("\tops/second    %f/s\n", n_move * (1000.0) / duration);
+/* Run one point of the matrix on fresh lists, and print its CSV line */
+static int run_point(const config_t *cfg,
+                     int n_threads,
+                     int range,
+                     int move_pct,
+                     int batch)
+{
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    pthread_data_t **data = calloc(n_threads, sizeof(pthread_data_t *));
+    uint64_t *hist = calloc(LAT_BUCKETS, sizeof(uint64_t));
+    double *mops = calloc(cfg->trials, sizeof(double));
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    void *list = NULL;
+    int ret = -1;
 
-    for (int i = 0; i < n_threads; i++)
+    if (!threads || !data || !hist || !mops) {
+        fprintf(stderr, "Failed to allocate the benchmark data\n");
+        goto out;
+    }
+    /* Half of the keys start in each list, the other half are missing */
+    if (!(list = list_global_init(range / 2, range))) {
+        fprintf(stderr, "Failed to do list_global_init\n");
+        goto out;
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        if ((data[i] = alloc_pthread_data()) == NULL ||
+            !(data[i]->lat = malloc(LAT_BUCKETS * sizeof(uint64_t)))) {
+            fprintf(stderr, "Failed to allocate pthread_data_t %d\n", i);
+            goto out;
+        }
+        data[i]->id = i;
+        data[i]->range = range;
+        data[i]->batch = batch;
+        data[i]->move_pct = move_pct;
+        data[i]->cpu = cfg->pin ? i % n_cpus : -1;
+        data[i]->seed = rand();
+        data[i]->list = list;
+        if (list_thread_init(data[i])) {
+            fprintf(stderr, "Failed to do list_thread_init\n");
+            goto out;
+        }
+    }
+
+    if (cfg->warmup && run_trial(threads, data, n_threads, cfg->warmup) < 0)
+        goto out;
+    for (int t = 0; t < cfg->trials; t++) {
+        double ops = run_trial(threads, data, n_threads, cfg->duration);
+        if (ops < 0)
+            goto out;
+        mops[t] = ops / 1e6;
+        for (int i = 0; i < n_threads; i++) {
+            for (int b = 0; b < LAT_BUCKETS; b++)
+                hist[b] += data[i]->lat[b];
+        }
+    }
+
+    double mean = 0, var = 0;
+    for (int t = 0; t < cfg->trials; t++)
+        mean += mops[t];
+    mean /= cfg->trials;
+    for (int t = 0; t < cfg->trials; t++)
+        var += (mops[t] - mean) * (mops[t] - mean);
+    if (cfg->trials > 1)
+        var /= cfg->trials - 1;
+
+    uint64_t total = 0;
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+
+    printf("%s,%d,%d,%d,%d,%d,%.3f,%.3f,%lu,%lu,%lu,%lu\n", list_name,
+           n_threads, range, move_pct, batch, cfg->trials, mean, sqrt(var),
+           lat_percentile(hist, total, 0.5), lat_percentile(hist, total, 0.9),
+           lat_percentile(hist, total, 0.99),
+           lat_percentile(hist, total, 0.999));
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (int i = 0; i < n_threads && data && data[i]; i++) {
+        free(data[i]->lat);
         free_pthread_data(data[i]);
-    list_global_exit(list);
+    }
+    if (list)
+        list_global_exit(list);
+    free(mops);
+    free(hist);
     free(data);
     free(threads);
+    return ret;
+}
 
-out:
+/* Parse a comma separated list of positive integers, or of percentages */
+static int parse_values(values_t *values, const char *s, int min, int max)
+{
+    char *end;
+
+    values->n = 0;
+    do {
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (errno || end == s || v < min || v > max ||
+            values->n == MAX_VALUES)
+            return -1;
+        values->v[values->n++] = v;
+        s = end + 1;
+    } while (*end == ',');
+
+    return *end ? -1 : 0;
+}
+
+static int parse_int(int *value, const char *s, int min)
+{
+    values_t values;
+
+    if (parse_values(&values, s, min, INT_MAX) || values.n != 1)
+        return -1;
+    *value = values.v[0];
+    return 0;
+}
+
+/* Set the option "opt", from the command line or a config file */
+static int set_option(config_t *cfg, int opt, const char *arg)
+{
+    switch (opt) {
+    case 't':
+        return parse_values(&cfg->threads, arg, 1, INT_MAX);
+    case 'r':
+        return parse_values(&cfg->ranges, arg, 2, INT_MAX);
+    case 'm':
+        return parse_values(&cfg->move_pcts, arg, 0, 100);
+    case 'b':
+        return parse_values(&cfg->batches, arg, 0, MAX_BATCH);
+    case 'd':
+        return parse_int(&cfg->duration, arg, 1);
+    case 'w':
+        return parse_int(&cfg->warmup, arg, 0);
+    case 'n':
+        return parse_int(&cfg->trials, arg, 1);
+    case 'p':
+        return parse_int(&cfg->pin, arg, 0);
+    }
+    return -1;
+}
+
+static const struct {
+    const char *name;
+    int opt;
+} config_keys[] = {
+    {"threads", 't'}, {"range", 'r'},  {"move", 'm'},   {"batch", 'b'},
+    {"duration", 'd'}, {"warmup", 'w'}, {"trials", 'n'}, {"pin", 'p'},
+};
+
+/* Read "key = value" lines, with the keys above and '#' comments */
+static int load_config(config_t *cfg, const char *path)
+{
+    FILE *f = fopen(path, "r");
+    char line[256], key[32], value[200];
+    int lineno = 0;
+
+    if (!f) {
+        perror(path);
+        return -1;
+    }
+    while (fgets(line, sizeof(line), f)) {
+        lineno++;
+        char *comment = strchr(line, '#');
+        if (comment)
+            *comment = '\0';
+        if (sscanf(line, " %31[a-z] = %199s", key, value) != 2) {
+            if (strspn(line, " \t\r\n") == strlen(line))
+                continue;
+            goto bad;
+        }
+
+        size_t k;
+        for (k = 0; k < sizeof(config_keys) / sizeof(config_keys[0]); k++) {
+            if (!strcmp(key, config_keys[k].name))
+                break;
+        }
+        if (k == sizeof(config_keys) / sizeof(config_keys[0]) ||
+            set_option(cfg, config_keys[k].opt, value))
+            goto bad;
+    }
+    fclose(f);
     return 0;
+
+bad:
+    fprintf(stderr, "%s:%d: invalid line\n", path, lineno);
+    fclose(f);
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-c config] [-t threads] [-r range] [-m move%%]\n"
+            "       [-b batch] [-d ms] [-w ms] [-n trials] [-P] [-H]\n"
+            "  -t, -r, -m and -b take comma separated lists, the benchmark\n"
+            "  runs every combination of them. A batch of 0 moves the keys\n"
+            "  one by one, and the operations that are not moves are\n"
+            "  lookups. -P leaves the threads unpinned, -H omits the CSV\n"
+            "  header. The config file keys are threads, range, move, batch,\n"
+            "  duration, warmup, trials and pin.\n",
+            prog);
+}
+
+int main(int argc, char *argv[])
+{
+    config_t cfg = {
+        .threads = {1, {DEFAULT_NTHREADS}},
+        .ranges = {1, {DEFAULT_VRANGE}},
+        .move_pcts = {1, {100}},
+        .batches = {2, {0, DEFAULT_BATCH}},
+        .duration = DEFAULT_DURATION,
+        .warmup = DEFAULT_WARMUP,
+        .trials = DEFAULT_TRIALS,
+        .pin = 1,
+    };
+    bool header = true;
+    int opt;
+
+    /* The config file is read first, the other options override it */
+    while ((opt = getopt(argc, argv, "c:t:r:m:b:d:w:n:PH")) != -1) {
+        if (opt == 'c' && load_config(&cfg, optarg))
+            return EXIT_FAILURE;
+        if (opt == '?') {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+    optind = 1;
+    while ((opt = getopt(argc, argv, "c:t:r:m:b:d:w:n:PH")) != -1) {
+        if (opt == 'c')
+            continue;
+        if (opt == 'P')
+            cfg.pin = 0;
+        else if (opt == 'H')
+            header = false;
+        else if (set_option(&cfg, opt, optarg)) {
+            fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    srand(getpid() ^ (uintptr_t) main);
+
+    if (header)
+        printf("impl,threads,range,move_pct,batch,trials,mops_mean,"
+               "mops_stddev,p50_ns,p90_ns,p99_ns,p999_ns\n");
+    for (int t = 0; t < cfg.threads.n; t++)
+        for (int r = 0; r < cfg.ranges.n; r++)
+            for (int m = 0; m < cfg.move_pcts.n; m++)
+                for (int b = 0; b < cfg.batches.n; b++) {
+                    if (run_point(&cfg, cfg.threads.v[t], cfg.ranges.v[r],
+                                  cfg.move_pcts.v[m], cfg.batches.v[b]))
+                        return EXIT_FAILURE;
+                }
+
+    return EXIT_SUCCESS;
 }
@@ -3,6 +3,7 @@
 
 #include <limits.h>
 #include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -20,14 +21,21 @@ typedef struct {
 typedef struct {
     long pthread_padding[PTHREAD_PADDING];
     long id;
-    unsigned long n_move;
+    unsigned long n_ops;
     int range;
+    int batch;    /* keys per list_move_batch(), or 0 for list_move() */
+    int move_pct; /* moves among the operations, the rest are lookups */
+    int cpu;      /* to pin the thread on, or -1 */
     unsigned int seed;
+    uint64_t *lat; /* latency histogram, see bench.c */
     barrier_t *barrier;
     void *list;
     void *ds_data; /* data structure specific data */
 } pthread_data_t;
 
+/* Name of the implementation, for the benchmark output */
+extern const char *list_name;
+
 pthread_data_t *alloc_pthread_data(void);
 
 void free_pthread_data(pthread_data_t *d);
@@ -36,4 +44,12 @@ int list_thread_init(pthread_data_t *data);
 void list_global_exit(void *list);
 int list_move(int key, pthread_data_t *data, int from);
 
+/* Return 1 if "key" is in list "which" */
+int list_contains(int key, pthread_data_t *data, int which);
+
+/* Move the "n" keys, in ascending order, from list "from" to the other one in
+ * a single pass. Return the number of keys moved.
+ */
+int list_move_batch(const int *keys, int n, pthread_data_t *data, int from);
+
 #endif
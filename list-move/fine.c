@@ -0,0 +1,275 @@
+#include <stdatomic.h>
+#include <stdbool.h>
+
+#include "bench.h"
+
+/* Per-node optimistic locking
+ *
+ * Every node has a version, which is odd while the node is locked. The
+ * traversals take no lock: they read the version of a node before following
+ * its link, and check that it did not change once they hold the version of
+ * the next node (optimistic lock coupling). A move then locks the node, its
+ * predecessor in the source list and its new predecessor in the destination
+ * list by bumping their versions from the values seen during the traversals,
+ * which also validates that none of them changed meanwhile.
+ *
+ * Nodes only move between the lists and are never freed, so a traversal that
+ * went astray is simply restarted.
+ */
+
+#if defined(__x86_64__) || defined(__i386__)
+#define cpu_relax() __asm__ __volatile__("pause" ::: "memory")
+#else
+#define cpu_relax() __asm__ __volatile__("" ::: "memory")
+#endif
+
+typedef struct node {
+    int val;
+    atomic_uint version;
+    struct node *_Atomic next;
+} node_t;
+
+typedef struct {
+    node_t *head[2];
+} fine_list_t;
+
+const char *list_name = "fine";
+
+/* A node of a list along with its version, from where a traversal resumes */
+typedef struct {
+    node_t *node;
+    unsigned int version;
+} cursor_t;
+
+static inline unsigned int node_read_begin(node_t *node)
+{
+    unsigned int v;
+
+    while ((v = atomic_load_explicit(&node->version, memory_order_acquire)) &
+           1)
+        cpu_relax();
+    return v;
+}
+
+/* The links are loaded with acquire, which keeps this load after them */
+static inline bool node_read_validate(node_t *node, unsigned int v)
+{
+    return atomic_load_explicit(&node->version, memory_order_relaxed) == v;
+}
+
+static inline bool node_try_lock(node_t *node, unsigned int v)
+{
+    return atomic_compare_exchange_strong(&node->version, &v, v + 1);
+}
+
+static inline void node_unlock(node_t *node)
+{
+    atomic_fetch_add_explicit(&node->version, 1, memory_order_release);
+}
+
+static inline node_t *node_next(node_t *node)
+{
+    return atomic_load_explicit(&node->next, memory_order_acquire);
+}
+
+static inline void node_set_next(node_t *node, node_t *next)
+{
+    atomic_store_explicit(&node->next, next, memory_order_relaxed);
+}
+
+/* Walk from "prev" to the first node not lower than "key", into "cur". The
+ * cursors hold the versions they were validated with. Return false if the
+ * walk has to start over.
+ */
+static bool list_find(cursor_t *prev, cursor_t *cur, int key)
+{
+    cursor_t p = *prev, c;
+
+    while (1) {
+        c.node = node_next(p.node);
+        c.version = node_read_begin(c.node);
+        if (!node_read_validate(p.node, p.version))
+            return false;
+        if (c.node->val >= key)
+            break;
+        p = c;
+    }
+    *prev = p;
+    *cur = c;
+    return true;
+}
+
+static inline void cursor_reset(cursor_t *cursor, node_t *head)
+{
+    cursor->node = head;
+    cursor->version = node_read_begin(head);
+}
+
+/* Move "key" with the traversals resumed from "src" and "dst", which are left
+ * on the nodes before it.
+ */
+static int fine_move(fine_list_t *list,
+                     int key,
+                     int from,
+                     cursor_t *src,
+                     cursor_t *dst)
+{
+    cursor_t prev_src, cur, prev_dst, next_dst;
+
+    while (1) {
+        prev_src = *src;
+        if (!list_find(&prev_src, &cur, key))
+            goto restart;
+        if (cur.node->val != key) {
+            *src = prev_src;
+            return 0;
+        }
+
+        prev_dst = *dst;
+        if (!list_find(&prev_dst, &next_dst, key))
+            goto restart;
+        /* Moved in by another thread after the source was walked */
+        if (next_dst.node->val == key)
+            goto restart;
+
+        if (!node_try_lock(prev_src.node, prev_src.version))
+            goto restart;
+        if (!node_try_lock(cur.node, cur.version))
+            goto unlock_src;
+        if (!node_try_lock(prev_dst.node, prev_dst.version))
+            goto unlock_cur;
+
+        node_set_next(prev_src.node, node_next(cur.node));
+        node_set_next(cur.node, next_dst.node);
+        node_set_next(prev_dst.node, cur.node);
+
+        node_unlock(prev_dst.node);
+        node_unlock(cur.node);
+        node_unlock(prev_src.node);
+
+        src->node = prev_src.node;
+        src->version = prev_src.version + 2;
+        dst->node = cur.node;
+        dst->version = cur.version + 2;
+        return 1;
+
+    unlock_cur:
+        node_unlock(cur.node);
+    unlock_src:
+        node_unlock(prev_src.node);
+    restart:
+        cursor_reset(src, list->head[from]);
+        cursor_reset(dst, list->head[1 - from]);
+    }
+}
+
+pthread_data_t *alloc_pthread_data(void)
+{
+    size_t size = sizeof(pthread_data_t);
+    size = CACHE_ALIGN(size);
+
+    pthread_data_t *d = malloc(size);
+    if (d)
+        d->ds_data = NULL;
+
+    return d;
+}
+
+void free_pthread_data(pthread_data_t *d)
+{
+    free(d);
+}
+
+static node_t *node_new(int val)
+{
+    node_t *node = malloc(sizeof(node_t));
+    if (!node)
+        return NULL;
+
+    node->val = val;
+    atomic_init(&node->version, 0);
+    atomic_init(&node->next, NULL);
+    return node;
+}
+
+void *list_global_init(int size, int value_range)
+{
+    fine_list_t *list = malloc(sizeof(fine_list_t));
+    if (!list)
+        return NULL;
+
+    for (int l = 0; l < 2; l++) {
+        node_t *node = list->head[l] = node_new(INT_MIN);
+        if (!node)
+            return NULL;
+        for (int i = 0; i < value_range; i += value_range / size) {
+            node_t *next = node_new(i + l);
+            if (!next)
+                return NULL;
+            node_set_next(node, next);
+            node = next;
+        }
+        node_t *tail = node_new(INT_MAX);
+        if (!tail)
+            return NULL;
+        node_set_next(node, tail);
+    }
+
+    return list;
+}
+
+int list_thread_init(pthread_data_t *data)
+{
+    (void) data;
+    return 0;
+}
+
+void list_global_exit(void *list)
+{
+    fine_list_t *l = (fine_list_t *) list;
+
+    for (int i = 0; i < 2; i++) {
+        node_t *node = l->head[i];
+        while (node) {
+            node_t *next = node_next(node);
+            free(node);
+            node = next;
+        }
+    }
+    free(l);
+}
+
+int list_move(int key, pthread_data_t *data, int from)
+{
+    fine_list_t *list = (fine_list_t *) data->list;
+    cursor_t src, dst;
+
+    cursor_reset(&src, list->head[from]);
+    cursor_reset(&dst, list->head[1 - from]);
+    return fine_move(list, key, from, &src, &dst);
+}
+
+int list_contains(int key, pthread_data_t *data, int which)
+{
+    fine_list_t *list = (fine_list_t *) data->list;
+    cursor_t prev, cur;
+
+    do {
+        cursor_reset(&prev, list->head[which]);
+    } while (!list_find(&prev, &cur, key));
+    return cur.node->val == key;
+}
+
+int list_move_batch(const int *keys, int n, pthread_data_t *data, int from)
+{
+    fine_list_t *list = (fine_list_t *) data->list;
+    cursor_t src, dst;
+    int moved = 0;
+
+    /* The keys are sorted, each walk resumes where the previous one ended */
+    cursor_reset(&src, list->head[from]);
+    cursor_reset(&dst, list->head[1 - from]);
+    for (int i = 0; i < n; i++)
+        moved += fine_move(list, keys[i], from, &src, &dst);
+    return moved;
+}
@@ -12,6 +12,8 @@ typedef struct spinlock_list {
     node_t *head[2];
 } spinlock_list_t;
 
+const char *list_name = "lock";
+
 pthread_data_t *alloc_pthread_data(void)
 {
     size_t size = sizeof(pthread_data_t);
@@ -105,3 +107,49 @@ out:
 
     return ret;
 }
+
+int list_contains(int key, pthread_data_t *data, int which)
+{
+    spinlock_list_t *list = (spinlock_list_t *) data->list;
+    node_t *cur;
+
+    pthread_spin_lock(&list->spinlock);
+    for (cur = list->head[which]->next; cur->val < key; cur = cur->next)
+        ;
+    int ret = (cur->val == key);
+    pthread_spin_unlock(&list->spinlock);
+
+    return ret;
+}
+
+int list_move_batch(const int *keys, int n, pthread_data_t *data, int from)
+{
+    spinlock_list_t *list = (spinlock_list_t *) data->list;
+    node_t *prev_src = list->head[from], *prev_dst = list->head[1 - from];
+    node_t *cur, *next_dst;
+    int moved = 0;
+
+    pthread_spin_lock(&list->spinlock);
+    for (int i = 0; i < n; i++) {
+        int key = keys[i];
+
+        /* The keys are sorted, both walks resume where they stopped */
+        while ((cur = prev_src->next)->val < key)
+            prev_src = cur;
+        if (cur->val != key)
+            continue;
+        while ((next_dst = prev_dst->next)->val < key)
+            prev_dst = next_dst;
+        if (next_dst->val == key)
+            continue;
+
+        prev_src->next = cur->next;
+        prev_dst->next = cur;
+        cur->next = next_dst;
+        prev_dst = cur;
+        moved++;
+    }
+    pthread_spin_unlock(&list->spinlock);
+
+    return moved;
+}
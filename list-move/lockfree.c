@@ -4,108 +4,16 @@
 
 #include "bench.h"
 
-#define QSBR_N_EPOCHS 3
-#define QSBR_PADDING 16
-#define QSBR_FREELIST_SIZE 32768
-
-typedef struct {
-    int epoch;
-    bool in_critical;
-    long qsbr_padding[QSBR_PADDING];
-    size_t freelist_count[QSBR_N_EPOCHS];
-    void *freelist[QSBR_N_EPOCHS][QSBR_FREELIST_SIZE];
-} qsbr_pthread_data_t;
+#include "qsbr.h"
 
 #define CAS(addr, oldv, newv)                                              \
     __atomic_compare_exchange((addr), &(oldv), &(newv), 0, __ATOMIC_RELAXED, \
                               __ATOMIC_RELAXED)
-#define FETCH_AND_ADD(addr, v) __atomic_fetch_add((addr), (v), __ATOMIC_RELAXED)
 #define MEM_BARRIER() __sync_synchronize()
 
-static long n_threads = 0;
-#define QSBR_MAX_THREADS 448
-static qsbr_pthread_data_t *threads[QSBR_MAX_THREADS] = {0};
-
-static volatile pthread_spinlock_t update_lock
-    __attribute__((__aligned__(CACHE_LINE)));
-
-static volatile int global_epoch __attribute__((__aligned__(CACHE_LINE)));
-static void qsbr_init(void)
-{
-    global_epoch = 1;
-    pthread_spin_init(&update_lock, PTHREAD_PROCESS_SHARED);
-}
-
-static void qsbr_pthread_init(qsbr_pthread_data_t *qsbr_data)
-{
-    qsbr_data->epoch = 0;
-    qsbr_data->in_critical = true;
-
-    for (int i = 0; i < QSBR_N_EPOCHS; i++)
-        qsbr_data->freelist_count[i] = 0;
-
-    threads[FETCH_AND_ADD(&n_threads, 1)] = qsbr_data;
-}
-
-static inline void qsbr_free(qsbr_pthread_data_t *qsbr_data, int epoch)
-{
-    MEM_BARRIER();
-
-    for (int i = 0; i < qsbr_data->freelist_count[epoch]; i++)
-        free(qsbr_data->freelist[epoch][i]);
-    qsbr_data->freelist_count[epoch] = 0;
-}
-
-static bool qsbr_update_epoch()
-{
-    if (!pthread_spin_trylock(&update_lock))
-        return false;
-
-    int cur_epoch = global_epoch;
-    for (int i = 0; i < n_threads; i++) {
-        if (threads[i]->in_critical && threads[i]->epoch != cur_epoch) {
-            pthread_spin_unlock(&update_lock);
-            return false;
-        }
-    }
-
-    global_epoch = (cur_epoch + 1) % QSBR_N_EPOCHS;
-
-    pthread_spin_unlock(&update_lock);
-
-    return true;
-}
-
-static void qsbr_quiescent_state(qsbr_pthread_data_t *qsbr_data)
-{
-    int epoch = global_epoch;
-    if (qsbr_data->epoch != epoch) {
-        qsbr_free(qsbr_data, epoch);
-        qsbr_data->epoch = epoch;
-    } else {
-        qsbr_data->in_critical = false;
-        if (qsbr_update_epoch()) {
-            qsbr_data->in_critical = true;
-            MEM_BARRIER();
-            epoch = global_epoch;
-            if (qsbr_data->epoch != epoch) {
-                qsbr_free(qsbr_data, epoch);
-                qsbr_data->epoch = epoch;
-            }
-            return;
-        }
-        qsbr_data->in_critical = true;
-        MEM_BARRIER();
-    }
-}
-
-static void qsbr_free_ptr(void *ptr, qsbr_pthread_data_t *qsbr_data)
-{
-    assert(qsbr_data->freelist_count[qsbr_data->epoch] < QSBR_FREELIST_SIZE);
+static qsbr_t *qsbr;
 
-    qsbr_data->freelist[qsbr_data->epoch]
-                       [(qsbr_data->freelist_count[qsbr_data->epoch])++] = ptr;
-}
+const char *list_name = "lockfree";
 
 typedef struct lf_list_slot {
     unsigned long epoch;
@@ -138,7 +46,7 @@ typedef struct {
     unsigned long epoch;
     lf_list_record_t *new_rec;
     unsigned long count;
-    qsbr_pthread_data_t *qsbr_data;
+    qsbr_tls_t *qsbr;
 } lf_list_pthread_data_t;
 
 enum { INDIRECT_EPOCH = 0, INACTIVE_EPOCH, STARTING_EPOCH };
@@ -155,7 +63,7 @@ static inline void list_maybe_quiescent(lf_list_pthread_data_t *lf_list_data)
             rec = *(lf_list_record_t **) &committed_rec;
         } while (rec->epoch < lf_list_data->epoch &&
                  !CAS(&committed_rec, rec, lf_list_data->rec));
-        qsbr_quiescent_state(lf_list_data->qsbr_data);
+        qsbr_checkpoint(lf_list_data->qsbr);
     }
 }
 
@@ -167,9 +75,10 @@ static inline unsigned long read_slot_epoch(lf_list_slot_t *slot)
 }
 
 static inline void lf_list_free_later(void *ptr,
+                                      size_t size,
                                       lf_list_pthread_data_t *lf_list_data)
 {
-    qsbr_free_ptr(ptr, lf_list_data->qsbr_data);
+    qsbr_retire(lf_list_data->qsbr, ptr, size, free);
 }
 
 static inline void lf_list_free_slots_later(
@@ -178,7 +87,7 @@ static inline void lf_list_free_slots_later(
 {
     for (struct lf_list_slot *it_slot = slot; it_slot;
          it_slot = it_slot->slot_next) {
-        lf_list_free_later(it_slot, lf_list_data);
+        lf_list_free_later(it_slot, sizeof(*it_slot), lf_list_data);
         if (read_slot_epoch(it_slot) >= STARTING_EPOCH)
             break;
     }
@@ -297,7 +206,7 @@ static int lf_list_write_cs_exit(lf_list_pthread_data_t *lf_list_data)
                                      lf_list_data);
             lf_list_free_slots_later(new_rec->slots[2]->slot_next,
                                      lf_list_data);
-            lf_list_free_later(it_rec, lf_list_data);
+            lf_list_free_later(it_rec, sizeof(*it_rec), lf_list_data);
             lf_list_data->rec = new_rec;
             lf_list_data->epoch = epoch;
             break;
@@ -309,7 +218,7 @@ out:
         new_rec->slots[0]->epoch = INACTIVE_EPOCH;
         new_rec->slots[1]->epoch = INACTIVE_EPOCH;
         new_rec->slots[2]->epoch = INACTIVE_EPOCH;
-        lf_list_free_later(new_rec, lf_list_data);
+        lf_list_free_later(new_rec, sizeof(*new_rec), lf_list_data);
         lf_list_data->new_rec = new_rec = malloc(sizeof(lf_list_record_t));
         assert(new_rec);
         new_rec->epoch = INACTIVE_EPOCH;
@@ -329,22 +238,22 @@ pthread_data_t *alloc_pthread_data(void)
     pthread_size = CACHE_ALIGN(pthread_size);
     size_t lf_list_size = sizeof(lf_list_pthread_data_t);
     lf_list_size = CACHE_ALIGN(lf_list_size);
-    size_t qsbr_size = sizeof(qsbr_pthread_data_t);
-    qsbr_size = CACHE_ALIGN(qsbr_size);
 
-    pthread_data_t *d = malloc(pthread_size + lf_list_size + qsbr_size);
-    if (d) {
+    pthread_data_t *d = malloc(pthread_size + lf_list_size);
+    if (d)
         d->ds_data = ((void *) d) + pthread_size;
-        ((lf_list_pthread_data_t *) d->ds_data)->qsbr_data =
-            ((void *) d) + pthread_size + lf_list_size;
-    }
 
     return d;
 }
 
 void free_pthread_data(pthread_data_t *d)
 {
-    /* free QSBR freelist */
+    lf_list_pthread_data_t *lf_list_data =
+        (lf_list_pthread_data_t *) d->ds_data;
+
+    /* what is left in limbo goes to qsbr_destroy() */
+    if (lf_list_data->qsbr)
+        qsbr_unregister(lf_list_data->qsbr);
     free(d);
 }
 
@@ -441,7 +350,8 @@ void *list_global_init(int size, int value_range)
     slot[1]->rec = NULL;
     slot[1]->next = NULL;
 
-    qsbr_init();
+    if (!(qsbr = qsbr_create()))
+        return NULL;
 
     return list;
 }
@@ -456,7 +366,8 @@ int list_thread_init(pthread_data_t *data)
     lf_list_data->new_rec = NULL;
 
     lf_list_data->count = 0;
-    qsbr_pthread_init(lf_list_data->qsbr_data);
+    if (!(lf_list_data->qsbr = qsbr_register(qsbr)))
+        return -1;
 
     return 0;
 }
@@ -464,6 +375,7 @@ int list_thread_init(pthread_data_t *data)
 void list_global_exit(void *list)
 {
     /* TODO: free list->head */
+    qsbr_destroy(qsbr);
 }
 
 int list_move(int key, pthread_data_t *data, int from)
@@ -508,3 +420,33 @@ int list_move(int key, pthread_data_t *data, int from)
 
     return ret;
 }
+
+int list_contains(int key, pthread_data_t *data, int which)
+{
+    lf_list_t *list = (lf_list_t *) data->list;
+    lf_list_pthread_data_t *lf_list_data =
+        (lf_list_pthread_data_t *) data->ds_data;
+    node_t *cur = list->head[which];
+    int val;
+
+    /* Read the snapshot of the latest committed epoch */
+    lf_list_set_read_epoch(lf_list_data);
+    while ((val = cur->val) < key)
+        cur = lf_list_get_next(cur, lf_list_data);
+
+    list_maybe_quiescent(lf_list_data);
+
+    return val == key;
+}
+
+/* A commit record holds the three nodes of one move, so each key is moved on
+ * its own.
+ */
+int list_move_batch(const int *keys, int n, pthread_data_t *data, int from)
+{
+    int moved = 0;
+
+    for (int i = 0; i < n; i++)
+        moved += list_move(keys[i], data, from);
+    return moved;
+}
@@ -0,0 +1,570 @@
+/* Lock benchmark
+ *
+ * Sweeps a matrix of locks, thread counts, critical section lengths, work
+ * outside of the lock and read percentages. The critical section walks a
+ * cache line of shared counters: the writers increment them and the readers
+ * check that they are all equal. Every point of the matrix runs a warmup then
+ * several trials on a fresh lock, and is printed as a CSV line with:
+ *
+ * - the mean throughput and its standard deviation across the trials,
+ * - the fairness, as the coefficient of variation of the operations done by
+ *   each thread and the ratio of the fewest to the most,
+ * - percentiles of the handoff latency, from the release by a thread to the
+ *   acquisition by another one that was already waiting for the lock.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define DEFAULT_DURATION 1000 /* ms */
+#define DEFAULT_WARMUP 200    /* ms */
+#define DEFAULT_TRIALS 3
+#define DEFAULT_NTHREADS 4
+#define MAX_VALUES 32 /* per dimension of the matrix */
+#define N_WORDS 8     /* shared counters, one cache line */
+
+static const lock_ops_t *const all_locks[] = {
+    &mcs_ops,         &mcs_adaptive_ops,   &mcs_cohort_ops,
+    &seqlock_ops,     &seqlock_ticket_ops, &spinlock_ops,
+    &mutex_ops,       &pthread_mutex_ops,
+};
+#define N_LOCKS (sizeof(all_locks) / sizeof(all_locks[0]))
+
+typedef struct {
+    pthread_cond_t complete;
+    pthread_mutex_t mutex;
+    int count;
+    int crossing;
+} barrier_t;
+
+static void barrier_init(barrier_t *b, int n)
+{
+    pthread_cond_init(&b->complete, NULL);
+    pthread_mutex_init(&b->mutex, NULL);
+    b->count = n;
+    b->crossing = 0;
+}
+
+static void barrier_cross(barrier_t *b)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->crossing++;
+    if (b->crossing < b->count)
+        pthread_cond_wait(&b->complete, &b->mutex);
+    else {
+        pthread_cond_broadcast(&b->complete);
+        b->crossing = 0;
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+/* Log-linear latency histogram, as in list-move */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+static inline int lat_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+static uint64_t lat_value(int b)
+{
+    if (b < LAT_SUB)
+        return b;
+    int shift = b / LAT_SUB - 1;
+    return (uint64_t) (LAT_SUB + b % LAT_SUB) << shift;
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t) ceil(total * p), seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen)
+            return lat_value(b);
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* What the lock protects, along with who released it last and when */
+typedef struct {
+    _Atomic uint64_t words[N_WORDS];
+    _Atomic int owner;
+    _Atomic uint64_t released_at;
+} __attribute__((aligned(CACHE_LINE))) shared_t;
+
+typedef struct {
+    lock_ctx_t ctx;
+    const lock_ops_t *ops;
+    void *lock;
+    shared_t *shared;
+    barrier_t *barrier;
+    int id, cpu;
+    int cs, outside, read_pct;
+    unsigned int seed;
+    unsigned long n_ops; /* of the current trial */
+    uint64_t *lat;
+} __attribute__((aligned(CACHE_LINE))) thread_data_t;
+
+typedef struct {
+    int n;
+    int v[MAX_VALUES];
+} values_t;
+
+typedef struct {
+    const lock_ops_t *locks[N_LOCKS];
+    int n_locks;
+    values_t threads, cs, outside, read_pcts, cpus;
+    int duration, warmup, trials;
+    int pin;
+} config_t;
+
+static _Atomic bool should_stop = false;
+
+/* The shared state is only written under the lock, but the seqlock readers
+ * may load it during a write, hence the relaxed atomics.
+ */
+static inline uint64_t word_load(shared_t *s, int i)
+{
+    return atomic_load_explicit(&s->words[i], memory_order_relaxed);
+}
+
+static void critical_write(shared_t *s, int passes)
+{
+    for (int p = 0; p < passes; p++) {
+        for (int i = 0; i < N_WORDS; i++)
+            atomic_store_explicit(&s->words[i], word_load(s, i) + 1,
+                                  memory_order_relaxed);
+    }
+}
+
+static bool critical_read(shared_t *s, int passes)
+{
+    bool same = true;
+
+    for (int p = 0; p < passes; p++) {
+        uint64_t first = word_load(s, 0);
+        for (int i = 1; i < N_WORDS; i++)
+            same &= word_load(s, i) == first;
+    }
+    return same;
+}
+
+static void work_outside(int passes)
+{
+    for (volatile int i = 0; i < passes; i++)
+        ;
+}
+
+/* Acquire exclusively, and record the handoff latency if the lock came from
+ * another thread that released it while this one was waiting.
+ */
+static void acquire(thread_data_t *d)
+{
+    shared_t *s = d->shared;
+    uint64_t start = now_ns();
+
+    d->ops->lock(d->lock, &d->ctx);
+
+    uint64_t now = now_ns();
+    int prev = atomic_load_explicit(&s->owner, memory_order_relaxed);
+    uint64_t released =
+        atomic_load_explicit(&s->released_at, memory_order_relaxed);
+    if (prev >= 0 && prev != d->id && released >= start)
+        d->lat[lat_bucket(now - released)]++;
+    atomic_store_explicit(&s->owner, d->id, memory_order_relaxed);
+}
+
+static void release(thread_data_t *d)
+{
+    atomic_store_explicit(&d->shared->released_at, now_ns(),
+                          memory_order_relaxed);
+    d->ops->unlock(d->lock, &d->ctx);
+}
+
+static void *bench_thread(void *data)
+{
+    thread_data_t *d = (thread_data_t *) data;
+    const lock_ops_t *ops = d->ops;
+
+    if (d->cpu >= 0) {
+        cpu_set_t set;
+        CPU_ZERO(&set);
+        CPU_SET(d->cpu, &set);
+        pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+    }
+
+    barrier_cross(d->barrier);
+    while (!should_stop) {
+        bool read = (int) (rand_r(&d->seed) % 100) < d->read_pct;
+
+        if (read && ops->read_lock) {
+            bool done;
+            do {
+                ops->read_lock(d->lock, &d->ctx);
+                bool same = critical_read(d->shared, d->cs);
+                done = ops->read_unlock(d->lock, &d->ctx);
+                if (done && !same) {
+                    fprintf(stderr, "%s: inconsistent read\n", ops->name);
+                    abort();
+                }
+            } while (!done);
+        } else {
+            acquire(d);
+            if (!read)
+                critical_write(d->shared, d->cs);
+            else if (!critical_read(d->shared, d->cs)) {
+                fprintf(stderr, "%s: inconsistent read\n", ops->name);
+                abort();
+            }
+            release(d);
+        }
+        d->n_ops++;
+        work_outside(d->outside);
+    }
+
+    return NULL;
+}
+
+/* Run every thread for "duration" ms, and return the operations per second
+ * or a negative value on failure.
+ */
+static double run_trial(pthread_t *threads,
+                        thread_data_t *data,
+                        int n_threads,
+                        int duration)
+{
+    struct timespec timeout = {.tv_sec = duration / 1000,
+                               .tv_nsec = (duration % 1000) * 1000000};
+    barrier_t barrier;
+
+    barrier_init(&barrier, n_threads + 1);
+    should_stop = false;
+    for (int i = 0; i < n_threads; i++) {
+        data[i].n_ops = 0;
+        data[i].barrier = &barrier;
+        if (pthread_create(&threads[i], NULL, bench_thread, &data[i])) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return -1;
+        }
+    }
+
+    barrier_cross(&barrier);
+
+    uint64_t start = now_ns();
+    nanosleep(&timeout, NULL);
+    should_stop = true;
+    uint64_t end = now_ns();
+
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            fprintf(stderr, "Failed to join child thread %d\n", i);
+            return -1;
+        }
+    }
+
+    unsigned long n_ops = 0;
+    for (int i = 0; i < n_threads; i++)
+        n_ops += data[i].n_ops;
+    return n_ops * 1e9 / (end - start);
+}
+
+static void mean_stddev(const double *v, int n, double *mean, double *stddev)
+{
+    double m = 0, var = 0;
+
+    for (int i = 0; i < n; i++)
+        m += v[i];
+    m /= n;
+    for (int i = 0; i < n; i++)
+        var += (v[i] - m) * (v[i] - m);
+    if (n > 1)
+        var /= n - 1;
+    *mean = m;
+    *stddev = sqrt(var);
+}
+
+/* Run one point of the matrix on a fresh lock, and print its CSV line */
+static int run_point(const config_t *cfg,
+                     const lock_ops_t *ops,
+                     int n_threads,
+                     int cs,
+                     int outside,
+                     int read_pct)
+{
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    thread_data_t *data =
+        aligned_alloc(CACHE_LINE, n_threads * sizeof(thread_data_t));
+    double *thread_ops = calloc(n_threads, sizeof(double));
+    uint64_t *hist = calloc(LAT_BUCKETS, sizeof(uint64_t));
+    double *mops = calloc(cfg->trials, sizeof(double));
+    shared_t *shared = aligned_alloc(CACHE_LINE, sizeof(shared_t));
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    void *lock = NULL;
+    int ret = -1;
+
+    if (data)
+        memset(data, 0, n_threads * sizeof(thread_data_t));
+    if (!threads || !data || !thread_ops || !hist || !mops || !shared) {
+        fprintf(stderr, "Failed to allocate the benchmark data\n");
+        goto out;
+    }
+    if (!(lock = ops->create())) {
+        fprintf(stderr, "Failed to create the %s lock\n", ops->name);
+        goto out;
+    }
+    for (int i = 0; i < N_WORDS; i++)
+        atomic_init(&shared->words[i], 0);
+    atomic_init(&shared->owner, -1);
+    atomic_init(&shared->released_at, 0);
+
+    for (int i = 0; i < n_threads; i++) {
+        thread_data_t *d = &data[i];
+        if (!(d->lat = calloc(LAT_BUCKETS, sizeof(uint64_t)))) {
+            fprintf(stderr, "Failed to allocate thread data %d\n", i);
+            goto out;
+        }
+        d->ops = ops;
+        d->lock = lock;
+        d->shared = shared;
+        d->id = i;
+        d->cs = cs;
+        d->outside = outside;
+        d->read_pct = read_pct;
+        d->seed = rand();
+        if (!cfg->pin)
+            d->cpu = -1;
+        else if (cfg->cpus.n)
+            d->cpu = cfg->cpus.v[i % cfg->cpus.n];
+        else
+            d->cpu = i % n_cpus;
+    }
+
+    if (cfg->warmup && run_trial(threads, data, n_threads, cfg->warmup) < 0)
+        goto out;
+    for (int i = 0; i < n_threads; i++)
+        memset(data[i].lat, 0, LAT_BUCKETS * sizeof(uint64_t));
+    for (int t = 0; t < cfg->trials; t++) {
+        double ops_per_sec =
+            run_trial(threads, data, n_threads, cfg->duration);
+        if (ops_per_sec < 0)
+            goto out;
+        mops[t] = ops_per_sec / 1e6;
+        for (int i = 0; i < n_threads; i++)
+            thread_ops[i] += data[i].n_ops;
+    }
+
+    double mean, stddev, fair_mean, fair_stddev;
+    mean_stddev(mops, cfg->trials, &mean, &stddev);
+    mean_stddev(thread_ops, n_threads, &fair_mean, &fair_stddev);
+    double min = thread_ops[0], max = thread_ops[0];
+    for (int i = 1; i < n_threads; i++) {
+        min = thread_ops[i] < min ? thread_ops[i] : min;
+        max = thread_ops[i] > max ? thread_ops[i] : max;
+    }
+
+    uint64_t total = 0;
+    for (int i = 0; i < n_threads; i++) {
+        for (int b = 0; b < LAT_BUCKETS; b++)
+            hist[b] += data[i].lat[b];
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+
+    printf("%s,%d,%d,%d,%d,%d,%.3f,%.3f,%.3f,%.3f,%lu,%lu,%lu,%lu,%lu\n",
+           ops->name, n_threads, cs, outside, read_pct, cfg->trials, mean,
+           stddev, fair_mean ? fair_stddev / fair_mean : 0,
+           max ? min / max : 0, total, lat_percentile(hist, total, 0.5),
+           lat_percentile(hist, total, 0.9), lat_percentile(hist, total, 0.99),
+           lat_percentile(hist, total, 0.999));
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (int i = 0; i < n_threads && data; i++)
+        free(data[i].lat);
+    if (lock)
+        ops->destroy(lock);
+    free(shared);
+    free(mops);
+    free(hist);
+    free(thread_ops);
+    free(data);
+    free(threads);
+    return ret;
+}
+
+/* Parse a comma separated list of integers within [min, max] */
+static int parse_values(values_t *values, const char *s, int min, int max)
+{
+    char *end;
+
+    values->n = 0;
+    do {
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (errno || end == s || v < min || v > max ||
+            values->n == MAX_VALUES)
+            return -1;
+        values->v[values->n++] = v;
+        s = end + 1;
+    } while (*end == ',');
+
+    return *end ? -1 : 0;
+}
+
+static int parse_int(int *value, const char *s, int min)
+{
+    values_t values;
+
+    if (parse_values(&values, s, min, INT_MAX) || values.n != 1)
+        return -1;
+    *value = values.v[0];
+    return 0;
+}
+
+/* Parse a comma separated list of lock names, or "all" */
+static int parse_locks(config_t *cfg, const char *s)
+{
+    cfg->n_locks = 0;
+    while (*s) {
+        size_t len = strcspn(s, ","), k;
+
+        if (len == 3 && !strncmp(s, "all", 3)) {
+            for (k = 0; k < N_LOCKS && cfg->n_locks < (int) N_LOCKS; k++)
+                cfg->locks[cfg->n_locks++] = all_locks[k];
+        } else {
+            for (k = 0; k < N_LOCKS; k++) {
+                if (strlen(all_locks[k]->name) == len &&
+                    !strncmp(s, all_locks[k]->name, len))
+                    break;
+            }
+            if (k == N_LOCKS || cfg->n_locks == (int) N_LOCKS)
+                return -1;
+            cfg->locks[cfg->n_locks++] = all_locks[k];
+        }
+        s += len;
+        if (*s == ',' && !*++s)
+            return -1;
+    }
+    return cfg->n_locks ? 0 : -1;
+}
+
+static int set_option(config_t *cfg, int opt, const char *arg)
+{
+    switch (opt) {
+    case 'l':
+        return parse_locks(cfg, arg);
+    case 't':
+        return parse_values(&cfg->threads, arg, 1, INT_MAX);
+    case 'c':
+        return parse_values(&cfg->cs, arg, 0, INT_MAX);
+    case 'o':
+        return parse_values(&cfg->outside, arg, 0, INT_MAX);
+    case 'r':
+        return parse_values(&cfg->read_pcts, arg, 0, 100);
+    case 'a':
+        return parse_values(&cfg->cpus, arg, 0, CPU_SETSIZE - 1);
+    case 'd':
+        return parse_int(&cfg->duration, arg, 1);
+    case 'w':
+        return parse_int(&cfg->warmup, arg, 0);
+    case 'n':
+        return parse_int(&cfg->trials, arg, 1);
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-l locks] [-t threads] [-c passes] [-o passes]\n"
+            "       [-r read%%] [-a cpus] [-d ms] [-w ms] [-n trials] [-P] "
+            "[-H]\n"
+            "  -l, -t, -c, -o and -r take comma separated lists, the\n"
+            "  benchmark runs every combination of them. -c is the number\n"
+            "  of passes over the shared cache line in the critical section,\n"
+            "  -o the length of the busy loop between two acquisitions.\n"
+            "  The threads are pinned round robin to the CPUs given with -a,\n"
+            "  or to all of them; -P leaves them unpinned, -H omits the CSV\n"
+            "  header. The locks are:",
+            prog);
+    for (size_t k = 0; k < N_LOCKS; k++)
+        fprintf(stderr, " %s", all_locks[k]->name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    config_t cfg = {
+        .threads = {1, {DEFAULT_NTHREADS}},
+        .cs = {1, {1}},
+        .outside = {1, {0}},
+        .read_pcts = {1, {0}},
+        .duration = DEFAULT_DURATION,
+        .warmup = DEFAULT_WARMUP,
+        .trials = DEFAULT_TRIALS,
+        .pin = 1,
+    };
+    bool header = true;
+    int opt;
+
+    parse_locks(&cfg, "all");
+    while ((opt = getopt(argc, argv, "l:t:c:o:r:a:d:w:n:PH")) != -1) {
+        if (opt == 'P')
+            cfg.pin = 0;
+        else if (opt == 'H')
+            header = false;
+        else if (opt == '?' || set_option(&cfg, opt, optarg)) {
+            if (opt != '?')
+                fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    srand(getpid() ^ (uintptr_t) main);
+
+    if (header)
+        printf("lock,threads,cs,outside,read_pct,trials,mops_mean,"
+               "mops_stddev,fair_cv,fair_min_max,handoffs,p50_ns,p90_ns,"
+               "p99_ns,p999_ns\n");
+    for (int l = 0; l < cfg.n_locks; l++)
+        for (int t = 0; t < cfg.threads.n; t++)
+            for (int c = 0; c < cfg.cs.n; c++)
+                for (int o = 0; o < cfg.outside.n; o++)
+                    for (int r = 0; r < cfg.read_pcts.n; r++) {
+                        if (run_point(&cfg, cfg.locks[l], cfg.threads.v[t],
+                                      cfg.cs.v[c], cfg.outside.v[o],
+                                      cfg.read_pcts.v[r]))
+                            return EXIT_FAILURE;
+                    }
+
+    return EXIT_SUCCESS;
+}
@@ -0,0 +1,33 @@
+#ifndef LOCKBENCH_H
+#define LOCKBENCH_H
+
+#include <stdbool.h>
+
+#define CACHE_LINE (64)
+
+/* Per-thread state of an acquisition, such as an MCS node or the sequence of
+ * a seqlock read, of the same thread for the matching release
+ */
+typedef union {
+    char data[CACHE_LINE];
+} __attribute__((aligned(CACHE_LINE))) lock_ctx_t;
+
+/* A lock under test. Without read_lock, the readers take it exclusively like
+ * the writers; read_unlock() returns false when the read has to be retried.
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(void);
+    void (*destroy)(void *lock);
+    void (*lock)(void *lock, lock_ctx_t *ctx);
+    void (*unlock)(void *lock, lock_ctx_t *ctx);
+    void (*read_lock)(void *lock, lock_ctx_t *ctx);
+    bool (*read_unlock)(void *lock, lock_ctx_t *ctx);
+} lock_ops_t;
+
+extern const lock_ops_t mcs_ops, mcs_adaptive_ops, mcs_cohort_ops;
+extern const lock_ops_t seqlock_ops, seqlock_ticket_ops;
+extern const lock_ops_t spinlock_ops;
+extern const lock_ops_t mutex_ops, pthread_mutex_ops;
+
+#endif
@@ -0,0 +1,80 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "mcslock.h"
+
+#define COHORT_BATCH 64
+
+static void *mcs_create(void)
+{
+    mcslock_t *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        mcslock_init(lock);
+    return lock;
+}
+
+static void mcs_lock(void *lock, lock_ctx_t *ctx)
+{
+    mcslock_acquire(lock, (mcsnode_t *) ctx);
+}
+
+static void mcs_lock_adaptive(void *lock, lock_ctx_t *ctx)
+{
+    mcslock_acquire_adaptive(lock, (mcsnode_t *) ctx);
+}
+
+static void mcs_unlock(void *lock, lock_ctx_t *ctx)
+{
+    mcslock_release(lock, (mcsnode_t *) ctx);
+}
+
+const lock_ops_t mcs_ops = {
+    .name = "mcs",
+    .create = mcs_create,
+    .destroy = free,
+    .lock = mcs_lock,
+    .unlock = mcs_unlock,
+};
+
+const lock_ops_t mcs_adaptive_ops = {
+    .name = "mcs-adaptive",
+    .create = mcs_create,
+    .destroy = free,
+    .lock = mcs_lock_adaptive,
+    .unlock = mcs_unlock,
+};
+
+/* One cohort per NUMA node */
+static void *cohort_create(void)
+{
+    mcs_cohort_t *lock = malloc(sizeof(mcs_cohort_t));
+    if (lock && !mcs_cohort_init(lock, 0, COHORT_BATCH)) {
+        free(lock);
+        return NULL;
+    }
+    return lock;
+}
+
+static void cohort_destroy(void *lock)
+{
+    mcs_cohort_destroy(lock);
+    free(lock);
+}
+
+static void cohort_lock(void *lock, lock_ctx_t *ctx)
+{
+    mcs_cohort_acquire(lock, (mcs_cohort_node_t *) ctx);
+}
+
+static void cohort_unlock(void *lock, lock_ctx_t *ctx)
+{
+    mcs_cohort_release(lock, (mcs_cohort_node_t *) ctx);
+}
+
+const lock_ops_t mcs_cohort_ops = {
+    .name = "mcs-cohort",
+    .create = cohort_create,
+    .destroy = cohort_destroy,
+    .lock = cohort_lock,
+    .unlock = cohort_unlock,
+};
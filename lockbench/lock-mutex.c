@@ -0,0 +1,69 @@
+#include <pthread.h>
+#include <stdlib.h>
+
+#include "bench.h"
+#include "mutex.h"
+
+/* The futex mutex of channel, and pthread_mutex_t as a baseline */
+
+static void *mutex_create(void)
+{
+    struct mutex *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        mutex_init(lock);
+    return lock;
+}
+
+static void mu_lock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    mutex_lock(lock);
+}
+
+static void mu_unlock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    mutex_unlock(lock);
+}
+
+const lock_ops_t mutex_ops = {
+    .name = "mutex",
+    .create = mutex_create,
+    .destroy = free,
+    .lock = mu_lock,
+    .unlock = mu_unlock,
+};
+
+static void *pmutex_create(void)
+{
+    pthread_mutex_t *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        pthread_mutex_init(lock, NULL);
+    return lock;
+}
+
+static void pmutex_destroy(void *lock)
+{
+    pthread_mutex_destroy(lock);
+    free(lock);
+}
+
+static void pmutex_lock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    pthread_mutex_lock(lock);
+}
+
+static void pmutex_unlock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    pthread_mutex_unlock(lock);
+}
+
+const lock_ops_t pthread_mutex_ops = {
+    .name = "pthread",
+    .create = pmutex_create,
+    .destroy = pmutex_destroy,
+    .lock = pmutex_lock,
+    .unlock = pmutex_unlock,
+};
@@ -0,0 +1,87 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "seqlock.h"
+
+/* The readers do not write to the lock, and retry when a write overlapped */
+
+static void *seq_create(void)
+{
+    seqlock_t *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        seqlock_init(lock);
+    return lock;
+}
+
+static void seq_lock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    seqlock_acquire_wr(lock);
+}
+
+static void seq_unlock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    seqlock_release_wr(lock);
+}
+
+static void seq_read_lock(void *lock, lock_ctx_t *ctx)
+{
+    *(seqlock_t *) ctx = seqlock_acquire_rd(lock);
+}
+
+static bool seq_read_unlock(void *lock, lock_ctx_t *ctx)
+{
+    return seqlock_release_rd(lock, *(seqlock_t *) ctx);
+}
+
+const lock_ops_t seqlock_ops = {
+    .name = "seqlock",
+    .create = seq_create,
+    .destroy = free,
+    .lock = seq_lock,
+    .unlock = seq_unlock,
+    .read_lock = seq_read_lock,
+    .read_unlock = seq_read_unlock,
+};
+
+/* The writers queue on the ticket lock instead of racing for the CAS */
+static void *ticket_create(void)
+{
+    seqlock_ticket_t *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        seqlock_ticket_init(lock);
+    return lock;
+}
+
+static void ticket_lock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    seqlock_ticket_acquire_wr(lock);
+}
+
+static void ticket_unlock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    seqlock_ticket_release_wr(lock);
+}
+
+static void ticket_read_lock(void *lock, lock_ctx_t *ctx)
+{
+    seq_read_lock(&((seqlock_ticket_t *) lock)->seq, ctx);
+}
+
+static bool ticket_read_unlock(void *lock, lock_ctx_t *ctx)
+{
+    return seq_read_unlock(&((seqlock_ticket_t *) lock)->seq, ctx);
+}
+
+const lock_ops_t seqlock_ticket_ops = {
+    .name = "seqlock-ticket",
+    .create = ticket_create,
+    .destroy = free,
+    .lock = ticket_lock,
+    .unlock = ticket_unlock,
+    .read_lock = ticket_read_lock,
+    .read_unlock = ticket_read_unlock,
+};
@@ -0,0 +1,40 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "locks.h"
+
+/* The CAS spinlock of cmap */
+
+static void *spin_create(void)
+{
+    struct spinlock *lock = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (lock)
+        spinlock_init(lock);
+    return lock;
+}
+
+static void spin_destroy(void *lock)
+{
+    spinlock_destroy(lock);
+    free(lock);
+}
+
+static void spin_lock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    spinlock_lock((struct spinlock *) lock);
+}
+
+static void spin_unlock(void *lock, lock_ctx_t *ctx)
+{
+    (void) ctx;
+    spinlock_unlock(lock);
+}
+
+const lock_ops_t spinlock_ops = {
+    .name = "spinlock",
+    .create = spin_create,
+    .destroy = spin_destroy,
+    .lock = spin_lock,
+    .unlock = spin_unlock,
+};
@@ -0,0 +1,887 @@
+#include <fcntl.h>
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "deque.h"
+#include "mapreduce.h"
+#include "uring.h"
+
+/* I/O operation configs */
+#ifndef BUFFER_SIZE
+#define BUFFER_SIZE 4096
+#endif
+
+/* Reads in flight on the ring of each thread, in the io_uring mode */
+#ifndef URING_DEPTH
+#define URING_DEPTH 32
+#endif
+
+/* Size of the sliding window used by the streaming mode */
+#ifndef WINDOW_SIZE
+#define WINDOW_SIZE (256 << 20)
+#endif
+
+/* Target size of a split. Smaller splits balance better, larger ones cost
+ * less scheduling.
+ */
+#ifndef SPLIT_SIZE
+#define SPLIT_SIZE (1 << 20)
+#endif
+
+/* Table configs */
+#define MIN_N_SLOTS 1024 /* initial capacity of a combiner, power of 2 */
+#define ARENA_CHUNK_SIZE (64 << 10)
+
+static struct mr_job *job;
+
+/* 64-bit string hash following the construction of wyhash: input is folded
+ * 16 bytes at a time through a 64x64->128 bit multiply-xor mix.
+ */
+static const uint64_t wy_secret[] = {0xa0761d6478bd642full,
+                                     0xe7037ed1a0b428dbull,
+                                     0x8ebc6af09c88c6e3ull};
+
+static inline uint64_t wy_mix(uint64_t a, uint64_t b)
+{
+    __uint128_t r = (__uint128_t) a * b;
+    return (uint64_t) r ^ (uint64_t) (r >> 64);
+}
+
+/* Read up to 8 bytes as a little-endian-ish 64-bit word */
+static inline uint64_t wy_read(const char *p, size_t n)
+{
+    uint64_t v = 0;
+    memcpy(&v, p, n);
+    return v;
+}
+
+static uint64_t mr_hash(const char *key, size_t len)
+{
+    uint64_t seed = wy_secret[0] ^ len, a, b;
+    for (; len > 16; len -= 16, key += 16)
+        seed = wy_mix(wy_read(key, 8) ^ wy_secret[1],
+                      wy_read(key + 8, 8) ^ seed);
+    if (len > 8)
+        a = wy_read(key, 8), b = wy_read(key + 8, len - 8);
+    else
+        a = wy_read(key, len), b = 0;
+    return wy_mix(wy_secret[2] ^ len, wy_mix(a ^ wy_secret[1], b ^ seed));
+}
+
+/* Bump allocator holding the keys of one thread. Keys are never freed one
+ * by one, so the whole arena is released at once when the job is done.
+ */
+struct arena_chunk {
+    struct arena_chunk *next;
+    char data[];
+};
+
+struct mr_arena {
+    struct arena_chunk *chunks;
+    char *cur, *end;
+};
+
+static char *arena_alloc(struct mr_arena *a, size_t size)
+{
+    if ((size_t) (a->end - a->cur) < size) {
+        size_t n = size > ARENA_CHUNK_SIZE ? size : ARENA_CHUNK_SIZE;
+        struct arena_chunk *c = malloc(sizeof(struct arena_chunk) + n);
+        if (!c) return NULL;
+        c->next = a->chunks, a->chunks = c;
+        a->cur = c->data, a->end = c->data + n;
+    }
+    char *p = a->cur;
+    a->cur += size;
+    return p;
+}
+
+static void arena_destroy(struct mr_arena *a)
+{
+    while (a->chunks) {
+        struct arena_chunk *c = a->chunks;
+        a->chunks = c->next;
+        free(c);
+    }
+    a->cur = a->end = NULL;
+}
+
+/* Flat open-addressing table with linear probing. It doubles whenever the
+ * load factor would exceed 3/4, so it never needs to be sized up front.
+ * Slots are mr_pair_t followed by the value, pair_size bytes apart.
+ */
+struct mr_table {
+    char *slots;
+    uint32_t mask, n_pairs;
+};
+
+static size_t pair_size;
+
+#define SLOT(t, i) ((mr_pair_t *) ((t)->slots + (size_t) (i) *pair_size))
+
+static int mt_init(struct mr_table *t, uint32_t n_slots)
+{
+    if (!(t->slots = calloc(n_slots, pair_size))) return -1;
+    t->mask = n_slots - 1, t->n_pairs = 0;
+    return 0;
+}
+
+static void mt_destroy(struct mr_table *t)
+{
+    free(t->slots);
+    t->slots = NULL;
+}
+
+/* Smallest power of 2 number of slots holding n pairs under 3/4 load */
+static uint32_t mt_slots_for(uint32_t n, uint32_t min)
+{
+    uint32_t slots = min;
+    while (slots * 3 < n * 4) slots *= 2;
+    return slots;
+}
+
+/* Return the slot holding the key, or the empty slot where it belongs */
+static inline mr_pair_t *mt_lookup(struct mr_table *t,
+                                   uint64_t hash,
+                                   const char *key,
+                                   uint32_t len)
+{
+    for (uint32_t i = hash & t->mask;; i = (i + 1) & t->mask) {
+        mr_pair_t *p = SLOT(t, i);
+        if (!p->key) return p;
+        if (p->hash == hash && p->key_len == len && !memcmp(p->key, key, len))
+            return p;
+    }
+}
+
+static int mt_grow(struct mr_table *t)
+{
+    struct mr_table bigger;
+    if (mt_init(&bigger, (t->mask + 1) * 2)) return -1;
+
+    for (uint32_t i = 0; i <= t->mask; i++) {
+        mr_pair_t *p = SLOT(t, i);
+        if (!p->key) continue;
+        for (uint32_t j = p->hash & bigger.mask;; j = (j + 1) & bigger.mask) {
+            if (!SLOT(&bigger, j)->key) {
+                memcpy(SLOT(&bigger, j), p, pair_size);
+                break;
+            }
+        }
+    }
+
+    bigger.n_pairs = t->n_pairs;
+    mt_destroy(t);
+    *t = bigger;
+    return 0;
+}
+
+/* Make room for one more pair, growing the table if needed */
+static inline int mt_reserve(struct mr_table *t)
+{
+    if ((t->n_pairs + 1) * 4 > (t->mask + 1) * 3) return mt_grow(t);
+    return 0;
+}
+
+/* Per-thread combiner. Pairs are split by partition on insertion, so that at
+ * reduce time each thread reads exactly the tables it owns and nothing else.
+ */
+struct combiner {
+    struct mr_table *parts;
+    struct mr_arena arena;
+};
+
+/* Sorted output of one partition */
+struct mr_result {
+    mr_pair_t **pairs;
+    uint32_t n_pairs, n_total;
+};
+
+static uint32_t n_parts;
+static struct combiner *combiners;
+static struct mr_table *reduced;
+static struct mr_result *results;
+
+/* Map a hash to a partition, using the bits the slot index does not use */
+static inline uint32_t mr_part(uint64_t hash)
+{
+    return (uint32_t) (((hash >> 32) * n_parts) >> 32);
+}
+
+static int combiners_init(void)
+{
+    n_parts = job->n_threads;
+    combiners = calloc(job->n_threads, sizeof(struct combiner));
+    reduced = calloc(n_parts, sizeof(struct mr_table));
+    results = calloc(n_parts, sizeof(struct mr_result));
+    if (!combiners || !reduced || !results) return -1;
+
+    /* Keep the total initial footprint of a thread near MIN_N_SLOTS */
+    uint32_t n_slots = 16;
+    while (n_slots * n_parts < MIN_N_SLOTS) n_slots *= 2;
+
+    for (uint32_t i = 0; i < job->n_threads; i++) {
+        struct combiner *c = &combiners[i];
+        if (!(c->parts = calloc(n_parts, sizeof(struct mr_table)))) return -1;
+        for (uint32_t j = 0; j < n_parts; j++)
+            if (mt_init(&c->parts[j], n_slots)) return -1;
+    }
+    return 0;
+}
+
+int mr_emit(uint32_t tid, const char *key, uint32_t key_len, const void *value)
+{
+    struct combiner *c = &combiners[tid];
+    uint64_t hash = mr_hash(key, key_len);
+    struct mr_table *t = &c->parts[mr_part(hash)];
+
+    mr_pair_t *p = mt_lookup(t, hash, key, key_len);
+    if (p->key) { /* combine with the pair already there */
+        job->combine(p->value, value);
+        return 0;
+    }
+
+    /* key was absent. Copy it to the arena */
+    if (mt_reserve(t)) return -1;
+    p = mt_lookup(t, hash, key, key_len);
+
+    char *copy = arena_alloc(&c->arena, key_len + 1);
+    if (!copy) return -1;
+    memcpy(copy, key, key_len);
+    copy[key_len] = '\0';
+
+    p->hash = hash, p->key = copy, p->key_len = key_len;
+    memcpy(p->value, value, job->value_size);
+    t->n_pairs++;
+    return 0;
+}
+
+static int pair_cmp(const void *a, const void *b)
+{
+    return job->compare(*(mr_pair_t *const *) a, *(mr_pair_t *const *) b);
+}
+
+/* Heap of output candidates whose root is the last one in output order */
+static void topk_sift_down(mr_pair_t **h, uint32_t n, uint32_t i)
+{
+    while (1) {
+        uint32_t l = 2 * i + 1, r = l + 1, m = i;
+        if (l < n && job->compare(h[l], h[m]) > 0) m = l;
+        if (r < n && job->compare(h[r], h[m]) > 0) m = r;
+        if (m == i) return;
+        mr_pair_t *tmp = h[i];
+        h[i] = h[m], h[m] = tmp;
+        i = m;
+    }
+}
+
+/* Turn a reduced partition into its sorted result, keeping only the top_k
+ * pairs if requested. The global top k is always among the union of the top
+ * k of every partition, so partitions can be trimmed independently.
+ */
+static int mr_sort_part(uint32_t tid)
+{
+    struct mr_table *part = &reduced[tid];
+    struct mr_result *res = &results[tid];
+    uint32_t keep = part->n_pairs;
+    if (job->top_k && job->top_k < keep) keep = job->top_k;
+
+    if (!(res->pairs = malloc(sizeof(mr_pair_t *) * (keep ? keep : 1))))
+        return -1;
+
+    uint32_t n = 0;
+    bool heap = job->compare && keep < part->n_pairs;
+    for (uint32_t j = 0; j <= part->mask; j++) {
+        mr_pair_t *p = SLOT(part, j);
+        if (!p->key) continue;
+        if (n < keep) {
+            res->pairs[n++] = p;
+            if (n == keep && heap)
+                for (uint32_t i = keep / 2; i-- > 0;)
+                    topk_sift_down(res->pairs, keep, i);
+        } else if (heap && job->compare(p, res->pairs[0]) < 0) {
+            res->pairs[0] = p;
+            topk_sift_down(res->pairs, keep, 0);
+        }
+    }
+
+    if (job->compare) qsort(res->pairs, n, sizeof(mr_pair_t *), pair_cmp);
+    res->n_pairs = n, res->n_total = part->n_pairs;
+    return 0;
+}
+
+/* Reduce partition @tid of every combiner, then sort it. This is done in
+ * parallel by all threads, each one owning a partition.
+ */
+static int mr_reduce_part(uint32_t tid)
+{
+    struct mr_table *part = &reduced[tid];
+
+    /* Size the partition once, so no rehash happens while reducing */
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < job->n_threads; i++)
+        n += combiners[i].parts[tid].n_pairs;
+    if (mt_init(part, mt_slots_for(n, 16))) return -1;
+
+    for (uint32_t i = 0; i < job->n_threads; i++) {
+        struct mr_table *t = &combiners[i].parts[tid];
+        for (uint32_t j = 0; j <= t->mask; j++) {
+            mr_pair_t *ip = SLOT(t, j);
+            if (!ip->key) continue;
+
+            mr_pair_t *p = mt_lookup(part, ip->hash, ip->key, ip->key_len);
+            if (p->key) {
+                job->combine(p->value, ip->value);
+                continue;
+            }
+            /* The key stays in the arena of the thread which found it */
+            memcpy(p, ip, pair_size);
+            part->n_pairs++;
+        }
+    }
+
+    return mr_sort_part(tid);
+}
+
+int mr_foreach(int (*cb)(const mr_pair_t *pair, void *arg), void *arg)
+{
+    uint32_t budget = job->top_k ? job->top_k : UINT32_MAX;
+
+    if (!job->compare) { /* no order, walk partition after partition */
+        for (uint32_t i = 0; i < n_parts; i++)
+            for (uint32_t j = 0; j < results[i].n_pairs; j++) {
+                if (!budget--) return 0;
+                int ret = cb(results[i].pairs[j], arg);
+                if (ret) return ret;
+            }
+        return 0;
+    }
+
+    /* k-way merge of the sorted partitions over a heap of their heads */
+    uint32_t *heads = malloc(sizeof(uint32_t) * n_parts);
+    uint32_t *pos = calloc(n_parts, sizeof(uint32_t));
+    uint32_t n_heads = 0;
+    int ret = 0;
+    if (!heads || !pos) {
+        free(heads), free(pos);
+        return -1;
+    }
+
+#define HEAD(i) (results[heads[i]].pairs[pos[heads[i]]])
+#define HEAD_LESS(a, b) (job->compare(HEAD(a), HEAD(b)) < 0)
+
+    for (uint32_t i = 0; i < n_parts; i++) {
+        if (!results[i].n_pairs) continue;
+        /* sift up */
+        uint32_t c = n_heads++;
+        heads[c] = i;
+        for (; c && HEAD_LESS(c, (c - 1) / 2); c = (c - 1) / 2) {
+            uint32_t tmp = heads[c];
+            heads[c] = heads[(c - 1) / 2], heads[(c - 1) / 2] = tmp;
+        }
+    }
+
+    while (n_heads && budget--) {
+        if ((ret = cb(HEAD(0), arg))) break;
+
+        if (++pos[heads[0]] == results[heads[0]].n_pairs)
+            heads[0] = heads[--n_heads];
+        /* sift down */
+        for (uint32_t i = 0;;) {
+            uint32_t l = 2 * i + 1, r = l + 1, m = i;
+            if (l < n_heads && HEAD_LESS(l, m)) m = l;
+            if (r < n_heads && HEAD_LESS(r, m)) m = r;
+            if (m == i) break;
+            uint32_t tmp = heads[i];
+            heads[i] = heads[m], heads[m] = tmp;
+            i = m;
+        }
+    }
+
+#undef HEAD_LESS
+#undef HEAD
+
+    free(heads), free(pos);
+    return ret;
+}
+
+uint32_t mr_n_keys(void)
+{
+    uint32_t n = 0;
+    for (uint32_t i = 0; i < n_parts; i++) n += results[i].n_total;
+    return n;
+}
+
+static int fd;
+static off_t file_size;
+
+static __thread char *worker_buffer;
+
+/* In the io_uring mode, worker_buffer holds URING_DEPTH buffers, registered
+ * with the ring along with the file
+ */
+static __thread struct uring worker_ring;
+static __thread bool worker_uring;
+
+#if defined(__linux__)
+#define MMAP_FLAGS (MAP_POPULATE | MAP_PRIVATE)
+#else
+#define MMAP_FLAGS (MAP_PRIVATE)
+#endif
+
+/* Current window of the input, [window_start, window_end). When the window
+ * is mapped, window_base + off is the address of file offset off; otherwise
+ * it is NULL and splits are read with pread().
+ */
+static const char *window_base;
+static off_t window_start, window_end;
+static void *window_map;
+static size_t window_map_len;
+
+/* Initialize file access for worker threads.
+ * Should be called by main thread. Return 0 on success.
+ */
+static inline int fa_init(const char *file)
+{
+    /* Opening file */
+    if ((fd = open(file, O_RDONLY)) < 0) {
+        perror("open");
+        return -1;
+    }
+
+    /* Get file size */
+    if ((file_size = lseek(fd, 0, SEEK_END)) < 0) {
+        perror("lseek");
+        return -1;
+    }
+
+    /* Tell the kernel to read ahead aggressively */
+    if (job->input == MR_INPUT_STREAM)
+        posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+    window_start = window_end = 0;
+    return 0;
+}
+
+/* Release what fa_init set up. Should be called by main thread. */
+static inline int fa_destroy()
+{
+    if (window_map) munmap(window_map, window_map_len);
+    window_map = NULL, window_base = NULL;
+    if (close(fd)) {
+        perror("close");
+        return -1;
+    }
+    return 0;
+}
+
+/* Set up the buffers of a worker thread. Return 0 on success. */
+static int fa_thread_init(void)
+{
+    if (job->input == MR_INPUT_MMAP) return 0;
+    if (job->input != MR_INPUT_URING)
+        return (worker_buffer = malloc(BUFFER_SIZE)) ? 0 : -1;
+
+    size_t size = (size_t) URING_DEPTH * BUFFER_SIZE;
+    if (!(worker_buffer = malloc(size))) return -1;
+    if (uring_init(&worker_ring, URING_DEPTH, 0)) {
+        perror("io_uring_setup"); /* fall back to pread() */
+        return 0;
+    }
+    struct iovec iov = {worker_buffer, size};
+    if (uring_register_buffers(&worker_ring, &iov, 1) ||
+        uring_register_files(&worker_ring, &fd, 1)) {
+        perror("io_uring_register");
+        uring_exit(&worker_ring);
+        return 0;
+    }
+    worker_uring = true;
+    return 0;
+}
+
+static void fa_thread_exit(void)
+{
+    if (worker_uring) uring_exit(&worker_ring);
+    worker_uring = false;
+    free(worker_buffer);
+    worker_buffer = NULL;
+}
+
+/* Return the first offset at or after pos, and before end, where the input
+ * may be cut. It reads from the window when it is mapped, or with pread().
+ */
+static off_t fa_boundary(off_t pos, off_t end, bool mapped)
+{
+    if (pos <= 0) return 0;
+
+    if (mapped) {
+        while (pos < end && !job->splittable(window_base[pos - 1],
+                                             window_base[pos]))
+            pos++;
+        return pos;
+    }
+
+    char buf[64];
+    while (pos < end) {
+        ssize_t n = pread(fd, buf, sizeof(buf), pos - 1);
+        if (n <= 1) return n < 0 ? -1 : end;
+        for (ssize_t i = 1; i < n && pos < end; i++, pos++)
+            if (job->splittable(buf[i - 1], buf[i])) return pos;
+    }
+    return end;
+}
+
+/* Drop the current window and move to the next one, moving its end up to a
+ * boundary. Called by one thread while all the others wait on the barrier.
+ * Return the new window length, 0 at EOF, or -1 on error.
+ */
+static off_t fa_window_next()
+{
+    bool stream = job->input == MR_INPUT_STREAM;
+    off_t start = window_end;
+
+    if (window_map) {
+        if (stream) { /* Do not let consumed windows pile up in memory */
+            madvise(window_map, window_map_len, MADV_DONTNEED);
+            posix_fadvise(fd, window_start, window_end - window_start,
+                          POSIX_FADV_DONTNEED);
+        }
+        munmap(window_map, window_map_len);
+        window_map = NULL, window_base = NULL;
+    }
+
+    window_start = window_end = start;
+    if (start >= file_size) return 0;
+
+    /* Only the streaming mode cuts the file into several windows */
+    off_t end = file_size;
+    if (stream && start + WINDOW_SIZE < file_size &&
+        (end = fa_boundary(start + WINDOW_SIZE, file_size, false)) < 0)
+        return -1;
+    window_end = end;
+
+    if (job->input == MR_INPUT_PREAD || job->input == MR_INPUT_URING)
+        return end - start;
+
+    off_t map_off = start & ~((off_t) sysconf(_SC_PAGESIZE) - 1);
+    window_map_len = end - map_off;
+    window_map = mmap(NULL, window_map_len, PROT_READ,
+                      stream ? MAP_PRIVATE : MMAP_FLAGS, fd, map_off);
+    if (window_map == MAP_FAILED) {
+        window_map = NULL;
+        if (!stream) return end - start; /* fall back to pread() */
+        perror("mmap");
+        return -1;
+    }
+    window_base = (const char *) window_map - map_off;
+
+    if (stream) {
+        madvise(window_map, window_map_len, MADV_SEQUENTIAL);
+        /* Start reading the following window while this one is processed */
+        if (end < file_size)
+            posix_fadvise(fd, end, WINDOW_SIZE, POSIX_FADV_WILLNEED);
+    }
+    return end - start;
+}
+
+/* A split of the current window. Each is wrapped in a work_t scheduled on
+ * the work-stealing deques.
+ */
+struct mr_split {
+    off_t start, end;
+};
+
+static struct mr_split *splits;
+static work_t **tasks;
+static uint32_t n_splits;
+static deque_t *deques;
+static atomic_uint pending;
+static atomic_int mr_err;
+
+static __thread uint32_t mr_tid;
+
+static void tasks_free(void)
+{
+    for (uint32_t i = 0; i < n_splits; i++) free(tasks[i]);
+    free(tasks), free(splits);
+    tasks = NULL, splits = NULL, n_splits = 0;
+}
+
+/* A read of the io_uring mode, into buffer @i of the worker */
+struct mr_read {
+    off_t pos;
+    size_t len, got;
+};
+
+static void uring_read(struct mr_read *rd, uint32_t i)
+{
+    struct io_uring_sqe *sqe = uring_sqe(&worker_ring);
+
+    uring_prep_read_fixed(sqe, 0, worker_buffer + i * BUFFER_SIZE + rd->got,
+                          rd->len - rd->got, rd->pos + rd->got, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->user_data = i;
+}
+
+/* Map split @s, keeping URING_DEPTH reads in flight and all of them going
+ * to the kernel at once. The reads complete in any order, their chunks are
+ * mapped in file order. Return 0 on success.
+ */
+static int uring_split(const struct mr_split *s)
+{
+    struct mr_read rd[URING_DEPTH];
+    uint32_t head = 0, tail = 0; /* reads mapped, and issued */
+    uint32_t in_flight = 0;
+    off_t next = s->start;
+    int err = 0;
+
+    /* Once an error occurred, only wait for the reads into the buffers */
+    while (in_flight || (!err && (head < tail || next < s->end))) {
+        for (; !err && tail - head < URING_DEPTH && next < s->end; tail++) {
+            uint32_t i = tail % URING_DEPTH;
+            size_t len = s->end - next < BUFFER_SIZE ? s->end - next
+                                                     : BUFFER_SIZE;
+            rd[i] = (struct mr_read){next, len, 0};
+            uring_read(&rd[i], i);
+            next += len, in_flight++;
+        }
+        if (uring_submit(&worker_ring, 1) < 0) {
+            perror("io_uring_enter");
+            return -1;
+        }
+
+        struct io_uring_cqe *cqe;
+        for (; (cqe = uring_cqe(&worker_ring)); uring_cqe_seen(&worker_ring)) {
+            uint32_t i = cqe->user_data;
+            in_flight--;
+            if (cqe->res <= 0) {
+                fprintf(stderr, "read: %s\n",
+                        cqe->res ? strerror(-cqe->res) : "end of file");
+                err = -1;
+            } else if (!err && (rd[i].got += cqe->res) < rd[i].len) {
+                uring_read(&rd[i], i); /* a short read, go on */
+                in_flight++;
+            }
+        }
+
+        for (; !err && head < tail; head++) {
+            uint32_t i = head % URING_DEPTH;
+            if (rd[i].got < rd[i].len) break;
+            if (job->map(mr_tid, worker_buffer + i * BUFFER_SIZE, rd[i].len,
+                         rd[i].pos + rd[i].len == s->end))
+                err = -1;
+        }
+    }
+    return err;
+}
+
+static work_t *map_task(work_t *w)
+{
+    struct mr_split *s = w->args[0];
+
+    if (atomic_load_explicit(&mr_err, memory_order_relaxed)) goto out;
+
+    if (window_base) {
+        if (job->map(mr_tid, window_base + s->start, s->end - s->start, true))
+            atomic_store(&mr_err, -1);
+        goto out;
+    }
+
+    if (worker_uring) {
+        if (uring_split(s)) atomic_store(&mr_err, -1);
+        goto out;
+    }
+
+    for (off_t pos = s->start; pos < s->end;) {
+        off_t size = s->end - pos < BUFFER_SIZE ? s->end - pos : BUFFER_SIZE;
+        ssize_t n = pread(fd, worker_buffer, size, pos);
+        if (n <= 0) {
+            perror("pread");
+            atomic_store(&mr_err, -1);
+            break;
+        }
+        pos += n;
+        if (job->map(mr_tid, worker_buffer, n, pos == s->end)) {
+            atomic_store(&mr_err, -1);
+            break;
+        }
+    }
+
+out:
+    atomic_fetch_sub_explicit(&pending, 1, memory_order_release);
+    return NULL;
+}
+
+/* Advance to the next window and cut it into splits. Done by one thread
+ * while the others wait.
+ */
+static void splits_next(void)
+{
+    tasks_free();
+
+    off_t len = fa_window_next();
+    if (len <= 0) {
+        if (len < 0) atomic_store(&mr_err, -1);
+        return;
+    }
+
+    uint32_t n = (len + SPLIT_SIZE - 1) / SPLIT_SIZE;
+    if (n < job->n_threads) n = job->n_threads;
+    if (n > len) n = len;
+
+    splits = malloc(sizeof(struct mr_split) * n);
+    tasks = malloc(sizeof(work_t *) * n);
+    if (!splits || !tasks) {
+        atomic_store(&mr_err, -1);
+        return;
+    }
+
+    off_t start = window_start;
+    for (uint32_t i = 0; i < n && start < window_end; i++) {
+        off_t end = window_start + len / n * (i + 1);
+        if (i == n - 1 || end < start) end = window_end;
+        if ((end = fa_boundary(end, window_end, window_base)) < 0) {
+            atomic_store(&mr_err, -1);
+            break;
+        }
+        if (end == start) continue;
+
+        work_t *w = malloc(sizeof(work_t) + sizeof(void *));
+        if (!w) {
+            atomic_store(&mr_err, -1);
+            break;
+        }
+        splits[n_splits] = (struct mr_split){start, end};
+        w->code = map_task;
+        atomic_init(&w->join_count, 0);
+        w->args[0] = &splits[n_splits];
+        tasks[n_splits++] = w;
+        start = end;
+    }
+    atomic_store(&pending, n_splits);
+}
+
+/* Run our own splits, then steal from the others until the window is done */
+static void run_tasks(uint32_t tid)
+{
+    deque_t *q = &deques[tid];
+    uint32_t victim = tid;
+
+    for (uint32_t i = tid; i < n_splits; i += job->n_threads)
+        push(q, tasks[i]);
+
+    while (atomic_load_explicit(&pending, memory_order_acquire)) {
+        work_t *w = take(q);
+        if (w == EMPTY) {
+            if ((victim = (victim + 1) % job->n_threads) == tid) continue;
+            if ((w = steal(&deques[victim])) == EMPTY || w == ABORT) continue;
+        }
+        while (w) w = w->code(w);
+    }
+}
+
+struct thread_info {
+    pthread_t thread_id; /* ID returned by pthread_create() */
+    int thread_num;      /* Application-defined thread # */
+};
+
+static struct thread_info *tinfo;
+static pthread_barrier_t barrier;
+
+static void *mr_worker(void *arg)
+{
+    uint32_t tid = ((struct thread_info *) arg)->thread_num;
+    mr_tid = tid;
+
+    if ((job->thread_init && job->thread_init(tid)) || fa_thread_init())
+        atomic_store(&mr_err, -1);
+
+    while (1) {
+        /* One thread moves the window once everyone is done with it */
+        if (pthread_barrier_wait(&barrier) == PTHREAD_BARRIER_SERIAL_THREAD)
+            splits_next();
+        pthread_barrier_wait(&barrier);
+        if (!n_splits || atomic_load(&mr_err)) break;
+
+        run_tasks(tid);
+    }
+
+    if (job->thread_exit) job->thread_exit(tid);
+    fa_thread_exit();
+
+    /* Every combiner is complete, reduce our partition */
+    pthread_barrier_wait(&barrier);
+    if (!atomic_load(&mr_err) && mr_reduce_part(tid))
+        atomic_store(&mr_err, -1);
+    return NULL;
+}
+
+int mr_run(struct mr_job *j)
+{
+    job = j;
+    pair_size = (sizeof(mr_pair_t) + job->value_size + 7) & ~(size_t) 7;
+    atomic_init(&mr_err, 0);
+
+    if (pthread_barrier_init(&barrier, NULL, job->n_threads)) {
+        perror("barrier init");
+        return -1;
+    }
+    if (fa_init(job->file_name)) return -1;
+    if (combiners_init()) return -1;
+
+    if (!(deques = malloc(sizeof(deque_t) * job->n_threads))) return -1;
+    for (uint32_t i = 0; i < job->n_threads; i++) init(&deques[i], 64);
+
+    if (!(tinfo = calloc(job->n_threads, sizeof(struct thread_info)))) {
+        perror("calloc");
+        return -1;
+    }
+    for (uint32_t i = 0; i < job->n_threads; i++) {
+        tinfo[i].thread_num = i;
+        if (pthread_create(&tinfo[i].thread_id, NULL, mr_worker, &tinfo[i])) {
+            perror("thread create");
+            return -1;
+        }
+    }
+    for (uint32_t i = 0; i < job->n_threads; i++) {
+        if (pthread_join(tinfo[i].thread_id, NULL)) {
+            perror("thread join");
+            return -1;
+        }
+    }
+    free(tinfo);
+
+    tasks_free();
+    if (fa_destroy()) return -1;
+    if (pthread_barrier_destroy(&barrier)) {
+        perror("barrier destroy");
+        return -1;
+    }
+    return atomic_load(&mr_err);
+}
+
+/* Destroy ressource allocated by mr_run */
+void mr_destroy(void)
+{
+    for (uint32_t i = 0; i < job->n_threads; i++) {
+        for (uint32_t j = 0; j < n_parts; j++)
+            mt_destroy(&combiners[i].parts[j]);
+        free(combiners[i].parts);
+        arena_destroy(&combiners[i].arena);
+    }
+    free(combiners);
+
+    for (uint32_t i = 0; i < n_parts; i++) {
+        mt_destroy(&reduced[i]);
+        free(results[i].pairs);
+    }
+    free(reduced);
+    free(results);
+
+    for (uint32_t i = 0; i < job->n_threads; i++) destroy(&deques[i]);
+    free(deques);
+}
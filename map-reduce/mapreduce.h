@@ -0,0 +1,86 @@
+/* A small MapReduce engine.
+ *
+ * The input file is cut into splits that never break a record, and the splits
+ * are scheduled on a pool of threads through the work-stealing deques of
+ * work-steal/. Map callbacks emit key/value pairs into a per-thread combiner,
+ * a flat hash table folding the values of equal keys with the combine
+ * callback as they are emitted. Combiners are partitioned by key hash, so
+ * that every thread then reduces one partition of all of them and sorts it,
+ * leaving no serial merge step.
+ */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+/* How the input file is accessed:
+ * - MR_INPUT_MMAP: map the whole file up front (falls back to pread on error)
+ * - MR_INPUT_PREAD: pread() every split in BUFFER_SIZE chunks
+ * - MR_INPUT_STREAM: map one WINDOW_SIZE window of the file at a time, split
+ *   it among all threads, and drop it from memory once it is consumed.
+ * - MR_INPUT_URING: read every split with URING_DEPTH reads of BUFFER_SIZE
+ *   in flight on an io_uring of each thread (falls back to pread on error)
+ */
+enum mr_input {
+    MR_INPUT_MMAP,
+    MR_INPUT_PREAD,
+    MR_INPUT_STREAM,
+    MR_INPUT_URING,
+};
+
+/* A key/value pair, as stored in the tables of the engine */
+typedef struct {
+    uint64_t hash;
+    char *key; /* NUL-terminated, NULL for an empty slot */
+    uint32_t key_len;
+    uint32_t reserved;
+    unsigned char value[]; /* value_size bytes, 8-byte aligned */
+} mr_pair_t;
+
+#define MR_VALUE(pair, type) ((type *) (pair)->value)
+
+struct mr_job {
+    const char *file_name;
+    uint32_t n_threads;
+    enum mr_input input;
+    size_t value_size;
+
+    /* Whether the input may be cut between bytes @prev and @next */
+    bool (*splittable)(char prev, char next);
+
+    /* Map a chunk of a split on thread @tid. The chunks of a split are handed
+     * in order to the same thread, and only the last one, flagged by @last, is
+     * guaranteed to end on a record boundary.
+     */
+    int (*map)(uint32_t tid, const char *buf, size_t len, bool last);
+
+    /* Fold value @src into value @dst */
+    void (*combine)(void *dst, const void *src);
+
+    /* Output order, negative if @a goes first. NULL for no particular order */
+    int (*compare)(const mr_pair_t *a, const mr_pair_t *b);
+
+    /* Keep only the first top_k pairs of the output, or all of them if 0 */
+    uint32_t top_k;
+
+    /* Optional hooks run on each worker thread before and after mapping */
+    int (*thread_init)(uint32_t tid);
+    void (*thread_exit)(uint32_t tid);
+};
+
+/* Run the job to completion. Return 0 on success. */
+int mr_run(struct mr_job *job);
+
+/* Emit a pair from the map callback of thread @tid. The key is copied. */
+int mr_emit(uint32_t tid, const char *key, uint32_t key_len, const void *value);
+
+/* Visit the output pairs in order. Stop early if @cb returns non-zero. */
+int mr_foreach(int (*cb)(const mr_pair_t *pair, void *arg), void *arg);
+
+/* Number of distinct keys, including those trimmed by top_k */
+uint32_t mr_n_keys(void);
+
+/* Release everything mr_run allocated */
+void mr_destroy(void);
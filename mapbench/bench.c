@@ -0,0 +1,756 @@
+/* Map benchmark
+ *
+ * Runs the core workloads of YCSB, the Yahoo! Cloud Serving Benchmark of
+ * Cooper et al., against the concurrent maps and sets of this repository:
+ *
+ *   A  50% reads, 50% updates
+ *   B  95% reads, 5% updates
+ *   C  100% reads
+ *   D  95% reads, 5% inserts, the reads going to the latest inserts
+ *   E  95% scans of up to -s keys, 5% inserts
+ *   F  50% reads, 50% read-modify-writes
+ *
+ * The keys are chosen uniformly or along a Zipfian distribution, whose
+ * popular keys are scattered over the key space as in the scrambled
+ * generator of YCSB. Each map is preloaded once per record count, in a
+ * process of its own, the growth of its resident memory giving what an
+ * entry costs, then every
+ * workload, distribution and thread count runs a warmup and several trials
+ * on it, and is printed as a CSV line with:
+ *
+ * - the mean throughput of the threads and its standard deviation across
+ *   the trials,
+ * - percentiles of the latency of the operations, one in LAT_SAMPLE being
+ *   timed,
+ * - the bytes per entry of the preloaded map.
+ */
+
+#define _GNU_SOURCE
+
+#include <ctype.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/wait.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define DEFAULT_DURATION 1000 /* ms */
+#define DEFAULT_WARMUP 200    /* ms */
+#define DEFAULT_TRIALS 3
+#define DEFAULT_SCAN 100 /* longest scan, as in YCSB */
+#define MAX_VALUES 32    /* per dimension of the matrix */
+#define LAT_SAMPLE 16    /* operations per timed one, a power of 2 */
+#define ZIPF_THETA 0.99  /* the Zipfian constant of YCSB */
+
+static const map_ops_t *const all_maps[] = {
+    &hashmap_ops,  &hashmap_cl_ops, &cmap_ops,
+    &rcuhash_ops,  &hp_list_ops,    &skiplist_ops,
+};
+#define N_MAPS (sizeof(all_maps) / sizeof(all_maps[0]))
+
+/* Percents of each operation */
+typedef struct {
+    char name;
+    int read, update, insert, scan, rmw;
+    bool latest; /* the reads favour the keys inserted last */
+} workload_t;
+
+static const workload_t all_workloads[] = {
+    {'A', 50, 50, 0, 0, 0, false}, {'B', 95, 5, 0, 0, 0, false},
+    {'C', 100, 0, 0, 0, 0, false}, {'D', 95, 0, 5, 0, 0, true},
+    {'E', 0, 0, 5, 95, 0, false},  {'F', 50, 0, 0, 0, 50, false},
+};
+#define N_WORKLOADS (sizeof(all_workloads) / sizeof(all_workloads[0]))
+
+enum { DIST_UNIFORM, DIST_ZIPFIAN, N_DISTS };
+static const char *const dist_names[N_DISTS] = {"uniform", "zipfian"};
+
+typedef struct {
+    pthread_cond_t complete;
+    pthread_mutex_t mutex;
+    int count;
+    int crossing;
+} barrier_t;
+
+static void barrier_init(barrier_t *b, int n)
+{
+    pthread_cond_init(&b->complete, NULL);
+    pthread_mutex_init(&b->mutex, NULL);
+    b->count = n;
+    b->crossing = 0;
+}
+
+static void barrier_cross(barrier_t *b)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->crossing++;
+    if (b->crossing < b->count)
+        pthread_cond_wait(&b->complete, &b->mutex);
+    else {
+        pthread_cond_broadcast(&b->complete);
+        b->crossing = 0;
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+/* Log-linear latency histogram, as in list-move */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+static inline int lat_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+static uint64_t lat_value(int b)
+{
+    if (b < LAT_SUB)
+        return b;
+    int shift = b / LAT_SUB - 1;
+    return (uint64_t) (LAT_SUB + b % LAT_SUB) << shift;
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t) ceil(total * p), seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen)
+            return lat_value(b);
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+/* xorshift64*, one per thread */
+static inline uint64_t rng_next(uint64_t *state)
+{
+    uint64_t x = *state;
+    x ^= x >> 12;
+    x ^= x << 25;
+    x ^= x >> 27;
+    *state = x;
+    return x * 0x2545f4914f6cdd1dULL;
+}
+
+static inline double rng_double(uint64_t *state)
+{
+    return (rng_next(state) >> 11) * 0x1.0p-53;
+}
+
+/* Zipfian ranks in [0, n), the most popular first, with the method of
+ * "Quickly Generating Billion-Record Synthetic Databases" by J. Gray et al.
+ * as in YCSB. Computing zeta(n) takes n steps, so it is done once per
+ * record count.
+ */
+typedef struct {
+    uint64_t n;
+    double theta, alpha, zetan, eta, half_pow;
+} zipf_t;
+
+static void zipf_init(zipf_t *z, uint64_t n, double theta)
+{
+    double zeta2 = 1 + pow(0.5, theta), zetan = 0;
+
+    for (uint64_t i = n; i > 0; i--) /* smallest terms first */
+        zetan += 1 / pow((double) i, theta);
+    z->n = n;
+    z->theta = theta;
+    z->alpha = 1 / (1 - theta);
+    z->zetan = zetan;
+    z->eta = (1 - pow(2.0 / n, 1 - theta)) / (1 - zeta2 / zetan);
+    z->half_pow = pow(0.5, theta);
+}
+
+static inline uint64_t zipf_next(const zipf_t *z, double u)
+{
+    double uz = u * z->zetan;
+
+    if (uz < 1)
+        return 0;
+    if (uz < 1 + z->half_pow)
+        return 1;
+    uint64_t rank = z->n * pow(z->eta * u - z->eta + 1, z->alpha);
+    return rank < z->n ? rank : z->n - 1;
+}
+
+typedef struct {
+    const map_ops_t *ops;
+    void *map;
+    const workload_t *workload;
+    int dist;
+    barrier_t *barrier;
+    int id, cpu;
+    uint64_t rng;
+
+    _Atomic unsigned long n_ops; /* of the current trial */
+    uint64_t *lat;
+    uint64_t sum; /* of the values read, so that they are used */
+} __attribute__((aligned(CACHE_LINE))) thread_data_t;
+
+typedef struct {
+    int n;
+    int v[MAX_VALUES];
+} values_t;
+
+typedef struct {
+    const map_ops_t *maps[N_MAPS];
+    int n_maps;
+    const workload_t *workloads[N_WORKLOADS];
+    int n_workloads;
+    values_t dists, records, threads, cpus;
+    int scan;
+    int duration, warmup, trials;
+    int pin;
+} config_t;
+
+static _Atomic bool should_stop = false;
+
+/* The preloaded keys are [0, records), the inserts take the next ones */
+static struct {
+    uint64_t records;
+    zipf_t zipf;
+    int scan;
+    _Alignas(CACHE_LINE) _Atomic uint64_t next_key;
+} keys;
+
+static int statm_fd = -1;
+
+/* Resident memory of the process, in KiB */
+static long rss_kb(void)
+{
+    char buf[128];
+    long size, resident;
+
+    ssize_t len = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+        return 0;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void pin_self(int cpu)
+{
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static inline uint64_t pick_rank(thread_data_t *d, uint64_t n)
+{
+    if (d->dist == DIST_ZIPFIAN)
+        return zipf_next(&keys.zipf, rng_double(&d->rng));
+    return rng_next(&d->rng) % n;
+}
+
+/* The key of the next operation. With "latest", the ranks count back from
+ * the last key handed to an inserter, which may still be on its way in.
+ */
+static inline uint64_t choose_key(thread_data_t *d)
+{
+    if (d->workload->latest) {
+        uint64_t newest =
+            atomic_load_explicit(&keys.next_key, memory_order_relaxed);
+        uint64_t rank = pick_rank(d, newest);
+        return rank < newest ? newest - 1 - rank : 0;
+    }
+    if (d->dist == DIST_ZIPFIAN)
+        return mix64(pick_rank(d, keys.records)) % keys.records;
+    return pick_rank(d, keys.records);
+}
+
+/* Values are odd and below 2^63, so that incrementing one keeps it non-zero */
+static inline uint64_t new_value(thread_data_t *d)
+{
+    return (rng_next(&d->rng) >> 1) | 1;
+}
+
+static void *worker(void *data)
+{
+    thread_data_t *d = (thread_data_t *) data;
+    const map_ops_t *ops = d->ops;
+    const workload_t *w = d->workload;
+    unsigned long n = 0;
+
+    pin_self(d->cpu);
+    if (ops->join)
+        ops->join(d->map);
+
+    barrier_cross(d->barrier);
+    while (!atomic_load_explicit(&should_stop, memory_order_relaxed)) {
+        uint64_t start = n & (LAT_SAMPLE - 1) ? 0 : now_ns(), value;
+        int op = rng_next(&d->rng) % 100;
+
+        if ((op -= w->read) < 0) {
+            if (ops->read(d->map, choose_key(d), &value))
+                d->sum += value;
+        } else if ((op -= w->update) < 0) {
+            ops->update(d->map, choose_key(d), new_value(d));
+        } else if ((op -= w->insert) < 0) {
+            uint64_t key = atomic_fetch_add_explicit(&keys.next_key, 1,
+                                                     memory_order_relaxed);
+            ops->insert(d->map, key, new_value(d));
+        } else if ((op -= w->scan) < 0) {
+            size_t len = 1 + rng_next(&d->rng) % keys.scan;
+            d->sum += ops->scan(d->map, choose_key(d), len);
+        } else {
+            uint64_t key = choose_key(d);
+            if (ops->read(d->map, key, &value))
+                ops->update(d->map, key, value + 1);
+        }
+
+        if (start)
+            d->lat[lat_bucket(now_ns() - start)]++;
+        n++;
+    }
+    atomic_store_explicit(&d->n_ops, n, memory_order_relaxed);
+
+    if (ops->leave)
+        ops->leave(d->map);
+    return NULL;
+}
+
+/* Run the threads for "duration" ms, return the operations per second or a
+ * negative value on failure.
+ */
+static double run_trial(pthread_t *threads,
+                        thread_data_t *data,
+                        int n_threads,
+                        int duration)
+{
+    barrier_t barrier;
+
+    barrier_init(&barrier, n_threads + 1);
+    should_stop = false;
+    for (int i = 0; i < n_threads; i++) {
+        data[i].n_ops = 0;
+        data[i].barrier = &barrier;
+        if (pthread_create(&threads[i], NULL, worker, &data[i])) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return -1;
+        }
+    }
+
+    barrier_cross(&barrier);
+
+    uint64_t start = now_ns();
+    struct timespec timeout = {duration / 1000, (duration % 1000) * 1000000L};
+    while (nanosleep(&timeout, &timeout) && errno == EINTR)
+        ;
+    should_stop = true;
+
+    unsigned long n_ops = 0;
+    for (int i = 0; i < n_threads; i++) {
+        if (pthread_join(threads[i], NULL)) {
+            fprintf(stderr, "Failed to join child thread %d\n", i);
+            return -1;
+        }
+        n_ops += data[i].n_ops;
+    }
+    return n_ops * 1e9 / (now_ns() - start);
+}
+
+static void mean_stddev(const double *v, int n, double *mean, double *stddev)
+{
+    double m = 0, var = 0;
+
+    for (int i = 0; i < n; i++)
+        m += v[i];
+    m /= n;
+    for (int i = 0; i < n; i++)
+        var += (v[i] - m) * (v[i] - m);
+    if (n > 1)
+        var /= n - 1;
+    *mean = m;
+    *stddev = sqrt(var);
+}
+
+/* Run one point of the matrix on the preloaded map, and print its CSV line */
+static int run_point(const config_t *cfg,
+                     const map_ops_t *ops,
+                     void *map,
+                     const workload_t *workload,
+                     int dist,
+                     int n_threads,
+                     double bytes_per_entry)
+{
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    thread_data_t *data =
+        aligned_alloc(CACHE_LINE, n_threads * sizeof(thread_data_t));
+    uint64_t *hist = calloc(LAT_BUCKETS, sizeof(uint64_t));
+    double *mops = calloc(cfg->trials, sizeof(double));
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN);
+    int ret = -1;
+
+    if (data)
+        memset(data, 0, n_threads * sizeof(thread_data_t));
+    if (!threads || !data || !hist || !mops) {
+        fprintf(stderr, "Failed to allocate the benchmark data\n");
+        goto out;
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        thread_data_t *d = &data[i];
+
+        if (!(d->lat = calloc(LAT_BUCKETS, sizeof(uint64_t)))) {
+            fprintf(stderr, "Failed to allocate thread data %d\n", i);
+            goto out;
+        }
+        d->ops = ops;
+        d->map = map;
+        d->workload = workload;
+        d->dist = dist;
+        d->id = i;
+        d->rng = mix64(i + 1);
+        if (!cfg->pin)
+            d->cpu = -1;
+        else if (cfg->cpus.n)
+            d->cpu = cfg->cpus.v[i % cfg->cpus.n];
+        else
+            d->cpu = i % n_cpus;
+    }
+
+    if (cfg->warmup && run_trial(threads, data, n_threads, cfg->warmup) < 0)
+        goto out;
+    for (int i = 0; i < n_threads; i++)
+        memset(data[i].lat, 0, LAT_BUCKETS * sizeof(uint64_t));
+    for (int t = 0; t < cfg->trials; t++) {
+        double ops_per_sec = run_trial(threads, data, n_threads,
+                                       cfg->duration);
+        if (ops_per_sec < 0)
+            goto out;
+        mops[t] = ops_per_sec / 1e6;
+    }
+
+    double mean, stddev;
+    mean_stddev(mops, cfg->trials, &mean, &stddev);
+
+    uint64_t total = 0;
+    for (int i = 0; i < n_threads; i++) {
+        for (int b = 0; b < LAT_BUCKETS; b++)
+            hist[b] += data[i].lat[b];
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+
+    printf("%s,%c,%s,%lu,%d,%d,%.3f,%.3f,%lu,%lu,%lu,%lu,%.1f\n", ops->name,
+           workload->name, dist_names[dist], keys.records, n_threads,
+           cfg->trials, mean, stddev, total, lat_percentile(hist, total, 0.5),
+           lat_percentile(hist, total, 0.99),
+           lat_percentile(hist, total, 0.999), bytes_per_entry);
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (int i = 0; i < n_threads && data; i++)
+        free(data[i].lat);
+    free(mops);
+    free(hist);
+    free(data);
+    free(threads);
+    return ret;
+}
+
+/* Preload a fresh map with "records" keys, and run every workload,
+ * distribution and thread count on it. The keys go in from the last, which
+ * is the cheap end of the ordered lists.
+ */
+static int run_map(const config_t *cfg, const map_ops_t *ops)
+{
+    long base = rss_kb();
+
+    void *map = ops->create(keys.records);
+    if (!map) {
+        fprintf(stderr, "Failed to create the %s map\n", ops->name);
+        return -1;
+    }
+    if (ops->join)
+        ops->join(map);
+    for (uint64_t key = keys.records; key-- > 0;)
+        ops->insert(map, key, mix64(key) >> 1 | 1);
+    if (ops->leave)
+        ops->leave(map);
+    double bytes_per_entry = (rss_kb() - base) * 1024.0 / keys.records;
+    keys.next_key = keys.records;
+
+    int ret = 0;
+    for (int w = 0; w < cfg->n_workloads && !ret; w++) {
+        const workload_t *workload = cfg->workloads[w];
+        if (workload->scan && !ops->scan)
+            continue;
+        for (int z = 0; z < cfg->dists.n && !ret; z++)
+            for (int t = 0; t < cfg->threads.n && !ret; t++)
+                ret = run_point(cfg, ops, map, workload, cfg->dists.v[z],
+                                cfg->threads.v[t], bytes_per_entry);
+    }
+
+    ops->destroy(map);
+    return ret;
+}
+
+/* Run run_map() in a child process. The memory the previous maps gave back
+ * stays with the allocator, and would be reused by the next map instead of
+ * growing the resident memory.
+ */
+static int run_map_isolated(const config_t *cfg, const map_ops_t *ops)
+{
+    int status;
+
+    fflush(stdout);
+    pid_t pid = fork();
+    if (pid < 0) {
+        perror("fork");
+        return -1;
+    }
+    if (pid == 0) {
+        /* /proc/self of the parent was opened, look at the child's own */
+        close(statm_fd);
+        if ((statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC)) < 0) {
+            perror("/proc/self/statm");
+            _exit(EXIT_FAILURE);
+        }
+        int ret = run_map(cfg, ops);
+        fflush(stdout);
+        _exit(ret ? EXIT_FAILURE : EXIT_SUCCESS);
+    }
+
+    if (waitpid(pid, &status, 0) < 0) {
+        perror("waitpid");
+        return -1;
+    }
+    return WIFEXITED(status) && WEXITSTATUS(status) == EXIT_SUCCESS ? 0 : -1;
+}
+
+/* Parse a comma separated list of integers within [min, max], each one
+ * possibly followed by K, M or G for a power of 1000.
+ */
+static int parse_values(values_t *values, const char *s, int min, int max)
+{
+    static const char units[] = "KMG";
+    char *end;
+
+    values->n = 0;
+    do {
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (errno || end == s)
+            return -1;
+        const char *unit = *end ? strchr(units, toupper(*end)) : NULL;
+        if (unit) {
+            for (long i = unit - units; i >= 0 && v <= max; i--)
+                v *= 1000;
+            end++;
+        }
+        if (v < min || v > max || values->n == MAX_VALUES)
+            return -1;
+        values->v[values->n++] = v;
+        s = end + 1;
+    } while (*end == ',');
+
+    return *end ? -1 : 0;
+}
+
+static int parse_int(int *value, const char *s, int min)
+{
+    values_t values;
+
+    if (parse_values(&values, s, min, INT_MAX) || values.n != 1)
+        return -1;
+    *value = values.v[0];
+    return 0;
+}
+
+/* Find each name of the comma separated list "s" among those of "names",
+ * or take them all for "all", and store their indexes in "found". Return
+ * how many there are, or -1 on error.
+ */
+static int parse_names(int *found,
+                       int max,
+                       const char *s,
+                       const char *(*name_of)(int i),
+                       int n_names)
+{
+    int n = 0;
+
+    while (*s) {
+        size_t len = strcspn(s, ","), k;
+
+        if (len == 3 && !strncasecmp(s, "all", 3)) {
+            for (k = 0; k < (size_t) n_names && n < max; k++)
+                found[n++] = k;
+        } else {
+            for (k = 0; k < (size_t) n_names; k++) {
+                if (strlen(name_of(k)) == len &&
+                    !strncasecmp(s, name_of(k), len))
+                    break;
+            }
+            if (k == (size_t) n_names || n == max)
+                return -1;
+            found[n++] = k;
+        }
+        s += len;
+        if (*s == ',' && !*++s)
+            return -1;
+    }
+    return n ? n : -1;
+}
+
+static const char *map_name(int i)
+{
+    return all_maps[i]->name;
+}
+
+static const char *workload_name(int i)
+{
+    static char names[N_WORKLOADS][2];
+    names[i][0] = all_workloads[i].name;
+    return names[i];
+}
+
+static const char *dist_name(int i)
+{
+    return dist_names[i];
+}
+
+static int set_option(config_t *cfg, int opt, const char *arg)
+{
+    int found[MAX_VALUES], n;
+
+    switch (opt) {
+    case 'm':
+        if ((n = parse_names(found, N_MAPS, arg, map_name, N_MAPS)) < 0)
+            return -1;
+        for (cfg->n_maps = 0; cfg->n_maps < n; cfg->n_maps++)
+            cfg->maps[cfg->n_maps] = all_maps[found[cfg->n_maps]];
+        return 0;
+    case 'y':
+        if ((n = parse_names(found, N_WORKLOADS, arg, workload_name,
+                             N_WORKLOADS)) < 0)
+            return -1;
+        for (cfg->n_workloads = 0; cfg->n_workloads < n; cfg->n_workloads++)
+            cfg->workloads[cfg->n_workloads] =
+                &all_workloads[found[cfg->n_workloads]];
+        return 0;
+    case 'z':
+        if ((n = parse_names(cfg->dists.v, N_DISTS, arg, dist_name,
+                             N_DISTS)) < 0)
+            return -1;
+        cfg->dists.n = n;
+        return 0;
+    case 'r':
+        return parse_values(&cfg->records, arg, 1, INT_MAX);
+    case 't':
+        return parse_values(&cfg->threads, arg, 1, 1024);
+    case 's':
+        return parse_int(&cfg->scan, arg, 1);
+    case 'a':
+        return parse_values(&cfg->cpus, arg, 0, CPU_SETSIZE - 1);
+    case 'd':
+        return parse_int(&cfg->duration, arg, 1);
+    case 'w':
+        return parse_int(&cfg->warmup, arg, 0);
+    case 'n':
+        return parse_int(&cfg->trials, arg, 1);
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-m maps] [-y workloads] [-z distributions]\n"
+            "       [-r records] [-t threads] [-s scan] [-a cpus] [-d ms]\n"
+            "       [-w ms] [-n trials] [-P] [-H]\n"
+            "  -m, -y, -z, -r and -t take comma separated lists, the\n"
+            "  benchmark runs every combination of them, except the scans\n"
+            "  of E on the unordered maps. The workloads are A to F of\n"
+            "  YCSB, the distributions uniform and zipfian, -r the keys\n"
+            "  preloaded, with a K, M or G suffix, and -s the longest scan.\n"
+            "  The threads are pinned round robin to the CPUs given with\n"
+            "  -a, or to all of them; -P leaves them unpinned, -H omits the\n"
+            "  CSV header. The maps are:",
+            prog);
+    for (size_t k = 0; k < N_MAPS; k++)
+        fprintf(stderr, " %s", all_maps[k]->name);
+    fprintf(stderr, "\n");
+}
+
+int main(int argc, char *argv[])
+{
+    config_t cfg = {
+        .dists = {2, {DIST_UNIFORM, DIST_ZIPFIAN}},
+        .records = {1, {100000}},
+        .threads = {1, {1}},
+        .scan = DEFAULT_SCAN,
+        .duration = DEFAULT_DURATION,
+        .warmup = DEFAULT_WARMUP,
+        .trials = DEFAULT_TRIALS,
+        .pin = 1,
+    };
+    bool header = true;
+    int opt;
+
+    set_option(&cfg, 'm', "all");
+    set_option(&cfg, 'y', "all");
+    while ((opt = getopt(argc, argv, "m:y:z:r:t:s:a:d:w:n:PH")) != -1) {
+        if (opt == 'P')
+            cfg.pin = 0;
+        else if (opt == 'H')
+            header = false;
+        else if (opt == '?' || set_option(&cfg, opt, optarg)) {
+            if (opt != '?')
+                fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/proc/self/statm");
+        return EXIT_FAILURE;
+    }
+
+    if (header)
+        printf("map,workload,distribution,records,threads,trials,mops_mean,"
+               "mops_stddev,ops_timed,p50_ns,p99_ns,p999_ns,"
+               "bytes_per_entry\n");
+    keys.scan = cfg.scan;
+    for (int r = 0; r < cfg.records.n; r++) {
+        keys.records = cfg.records.v[r];
+        zipf_init(&keys.zipf, keys.records, ZIPF_THETA);
+        for (int m = 0; m < cfg.n_maps; m++)
+            if (run_map_isolated(&cfg, cfg.maps[m]))
+                return EXIT_FAILURE;
+    }
+
+    close(statm_fd);
+    return EXIT_SUCCESS;
+}
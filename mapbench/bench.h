@@ -0,0 +1,57 @@
+#ifndef MAPBENCH_H
+#define MAPBENCH_H
+
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+
+#define CACHE_LINE (64)
+
+/* A map under test, from 64-bit keys to non-zero 64-bit values. The sets,
+ * which have no values, only keep the keys and report a value of 1.
+ *
+ * create() knows how many keys will be preloaded, for the maps that are
+ * sized up front. Keys are below UINT64_MAX - 1, so that they can be stored
+ * with an offset by the maps that reserve some keys.
+ */
+typedef struct {
+    const char *name;
+    void *(*create)(uint64_t records);
+    void (*destroy)(void *map);
+
+    /* Optional, around the use of the map by each thread */
+    void (*join)(void *map);
+    void (*leave)(void *map);
+
+    /* The value of 'key' in 'value', false if the key is not in the map */
+    bool (*read)(void *map, uint64_t key, uint64_t *value);
+
+    /* Replace the value of a key that is in the map, false if it is not */
+    bool (*update)(void *map, uint64_t key, uint64_t value);
+
+    /* Add a key that is not in the map yet */
+    void (*insert)(void *map, uint64_t key, uint64_t value);
+
+    /* Optional, for the ordered maps: visit the keys of [key, key + n) that
+     * are in the map, and return how many there were.
+     */
+    size_t (*scan)(void *map, uint64_t key, size_t n);
+} map_ops_t;
+
+extern const map_ops_t hashmap_ops, hashmap_cl_ops;
+extern const map_ops_t cmap_ops;
+extern const map_ops_t rcuhash_ops;
+extern const map_ops_t hp_list_ops, skiplist_ops;
+
+/* A 64-bit mix, for the maps that leave the hashing to the user */
+static inline uint64_t mix64(uint64_t x)
+{
+    x ^= x >> 33;
+    x *= 0xff51afd7ed558ccdULL;
+    x ^= x >> 33;
+    x *= 0xc4ceb9fe1a85ec53ULL;
+    x ^= x >> 33;
+    return x;
+}
+
+#endif
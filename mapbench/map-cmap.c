@@ -0,0 +1,98 @@
+/* The cmap of cmap, over nodes that embed the key and its value. The
+ * updates store the value in place, so that no node is ever removed while
+ * the benchmark runs, only once it is over.
+ */
+#include <stdatomic.h>
+#include <stdlib.h>
+
+#include "cmap.h"
+
+#include "bench.h"
+
+struct entry {
+    struct cmap_node node;
+    uint64_t key;
+    _Atomic uint64_t value;
+};
+
+static inline uint32_t key_hash(uint64_t key)
+{
+    return mix64(key);
+}
+
+static void *cmap_create(uint64_t records)
+{
+    struct cmap *cmap = malloc(sizeof(struct cmap));
+    if (cmap)
+        cmap_init(cmap);
+    return cmap;
+}
+
+/* The cursor is past a node before the body of the loop sees it. The nodes
+ * are removed before they are freed, as cmap_destroy() finishes a pending
+ * migration, which walks the nodes left in the map.
+ */
+static void cmap_bench_destroy(void *map)
+{
+    struct cmap *cmap = map;
+    struct cmap_state state = cmap_state_acquire(cmap);
+    struct entry *e;
+
+    MAP_FOREACH (e, node, state) {
+        cmap_remove(cmap, &e->node);
+        free(e);
+    }
+    cmap_state_release(state);
+    cmap_destroy(cmap);
+    free(cmap);
+}
+
+static struct entry *cmap_find(struct cmap *cmap,
+                               struct cmap_state state,
+                               uint64_t key)
+{
+    struct entry *e;
+
+    MAP_FOREACH_WITH_HASH (e, node, key_hash(key), state) {
+        if (e->key == key)
+            return e;
+    }
+    return NULL;
+}
+
+static bool cmap_read(void *map, uint64_t key, uint64_t *value)
+{
+    struct cmap_state state = cmap_state_acquire(map);
+    struct entry *e = cmap_find(map, state, key);
+    if (e)
+        *value = atomic_load_explicit(&e->value, memory_order_relaxed);
+    cmap_state_release(state);
+    return e;
+}
+
+static bool cmap_update(void *map, uint64_t key, uint64_t value)
+{
+    struct cmap_state state = cmap_state_acquire(map);
+    struct entry *e = cmap_find(map, state, key);
+    if (e)
+        atomic_store_explicit(&e->value, value, memory_order_relaxed);
+    cmap_state_release(state);
+    return e;
+}
+
+static void cmap_bench_insert(void *map, uint64_t key, uint64_t value)
+{
+    struct entry *e = xmalloc(sizeof(struct entry));
+    e->key = key;
+    atomic_init(&e->value, value);
+    cmap_insert(map, &e->node, key_hash(key));
+}
+
+const map_ops_t cmap_ops = {
+    .name = "cmap",
+    .create = cmap_create,
+    .destroy = cmap_bench_destroy,
+    .read = cmap_read,
+    .update = cmap_update,
+    .insert = cmap_bench_insert,
+};
@@ -0,0 +1,102 @@
+/* The split-ordered hashmap of hashmap and its cache-line variant. Both take
+ * pointers to the keys and hash them with the callbacks of the user, so the
+ * keys are stored in the pointers themselves, offset by one since the
+ * dummy nodes of the split-ordered lists have a NULL key.
+ */
+#include "hashmap.h"
+#include "hashmap_cl.h"
+#include "ebr.h"
+
+#include "bench.h"
+
+static inline const void *key_ptr(uint64_t key)
+{
+    return (const void *) (uintptr_t) (key + 1);
+}
+
+static uint8_t key_cmp(const void *x, const void *y)
+{
+    return x != y;
+}
+
+static uint64_t key_hash(const void *key)
+{
+    return mix64((uintptr_t) key);
+}
+
+/* Updates replace the node, which is retired to EBR */
+static void *hashmap_create(uint64_t records)
+{
+    if (ebr_init())
+        return NULL;
+    return hashmap_new(records, key_cmp, key_hash);
+}
+
+static void hashmap_destroy(void *map)
+{
+    hashmap_free(map);
+    ebr_exit();
+}
+
+static bool hashmap_read(void *map, uint64_t key, uint64_t *value)
+{
+    void *v = hashmap_get(map, key_ptr(key));
+    *value = (uintptr_t) v;
+    return v;
+}
+
+static bool hashmap_update(void *map, uint64_t key, uint64_t value)
+{
+    return hashmap_put(map, key_ptr(key), (void *) (uintptr_t) value);
+}
+
+static void hashmap_insert(void *map, uint64_t key, uint64_t value)
+{
+    hashmap_put(map, key_ptr(key), (void *) (uintptr_t) value);
+}
+
+const map_ops_t hashmap_ops = {
+    .name = "hashmap",
+    .create = hashmap_create,
+    .destroy = hashmap_destroy,
+    .read = hashmap_read,
+    .update = hashmap_update,
+    .insert = hashmap_insert,
+};
+
+/* Sized for the preloaded keys, the inserts go to overflow lines */
+static void *hashmap_cl_create(uint64_t records)
+{
+    return hashmap_cl_new(records / HASHMAP_CL_SLOTS, key_cmp, key_hash);
+}
+
+static void hashmap_cl_destroy(void *map)
+{
+    hashmap_cl_free(map);
+}
+
+static bool hashmap_cl_read(void *map, uint64_t key, uint64_t *value)
+{
+    void *v = hashmap_cl_get(map, key_ptr(key));
+    *value = (uintptr_t) v;
+    return v;
+}
+
+static bool hashmap_cl_update(void *map, uint64_t key, uint64_t value)
+{
+    return hashmap_cl_put(map, key_ptr(key), (void *) (uintptr_t) value);
+}
+
+static void hashmap_cl_insert(void *map, uint64_t key, uint64_t value)
+{
+    hashmap_cl_put(map, key_ptr(key), (void *) (uintptr_t) value);
+}
+
+const map_ops_t hashmap_cl_ops = {
+    .name = "hashmap-cl",
+    .create = hashmap_cl_create,
+    .destroy = hashmap_cl_destroy,
+    .read = hashmap_cl_read,
+    .update = hashmap_cl_update,
+    .insert = hashmap_cl_insert,
+};
@@ -0,0 +1,58 @@
+/* The ordered list of hp_list, with its test program out of the way. It is
+ * a set, so an update deletes the key and inserts it back, and the keys are
+ * offset by one, past the head of the list. It is built with fewer warnings
+ * than here.
+ */
+#define main hp_list_main
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include "../hp_list/main.c"
+#pragma GCC diagnostic pop
+#undef main
+
+#include "bench.h"
+
+static void *hp_list_create(uint64_t records)
+{
+    return list_new();
+}
+
+static void hp_list_destroy(void *map)
+{
+    list_destroy(map);
+}
+
+static bool hp_list_read(void *map, uint64_t key, uint64_t *value)
+{
+    list_t *list = map;
+    list_node_t *curr, *next;
+    atomic_uintptr_t *prev;
+    list_key_t k = key + 1;
+
+    bool found = __list_find(list, &k, &prev, &curr, &next);
+    list_hp_clear(list->hp);
+    *value = 1;
+    return found;
+}
+
+static bool hp_list_update(void *map, uint64_t key, uint64_t value)
+{
+    if (!list_delete(map, key + 1))
+        return false;
+    list_insert(map, key + 1);
+    return true;
+}
+
+static void hp_list_insert(void *map, uint64_t key, uint64_t value)
+{
+    list_insert(map, key + 1);
+}
+
+const map_ops_t hp_list_ops = {
+    .name = "hp-list",
+    .create = hp_list_create,
+    .destroy = hp_list_destroy,
+    .read = hp_list_read,
+    .update = hp_list_update,
+    .insert = hp_list_insert,
+};
@@ -0,0 +1,106 @@
+/* The RCU hash table of rcu-list, over nodes that embed the key and its
+ * value. The updates store the value in place and no node is removed, so
+ * that the readers only need their read-side critical sections; the table
+ * grows under them as the inserts come.
+ */
+#include <stdatomic.h>
+
+#include "../rcu-list/rcuhash.h"
+
+#include "bench.h"
+
+struct entry {
+    uint64_t key;
+    _Atomic uint64_t value;
+    struct rcu_hash_node hnode;
+};
+
+static void *rcuhash_create(uint64_t records)
+{
+    struct rcu_hash *ht = malloc(sizeof(struct rcu_hash));
+    if (ht)
+        rcu_hash_init(ht, records, true);
+    return ht;
+}
+
+/* No reader is left, walk the chains directly */
+static void rcuhash_destroy(void *map)
+{
+    struct rcu_hash *ht = map;
+
+    for (unsigned long b = 0; b < ht->table->size; b++) {
+        struct hlist_node *n = ht->table->buckets[b].first, *next;
+        for (; n; n = next) {
+            next = n->next;
+            free(container_of(n, struct entry, hnode.node));
+        }
+    }
+    rcu_hash_destroy(ht);
+    free(ht);
+}
+
+static void rcuhash_join(void *map)
+{
+    rcu_init();
+}
+
+static void rcuhash_leave(void *map)
+{
+    rcu_exit();
+}
+
+static struct entry *rcuhash_find(struct rcu_hash *ht, uint64_t key)
+{
+    struct rcu_hash_table *tbl = rcu_hash_table_rcu(ht);
+    struct entry *e;
+
+    rcu_hash_for_each_possible_rcu(tbl, e, hnode, mix64(key))
+    {
+        if (e->key == key)
+            return e;
+    }
+    return NULL;
+}
+
+static bool rcuhash_read(void *map, uint64_t key, uint64_t *value)
+{
+    rcu_read_lock();
+    struct entry *e = rcuhash_find(map, key);
+    if (e)
+        *value = atomic_load_explicit(&e->value, memory_order_relaxed);
+    rcu_read_unlock();
+    return e;
+}
+
+static bool rcuhash_update(void *map, uint64_t key, uint64_t value)
+{
+    rcu_read_lock();
+    struct entry *e = rcuhash_find(map, key);
+    if (e)
+        atomic_store_explicit(&e->value, value, memory_order_relaxed);
+    rcu_read_unlock();
+    return e;
+}
+
+static void rcuhash_insert(void *map, uint64_t key, uint64_t value)
+{
+    struct entry *e = malloc(sizeof(struct entry));
+    if (!e) {
+        fprintf(stderr, "rcuhash_insert failed\n");
+        abort();
+    }
+    e->key = key;
+    atomic_init(&e->value, value);
+    rcu_hash_add(map, &e->hnode, mix64(key));
+}
+
+const map_ops_t rcuhash_ops = {
+    .name = "rcuhash",
+    .create = rcuhash_create,
+    .destroy = rcuhash_destroy,
+    .join = rcuhash_join,
+    .leave = rcuhash_leave,
+    .read = rcuhash_read,
+    .update = rcuhash_update,
+    .insert = rcuhash_insert,
+};
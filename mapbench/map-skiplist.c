@@ -0,0 +1,61 @@
+/* The skip list of hp_list, with its test program out of the way. It is a
+ * set, so an update deletes the key and inserts it back, and the keys are
+ * offset by one, past the head of the list. Being ordered, it also runs the
+ * scans of workload E.
+ */
+#define main skiplist_main
+#include "../hp_list/skiplist.c"
+#undef main
+
+#include "bench.h"
+
+static void *skiplist_bench_create(uint64_t records)
+{
+    return skiplist_new();
+}
+
+static void skiplist_bench_destroy(void *map)
+{
+    skiplist_destroy(map);
+}
+
+static bool skiplist_read(void *map, uint64_t key, uint64_t *value)
+{
+    *value = 1;
+    return skiplist_contains(map, key + 1);
+}
+
+static bool skiplist_update(void *map, uint64_t key, uint64_t value)
+{
+    if (!skiplist_delete(map, key + 1))
+        return false;
+    skiplist_insert(map, key + 1);
+    return true;
+}
+
+static void skiplist_bench_insert(void *map, uint64_t key, uint64_t value)
+{
+    skiplist_insert(map, key + 1);
+}
+
+static void scan_key(skiplist_key_t key, void *arg)
+{
+    (*(size_t *) arg)++;
+}
+
+static size_t skiplist_scan(void *map, uint64_t key, size_t n)
+{
+    size_t seen = 0;
+    skiplist_range(map, key + 1, key + n, scan_key, &seen);
+    return seen;
+}
+
+const map_ops_t skiplist_ops = {
+    .name = "skiplist",
+    .create = skiplist_bench_create,
+    .destroy = skiplist_bench_destroy,
+    .read = skiplist_read,
+    .update = skiplist_update,
+    .insert = skiplist_bench_insert,
+    .scan = skiplist_scan,
+};
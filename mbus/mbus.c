@@ -1,9 +1,15 @@
 #include <limits.h>
+#include <pthread.h>
+#include <stdatomic.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 
+#include "ebr.h"
+#include "hashmap.h"
+
 #define BUS_DEFAULT_CLIENTS 128
 #define BUS_MAX_CLIENTS UINT_MAX
 
@@ -22,15 +28,102 @@ typedef struct {
     void *ctx;
 } bus_client_t;
 
+/* Async mode: each message waits in the inbox of its client, a lock-free
+ * Vyukov MPSC queue, until a dispatcher thread takes it out. The inbox is
+ * queued for the dispatchers by the sender that sets "scheduled", so that
+ * only one of them drains it at a time, in order.
+ */
+typedef struct bus_msg {
+    struct bus_msg *_Atomic next;
+    void *msg;
+} bus_msg_t;
+
+typedef struct bus_inbox {
+    bus_msg_t *_Atomic head; /* where the senders push */
+    bus_msg_t *tail;         /* where the dispatcher pops */
+    bus_msg_t stub;
+    atomic_bool scheduled;
+    struct bus_inbox *next_ready;
+    bus_client_id_t id;
+} bus_inbox_t;
+
+#define BUS_DISPATCH_BATCH 64 /* messages delivered before the next inbox */
+
+typedef struct {
+    pthread_mutex_t lock; /* protects the ready list and "stop" */
+    pthread_cond_t cond;
+    bus_inbox_t *ready_head, **ready_tail;
+    bool stop;
+    unsigned int n_workers;
+    pthread_t workers[];
+} bus_async_t;
+
+/* The clients are allocated by chunks, on the first registration of one of
+ * their ids, so that a large bus only pays for the ids in use. A chunk is
+ * never freed before the bus.
+ */
+#define BUS_CHUNK_CLIENTS 128
+
 typedef struct {
-    bus_client_t *clients;
+    _Atomic uint64_t registered[BUS_CHUNK_CLIENTS / 64]; /* bitmap of the ids */
+    bus_client_t clients[BUS_CHUNK_CLIENTS];
+    bus_inbox_t inboxes[]; /* async mode only */
+} bus_chunk_t;
+
+#define BUS_N_CHUNKS(n) \
+    ((n) / BUS_CHUNK_CLIENTS + ((n) % BUS_CHUNK_CLIENTS != 0))
+
+/* Subscribers of a topic, replaced as a whole on every change so that
+ * bus_publish() reads them without a lock. The old arrays are reclaimed with
+ * EBR.
+ */
+typedef struct {
+    unsigned int n;
+    bus_client_id_t ids[];
+} bus_subs_t;
+
+typedef struct bus_topic {
+    char *name;
+    bus_subs_t *_Atomic subs;
+    struct bus_topic *next; /* all the topics, for bus_free() */
+} bus_topic_t;
+
+typedef struct {
+    bus_chunk_t *_Atomic *chunks;
     const unsigned int n_clients;
+    bus_async_t *async; /* NULL in sync mode */
+
+    hashmap_t *topics;           /* name to bus_topic_t */
+    pthread_mutex_t topics_lock; /* serializes the subscription changes */
+    bus_topic_t *topic_list;
 } bus_t;
 
+static uint8_t topic_cmp(const void *x, const void *y)
+{
+    return strcmp(x, y) != 0;
+}
+
+/* FNV-1a */
+static uint64_t topic_hash(const void *key)
+{
+    uint64_t h = 0xcbf29ce484222325ULL;
+    for (const unsigned char *p = key; *p; p++)
+        h = (h ^ *p) * 0x100000001b3ULL;
+    return h;
+}
+
+static pthread_once_t ebr_once = PTHREAD_ONCE_INIT;
+
+static void bus_ebr_init(void)
+{
+    ebr_init();
+}
+
 /*
- * Allocate a new bus. If @n_clients is non-zero, it allocates space for
- * specific number of clients; otherwise, it uses BUS_DEFAULT_CLIENTS.
- * @n_clients can not be greater than BUS_MAX_CLIENTS. Returns true on success.
+ * Allocate a new bus. If @n_clients is non-zero, it has room for that many
+ * clients; otherwise, it uses BUS_DEFAULT_CLIENTS. @n_clients can not be
+ * greater than BUS_MAX_CLIENTS. The clients are only allocated as their ids
+ * get registered. Returns true on success.
  */
 bool __attribute__((warn_unused_result))
 bus_new(bus_t **bus, unsigned int n_clients)
@@ -45,15 +138,216 @@ bus_new(bus_t **bus, unsigned int n_clients)
     /* Initialize bus struct */
     *(unsigned int *) &b->n_clients =
         !n_clients ? BUS_DEFAULT_CLIENTS : n_clients;
-    if (!(b->clients = calloc(b->n_clients, sizeof(bus_client_t)))) {
+    b->async = NULL;
+    b->topic_list = NULL;
+    if (!(b->chunks =
+              calloc(BUS_N_CHUNKS(b->n_clients), sizeof(bus_chunk_t *)))) {
         free(b);
         return false;
     }
+    pthread_once(&ebr_once, bus_ebr_init);
+    if (!(b->topics = hashmap_new(16, topic_cmp, topic_hash))) {
+        free(b->chunks);
+        free(b);
+        return false;
+    }
+    pthread_mutex_init(&b->topics_lock, NULL);
 
     *bus = b;
     return true;
 }
 
+static inline bus_chunk_t *bus_chunk(bus_t *bus, bus_client_id_t id)
+{
+    return atomic_load_explicit(&bus->chunks[id / BUS_CHUNK_CLIENTS],
+                                memory_order_acquire);
+}
+
+static inline bus_client_t *chunk_client(bus_chunk_t *chunk,
+                                         bus_client_id_t id)
+{
+    return &chunk->clients[id % BUS_CHUNK_CLIENTS];
+}
+
+static inline bus_inbox_t *chunk_inbox(bus_chunk_t *chunk, bus_client_id_t id)
+{
+    return &chunk->inboxes[id % BUS_CHUNK_CLIENTS];
+}
+
+static void inbox_init(bus_inbox_t *inbox, bus_client_id_t id)
+{
+    atomic_init(&inbox->stub.next, NULL);
+    atomic_init(&inbox->head, &inbox->stub);
+    inbox->tail = &inbox->stub;
+    atomic_init(&inbox->scheduled, false);
+    inbox->id = id;
+}
+
+/* Return the chunk of @id, allocated if needed, or NULL without memory */
+static bus_chunk_t *bus_chunk_get(bus_t *bus, bus_client_id_t id)
+{
+    bus_chunk_t *chunk = bus_chunk(bus, id);
+    if (chunk)
+        return chunk;
+
+    size_t size = sizeof(bus_chunk_t);
+    if (bus->async)
+        size += BUS_CHUNK_CLIENTS * sizeof(bus_inbox_t);
+    if (!(chunk = calloc(1, size)))
+        return NULL;
+    if (bus->async) {
+        bus_client_id_t base = id - id % BUS_CHUNK_CLIENTS;
+        for (unsigned int i = 0; i < BUS_CHUNK_CLIENTS; i++)
+            inbox_init(&chunk->inboxes[i], base + i);
+    }
+
+    /* Another registration may have installed one meanwhile */
+    bus_chunk_t *expected = NULL;
+    if (!atomic_compare_exchange_strong_explicit(
+            &bus->chunks[id / BUS_CHUNK_CLIENTS], &expected, chunk,
+            memory_order_acq_rel, memory_order_acquire)) {
+        free(chunk);
+        return expected;
+    }
+    return chunk;
+}
+
+static void inbox_push_node(bus_inbox_t *inbox, bus_msg_t *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    bus_msg_t *prev = atomic_exchange(&inbox->head, node);
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+/* Only the dispatcher that scheduled the inbox pops. NULL when empty, or
+ * when a sender is in the middle of a push, which then schedules it again.
+ */
+static bus_msg_t *inbox_pop(bus_inbox_t *inbox)
+{
+    bus_msg_t *tail = inbox->tail;
+    bus_msg_t *next = atomic_load_explicit(&tail->next, memory_order_acquire);
+
+    if (tail == &inbox->stub) {
+        if (!next)
+            return NULL;
+        inbox->tail = tail = next;
+        next = atomic_load_explicit(&next->next, memory_order_acquire);
+    }
+    if (next) {
+        inbox->tail = next;
+        return tail;
+    }
+    if (tail != atomic_load(&inbox->head))
+        return NULL;
+    inbox_push_node(inbox, &inbox->stub);
+    next = atomic_load_explicit(&tail->next, memory_order_acquire);
+    if (next) {
+        inbox->tail = next;
+        return tail;
+    }
+    return NULL;
+}
+
+static bool inbox_empty(bus_inbox_t *inbox)
+{
+    bus_msg_t *tail = inbox->tail;
+    return tail == &inbox->stub && !atomic_load(&tail->next) &&
+           atomic_load(&inbox->head) == tail;
+}
+
+/* Queue the inbox for the dispatchers, unless it already is */
+static void inbox_schedule(bus_async_t *async, bus_inbox_t *inbox)
+{
+    if (atomic_exchange(&inbox->scheduled, true))
+        return;
+
+    pthread_mutex_lock(&async->lock);
+    inbox->next_ready = NULL;
+    *async->ready_tail = inbox;
+    async->ready_tail = &inbox->next_ready;
+    pthread_cond_signal(&async->cond);
+    pthread_mutex_unlock(&async->lock);
+}
+
+static void deliver(bus_t *bus, bus_client_id_t id, void *msg);
+void bus_free(bus_t *bus);
+
+static void *dispatcher(void *arg)
+{
+    bus_t *bus = arg;
+    bus_async_t *async = bus->async;
+
+    pthread_mutex_lock(&async->lock);
+    for (;;) {
+        bus_inbox_t *inbox = async->ready_head;
+        if (!inbox) {
+            if (async->stop)
+                break;
+            pthread_cond_wait(&async->cond, &async->lock);
+            continue;
+        }
+        if (!(async->ready_head = inbox->next_ready))
+            async->ready_tail = &async->ready_head;
+        pthread_mutex_unlock(&async->lock);
+
+        bus_msg_t *node;
+        for (int n = 0; n < BUS_DISPATCH_BATCH && (node = inbox_pop(inbox));
+             n++) {
+            deliver(bus, inbox->id, node->msg);
+            free(node);
+        }
+
+        /* A sender that saw it scheduled counts on us to see its message */
+        atomic_store(&inbox->scheduled, false);
+        if (!inbox_empty(inbox))
+            inbox_schedule(async, inbox);
+
+        pthread_mutex_lock(&async->lock);
+    }
+    pthread_mutex_unlock(&async->lock);
+    return NULL;
+}
+
+/*
+ * Allocate a new bus in async mode: the callbacks are called by a pool of
+ * @n_workers dispatcher threads instead of by the sender, which only queues
+ * the message in the inbox of the client. The messages to a client are
+ * delivered one at a time, in the order they were queued. Returns true on
+ * success.
+ */
+bool __attribute__((warn_unused_result))
+bus_new_async(bus_t **bus, unsigned int n_clients, unsigned int n_workers)
+{
+    if (!n_workers || !bus_new(bus, n_clients))
+        return false;
+
+    bus_t *b = *bus;
+    bus_async_t *async =
+        malloc(sizeof(bus_async_t) + n_workers * sizeof(pthread_t));
+    if (!async)
+        goto fail;
+    pthread_mutex_init(&async->lock, NULL);
+    pthread_cond_init(&async->cond, NULL);
+    async->ready_head = NULL;
+    async->ready_tail = &async->ready_head;
+    async->stop = false;
+    b->async = async;
+
+    for (async->n_workers = 0; async->n_workers < n_workers;
+         async->n_workers++) {
+        if (pthread_create(&async->workers[async->n_workers], NULL,
+                           dispatcher, b)) {
+            bus_free(b);
+            return false;
+        }
+    }
+    return true;
+
+fail:
+    bus_free(b);
+    return false;
+}
+
 /*
  * Register a new client with the specified @id.
  * The ID must satisfy 0 <= ID < n_clients and not be in use; otherwise the
@@ -70,6 +364,9 @@ bus_register(bus_t *bus,
 {
     if (id >= bus->n_clients)
         return false;
+    bus_chunk_t *chunk = bus_chunk_get(bus, id);
+    if (!chunk)
+        return false;
 
     bus_client_t null_client = {0};
     bus_client_t new_client = {
@@ -79,14 +376,37 @@ bus_register(bus_t *bus,
         .refcnt = 0,
     };
 
-    return (bool) CAS(&(bus->clients[id]), &null_client, &new_client);
+    if (!CAS(chunk_client(chunk, id), &null_client, &new_client))
+        return false;
+    atomic_fetch_or(&chunk->registered[id % BUS_CHUNK_CLIENTS / 64],
+                    (uint64_t) 1 << (id % 64));
+    return true;
+}
+
+/* Drop a reference taken on the client. The client is updated as a whole,
+ * like everywhere else: a plain atomic on refcnt alone would not be atomic
+ * with respect to the CAS of the whole client.
+ */
+static void put_client(bus_client_t *client)
+{
+    bus_client_t local_client, new_client;
+    __atomic_load(client, &local_client, __ATOMIC_SEQ_CST);
+    do {
+        new_client = local_client;
+        --(new_client.refcnt);
+    } while (!CAS(client, &local_client, &new_client));
 }
 
 /* Attempt to call a client's callback function in a loop until it succeeds or
  * it gets unregistered.
  */
-static bool execute_client_callback(bus_client_t *client, void *msg)
+static bool execute_client_callback(bus_t *bus, bus_client_id_t id, void *msg)
 {
+    bus_chunk_t *chunk = bus_chunk(bus, id);
+    if (!chunk)
+        return false;
+    bus_client_t *client = chunk_client(chunk, id);
+
     /* Load the client with which we are attempting to communicate. */
     bus_client_t local_client;
     __atomic_load(client, &local_client, __ATOMIC_SEQ_CST);
@@ -105,9 +425,24 @@ static bool execute_client_callback(bus_client_t *client, void *msg)
          * still registered by the time we update the reference count.
          */
         if (CAS(client, &local_client, &new_client)) {
+            /* In async mode, the reference is held until the dispatcher is
+             * done with the message.
+             */
+            if (bus->async) {
+                bus_msg_t *node = malloc(sizeof(bus_msg_t));
+                if (!node) {
+                    put_client(client);
+                    return false;
+                }
+                node->msg = msg;
+                inbox_push_node(chunk_inbox(chunk, id), node);
+                inbox_schedule(bus->async, chunk_inbox(chunk, id));
+                return true;
+            }
+
             /* Send a message and decrease the reference count back */
             local_client.callback(local_client.ctx, msg);
-            __atomic_fetch_sub(&(client->refcnt), 1, __ATOMIC_SEQ_CST);
+            put_client(client);
             return true;
         }
     }
@@ -118,6 +453,18 @@ static bool execute_client_callback(bus_client_t *client, void *msg)
     return false;
 }
 
+/* Async mode: call the callback on behalf of the sender, which holds a
+ * reference to the client.
+ */
+static void deliver(bus_t *bus, bus_client_id_t id, void *msg)
+{
+    bus_client_t *client = chunk_client(bus_chunk(bus, id), id);
+    bus_client_t local_client;
+    __atomic_load(client, &local_client, __ATOMIC_SEQ_CST);
+    local_client.callback(local_client.ctx, msg);
+    put_client(client);
+}
+
 /*
  * If @broadcast is set to false, it sends a message to the client with the
  * specified @id. If @broadcast is set to true, the message is sent to every
@@ -127,33 +474,56 @@ bool __attribute__((warn_unused_result, nonnull(1)))
 bus_send(bus_t *bus, bus_client_id_t id, void *msg, bool broadcast)
 {
     if (broadcast) {
-        for (id = 0; id < bus->n_clients; ++id)
-            execute_client_callback(&(bus->clients[id]), msg);
+        /* Only visit the registered ids of the allocated chunks */
+        for (unsigned int c = 0; c < BUS_N_CHUNKS(bus->n_clients); c++) {
+            bus_chunk_t *chunk = atomic_load_explicit(&bus->chunks[c],
+                                                      memory_order_acquire);
+            if (!chunk)
+                continue;
+            for (unsigned int w = 0; w < BUS_CHUNK_CLIENTS / 64; w++) {
+                uint64_t bits = atomic_load(&chunk->registered[w]);
+                while (bits) {
+                    id = c * BUS_CHUNK_CLIENTS + w * 64 + __builtin_ctzll(bits);
+                    bits &= bits - 1;
+                    execute_client_callback(bus, id, msg);
+                }
+            }
+        }
         return true;
     }
     if (id >= bus->n_clients)
         return false;
-    return execute_client_callback(&(bus->clients[id]), msg);
+    return execute_client_callback(bus, id, msg);
 }
 
 /*
  * Unregister the client with the specified @id. No additional can be made
- * to the specified client. Returns true on success.
+ * to the specified client. In async mode, it waits for the messages queued
+ * for the client to be delivered. Returns true on success.
  */
 bool __attribute__((warn_unused_result, nonnull(1)))
 bus_unregister(bus_t *bus, bus_client_id_t id)
 {
     if (id >= bus->n_clients)
         return false;
+    bus_chunk_t *chunk = bus_chunk(bus, id);
+    if (!chunk)
+        return false;
+    bus_client_t *client = chunk_client(chunk, id);
 
     /* Load the client we are attempting to unregister */
     bus_client_t local_client, null_client = {0};
-    __atomic_load(&(bus->clients[id]), &local_client, __ATOMIC_SEQ_CST);
+    __atomic_load(client, &local_client, __ATOMIC_SEQ_CST);
 
     /* It was already unregistered */
     if (!local_client.registered)
         return false;
 
+    /* No new broadcast is sent to it; the ones that already saw the bit
+     * take a reference, and the CAS below waits for them.
+     */
+    atomic_fetch_and(&chunk->registered[id % BUS_CHUNK_CLIENTS / 64],
+                     ~((uint64_t) 1 << (id % 64)));
     do {
         local_client.refcnt = 0; /* the expected reference count */
 
@@ -161,7 +531,7 @@ bus_unregister(bus_t *bus, bus_client_id_t id)
          * If CAS does not succeed, the value of the client gets copied into
          * local_client.
          */
-        if (CAS(&(bus->clients[id]), &local_client, &null_client))
+        if (CAS(client, &local_client, &null_client))
             return true;
     } while (local_client.registered);
 
@@ -169,17 +539,163 @@ bus_unregister(bus_t *bus, bus_client_id_t id)
     return true;
 }
 
-/* Free the bus object */
+/* Return the topic called @name, created if @create is set, or NULL. The
+ * topics lock must be held.
+ */
+static bus_topic_t *topic_get(bus_t *bus, const char *name, bool create)
+{
+    bus_topic_t *topic = hashmap_get(bus->topics, name);
+    if (topic || !create)
+        return topic;
+
+    if (!(topic = malloc(sizeof(bus_topic_t))))
+        return NULL;
+    if (!(topic->name = strdup(name))) {
+        free(topic);
+        return NULL;
+    }
+    atomic_init(&topic->subs, NULL);
+    topic->next = bus->topic_list;
+    bus->topic_list = topic;
+    hashmap_put(bus->topics, topic->name, topic);
+    return topic;
+}
+
+/* Publish @subs in place of the current subscribers of @topic */
+static void topic_replace(bus_topic_t *topic, bus_subs_t *subs)
+{
+    bus_subs_t *old = atomic_exchange(&topic->subs, subs);
+    if (old)
+        ebr_retire(old, free);
+}
+
+/*
+ * Subscribe the client with the specified @id to @topic, which is created on
+ * its first subscription. The client is expected to unsubscribe before it
+ * gets unregistered. Returns true on success, false if it already was.
+ */
+bool __attribute__((warn_unused_result, nonnull(1, 3)))
+bus_subscribe(bus_t *bus, bus_client_id_t id, const char *topic)
+{
+    if (id >= bus->n_clients)
+        return false;
+
+    bool ok = false;
+    pthread_mutex_lock(&bus->topics_lock);
+    bus_topic_t *t = topic_get(bus, topic, true);
+    if (!t)
+        goto out;
+
+    bus_subs_t *old = atomic_load(&t->subs), *subs;
+    unsigned int n = old ? old->n : 0;
+    for (unsigned int i = 0; i < n; i++) {
+        if (old->ids[i] == id)
+            goto out;
+    }
+    if (!(subs = malloc(sizeof(bus_subs_t) +
+                        (n + 1) * sizeof(bus_client_id_t))))
+        goto out;
+    if (n)
+        memcpy(subs->ids, old->ids, n * sizeof(bus_client_id_t));
+    subs->ids[n] = id;
+    subs->n = n + 1;
+    topic_replace(t, subs);
+    ok = true;
+
+out:
+    pthread_mutex_unlock(&bus->topics_lock);
+    return ok;
+}
+
+/*
+ * Unsubscribe the client with the specified @id from @topic. A publication
+ * running concurrently may still deliver to it. Returns true on success.
+ */
+bool __attribute__((warn_unused_result, nonnull(1, 3)))
+bus_unsubscribe(bus_t *bus, bus_client_id_t id, const char *topic)
+{
+    bool ok = false;
+    pthread_mutex_lock(&bus->topics_lock);
+    bus_topic_t *t = topic_get(bus, topic, false);
+    bus_subs_t *old = t ? atomic_load(&t->subs) : NULL, *subs = NULL;
+    if (!old)
+        goto out;
+
+    unsigned int i = 0;
+    while (i < old->n && old->ids[i] != id)
+        i++;
+    if (i == old->n)
+        goto out;
+    if (old->n > 1) {
+        if (!(subs = malloc(sizeof(bus_subs_t) +
+                            (old->n - 1) * sizeof(bus_client_id_t))))
+            goto out;
+        memcpy(subs->ids, old->ids, i * sizeof(bus_client_id_t));
+        memcpy(subs->ids + i, old->ids + i + 1,
+               (old->n - i - 1) * sizeof(bus_client_id_t));
+        subs->n = old->n - 1;
+    }
+    topic_replace(t, subs);
+    ok = true;
+
+out:
+    pthread_mutex_unlock(&bus->topics_lock);
+    return ok;
+}
+
+/*
+ * Send a message to every client subscribed to @topic, which only costs a
+ * lookup and a visit of its subscribers. Returns the number of clients the
+ * message was delivered (or queued, in async mode) to.
+ */
+unsigned int __attribute__((nonnull(1, 2)))
+bus_publish(bus_t *bus, const char *topic, void *msg)
+{
+    unsigned int n = 0;
+
+    ebr_enter();
+    bus_topic_t *t = hashmap_get(bus->topics, topic);
+    bus_subs_t *subs = t ? atomic_load(&t->subs) : NULL;
+    for (unsigned int i = 0; subs && i < subs->n; i++)
+        n += execute_client_callback(bus, subs->ids[i], msg);
+    ebr_leave();
+    return n;
+}
+
+/* Free the bus object. In async mode, the queued messages are delivered
+ * first.
+ */
 void bus_free(bus_t *bus)
 {
     if (!bus)
         return;
-    free(bus->clients);
+    bus_async_t *async = bus->async;
+    if (async) {
+        pthread_mutex_lock(&async->lock);
+        async->stop = true;
+        pthread_cond_broadcast(&async->cond);
+        pthread_mutex_unlock(&async->lock);
+        for (unsigned int i = 0; i < async->n_workers; i++)
+            pthread_join(async->workers[i], NULL);
+        pthread_cond_destroy(&async->cond);
+        pthread_mutex_destroy(&async->lock);
+        free(async);
+    }
+    for (bus_topic_t *t = bus->topic_list, *next; t; t = next) {
+        next = t->next;
+        free(atomic_load(&t->subs));
+        free(t->name);
+        free(t);
+    }
+    hashmap_free(bus->topics);
+    pthread_mutex_destroy(&bus->topics_lock);
+    for (unsigned int c = 0; c < BUS_N_CHUNKS(bus->n_clients); c++)
+        free(atomic_load(&bus->chunks[c]));
+    free(bus->chunks);
     free(bus);
 }
 
-#include <pthread.h>
-#include <stdlib.h>
+#include <assert.h>
 #include <unistd.h>
 
 #define NUM_THREADS 4
@@ -220,6 +736,131 @@ static void *thread_func(void *_data)
     return NULL;
 }
 
+/* Async mode: every thread broadcasts to all the clients, which check that
+ * the messages of each sender arrive in order.
+ */
+#define ASYNC_CLIENTS 16
+#define ASYNC_MSGS 1000
+
+static unsigned int async_last[ASYNC_CLIENTS][NUM_THREADS];
+static _Atomic unsigned int async_received[ASYNC_CLIENTS];
+
+static void async_callback(void *_ctx, void *_msg)
+{
+    unsigned int client = *(unsigned int *) _ctx;
+    uintptr_t msg = (uintptr_t) _msg;
+    unsigned int sender = msg >> 16, seq = msg & 0xffff;
+
+    assert(seq == async_last[client][sender] + 1);
+    async_last[client][sender] = seq;
+    atomic_fetch_add(&async_received[client], 1);
+}
+
+static void *async_sender(void *_data)
+{
+    thread_data_t *data = (thread_data_t *) _data;
+
+    for (uintptr_t seq = 1; seq <= ASYNC_MSGS; seq++) {
+        if (!bus_send(data->bus, 0, (void *) (data->id << 16 | seq), true))
+            perror("bus_send");
+    }
+    return NULL;
+}
+
+static void test_async(void)
+{
+    pthread_t threads[NUM_THREADS];
+    thread_data_t ctx[NUM_THREADS];
+    unsigned int ids[ASYNC_CLIENTS];
+
+    bus_t *bus;
+    if (!bus_new_async(&bus, 0, 2)) {
+        perror("bus_new_async");
+        exit(EXIT_FAILURE);
+    }
+
+    /* Spread over the bitmap, most ids stay unregistered */
+    for (unsigned int i = 0; i < ASYNC_CLIENTS; ++i) {
+        ids[i] = i;
+        if (!bus_register(bus, i * 7, &async_callback, &ids[i]))
+            perror("bus_register");
+    }
+
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        ctx[i].bus = bus, ctx[i].id = i;
+        if (pthread_create(&threads[i], NULL, async_sender, &ctx[i]))
+            perror("pthread_create");
+    }
+    for (int i = 0; i < NUM_THREADS; ++i) {
+        if (pthread_join(threads[i], NULL))
+            perror("pthread_join");
+    }
+
+    /* Waits for the queued messages */
+    for (unsigned int i = 0; i < ASYNC_CLIENTS; ++i) {
+        if (!bus_unregister(bus, i * 7))
+            perror("bus_unregister");
+        assert(atomic_load(&async_received[i]) == NUM_THREADS * ASYNC_MSGS);
+    }
+    bus_free(bus);
+    printf("Async: %d messages to each of %d clients\n",
+           NUM_THREADS * ASYNC_MSGS, ASYNC_CLIENTS);
+}
+
+/* Topics: only the subscribers of a topic are called */
+static _Atomic unsigned int topic_received[4];
+
+static void topic_callback(void *_ctx, void *_msg)
+{
+    (void) _msg;
+    atomic_fetch_add(&topic_received[*(unsigned int *) _ctx], 1);
+}
+
+static void test_topics(void)
+{
+    unsigned int ids[4] = {0, 1, 2, 3};
+
+    /* A large bus, of which only two chunks get allocated */
+    bus_t *bus;
+    if (!bus_new(&bus, 1 << 20)) {
+        perror("bus_new");
+        exit(EXIT_FAILURE);
+    }
+    bus_client_id_t cid[4] = {3, 500, 1 << 19, (1 << 20) - 1};
+    for (int i = 0; i < 4; i++)
+        assert(bus_register(bus, cid[i], &topic_callback, &ids[i]));
+    assert(!bus_send(bus, 1 << 18, NULL, false));
+    assert(bus_send(bus, cid[3], NULL, false));
+    assert(topic_received[3] == 1);
+
+    assert(bus_subscribe(bus, cid[0], "even"));
+    assert(bus_subscribe(bus, cid[2], "even"));
+    assert(!bus_subscribe(bus, cid[2], "even"));
+    assert(bus_subscribe(bus, cid[1], "odd"));
+    assert(bus_subscribe(bus, cid[3], "odd"));
+
+    assert(bus_publish(bus, "even", NULL) == 2);
+    assert(bus_publish(bus, "odd", NULL) == 2);
+    assert(bus_publish(bus, "none", NULL) == 0);
+    assert(topic_received[0] == 1 && topic_received[2] == 1);
+    assert(topic_received[1] == 1 && topic_received[3] == 2);
+
+    assert(bus_unsubscribe(bus, cid[0], "even"));
+    assert(!bus_unsubscribe(bus, cid[0], "even"));
+    assert(bus_publish(bus, "even", NULL) == 1);
+    assert(topic_received[0] == 1 && topic_received[2] == 2);
+
+    assert(bus_send(bus, 0, NULL, true));
+    for (int i = 0; i < 4; i++) {
+        assert(bus_unsubscribe(bus, cid[i], i % 2 ? "odd" : "even") ==
+               (i != 0));
+        assert(bus_unregister(bus, cid[i]));
+    }
+    assert(topic_received[0] == 2 && topic_received[3] == 3);
+    bus_free(bus);
+    printf("Topics: ok\n");
+}
+
 int main()
 {
     pthread_t threads[NUM_THREADS];
@@ -248,5 +889,7 @@ int main()
 
     bus_free(bus);
 
+    test_async();
+    test_topics();
     return 0;
 }
@@ -1,11 +1,27 @@
+#define _GNU_SOURCE
+#include <sched.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <linux/futex.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
+#include "../hotstat/hotstat.h"
 #include "mcslock.h"
 
 #define LIKELY(x) __builtin_expect(!!(x), 1)
 
-enum { MCS_PROCEED = 0, MCS_WAIT = 1 };
+/* MCS_PROCEED_GLOBAL passes the global lock of a cohort lock along, and
+ * MCS_PARKED is a waiter sleeping on its futex
+ */
+enum { MCS_PROCEED = 0, MCS_WAIT = 1, MCS_PROCEED_GLOBAL = 2, MCS_PARKED = 3 };
+
+/* Spins of an adaptive waiter before it parks, a few microseconds */
+#define MCS_SPIN_LIMIT 1024
 
 #if defined(__i386__) || defined(__x86_64__)
 #define spin_wait() __builtin_ia32_pause()
@@ -15,12 +31,55 @@ enum { MCS_PROCEED = 0, MCS_WAIT = 1 };
 #define spin_wait() ((void) 0)
 #endif
 
-static inline void wait_until_equal_u8(_Atomic uint8_t *loc,
-                                       uint8_t val,
-                                       memory_order mm)
+static inline long futex_wait(_Atomic uint32_t *uaddr, uint32_t val)
 {
-    while (atomic_load_explicit(loc, mm) != val)
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static inline long futex_wake(_Atomic uint32_t *uaddr, int n)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Wait for the turn of the node, parking it after MCS_SPIN_LIMIT spins if
+ * 'park' is set, and return how the lock was passed
+ * C0: Read wait, synchronized with C1
+ */
+HOTSTAT_COUNTER(parks, "mcs.parks");
+
+static uint32_t mcs_wait(mcsnode_t *node, bool park)
+{
+    uint32_t cur;
+
+    for (unsigned int spins = 0;
+         (cur = atomic_load_explicit(&node->wait, memory_order_acquire)) ==
+         MCS_WAIT;
+         spins++) {
+        if (park && spins >= MCS_SPIN_LIMIT) {
+            /* Fails if the lock was passed meanwhile */
+            if (!atomic_compare_exchange_strong_explicit(
+                    &node->wait, &cur, MCS_PARKED, memory_order_acquire,
+                    memory_order_acquire))
+                return cur;
+            HOTSTAT_INC(parks);
+            while ((cur = atomic_load_explicit(
+                        &node->wait, memory_order_acquire)) == MCS_PARKED)
+                futex_wait(&node->wait, MCS_PARKED);
+            return cur;
+        }
         spin_wait();
+    }
+    return cur;
+}
+
+/* Pass the lock to the waiter of 'next', waking it up if it parked
+ * C1: Write wait, synchronized with C0
+ */
+static inline void mcs_signal(mcsnode_t *next, uint32_t val)
+{
+    if (atomic_exchange_explicit(&next->wait, val, memory_order_release) ==
+        MCS_PARKED)
+        futex_wake(&next->wait, 1);
 }
 
 void mcslock_init(mcslock_t *lock)
@@ -28,24 +87,80 @@ void mcslock_init(mcslock_t *lock)
     atomic_init(lock, NULL);
 }
 
-void mcslock_acquire(mcslock_t *lock, mcsnode_t *node)
+/* Queue the node and wait for its turn, return how the lock was passed */
+static uint32_t mcs_enqueue(mcslock_t *lock, mcsnode_t *node, bool park)
 {
     atomic_init(&node->next, NULL);
     /* A0: Read and write lock, synchronized with A0/A1 */
     mcsnode_t *prev =
         atomic_exchange_explicit(lock, node, memory_order_acq_rel);
     if (LIKELY(!prev)) /* Lock uncontended, the lock is acquired */
-        return;
+        return MCS_PROCEED;
     /* Otherwise, the lock is owned by another thread, waiting for its turn */
 
     atomic_store_explicit(&node->wait, MCS_WAIT, memory_order_release);
     /* B0: Write next, synchronized with B1/B2 */
     atomic_store_explicit(&prev->next, node, memory_order_release);
 
-    /* Waiting for the previous thread to signal using the assigned node
-     * C0: Read wait, synchronized with C1
-     */
-    wait_until_equal_u8(&node->wait, MCS_PROCEED, memory_order_acquire);
+    /* Waiting for the previous thread to signal using the assigned node */
+    return mcs_wait(node, park);
+}
+
+/* Wait for the successor which is linking its node with ours. It may have
+ * been preempted in between, so yield once in a while.
+ */
+static inline mcsnode_t *mcs_successor(mcsnode_t *node)
+{
+    mcsnode_t *next;
+
+    /* B2: Read next, synchronized with B0 */
+    for (unsigned int spins = 1;
+         (next = atomic_load_explicit(&node->next, memory_order_acquire)) ==
+         NULL;
+         spins++) {
+        if (spins % MCS_SPIN_LIMIT == 0)
+            sched_yield();
+        else
+            spin_wait();
+    }
+    return next;
+}
+
+void mcslock_acquire(mcslock_t *lock, mcsnode_t *node)
+{
+    mcs_enqueue(lock, node, false);
+}
+
+void mcslock_acquire_adaptive(mcslock_t *lock, mcsnode_t *node)
+{
+    mcs_enqueue(lock, node, true);
+}
+
+bool mcslock_tryacquire(mcslock_t *lock, mcsnode_t *node, uint64_t timeout_ns)
+{
+    struct timespec ts;
+    uint64_t deadline = 0;
+
+    atomic_init(&node->next, NULL);
+    for (unsigned int spins = 0;; spins++) {
+        mcsnode_t *tmp = NULL;
+        if (atomic_load_explicit(lock, memory_order_relaxed) == NULL &&
+            atomic_compare_exchange_weak_explicit(lock, &tmp, node,
+                                                  memory_order_acquire,
+                                                  memory_order_relaxed))
+            return true;
+
+        /* Read the clock once in a while only */
+        if (spins % 64 == 0) {
+            clock_gettime(CLOCK_MONOTONIC, &ts);
+            uint64_t now = ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+            if (!deadline)
+                deadline = now + timeout_ns;
+            if (now >= deadline)
+                return false;
+        }
+        spin_wait();
+    }
 }
 
 void mcslock_release(mcslock_t *lock, mcsnode_t *node)
@@ -69,13 +184,104 @@ void mcslock_release(mcslock_t *lock, mcsnode_t *node)
         /* Otherwise, at least one waiting thread exists */
 
         /* Wait for the first waiting thread to link its node with ours */
-        /* B2: Read next, synchronized with B0 */
-        while ((next = atomic_load_explicit(&node->next,
-                                            memory_order_acquire)) == NULL)
-            spin_wait();
+        next = mcs_successor(node);
     }
 
     /* Signal the first waiting thread */
-    /* C1: Write wait, synchronized with C0 */
-    atomic_store_explicit(&next->wait, MCS_PROCEED, memory_order_release);
+    mcs_signal(next, MCS_PROCEED);
+}
+
+/* Number of NUMA nodes, from the range of the possible ones */
+static unsigned int numa_nodes(void)
+{
+    FILE *f = fopen("/sys/devices/system/node/possible", "r");
+    unsigned int lo, hi = 0;
+
+    if (!f)
+        return 1;
+    int n = fscanf(f, "%u-%u", &lo, &hi);
+    fclose(f);
+    if (n < 1)
+        return 1;
+    return (n == 2 ? hi : lo) + 1;
+}
+
+bool mcs_cohort_init(mcs_cohort_t *lock,
+                     unsigned int n_cohorts,
+                     unsigned int max_batch)
+{
+    if (!n_cohorts)
+        n_cohorts = numa_nodes();
+    lock->cohorts =
+        aligned_alloc(sizeof(mcs_cohort_local_t),
+                      n_cohorts * sizeof(mcs_cohort_local_t));
+    if (!lock->cohorts)
+        return false;
+
+    mcslock_init(&lock->global);
+    lock->n_cohorts = n_cohorts;
+    lock->max_batch = max_batch;
+    for (unsigned int i = 0; i < n_cohorts; i++) {
+        mcslock_init(&lock->cohorts[i].lock);
+        lock->cohorts[i].batch = 0;
+    }
+    return true;
+}
+
+void mcs_cohort_destroy(mcs_cohort_t *lock)
+{
+    free(lock->cohorts);
+    lock->cohorts = NULL;
+}
+
+void mcs_cohort_acquire_on(mcs_cohort_t *lock,
+                           mcs_cohort_node_t *node,
+                           unsigned int cohort)
+{
+    mcs_cohort_local_t *local = &lock->cohorts[cohort % lock->n_cohorts];
+
+    /* The thread may move to another node before it releases the lock */
+    node->cohort = cohort % lock->n_cohorts;
+
+    /* The global lock came along with the local one, or has to be taken on
+     * behalf of the cohort
+     */
+    if (mcs_enqueue(&local->lock, &node->node, false) != MCS_PROCEED_GLOBAL)
+        mcslock_acquire(&lock->global, &local->global_node);
+}
+
+void mcs_cohort_acquire(mcs_cohort_t *lock, mcs_cohort_node_t *node)
+{
+    unsigned int cpu, numa = 0;
+
+    if (lock->n_cohorts > 1 && getcpu(&cpu, &numa) < 0)
+        numa = 0;
+    mcs_cohort_acquire_on(lock, node, numa);
+}
+
+void mcs_cohort_release(mcs_cohort_t *lock, mcs_cohort_node_t *node)
+{
+    mcs_cohort_local_t *local = &lock->cohorts[node->cohort];
+    mcsnode_t *next =
+        atomic_load_explicit(&node->node.next, memory_order_acquire);
+
+    /* A thread of the cohort is queued, or about to be: it gets the global
+     * lock along with the local one, up to max_batch times in a row
+     */
+    if ((next || atomic_load_explicit(&local->lock, memory_order_relaxed) !=
+                     &node->node) &&
+        local->batch < lock->max_batch) {
+        local->batch++;
+        if (!next)
+            next = mcs_successor(&node->node);
+        mcs_signal(next, MCS_PROCEED_GLOBAL);
+        return;
+    }
+
+    /* The global lock goes first, the next owner of the local lock reuses
+     * the node of the cohort to take it again
+     */
+    local->batch = 0;
+    mcslock_release(&lock->global, &local->global_node);
+    mcslock_release(&local->lock, &node->node);
 }
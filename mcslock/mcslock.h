@@ -1,11 +1,12 @@
 #pragma once
 
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 typedef struct mcsnode {
     _Atomic(struct mcsnode *) next;
-    _Atomic(uint8_t) wait;
+    _Atomic(uint32_t) wait; /* A futex for the adaptive waiters */
 } mcsnode_t;
 
 typedef _Atomic(mcsnode_t *) mcslock_t;
@@ -18,7 +19,70 @@ void mcslock_init(mcslock_t *lock);
  */
 void mcslock_acquire(mcslock_t *lock, mcsnode_t *node);
 
+/* Acquire an MCS lock, spinning for a bounded time before sleeping until the
+ * lock is passed, for long critical sections or more threads than cores
+ * It can be mixed with mcslock_acquire() on the same lock, the release only
+ * makes a system call if the next waiter is asleep.
+ */
+void mcslock_acquire_adaptive(mcslock_t *lock, mcsnode_t *node);
+
+/* Try to acquire an MCS lock for up to 'timeout_ns' nanoseconds
+ * The node is only installed once the lock is free, it never waits in the
+ * queue, so that giving up leaves nothing behind. Returns true if the lock
+ * was acquired, to be released with mcslock_release() and the same node.
+ */
+bool mcslock_tryacquire(mcslock_t *lock, mcsnode_t *node, uint64_t timeout_ns);
+
 /* Release an MCS lock
  * node' must specify same node as used in matching acquire call
  */
 void mcslock_release(mcslock_t *lock, mcsnode_t *node);
+
+/* Cohort lock (Dice, Marathe and Shavit, "Lock Cohorting")
+ *
+ * The threads of a cohort, typically a NUMA node, queue on an MCS lock of
+ * their own, and its owner takes a global MCS lock on behalf of the cohort.
+ * On release, the global lock is passed to the next thread of the cohort if
+ * there is one, up to 'max_batch' times in a row, so that the lock and the
+ * data it protects tend to stay within a node.
+ */
+typedef struct {
+    mcslock_t lock;        /* Among the threads of the cohort */
+    mcsnode_t global_node; /* Of the cohort, in the global lock */
+    unsigned int batch;    /* Handoffs within the cohort in a row */
+} __attribute__((aligned(64))) mcs_cohort_local_t;
+
+typedef struct {
+    mcslock_t global;
+    unsigned int n_cohorts, max_batch;
+    mcs_cohort_local_t *cohorts;
+} mcs_cohort_t;
+
+typedef struct {
+    mcsnode_t node;
+    unsigned int cohort;
+} mcs_cohort_node_t;
+
+/* Initialize a cohort lock with 'n_cohorts' cohorts, or one per NUMA node if
+ * 0. Returns false if out of memory.
+ */
+bool mcs_cohort_init(mcs_cohort_t *lock,
+                     unsigned int n_cohorts,
+                     unsigned int max_batch);
+
+void mcs_cohort_destroy(mcs_cohort_t *lock);
+
+/* Acquire a cohort lock in the cohort of the NUMA node of the calling thread
+ * 'node' points to an uninitialized mcs_cohort_node_t
+ */
+void mcs_cohort_acquire(mcs_cohort_t *lock, mcs_cohort_node_t *node);
+
+/* Acquire a cohort lock in the cohort 'cohort' (modulo the cohort count) */
+void mcs_cohort_acquire_on(mcs_cohort_t *lock,
+                           mcs_cohort_node_t *node,
+                           unsigned int cohort);
+
+/* Release a cohort lock
+ * 'node' must specify same node as used in matching acquire call
+ */
+void mcs_cohort_release(mcs_cohort_t *lock, mcs_cohort_node_t *node);
@@ -1,16 +1,95 @@
+#include <assert.h>
+#include <pthread.h>
 #include <stdio.h>
 
 #include "mcslock.h"
 
+#define N_THREADS 4
+#define N_LOOPS 2000
+
+static mcs_cohort_t cohort;
+static unsigned long counter;
+
+static void *cohort_worker(void *arg)
+{
+    unsigned int id = (unsigned int) (uintptr_t) arg;
+
+    for (int i = 0; i < N_LOOPS; i++) {
+        mcs_cohort_node_t node;
+        /* Two threads per cohort */
+        mcs_cohort_acquire_on(&cohort, &node, id / 2);
+        counter++;
+        mcs_cohort_release(&cohort, &node);
+    }
+    return NULL;
+}
+
+static void test_cohort(void)
+{
+    pthread_t threads[N_THREADS];
+
+    assert(mcs_cohort_init(&cohort, N_THREADS / 2, 8));
+    for (uintptr_t i = 0; i < N_THREADS; i++)
+        pthread_create(&threads[i], NULL, cohort_worker, (void *) i);
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    assert(counter == N_THREADS * N_LOOPS);
+
+    mcs_cohort_node_t node;
+    mcs_cohort_acquire(&cohort, &node);
+    mcs_cohort_release(&cohort, &node);
+    mcs_cohort_destroy(&cohort);
+}
+
+/* More threads than cores, half of them parking */
+static mcslock_t adaptive;
+
+static void *adaptive_worker(void *arg)
+{
+    for (int i = 0; i < N_LOOPS; i++) {
+        mcsnode_t node;
+        if ((uintptr_t) arg % 2)
+            mcslock_acquire_adaptive(&adaptive, &node);
+        else
+            mcslock_acquire(&adaptive, &node);
+        counter++;
+        mcslock_release(&adaptive, &node);
+    }
+    return NULL;
+}
+
+static void test_adaptive(void)
+{
+    pthread_t threads[4 * N_THREADS];
+
+    counter = 0;
+    mcslock_init(&adaptive);
+    for (uintptr_t i = 0; i < 4 * N_THREADS; i++)
+        pthread_create(&threads[i], NULL, adaptive_worker, (void *) i);
+    for (int i = 0; i < 4 * N_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    assert(counter == 4 * N_THREADS * N_LOOPS);
+}
+
 int main(void)
 {
     mcslock_t lock;
-    mcsnode_t node;
+    mcsnode_t node, other;
     mcslock_init(&lock);
     mcslock_acquire(&lock, &node);
     mcslock_release(&lock, &node);
     mcslock_acquire(&lock, &node);
     mcslock_release(&lock, &node);
 
+    /* The trylock gives up while the lock is held */
+    assert(mcslock_tryacquire(&lock, &node, 0));
+    assert(!mcslock_tryacquire(&lock, &other, 1000000));
+    mcslock_release(&lock, &node);
+    assert(mcslock_tryacquire(&lock, &other, 1000000));
+    mcslock_release(&lock, &other);
+
+    test_cohort();
+    test_adaptive();
+    printf("mcslock tests complete\n");
     return 0;
 }
@@ -1,5 +1,9 @@
 /* A multiple-producer/multiple-consumer queue
  * NOTE: dequeue operation would block if there is no element.
+ *
+ * Threads join and leave at any time. The nodes before the oldest one a
+ * handle still uses are freed as the dequeuers go, so the memory in use stays
+ * bounded.
  */
 
 #ifndef _GNU_SOURCE
@@ -37,27 +41,30 @@ typedef struct __node {
     void *cells[N] __DOUBLE___CACHE_ALIGNED;
 } node_t;
 
-#define N_HANDLES 128 /* support 127 threads */
-
-typedef struct {
+/* The handles are kept in a list that only grows, so that a reclamation can
+ * walk it while threads join and leave. A handle left by its thread is reused
+ * by the next one to join.
+ */
+typedef struct __handle {
+    struct __handle *next;
+    int active; /* taken by a thread */
     node_t *spare;
 
+    /* NULL if the handle does not enqueue, or does not dequeue */
     node_t *volatile push __CACHE_ALIGNED;
     node_t *volatile pop __CACHE_ALIGNED;
 } handle_t;
 
 typedef struct {
     node_t *init_node;
-    volatile long init_id __DOUBLE___CACHE_ALIGNED;
+    volatile long init_id __DOUBLE___CACHE_ALIGNED; /* -1 while reclaiming */
 
     volatile long put_index __DOUBLE___CACHE_ALIGNED;
     volatile long pop_index __DOUBLE___CACHE_ALIGNED;
 
-    handle_t *enqueue_handles[N_HANDLES], *dequeue_handles[N_HANDLES];
+    handle_t *handles;
 
     int threshold;
-
-    pthread_barrier_t enq_barrier, deq_barrier;
 } mpmc_t;
 
 static inline node_t *mpmc_new_node()
@@ -67,52 +74,98 @@ static inline node_t *mpmc_new_node()
     return n;
 }
 
+static inline void mpmc_pause(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("isb\n");
+#endif
+}
+
 enum queue_ops {
     DEQUEUE = 1 << 0,
     ENQUEUE = 1 << 1,
 };
 
-/* register the enqueuers first, dequeuers second. */
-void mpmc_queue_register(mpmc_t *q, handle_t *th, int flag)
+/* Join the queue as an enqueuer, a dequeuer or both, at any time. The handle
+ * belongs to the queue, give it back with mpmc_queue_leave().
+ */
+handle_t *mpmc_queue_join(mpmc_t *q, int flag)
 {
-    th->spare = mpmc_new_node();
-    th->push = th->pop = q->init_node;
-
-    if (flag & ENQUEUE) {
-        handle_t **tail = q->enqueue_handles;
-        for (int i = 0;; ++i) {
-            handle_t *init = NULL;
-            if (!tail[i] &&
-                __atomic_compare_exchange_n(tail + i, &init, th, 0,
-                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
-                break;
-        }
-        /* wait for the other enqueuers to register */
-        pthread_barrier_wait(&q->enq_barrier);
+    handle_t *th;
+
+    for (th = __atomic_load_n(&q->handles, __ATOMIC_ACQUIRE); th;
+         th = th->next) {
+        int idle = 0;
+        if (!__atomic_load_n(&th->active, __ATOMIC_RELAXED) &&
+            __atomic_compare_exchange_n(&th->active, &idle, 1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+    }
+    if (!th) {
+        th = align_alloc(CACHE_LINE_SIZE, sizeof(handle_t));
+        memset(th, 0, sizeof(handle_t));
+        th->active = 1;
+        th->next = __atomic_load_n(&q->handles, __ATOMIC_RELAXED);
+        while (!__atomic_compare_exchange_n(&q->handles, &th->next, th, 0,
+                                            __ATOMIC_RELEASE, __ATOMIC_RELAXED))
+            ;
     }
+    if (!th->spare)
+        th->spare = mpmc_new_node();
 
-    if (flag & DEQUEUE) {
-        handle_t **tail = q->dequeue_handles;
-        for (int i = 0;; ++i) {
-            handle_t *init = NULL;
-            if (!tail[i] &&
-                __atomic_compare_exchange_n(tail + i, &init, th, 0,
-                                            __ATOMIC_RELAXED, __ATOMIC_RELAXED))
-                break;
-        }
-        /* wait for the other dequeuers to register */
-        pthread_barrier_wait(&q->deq_barrier);
+    /* Take the reclamation lock, so that the oldest node is not freed before
+     * the next reclamation sees that this handle uses it.
+     */
+    long init_index;
+    for (;;) {
+        init_index = __atomic_load_n(&q->init_id, __ATOMIC_RELAXED);
+        if (init_index >= 0 &&
+            __atomic_compare_exchange_n(&q->init_id, &init_index, -1, 0,
+                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+            break;
+        mpmc_pause();
     }
+    if (flag & ENQUEUE)
+        th->push = q->init_node;
+    if (flag & DEQUEUE)
+        th->pop = q->init_node;
+    __atomic_store_n(&q->init_id, init_index, __ATOMIC_RELEASE);
+
+    return th;
+}
+
+/* No operation may be in progress on the handle */
+void mpmc_queue_leave(mpmc_t *q, handle_t *th)
+{
+    __atomic_store_n(&th->push, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&th->pop, NULL, __ATOMIC_RELEASE);
+    __atomic_store_n(&th->active, 0, __ATOMIC_RELEASE);
 }
 
-void mpmc_init_queue(mpmc_t *q, int enqs, int deqs, int threshold)
+void mpmc_init_queue(mpmc_t *q, int threshold)
 {
     q->init_node = mpmc_new_node();
     q->threshold = threshold;
     q->put_index = q->pop_index = q->init_id = 0;
+    q->handles = NULL;
+}
 
-    pthread_barrier_init(&q->enq_barrier, NULL, enqs); /* enqueuers */
-    pthread_barrier_init(&q->deq_barrier, NULL, deqs); /* dequeuers */
+/* Every thread must have left */
+void mpmc_destroy_queue(mpmc_t *q)
+{
+    for (node_t *n = q->init_node, *next; n; n = next) {
+        next = n->next;
+        free(n);
+    }
+    for (handle_t *th = q->handles, *next; th; th = next) {
+        next = th->next;
+        free(th->spare);
+        free(th);
+    }
+    q->init_node = NULL;
+    q->handles = NULL;
 }
 
 /* locate the offset on the nodes and nodes needed. */
@@ -161,8 +214,10 @@ static void *mpmc_find_cell(node_t *volatile *ptr, long i, handle_t *th)
     return &curr->cells[i & N_BITS];
 }
 
+#include <errno.h>
 #include <linux/futex.h>
 #include <sys/syscall.h>
+#include <time.h>
 #include <unistd.h>
 #ifndef SYS_futex
 #define SYS_futex __NR_futex
@@ -172,19 +227,29 @@ static inline int mpmc_futex_wake(void *addr, int val)
     return syscall(SYS_futex, addr, FUTEX_WAKE, val, NULL, NULL, 0);
 }
 
-static inline int mpmc_futex_wait(void *addr, int val)
+/* Wait until the absolute CLOCK_MONOTONIC @deadline, or forever if NULL */
+static inline int mpmc_futex_wait(void *addr,
+                                  int val,
+                                  const struct timespec *deadline)
 {
-    return syscall(SYS_futex, addr, FUTEX_WAIT, val, NULL, NULL, 0);
+    return syscall(SYS_futex, addr, FUTEX_WAIT_BITSET, val, deadline, NULL,
+                   FUTEX_BITSET_MATCH_ANY);
 }
 
-void mpmc_enqueue(mpmc_t *q, handle_t *th, void *v)
+/* A cell whose dequeuer timed out, its enqueuer moves on to another cell.
+ * The values can thus be neither NULL nor MPMC_ABANDONED.
+ */
+#define MPMC_ABANDONED ((void *) -1)
+
+/* Put @v in the cell @index, found from @ptr on. Return false if the cell
+ * was abandoned.
+ */
+static bool mpmc_put_cell(node_t *volatile *ptr,
+                          handle_t *th,
+                          long index,
+                          void *v)
 {
-    /* return the needed index */
-    void *volatile *c = mpmc_find_cell(
-        &th->push, __atomic_fetch_add(&q->put_index, 1, __ATOMIC_SEQ_CST), th);
-    /* __atomic_fetch_add(ptr, val) is an atomic fetch-and-add that also
-     * ensures sequential consistency
-     */
+    void *volatile *c = mpmc_find_cell(ptr, index, th);
 
     /* now c is the needed cell */
     void *cv;
@@ -193,37 +258,139 @@ void mpmc_enqueue(mpmc_t *q, handle_t *th, void *v)
      * so our value has put into the cell, just return.
      */
     if ((cv = __atomic_exchange_n(c, v, __ATOMIC_ACQ_REL)) == NULL)
-        return;
+        return true;
+    if (cv == MPMC_ABANDONED)
+        return false;
 
     /* else the counterpart pop thread has wait this cell, so we just change the
      * waiting value to 0 and wake it
      */
-    *((int *) cv) = 0;
+    __atomic_store_n((int *) cv, 0, __ATOMIC_RELEASE);
     mpmc_futex_wake(cv, 1);
+    return true;
 }
 
-void *mpmc_dequeue(mpmc_t *q, handle_t *th)
+void mpmc_enqueue(mpmc_t *q, handle_t *th, void *v)
+{
+    /* __atomic_fetch_add(ptr, val) is an atomic fetch-and-add that also
+     * ensures sequential consistency
+     */
+    while (!mpmc_put_cell(
+        &th->push, th, __atomic_fetch_add(&q->put_index, 1, __ATOMIC_SEQ_CST),
+        v))
+        ;
+}
+
+/* Enqueue @n values, claiming their cells with a single fetch-add. They are
+ * in order, unless a dequeuer that timed out had one of their cells.
+ */
+void mpmc_enqueue_bulk(mpmc_t *q, handle_t *th, void *const *v, long n)
+{
+    long index = __atomic_fetch_add(&q->put_index, n, __ATOMIC_SEQ_CST);
+
+    for (long i = 0; i < n; i++) {
+        if (mpmc_put_cell(&th->push, th, index + i, v[i]))
+            continue;
+
+        /* The new cell is past the rest of the run, find it on a copy of our
+         * position, which keeps protecting the nodes from th->push on.
+         */
+        node_t *volatile retry = th->push;
+        while (!mpmc_put_cell(
+            &retry, th, __atomic_fetch_add(&q->put_index, 1, __ATOMIC_SEQ_CST),
+            v[i]))
+            ;
+    }
+}
+
+static void mpmc_reclaim(mpmc_t *q, handle_t *th)
+{
+    /* __atomic_load_n(ptr, __ATOMIC_ACQUIRE) is a load with a following
+     * acquire fence to ensure no following load and stores can start before
+     * the current load completes.
+     */
+    long init_index = __atomic_load_n(&q->init_id, __ATOMIC_ACQUIRE);
+
+    /* __atomic_compare_exchange_n(ptr, cmp, val, 0, __ATOMIC_ACQUIRE,
+     * __ATOMIC_RELAXED) is an atomic compare-and-swap that ensures acquire
+     * semantic when succeed or relaxed semantic when failed.
+     */
+    if ((th->pop->id - init_index) < q->threshold || init_index < 0 ||
+        !__atomic_compare_exchange_n(&q->init_id, &init_index, -1, 0,
+                                     __ATOMIC_ACQUIRE, __ATOMIC_RELAXED))
+        return;
+
+    node_t *init_node = q->init_node;
+    node_t *min_node = th->pop;
+
+    /* Take the positions of the handles after the lock, the ones that are
+     * not in use are NULL.
+     */
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    for (handle_t *next = __atomic_load_n(&q->handles, __ATOMIC_ACQUIRE);
+         next && min_node->id > init_index; next = next->next) {
+        node_t *next_min = __atomic_load_n(&next->pop, __ATOMIC_ACQUIRE);
+        if (next_min && next_min->id < min_node->id)
+            min_node = next_min;
+        next_min = __atomic_load_n(&next->push, __ATOMIC_ACQUIRE);
+        if (next_min && next_min->id < min_node->id)
+            min_node = next_min;
+    }
+
+    /* The cells abandoned by timed out dequeuers are still to be visited by
+     * the enqueuers, which may not have joined yet: keep the node of the next
+     * index they are about to take.
+     */
+    long new_id = min_node->id;
+    long put_id = __atomic_load_n(&q->put_index, __ATOMIC_ACQUIRE) / N;
+    if (put_id < new_id)
+        new_id = put_id;
+
+    if (new_id <= init_index) {
+        /* __atomic_store_n(ptr, val, __ATOMIC_RELEASE) is a store with a
+         * preceding release fence to ensure all previous load and stores
+         * completes before the current store is visible.
+         */
+        __atomic_store_n(&q->init_id, init_index, __ATOMIC_RELEASE);
+        return;
+    }
+
+    if (min_node->id > new_id) {
+        for (min_node = init_node; min_node->id < new_id;
+             min_node = min_node->next)
+            ;
+    }
+    q->init_node = min_node;
+    __atomic_store_n(&q->init_id, new_id, __ATOMIC_RELEASE);
+
+    do {
+        node_t *tmp = init_node->next;
+        free(init_node);
+        init_node = tmp;
+    } while (init_node != min_node);
+}
+
+/* Take the value of the cell @index. Past the absolute CLOCK_MONOTONIC
+ * @deadline, unless it is NULL, abandon the cell and return NULL.
+ */
+static void *mpmc_get_cell(mpmc_t *q,
+                           handle_t *th,
+                           long index,
+                           const struct timespec *deadline)
 {
     void *cv;
     int futex_addr = 1;
 
-    /* the needed pop_index */
-    long index = __atomic_fetch_add(&q->pop_index, 1, __ATOMIC_SEQ_CST);
-
     /* locate the needed cell */
     void *volatile *c = mpmc_find_cell(&th->pop, index, th);
 
     /* because the queue is a blocking queue, so we just use more spin. */
-    int times = (1 << 20);
+    int times = deadline ? (1 << 10) : (1 << 20);
     do {
         cv = *c;
         if (cv)
             goto over;
-#if defined(__i386__) || defined(__x86_64__)
-        __asm__ __volatile__("pause");
-#elif defined(__aarch64__) || defined(__arm__)
-        __asm__ __volatile__("isb\n");
-#endif
+        mpmc_pause();
     } while (times-- > 0);
 
     /* XCHG, if return NULL so this cell is NULL, we just wait and observe the
@@ -234,8 +401,18 @@ void *mpmc_dequeue(mpmc_t *q, handle_t *th)
          * futex_addr at mpmc_enqueue(call wake)
          */
         do {
-            mpmc_futex_wait(&futex_addr, 1);
-        } while (futex_addr == 1);
+            if (mpmc_futex_wait(&futex_addr, 1, deadline) == -1 &&
+                errno == ETIMEDOUT) {
+                void *expected = &futex_addr;
+                if (__atomic_compare_exchange_n(c, &expected, MPMC_ABANDONED,
+                                                0, __ATOMIC_ACQ_REL,
+                                                __ATOMIC_ACQUIRE))
+                    goto over; /* cv is NULL */
+
+                /* the enqueuer got here first, wait for it to wake us */
+                deadline = NULL;
+            }
+        } while (__atomic_load_n(&futex_addr, __ATOMIC_ACQUIRE) == 1);
 
         /* the counterpart put thread has change futex_addr's value to 0. and
          * the data has into cell(c).
@@ -250,65 +427,43 @@ over:
      * of other threads, we get a larger ID node(min_node). So it is safe to
      * recycle the memory [init_node, min_node).
      */
-    if ((index & N_BITS) == N_BITS) {
-        /* __atomic_load_n(ptr, __ATOMIC_ACQUIRE) is a load with a following
-         * acquire fence to ensure no following load and stores can start before
-         * the current load completes.
-         */
-        long init_index = __atomic_load_n(&q->init_id, __ATOMIC_ACQUIRE);
-
-        /* __atomic_compare_exchange_n(ptr, cmp, val, 0, __ATOMIC_ACQUIRE,
-         * __ATOMIC_RELAXED) is an atomic compare-and-swap that ensures acquire
-         * semantic when succeed or relaxed semantic when failed.
-         */
-        if ((th->pop->id - init_index) >= q->threshold && init_index >= 0 &&
-            __atomic_compare_exchange_n(&q->init_id, &init_index, -1, 0,
-                                        __ATOMIC_ACQUIRE, __ATOMIC_RELAXED)) {
-            node_t *init_node = q->init_node;
-            th = q->dequeue_handles[0];
-            node_t *min_node = th->pop;
-
-            int i;
-            handle_t *next = q->dequeue_handles[i = 1];
-            while (next) {
-                node_t *next_min = next->pop;
-                if (next_min->id < min_node->id)
-                    min_node = next_min;
-                if (min_node->id <= init_index)
-                    break;
-                next = q->dequeue_handles[++i];
-            }
+    if ((index & N_BITS) == N_BITS)
+        mpmc_reclaim(q, th);
+    return cv;
+}
 
-            next = q->enqueue_handles[i = 0];
-            while (next) {
-                node_t *next_min = next->push;
-                if (next_min->id < min_node->id)
-                    min_node = next_min;
-                if (min_node->id <= init_index)
-                    break;
-                next = q->enqueue_handles[++i];
-            }
+void *mpmc_dequeue(mpmc_t *q, handle_t *th)
+{
+    /* the needed pop_index */
+    long index = __atomic_fetch_add(&q->pop_index, 1, __ATOMIC_SEQ_CST);
+    return mpmc_get_cell(q, th, index, NULL);
+}
 
-            long new_id = min_node->id;
-            if (new_id <= init_index)
-                /* __atomic_store_n(ptr, val, __ATOMIC_RELEASE) is a store with
-                 * a preceding release fence to ensure all previous load and
-                 * stores completes before the current store is visible.
-                 */
-                __atomic_store_n(&q->init_id, init_index, __ATOMIC_RELEASE);
-            else {
-                q->init_node = min_node;
-                __atomic_store_n(&q->init_id, new_id, __ATOMIC_RELEASE);
-
-                do {
-                    node_t *tmp = init_node->next;
-                    free(init_node);
-                    init_node = tmp;
-                } while (init_node != min_node);
-            }
-        }
+/* Return NULL if no value came within @timeout_ns */
+void *mpmc_dequeue_timeout(mpmc_t *q, handle_t *th, long timeout_ns)
+{
+    struct timespec deadline;
+    clock_gettime(CLOCK_MONOTONIC, &deadline);
+    deadline.tv_sec += timeout_ns / 1000000000;
+    deadline.tv_nsec += timeout_ns % 1000000000;
+    if (deadline.tv_nsec >= 1000000000) {
+        deadline.tv_sec++;
+        deadline.tv_nsec -= 1000000000;
     }
-    return cv;
+
+    long index = __atomic_fetch_add(&q->pop_index, 1, __ATOMIC_SEQ_CST);
+    return mpmc_get_cell(q, th, index, &deadline);
+}
+
+/* Dequeue @n values into @out, claiming their cells with a single fetch-add.
+ * Block until all of them came.
+ */
+void mpmc_dequeue_bulk(mpmc_t *q, handle_t *th, void **out, long n)
+{
+    long index = __atomic_fetch_add(&q->pop_index, n, __ATOMIC_SEQ_CST);
+
+    for (long i = 0; i < n; i++)
+        out[i] = mpmc_get_cell(q, th, index + i, NULL);
 }
 
 #include <sys/time.h>
@@ -319,17 +474,34 @@ static mpmc_t mpmc;
 
 static pthread_barrier_t prod_barrier, cons_barrier;
 
+#define N_ROUNDS 8
+#define BULK 16
+#define TIMEOUT_NS 100000
+
+/* The threads join the queue for each round and leave after it */
 static void *producer(void *index)
 {
     mpmc_t *q = &mpmc;
-    handle_t *th = calloc(1, sizeof(handle_t));
-    mpmc_queue_register(q, th, ENQUEUE);
 
-    for (;;) {
+    for (int r = 0; r < N_ROUNDS; r++) {
         pthread_barrier_wait(&prod_barrier);
-        for (int i = 0; i < COUNTS_PER_THREAD; ++i)
-            mpmc_enqueue(
-                q, th, (void *) 1 + i + ((intptr_t) index) * COUNTS_PER_THREAD);
+        handle_t *th = mpmc_queue_join(q, ENQUEUE);
+        void *values[BULK];
+        for (int i = 0; i < COUNTS_PER_THREAD;) {
+            void *v = (void *) 1 + i + ((intptr_t) index) * COUNTS_PER_THREAD;
+
+            /* the odd producers enqueue in bulk */
+            if (!((intptr_t) index & 1) || COUNTS_PER_THREAD - i < BULK) {
+                mpmc_enqueue(q, th, v);
+                i++;
+                continue;
+            }
+            for (int j = 0; j < BULK; j++)
+                values[j] = v + j;
+            mpmc_enqueue_bulk(q, th, values, BULK);
+            i += BULK;
+        }
+        mpmc_queue_leave(q, th);
         pthread_barrier_wait(&prod_barrier);
     }
     return NULL;
@@ -340,17 +512,33 @@ static bool *array;
 static void *consumer(void *index)
 {
     mpmc_t *q = &mpmc;
-    handle_t *th = calloc(1, sizeof(handle_t));
-    mpmc_queue_register(q, th, DEQUEUE);
 
-    for (;;) {
+    for (int r = 0; r < N_ROUNDS; r++) {
         pthread_barrier_wait(&cons_barrier);
-        for (long i = 0; i < COUNTS_PER_THREAD; ++i) {
-            int value;
-            if (!(value = (intptr_t) mpmc_dequeue(q, th)))
-                return NULL;
-            array[value] = true;
+        handle_t *th = mpmc_queue_join(q, DEQUEUE);
+        void *values[BULK];
+        for (long i = 0; i < COUNTS_PER_THREAD;) {
+            long n = 1;
+
+            /* the others dequeue in bulk, or with a timeout */
+            if ((intptr_t) index % 3 == 1 && COUNTS_PER_THREAD - i >= BULK) {
+                n = BULK;
+                mpmc_dequeue_bulk(q, th, values, n);
+            } else if ((intptr_t) index % 3 == 2) {
+                if (!(values[0] = mpmc_dequeue_timeout(q, th, TIMEOUT_NS)))
+                    continue;
+            } else
+                values[0] = mpmc_dequeue(q, th);
+
+            for (long j = 0; j < n; j++) {
+                int value;
+                if (!(value = (intptr_t) values[j]))
+                    return NULL;
+                array[value] = true;
+            }
+            i += n;
         }
+        mpmc_queue_leave(q, th);
         pthread_barrier_wait(&cons_barrier);
     }
 
@@ -370,21 +558,21 @@ int main(int argc, char *argv[])
     printf("Amount: %ld\n", N_THREADS * COUNTS_PER_THREAD);
     fflush(stdout);
     array = calloc(1, (1 + N_THREADS * COUNTS_PER_THREAD) * sizeof(bool));
-    mpmc_init_queue(&mpmc, N_THREADS, N_THREADS, threshold);
+    mpmc_init_queue(&mpmc, threshold);
 
-    pthread_t pids[N_THREADS];
+    pthread_t prod_pids[N_THREADS], cons_pids[N_THREADS];
 
     for (int i = 0; i < N_THREADS; ++i) {
-        if (-1 == pthread_create(&pids[i], NULL, producer,
-                                 (void *) (intptr_t) i) ||
-            -1 == pthread_create(&pids[i], NULL, consumer,
-                                 (void *) (intptr_t) i)) {
+        if (pthread_create(&prod_pids[i], NULL, producer,
+                           (void *) (intptr_t) i) ||
+            pthread_create(&cons_pids[i], NULL, consumer,
+                           (void *) (intptr_t) i)) {
             printf("error create thread\n");
             exit(1);
         }
     }
 
-    for (int i = 0; i < 8; i++) {
+    for (int i = 0; i < N_ROUNDS; i++) {
         printf("\n#%d\n", i);
 
         pthread_barrier_wait(&cons_barrier);
@@ -411,9 +599,22 @@ int main(int argc, char *argv[])
         float cost_time = (prod_end.tv_sec - start.tv_sec) +
                           (prod_end.tv_usec - start.tv_usec) / 1000000.0;
         printf("elapsed time: %f seconds\n", cost_time);
+
+        /* Every thread left, what is not reclaimed yet stays bounded */
+        int n_nodes = 0;
+        for (node_t *n = mpmc.init_node; n; n = n->next)
+            n_nodes++;
+        printf("nodes in use: %d\n", n_nodes);
         printf("DONE #%d\n", i);
         fflush(stdout);
         memset(array, 0, (1 + N_THREADS * COUNTS_PER_THREAD) * sizeof(bool));
     }
+
+    for (int i = 0; i < N_THREADS; ++i) {
+        pthread_join(prod_pids[i], NULL);
+        pthread_join(cons_pids[i], NULL);
+    }
+    mpmc_destroy_queue(&mpmc);
+    free(array);
     return 0;
 }
@@ -1,4 +1,5 @@
 #include <stddef.h>
+#include <stdbool.h>
 #include <stdint.h>
 
 /* Classical Producer-Consumer Problem, utilizing unbounded lockless single
@@ -68,8 +69,55 @@ struct __QUEUE_API__ {
     queue_result_t (*destroy)(queue_p);
 } Queue;
 
+/* Intrusive queue
+ *
+ * Dmitry Vyukov's node-based MPSC queue: the callers embed a mpsc_node_t in
+ * their own structures, so that pushing and popping never allocate. The
+ * queue keeps a stub node of its own, which goes back in whenever the
+ * consumer would otherwise take the last node.
+ */
+
+typedef struct mpsc_node {
+    _Atomic(struct mpsc_node *) next;
+} mpsc_node_t;
+
+typedef struct {
+    _Atomic(mpsc_node_t *) head; /* the last pushed node, for the producers */
+    mpsc_node_t *tail;           /* the next node to pop, for the consumer */
+    mpsc_node_t stub;
+    bool stub_queued; /* pop() pushed the stub back behind tail */
+} mpsc_queue_t;
+
+struct __INTRUSIVE_QUEUE_API__ {
+    /** Initialize an empty queue */
+    void (*init)(mpsc_queue_t *);
+
+    /** Push a node, from any thread at any time. */
+    void (*push)(mpsc_queue_t *, mpsc_node_t *);
+
+    /** Pop the node at the front, from the consumer thread.
+     * @return NULL if the queue is empty, or if a producer is in the middle
+     * of pushing the next node: check again later.
+     */
+    mpsc_node_t *(*pop)(mpsc_queue_t *);
+
+    /** Take every node pushed so far at once, from the consumer thread.
+     * Walk them with next(), in order, from the returned node to @last.
+     * Only the nodes pushed before the last pop() are taken if it had to
+     * put the stub back behind a push in progress.
+     * @return NULL under the same conditions as pop().
+     */
+    mpsc_node_t *(*popAll)(mpsc_queue_t *, mpsc_node_t **last);
+
+    /** The node after @node in a chain from popAll, or NULL past @last.
+     * It waits for the producers still linking the chain.
+     */
+    mpsc_node_t *(*next)(mpsc_node_t *node, mpsc_node_t *last);
+} IntrusiveQueue;
+
 #include <assert.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stdlib.h>
 #include <string.h>
 
@@ -197,7 +245,114 @@ struct __QUEUE_API__ Queue = {
     .destroy = queue_destroy,
 };
 
+static void mpsc_init(mpsc_queue_t *q)
+{
+    atomic_init(&q->stub.next, NULL);
+    atomic_init(&q->head, &q->stub);
+    q->tail = &q->stub;
+    q->stub_queued = false;
+}
+
+static void mpsc_push(mpsc_queue_t *q, mpsc_node_t *node)
+{
+    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    mpsc_node_t *prev =
+        atomic_exchange_explicit(&q->head, node, memory_order_acq_rel);
+    /* the queue is cut between prev and node until this store */
+    atomic_store_explicit(&prev->next, node, memory_order_release);
+}
+
+static inline mpsc_node_t *mpsc_load_next(mpsc_node_t *node)
+{
+    return atomic_load_explicit(&node->next, memory_order_acquire);
+}
+
+/* Move the tail past the stub, return false if nothing follows it */
+static bool mpsc_skip_stub(mpsc_queue_t *q)
+{
+    if (q->tail != &q->stub)
+        return true;
+
+    mpsc_node_t *next = mpsc_load_next(&q->stub);
+    if (!next)
+        return false;
+    q->tail = next;
+    q->stub_queued = false;
+    return true;
+}
+
+static mpsc_node_t *mpsc_pop(mpsc_queue_t *q)
+{
+    if (!mpsc_skip_stub(q))
+        return NULL;
+
+    mpsc_node_t *tail = q->tail, *next = mpsc_load_next(tail);
+    if (next) {
+        q->tail = next;
+        return tail;
+    }
+
+    /* tail is the last node, unless a push is in progress */
+    if (tail != atomic_load_explicit(&q->head, memory_order_acquire))
+        return NULL;
+    q->stub_queued = true;
+    mpsc_push(q, &q->stub);
+
+    next = mpsc_load_next(tail);
+    if (!next)
+        return NULL;
+    q->tail = next;
+    return tail;
+}
+
+static mpsc_node_t *mpsc_chain_next(mpsc_node_t *node, mpsc_node_t *last)
+{
+    if (node == last)
+        return NULL;
+
+    mpsc_node_t *next;
+    while (!(next = mpsc_load_next(node)))
+        ; /* the producer of next has not linked it yet */
+    return next;
+}
+
+static mpsc_node_t *mpsc_pop_all(mpsc_queue_t *q, mpsc_node_t **last)
+{
+    if (!mpsc_skip_stub(q))
+        return NULL;
+
+    mpsc_node_t *first = q->tail;
+    if (q->stub_queued) {
+        /* A push got in before pop() put the stub back, which is now in the
+         * middle of the queue and still linked to by the producers: take
+         * the nodes before it only.
+         */
+        mpsc_node_t *node = first, *next;
+        while ((next = mpsc_chain_next(node, NULL)) != &q->stub)
+            node = next;
+        *last = node;
+        q->tail = &q->stub;
+        return first;
+    }
+
+    /* The stub is out of the queue, and no producer links to it anymore */
+    atomic_store_explicit(&q->stub.next, NULL, memory_order_relaxed);
+    *last = atomic_exchange_explicit(&q->head, &q->stub, memory_order_acq_rel);
+    q->tail = &q->stub;
+    return first;
+}
+
+/* API gateway */
+struct __INTRUSIVE_QUEUE_API__ IntrusiveQueue = {
+    .init = mpsc_init,
+    .push = mpsc_push,
+    .pop = mpsc_pop,
+    .popAll = mpsc_pop_all,
+    .next = mpsc_chain_next,
+};
+
 #include <pthread.h>
+#include <sched.h>
 #include <stdio.h>
 
 static void basic_test()
@@ -336,6 +491,175 @@ static void stress_test()
     Queue.destroy(test.q);
 }
 
+typedef struct {
+    int value;
+    mpsc_node_t link;
+} item_t;
+
+#define item_of(node) \
+    ((item_t *) ((char *) (node) - offsetof(item_t, link)))
+
+static void basic_intrusive_test()
+{
+    mpsc_queue_t q;
+    item_t items[64];
+    mpsc_node_t *node, *last;
+
+    IntrusiveQueue.init(&q);
+    assert(!IntrusiveQueue.pop(&q));
+    assert(!IntrusiveQueue.popAll(&q, &last));
+
+    /* push and pop one item */
+    items[0].value = 0;
+    IntrusiveQueue.push(&q, &items[0].link);
+    node = IntrusiveQueue.pop(&q);
+    assert(node == &items[0].link);
+    assert(!IntrusiveQueue.pop(&q));
+
+    /* pop half of the items one by one, then take the rest at once */
+    for (int i = 0; i < 64; ++i) {
+        items[i].value = i;
+        IntrusiveQueue.push(&q, &items[i].link);
+    }
+    for (int i = 0; i < 32; ++i) {
+        node = IntrusiveQueue.pop(&q);
+        assert(node && item_of(node)->value == i);
+    }
+    int i = 32;
+    for (node = IntrusiveQueue.popAll(&q, &last); node;
+         node = IntrusiveQueue.next(node, last))
+        assert(item_of(node)->value == i++);
+    assert(i == 64);
+    assert(!IntrusiveQueue.pop(&q));
+
+    /* the queue still works after popAll */
+    IntrusiveQueue.push(&q, &items[1].link);
+    IntrusiveQueue.push(&q, &items[2].link);
+    node = IntrusiveQueue.popAll(&q, &last);
+    assert(node == &items[1].link && last == &items[2].link);
+    assert(IntrusiveQueue.next(node, last) == last);
+    assert(!IntrusiveQueue.next(last, last));
+    IntrusiveQueue.push(&q, &items[3].link);
+    assert(IntrusiveQueue.pop(&q) == &items[3].link);
+
+    /* What pop() leaves when a push gets in right before it puts the stub
+     * back: items[4], items[5] not linked to it yet, then the stub, which
+     * the chain from popAll must stop before.
+     */
+    IntrusiveQueue.init(&q);
+    IntrusiveQueue.push(&q, &items[4].link);
+    assert(mpsc_skip_stub(&q) && q.tail == &items[4].link);
+    atomic_store(&items[5].link.next, NULL);
+    mpsc_node_t *prev = atomic_exchange(&q.head, &items[5].link);
+    q.stub_queued = true;
+    IntrusiveQueue.push(&q, &q.stub);
+    IntrusiveQueue.push(&q, &items[6].link);
+    atomic_store(&prev->next, &items[5].link);
+    node = IntrusiveQueue.popAll(&q, &last);
+    assert(node == &items[4].link && last == &items[5].link);
+    assert(IntrusiveQueue.next(node, last) == last);
+    assert(!IntrusiveQueue.next(last, last));
+    assert(IntrusiveQueue.pop(&q) == &items[6].link);
+    assert(!IntrusiveQueue.pop(&q));
+}
+
+#define ITEMS_PER_PRODUCER (64 * 1024)
+
+typedef struct {
+    mpsc_queue_t q;
+    item_t *items;
+    atomic_int next_producer;
+    /* The producers yield after each push, so that the queue is often down
+     * to a single node, and the consumer takes all whenever pop comes back
+     * empty: pop may have put the stub back behind a push then.
+     */
+    bool sparse;
+    int per_producer;
+} intrusive_test_t;
+
+/* Take turns with pop and popAll, checking that every item comes once */
+static void *intrusive_consumer(void *arg)
+{
+    intrusive_test_t *test = (intrusive_test_t *) arg;
+    const int total = PRODUCER_COUNT * test->per_producer;
+    char *seen = calloc(total, 1);
+    assert(seen);
+
+    bool empty = false;
+    for (int n = 0, round = 0; n < total; round++) {
+        mpsc_node_t *node, *last;
+        if (test->sparse ? empty : (round & 1)) {
+            node = IntrusiveQueue.popAll(&test->q, &last);
+        } else {
+            node = IntrusiveQueue.pop(&test->q);
+            last = node;
+        }
+        empty = !node;
+        for (; node; node = IntrusiveQueue.next(node, last)) {
+            int value = item_of(node)->value;
+            assert(value >= 0 && value < total && !seen[value]);
+            seen[value] = 1;
+            n++;
+        }
+    }
+    free(seen);
+    return NULL;
+}
+
+static void *intrusive_producer(void *arg)
+{
+    intrusive_test_t *test = (intrusive_test_t *) arg;
+    int p = atomic_fetch_add(&test->next_producer, 1);
+
+    for (int i = 0; i < test->per_producer; ++i) {
+        item_t *item = &test->items[p * test->per_producer + i];
+        item->value = p * test->per_producer + i;
+        IntrusiveQueue.push(&test->q, &item->link);
+        if (test->sparse)
+            sched_yield();
+    }
+    return NULL;
+}
+
+static void intrusive_stress_test(bool sparse)
+{
+    intrusive_test_t test;
+    IntrusiveQueue.init(&test.q);
+    atomic_init(&test.next_producer, 0);
+    test.sparse = sparse;
+    /* yielding makes each push much slower */
+    test.per_producer = sparse ? ITEMS_PER_PRODUCER / 16 : ITEMS_PER_PRODUCER;
+    /* all the memory the queue will use, allocated up front */
+    test.items = malloc(PRODUCER_COUNT * ITEMS_PER_PRODUCER * sizeof(item_t));
+    assert(test.items);
+
+    pthread_t consumer, producers[PRODUCER_COUNT];
+    {
+        int p_result =
+            pthread_create(&consumer, NULL, intrusive_consumer, &test);
+        assert(p_result == 0);
+    }
+    for (size_t i = 0; i < PRODUCER_COUNT; ++i) {
+        int p_result =
+            pthread_create(&producers[i], NULL, intrusive_producer, &test);
+        assert(p_result == 0);
+    }
+
+    for (size_t i = 0; i < PRODUCER_COUNT; ++i) {
+        int p_result = pthread_join(producers[i], NULL);
+        assert(p_result == 0);
+    }
+    {
+        int p_result = pthread_join(consumer, NULL);
+        assert(p_result == 0);
+    }
+
+    mpsc_node_t *last;
+    assert(!IntrusiveQueue.pop(&test.q));
+    assert(!IntrusiveQueue.popAll(&test.q, &last));
+    free(test.items);
+}
+
 int main(int argc, char *argv[])
 {
     printf("** Basic operations **\n");
@@ -346,5 +670,17 @@ int main(int argc, char *argv[])
     stress_test();
     printf("Verified OK!\n\n");
 
+    printf("** Intrusive basic operations **\n");
+    basic_intrusive_test();
+    printf("Verified OK!\n\n");
+
+    printf("** Intrusive stress test **\n");
+    intrusive_stress_test(false);
+    printf("Verified OK!\n\n");
+
+    printf("** Intrusive pop/popAll race test **\n");
+    intrusive_stress_test(true);
+    printf("Verified OK!\n\n");
+
     return 0;
 }
@@ -0,0 +1,167 @@
+/* Per-CPU counters over restartable sequences
+ *
+ * Each CPU owns a cache line of PERCPU_COUNTERS 64-bit counters, and
+ * percpu_add() adds to the line of the CPU it runs on, inside a restartable
+ * sequence (rseq): the kernel aborts the sequence if the thread is preempted,
+ * migrated or signaled before the add commits, and it is retried on the new
+ * CPU. So adding takes no atomic read-modify-write, touches only the line of
+ * the current CPU, and its cost stays flat however many threads there are.
+ * The readers sum a counter over the CPUs with percpu_sum(), the counters
+ * only ever grow and may be read while they are updated.
+ *
+ * The sequence is written for x86-64 and uses the rseq area that glibc 2.35
+ * and later registers for every thread. Elsewhere, or for the CPUs beyond
+ * PERCPU_MAX_CPUS, the counters are updated with an atomic add instead, as
+ * they always are with PERCPU_NO_RSEQ.
+ */
+
+#pragma once
+
+#include <sched.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <sys/sysinfo.h>
+#include <unistd.h>
+
+/* <sched.h> only declares it with _GNU_SOURCE, which may come too late */
+extern int sched_getcpu(void);
+
+/* ThreadSanitizer cannot see into the sequences, it gets the atomic adds */
+#if defined(__SANITIZE_THREAD__) && !defined(PERCPU_NO_RSEQ)
+#define PERCPU_NO_RSEQ
+#endif
+
+#if defined(__x86_64__) && defined(__GLIBC__) && !defined(PERCPU_NO_RSEQ) && \
+    __has_include(<sys/rseq.h>)
+#include <sys/rseq.h>
+#define PERCPU_RSEQ 1
+#else
+#define PERCPU_RSEQ 0
+#endif
+
+#ifndef PERCPU_MAX_CPUS
+#define PERCPU_MAX_CPUS 256
+#endif
+
+#define PERCPU_COUNTERS 8
+
+/* One line per CPU, and one more shared by the CPUs beyond PERCPU_MAX_CPUS,
+ * which is only updated atomically
+ */
+struct percpu {
+    struct {
+        uint64_t v[PERCPU_COUNTERS];
+    } __attribute__((aligned(64))) cpu[PERCPU_MAX_CPUS + 1];
+};
+
+/* The number of lines in use */
+static inline unsigned percpu_nr_lines__(void)
+{
+    static unsigned n;
+    unsigned cpus = __atomic_load_n(&n, __ATOMIC_RELAXED);
+
+    if (!cpus) {
+        cpus = get_nprocs_conf();
+        if (cpus > PERCPU_MAX_CPUS)
+            cpus = PERCPU_MAX_CPUS;
+        __atomic_store_n(&n, cpus, __ATOMIC_RELAXED);
+    }
+    return cpus;
+}
+
+#if PERCPU_RSEQ
+#define PERCPU_STR__(x) #x
+#define PERCPU_STR(x) PERCPU_STR__(x)
+
+static inline struct rseq *percpu_rseq__(void)
+{
+    return (struct rseq *) ((char *) __builtin_thread_pointer() +
+                            __rseq_offset);
+}
+
+/* Add @n to @v if the thread still runs on @cpu. The critical section goes
+ * from 1 to the add, which commits it, and the kernel restarts it at 4,
+ * right after the signature it checks, if it is interrupted.
+ */
+static inline bool percpu_rseq_add__(struct rseq *rs, uint32_t cpu,
+                                     uint64_t *v, uint64_t n)
+{
+    __asm__ __volatile__ goto(
+        ".pushsection __rseq_cs, \"aw\"\n\t"
+        ".balign 32\n\t"
+        "3:\n\t"
+        ".long 0x0, 0x0\n\t"
+        ".quad 1f, (2f - 1f), 4f\n\t"
+        ".popsection\n\t"
+        "leaq 3b(%%rip), %%rax\n\t"
+        "movq %%rax, %[rseq_cs]\n\t"
+        "1:\n\t"
+        "cmpl %[cpu], %[cpu_id]\n\t"
+        "jnz %l[abort]\n\t"
+        "addq %[n], (%[v])\n\t"
+        "2:\n\t"
+        ".pushsection __rseq_failure, \"ax\"\n\t"
+        ".byte 0x0f, 0xb9, 0x3d\n\t"
+        ".long " PERCPU_STR(RSEQ_SIG) "\n\t"
+        "4:\n\t"
+        "jmp %l[abort]\n\t"
+        ".popsection\n\t"
+        :
+        : [rseq_cs] "m"(rs->rseq_cs), [cpu_id] "m"(rs->cpu_id),
+          [cpu] "r"(cpu), [v] "r"(v), [n] "er"(n)
+        : "memory", "cc", "rax"
+        : abort);
+    return true;
+abort:
+    return false;
+}
+#endif
+
+/* Whether the adds run in restartable sequences */
+static inline bool percpu_has_rseq(void)
+{
+#if PERCPU_RSEQ
+    return __rseq_size > 0;
+#else
+    return false;
+#endif
+}
+
+/* Add @n to the counter @idx of the current CPU */
+static inline void percpu_add(struct percpu *p, unsigned idx, uint64_t n)
+{
+    unsigned line;
+
+#if PERCPU_RSEQ
+    if (__builtin_expect(percpu_has_rseq(), 1)) {
+        struct rseq *rs = percpu_rseq__();
+        uint32_t cpu;
+        while ((cpu = __atomic_load_n(&rs->cpu_id_start, __ATOMIC_RELAXED)) <
+               PERCPU_MAX_CPUS)
+            if (percpu_rseq_add__(rs, cpu, &p->cpu[cpu].v[idx], n))
+                return;
+        line = PERCPU_MAX_CPUS;
+    } else
+#endif
+    {
+        /* Every add is atomic then, the CPU only spreads them. Release and
+         * acquire cost nothing more on x86, and let ThreadSanitizer follow
+         * the orderings built on the counters.
+         */
+        int cpu = sched_getcpu();
+        line = cpu < 0 ? PERCPU_MAX_CPUS : (unsigned) cpu % PERCPU_MAX_CPUS;
+    }
+    __atomic_fetch_add(&p->cpu[line].v[idx], n, __ATOMIC_RELEASE);
+}
+
+/* The sum of the counter @idx over the CPUs */
+static inline uint64_t percpu_sum(const struct percpu *p, unsigned idx)
+{
+    unsigned lines = percpu_nr_lines__();
+    uint64_t sum = __atomic_load_n(&p->cpu[PERCPU_MAX_CPUS].v[idx],
+                                   __ATOMIC_ACQUIRE);
+
+    for (unsigned i = 0; i < lines; i++)
+        sum += __atomic_load_n(&p->cpu[i].v[idx], __ATOMIC_ACQUIRE);
+    return sum;
+}
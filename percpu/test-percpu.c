@@ -0,0 +1,67 @@
+/* More threads than CPUs add to the counters while a profiling timer keeps
+ * interrupting them, so that restartable sequences abort and retry, and the
+ * sums have to come out exact all the same.
+ */
+
+#include <assert.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdio.h>
+#include <string.h>
+#include <sys/time.h>
+
+#include "percpu.h"
+
+#define N_THREADS 16
+#define N_LOOPS (1 << 20)
+
+static struct percpu counters;
+static volatile sig_atomic_t signals;
+
+static void on_signal(int sig)
+{
+    signals++;
+}
+
+static void *worker(void *arg)
+{
+    uintptr_t id = (uintptr_t) arg;
+
+    for (uint64_t i = 0; i < N_LOOPS; i++) {
+        percpu_add(&counters, 0, 1);
+        percpu_add(&counters, 1 + id % (PERCPU_COUNTERS - 1), i & 7);
+    }
+    return NULL;
+}
+
+int main(void)
+{
+    pthread_t threads[N_THREADS];
+    struct sigaction sa;
+    struct itimerval tick = {{0, 1000}, {0, 1000}};
+
+    memset(&sa, 0, sizeof(sa));
+    sa.sa_handler = on_signal;
+    sa.sa_flags = SA_RESTART;
+    assert(!sigaction(SIGPROF, &sa, NULL));
+    assert(!setitimer(ITIMER_PROF, &tick, NULL));
+
+    for (uintptr_t i = 0; i < N_THREADS; i++)
+        assert(!pthread_create(&threads[i], NULL, worker, (void *) i));
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_join(threads[i], NULL);
+
+    memset(&tick, 0, sizeof(tick));
+    setitimer(ITIMER_PROF, &tick, NULL);
+
+    /* Each thread adds 0 to 7 in turn, 3.5 on average */
+    uint64_t per_thread = (uint64_t) N_LOOPS / 8 * 28, total = 0;
+    assert(percpu_sum(&counters, 0) == (uint64_t) N_THREADS * N_LOOPS);
+    for (int i = 1; i < PERCPU_COUNTERS; i++)
+        total += percpu_sum(&counters, i);
+    assert(total == N_THREADS * per_thread);
+
+    printf("OK (%s, %d signals)\n", percpu_has_rseq() ? "rseq" : "atomic",
+           (int) signals);
+    return 0;
+}
@@ -1,7 +1,12 @@
+#define _GNU_SOURCE
+
+#include <errno.h>
 #include <fcntl.h>
+#include <spawn.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/stat.h>
 #include <sys/wait.h>
 #include <unistd.h>
 
@@ -42,15 +47,146 @@ static int is_special(int c)
     return is_delim(c) || is_redir(c) || is_blank(c);
 }
 
-/* Recursively run right-most part of the command line printing output to the
- * file descriptor @t
+#define MAX_STAGES 64
+#define HASH_SIZE 64
+
+/* Hashed command paths, like the "hash" builtin of bash */
+struct cmd {
+    struct cmd *next;
+    unsigned hits;
+    char *name;
+    char path[];
+};
+
+static struct cmd *cmd_hash[HASH_SIZE];
+
+static unsigned cmd_bucket(const char *name)
+{
+    unsigned h = 2166136261u; /* FNV-1a */
+    while (*name)
+        h = (h ^ (unsigned char) *name++) * 16777619u;
+    return h % HASH_SIZE;
+}
+
+static struct cmd **cmd_find(const char *name)
+{
+    struct cmd **p = &cmd_hash[cmd_bucket(name)];
+    for (; *p; p = &(*p)->next)
+        if (!strcmp((*p)->name, name))
+            break;
+    return p;
+}
+
+/* Search PATH for @name and remember where it was found */
+static struct cmd *cmd_search(const char *name)
+{
+    const char *dir = getenv("PATH");
+    if (!dir)
+        dir = "/bin:/usr/bin";
+
+    size_t len = strlen(name);
+    for (const char *end; *dir; dir = *end ? end + 1 : end) {
+        end = strchrnul(dir, ':');
+        size_t dlen = end - dir;
+        struct cmd *e = malloc(sizeof(*e) + dlen + len + 2);
+        if (!e)
+            return NULL;
+        /* an empty PATH entry is the current directory */
+        memcpy(e->path, dir, dlen);
+        e->path[dlen] = '/';
+        memcpy(e->path + dlen + 1, name, len + 1);
+        if (!dlen)
+            memmove(e->path, e->path + 1, len + 1);
+        /* access() alone would take a directory for a command */
+        struct stat st;
+        if (!stat(e->path, &st) && S_ISREG(st.st_mode) &&
+            !access(e->path, X_OK)) {
+            struct cmd **p = cmd_find(name);
+            e->name = strdup(name);
+            e->hits = 0;
+            e->next = NULL;
+            return *p = e;
+        }
+        free(e);
+    }
+    return NULL;
+}
+
+static void cmd_forget(const char *name)
+{
+    struct cmd **p = cmd_find(name), *e = *p;
+    if (!e)
+        return;
+    *p = e->next;
+    free(e->name);
+    free(e);
+}
+
+static void cmd_clear()
+{
+    for (int i = 0; i < HASH_SIZE; i++)
+        while (cmd_hash[i])
+            cmd_forget(cmd_hash[i]->name);
+}
+
+/* Resolve @name into the path to run, NULL if it is nowhere in PATH. The
+ * @cached flag tells whether the path came from the table.
+ */
+static const char *cmd_lookup(const char *name, int *cached)
+{
+    *cached = 0;
+    if (strchr(name, '/'))
+        return name;
+
+    struct cmd *e = *cmd_find(name);
+    if (e)
+        *cached = 1;
+    else if (!(e = cmd_search(name)))
+        return NULL;
+    e->hits++;
+    return e->path;
+}
+
+/* Built-in command: hash [-r] [name...] */
+static int hash(char **argv)
+{
+    if (!argv[1]) {
+        printf("hits\tcommand\n");
+        for (int i = 0; i < HASH_SIZE; i++)
+            for (struct cmd *e = cmd_hash[i]; e; e = e->next)
+                printf("%4u\t%s\n", e->hits, e->path);
+        fflush(stdout);
+        return 0;
+    }
+
+    int ret = 0;
+    for (argv++; *argv; argv++) {
+        if (!strcmp(*argv, "-r"))
+            cmd_clear();
+        else if (!*cmd_find(*argv) && !cmd_search(*argv))
+            ret = -1;
+    }
+    return ret;
+}
+
+/* A pipeline stage: its words and redirections */
+struct stage {
+    char *v[99];
+    char **argv;
+    char *redir_stdin, *redir_stdout;
+};
+
+/* Parse the right-most stage of the command line ending at @c into @s.
+ * Return where the stage starts (the pipe before it, or the beginning of the
+ * line), NULL if the stage is empty.
  */
-static void run(char *c, int t)
+static char *parse(char *c, struct stage *s)
 {
-    char *redir_stdin = NULL, *redir_stdout = NULL;
-    int pipefds[2] = {0, 0}, outfd = 0;
-    char *v[99] = {0};
+    char **v = s->v;
     char **u = &v[98]; /* end of words */
+
+    s->redir_stdin = s->redir_stdout = NULL;
+    v[98] = NULL;
     for (;;) {
         c--;
         if (is_delim(*c)) /* if NULL (start of string) or pipe: break */
@@ -64,59 +200,108 @@ static void run(char *c, int t)
         }
         if (is_redir(*c)) { /* If < or > */
             if (*c == '<')
-                redir_stdin = *u;
+                s->redir_stdin = *u;
             else
-                redir_stdout = *u;
+                s->redir_stdout = *u;
             if ((u - v) != 98)
                 u++;
         }
     }
     if ((u - v) == 98) /* empty input */
-        return;
+        return NULL;
+    s->argv = u;
+    return c;
+}
 
-    if (!strcmp(*u, "cd")) { /* built-in command: cd */
-        fatal(chdir(u[1]), 0);
-        return; /* actually, should run() again */
-    }
+/* Start stage @s reading from @in and writing to @out (-1 for the terminal).
+ * posix_spawn() does not copy the shell's address space, glibc creates the
+ * child with vfork semantics.
+ */
+static pid_t spawn(struct stage *s, int in, int out)
+{
+    posix_spawn_file_actions_t fa;
+    pid_t pid = -1;
+    int cached, err;
 
-    if (*c) {
-        pipe(pipefds);
-        outfd = pipefds[1]; /* write end of the pipe */
-    }
+    posix_spawn_file_actions_init(&fa);
+    if (in >= 0)
+        posix_spawn_file_actions_adddup2(&fa, in, 0);
+    if (out >= 0)
+        posix_spawn_file_actions_adddup2(&fa, out, 1);
+    if (s->redir_stdin)
+        posix_spawn_file_actions_addopen(&fa, 0, s->redir_stdin, O_RDONLY, 0);
+    if (s->redir_stdout)
+        posix_spawn_file_actions_addopen(&fa, 1, s->redir_stdout,
+                                         O_WRONLY | O_CREAT | O_TRUNC, 438);
 
-    pid_t pid = fork();
-    if (pid) { /* Parent or error */
-        fatal(pid, 1);
-        if (outfd) {
-            run(c, outfd);     /* parse the rest of the cmdline */
-            close(outfd);      /* close output fd */
-            close(pipefds[0]); /* close read end of the pipe */
-        }
-        wait(0);
-        return;
+    const char *path = cmd_lookup(*s->argv, &cached);
+    err = path ? posix_spawn(&pid, path, &fa, NULL, s->argv, environ) : ENOENT;
+    if (err == ENOENT && cached) { /* moved or removed since it was hashed */
+        cmd_forget(*s->argv);
+        path = cmd_lookup(*s->argv, &cached);
+        if (path)
+            err = posix_spawn(&pid, path, &fa, NULL, s->argv, environ);
     }
+    posix_spawn_file_actions_destroy(&fa);
 
-    if (outfd) {
-        dup2(pipefds[0], 0); /* dup read fd to stdin */
-        close(pipefds[0]);   /* close read fd */
-        close(outfd);        /* close output */
+    if (err) {
+        dprintf(2, "%s: %s\n", *s->argv, strerror(err));
+        return -1;
     }
+    return pid;
+}
 
-    if (redir_stdin) {
-        close(0); /* replace stdin with redir_stdin */
-        fatal(open(redir_stdin, 0), 1);
-    }
+/* Run the command line ending at @c. All the stages are parsed first, then
+ * started left to right, each on the pipe of the previous one, and only waited
+ * for once they all run.
+ */
+static void run(char *c)
+{
+    static struct stage stages[MAX_STAGES]; /* right-most first */
+    pid_t pids[MAX_STAGES];
+    int n = 0, npids = 0, in = -1;
 
-    if (t) {
-        dup2(t, 1); /* replace stdout with t */
-        close(t);
+    do {
+        if (n == MAX_STAGES) {
+            fatal(-1, 0);
+            return;
+        }
+        if (!(c = parse(c, &stages[n++])))
+            return;
+    } while (*c);
+
+    if (n == 1) {
+        char **u = stages[0].argv;
+        if (!strcmp(*u, "cd")) { /* built-in command: cd */
+            fatal(chdir(u[1] ? u[1] : getenv("HOME")), 0);
+            return;
+        }
+        if (!strcmp(*u, "hash")) {
+            fatal(hash(u), 0);
+            return;
+        }
     }
 
-    if (redir_stdout) {
-        close(1);
-        fatal(creat(redir_stdout, 438), 1); /* replace stdout with redir */
+    while (n--) {
+        int pipefds[2] = {-1, -1};
+        if (n && pipe2(pipefds, O_CLOEXEC) < 0) {
+            fatal(-1, 0);
+            break;
+        }
+        pid_t pid = spawn(&stages[n], in, pipefds[1]);
+        if (pid > 0)
+            pids[npids++] = pid;
+        if (in >= 0)
+            close(in);
+        if (pipefds[1] >= 0)
+            close(pipefds[1]);
+        in = pipefds[0];
     }
-    fatal(execvp(*u, u), 1);
+    if (in >= 0)
+        close(in);
+
+    while (npids)
+        waitpid(pids[--npids], NULL, 0);
 }
 
 int main()
@@ -129,7 +314,7 @@ int main()
             exit(0);
         for (; *++c;) /* skip to end of line */
             ;
-        run(c, 0);
+        run(c);
     }
     return 0;
 }
@@ -6,29 +6,127 @@
  * directly) or be preempted by a timer, and in that case nonvoluntary
  * scheduling occurs.
  *
- * The default time slice is 10ms, that means that each 10ms SIGALRM fires and
- * next context is scheduled by round robin algorithm.
+ * There is one scheduler per core, each a kernel thread with its own run
+ * queue and its own timer: a per-thread CPU-time timer, ticking every
+ * millisecond that the thread actually runs. Tasks are picked as by the O(1)
+ * scheduler of Linux: each priority has its own run list, with a bitmap of
+ * the non-empty ones, so the highest priority ready task is found with a
+ * single bit scan. A task runs for a time slice that grows with its priority,
+ * then goes to the expired array, which becomes the active one once every
+ * other task used its slice. A task waking from task_sleep() goes back to the
+ * active array, and preempts a lower priority task at the next tick.
+ *
+ * A load balancer moves the ready tasks from the busiest core to the idle
+ * ones, and to the busy ones every few ticks when the imbalance is large.
  */
 
 #define _GNU_SOURCE
+#include <pthread.h>
 #include <signal.h>
+#include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
 #include <ucontext.h>
 #include <unistd.h>
 
 #include "list.h"
 
-static int preempt_count = 0;
+#define TASK_PRIOS 32 /* 0 is the highest priority */
+#define TASK_TICK_US 1000
+#define TASK_BALANCE_TICKS 8 /* between two balancing of a busy core */
+#define TASK_IDLE_US 1000    /* between two balancing of an idle core */
+
+/* The stacks are aligned to their size, and start with a pointer to their
+ * task, as the thread_info of older Linux kernels.
+ */
+#define TASK_STACK_SIZE (1 << 20)
+
+/* The time slice, in ticks: from 128 ms at priority 0 down to 4 ms */
+#define task_slice(prio) ((TASK_PRIOS - (prio)) * 4)
+
+typedef void(task_callback_t)(void *arg);
+
+struct task_struct {
+    struct list_head list; /* in a run list, the sleepers or the reaps */
+    ucontext_t context;
+    void *stack;
+    task_callback_t *callback;
+    void *arg;
+    int prio;
+    int slice_left; /* in ticks */
+    uint64_t wake_ns;
+    volatile int preempt_count;
+};
+
+struct prio_array {
+    uint32_t bitmap; /* bit p is set when queue[p] is not empty */
+    struct list_head queue[TASK_PRIOS];
+};
+
+/* A core runs its idle task on the stack of its thread: it is never queued,
+ * and runs when no other task is ready.
+ *
+ * The lock is held across every switch, and released by the next task, so
+ * that no other core takes the previous one before its context is saved.
+ */
+struct cpu {
+    pthread_mutex_t lock;
+    struct prio_array arrays[2];
+    struct prio_array *active, *expired;
+    struct list_head sleeping; /* by wake time */
+    struct list_head reap;
+    atomic_int nr_ready; /* read by the other cores when balancing */
+    struct task_struct *current;
+    struct task_struct idle;
+    unsigned int ticks;
+    timer_t timer;
+    pthread_t thread;
+};
+
+static struct cpu *cpus;
+static int nr_cpus;
+static atomic_int task_count;
+
+static __thread struct cpu *cpu_tls;
+
+/* The core emulated by the calling kernel thread. A task that swapcontext()
+ * left in __schedule() may be balanced to another core and resumed there, so
+ * __schedule() asks again once it is back; an inlined read of cpu_tls could
+ * still hand it the core the task left from.
+ */
+static __attribute__((noinline)) struct cpu *this_cpu(void)
+{
+    struct cpu *c = cpu_tls;
+    __asm__ __volatile__("" ::: "memory");
+    return c;
+}
+
+/* The task running this code, found from its stack whichever core it is on */
+static inline struct task_struct *task_self(void)
+{
+    char here;
+    uintptr_t base = (uintptr_t) &here & ~(uintptr_t) (TASK_STACK_SIZE - 1);
+    return *(struct task_struct **) base;
+}
+
+/* The count belongs to the task, not to the core: a task preempted in the
+ * middle of an increment could be migrated, and finish it on a count that is
+ * no longer its own. Only the tasks call these, never the idle loop.
+ */
 static void preempt_disable(void)
 {
-    preempt_count++;
+    task_self()->preempt_count++;
+    atomic_signal_fence(memory_order_seq_cst);
 }
 static void preempt_enable(void)
 {
-    preempt_count--;
+    atomic_signal_fence(memory_order_seq_cst);
+    task_self()->preempt_count--;
 }
 
 static void local_irq_save(sigset_t *sig_set)
@@ -51,32 +149,114 @@ static void local_irq_restore(sigset_t *sig_set)
         preempt_enable();    \
     })
 
-typedef void(task_callback_t)(void *arg);
+static uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
 
-struct task_struct {
-    struct list_head list;
-    ucontext_t context;
-    void *stack;
-    task_callback_t *callback;
-    void *arg;
-    bool reap_self;
-};
+static void cpus_init(int n)
+{
+    cpus = calloc(n, sizeof(struct cpu));
+    if (!cpus)
+        abort();
+    nr_cpus = n;
+
+    for (int i = 0; i < n; i++) {
+        struct cpu *c = &cpus[i];
+        pthread_mutex_init(&c->lock, NULL);
+        for (int a = 0; a < 2; a++) {
+            c->arrays[a].bitmap = 0;
+            for (int p = 0; p < TASK_PRIOS; p++)
+                INIT_LIST_HEAD(&c->arrays[a].queue[p]);
+        }
+        c->active = &c->arrays[0];
+        c->expired = &c->arrays[1];
+        INIT_LIST_HEAD(&c->sleeping);
+        INIT_LIST_HEAD(&c->reap);
+        atomic_init(&c->nr_ready, 0);
+        INIT_LIST_HEAD(&c->idle.list);
+        c->current = &c->idle;
+    }
+    cpu_tls = &cpus[0];
+}
+
+/* The helpers of the run queue are called with the lock of the core held */
+static void rq_enqueue(struct cpu *c,
+                       struct prio_array *array,
+                       struct task_struct *task,
+                       bool head)
+{
+    if (head)
+        list_add(&task->list, &array->queue[task->prio]);
+    else
+        list_add_tail(&task->list, &array->queue[task->prio]);
+    array->bitmap |= 1U << task->prio;
+    atomic_fetch_add_explicit(&c->nr_ready, 1, memory_order_relaxed);
+}
+
+static void rq_dequeue(struct cpu *c,
+                       struct prio_array *array,
+                       struct task_struct *task)
+{
+    list_del_init(&task->list);
+    if (list_empty(&array->queue[task->prio]))
+        array->bitmap &= ~(1U << task->prio);
+    atomic_fetch_sub_explicit(&c->nr_ready, 1, memory_order_relaxed);
+}
+
+/* Take the highest priority task, or NULL if none is ready */
+static struct task_struct *rq_pick(struct cpu *c)
+{
+    if (!c->active->bitmap) {
+        struct prio_array *array = c->active;
+        c->active = c->expired;
+        c->expired = array;
+        if (!c->active->bitmap)
+            return NULL;
+    }
 
-static struct task_struct *task_current, task_main;
-static LIST_HEAD(task_reap);
+    int prio = __builtin_ctz(c->active->bitmap);
+    struct task_struct *task =
+        list_first_entry(&c->active->queue[prio], struct task_struct, list);
+    rq_dequeue(c, c->active, task);
+    return task;
+}
 
-static void task_init(void)
+/* Take a task for another core: the lowest priority one, from the expired
+ * array first, as the least likely to run here soon.
+ */
+static struct task_struct *rq_steal(struct cpu *c, bool *expired)
 {
-    INIT_LIST_HEAD(&task_main.list);
-    task_current = &task_main;
+    struct prio_array *array = c->expired;
+
+    *expired = true;
+    if (!array->bitmap) {
+        array = c->active;
+        *expired = false;
+        if (!array->bitmap)
+            return NULL;
+    }
+
+    int prio = 31 - __builtin_clz(array->bitmap);
+    struct task_struct *task =
+        list_last_entry(&array->queue[prio], struct task_struct, list);
+    rq_dequeue(c, array, task);
+    return task;
 }
 
-static struct task_struct *task_alloc(task_callback_t *func, void *arg)
+static struct task_struct *task_alloc(task_callback_t *func,
+                                      void *arg,
+                                      int prio)
 {
     struct task_struct *task = calloc(1, sizeof(*task));
-    task->stack = calloc(1, 1 << 20);
+    task->stack = aligned_alloc(TASK_STACK_SIZE, TASK_STACK_SIZE);
+    *(struct task_struct **) task->stack = task;
     task->callback = func;
     task->arg = arg;
+    task->prio = prio;
+    task->slice_left = task_slice(prio);
     return task;
 }
 
@@ -85,34 +265,141 @@ static void task_destroy(struct task_struct *task)
     list_del(&task->list);
     free(task->stack);
     free(task);
+    atomic_fetch_sub(&task_count, 1);
 }
 
-static void task_switch_to(struct task_struct *from, struct task_struct *to)
+/* Switch to the next task, the current one being already queued where it
+ * belongs. Called with the timer signal blocked and the lock of the core
+ * held, which is released on the other side of the switch.
+ */
+static void __schedule(struct cpu *c)
 {
-    task_current = to;
-    swapcontext(&from->context, &to->context);
+    struct task_struct *prev = c->current;
+    struct task_struct *next_task = rq_pick(c);
+    if (!next_task)
+        next_task = &c->idle;
+
+    if (next_task != prev) {
+        c->current = next_task;
+        swapcontext(&prev->context, &next_task->context);
+        /* Possibly resumed by another core */
+        c = this_cpu();
+    }
+    pthread_mutex_unlock(&c->lock);
 }
 
+/* Voluntary scheduling, behind the ready tasks of the same priority */
 static void schedule(void)
 {
     sigset_t set;
     local_irq_save(&set);
 
-    struct task_struct *next_task =
-        list_first_entry(&task_current->list, struct task_struct, list);
-    if (next_task) {
-        if (task_current->reap_self)
-            list_move(&task_current->list, &task_reap);
-        task_switch_to(task_current, next_task);
+    struct cpu *c = this_cpu();
+    pthread_mutex_lock(&c->lock);
+    if (c->current != &c->idle)
+        rq_enqueue(c, c->active, c->current, false);
+    __schedule(c);
+
+    local_irq_restore(&set);
+}
+
+static void task_wake_sleepers(struct cpu *c)
+{
+    uint64_t now = now_ns();
+
+    while (!list_empty(&c->sleeping)) {
+        struct task_struct *task =
+            list_first_entry(&c->sleeping, struct task_struct, list);
+        if (task->wake_ns > now)
+            break;
+        list_del(&task->list);
+        rq_enqueue(c, c->active, task, false);
     }
+}
 
-    struct task_struct *task, *tmp;
-    list_for_each_entry_safe (task, tmp, &task_reap, list) /* clean reaps */
-        task_destroy(task);
+static void task_sleep(unsigned int usecs)
+{
+    sigset_t set;
+    local_irq_save(&set);
+
+    struct cpu *c = this_cpu();
+    struct task_struct *task = c->current, *pos;
+    pthread_mutex_lock(&c->lock);
+    task->wake_ns = now_ns() + usecs * 1000ULL;
+    list_for_each_entry (pos, &c->sleeping, list) {
+        if (pos->wake_ns > task->wake_ns)
+            break;
+    }
+    list_add_tail(&task->list, &pos->list);
+    __schedule(c);
 
     local_irq_restore(&set);
 }
 
+/* Pull a ready task from the core with the most of them, if it has at least
+ * two more than this one, or any if this one is idle. Called with the timer
+ * signal blocked but no lock held: the task is in no run queue in between.
+ */
+static bool load_balance(struct cpu *c, bool idle)
+{
+    int mine = atomic_load_explicit(&c->nr_ready, memory_order_relaxed);
+    struct cpu *busiest = NULL;
+    int max = 0;
+
+    for (int i = 0; i < nr_cpus; i++) {
+        int n = atomic_load_explicit(&cpus[i].nr_ready, memory_order_relaxed);
+        if (&cpus[i] != c && n > max) {
+            max = n;
+            busiest = &cpus[i];
+        }
+    }
+    if (!busiest || max < (idle ? 1 : mine + 2))
+        return false;
+
+    bool expired;
+    pthread_mutex_lock(&busiest->lock);
+    struct task_struct *task = rq_steal(busiest, &expired);
+    pthread_mutex_unlock(&busiest->lock);
+    if (!task)
+        return false;
+
+    pthread_mutex_lock(&c->lock);
+    rq_enqueue(c, expired ? c->expired : c->active, task, false);
+    pthread_mutex_unlock(&c->lock);
+    return true;
+}
+
+/* On every tick of CPU time: charge the current task, and preempt it once
+ * its slice is used or a higher priority task is ready.
+ */
+static void task_tick(void)
+{
+    struct cpu *c = this_cpu();
+    struct task_struct *task = c->current;
+
+    if (++c->ticks % TASK_BALANCE_TICKS == 0)
+        load_balance(c, task == &c->idle);
+
+    pthread_mutex_lock(&c->lock);
+    task_wake_sleepers(c);
+    if (task == &c->idle) {
+        __schedule(c);
+        return;
+    }
+
+    if (--task->slice_left <= 0) {
+        task->slice_left = task_slice(task->prio);
+        rq_enqueue(c, c->expired, task, false);
+        __schedule(c);
+    } else if (c->active->bitmap & ((1U << task->prio) - 1)) {
+        /* Keeps the rest of its slice, ahead of its peers */
+        rq_enqueue(c, c->active, task, true);
+        __schedule(c);
+    } else {
+        pthread_mutex_unlock(&c->lock);
+    }
+}
+
 union task_ptr {
     void *p;
     int i[2];
@@ -129,26 +416,34 @@ __attribute__((noreturn)) static void task_trampoline(int i0, int i1)
     union task_ptr ptr = {.i = {i0, i1}};
     struct task_struct *task = ptr.p;
 
-    /* We switch to trampoline with blocked timer.  That is safe.
-     * So the first thing that we have to do is to unblock timer signal.
-     * Paired with task_add().
+    /* We switch to trampoline with blocked timer and the lock of the core
+     * held.  That is safe.  So the first thing that we have to do is to
+     * release the lock and unblock timer signal.  Paired with task_add().
      */
+    pthread_mutex_unlock(&this_cpu()->lock);
     local_irq_restore_trampoline(task);
     task->callback(task->arg);
-    task->reap_self = true;
-    schedule();
+
+    sigset_t set;
+    local_irq_save(&set);
+    struct cpu *c = this_cpu();
+    pthread_mutex_lock(&c->lock);
+    list_add(&task->list, &c->reap);
+    __schedule(c);
 
     __builtin_unreachable(); /* shall not reach here */
 }
 
-static void task_add(task_callback_t *func, void *param)
+/* Add a task to the core the caller runs on, the balancer spreads them */
+static void task_add(task_callback_t *func, void *param, int prio)
 {
-    struct task_struct *task = task_alloc(func, param);
+    struct task_struct *task = task_alloc(func, param, prio);
     if (getcontext(&task->context) == -1)
         abort();
 
-    task->context.uc_stack.ss_sp = task->stack;
-    task->context.uc_stack.ss_size = 1 << 20;
+    /* Keep clear of the pointer to the task at the base */
+    task->context.uc_stack.ss_sp = (char *) task->stack + 64;
+    task->context.uc_stack.ss_size = TASK_STACK_SIZE - 64;
     task->context.uc_stack.ss_flags = 0;
     task->context.uc_link = NULL;
 
@@ -161,20 +456,25 @@ static void task_add(task_callback_t *func, void *param)
      */
     sigaddset(&task->context.uc_sigmask, SIGALRM);
 
-    preempt_disable();
-    list_add_tail(&task->list, &task_main.list);
-    preempt_enable();
+    sigset_t set;
+    local_irq_save(&set);
+    struct cpu *c = this_cpu();
+    pthread_mutex_lock(&c->lock);
+    rq_enqueue(c, c->active, task, false);
+    atomic_fetch_add(&task_count, 1);
+    pthread_mutex_unlock(&c->lock);
+    local_irq_restore(&set);
 }
 
 static void timer_handler(int signo, siginfo_t *info, ucontext_t *ctx)
 {
-    if (preempt_count) /* once preemption is disabled */
+    if (this_cpu()->current->preempt_count) /* once preemption is disabled */
         return;
 
     /* We can schedule directly from sighandler because Linux kernel cares only
      * about proper sigreturn frame in the stack.
      */
-    schedule();
+    task_tick();
 }
 
 static void timer_init(void)
@@ -187,21 +487,90 @@ static void timer_init(void)
     sigaction(SIGALRM, &sa, NULL);
 }
 
-static void timer_create(unsigned int usecs)
+#ifndef sigev_notify_thread_id
+#define sigev_notify_thread_id _sigev_un._tid
+#endif
+
+/* Tick every "usecs" of CPU time of the calling thread, unlike alarm()
+ * counting the wall-clock time of the whole process.
+ */
+static void timer_start(struct cpu *c, unsigned int usecs)
 {
-    ualarm(usecs, usecs);
+    struct sigevent sev = {
+        .sigev_notify = SIGEV_THREAD_ID,
+        .sigev_signo = SIGALRM,
+    };
+    sev.sigev_notify_thread_id = syscall(SYS_gettid);
+    if (timer_create(CLOCK_THREAD_CPUTIME_ID, &sev, &c->timer) == -1)
+        abort();
+
+    struct itimerspec its = {
+        .it_value = {.tv_nsec = usecs * 1000L},
+        .it_interval = {.tv_nsec = usecs * 1000L},
+    };
+    if (timer_settime(c->timer, 0, &its, NULL) == -1)
+        abort();
 }
-static void timer_cancel(void)
+
+static void timer_cancel(struct cpu *c)
 {
-    ualarm(0, 0);
+    timer_delete(c->timer);
+}
+
+/* With no task ready, the idle task frees the tasks that quit, and looks for
+ * work on the other cores. Failing that, it sleeps until its first sleeper is
+ * due or the next balancing, since the CPU-time timer does not tick meanwhile.
+ */
+static void task_idle(struct cpu *c)
+{
+    struct task_struct *task, *tmp;
+    LIST_HEAD(reap);
+    sigset_t set;
+    local_irq_save(&set);
+
+    pthread_mutex_lock(&c->lock);
+    list_splice_init(&c->reap, &reap);
+    bool ready = c->active->bitmap || c->expired->bitmap;
+    uint64_t wake = now_ns() + TASK_IDLE_US * 1000ULL;
+    if (!list_empty(&c->sleeping)) {
+        task = list_first_entry(&c->sleeping, struct task_struct, list);
+        if (task->wake_ns < wake)
+            wake = task->wake_ns;
+    }
+    pthread_mutex_unlock(&c->lock);
+
+    list_for_each_entry_safe (task, tmp, &reap, list) /* clean reaps */
+        task_destroy(task);
+
+    if (!ready && !load_balance(c, true)) {
+        struct timespec ts = {
+            .tv_sec = wake / 1000000000,
+            .tv_nsec = wake % 1000000000,
+        };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL))
+            ;
+    }
+
+    pthread_mutex_lock(&c->lock);
+    task_wake_sleepers(c);
+    pthread_mutex_unlock(&c->lock);
+
+    local_irq_restore(&set);
 }
 
-static void timer_wait(void)
+/* The scheduler of a core, its idle task being the rest of this function */
+static void *cpu_run(void *arg)
 {
-    sigset_t mask;
-    sigprocmask(0, NULL, &mask);
-    sigdelset(&mask, SIGALRM);
-    sigsuspend(&mask);
+    struct cpu *c = arg;
+
+    cpu_tls = c;
+    timer_start(c, TASK_TICK_US);
+    while (atomic_load(&task_count)) {
+        schedule();
+        task_idle(c);
+    }
+    timer_cancel(c);
+    return NULL;
 }
 
 static int cmp_u32(const void *a, const void *b, void *arg)
@@ -263,24 +632,64 @@ static void sort(void *arg)
     preempt_enable();
 }
 
-int main()
-{
-    timer_init();
-    task_init();
+#define TICKER_ROUNDS 100
+#define TICKER_PERIOD_US 5000
 
-    task_add(sort, "1"), task_add(sort, "2"), task_add(sort, "3");
+/* A latency-sensitive task, waking up periodically for a short while */
+static void ticker(void *arg)
+{
+    uint64_t total = 0, max = 0;
+
+    for (int i = 0; i < TICKER_ROUNDS; i++) {
+        task_sleep(TICKER_PERIOD_US);
+        uint64_t late = now_ns() - task_self()->wake_ns;
+        total += late;
+        if (late > max)
+            max = late;
+    }
 
-    preempt_disable();
-    timer_create(10000); /* 10 ms */
+    task_printf("[ticker] wakeup latency: avg %lu us, max %lu us\n",
+                (unsigned long) (total / TICKER_ROUNDS / 1000),
+                (unsigned long) (max / 1000));
+}
 
-    while (!list_empty(&task_main.list) || !list_empty(&task_reap)) {
-        preempt_enable();
-        timer_wait();
-        preempt_disable();
+/* Usage: task_sched [-f] [-c cores]
+ *
+ * The sorts run at a batch priority next to a high priority ticker, or all at
+ * the same priority with -f, on one scheduler per online core by default.
+ */
+int main(int argc, char *argv[])
+{
+    int opt, n = sysconf(_SC_NPROCESSORS_ONLN);
+    bool flat = false;
+
+    while ((opt = getopt(argc, argv, "fc:")) != -1) {
+        switch (opt) {
+        case 'f':
+            flat = true;
+            break;
+        case 'c':
+            n = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
     }
+    if (n < 1)
+        n = 1;
 
-    preempt_enable();
-    timer_cancel();
+    timer_init();
+    cpus_init(n);
+
+    task_add(sort, "1", 20), task_add(sort, "2", 20), task_add(sort, "3", 20);
+    task_add(ticker, NULL, flat ? 20 : 0);
+
+    for (int i = 1; i < n; i++)
+        pthread_create(&cpus[i].thread, NULL, cpu_run, &cpus[i]);
+    cpu_run(&cpus[0]);
+    for (int i = 1; i < n; i++)
+        pthread_join(cpus[i].thread, NULL);
 
+    free(cpus);
     return 0;
 }
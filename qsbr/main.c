@@ -1,13 +1,6 @@
 #include <assert.h>
 #include <stdbool.h>
 
-/* Branch prediction hints */
-#define unlikely(x) __builtin_expect((x) != 0, 0)
-
-#ifndef atomic_fetch_add
-#define atomic_fetch_add(x, a) __atomic_fetch_add(x, a, __ATOMIC_SEQ_CST)
-#endif
-
 #ifndef atomic_thread_fence
 #define memory_order_relaxed __ATOMIC_RELAXED
 #define memory_order_acquire __ATOMIC_ACQUIRE
@@ -45,142 +38,7 @@
 
 #define CACHE_LINE_SIZE 64
 
-/* Quiescent state based reclamation (QSBR).
- *
- * Each registered thread has to periodically indicate that it is in a
- * quiescent i.e. the state when it does not hold any memory references to the
- * objects which may be garbage collected. A typical use of the qsbr_checkpoint
- * function would be e.g. after processing a single request when any shared
- * state is no longer referenced. The higher the period, the higher the
- * reclamation granularity.
- *
- * Writers i.e. threads which are trying to garbage collect the object should
- * ensure that the objects are no longer globally visible and then issue a
- * barrier using qsbr_barrier function. This function returns a generation
- * number. It is safe to reclaim the said objects when qsbr_sync returns true
- * on a given number.
- *
- * Note that this interface is asynchronous.
- */
-
-#include <pthread.h>
-#include <stdint.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/queue.h>
-
-typedef uint64_t qsbr_epoch_t;
-
-typedef struct qsbr_tls {
-    /* The thread (local) epoch, observed at qsbr_checkpoint. Also, a pointer
-     * to the TLS structure of a next thread.
-     */
-    qsbr_epoch_t local_epoch;
-    LIST_ENTRY(qsbr_tls) entry;
-} qsbr_tls_t;
-
-typedef struct qsbr {
-    /* The global epoch, TLS key with a list of the registered threads. */
-    qsbr_epoch_t global_epoch;
-    pthread_key_t tls_key;
-    pthread_mutex_t lock;
-    LIST_HEAD(priv, qsbr_tls) list;
-} qsbr_t;
-
-qsbr_t *qsbr_create(void)
-{
-    qsbr_t *qs;
-    int ret = posix_memalign((void **) &qs, CACHE_LINE_SIZE, sizeof(qsbr_t));
-    if (ret != 0) {
-        return NULL;
-    }
-    memset(qs, 0, sizeof(qsbr_t));
-
-    if (pthread_key_create(&qs->tls_key, free) != 0) {
-        free(qs);
-        return NULL;
-    }
-    pthread_mutex_init(&qs->lock, NULL);
-    qs->global_epoch = 1;
-    return qs;
-}
-
-void qsbr_destroy(qsbr_t *qs)
-{
-    pthread_key_delete(qs->tls_key);
-    pthread_mutex_destroy(&qs->lock);
-    free(qs);
-}
-
-/* qsbr_register: register the current thread for QSBR */
-int qsbr_register(qsbr_t *qs)
-{
-    qsbr_tls_t *t = pthread_getspecific(qs->tls_key);
-    if (unlikely(!t)) {
-        /* posix_memalign() returns zero on success */
-        if (posix_memalign((void **) &t, CACHE_LINE_SIZE, sizeof(qsbr_tls_t)) !=
-            0)
-            return -1;
-        pthread_setspecific(qs->tls_key, t);
-    }
-    memset(t, 0, sizeof(qsbr_tls_t));
-
-    pthread_mutex_lock(&qs->lock);
-    LIST_INSERT_HEAD(&qs->list, t, entry);
-    pthread_mutex_unlock(&qs->lock);
-    return 0;
-}
-
-void qsbr_unregister(qsbr_t *qsbr)
-{
-    qsbr_tls_t *t = pthread_getspecific(qsbr->tls_key);
-    if (!t)
-        return;
-
-    pthread_setspecific(qsbr->tls_key, NULL);
-
-    pthread_mutex_lock(&qsbr->lock);
-    LIST_REMOVE(t, entry);
-    pthread_mutex_unlock(&qsbr->lock);
-    free(t);
-}
-
-/* qsbr_checkpoint: indicate a quiescent state of the current thread. */
-void qsbr_checkpoint(qsbr_t *qs)
-{
-    qsbr_tls_t *t = pthread_getspecific(qs->tls_key);
-    assert(t);
-
-    /* Observe the current epoch and issue a load barrier.
-     *
-     * Additionally, issue a store barrier before observation, so the callers
-     * could assume qsbr_checkpoint() being a full barrier.
-     */
-    atomic_thread_fence(memory_order_seq_cst);
-    t->local_epoch = qs->global_epoch;
-}
-
-qsbr_epoch_t qsbr_barrier(qsbr_t *qs)
-{
-    /* Note: atomic operation will issue a store barrier. */
-    return atomic_fetch_add(&qs->global_epoch, 1) + 1;
-}
-
-bool qsbr_sync(qsbr_t *qs, qsbr_epoch_t target)
-{
-    /* First, our thread should observe the epoch itself. */
-    qsbr_checkpoint(qs);
-
-    /* Have all threads observed the target epoch? */
-    qsbr_tls_t *t;
-    LIST_FOREACH (t, &qs->list, entry) {
-        if (t->local_epoch < target) /* not ready to reclaim */
-            return false;
-    }
-
-    /* Detected the grace period */
-    return true;
-}
+#include "qsbr.h"
 
 /* Test program starts here */
 
@@ -239,7 +97,7 @@ static void destroy_obj(data_t *obj)
 
 /* QSBR stress test */
 
-static void qsbr_writer(unsigned target)
+static void qsbr_writer(qsbr_tls_t *self, unsigned target)
 {
     data_t *obj = &data[target];
 
@@ -254,7 +112,7 @@ static void qsbr_writer(unsigned target)
 
         /* QSBR synchronization barrier */
         target_epoch = qsbr_barrier(qsbr);
-        while (!qsbr_sync(qsbr, target_epoch)) {
+        while (!qsbr_sync(self, target_epoch)) {
             SPINLOCK_BACKOFF(count);
             /* Other threads might have exited and the checkpoint would never
              * be passed.
@@ -278,7 +136,8 @@ static void *qsbr_stress(void *arg)
     const unsigned id = (uintptr_t) arg;
     unsigned n = 0;
 
-    if (qsbr_register(qsbr) != 0)
+    qsbr_tls_t *self = qsbr_register(qsbr);
+    if (!self)
         abort();
 
     /* There are NCPU threads concurrently reading data and a single writer
@@ -290,7 +149,7 @@ static void *qsbr_stress(void *arg)
     while (!stop) {
         n = (n + 1) & (N_DATA - 1);
         if (id == 0) {
-            qsbr_writer(n);
+            qsbr_writer(self, n);
             continue;
         }
 
@@ -303,10 +162,61 @@ static void *qsbr_stress(void *arg)
          * following pointer dereference.
          */
         access_obj(&data[n]);
-        qsbr_checkpoint(qsbr);
+        qsbr_checkpoint(self);
+    }
+    pthread_barrier_wait(&barrier);
+    qsbr_unregister(self);
+    pthread_exit(NULL);
+    return NULL;
+}
+
+/* Limbo stress test
+ *
+ * The writer replaces the objects with new copies and retires the old ones,
+ * which are poisoned when they are eventually freed.
+ */
+
+static unsigned int *_Atomic objs[N_DATA];
+
+static void free_val(void *ptr)
+{
+    *(unsigned int *) ptr = 0;
+    free(ptr);
+    destructions++;
+}
+
+static unsigned int *new_val(void)
+{
+    unsigned int *val = malloc(sizeof(*val));
+    if (!val)
+        abort();
+    *val = MAGIC;
+    return val;
+}
+
+static void *qsbr_limbo_stress(void *arg)
+{
+    const unsigned id = (uintptr_t) arg;
+    unsigned n = 0;
+
+    qsbr_tls_t *self = qsbr_register(qsbr);
+    if (!self)
+        abort();
+
+    pthread_barrier_wait(&barrier);
+    while (!stop) {
+        n = (n + 1) & (N_DATA - 1);
+        if (id == 0) {
+            unsigned int *old = __atomic_exchange_n(&objs[n], new_val(),
+                                                    __ATOMIC_ACQ_REL);
+            qsbr_retire(self, old, sizeof(*old), free_val);
+        } else if (*__atomic_load_n(&objs[n], __ATOMIC_ACQUIRE) != MAGIC) {
+            abort();
+        }
+        qsbr_checkpoint(self);
     }
     pthread_barrier_wait(&barrier);
-    qsbr_unregister(qsbr);
+    qsbr_unregister(self);
     pthread_exit(NULL);
     return NULL;
 }
@@ -336,6 +246,8 @@ static void run_test(func_t func)
     assert(ret == 0);
 
     memset(&data, 0, sizeof(data));
+    for (unsigned i = 0; i < N_DATA; i++)
+        objs[i] = new_val();
     qsbr = qsbr_create();
     destructions = 0;
 
@@ -351,15 +263,20 @@ static void run_test(func_t func)
         pthread_join(threads[i], NULL);
     pthread_barrier_destroy(&barrier);
     free(threads);
-    printf("# %" PRIu64 "\n", destructions);
+    printf("# %" PRIu64 ", limbo peak %zu bytes\n", destructions,
+           qsbr_limbo_peak(qsbr));
 
     qsbr_destroy(qsbr);
+    for (unsigned i = 0; i < N_DATA; i++)
+        free(objs[i]);
 }
 
 int main(int argc, char **argv)
 {
     printf("stress test...\n");
     run_test(qsbr_stress);
+    printf("limbo stress test...\n");
+    run_test(qsbr_limbo_stress);
     printf("OK\n");
     return 0;
 }
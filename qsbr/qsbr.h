@@ -0,0 +1,393 @@
+/* Quiescent state based reclamation (QSBR).
+ *
+ * Each registered thread has to periodically indicate that it is in a
+ * quiescent i.e. the state when it does not hold any memory references to the
+ * objects which may be garbage collected. A typical use of the qsbr_checkpoint
+ * function would be e.g. after processing a single request when any shared
+ * state is no longer referenced. The higher the period, the higher the
+ * reclamation granularity.
+ *
+ * Writers i.e. threads which are trying to garbage collect the object should
+ * ensure that the objects are no longer globally visible and then either
+ *
+ * - issue a barrier using qsbr_barrier function. This function returns a
+ *   generation number. It is safe to reclaim the said objects when qsbr_sync
+ *   returns true on a given number. This interface is asynchronous.
+ *
+ * - or hand them to qsbr_retire, which keeps them in a limbo list of the
+ *   calling thread and frees them in batches, once enough bytes are retired
+ *   and their grace period is over.
+ *
+ * A thread which blocks for long, or is done with the shared state for a
+ * while, should go offline so that it does not hold the grace periods back.
+ *
+ * All functions take the handle returned by qsbr_register, which does not
+ * have to be called by the thread that later uses it.
+ */
+
+#ifndef _QSBR_H_
+#define _QSBR_H_
+
+#include <pthread.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/queue.h>
+
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+#define QSBR_CACHE_LINE_SIZE 64
+
+/* Entries of a limbo batch */
+#define QSBR_LIMBO_ENTRIES 256
+
+/* Bytes retired by a thread before its batch is sealed. The threshold
+ * doubles while the grace periods lag behind, so that lagging readers are not
+ * scanned for every few objects, and halves back when they keep up.
+ */
+#define QSBR_RECLAIM_MIN (16 * 1024)
+#define QSBR_RECLAIM_MAX (1024 * 1024)
+
+typedef uint64_t qsbr_epoch_t;
+
+/* The epoch of an offline thread, the global epoch starts at 1 */
+#define QSBR_OFFLINE 0
+
+typedef struct qsbr_limbo {
+    struct qsbr_limbo *next;
+    qsbr_epoch_t epoch; /* safe to free once every thread observed it */
+    size_t bytes;
+    unsigned int n;
+    struct {
+        void *ptr;
+        void (*free_fn)(void *ptr);
+    } entries[QSBR_LIMBO_ENTRIES];
+} qsbr_limbo_t;
+
+typedef struct qsbr_tls {
+    /* The thread (local) epoch, observed at qsbr_checkpoint. The only field
+     * written by the owner and read by other threads.
+     */
+    qsbr_epoch_t local_epoch;
+    LIST_ENTRY(qsbr_tls) entry;
+    struct qsbr *qs;
+
+    /* Limbo list, only touched by the owner: the batch being filled, then
+     * the sealed ones from oldest to newest.
+     */
+    qsbr_limbo_t *pending;
+    qsbr_limbo_t *head, **tail;
+    qsbr_limbo_t *spare;
+    size_t reclaim_bytes;       /* current sealing threshold */
+    qsbr_epoch_t reclaim_epoch; /* global epoch at the last reclaim */
+} __attribute__((__aligned__(QSBR_CACHE_LINE_SIZE))) qsbr_tls_t;
+
+typedef struct qsbr {
+    /* The global epoch, with a list of the registered threads. */
+    qsbr_epoch_t global_epoch;
+    pthread_mutex_t lock;
+    LIST_HEAD(priv, qsbr_tls) list;
+
+    /* Limbo batches left behind by unregistered threads, under lock */
+    qsbr_limbo_t *orphans;
+
+    /* Bytes retired and not freed yet, and their high-water mark */
+    size_t limbo_bytes, limbo_peak;
+
+    bool has_membarrier;
+} qsbr_t;
+
+/* Asymmetric barriers
+ *
+ * With membarrier(), the writer forces a full barrier on every running thread
+ * of the process, so a reader gets by with a compiler barrier where it would
+ * otherwise need a full one. Without it, both sides use a full barrier.
+ */
+static inline void qsbr_membarrier_init(qsbr_t *qs)
+{
+#ifdef __linux__
+    long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+                 0))
+        qs->has_membarrier = true;
+#endif
+}
+
+static inline void qsbr_mb_light(qsbr_t *qs)
+{
+    if (qs->has_membarrier)
+        __asm__ __volatile__("" ::: "memory");
+    else
+        __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void qsbr_mb_heavy(qsbr_t *qs)
+{
+#ifdef __linux__
+    if (qs->has_membarrier &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+        return;
+#endif
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline void qsbr_limbo_free(qsbr_t *qs, qsbr_limbo_t *b)
+{
+    for (unsigned int i = 0; i < b->n; i++)
+        b->entries[i].free_fn(b->entries[i].ptr);
+    __atomic_fetch_sub(&qs->limbo_bytes, b->bytes, __ATOMIC_RELAXED);
+}
+
+static inline qsbr_t *qsbr_create(void)
+{
+    qsbr_t *qs;
+    int ret =
+        posix_memalign((void **) &qs, QSBR_CACHE_LINE_SIZE, sizeof(qsbr_t));
+    if (ret != 0) {
+        return NULL;
+    }
+    memset(qs, 0, sizeof(qsbr_t));
+
+    pthread_mutex_init(&qs->lock, NULL);
+    qs->global_epoch = 1;
+    qsbr_membarrier_init(qs);
+    return qs;
+}
+
+/* All threads must be unregistered, what they left in limbo is freed */
+static inline void qsbr_destroy(qsbr_t *qs)
+{
+    while (qs->orphans) {
+        qsbr_limbo_t *b = qs->orphans;
+        qs->orphans = b->next;
+        qsbr_limbo_free(qs, b);
+        free(b);
+    }
+    pthread_mutex_destroy(&qs->lock);
+    free(qs);
+}
+
+/* qsbr_register: register a thread for QSBR, online at the current epoch */
+static inline qsbr_tls_t *qsbr_register(qsbr_t *qs)
+{
+    qsbr_tls_t *t;
+
+    /* posix_memalign() returns zero on success */
+    if (posix_memalign((void **) &t, QSBR_CACHE_LINE_SIZE, sizeof(qsbr_tls_t)))
+        return NULL;
+    memset(t, 0, sizeof(qsbr_tls_t));
+    t->qs = qs;
+    t->tail = &t->head;
+    t->reclaim_bytes = QSBR_RECLAIM_MIN;
+
+    pthread_mutex_lock(&qs->lock);
+    t->local_epoch = __atomic_load_n(&qs->global_epoch, __ATOMIC_ACQUIRE);
+    LIST_INSERT_HEAD(&qs->list, t, entry);
+    pthread_mutex_unlock(&qs->lock);
+    return t;
+}
+
+/* The oldest epoch not observed by some online thread yet */
+static inline qsbr_epoch_t qsbr_observed(qsbr_t *qs)
+{
+    qsbr_epoch_t min = __atomic_load_n(&qs->global_epoch, __ATOMIC_ACQUIRE);
+    qsbr_tls_t *t;
+
+    qsbr_mb_heavy(qs);
+
+    pthread_mutex_lock(&qs->lock);
+    LIST_FOREACH (t, &qs->list, entry) {
+        qsbr_epoch_t e = __atomic_load_n(&t->local_epoch, __ATOMIC_ACQUIRE);
+        if (e != QSBR_OFFLINE && e < min)
+            min = e;
+    }
+    pthread_mutex_unlock(&qs->lock);
+    return min;
+}
+
+/* Free the sealed batches of @t whose grace period is over, and orphans */
+static inline void qsbr_reclaim(qsbr_tls_t *t)
+{
+    qsbr_t *qs = t->qs;
+    qsbr_epoch_t observed = qsbr_observed(qs);
+
+    t->reclaim_epoch = __atomic_load_n(&qs->global_epoch, __ATOMIC_RELAXED);
+
+    while (t->head && t->head->epoch <= observed) {
+        qsbr_limbo_t *b = t->head;
+        if (!(t->head = b->next))
+            t->tail = &t->head;
+        qsbr_limbo_free(qs, b);
+        if (t->spare)
+            free(b);
+        else
+            t->spare = b;
+    }
+
+    pthread_mutex_lock(&qs->lock);
+    for (qsbr_limbo_t **bp = &qs->orphans; *bp;) {
+        qsbr_limbo_t *b = *bp;
+        if (b->epoch <= observed) {
+            *bp = b->next;
+            qsbr_limbo_free(qs, b);
+            free(b);
+        } else {
+            bp = &b->next;
+        }
+    }
+    pthread_mutex_unlock(&qs->lock);
+}
+
+static inline qsbr_epoch_t qsbr_barrier(qsbr_t *qs)
+{
+    /* Note: atomic operation will issue a store barrier. */
+    return __atomic_fetch_add(&qs->global_epoch, 1, __ATOMIC_SEQ_CST) + 1;
+}
+
+/* Close the batch being filled, its objects are freed after a grace period
+ * starting now.
+ */
+static inline void qsbr_seal(qsbr_tls_t *t)
+{
+    qsbr_limbo_t *b = t->pending;
+    if (!b)
+        return;
+
+    t->pending = NULL;
+    b->epoch = qsbr_barrier(t->qs);
+    b->next = NULL;
+    *t->tail = b;
+    t->tail = &b->next;
+
+    /* Only the batch just sealed is left if the readers keep up */
+    qsbr_reclaim(t);
+    if (t->head == b) {
+        if (t->reclaim_bytes > QSBR_RECLAIM_MIN)
+            t->reclaim_bytes /= 2;
+    } else if (t->reclaim_bytes < QSBR_RECLAIM_MAX) {
+        t->reclaim_bytes *= 2;
+    }
+}
+
+/* qsbr_checkpoint: indicate a quiescent state of the thread. */
+static inline void qsbr_checkpoint(qsbr_tls_t *t)
+{
+    qsbr_t *qs = t->qs;
+
+    /* Observe the current epoch and issue a load barrier.
+     *
+     * Additionally, issue a store barrier before observation, so the callers
+     * could assume qsbr_checkpoint() being a full barrier. It is only a
+     * compiler barrier when qsbr_sync() can use membarrier() instead.
+     */
+    qsbr_mb_light(qs);
+    qsbr_epoch_t epoch = __atomic_load_n(&qs->global_epoch, __ATOMIC_ACQUIRE);
+    __atomic_store_n(&t->local_epoch, epoch, __ATOMIC_RELEASE);
+
+    /* Retry what is in limbo whenever a grace period may have ended */
+    if (__builtin_expect(t->head && epoch != t->reclaim_epoch, 0))
+        qsbr_reclaim(t);
+}
+
+/* Stop holding the grace periods back until qsbr_online(). The thread must
+ * not reference shared objects meanwhile.
+ */
+static inline void qsbr_offline(qsbr_tls_t *t)
+{
+    __atomic_store_n(&t->local_epoch, QSBR_OFFLINE, __ATOMIC_RELEASE);
+}
+
+static inline void qsbr_online(qsbr_tls_t *t)
+{
+    qsbr_checkpoint(t);
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+}
+
+static inline bool qsbr_sync(qsbr_tls_t *t, qsbr_epoch_t target)
+{
+    /* First, our thread should observe the epoch itself. */
+    qsbr_checkpoint(t);
+
+    /* Have all threads observed the target epoch? */
+    return qsbr_observed(t->qs) >= target;
+}
+
+/* Free @ptr with @free_fn once no thread can reference it anymore. @size is
+ * what it accounts for in the limbo, freeing is batched by bytes retired.
+ */
+static inline void qsbr_retire(qsbr_tls_t *t,
+                               void *ptr,
+                               size_t size,
+                               void (*free_fn)(void *ptr))
+{
+    qsbr_t *qs = t->qs;
+    qsbr_limbo_t *b = t->pending;
+
+    if (!b) {
+        if ((b = t->spare))
+            t->spare = NULL;
+        else if (!(b = malloc(sizeof(qsbr_limbo_t))))
+            abort();
+        b->n = 0;
+        b->bytes = 0;
+        t->pending = b;
+    }
+
+    b->entries[b->n].ptr = ptr;
+    b->entries[b->n].free_fn = free_fn;
+    b->n++;
+    b->bytes += size;
+
+    size_t bytes =
+        __atomic_add_fetch(&qs->limbo_bytes, size, __ATOMIC_RELAXED);
+    size_t peak = __atomic_load_n(&qs->limbo_peak, __ATOMIC_RELAXED);
+    while (bytes > peak &&
+           !__atomic_compare_exchange_n(&qs->limbo_peak, &peak, bytes, true,
+                                        __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+        ;
+
+    if (b->n == QSBR_LIMBO_ENTRIES || b->bytes >= t->reclaim_bytes)
+        qsbr_seal(t);
+}
+
+/* Bytes retired and not freed yet, and the most there ever were */
+static inline size_t qsbr_limbo_bytes(qsbr_t *qs)
+{
+    return __atomic_load_n(&qs->limbo_bytes, __ATOMIC_RELAXED);
+}
+
+static inline size_t qsbr_limbo_peak(qsbr_t *qs)
+{
+    return __atomic_load_n(&qs->limbo_peak, __ATOMIC_RELAXED);
+}
+
+/* qsbr_unregister: what is left in limbo is freed by the other threads, or
+ * by qsbr_destroy.
+ */
+static inline void qsbr_unregister(qsbr_tls_t *t)
+{
+    qsbr_t *qs = t->qs;
+
+    qsbr_offline(t);
+    qsbr_seal(t);
+
+    pthread_mutex_lock(&qs->lock);
+    LIST_REMOVE(t, entry);
+    if (t->head) {
+        *t->tail = qs->orphans;
+        qs->orphans = t->head;
+    }
+    pthread_mutex_unlock(&qs->lock);
+
+    free(t->spare);
+    free(t);
+}
+
+#endif /* _QSBR_H_ */
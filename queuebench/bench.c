@@ -0,0 +1,712 @@
+/* Queue benchmark
+ *
+ * Sweeps a matrix of queues, producer and consumer counts, batch sizes and
+ * payload sizes. The producers fill messages of the payload size and
+ * enqueue them a batch at a time, the consumers dequeue batches and read
+ * them back. Every point of the matrix runs a warmup then several trials,
+ * each on a fresh queue, and is printed as a CSV line with:
+ *
+ * - the mean throughput of the producers and its standard deviation across
+ *   the trials,
+ * - percentiles of the latency from the enqueue of a message to its dequeue,
+ * - the growth of the resident memory while the queue was in use.
+ *
+ * A producer owns as many messages as the queue capacity and reuses them
+ * round robin, waiting for the consumers to be done with one before filling
+ * it again, which also bounds the backlog of the unbounded queues.
+ */
+
+#define _GNU_SOURCE
+
+#include <errno.h>
+#include <fcntl.h>
+#include <limits.h>
+#include <malloc.h>
+#include <math.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "bench.h"
+
+#define DEFAULT_DURATION 1000 /* ms */
+#define DEFAULT_WARMUP 200    /* ms */
+#define DEFAULT_TRIALS 3
+#define DEFAULT_CAPACITY 1024
+#define MAX_VALUES 32 /* per dimension of the matrix */
+#define SAMPLE_MS 10  /* between two looks at the resident memory */
+#define SPIN_MAX 64   /* busy waits before yielding */
+
+static const queue_ops_t *const all_queues[] = {
+    &spmc_ops,    &mpsc_ops,    &mpsc_intrusive_ops, &mpmc_ops,
+    &lfq_ops,     &lfring_ops,  &lfchain_ops,        &ringbuffer_ops,
+    &channel_ops, &rcu_queue_ops,
+};
+#define N_QUEUES (sizeof(all_queues) / sizeof(all_queues[0]))
+
+typedef struct {
+    pthread_cond_t complete;
+    pthread_mutex_t mutex;
+    int count;
+    int crossing;
+} barrier_t;
+
+static void barrier_init(barrier_t *b, int n)
+{
+    pthread_cond_init(&b->complete, NULL);
+    pthread_mutex_init(&b->mutex, NULL);
+    b->count = n;
+    b->crossing = 0;
+}
+
+static void barrier_cross(barrier_t *b)
+{
+    pthread_mutex_lock(&b->mutex);
+    b->crossing++;
+    if (b->crossing < b->count)
+        pthread_cond_wait(&b->complete, &b->mutex);
+    else {
+        pthread_cond_broadcast(&b->complete);
+        b->crossing = 0;
+    }
+    pthread_mutex_unlock(&b->mutex);
+}
+
+/* Log-linear latency histogram, as in list-move */
+#define LAT_SUB_BITS 4
+#define LAT_SUB (1 << LAT_SUB_BITS)
+#define LAT_BUCKETS (64 * LAT_SUB)
+
+static inline int lat_bucket(uint64_t ns)
+{
+    if (ns < LAT_SUB)
+        return ns;
+    int shift = 63 - __builtin_clzll(ns) - LAT_SUB_BITS;
+    return (shift + 1) * LAT_SUB + ((ns >> shift) & (LAT_SUB - 1));
+}
+
+static uint64_t lat_value(int b)
+{
+    if (b < LAT_SUB)
+        return b;
+    int shift = b / LAT_SUB - 1;
+    return (uint64_t) (LAT_SUB + b % LAT_SUB) << shift;
+}
+
+static uint64_t lat_percentile(const uint64_t *hist, uint64_t total, double p)
+{
+    uint64_t rank = (uint64_t) ceil(total * p), seen = 0;
+
+    for (int b = 0; b < LAT_BUCKETS; b++) {
+        seen += hist[b];
+        if (seen >= rank && seen)
+            return lat_value(b);
+    }
+    return 0;
+}
+
+static inline uint64_t now_ns(void)
+{
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__i386__) || defined(__x86_64__)
+    __asm__ __volatile__("pause");
+#elif defined(__aarch64__) || defined(__arm__)
+    __asm__ __volatile__("isb\n");
+#endif
+}
+
+/* Spin for a while, then let the other side of the queue run */
+static inline void backoff(unsigned *spins)
+{
+    if (++*spins < SPIN_MAX)
+        cpu_relax();
+    else
+        sched_yield();
+}
+
+/* A message, followed by its body up to the payload size */
+typedef struct {
+    void *link;            /* for the intrusive queues */
+    uint64_t sent;         /* when the producer enqueued it */
+    _Atomic uint32_t busy; /* until a consumer is done with it */
+    uint32_t seq;
+} msg_t;
+
+typedef struct {
+    queue_ctx_t ctx;
+    const queue_ops_t *ops;
+    void *queue;
+    barrier_t *barrier;
+    int id, cpu;
+    unsigned batch;
+    size_t payload;
+    void **msgs; /* of the current batch */
+
+    /* Producers only: their messages, reused round robin */
+    char *slab;
+    size_t stride;
+    unsigned n_slots, next;
+    uint32_t seq;
+
+    _Atomic unsigned long n_msgs; /* of the current trial */
+    uint64_t *lat;                /* consumers only */
+    uint64_t sum;                 /* of the bodies, so that they are read */
+} __attribute__((aligned(CACHE_LINE))) thread_data_t;
+
+typedef struct {
+    int n;
+    int v[MAX_VALUES];
+} values_t;
+
+typedef struct {
+    const queue_ops_t *queues[N_QUEUES];
+    int n_queues;
+    values_t producers, consumers, batches, payloads, cpus;
+    int capacity;
+    int duration, warmup, trials;
+    int pin;
+} config_t;
+
+static _Atomic bool should_stop = false;
+
+/* How the consumers tell that they received every message once the
+ * producers are gone
+ */
+static struct {
+    _Atomic bool producers_done;
+    unsigned long produced;
+    thread_data_t *consumers;
+    int n_consumers;
+} drain;
+
+static int statm_fd = -1;
+
+/* Resident memory of the process, in KiB */
+static long rss_kb(void)
+{
+    char buf[128];
+    long size, resident;
+
+    ssize_t len = pread(statm_fd, buf, sizeof(buf) - 1, 0);
+    if (len <= 0)
+        return 0;
+    buf[len] = '\0';
+    if (sscanf(buf, "%ld %ld", &size, &resident) != 2)
+        return 0;
+    return resident * (sysconf(_SC_PAGESIZE) / 1024);
+}
+
+static void pin_self(int cpu)
+{
+    if (cpu < 0)
+        return;
+
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(cpu, &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static inline msg_t *slot_msg(const thread_data_t *d, unsigned i)
+{
+    return (msg_t *) (d->slab + i * d->stride);
+}
+
+/* Take the next message of the producer, NULL when it is still queued and
+ * the trial is over.
+ */
+static msg_t *next_msg(thread_data_t *d)
+{
+    msg_t *m = slot_msg(d, d->next);
+
+    for (unsigned spins = 0;
+         atomic_load_explicit(&m->busy, memory_order_acquire);) {
+        if (should_stop)
+            return NULL;
+        backoff(&spins);
+    }
+
+    d->next = d->next + 1 < d->n_slots ? d->next + 1 : 0;
+    m->seq = d->seq++;
+    memset(m + 1, (uint8_t) m->seq, d->payload - sizeof(msg_t));
+    atomic_store_explicit(&m->busy, 1, memory_order_relaxed);
+    return m;
+}
+
+static void *producer(void *data)
+{
+    thread_data_t *d = (thread_data_t *) data;
+    const queue_ops_t *ops = d->ops;
+
+    pin_self(d->cpu);
+    if (ops->join)
+        ops->join(d->queue, &d->ctx, true);
+
+    barrier_cross(d->barrier);
+    while (!should_stop) {
+        unsigned n = 0;
+        msg_t *m;
+
+        while (n < d->batch && (m = next_msg(d)))
+            d->msgs[n++] = m;
+
+        uint64_t now = now_ns();
+        for (unsigned i = 0; i < n; i++)
+            ((msg_t *) d->msgs[i])->sent = now;
+
+        /* The consumers keep going until they have all, do not give up */
+        for (unsigned done = 0, spins = 0; done < n;) {
+            unsigned k = ops->enqueue(d->queue, &d->ctx, d->msgs + done,
+                                      n - done);
+            if (k)
+                done += k, spins = 0;
+            else
+                backoff(&spins);
+        }
+        atomic_store_explicit(&d->n_msgs, d->n_msgs + n,
+                              memory_order_relaxed);
+    }
+
+    if (ops->leave)
+        ops->leave(d->queue, &d->ctx);
+    return NULL;
+}
+
+static bool drained(void)
+{
+    if (!atomic_load_explicit(&drain.producers_done, memory_order_acquire))
+        return false;
+
+    unsigned long n = 0;
+    for (int i = 0; i < drain.n_consumers; i++)
+        n += atomic_load_explicit(&drain.consumers[i].n_msgs,
+                                  memory_order_relaxed);
+    return n == drain.produced;
+}
+
+/* Read the body back, which the producer filled with its sequence number */
+static void read_msg(thread_data_t *d, const msg_t *m)
+{
+    const uint8_t *body = (const uint8_t *) (m + 1);
+    size_t len = d->payload - sizeof(msg_t);
+    uint64_t sum = 0;
+
+    for (size_t i = 0; i < len; i++)
+        sum += body[i];
+    if (len && (body[0] != (uint8_t) m->seq || sum != len * body[0])) {
+        fprintf(stderr, "%s: corrupted message\n", d->ops->name);
+        abort();
+    }
+    d->sum += sum;
+}
+
+static void *consumer(void *data)
+{
+    thread_data_t *d = (thread_data_t *) data;
+    const queue_ops_t *ops = d->ops;
+
+    pin_self(d->cpu);
+    if (ops->join)
+        ops->join(d->queue, &d->ctx, false);
+
+    barrier_cross(d->barrier);
+    for (unsigned spins = 0;;) {
+        unsigned n = ops->dequeue(d->queue, &d->ctx, d->msgs, d->batch);
+        if (!n) {
+            if (drained())
+                break;
+            backoff(&spins);
+            continue;
+        }
+        spins = 0;
+
+        uint64_t now = now_ns();
+        for (unsigned i = 0; i < n; i++) {
+            msg_t *m = d->msgs[i];
+            d->lat[lat_bucket(now > m->sent ? now - m->sent : 0)]++;
+            read_msg(d, m);
+            atomic_store_explicit(&m->busy, 0, memory_order_release);
+        }
+        atomic_store_explicit(&d->n_msgs, d->n_msgs + n,
+                              memory_order_relaxed);
+    }
+
+    if (ops->leave)
+        ops->leave(d->queue, &d->ctx);
+    return NULL;
+}
+
+/* Run the producers for "duration" ms on a fresh queue, then let the
+ * consumers drain it. Return the messages per second or a negative value on
+ * failure, and the growth of the resident memory in "mem_kb".
+ */
+static double run_trial(const config_t *cfg,
+                        const queue_ops_t *ops,
+                        pthread_t *threads,
+                        thread_data_t *data,
+                        int n_producers,
+                        int n_consumers,
+                        int duration,
+                        long *mem_kb)
+{
+    int n_threads = n_producers + n_consumers;
+    barrier_t barrier;
+
+    /* Give the memory of the previous trials back, only count this one */
+    malloc_trim(0);
+    long base = rss_kb(), peak = base;
+
+    void *queue = ops->create(cfg->capacity, n_producers, n_consumers);
+    if (!queue) {
+        fprintf(stderr, "Failed to create the %s queue\n", ops->name);
+        return -1;
+    }
+
+    barrier_init(&barrier, n_threads + 1);
+    should_stop = false;
+    drain.producers_done = false;
+    drain.produced = 0;
+    drain.consumers = data + n_producers;
+    drain.n_consumers = n_consumers;
+    for (int i = 0; i < n_threads; i++) {
+        data[i].n_msgs = 0;
+        data[i].queue = queue;
+        data[i].barrier = &barrier;
+        if (pthread_create(&threads[i], NULL,
+                           i < n_producers ? producer : consumer, &data[i])) {
+            fprintf(stderr, "Failed to create thread %d\n", i);
+            return -1;
+        }
+    }
+
+    barrier_cross(&barrier);
+
+    uint64_t start = now_ns(), end = start + duration * 1000000ULL, now;
+    while ((now = now_ns()) < end) {
+        uint64_t left = end - now, ns = SAMPLE_MS * 1000000ULL;
+        struct timespec timeout = {0, left < ns ? left : ns};
+        nanosleep(&timeout, NULL);
+        long rss = rss_kb();
+        peak = rss > peak ? rss : peak;
+    }
+    should_stop = true;
+    end = now_ns();
+
+    for (int i = 0; i < n_threads; i++) {
+        if (i == n_producers) {
+            for (int j = 0; j < n_producers; j++)
+                drain.produced += data[j].n_msgs;
+            atomic_store_explicit(&drain.producers_done, true,
+                                  memory_order_release);
+            if (ops->close)
+                ops->close(queue);
+        }
+        if (pthread_join(threads[i], NULL)) {
+            fprintf(stderr, "Failed to join child thread %d\n", i);
+            return -1;
+        }
+    }
+
+    long rss = rss_kb();
+    peak = rss > peak ? rss : peak;
+    *mem_kb = peak - base;
+    ops->destroy(queue);
+
+    return drain.produced * 1e9 / (end - start);
+}
+
+static void mean_stddev(const double *v, int n, double *mean, double *stddev)
+{
+    double m = 0, var = 0;
+
+    for (int i = 0; i < n; i++)
+        m += v[i];
+    m /= n;
+    for (int i = 0; i < n; i++)
+        var += (v[i] - m) * (v[i] - m);
+    if (n > 1)
+        var /= n - 1;
+    *mean = m;
+    *stddev = sqrt(var);
+}
+
+/* Run one point of the matrix, and print its CSV line */
+static int run_point(const config_t *cfg,
+                     const queue_ops_t *ops,
+                     int n_producers,
+                     int n_consumers,
+                     int batch,
+                     int payload)
+{
+    int n_threads = n_producers + n_consumers;
+    pthread_t *threads = malloc(n_threads * sizeof(pthread_t));
+    thread_data_t *data =
+        aligned_alloc(CACHE_LINE, n_threads * sizeof(thread_data_t));
+    uint64_t *hist = calloc(LAT_BUCKETS, sizeof(uint64_t));
+    double *mops = calloc(cfg->trials, sizeof(double));
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN), mem_kb = 0;
+    size_t stride = (payload + sizeof(void *) - 1) & ~(sizeof(void *) - 1);
+    unsigned n_slots = cfg->capacity > batch ? cfg->capacity : batch;
+    int ret = -1;
+
+    if (data)
+        memset(data, 0, n_threads * sizeof(thread_data_t));
+    if (!threads || !data || !hist || !mops) {
+        fprintf(stderr, "Failed to allocate the benchmark data\n");
+        goto out;
+    }
+
+    for (int i = 0; i < n_threads; i++) {
+        thread_data_t *d = &data[i];
+        bool is_producer = i < n_producers;
+
+        d->msgs = malloc(batch * sizeof(void *));
+        if (is_producer)
+            d->slab = calloc(n_slots, stride);
+        else
+            d->lat = calloc(LAT_BUCKETS, sizeof(uint64_t));
+        if (!d->msgs || (is_producer ? !d->slab : !d->lat)) {
+            fprintf(stderr, "Failed to allocate thread data %d\n", i);
+            goto out;
+        }
+        d->ops = ops;
+        d->id = i;
+        d->batch = batch;
+        d->payload = payload;
+        d->stride = stride;
+        d->n_slots = n_slots;
+        if (!cfg->pin)
+            d->cpu = -1;
+        else if (cfg->cpus.n)
+            d->cpu = cfg->cpus.v[i % cfg->cpus.n];
+        else
+            d->cpu = i % n_cpus;
+    }
+
+    if (cfg->warmup && run_trial(cfg, ops, threads, data, n_producers,
+                                 n_consumers, cfg->warmup, &mem_kb) < 0)
+        goto out;
+    for (int i = n_producers; i < n_threads; i++)
+        memset(data[i].lat, 0, LAT_BUCKETS * sizeof(uint64_t));
+    long mem_max = 0;
+    for (int t = 0; t < cfg->trials; t++) {
+        double msgs_per_sec =
+            run_trial(cfg, ops, threads, data, n_producers, n_consumers,
+                      cfg->duration, &mem_kb);
+        if (msgs_per_sec < 0)
+            goto out;
+        mops[t] = msgs_per_sec / 1e6;
+        mem_max = mem_kb > mem_max ? mem_kb : mem_max;
+    }
+
+    double mean, stddev;
+    mean_stddev(mops, cfg->trials, &mean, &stddev);
+
+    uint64_t total = 0;
+    for (int i = n_producers; i < n_threads; i++) {
+        for (int b = 0; b < LAT_BUCKETS; b++)
+            hist[b] += data[i].lat[b];
+    }
+    for (int b = 0; b < LAT_BUCKETS; b++)
+        total += hist[b];
+
+    printf("%s,%d,%d,%d,%d,%d,%d,%.3f,%.3f,%lu,%lu,%lu,%lu,%lu,%ld\n",
+           ops->name, n_producers, n_consumers, batch, payload, cfg->capacity,
+           cfg->trials, mean, stddev, total, lat_percentile(hist, total, 0.5),
+           lat_percentile(hist, total, 0.9), lat_percentile(hist, total, 0.99),
+           lat_percentile(hist, total, 0.999), mem_max);
+    fflush(stdout);
+    ret = 0;
+
+out:
+    for (int i = 0; i < n_threads && data; i++) {
+        free(data[i].msgs);
+        free(data[i].slab);
+        free(data[i].lat);
+    }
+    free(mops);
+    free(hist);
+    free(data);
+    free(threads);
+    return ret;
+}
+
+/* Parse a comma separated list of integers within [min, max] */
+static int parse_values(values_t *values, const char *s, int min, int max)
+{
+    char *end;
+
+    values->n = 0;
+    do {
+        errno = 0;
+        long v = strtol(s, &end, 10);
+        if (errno || end == s || v < min || v > max ||
+            values->n == MAX_VALUES)
+            return -1;
+        values->v[values->n++] = v;
+        s = end + 1;
+    } while (*end == ',');
+
+    return *end ? -1 : 0;
+}
+
+static int parse_int(int *value, const char *s, int min)
+{
+    values_t values;
+
+    if (parse_values(&values, s, min, INT_MAX) || values.n != 1)
+        return -1;
+    *value = values.v[0];
+    return 0;
+}
+
+/* Parse a comma separated list of queue names, or "all" */
+static int parse_queues(config_t *cfg, const char *s)
+{
+    cfg->n_queues = 0;
+    while (*s) {
+        size_t len = strcspn(s, ","), k;
+
+        if (len == 3 && !strncmp(s, "all", 3)) {
+            for (k = 0; k < N_QUEUES && cfg->n_queues < (int) N_QUEUES; k++)
+                cfg->queues[cfg->n_queues++] = all_queues[k];
+        } else {
+            for (k = 0; k < N_QUEUES; k++) {
+                if (strlen(all_queues[k]->name) == len &&
+                    !strncmp(s, all_queues[k]->name, len))
+                    break;
+            }
+            if (k == N_QUEUES || cfg->n_queues == (int) N_QUEUES)
+                return -1;
+            cfg->queues[cfg->n_queues++] = all_queues[k];
+        }
+        s += len;
+        if (*s == ',' && !*++s)
+            return -1;
+    }
+    return cfg->n_queues ? 0 : -1;
+}
+
+static int set_option(config_t *cfg, int opt, const char *arg)
+{
+    switch (opt) {
+    case 'q':
+        return parse_queues(cfg, arg);
+    case 'p':
+        return parse_values(&cfg->producers, arg, 1, INT_MAX);
+    case 'c':
+        return parse_values(&cfg->consumers, arg, 1, INT_MAX);
+    case 'b':
+        return parse_values(&cfg->batches, arg, 1, 4096);
+    case 's':
+        return parse_values(&cfg->payloads, arg, sizeof(msg_t), 1 << 20);
+    case 'k':
+        return parse_int(&cfg->capacity, arg, 2);
+    case 'a':
+        return parse_values(&cfg->cpus, arg, 0, CPU_SETSIZE - 1);
+    case 'd':
+        return parse_int(&cfg->duration, arg, 1);
+    case 'w':
+        return parse_int(&cfg->warmup, arg, 0);
+    case 'n':
+        return parse_int(&cfg->trials, arg, 1);
+    }
+    return -1;
+}
+
+static void usage(const char *prog)
+{
+    fprintf(stderr,
+            "Usage: %s [-q queues] [-p producers] [-c consumers] [-b batch]\n"
+            "       [-s bytes] [-k capacity] [-a cpus] [-d ms] [-w ms]\n"
+            "       [-n trials] [-P] [-H]\n"
+            "  -q, -p, -c, -b and -s take comma separated lists, the\n"
+            "  benchmark runs every combination of them that the queue\n"
+            "  supports. -b is the number of messages per enqueue and\n"
+            "  dequeue, -s their size, of at least %zu bytes, and -k the\n"
+            "  capacity of the bounded queues and of the messages each\n"
+            "  producer has in flight.\n"
+            "  The producers then the consumers are pinned round robin to\n"
+            "  the CPUs given with -a, or to all of them; -P leaves them\n"
+            "  unpinned, -H omits the CSV header. The queues are:",
+            prog, sizeof(msg_t));
+    for (size_t k = 0; k < N_QUEUES; k++)
+        fprintf(stderr, " %s", all_queues[k]->name);
+    fprintf(stderr, "\n");
+}
+
+static bool supported(const queue_ops_t *ops, int n_producers, int n_consumers)
+{
+    return (!ops->max_producers || n_producers <= ops->max_producers) &&
+           (!ops->max_consumers || n_consumers <= ops->max_consumers);
+}
+
+int main(int argc, char *argv[])
+{
+    config_t cfg = {
+        .producers = {1, {1}},
+        .consumers = {1, {1}},
+        .batches = {1, {1}},
+        .payloads = {1, {64}},
+        .capacity = DEFAULT_CAPACITY,
+        .duration = DEFAULT_DURATION,
+        .warmup = DEFAULT_WARMUP,
+        .trials = DEFAULT_TRIALS,
+        .pin = 1,
+    };
+    bool header = true;
+    int opt;
+
+    parse_queues(&cfg, "all");
+    while ((opt = getopt(argc, argv, "q:p:c:b:s:k:a:d:w:n:PH")) != -1) {
+        if (opt == 'P')
+            cfg.pin = 0;
+        else if (opt == 'H')
+            header = false;
+        else if (opt == '?' || set_option(&cfg, opt, optarg)) {
+            if (opt != '?')
+                fprintf(stderr, "Invalid value for -%c: %s\n", opt, optarg);
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if ((statm_fd = open("/proc/self/statm", O_RDONLY | O_CLOEXEC)) < 0) {
+        perror("/proc/self/statm");
+        return EXIT_FAILURE;
+    }
+
+    if (header)
+        printf("queue,producers,consumers,batch,payload,capacity,trials,"
+               "mops_mean,mops_stddev,msgs,p50_ns,p90_ns,p99_ns,p999_ns,"
+               "mem_kb\n");
+    for (int q = 0; q < cfg.n_queues; q++)
+        for (int p = 0; p < cfg.producers.n; p++)
+            for (int c = 0; c < cfg.consumers.n; c++)
+                for (int b = 0; b < cfg.batches.n; b++)
+                    for (int s = 0; s < cfg.payloads.n; s++) {
+                        const queue_ops_t *ops = cfg.queues[q];
+                        if (!supported(ops, cfg.producers.v[p],
+                                       cfg.consumers.v[c]))
+                            continue;
+                        if (run_point(&cfg, ops, cfg.producers.v[p],
+                                      cfg.consumers.v[c], cfg.batches.v[b],
+                                      cfg.payloads.v[s]))
+                            return EXIT_FAILURE;
+                    }
+
+    close(statm_fd);
+    return EXIT_SUCCESS;
+}
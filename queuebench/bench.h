@@ -0,0 +1,55 @@
+#ifndef QUEUEBENCH_H
+#define QUEUEBENCH_H
+
+#include <stdbool.h>
+
+#define CACHE_LINE (64)
+
+/* Per-thread state of a queue, such as a QSBR registration, a hazard
+ * pointer slot or the handle of mpmc, from join() to leave().
+ */
+typedef union {
+    char data[CACHE_LINE];
+} __attribute__((aligned(CACHE_LINE))) queue_ctx_t;
+
+/* A queue under test, of pointers to messages. The messages start with a
+ * pointer-sized word the intrusive queues are free to link them through.
+ *
+ * create() sizes a bounded queue to about 'capacity' elements, and an
+ * unbounded one as it sees fit, knowing how many threads will use it. It
+ * gets a fresh queue for every trial, so that close() needs no undoing.
+ */
+typedef struct {
+    const char *name;
+    int max_producers, max_consumers; /* 0 if there is no limit */
+    void *(*create)(unsigned capacity, int producers, int consumers);
+    void (*destroy)(void *queue);
+
+    /* Optional, around the use of the queue by each thread */
+    void (*join)(void *queue, queue_ctx_t *ctx, bool producer);
+    void (*leave)(void *queue, queue_ctx_t *ctx);
+
+    /* Move up to 'n' messages and return how many, possibly none when the
+     * queue is full or empty. They may also wait for a while before giving
+     * up, or until close() for a dequeue.
+     */
+    unsigned (*enqueue)(void *queue,
+                        queue_ctx_t *ctx,
+                        void *const *msgs,
+                        unsigned n);
+    unsigned (*dequeue)(void *queue, queue_ctx_t *ctx, void **msgs, unsigned n);
+
+    /* Optional: the producers are gone, wake the consumers waiting */
+    void (*close)(void *queue);
+} queue_ops_t;
+
+extern const queue_ops_t spmc_ops;
+extern const queue_ops_t mpsc_ops, mpsc_intrusive_ops;
+extern const queue_ops_t mpmc_ops;
+extern const queue_ops_t lfq_ops;
+extern const queue_ops_t lfring_ops, lfchain_ops;
+extern const queue_ops_t ringbuffer_ops;
+extern const queue_ops_t channel_ops;
+extern const queue_ops_t rcu_queue_ops;
+
+#endif
@@ -0,0 +1,46 @@
+/* A buffered channel of channel, with its test program out of the way. Both
+ * sides block on the futexes of the channel, until it is closed for the
+ * consumers.
+ */
+#define main channel_main
+#include "../channel/channel.c"
+#undef main
+
+#include "bench.h"
+
+static void *channel_create(unsigned capacity, int producers, int consumers)
+{
+    return chan_make(capacity, malloc);
+}
+
+static unsigned channel_enqueue(void *queue,
+                                queue_ctx_t *ctx,
+                                void *const *msgs,
+                                unsigned n)
+{
+    ssize_t k = chan_send_n(queue, msgs, n);
+    return k < 0 ? 0 : k;
+}
+
+static unsigned channel_dequeue(void *queue,
+                                queue_ctx_t *ctx,
+                                void **msgs,
+                                unsigned n)
+{
+    ssize_t k = chan_recv_n(queue, msgs, n);
+    return k < 0 ? 0 : k;
+}
+
+static void channel_close(void *queue)
+{
+    chan_close(queue);
+}
+
+const queue_ops_t channel_ops = {
+    .name = "channel",
+    .create = channel_create,
+    .destroy = free,
+    .enqueue = channel_enqueue,
+    .dequeue = channel_dequeue,
+    .close = channel_close,
+};
@@ -0,0 +1,77 @@
+#include <stdlib.h>
+
+#include "bench.h"
+#include "lfq.h"
+
+/* The unbounded lock-free queue of lf-queue, the consumers take their
+ * hazard pointer slot when they join.
+ */
+
+static inline int *tid_of(queue_ctx_t *ctx)
+{
+    return (int *) ctx->data;
+}
+
+static void *lfq_create(unsigned capacity, int producers, int consumers)
+{
+    struct lfq_ctx *q = aligned_alloc(CACHE_LINE, sizeof(struct lfq_ctx));
+    if (q && lfq_init(q, consumers)) {
+        free(q);
+        return NULL;
+    }
+    return q;
+}
+
+static void lfq_destroy(void *queue)
+{
+    lfq_release(queue);
+    free(queue);
+}
+
+static void lfq_join(void *queue, queue_ctx_t *ctx, bool producer)
+{
+    *tid_of(ctx) = producer ? -1 : lfq_register_consumer(queue);
+}
+
+static void lfq_leave(void *queue, queue_ctx_t *ctx)
+{
+    if (*tid_of(ctx) >= 0)
+        lfq_unregister_consumer(queue, *tid_of(ctx));
+}
+
+static unsigned lfq_bench_enqueue(void *queue,
+                                  queue_ctx_t *ctx,
+                                  void *const *msgs,
+                                  unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (lfq_enqueue(queue, msgs[i]))
+            break;
+    }
+    return i;
+}
+
+static unsigned lfq_bench_dequeue(void *queue,
+                                  queue_ctx_t *ctx,
+                                  void **msgs,
+                                  unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n && (msgs[i] = lfq_dequeue_tid(queue, *tid_of(ctx)));
+         i++)
+        ;
+    return i;
+}
+
+const queue_ops_t lfq_ops = {
+    .name = "lf-queue",
+    .create = lfq_create,
+    .destroy = lfq_destroy,
+    .join = lfq_join,
+    .leave = lfq_leave,
+    .enqueue = lfq_bench_enqueue,
+    .dequeue = lfq_bench_dequeue,
+};
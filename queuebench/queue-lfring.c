@@ -0,0 +1,100 @@
+#include "bench.h"
+#include "lfchain.h"
+#include "lfring.h"
+
+/* The ring of lfring, single producer or consumer when there is only one,
+ * and the unbounded queue of its segments.
+ */
+
+static uint32_t lfring_flags(int producers, int consumers)
+{
+    return (producers == 1 ? LFRING_FLAG_SP : LFRING_FLAG_MP) |
+           (consumers == 1 ? LFRING_FLAG_SC : LFRING_FLAG_MC);
+}
+
+static void *lfring_create(unsigned capacity, int producers, int consumers)
+{
+    return lfring_alloc(capacity, lfring_flags(producers, consumers));
+}
+
+static void lfring_destroy(void *queue)
+{
+    lfring_free(queue);
+}
+
+static unsigned lfring_bench_enqueue(void *queue,
+                                     queue_ctx_t *ctx,
+                                     void *const *msgs,
+                                     unsigned n)
+{
+    return lfring_enqueue(queue, msgs, n);
+}
+
+static unsigned lfring_bench_dequeue(void *queue,
+                                     queue_ctx_t *ctx,
+                                     void **msgs,
+                                     unsigned n)
+{
+    uint32_t index;
+    return lfring_dequeue(queue, msgs, n, &index);
+}
+
+const queue_ops_t lfring_ops = {
+    .name = "lfring",
+    .create = lfring_create,
+    .destroy = lfring_destroy,
+    .enqueue = lfring_bench_enqueue,
+    .dequeue = lfring_bench_dequeue,
+};
+
+static inline struct qsbr_tls **tls_of(queue_ctx_t *ctx)
+{
+    return (struct qsbr_tls **) ctx->data;
+}
+
+/* Segments of the capacity */
+static void *lfchain_create(unsigned capacity, int producers, int consumers)
+{
+    return lfchain_alloc(capacity, lfring_flags(producers, consumers));
+}
+
+static void lfchain_destroy(void *queue)
+{
+    lfchain_free(queue);
+}
+
+static void lfchain_join(void *queue, queue_ctx_t *ctx, bool producer)
+{
+    *tls_of(ctx) = lfchain_register(queue);
+}
+
+static void lfchain_leave(void *queue, queue_ctx_t *ctx)
+{
+    lfchain_unregister(*tls_of(ctx));
+}
+
+static unsigned lfchain_bench_enqueue(void *queue,
+                                      queue_ctx_t *ctx,
+                                      void *const *msgs,
+                                      unsigned n)
+{
+    return lfchain_enqueue(queue, *tls_of(ctx), msgs, n);
+}
+
+static unsigned lfchain_bench_dequeue(void *queue,
+                                      queue_ctx_t *ctx,
+                                      void **msgs,
+                                      unsigned n)
+{
+    return lfchain_dequeue(queue, *tls_of(ctx), msgs, n);
+}
+
+const queue_ops_t lfchain_ops = {
+    .name = "lfchain",
+    .create = lfchain_create,
+    .destroy = lfchain_destroy,
+    .join = lfchain_join,
+    .leave = lfchain_leave,
+    .enqueue = lfchain_bench_enqueue,
+    .dequeue = lfchain_bench_dequeue,
+};
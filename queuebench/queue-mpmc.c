@@ -0,0 +1,79 @@
+/* The queue of mpmc, with its test program out of the way */
+#define main mpmc_main
+#include "../mpmc/mpmc.c"
+#undef main
+
+#include "bench.h"
+
+#define MPMC_THRESHOLD 8 /* nodes between two reclamations */
+
+/* The dequeues block, the first of a batch waits that long for a value and
+ * the others do not wait.
+ */
+#define MPMC_WAIT_NS 1000000
+
+static inline handle_t **handle_of(queue_ctx_t *ctx)
+{
+    return (handle_t **) ctx->data;
+}
+
+static void *mpmc_create(unsigned capacity, int producers, int consumers)
+{
+    mpmc_t *q = align_alloc(2 * CACHE_LINE_SIZE, sizeof(mpmc_t));
+    mpmc_init_queue(q, MPMC_THRESHOLD);
+    return q;
+}
+
+static void mpmc_destroy(void *queue)
+{
+    mpmc_destroy_queue(queue);
+    free(queue);
+}
+
+static void mpmc_join(void *queue, queue_ctx_t *ctx, bool producer)
+{
+    *handle_of(ctx) = mpmc_queue_join(queue, producer ? ENQUEUE : DEQUEUE);
+}
+
+static void mpmc_leave(void *queue, queue_ctx_t *ctx)
+{
+    mpmc_queue_leave(queue, *handle_of(ctx));
+}
+
+static unsigned mpmc_bench_enqueue(void *queue,
+                                   queue_ctx_t *ctx,
+                                   void *const *msgs,
+                                   unsigned n)
+{
+    if (n == 1)
+        mpmc_enqueue(queue, *handle_of(ctx), msgs[0]);
+    else
+        mpmc_enqueue_bulk(queue, *handle_of(ctx), msgs, n);
+    return n;
+}
+
+static unsigned mpmc_bench_dequeue(void *queue,
+                                   queue_ctx_t *ctx,
+                                   void **msgs,
+                                   unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        msgs[i] = mpmc_dequeue_timeout(queue, *handle_of(ctx),
+                                       i ? 0 : MPMC_WAIT_NS);
+        if (!msgs[i])
+            break;
+    }
+    return i;
+}
+
+const queue_ops_t mpmc_ops = {
+    .name = "mpmc",
+    .create = mpmc_create,
+    .destroy = mpmc_destroy,
+    .join = mpmc_join,
+    .leave = mpmc_leave,
+    .enqueue = mpmc_bench_enqueue,
+    .dequeue = mpmc_bench_dequeue,
+};
@@ -0,0 +1,100 @@
+/* The queues of mpsc, with its test program out of the way: the one that
+ * copies the values into nodes of its own, and the intrusive one, which
+ * links the messages through their first word. It is built with fewer
+ * warnings than here.
+ */
+#define main mpsc_main
+#pragma GCC diagnostic push
+#pragma GCC diagnostic ignored "-Wsign-compare"
+#include "../mpsc/mpsc.c"
+#pragma GCC diagnostic pop
+#undef main
+
+#include "bench.h"
+
+static void *mpsc_create(unsigned capacity, int producers, int consumers)
+{
+    return Queue.create(sizeof(void *));
+}
+
+static void mpsc_destroy(void *queue)
+{
+    Queue.clear(queue);
+    Queue.destroy(queue);
+}
+
+static unsigned mpsc_enqueue(void *queue,
+                             queue_ctx_t *ctx,
+                             void *const *msgs,
+                             unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (Queue.push(queue, (void *) &msgs[i]) != QUEUE_SUCCESS)
+            break;
+    }
+    return i;
+}
+
+static unsigned mpsc_dequeue(void *queue,
+                             queue_ctx_t *ctx,
+                             void **msgs,
+                             unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n && Queue.hasFront(queue) == QUEUE_TRUE; i++) {
+        Queue.front(queue, &msgs[i]);
+        Queue.pop(queue);
+    }
+    return i;
+}
+
+const queue_ops_t mpsc_ops = {
+    .name = "mpsc",
+    .max_consumers = 1,
+    .create = mpsc_create,
+    .destroy = mpsc_destroy,
+    .enqueue = mpsc_enqueue,
+    .dequeue = mpsc_dequeue,
+};
+
+static void *intrusive_create(unsigned capacity, int producers, int consumers)
+{
+    mpsc_queue_t *q = aligned_alloc(CACHE_LINE, CACHE_LINE);
+    if (q)
+        IntrusiveQueue.init(q);
+    return q;
+}
+
+static unsigned intrusive_enqueue(void *queue,
+                                  queue_ctx_t *ctx,
+                                  void *const *msgs,
+                                  unsigned n)
+{
+    for (unsigned i = 0; i < n; i++)
+        IntrusiveQueue.push(queue, msgs[i]);
+    return n;
+}
+
+static unsigned intrusive_dequeue(void *queue,
+                                  queue_ctx_t *ctx,
+                                  void **msgs,
+                                  unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n && (msgs[i] = IntrusiveQueue.pop(queue)); i++)
+        ;
+    return i;
+}
+
+const queue_ops_t mpsc_intrusive_ops = {
+    .name = "mpsc-intrusive",
+    .max_consumers = 1,
+    .create = intrusive_create,
+    .destroy = free,
+    .enqueue = intrusive_enqueue,
+    .dequeue = intrusive_dequeue,
+};
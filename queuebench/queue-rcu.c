@@ -0,0 +1,106 @@
+/* The queue of rcu_queue, with its test program out of the way. Every
+ * thread registers with the QSBR of the queue, the consumers retire the
+ * nodes they release to the free lists of the test program, and each
+ * operation is a quiescent state.
+ */
+#define main rcu_queue_main
+#include "../rcu_queue/rcu_queue.c"
+#undef main
+
+#include "bench.h"
+
+typedef struct {
+    struct qsbr_queue queue;
+    qsbr_t *qsbr;
+} rcu_queue_t;
+
+static inline qsbr_tls_t **tls_of(queue_ctx_t *ctx)
+{
+    return (qsbr_tls_t **) ctx->data;
+}
+
+static void *rcu_create(unsigned capacity, int producers, int consumers)
+{
+    rcu_queue_t *q = aligned_alloc(CACHE_LINE_SIZE, sizeof(rcu_queue_t));
+    if (!q)
+        return NULL;
+    if (!(q->qsbr = qsbr_create())) {
+        free(q);
+        return NULL;
+    }
+    qsbr_queue_init(&q->queue, alloc_node());
+    return q;
+}
+
+/* The limbo goes to the free lists, which are freed last */
+static void rcu_destroy(void *queue)
+{
+    rcu_queue_t *q = queue;
+    struct qsbr_queue_node *node;
+
+    qsbr_queue_fini(&q->queue, &node);
+    free_node(node);
+    qsbr_destroy(q->qsbr);
+    free_list_destroy();
+    free(q);
+}
+
+static void rcu_join(void *queue, queue_ctx_t *ctx, bool producer)
+{
+    rcu_queue_t *q = queue;
+    *tls_of(ctx) = qsbr_register(q->qsbr);
+}
+
+static void rcu_leave(void *queue, queue_ctx_t *ctx)
+{
+    qsbr_unregister(*tls_of(ctx));
+    free_list_exit();
+}
+
+static unsigned rcu_enqueue(void *queue,
+                            queue_ctx_t *ctx,
+                            void *const *msgs,
+                            unsigned n)
+{
+    rcu_queue_t *q = queue;
+    struct qsbr_queue_node *first = alloc_node(), *last = first;
+
+    first->value = msgs[0];
+    for (unsigned i = 1; i < n; i++) {
+        struct qsbr_queue_node *node = alloc_node();
+        node->value = msgs[i];
+        atomic_store_explicit(&last->next, node, memory_order_relaxed);
+        last = node;
+    }
+    qsbr_queue_push_chain(&q->queue, first, last);
+    qsbr_checkpoint(*tls_of(ctx));
+    return n;
+}
+
+static unsigned rcu_dequeue(void *queue,
+                            queue_ctx_t *ctx,
+                            void **msgs,
+                            unsigned n)
+{
+    rcu_queue_t *q = queue;
+    struct qsbr_queue_node *node;
+
+    size_t k = qsbr_queue_pop_bulk(&q->queue, &node, msgs, n);
+    for (size_t i = 0; i < k; i++) {
+        struct qsbr_queue_node *next = node_next(node);
+        qsbr_retire(*tls_of(ctx), node, sizeof(*node), free_qsbr_node);
+        node = next;
+    }
+    qsbr_checkpoint(*tls_of(ctx));
+    return k;
+}
+
+const queue_ops_t rcu_queue_ops = {
+    .name = "rcu_queue",
+    .create = rcu_create,
+    .destroy = rcu_destroy,
+    .join = rcu_join,
+    .leave = rcu_leave,
+    .enqueue = rcu_enqueue,
+    .dequeue = rcu_dequeue,
+};
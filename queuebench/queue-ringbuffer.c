@@ -0,0 +1,68 @@
+/* The ring of ringbuffer, with its test program out of the way. The burst
+ * calls of the single producer or consumer side are used when there is only
+ * one.
+ */
+#define main ringbuffer_main
+#include "../ringbuffer/ringbuffer.c"
+#undef main
+
+#include "bench.h"
+
+typedef struct {
+    ringbuf_t *ring;
+    bool sp, sc;
+} ring_queue_t;
+
+/* One slot is always left free, the ring has the next power of two */
+static void *ring_create(unsigned capacity, int producers, int consumers)
+{
+    ring_queue_t *q = malloc(sizeof(ring_queue_t));
+    unsigned count = 2;
+
+    while (count <= capacity)
+        count <<= 1;
+    if (q && !(q->ring = ringbuf_create(count, 0))) {
+        free(q);
+        return NULL;
+    }
+    if (q)
+        q->sp = producers == 1, q->sc = consumers == 1;
+    return q;
+}
+
+static void ring_destroy(void *queue)
+{
+    ring_queue_t *q = queue;
+    ringbuf_free(q->ring);
+    free(q);
+}
+
+static unsigned ring_enqueue(void *queue,
+                             queue_ctx_t *ctx,
+                             void *const *msgs,
+                             unsigned n)
+{
+    ring_queue_t *q = queue;
+    if (q->sp)
+        return ringbuf_sp_enqueue_burst(q->ring, msgs, n);
+    return ringbuf_mp_enqueue_burst(q->ring, msgs, n);
+}
+
+static unsigned ring_dequeue(void *queue,
+                             queue_ctx_t *ctx,
+                             void **msgs,
+                             unsigned n)
+{
+    ring_queue_t *q = queue;
+    if (q->sc)
+        return ringbuf_sc_dequeue_burst(q->ring, msgs, n);
+    return ringbuf_mc_dequeue_burst(q->ring, msgs, n);
+}
+
+const queue_ops_t ringbuffer_ops = {
+    .name = "ringbuffer",
+    .create = ring_create,
+    .destroy = ring_destroy,
+    .enqueue = ring_enqueue,
+    .dequeue = ring_dequeue,
+};
@@ -0,0 +1,67 @@
+/* The queue of spmc, with its test program out of the way */
+#define main spmc_main
+#include "../spmc/spmc.c"
+#undef main
+
+#include "bench.h"
+
+static inline spmc_consumer_t **consumer_of(queue_ctx_t *ctx)
+{
+    return (spmc_consumer_t **) ctx->data;
+}
+
+/* The nodes grow from the default size, the capacity does not apply */
+static void *spmc_bench_create(unsigned capacity, int producers, int consumers)
+{
+    return spmc_new(0, 0, NULL);
+}
+
+static void spmc_bench_destroy(void *queue)
+{
+    spmc_delete(queue);
+}
+
+static void spmc_bench_join(void *queue, queue_ctx_t *ctx, bool producer)
+{
+    *consumer_of(ctx) = producer ? NULL : spmc_join(queue);
+}
+
+static void spmc_bench_leave(void *queue, queue_ctx_t *ctx)
+{
+    if (*consumer_of(ctx))
+        spmc_leave(*consumer_of(ctx));
+}
+
+static unsigned spmc_bench_enqueue(void *queue,
+                                   queue_ctx_t *ctx,
+                                   void *const *msgs,
+                                   unsigned n)
+{
+    unsigned i;
+
+    for (i = 0; i < n; i++) {
+        if (!spmc_enqueue(queue, (uintptr_t) msgs[i]))
+            break;
+    }
+    return i;
+}
+
+static unsigned spmc_bench_dequeue(void *queue,
+                                   queue_ctx_t *ctx,
+                                   void **msgs,
+                                   unsigned n)
+{
+    return spmc_trydequeue_batch(queue, *consumer_of(ctx), (uintptr_t *) msgs,
+                                 n);
+}
+
+const queue_ops_t spmc_ops = {
+    .name = "spmc",
+    .max_producers = 1,
+    .create = spmc_bench_create,
+    .destroy = spmc_bench_destroy,
+    .join = spmc_bench_join,
+    .leave = spmc_bench_leave,
+    .enqueue = spmc_bench_enqueue,
+    .dequeue = spmc_bench_dequeue,
+};
@@ -0,0 +1,267 @@
+/* RCU hash table with relativistic resizing */
+
+#pragma once
+
+#include <stdbool.h>
+#include <stdlib.h>
+
+#include "rculist.h"
+
+/* Each bucket is an hlist, and the number of buckets is a power of two.
+ * The table is resized without stopping the readers, as in "Resizable,
+ * Scalable, Concurrent Hash Tables via Relativistic Programming" by J.
+ * Triplett, P. E. McKenney and J. Walpole:
+ *
+ * - To grow, the new buckets point into the old chains, which hold the
+ *   nodes of two new buckets each. Once no reader uses the old table, the
+ *   chains are unzipped one link at a time, with a grace period between
+ *   two steps so that no reader of a bucket gets cut from its next nodes.
+ * - To shrink, the old chains that end up in the same new bucket are
+ *   concatenated, then the new table is published.
+ *
+ * A chain may thus hold nodes of other buckets, readers skip the nodes whose
+ * hash does not match.
+ */
+
+#define RCU_HASH_MIN_SIZE 8
+
+struct rcu_hash_node {
+    struct hlist_node node;
+    unsigned long hash;
+};
+
+struct rcu_hash_table {
+    unsigned long size;
+    struct hlist_head buckets[];
+};
+
+struct rcu_hash {
+    struct rcu_hash_table __rcu *table;
+    spinlock_t lock; /* Serializes the updaters */
+    unsigned long count;
+    bool auto_resize;
+};
+
+#define rcu_hash_bucket(tbl, hash) (&(tbl)->buckets[(hash) & ((tbl)->size - 1)])
+
+static inline struct rcu_hash_table *rcu_hash_table_alloc(unsigned long size)
+{
+    struct rcu_hash_table *tbl =
+        malloc(sizeof(*tbl) + size * sizeof(struct hlist_head));
+    if (!tbl) {
+        fprintf(stderr, "rcu_hash_table_alloc failed\n");
+        abort();
+    }
+
+    tbl->size = size;
+    for (unsigned long i = 0; i < size; i++)
+        hlist_init_rcu(&tbl->buckets[i]);
+    return tbl;
+}
+
+/* With "auto_resize", the table doubles once there are more nodes than
+ * buckets and halves below a quarter of that. The size is rounded up to a
+ * power of two.
+ */
+static inline void rcu_hash_init(struct rcu_hash *ht,
+                                 unsigned long size,
+                                 bool auto_resize)
+{
+    unsigned long n = RCU_HASH_MIN_SIZE;
+
+    while (n < size)
+        n <<= 1;
+    ht->table = rcu_hash_table_alloc(n);
+    pthread_mutex_init(&ht->lock, NULL);
+    ht->count = 0;
+    ht->auto_resize = auto_resize;
+}
+
+/* No reader may be left, the nodes are the caller's */
+static inline void rcu_hash_destroy(struct rcu_hash *ht)
+{
+    free(ht->table);
+    ht->table = NULL;
+    pthread_mutex_destroy(&ht->lock);
+}
+
+/* The pprev of the nodes are only used by the updaters, set them once a
+ * resize is over.
+ */
+static inline void __rcu_hash_fix_pprev(struct rcu_hash_table *tbl)
+{
+    for (unsigned long i = 0; i < tbl->size; i++) {
+        struct hlist_node **pprev = &tbl->buckets[i].first;
+        for (struct hlist_node *n = *pprev; n; n = n->next) {
+            n->pprev = pprev;
+            pprev = &n->next;
+        }
+    }
+}
+
+static inline struct rcu_hash_node *__rcu_hash_node(struct hlist_node *n)
+{
+    return container_of(n, struct rcu_hash_node, node);
+}
+
+static inline void __rcu_hash_grow(struct rcu_hash *ht,
+                                   struct rcu_hash_table *old)
+{
+    unsigned long size = old->size * 2, mask = size - 1;
+    struct rcu_hash_table *new = rcu_hash_table_alloc(size);
+    struct hlist_node **unzip = calloc(old->size, sizeof(*unzip));
+    bool zipped;
+
+    if (!unzip) {
+        fprintf(stderr, "__rcu_hash_grow failed\n");
+        abort();
+    }
+
+    /* Each new bucket starts at its first node in the old chain */
+    for (unsigned long i = 0; i < old->size; i++) {
+        unzip[i] = old->buckets[i].first;
+        for (struct hlist_node *n = unzip[i]; n; n = n->next) {
+            struct hlist_head *b = &new->buckets[__rcu_hash_node(n)->hash & mask];
+            if (!b->first)
+                b->first = n;
+        }
+    }
+    rcu_assign_pointer(ht->table, new);
+    synchronize_rcu();
+
+    /* Unzip each chain at its first link between two new buckets, then wait
+     * for the readers that might be past it before the next step.
+     */
+    do {
+        zipped = false;
+        for (unsigned long i = 0; i < old->size; i++) {
+            struct hlist_node *p = unzip[i], *q;
+            if (!p)
+                continue;
+
+            unsigned long b = __rcu_hash_node(p)->hash & mask;
+            while (p->next && (__rcu_hash_node(p->next)->hash & mask) == b)
+                p = p->next;
+            if (!p->next) {
+                unzip[i] = NULL;
+                continue;
+            }
+
+            /* p->next starts a run of the other bucket, skip it */
+            unzip[i] = p->next;
+            for (q = p->next; q; q = q->next) {
+                if ((__rcu_hash_node(q)->hash & mask) == b)
+                    break;
+            }
+            rcu_assign_pointer(hlist_next_rcu(p), q);
+            zipped = true;
+        }
+        if (zipped)
+            synchronize_rcu();
+    } while (zipped);
+
+    __rcu_hash_fix_pprev(new);
+    free(unzip);
+    free(old);
+}
+
+static inline void __rcu_hash_shrink(struct rcu_hash *ht,
+                                     struct rcu_hash_table *old)
+{
+    unsigned long size = old->size / 2;
+    struct rcu_hash_table *new = rcu_hash_table_alloc(size);
+
+    /* Bucket i + size goes after bucket i, in both tables */
+    for (unsigned long i = 0; i < size; i++) {
+        struct hlist_head *low = &old->buckets[i];
+        struct hlist_node *high = old->buckets[i + size].first;
+
+        if (!low->first) {
+            new->buckets[i].first = high;
+            continue;
+        }
+        new->buckets[i].first = low->first;
+
+        struct hlist_node *tail = low->first;
+        while (tail->next)
+            tail = tail->next;
+        rcu_assign_pointer(hlist_next_rcu(tail), high);
+    }
+    rcu_assign_pointer(ht->table, new);
+    synchronize_rcu();
+
+    __rcu_hash_fix_pprev(new);
+    free(old);
+}
+
+/* Resize to "size" buckets, rounded up to a power of two. The lock must be
+ * held, and the caller must not be a reader.
+ */
+static inline void __rcu_hash_resize(struct rcu_hash *ht, unsigned long size)
+{
+    unsigned long n = RCU_HASH_MIN_SIZE;
+
+    while (n < size)
+        n <<= 1;
+    while (ht->table->size < n)
+        __rcu_hash_grow(ht, ht->table);
+    while (ht->table->size > n)
+        __rcu_hash_shrink(ht, ht->table);
+}
+
+static inline void rcu_hash_resize(struct rcu_hash *ht, unsigned long size)
+{
+    spin_lock(&ht->lock);
+    __rcu_hash_resize(ht, size);
+    spin_unlock(&ht->lock);
+}
+
+/* Add "node" with the given hash, the caller checks for duplicates. With
+ * auto_resize, it may wait for grace periods, and must not be called by a
+ * reader.
+ */
+static inline void rcu_hash_add(struct rcu_hash *ht,
+                                struct rcu_hash_node *node,
+                                unsigned long hash)
+{
+    spin_lock(&ht->lock);
+    node->hash = hash;
+    hlist_add_head_rcu(&node->node, rcu_hash_bucket(ht->table, hash));
+    if (++ht->count > ht->table->size && ht->auto_resize)
+        __rcu_hash_grow(ht, ht->table);
+    spin_unlock(&ht->lock);
+}
+
+/* Remove "node", which may be freed after a grace period */
+static inline void rcu_hash_del(struct rcu_hash *ht, struct rcu_hash_node *node)
+{
+    spin_lock(&ht->lock);
+    hlist_del_rcu(&node->node);
+    if (--ht->count < ht->table->size / 4 && ht->auto_resize &&
+        ht->table->size > RCU_HASH_MIN_SIZE)
+        __rcu_hash_shrink(ht, ht->table);
+    spin_unlock(&ht->lock);
+}
+
+/* The read side should only use the following API, inside a read-side
+ * critical section. Load the table once with rcu_hash_table_rcu() and use it
+ * for the whole lookup.
+ */
+
+#define rcu_hash_table_rcu(ht) rcu_dereference((ht)->table)
+
+/* Iterate over the nodes with the hash "key_hash", which still have to be
+ * compared with the key.
+ */
+#define rcu_hash_for_each_possible_rcu(tbl, pos, member, key_hash) \
+    hlist_for_each_entry_rcu(pos, rcu_hash_bucket(tbl, key_hash),  \
+                             member.node)                          \
+        if ((pos)->member.hash != (key_hash)) {                    \
+        } else
+
+/* Iterate over every node once, "bkt" is an unsigned long */
+#define rcu_hash_for_each_rcu(tbl, bkt, pos, member)                        \
+    for (bkt = 0; bkt < (tbl)->size; bkt++)                                 \
+        hlist_for_each_entry_rcu(pos, &(tbl)->buckets[bkt], member.node)    \
+            if (((pos)->member.hash & ((tbl)->size - 1)) != bkt) {          \
+            } else
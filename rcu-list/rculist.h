@@ -4,16 +4,17 @@
 
 #include <stddef.h>
 
-/* Reuse the RCU from thread-rcu */
-#include "../thread-rcu/rcu.h"
-
-#define __allow_unused __attribute__((unused))
-
 #define container_of(ptr, type, member)                         \
     __extension__({                                             \
         const __typeof__(((type *) 0)->member) *__mptr = (ptr); \
         (type *) ((char *) __mptr - offsetof(type, member));    \
     })
+
+/* Reuse the RCU from thread-rcu */
+#include "../thread-rcu/rcu.h"
+
+#define __allow_unused __attribute__((unused))
+
 #define list_entry_rcu(ptr, type, member) \
     container_of(READ_ONCE(ptr), type, member)
 
@@ -85,3 +86,59 @@ static inline void list_del_rcu(struct list_head *node)
     for (pos = list_entry_rcu((head)->next, __typeof__(*pos), member); \
          &pos->member != (head);                                       \
          pos = list_entry_rcu(pos->member.next, __typeof__(*pos), member))
+
+/* Lists with a single pointer head, for hash buckets. The chain ends with
+ * NULL instead of going back to the head, so that a node may be on the chain
+ * of several buckets while a hash table is resized.
+ */
+
+struct hlist_head {
+    struct hlist_node *first;
+};
+
+struct hlist_node {
+    struct hlist_node *next, **pprev;
+};
+
+#define hlist_first_rcu(head) (*((struct hlist_node __rcu **) (&(head)->first)))
+#define hlist_next_rcu(n) (*((struct hlist_node __rcu **) (&(n)->next)))
+
+static inline void hlist_init_rcu(struct hlist_head *head)
+{
+    head->first = NULL;
+}
+
+static inline void hlist_add_head_rcu(struct hlist_node *new,
+                                      struct hlist_head *head)
+{
+    struct hlist_node *first = head->first;
+
+    new->next = first;
+    new->pprev = &head->first;
+    rcu_assign_pointer(hlist_first_rcu(head), new);
+    if (first)
+        first->pprev = &new->next;
+}
+
+/* Readers on the node keep going from it, free it after a grace period */
+static inline void hlist_del_rcu(struct hlist_node *node)
+{
+    struct hlist_node *next = node->next;
+
+    WRITE_ONCE(*node->pprev, next);
+    if (next)
+        next->pprev = node->pprev;
+    node->pprev = NULL;
+}
+
+#define hlist_entry_safe_rcu(ptr, type, member)                        \
+    __extension__({                                                    \
+        struct hlist_node *___n = READ_ONCE(ptr);                      \
+        ___n ? container_of(___n, type, member) : (type *) NULL;       \
+    })
+
+#define hlist_for_each_entry_rcu(pos, head, member)                      \
+    for (pos = hlist_entry_safe_rcu(hlist_first_rcu(head),               \
+                                    __typeof__(*pos), member);           \
+         pos; pos = hlist_entry_safe_rcu(hlist_next_rcu(&(pos)->member), \
+                                         __typeof__(*pos), member))
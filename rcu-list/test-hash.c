@@ -0,0 +1,148 @@
+/* A stress test of the RCU hash table
+ *
+ * Readers look up a set of keys that stays in the table, while the updater
+ * adds and removes other keys, making the table grow and shrink under them.
+ */
+
+#define _GNU_SOURCE
+
+#include <pthread.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+
+#include "rcuhash.h"
+
+#define N_READERS 4
+#define N_STABLE 64     /* keys that are never removed */
+#define N_VOLATILE 1024 /* keys that come and go */
+#define N_ROUNDS 4
+
+struct route {
+    unsigned long key;
+    struct rcu_hash_node hnode;
+    struct rcu_head rcu;
+};
+
+static struct rcu_hash table;
+static volatile _Atomic bool stop;
+
+static unsigned long hash(unsigned long key)
+{
+    key ^= key >> 33;
+    key *= 0xff51afd7ed558ccdUL;
+    key ^= key >> 33;
+    return key;
+}
+
+static struct route *route_add(unsigned long key)
+{
+    struct route *r = malloc(sizeof(struct route));
+    if (!r) {
+        fprintf(stderr, "route_add failed\n");
+        abort();
+    }
+
+    r->key = key;
+    rcu_hash_add(&table, &r->hnode, hash(key));
+    return r;
+}
+
+static void route_free(struct rcu_head *head)
+{
+    free(container_of(head, struct route, rcu));
+}
+
+static bool route_lookup(unsigned long key)
+{
+    struct rcu_hash_table *tbl = rcu_hash_table_rcu(&table);
+    struct route *r;
+
+    rcu_hash_for_each_possible_rcu(tbl, r, hnode, hash(key))
+    {
+        if (r->key == key)
+            return true;
+    }
+    return false;
+}
+
+static void *reader_side(void *argv)
+{
+    unsigned long bkt;
+    struct route *r;
+
+    rcu_init();
+
+    while (!stop) {
+        rcu_read_lock();
+        for (unsigned long key = 0; key < N_STABLE; key++) {
+            if (!route_lookup(key)) {
+                fprintf(stderr, "key %lu lost\n", key);
+                abort();
+            }
+        }
+        rcu_read_unlock();
+
+        /* Every stable key shows up once in a full walk */
+        unsigned long n = 0;
+        rcu_read_lock();
+        struct rcu_hash_table *tbl = rcu_hash_table_rcu(&table);
+        rcu_hash_for_each_rcu(tbl, bkt, r, hnode)
+        {
+            if (r->key < N_STABLE)
+                n++;
+        }
+        rcu_read_unlock();
+        if (n != N_STABLE) {
+            fprintf(stderr, "%lu stable keys in the walk\n", n);
+            abort();
+        }
+    }
+
+    pthread_exit(NULL);
+}
+
+static void *updater_side(void *argv)
+{
+    static struct route *routes[N_VOLATILE];
+
+    for (int round = 0; round < N_ROUNDS; round++) {
+        for (unsigned long i = 0; i < N_VOLATILE; i++)
+            routes[i] = route_add(N_STABLE + i);
+        for (unsigned long i = 0; i < N_VOLATILE; i++) {
+            rcu_hash_del(&table, &routes[i]->hnode);
+            call_rcu(&routes[i]->rcu, route_free);
+        }
+    }
+    stop = true;
+
+    pthread_exit(NULL);
+}
+
+int main(int argc, char *argv[])
+{
+    pthread_t reader[N_READERS], updater;
+    struct route *stable[N_STABLE];
+
+    rcu_hash_init(&table, 0, true);
+    for (unsigned long key = 0; key < N_STABLE; key++)
+        stable[key] = route_add(key);
+
+    for (int i = 0; i < N_READERS; i++)
+        pthread_create(&reader[i], NULL, reader_side, NULL);
+    pthread_create(&updater, NULL, updater_side, NULL);
+
+    pthread_join(updater, NULL);
+    for (int i = 0; i < N_READERS; i++)
+        pthread_join(reader[i], NULL);
+
+    printf("%lu buckets for %lu keys\n", table.table->size, table.count);
+    for (unsigned long key = 0; key < N_STABLE; key++) {
+        rcu_hash_del(&table, &stable[key]->hnode);
+        free(stable[key]);
+    }
+    rcu_barrier();
+    rcu_hash_destroy(&table);
+    rcu_clean();
+    return 0;
+}
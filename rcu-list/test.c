@@ -1,4 +1,9 @@
-/* A benchmark of thread-rcu linked list */
+/* A benchmark of thread-rcu linked list
+ *
+ * The number of readers doubles up to READER_NUM, and for each the average
+ * latency of a read-side walk and of an update, including its grace period,
+ * is reported.
+ */
 
 #define _GNU_SOURCE
 
@@ -8,6 +13,9 @@
 #include <unistd.h>
 
 #include "rculist.h"
+#include "tracer.h"
+
+#define READ_ITERS 100 /* read-side walks per reader */
 
 struct test {
     int count;
@@ -15,6 +23,14 @@ struct test {
 };
 
 static struct list_head head;
+static _Atomic double read_ns, update_ns;
+
+static void add_ns(_Atomic double *sum, double ns)
+{
+    double old = atomic_load(sum);
+    while (!atomic_compare_exchange_weak(sum, &old, old + ns))
+        ;
+}
 
 static struct test *test_alloc(int val)
 {
@@ -33,14 +49,20 @@ static struct test *test_alloc(int val)
 static void *reader_side(void *argv)
 {
     struct test __allow_unused *tmp;
+    struct timespec start, end;
 
     rcu_init();
 
-    rcu_read_lock();
+    clock_gettime(CLOCK_MONOTONIC, &start);
+    for (int i = 0; i < READ_ITERS; i++) {
+        rcu_read_lock();
 
-    list_for_each_entry_rcu(tmp, &head, node) {}
+        list_for_each_entry_rcu(tmp, &head, node) {}
 
-    rcu_read_unlock();
+        rcu_read_unlock();
+    }
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    add_ns(&read_ns, time_diff(start, end));
 
     pthread_exit(NULL);
 }
@@ -48,14 +70,18 @@ static void *reader_side(void *argv)
 static void *updater_side(void *argv)
 {
     struct test *newval = test_alloc(current_tid());
+    struct timespec start, end;
 
+    clock_gettime(CLOCK_MONOTONIC, &start);
     list_add_tail_rcu(&newval->node, &head);
     synchronize_rcu();
+    clock_gettime(CLOCK_MONOTONIC, &end);
+    add_ns(&update_ns, time_diff(start, end));
 
     pthread_exit(NULL);
 }
 
-static inline void benchmark(void)
+static inline void benchmark(int n_readers)
 {
     pthread_t reader[READER_NUM];
     pthread_t updater[UPDATER_NUM];
@@ -64,16 +90,16 @@ static inline void benchmark(void)
     int i;
     list_init_rcu(&head);
 
-    for (i = 0; i < READER_NUM / 2; i++)
+    for (i = 0; i < n_readers / 2; i++)
         pthread_create(&reader[i], NULL, reader_side, NULL);
 
     for (i = 0; i < UPDATER_NUM; i++)
         pthread_create(&updater[i], NULL, updater_side, NULL);
 
-    for (i = READER_NUM / 2; i < READER_NUM; i++)
+    for (i = n_readers / 2; i < n_readers; i++)
         pthread_create(&reader[i], NULL, reader_side, NULL);
 
-    for (i = 0; i < READER_NUM; i++)
+    for (i = 0; i < n_readers; i++)
         pthread_join(reader[i], NULL);
 
     for (i = 0; i < UPDATER_NUM; i++)
@@ -88,10 +114,19 @@ static inline void benchmark(void)
     rcu_clean();
 }
 
-#include "tracer.h"
-
 int main(int argc, char *argv[])
 {
-    time_check_loop(benchmark(), TRACE_LOOP);
+    printf("%8s %14s %14s %14s\n", "readers", "read (ns/op)", "update (ns/op)",
+           "loop (ns)");
+    for (int n = 1;; n = n * 2 < READER_NUM ? n * 2 : READER_NUM) {
+        read_ns = update_ns = 0;
+        double loop = time_check_loop_return(benchmark(n), TRACE_LOOP);
+        printf("%8d %14.1f %14.1f %14.1f\n", n,
+               read_ns / ((double) TRACE_LOOP * n * READ_ITERS),
+               update_ns / ((double) TRACE_LOOP * UPDATER_NUM),
+               loop / TRACE_LOOP);
+        if (n == READER_NUM)
+            break;
+    }
     return 0;
 }
@@ -4,10 +4,18 @@
 
 #include <time.h>
 
-#define time_diff(start, end)                         \
-    (end.tv_nsec - start.tv_nsec < 0                  \
-         ? (1000000000 + end.tv_nsec - start.tv_nsec) \
-         : (end.tv_nsec - start.tv_nsec))
+#include "../hotstat/hotstat.h"
+
+/* Under HOTSTAT, every traced call also lands in a histogram of its own */
+#define __time_record(_FUNC_, during)                   \
+    do {                                                \
+        HOTSTAT_HISTOGRAM(trace_ns, "tracer." #_FUNC_); \
+        HOTSTAT_RECORD(trace_ns, (uint64_t) during);    \
+    } while (0)
+
+#define time_diff(start, end)                   \
+    ((end.tv_sec - start.tv_sec) * 1000000000.0 + \
+     (end.tv_nsec - start.tv_nsec))
 #define time_check(_FUNC_)                               \
     do {                                                 \
         struct timespec time_start;                      \
@@ -17,6 +25,7 @@
         _FUNC_;                                          \
         clock_gettime(CLOCK_MONOTONIC, &time_end);       \
         during = time_diff(time_start, time_end);        \
+        __time_record(_FUNC_, during);                   \
         printf("[tracer] %s: %f ns\n", #_FUNC_, during); \
     } while (0)
 #define __time_check(_FUNC_)                         \
@@ -39,6 +48,7 @@
         _FUNC_;                                      \
         clock_gettime(CLOCK_MONOTONIC, &time_end);   \
         during = time_diff(time_start, time_end);    \
+        __time_record(_FUNC_, during);               \
         during;                                      \
     })
 #define time_check_loop(_FUNC_, times)                    \
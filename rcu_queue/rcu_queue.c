@@ -34,131 +34,11 @@ static inline void wrap_free(void *ptr)
 #include <stdatomic.h>
 #include <stdbool.h>
 
-struct qsbr_entry {
-    _Atomic(struct qsbr_entry *) next;
-};
-
-struct qsbr_global {
-    /* Current global epoch */
-    _Atomic uint32_t epoch;
-
-    /* Number of threads that have not entered a quiescent section in the
-     * current epoch yet.
-     */
-    _Atomic uint32_t n_remaining;
-
-    /* Entries that can be freed at current epoch + 1 */
-    _Atomic(struct qsbr_entry *) to_free1;
-
-    /* Entries that can be freed at current epoch + 2 */
-    _Atomic(struct qsbr_entry *) to_free2;
-
-    uint32_t n_threads;
-};
-
-struct qsbr_local {
-    uint32_t epoch;
-};
-
-static inline void qsbr_init_global(struct qsbr_global *global,
-                                    uint32_t n_threads)
-{
-    atomic_init(&global->epoch, 0);
-    atomic_init(&global->n_remaining, 0);
-    atomic_init(&global->to_free1, NULL);
-    atomic_init(&global->to_free2, NULL);
-    global->n_threads = n_threads;
-}
-
-static inline void qsbr_init_local(struct qsbr_local *local)
-{
-    local->epoch = 0;
-}
-
-static inline void qsbr_fini_global(struct qsbr_global *global,
-                                    struct qsbr_entry **to_free1,
-                                    struct qsbr_entry **to_free2)
-{
-    *to_free1 = atomic_load_explicit(&global->to_free1, memory_order_relaxed);
-    *to_free2 = atomic_load_explicit(&global->to_free2, memory_order_relaxed);
-}
-
-static inline void qsbr_free(struct qsbr_global *global,
-                             struct qsbr_local *local,
-                             struct qsbr_entry *entry)
-{
-    struct qsbr_entry *expected = NULL;
-
-    /* qsbr_free() is not supported when the number of threads is 1. */
-    assert(global->n_threads > 1);
-
-    atomic_store_explicit(&entry->next, NULL, memory_order_relaxed);
-    bool exchanged = atomic_compare_exchange_strong_explicit(
-        &global->to_free1, &expected, entry, memory_order_acq_rel,
-        memory_order_consume);
-    if (UNLIKELY(exchanged)) {
-        uint32_t epoch =
-            atomic_load_explicit(&global->epoch, memory_order_relaxed);
-        atomic_store_explicit(&global->n_remaining, global->n_threads - 1,
-                              memory_order_relaxed);
-        atomic_store_explicit(&global->epoch, epoch + 1, memory_order_release);
-        local->epoch = epoch + 1;
-    } else {
-        struct qsbr_entry *next =
-            atomic_load_explicit(&global->to_free2, memory_order_relaxed);
-        atomic_store_explicit(&entry->next, next, memory_order_relaxed);
-        while (!atomic_compare_exchange_weak_explicit(
-            &global->to_free2, &entry->next, entry, memory_order_release,
-            memory_order_relaxed))
-            ;
-    }
-}
-
-static inline struct qsbr_entry *qsbr_quiescent(struct qsbr_global *global,
-                                                struct qsbr_local *local)
-{
-    uint32_t epoch = atomic_load_explicit(&global->epoch, memory_order_consume);
-    if (LIKELY(epoch == local->epoch))
-        return NULL;
-
-    struct qsbr_entry *to_free = NULL;
-    uint32_t n_remaining = atomic_fetch_sub_explicit(&global->n_remaining, 1,
-                                                     memory_order_acq_rel);
-    assert(n_remaining >= 1);
-
-    if (UNLIKELY(n_remaining == 1)) {
-        to_free = atomic_load_explicit(&global->to_free1, memory_order_acquire);
-        assert(to_free);
-
-        struct qsbr_entry *new_to_free1 =
-            atomic_load_explicit(&global->to_free2, memory_order_consume);
-        if (new_to_free1) {
-            while (!atomic_compare_exchange_weak_explicit(
-                &global->to_free2, &new_to_free1, NULL, memory_order_acquire,
-                memory_order_relaxed))
-                ;
-            assert(new_to_free1);
-            atomic_store_explicit(&global->to_free1, new_to_free1,
-                                  memory_order_relaxed);
-            atomic_store_explicit(&global->n_remaining, global->n_threads - 1,
-                                  memory_order_relaxed);
-            atomic_store_explicit(&global->epoch, epoch + 1,
-                                  memory_order_release);
-            epoch++;
-        } else {
-            atomic_store_explicit(&global->to_free1, NULL,
-                                  memory_order_relaxed);
-        }
-    }
-
-    local->epoch = epoch;
-    return to_free;
-}
+#include "qsbr.h"
 
 #include <stdalign.h>
 
 struct qsbr_queue_node {
-    struct qsbr_entry qsbr_entry;
     void *value;
     _Atomic(struct qsbr_queue_node *) next;
 };
@@ -182,18 +62,20 @@ static inline void qsbr_queue_fini(struct qsbr_queue *queue,
     *released_node = atomic_load_explicit(&queue->head, memory_order_relaxed);
 }
 
-static inline void qsbr_queue_push(struct qsbr_queue *queue,
-                                   struct qsbr_queue_node *node,
-                                   void *value)
+/* Push the nodes from @first to @last, already linked and holding their
+ * values, with a single CAS on the tail.
+ */
+static inline void qsbr_queue_push_chain(struct qsbr_queue *queue,
+                                         struct qsbr_queue_node *first,
+                                         struct qsbr_queue_node *last)
 {
-    node->value = value;
-    atomic_store_explicit(&node->next, NULL, memory_order_relaxed);
+    atomic_store_explicit(&last->next, NULL, memory_order_relaxed);
 
     struct qsbr_queue_node *tail =
         atomic_load_explicit(&queue->tail, memory_order_relaxed);
     for (;;) {
         struct qsbr_queue_node *next = NULL;
-        if (atomic_compare_exchange_weak_explicit(&tail->next, &next, node,
+        if (atomic_compare_exchange_weak_explicit(&tail->next, &next, first,
                                                   memory_order_release,
                                                   memory_order_relaxed))
             break;
@@ -201,7 +83,15 @@ static inline void qsbr_queue_push(struct qsbr_queue *queue,
                                               memory_order_relaxed,
                                               memory_order_relaxed);
     }
-    atomic_compare_exchange_strong(&queue->tail, &tail, node);
+    atomic_compare_exchange_strong(&queue->tail, &tail, last);
+}
+
+static inline void qsbr_queue_push(struct qsbr_queue *queue,
+                                   struct qsbr_queue_node *node,
+                                   void *value)
+{
+    node->value = value;
+    qsbr_queue_push_chain(queue, node, node);
 }
 
 static inline bool qsbr_queue_pop(struct qsbr_queue *queue,
@@ -227,6 +117,39 @@ static inline bool qsbr_queue_pop(struct qsbr_queue *queue,
     return true;
 }
 
+/* Pop up to @max values with a single CAS on the head, and return how many.
+ * As many nodes are released, from @released_node on through their next
+ * links, and go to QSBR like the one of qsbr_queue_pop().
+ */
+static inline size_t qsbr_queue_pop_bulk(struct qsbr_queue *queue,
+                                         struct qsbr_queue_node **released_node,
+                                         void **values,
+                                         size_t max)
+{
+    struct qsbr_queue_node *head =
+        atomic_load_explicit(&queue->head, memory_order_consume);
+    for (;;) {
+        struct qsbr_queue_node *last = head, *next;
+        size_t n = 0;
+
+        /* The nodes are not freed under us, whether we win the CAS or not */
+        while (n < max &&
+               (next = atomic_load_explicit(&last->next,
+                                            memory_order_acquire))) {
+            values[n++] = next->value;
+            last = next;
+        }
+        if (!n)
+            return 0;
+        if (atomic_compare_exchange_weak_explicit(&queue->head, &head, last,
+                                                  memory_order_acquire,
+                                                  memory_order_consume)) {
+            *released_node = head;
+            return n;
+        }
+    }
+}
+
 #include <errno.h>
 #include <pthread.h>
 
@@ -255,15 +178,90 @@ static inline bool qsbr_queue_pop(struct qsbr_queue *queue,
 #include <stddef.h>
 #include <stdio.h>
 
+#define BULK_MAX 32 /* values pushed or popped at once */
+
 static uint32_t n_workers, n_tries;
 static struct qsbr_queue queue;
 static atomic_uint barrier;
 static _Atomic uint64_t total_sum;
-static struct qsbr_global qsbr_global;
+static qsbr_t *qsbr;
+
+/* Node free list
+ *
+ * QSBR hands the retired nodes to the thread that reclaims them, which keeps
+ * them in its own list for its next pushes. Past FREE_LOCAL_MAX nodes, the
+ * list goes to a shared stack in a single CAS, and a thread out of free nodes
+ * takes the whole stack with a single exchange. Taking every node at once
+ * avoids the ABA problem of popping one node off a stack.
+ */
+#define FREE_LOCAL_MAX 256
+
+struct free_list {
+    struct qsbr_queue_node *first, *last;
+    size_t count;
+};
+
+static _Thread_local struct free_list free_local;
+static _Thread_local struct qsbr_queue_node *free_taken; /* from the stack */
+static _Atomic(struct qsbr_queue_node *) free_shared;
+
+static inline struct qsbr_queue_node *node_next(struct qsbr_queue_node *node)
+{
+    return atomic_load_explicit(&node->next, memory_order_relaxed);
+}
+
+static void free_list_push(struct qsbr_queue_node *node)
+{
+    struct free_list *l = &free_local;
+
+    atomic_store_explicit(&node->next, l->first, memory_order_relaxed);
+    if (!l->first)
+        l->last = node;
+    l->first = node;
+    l->count++;
+}
+
+static void free_list_flush(void)
+{
+    struct free_list *l = &free_local;
+    if (!l->first)
+        return;
+
+    struct qsbr_queue_node *top =
+        atomic_load_explicit(&free_shared, memory_order_relaxed);
+    do {
+        atomic_store_explicit(&l->last->next, top, memory_order_relaxed);
+    } while (!atomic_compare_exchange_weak_explicit(&free_shared, &top,
+                                                    l->first,
+                                                    memory_order_release,
+                                                    memory_order_relaxed));
+    l->first = l->last = NULL;
+    l->count = 0;
+}
 
 static struct qsbr_queue_node *alloc_node(void)
 {
-    struct qsbr_queue_node *node = wrap_malloc(sizeof(*node));
+    struct free_list *l = &free_local;
+    struct qsbr_queue_node *node;
+
+    if (LIKELY(l->first != NULL)) {
+        node = l->first;
+        if (!(l->first = node_next(node)))
+            l->last = NULL;
+        l->count--;
+        return node;
+    }
+
+    if (UNLIKELY(free_taken == NULL))
+        free_taken =
+            atomic_exchange_explicit(&free_shared, NULL, memory_order_acquire);
+    if (LIKELY(free_taken != NULL)) {
+        node = free_taken;
+        free_taken = node_next(node);
+        return node;
+    }
+
+    node = wrap_malloc(sizeof(*node));
     CHECK(node, "Allocating node failed");
 
     CHECK((uintptr_t) node % 8 == 0, "Bad alignment");
@@ -276,13 +274,35 @@ static void free_node(struct qsbr_queue_node *node)
     wrap_free(node);
 }
 
-static void free_qsbr_nodes(struct qsbr_entry *head)
+static void free_qsbr_node(void *ptr)
 {
-    while (head) {
-        struct qsbr_entry *next =
-            atomic_load_explicit(&head->next, memory_order_relaxed);
-        free_node(container_of(head, struct qsbr_queue_node, qsbr_entry));
-        head = next;
+    free_list_push(ptr);
+    if (free_local.count >= FREE_LOCAL_MAX)
+        free_list_flush();
+}
+
+/* Give the free nodes of the calling thread back to the shared stack */
+static void free_list_exit(void)
+{
+    while (free_taken) {
+        struct qsbr_queue_node *node = free_taken;
+        free_taken = node_next(node);
+        free_list_push(node);
+    }
+    free_list_flush();
+}
+
+/* Free every node of the shared stack, once the other threads exited */
+static void free_list_destroy(void)
+{
+    free_list_exit();
+
+    struct qsbr_queue_node *node =
+        atomic_exchange_explicit(&free_shared, NULL, memory_order_acquire);
+    while (node) {
+        struct qsbr_queue_node *next = node_next(node);
+        free_node(node);
+        node = next;
     }
 }
 
@@ -292,43 +312,65 @@ static void *worker(void *arg)
     uint32_t n_enqueue = 0, n_dequeue = 0;
     uint32_t r = (uint32_t)(uintptr_t) arg;
 
-    struct qsbr_local qsbr_local;
-    qsbr_init_local(&qsbr_local);
+    qsbr_tls_t *qsbr_local = qsbr_register(qsbr);
+    CHECK(qsbr_local, "Registering thread failed");
 
     /* Wait until all threads are created. */
     atomic_fetch_sub(&barrier, 1);
     while (atomic_load_explicit(&barrier, memory_order_acquire) > 0)
         ;
 
+    /* Every round, a coin flip picks single or bulk operations */
     while (n_enqueue < n_tries || n_dequeue < n_tries) {
         r = RANDOM_NEXT(r);
+        bool bulk = r & 1;
         uint32_t iters = r % 1024;
-        while (iters-- > 0 && n_enqueue < n_tries) {
-            struct qsbr_queue_node *node = alloc_node();
-            qsbr_queue_push(&queue, node, (void *) (uintptr_t)(n_enqueue + 1));
-            n_enqueue++;
+        while (iters > 0 && n_enqueue < n_tries) {
+            uint32_t n = bulk ? BULK_MAX : 1;
+            if (n > iters)
+                n = iters;
+            if (n > n_tries - n_enqueue)
+                n = n_tries - n_enqueue;
+
+            struct qsbr_queue_node *first = alloc_node(), *last = first;
+            first->value = (void *) (uintptr_t)(++n_enqueue);
+            for (uint32_t i = 1; i < n; i++) {
+                struct qsbr_queue_node *node = alloc_node();
+                node->value = (void *) (uintptr_t)(++n_enqueue);
+                atomic_store_explicit(&last->next, node, memory_order_relaxed);
+                last = node;
+            }
+            qsbr_queue_push_chain(&queue, first, last);
+            iters -= n;
         }
 
         r = RANDOM_NEXT(r);
         iters = r % 1024;
         while (iters-- > 0 && n_dequeue < n_tries) {
             struct qsbr_queue_node *node;
-            void *value;
-            bool popped = qsbr_queue_pop(&queue, &node, &value);
-            if (!popped)
-                continue;
-            if (n_workers == 1)
-                free_node(node);
+            void *values[BULK_MAX];
+            size_t n, max = BULK_MAX;
+            if (max > n_tries - n_dequeue)
+                max = n_tries - n_dequeue;
+
+            if (bulk)
+                n = qsbr_queue_pop_bulk(&queue, &node, values, max);
             else
-                qsbr_free(&qsbr_global, &qsbr_local, &node->qsbr_entry);
-            sum += (uint32_t)(uintptr_t) value;
-            n_dequeue++;
+                n = qsbr_queue_pop(&queue, &node, &values[0]);
+            for (size_t i = 0; i < n; i++) {
+                struct qsbr_queue_node *next = node_next(node);
+                qsbr_retire(qsbr_local, node, sizeof(*node), free_qsbr_node);
+                sum += (uint32_t)(uintptr_t) values[i];
+                node = next;
+            }
+            n_dequeue += n;
         }
 
-        struct qsbr_entry *to_free = qsbr_quiescent(&qsbr_global, &qsbr_local);
-        free_qsbr_nodes(to_free);
+        qsbr_checkpoint(qsbr_local);
     }
 
+    qsbr_unregister(qsbr_local);
+    free_list_exit();
     atomic_fetch_add(&total_sum, sum);
 
     return NULL;
@@ -348,7 +390,8 @@ int main(void)
         return 1;
     }
 
-    qsbr_init_global(&qsbr_global, n_workers);
+    qsbr = qsbr_create();
+    CHECK(qsbr, "Creating QSBR failed");
 
     struct qsbr_queue_node *node = alloc_node();
     qsbr_queue_init(&queue, node);
@@ -374,10 +417,8 @@ int main(void)
     qsbr_queue_fini(&queue, &node);
     free_node(node);
 
-    struct qsbr_entry *to_free1, *to_free2;
-    qsbr_fini_global(&qsbr_global, &to_free1, &to_free2);
-    free_qsbr_nodes(to_free1);
-    free_qsbr_nodes(to_free2);
+    qsbr_destroy(qsbr);
+    free_list_destroy();
 
     uint64_t expected_sum =
         ((uint64_t) n_tries * ((uint64_t) n_tries + 1) / 2) * n_workers;
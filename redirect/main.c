@@ -1,9 +1,12 @@
+#define _GNU_SOURCE
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <sys/epoll.h>
 
-#define EV_FOREACH(node, list) \
-    for (typeof(node) nxt, node = list; node && (nxt = node->next); node = nxt)
+#define EV_FOREACH(node, list)                                       \
+    for (typeof(node) nxt, node = list; node && (nxt = node->next, 1); \
+         node = nxt)
 
 #define EV_INSERT(node, list)                 \
     do {                                      \
@@ -40,6 +43,22 @@ typedef struct {
     int fd; /* For epoll() */
     struct ev *watchers;
     bool workaround; /* For workarounds, e.g. redirected stdin */
+
+    /* Batch of events filled by each epoll_wait() */
+    struct epoll_event *events;
+    int max_events;
+
+    /* All timer watchers share one timerfd, set to the first expiry of a
+     * binary heap ordered by expiry.
+     */
+    struct ev **timers;
+    int nr_timers, max_timers;
+    int timer_fd;
+    bool timer_dirty; /* The first expiry changed since the timerfd was set */
+
+    /* %EV_DRAIN watchers with I/O left to do */
+    struct ev *ready_head, *ready_tail;
+    int nr_ready;
 } ev_ctx_t;
 
 /* hide all private data members in ev_t */
@@ -57,9 +76,15 @@ typedef struct {
     union {                                                 \
         struct { /* Timer watchers, time in milliseconds */ \
             int timeout, period;                            \
+            int heap;        /* Index in the heap, or -1 */ \
+            uint64_t expiry; /* In ns of CLOCK_MONOTONIC */ \
         } t;                                                \
     } u;                                                    \
                                                             \
+    /* Pending events of an %EV_DRAIN watcher */            \
+    struct ev *rnext, *rprev;                               \
+    int ready;                                              \
+                                                            \
     /* Watcher type */                                      \
     ev_type_t
 
@@ -75,8 +100,11 @@ static int _ev_watcher_stop(struct ev *w);
 static bool _ev_watcher_active(struct ev *w);
 static int _ev_watcher_rearm(struct ev *w);
 
-/* Max number of simulateneous events */
-#define EV_MAX_EVENTS 10
+/* Default max number of simulateneous events, see ev_init_batch() */
+#define EV_MAX_EVENTS 64
+
+/* Rounds given to the ready %EV_DRAIN watchers between two polls */
+#define EV_DRAIN_ROUNDS 8
 
 /* I/O events and timer revents are always EV_READ */
 #define EV_ERROR EPOLLERR
@@ -88,6 +116,11 @@ static int _ev_watcher_rearm(struct ev *w);
 #define EV_EDGE EPOLLET
 #define EV_ONESHOT EPOLLONESHOT
 
+/* Edge-triggered, with the callback called again until the fd is drained,
+ * that is until ev_io_read() or ev_io_write() hit EAGAIN. Not given to epoll.
+ */
+#define EV_DRAIN (1 << 27)
+
 /* Run flags */
 enum { EV_ONCE = 1, EV_NONBLOCK = 2 };
 
@@ -112,6 +145,7 @@ typedef void(ev_cb_t)(ev_t *w, void *arg, int events);
 
 /* Public interface */
 int ev_init(ev_ctx_t *ctx);
+int ev_init_batch(ev_ctx_t *ctx, int max_events);
 int ev_exit(ev_ctx_t *ctx);
 int ev_run(ev_ctx_t *ctx, int flags);
 
@@ -119,6 +153,7 @@ int ev_io_start(ev_t *w);
 int ev_io_stop(ev_t *w);
 
 #include <errno.h>
+#include <sys/types.h>
 
 /* Create an I/O watcher
  * @param ctx     A valid EV context
@@ -127,7 +162,7 @@ int ev_io_stop(ev_t *w);
  * @param arg     Optional callback argument
  * @param fd      File descriptor to watch, or -1 to register an empty watcher
  * @param events  Events to watch for: %EV_READ, %EV_WRITE, %EV_EDGE,
- * %EV_ONESHOW
+ * %EV_ONESHOW, %EV_DRAIN
  *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
@@ -143,6 +178,9 @@ int ev_io_init(ev_ctx_t *ctx,
         return -1;
     }
 
+    if (events & EV_DRAIN)
+        events |= EV_EDGE;
+
     if (_ev_watcher_init(ctx, w, EV_IO_TYPE, cb, arg, fd, events))
         return -1;
 
@@ -188,19 +226,292 @@ int ev_io_stop(ev_t *w)
     return _ev_watcher_stop(w);
 }
 
-#include <sys/timerfd.h>
 #include <unistd.h>
 
-static inline void ms2ts(int ms, struct timespec *ts)
+static void _ev_ready_add(ev_t *w, int events)
+{
+    ev_ctx_t *ctx = w->ctx;
+
+    if (!w->ready) {
+        w->rnext = NULL, w->rprev = ctx->ready_tail;
+        if (ctx->ready_tail)
+            ctx->ready_tail->rnext = w;
+        else
+            ctx->ready_head = w;
+        ctx->ready_tail = w;
+        ctx->nr_ready++;
+    }
+    w->ready |= events;
+}
+
+static void _ev_ready_del(ev_t *w)
+{
+    ev_ctx_t *ctx = w->ctx;
+
+    if (!w->ready)
+        return;
+    if (w->rprev)
+        w->rprev->rnext = w->rnext;
+    else
+        ctx->ready_head = w->rnext;
+    if (w->rnext)
+        w->rnext->rprev = w->rprev;
+    else
+        ctx->ready_tail = w->rprev;
+    w->rnext = w->rprev = NULL;
+    w->ready = 0;
+    ctx->nr_ready--;
+}
+
+/* Done with some of the events of an %EV_DRAIN watcher */
+static void _ev_ready_clear(ev_t *w, int events)
 {
-    if (ms) /* millisecond */
-        ts->tv_sec = ms / 1000, ts->tv_nsec = (ms % 1000) * 1000000;
+    if (!(w->ready & ~events & (EV_READ | EV_WRITE)))
+        _ev_ready_del(w);
     else
-        ts->tv_sec = 0, ts->tv_nsec = 0;
+        w->ready &= ~events;
+}
+
+/* Read from the fd of an I/O watcher
+ * @param w    Watcher to read from
+ * @param buf  Buffer to read into
+ * @param len  Size of @param buf
+ *
+ * Required for %EV_DRAIN watchers, which are called again until this hits the
+ * end of file or EAGAIN.
+ *
+ * @return As read(2).
+ */
+ssize_t ev_io_read(ev_t *w, void *buf, size_t len)
+{
+    ssize_t n = read(w->fd, buf, len);
+    if (n == 0 || (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK)))
+        _ev_ready_clear(w, EV_READ | EV_PRI | EV_RDHUP);
+    return n;
+}
+
+/* Write to the fd of an I/O watcher
+ * @param w    Watcher to write to
+ * @param buf  Data to write
+ * @param len  Size of @param buf
+ *
+ * Required for %EV_DRAIN watchers, which are called again until this hits
+ * EAGAIN.
+ *
+ * @return As write(2).
+ */
+ssize_t ev_io_write(ev_t *w, const void *buf, size_t len)
+{
+    ssize_t n = write(w->fd, buf, len);
+    if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+        _ev_ready_clear(w, EV_WRITE);
+    return n;
+}
+
+/* Call each ready %EV_DRAIN watcher once per round, in turn. A watcher is
+ * moved to the tail before its callback, which is the last use of it, since
+ * the callback may delete it; those still ready after the last round are
+ * served again after the next poll.
+ */
+static void _ev_drain(ev_ctx_t *ctx)
+{
+    for (int round = 0; round < EV_DRAIN_ROUNDS; round++) {
+        for (int n = ctx->nr_ready; n > 0 && ctx->running; n--) {
+            ev_t *w = ctx->ready_head;
+            if (!w)
+                return;
+
+            int events = w->ready;
+            if (w != ctx->ready_tail) {
+                _ev_ready_del(w);
+                _ev_ready_add(w, events);
+            }
+            if (w->cb)
+                w->cb(w, w->arg, events & EV_EVENT_MASK);
+        }
+    }
+}
+
+#include <stdlib.h> /* realloc() */
+#include <sys/timerfd.h>
+#include <time.h>
+
+static uint64_t _ev_now(void)
+{
+    struct timespec ts;
+
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (uint64_t) ts.tv_sec * 1000000000 + ts.tv_nsec;
+}
+
+static void _ev_heap_set(ev_ctx_t *ctx, int i, ev_t *w)
+{
+    ctx->timers[i] = w;
+    w->u.t.heap = i;
+}
+
+static void _ev_heap_up(ev_ctx_t *ctx, int i)
+{
+    ev_t *w = ctx->timers[i];
+
+    while (i > 0) {
+        int parent = (i - 1) / 2;
+        if (ctx->timers[parent]->u.t.expiry <= w->u.t.expiry)
+            break;
+        _ev_heap_set(ctx, i, ctx->timers[parent]);
+        i = parent;
+    }
+    _ev_heap_set(ctx, i, w);
+}
+
+static void _ev_heap_down(ev_ctx_t *ctx, int i)
+{
+    ev_t *w = ctx->timers[i];
+
+    while (1) {
+        int child = 2 * i + 1;
+        if (child >= ctx->nr_timers)
+            break;
+        if (child + 1 < ctx->nr_timers &&
+            ctx->timers[child + 1]->u.t.expiry < ctx->timers[child]->u.t.expiry)
+            child++;
+        if (w->u.t.expiry <= ctx->timers[child]->u.t.expiry)
+            break;
+        _ev_heap_set(ctx, i, ctx->timers[child]);
+        i = child;
+    }
+    _ev_heap_set(ctx, i, w);
+}
+
+/* The timerfd is only created with the first armed timer */
+static int _ev_timer_open(ev_ctx_t *ctx)
+{
+    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (fd < 0)
+        return -1;
+
+    /* No watcher behind it, told apart by its NULL pointer */
+    struct epoll_event ev = {.events = EPOLLIN, .data.ptr = NULL};
+    if (epoll_ctl(ctx->fd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+        close(fd);
+        return -1;
+    }
+
+    ctx->timer_fd = fd;
+    return 0;
+}
+
+static int _ev_heap_push(ev_ctx_t *ctx, ev_t *w)
+{
+    if (ctx->timer_fd < 0 && _ev_timer_open(ctx))
+        return -1;
+
+    if (ctx->nr_timers == ctx->max_timers) {
+        int max = ctx->max_timers ? ctx->max_timers * 2 : 64;
+        ev_t **timers = realloc(ctx->timers, max * sizeof(ev_t *));
+        if (!timers)
+            return -1;
+        ctx->timers = timers, ctx->max_timers = max;
+    }
+
+    int i = ctx->nr_timers++;
+    ctx->timers[i] = w;
+    _ev_heap_up(ctx, i);
+    if (!w->u.t.heap)
+        ctx->timer_dirty = true;
+
+    return 0;
+}
+
+static void _ev_heap_del(ev_ctx_t *ctx, ev_t *w)
+{
+    int i = w->u.t.heap;
+    if (i < 0)
+        return;
+
+    w->u.t.heap = -1;
+    ev_t *last = ctx->timers[--ctx->nr_timers];
+    if (last != w) {
+        _ev_heap_set(ctx, i, last);
+        _ev_heap_up(ctx, i);
+        _ev_heap_down(ctx, last->u.t.heap);
+    }
+    if (!i)
+        ctx->timer_dirty = true;
+}
+
+/* Set the timerfd to the first expiry, once per loop at most */
+static int _ev_timer_rearm(ev_ctx_t *ctx)
+{
+    if (!ctx->timer_dirty || ctx->timer_fd < 0)
+        return 0;
+    ctx->timer_dirty = false;
+
+    struct itimerspec time = {{0, 0}, {0, 0}}; /* Disarms */
+    if (ctx->nr_timers) {
+        uint64_t expiry = ctx->timers[0]->u.t.expiry;
+        time.it_value.tv_sec = expiry / 1000000000;
+        time.it_value.tv_nsec = expiry % 1000000000;
+    }
+
+    return timerfd_settime(ctx->timer_fd, TFD_TIMER_ABSTIME, &time, NULL);
+}
+
+static int ev_timer_stop(ev_t *w);
+
+/* Call back the timers due, and requeue the periodic ones. Every callback is
+ * the last use of its watcher, which may be deleted by it.
+ */
+static void _ev_timer_expire(ev_ctx_t *ctx)
+{
+    uint64_t exp, now = _ev_now();
+
+    if (read(ctx->timer_fd, &exp, sizeof(exp)) < 0 && errno != EAGAIN)
+        return;
+    ctx->timer_dirty = true;
+
+    while (ctx->running && ctx->nr_timers &&
+           ctx->timers[0]->u.t.expiry <= now) {
+        ev_t *w = ctx->timers[0];
+
+        _ev_heap_del(ctx, w);
+        if (w->u.t.period) {
+            /* Overruns are folded into one expiry, as by timerfd */
+            uint64_t period = w->u.t.period * 1000000ULL;
+            w->u.t.expiry += period;
+            if (w->u.t.expiry <= now)
+                w->u.t.expiry = now + period;
+            _ev_heap_push(ctx, w); /* Does not fail, it just left */
+        } else {
+            w->u.t.timeout = 0;
+            ev_timer_stop(w);
+        }
+
+        if (w->cb)
+            w->cb(w, w->arg, EV_READ);
+    }
 }
 
 static int ev_timer_set(ev_t *w, int timeout, int period);
 
+/* Set up the timer in the heap if the event loop runs, it is added when it
+ * starts otherwise.
+ */
+static int _ev_timer_arm(ev_t *w, int timeout, int period)
+{
+    ev_ctx_t *ctx = w->ctx;
+
+    _ev_heap_del(ctx, w);
+    w->u.t.timeout = timeout, w->u.t.period = period;
+    if (ctx->running && timeout) {
+        w->u.t.expiry = _ev_now() + timeout * 1000000ULL;
+        if (_ev_heap_push(ctx, w))
+            return -1;
+    }
+
+    return _ev_watcher_start(w);
+}
+
 /* Create and start a timer watcher
  * @param ctx      A valid EV context
  * @param w        Pointer to an ev_t watcher
@@ -240,18 +551,13 @@ static int ev_timer_init(ev_ctx_t *ctx,
         return -1;
     }
 
-    int fd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
-    if (fd < 0)
+    /* Timers have no fd of their own */
+    if (_ev_watcher_init(ctx, w, EV_TIMER_TYPE, cb, arg, -1, EV_READ))
         return -1;
+    w->u.t.heap = -1;
 
-    if (_ev_watcher_init(ctx, w, EV_TIMER_TYPE, cb, arg, fd, EV_READ))
-        goto out;
-
-    if (ev_timer_set(w, timeout, period)) {
+    if (_ev_timer_arm(w, timeout, period)) {
         _ev_watcher_stop(w);
-    out:
-        close(fd);
-        w->fd = -1;
         return -1;
     }
 
@@ -266,8 +572,8 @@ static int ev_timer_init(ev_ctx_t *ctx,
  *                 timeout is reset to
  *
  * Note, the @param timeout value must be non-zero.  Setting it to zero will
- * disarm the timer.  This is the underlying Linux function @func
- * timerfd_settimer() which has this behavior.
+ * disarm the timer, as the underlying Linux function @func timerfd_settime()
+ * would.
  *
  * @return POSIX OK(0) or non-zero with @param errno set on error.
  */
@@ -284,25 +590,14 @@ static int ev_timer_set(ev_t *w, int timeout, int period)
         return -1;
     }
 
-    if (w->fd < 0) { /* Handle stopped timers */
+    if (!_ev_watcher_active(w)) { /* Handle stopped timers */
         if (!timeout && !period)
             return 0; /* Timer already stopped */
 
-        if (ev_timer_init(w->ctx, w, w->cb, w->arg, timeout, period))
-            return -1;
+        return ev_timer_init(w->ctx, w, w->cb, w->arg, timeout, period);
     }
 
-    w->u.t.timeout = timeout, w->u.t.period = period;
-
-    if (w->ctx->running) {
-        struct itimerspec time;
-
-        ms2ts(timeout, &time.it_value), ms2ts(period, &time.it_interval);
-        if (timerfd_settime(w->fd, 0, &time, NULL) < 0)
-            return 1;
-    }
-
-    return _ev_watcher_start(w);
+    return _ev_timer_arm(w, timeout, period);
 }
 
 /* Stop and unregister a timer watcher
@@ -315,13 +610,9 @@ static int ev_timer_stop(ev_t *w)
     if (!_ev_watcher_active(w))
         return 0;
 
-    if (_ev_watcher_stop(w))
-        return -1;
-
-    close(w->fd);
-    w->fd = -1;
+    _ev_heap_del(w->ctx, w);
 
-    return 0;
+    return _ev_watcher_stop(w);
 }
 
 #include <string.h> /* memset() */
@@ -376,13 +667,14 @@ static int _ev_watcher_init(ev_ctx_t *ctx,
     w->ctx = ctx, w->type = type, w->active = 0, w->fd = fd;
     w->cb = cb, w->arg = arg;
     w->events = events;
+    w->rnext = w->rprev = NULL, w->ready = 0;
 
     return 0;
 }
 
 static int _ev_watcher_start(ev_t *w)
 {
-    if (!w || w->fd < 0 || !w->ctx) {
+    if (!w || (w->fd < 0 && w->type != EV_TIMER_TYPE) || !w->ctx) {
         errno = EINVAL;
         return -1;
     }
@@ -390,7 +682,15 @@ static int _ev_watcher_start(ev_t *w)
     if (_ev_watcher_active(w))
         return 0;
 
-    struct epoll_event ev = {.events = w->events | EPOLLRDHUP, .data.ptr = w};
+    /* Timers live in the heap, not in epoll */
+    if (w->type == EV_TIMER_TYPE) {
+        w->active = 1;
+        EV_INSERT(w, w->ctx->watchers);
+        return 0;
+    }
+
+    struct epoll_event ev = {.events = (w->events & ~EV_DRAIN) | EPOLLRDHUP,
+                             .data.ptr = w};
     if (epoll_ctl(w->ctx->fd, EPOLL_CTL_ADD, w->fd, &ev) < 0) {
         if (errno != EPERM)
             return -1;
@@ -428,6 +728,10 @@ static int _ev_watcher_stop(ev_t *w)
     /* Remove from internal list */
     EV_REMOVE(w, w->ctx->watchers);
 
+    if (w->type == EV_TIMER_TYPE)
+        return 0;
+    _ev_ready_del(w);
+
     /* Remove from kernel */
     if (epoll_ctl(w->ctx->fd, EPOLL_CTL_DEL, w->fd, NULL) < 0)
         return -1;
@@ -447,7 +751,8 @@ static int _ev_watcher_rearm(ev_t *w)
         return -1;
     }
 
-    struct epoll_event ev = {.events = w->events | EPOLLRDHUP, .data.ptr = w};
+    struct epoll_event ev = {.events = (w->events & ~EV_DRAIN) | EPOLLRDHUP,
+                             .data.ptr = w};
     if (epoll_ctl(w->ctx->fd, EPOLL_CTL_MOD, w->fd, &ev) < 0)
         return -1;
 
@@ -465,13 +770,37 @@ static int _ev_watcher_rearm(ev_t *w)
  */
 int ev_init(ev_ctx_t *ctx)
 {
-    if (!ctx) {
+    return ev_init_batch(ctx, EV_MAX_EVENTS);
+}
+
+/* Create an event loop context, with the batch size of epoll_wait()
+ * @param ctx         Pointer to an ev_ctx_t context to be initialized
+ * @param max_events  Max number of events served per call to epoll_wait(),
+ *                    larger batches save system calls with many active fds
+ *
+ * @return POSIX OK(0) on success, or non-zero on error.
+ */
+int ev_init_batch(ev_ctx_t *ctx, int max_events)
+{
+    if (!ctx || max_events < 1) {
         errno = EINVAL;
         return -1;
     }
 
     memset(ctx, 0, sizeof(*ctx));
-    return _init(ctx, false);
+    ctx->timer_fd = -1;
+    ctx->max_events = max_events;
+    ctx->events = malloc(max_events * sizeof(struct epoll_event));
+    if (!ctx->events)
+        return -1;
+
+    if (_init(ctx, false)) {
+        free(ctx->events);
+        ctx->events = NULL;
+        return -1;
+    }
+
+    return 0;
 }
 
 /* Terminate the event loop
@@ -509,6 +838,14 @@ int ev_exit(ev_ctx_t *ctx)
         close(ctx->fd);
     ctx->fd = -1;
 
+    if (ctx->timer_fd > -1)
+        close(ctx->timer_fd);
+    ctx->timer_fd = -1;
+    free(ctx->timers);
+    ctx->timers = NULL, ctx->nr_timers = ctx->max_timers = 0;
+    free(ctx->events);
+    ctx->events = NULL;
+
     return 0;
 }
 
@@ -545,7 +882,7 @@ int ev_run(ev_ctx_t *ctx, int flags)
     }
 
     while (ctx->running && ctx->watchers) {
-        struct epoll_event ee[EV_MAX_EVENTS];
+        struct epoll_event *ee = ctx->events;
         int nfds, rerun = 0;
 
         /* Handle special case: "prog < file.txt" */
@@ -568,7 +905,14 @@ int ev_run(ev_ctx_t *ctx, int flags)
             continue;
         ctx->workaround = false;
 
-        while ((nfds = epoll_wait(ctx->fd, ee, EV_MAX_EVENTS, timeout)) < 0) {
+        if (_ev_timer_rearm(ctx)) {
+            ev_exit(ctx);
+            return -2;
+        }
+
+        /* Only poll for more while draining */
+        int wait = ctx->ready_head ? 0 : timeout;
+        while ((nfds = epoll_wait(ctx->fd, ee, ctx->max_events, wait)) < 0) {
             if (!ctx->running)
                 break;
 
@@ -582,28 +926,20 @@ int ev_run(ev_ctx_t *ctx, int flags)
         }
 
         for (int i = 0; ctx->running && i < nfds; i++) {
-            uint64_t exp;
-
             w = (ev_t *) ee[i].data.ptr;
             uint32_t events = ee[i].events;
 
-            switch (w->type) {
-            case EV_IO_TYPE:
-                if (events & (EPOLLHUP | EPOLLERR))
-                    ev_io_stop(w);
-                break;
-
-            case EV_TIMER_TYPE:
-                if (read(w->fd, &exp, sizeof(exp)) != sizeof(exp)) {
-                    ev_timer_stop(w);
-                    events = EV_ERROR;
-                }
+            /* The shared timerfd */
+            if (!w) {
+                _ev_timer_expire(ctx);
+                continue;
+            }
 
-                if (!w->u.t.period)
-                    w->u.t.timeout = 0;
-                if (!w->u.t.timeout)
-                    ev_timer_stop(w);
-                break;
+            if (events & (EPOLLHUP | EPOLLERR)) {
+                ev_io_stop(w);
+            } else if (w->events & EV_DRAIN) {
+                _ev_ready_add(w, events);
+                continue;
             }
 
             /* Must be last action for watcher, callback may delete itself */
@@ -611,6 +947,8 @@ int ev_run(ev_ctx_t *ctx, int flags)
                 w->cb(w, w->arg, events & EV_EVENT_MASK);
         }
 
+        _ev_drain(ctx);
+
         if (flags & EV_ONCE)
             break;
     }
@@ -621,15 +959,78 @@ int ev_run(ev_ctx_t *ctx, int flags)
 #include <err.h>
 #include <stdlib.h>
 
-static void process_stdin(ev_t *w, void *arg /* unused */, int events)
+#define FORWARD_CHUNK (64 * 1024)
+
+/* Forwarding of stdin to stdout, through a pipe with splice(2) so that the data
+ * stays in the kernel, or through a buffer once either side turned out not to
+ * support it.
+ */
+struct forward {
+    int pipe[2];
+    bool copy;
+};
+
+/* Write out all of "buf" */
+static bool write_all(int fd, const char *buf, ssize_t len)
+{
+    while (len > 0) {
+        ssize_t n = write(fd, buf, len);
+        if (n <= 0)
+            return false;
+        buf += n, len -= n;
+    }
+    return true;
+}
+
+/* Move "len" bytes from the pipe to stdout */
+static void forward_out(struct forward *fwd, ssize_t len)
+{
+    char buf[256];
+
+    while (len > 0 && !fwd->copy) {
+        ssize_t n = splice(fwd->pipe[0], NULL, STDOUT_FILENO, NULL, len,
+                           SPLICE_F_MOVE);
+        if (n == -1 && errno == EINVAL) {
+            fwd->copy = true;
+            break;
+        }
+        if (n <= 0) {
+            warn("Failed writing to stdout");
+            return;
+        }
+        len -= n;
+    }
+
+    /* Flush the rest of the pipe through the buffer */
+    while (len > 0) {
+        ssize_t n = read(fwd->pipe[0], buf, len < 256 ? len : 256);
+        if (n <= 0 || !write_all(STDOUT_FILENO, buf, n)) {
+            warn("Failed writing to stdout");
+            return;
+        }
+        len -= n;
+    }
+}
+
+static void process_stdin(ev_t *w, void *arg, int events)
 {
+    struct forward *fwd = arg;
+
     if (events == EV_ERROR) {
         warnx("Spurious problem with the stdin watcher, restarting.");
         ev_io_start(w);
     }
 
     char buf[256];
-    int len = read(w->fd, buf, sizeof(buf));
+    ssize_t len = -1;
+    if (!fwd->copy) {
+        len = splice(w->fd, NULL, fwd->pipe[1], NULL, FORWARD_CHUNK,
+                     SPLICE_F_MOVE);
+        if (len == -1 && errno == EINVAL)
+            fwd->copy = true;
+    }
+    if (fwd->copy)
+        len = read(w->fd, buf, sizeof(buf));
     if (len == -1) {
         warn("Error reading from stdin");
         return;
@@ -638,18 +1039,89 @@ static void process_stdin(ev_t *w, void *arg /* unused */, int events)
     if (len == 0 || EV_HUP == events) /* Ignore */
         return;
 
-    printf("Read %d bytes\n", len);
-    if (write(STDOUT_FILENO, buf, len) != len)
+    printf("Read %zd bytes\n", len);
+    if (!fwd->copy)
+        forward_out(fwd, len);
+    else if (!write_all(STDOUT_FILENO, buf, len))
         warn("Failed writing to stdout");
 }
 
-int main(void)
+static void count_timer(ev_t *w, void *arg, int events)
+{
+    (void) w, (void) events;
+    (*(long *) arg)++;
+}
+
+static void stop_loop(ev_t *w, void *arg, int events)
+{
+    (void) arg, (void) events;
+    ev_exit(w->ctx);
+}
+
+/* Run "n" periodic timers for a second, on the single timerfd */
+static int run_timers(int n, int batch)
 {
     ev_ctx_t ctx;
-    ev_init(&ctx);
+    if (ev_init_batch(&ctx, batch))
+        err(errno, "Failed creating the event loop");
+
+    ev_t *timers = calloc(n + 1, sizeof(ev_t));
+    long fired = 0;
+    if (!timers)
+        err(errno, "Failed allocating %d timers", n);
+
+    for (int i = 0; i < n; i++) {
+        int period = 1 + i % 100;
+        if (ev_timer_init(&ctx, &timers[i], count_timer, &fired, period,
+                          period))
+            err(errno, "Failed setting up timer %d", i);
+    }
+    if (ev_timer_init(&ctx, &timers[n], stop_loop, NULL, 1000, 0))
+        err(errno, "Failed setting up the stop timer");
+
+    int ret = ev_run(&ctx, 0);
+    printf("%d timers fired %ld times in 1 s\n", n, fired);
+    free(timers);
+    return ret;
+}
+
+/* Usage: redirect [-b batch] [-t timers]
+ *
+ * Copies stdin to stdout, or with -t, runs that many periodic timers.
+ */
+int main(int argc, char *argv[])
+{
+    int opt, batch = EV_MAX_EVENTS, n_timers = 0;
+
+    while ((opt = getopt(argc, argv, "b:t:")) != -1) {
+        switch (opt) {
+        case 'b':
+            batch = atoi(optarg);
+            break;
+        case 't':
+            n_timers = atoi(optarg);
+            break;
+        default:
+            return 1;
+        }
+    }
+
+    if (n_timers > 0)
+        return run_timers(n_timers, batch);
 
     ev_t watcher;
-    if (ev_io_init(&ctx, &watcher, process_stdin, NULL, STDIN_FILENO, EV_READ))
+    ev_ctx_t ctx;
+    if (ev_init_batch(&ctx, batch))
+        err(errno, "Failed creating the event loop");
+
+    struct forward fwd = {.copy = false};
+    /* Blocking, as stdout: splicing between pipes does not block if either
+     * one is O_NONBLOCK.
+     */
+    if (pipe2(fwd.pipe, O_CLOEXEC))
+        fwd.copy = true;
+
+    if (ev_io_init(&ctx, &watcher, process_stdin, &fwd, STDIN_FILENO, EV_READ))
         err(errno, "Failed setting up STDIN watcher");
 
     return ev_run(&ctx, 0);
@@ -7,9 +7,33 @@
  * The resulting string must be released using refcnt_unref since refcnt_strdup
  * function utilizes refcnt_malloc.
  *
+ * refcnt_malloc_kind and refcnt_strdup_kind pick how the references are
+ * counted, and the other functions work the same on every kind:
+ *
+ * - REFCNT_ATOMIC, the default, is a single atomic counter.
+ * - REFCNT_BIASED objects are owned by the thread that allocated them, which
+ *   counts its references without atomics, while the other threads share an
+ *   atomic counter. A thread that brings the shared counter below zero hands
+ *   the object to the owner, which merges both counters on its next
+ *   refcnt_flush, or allocation or release of a biased object, and at exit.
+ * - REFCNT_SHARDED objects count the references on per-CPU counters, and are
+ *   never freed until refcnt_kill drops the reference of the creator and
+ *   switches them to a single atomic counter. This suits hot objects that
+ *   live about as long as the program.
+ *
  * This implementation is thread-safe with the exception of refcnt_realloc. If
  * you need to use refcnt_realloc in a multi-threaded environment, you must
- * synchronize access to the reference.
+ * synchronize access to the reference. A biased object may only be
+ * reallocated by its owner, or once the owner exited.
+ *
+ * refcnt_weak takes a weak reference to an atomic object, which keeps its
+ * memory but not the object: refcnt_weak_upgrade returns a strong reference,
+ * or NULL once the last one was dropped.
+ *
+ * refcnt_release_buffer(true) makes the final releases of the calling thread
+ * go into a buffer, released by batches or by refcnt_release_flush, and
+ * recycles the freed blocks in pools of size classes for the allocations of
+ * that thread.
  *
  * If you define REFCNT_CHECK, references passed into refcnt_ref and and
  * refcnt_unref will be checked that they were created by refcnt_malloc. This is
@@ -20,24 +44,100 @@
  * debugging memory leaks or use after free errors.
  */
 
+#define _GNU_SOURCE
+
 #include <assert.h>
+#include <limits.h>
+#include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <stdbool.h>
 #include <stddef.h>
 #include <stdlib.h>
 #include <string.h>
+#include <unistd.h>
 
 #define REFCNT_CHECK
 
 #define maybe_unused __attribute__((unused))
 
+typedef enum {
+    REFCNT_ATOMIC,
+    REFCNT_BIASED,
+    REFCNT_SHARDED,
+} refcnt_kind_t;
+
+#define REFCNT_MAX_SHARDS 64
+
 typedef struct {
+    atomic_long count;
+} __attribute__((aligned(64))) refcnt_shard_t;
+
+struct refcnt_queue;
+
+typedef struct refcnt {
 #ifdef REFCNT_CHECK
     int magic;
 #endif
-    atomic_uint refcount;
+    refcnt_kind_t kind;
+    unsigned char size_class; /* of the pool the block goes back to, or 0 */
+    union {
+        struct {
+            atomic_uint count;
+            atomic_uint weak; /* plus one for the strong references */
+        } atomic;
+        struct {
+            struct refcnt_queue *owner;
+            struct refcnt *next; /* in the queue of the owner */
+            unsigned long count; /* of the owner, which alone touches it */
+            atomic_long shared;
+        } biased;
+        struct {
+            refcnt_shard_t *shards;
+            unsigned int n_shards;
+            atomic_long central;
+        } sharded;
+        struct refcnt *pool_next; /* once released to a pool */
+    };
     char data[];
 } refcnt_t;
 
+/* The shared counter of a biased object, and the central counter of a sharded
+ * one, count in units of REFCNT_ONE with flags in the low bits:
+ * - REFCNT_MERGED: the owner no longer counts, the count is all in "shared".
+ * - REFCNT_QUEUED: the object is in the queue of its owner.
+ * - REFCNT_KILLED: the shards are frozen, the count is all in "central".
+ */
+#define REFCNT_MERGED 1L
+#define REFCNT_QUEUED 2L
+#define REFCNT_KILLED 1L
+#define REFCNT_ONE 4L
+#define REFCNT_NO_REF(v) (((v) & ~(REFCNT_ONE - 1)) == 0)
+
+/* A shard that was folded into the central counter */
+#define REFCNT_FROZEN LONG_MIN
+
+/* A weak reference keeps the memory of an atomic object, not the object */
+typedef struct refcnt refcnt_weak_t;
+
+/* The release buffer of a thread defers the final releases by batches, and
+ * recycles the blocks of up to REFCNT_POOL_MAX objects of each size class.
+ * The classes are powers of two, up to REFCNT_CLASS_SIZE(REFCNT_N_CLASSES - 1)
+ * bytes with the header.
+ */
+#define REFCNT_RELEASE_BATCH 64
+#define REFCNT_N_CLASSES 9
+#define REFCNT_CLASS_SIZE(c) (16UL << (c))
+#define REFCNT_POOL_MAX 1024
+
+typedef struct {
+    bool buffered, registered;
+    unsigned int n_pending;
+    refcnt_t *pending[REFCNT_RELEASE_BATCH];
+    refcnt_t *pool[REFCNT_N_CLASSES];
+    unsigned int n_pooled[REFCNT_N_CLASSES];
+} refcnt_local_t;
+
 #ifdef REFCNT_TRACE
 #define _REFCNT_TRACE(call)                                                \
     ({                                                                     \
@@ -46,87 +146,526 @@ typedef struct {
         call;                                                              \
     })
 #define refcnt_malloc refcnt_t_malloc
+#define refcnt_malloc_kind refcnt_t_malloc_kind
 #define refcnt_realloc refcnt_t_realloc
 #define refcnt_ref refcnt_t_ref
 #define refcnt_unref refcnt_t_unref
 #define refcnt_strdup refcnt_t_strdup
+#define refcnt_strdup_kind refcnt_t_strdup_kind
 #endif
 
 #define REFCNT_MAGIC 0xDEADBEEF
 
-static maybe_unused void *refcnt_malloc(size_t len)
+/* Objects handed to their owner by other threads, as a stack, or DEAD once
+ * the owner exited.
+ */
+struct refcnt_queue {
+    refcnt_t *_Atomic head;
+    atomic_uint refs; /* the owner, and its objects that are not merged */
+};
+
+#define REFCNT_QUEUE_DEAD ((refcnt_t *) 1)
+
+static __thread struct refcnt_queue *refcnt_self;
+static __thread refcnt_local_t refcnt_local;
+static pthread_key_t refcnt_key;
+static pthread_once_t refcnt_once = PTHREAD_ONCE_INIT;
+
+static inline refcnt_t *refcnt_header(void *ptr)
+{
+    refcnt_t *ref = (void *) (ptr - offsetof(refcnt_t, data));
+#ifdef REFCNT_CHECK
+    assert(ref->magic == REFCNT_MAGIC && "Invalid refcnt pointer");
+#endif
+    return ref;
+}
+
+/* Allocate from the pool of the size class if the thread has a release
+ * buffer, and round the block up to the size class so that it can go back to
+ * a pool.
+ */
+static refcnt_t *refcnt_alloc(size_t len)
+{
+    refcnt_local_t *local = &refcnt_local;
+    size_t size = sizeof(refcnt_t) + len;
+    unsigned int c = 0;
+    refcnt_t *ref;
+
+    if (local->buffered && size <= REFCNT_CLASS_SIZE(REFCNT_N_CLASSES - 1)) {
+        for (c = 1; REFCNT_CLASS_SIZE(c) < size; c++)
+            ;
+        if ((ref = local->pool[c])) {
+            local->pool[c] = ref->pool_next;
+            local->n_pooled[c]--;
+            return ref;
+        }
+        size = REFCNT_CLASS_SIZE(c);
+    }
+    if ((ref = malloc(size)))
+        ref->size_class = c;
+    return ref;
+}
+
+static void refcnt_destroy(refcnt_t *ref)
+{
+    refcnt_local_t *local = &refcnt_local;
+    unsigned int c = ref->size_class;
+
+    if (ref->kind == REFCNT_SHARDED)
+        free(ref->sharded.shards);
+    if (c && local->buffered && local->n_pooled[c] < REFCNT_POOL_MAX) {
+#ifdef REFCNT_CHECK
+        ref->magic = 0;
+#endif
+        ref->pool_next = local->pool[c];
+        local->pool[c] = ref;
+        local->n_pooled[c]++;
+        return;
+    }
+    free(ref);
+}
+
+/* Release the objects deferred by the release buffer of this thread */
+static maybe_unused void refcnt_release_flush(void)
+{
+    refcnt_local_t *local = &refcnt_local;
+
+    for (unsigned int i = 0; i < local->n_pending; i++)
+        refcnt_destroy(local->pending[i]);
+    local->n_pending = 0;
+}
+
+static void refcnt_free(refcnt_t *ref)
+{
+    refcnt_local_t *local = &refcnt_local;
+
+    if (!local->buffered) {
+        refcnt_destroy(ref);
+        return;
+    }
+    local->pending[local->n_pending++] = ref;
+    if (local->n_pending == REFCNT_RELEASE_BATCH)
+        refcnt_release_flush();
+}
+
+static void refcnt_thread_register(void);
+
+/* Start or stop deferring the final releases of this thread, which also
+ * empties its pools when stopping. The buffer is stopped at thread exit.
+ */
+static maybe_unused void refcnt_release_buffer(bool enable)
+{
+    refcnt_local_t *local = &refcnt_local;
+
+    if (enable) {
+        refcnt_thread_register();
+        local->buffered = true;
+        return;
+    }
+    refcnt_release_flush();
+    local->buffered = false;
+    for (unsigned int c = 1; c < REFCNT_N_CLASSES; c++) {
+        while (local->pool[c]) {
+            refcnt_t *ref = local->pool[c];
+            local->pool[c] = ref->pool_next;
+            free(ref);
+        }
+        local->n_pooled[c] = 0;
+    }
+}
+
+static void refcnt_queue_put(struct refcnt_queue *q)
+{
+    if (atomic_fetch_sub_explicit(&q->refs, 1, memory_order_acq_rel) == 1)
+        free(q);
+}
+
+/* Move the count of the owner into the shared counter, and clear "flags".
+ * The caller has exclusive access to the count of the owner: it is the owner,
+ * or the owner exited. Return true if no reference is left.
+ */
+static bool refcnt_merge(refcnt_t *ref, long flags)
+{
+    long shared = atomic_load_explicit(&ref->biased.shared,
+                                       memory_order_relaxed);
+    bool merged = shared & REFCNT_MERGED;
+    long delta = -flags;
+
+    if (!merged) {
+        delta += ref->biased.count * REFCNT_ONE + REFCNT_MERGED;
+        ref->biased.count = 0;
+    }
+    shared = atomic_fetch_add_explicit(&ref->biased.shared, delta,
+                                       memory_order_acq_rel) +
+             delta;
+    if (!merged)
+        refcnt_queue_put(ref->biased.owner);
+    return REFCNT_NO_REF(shared) && !(shared & REFCNT_QUEUED);
+}
+
+static void refcnt_merge_queue(refcnt_t *ref)
+{
+    while (ref) {
+        refcnt_t *next = ref->biased.next;
+        if (refcnt_merge(ref, REFCNT_QUEUED))
+            refcnt_free(ref);
+        ref = next;
+    }
+}
+
+/* Merge the objects that other threads handed to this one */
+static maybe_unused void refcnt_flush(void)
+{
+    struct refcnt_queue *q = refcnt_self;
+
+    if (!q || !atomic_load_explicit(&q->head, memory_order_relaxed))
+        return;
+    refcnt_merge_queue(
+        atomic_exchange_explicit(&q->head, NULL, memory_order_acquire));
+}
+
+/* From then on, the threads that would hand an object over merge it */
+static void refcnt_thread_exit(void *arg)
+{
+    struct refcnt_queue *q = refcnt_self;
+
+    (void) arg;
+    if (q) {
+        refcnt_merge_queue(atomic_exchange_explicit(
+            &q->head, REFCNT_QUEUE_DEAD, memory_order_acq_rel));
+        refcnt_self = NULL;
+        refcnt_queue_put(q);
+    }
+    refcnt_release_buffer(false);
+}
+
+static void refcnt_key_init(void)
+{
+    pthread_key_create(&refcnt_key, refcnt_thread_exit);
+}
+
+/* Have refcnt_thread_exit() called when this thread exits */
+static void refcnt_thread_register(void)
+{
+    refcnt_local_t *local = &refcnt_local;
+
+    if (local->registered)
+        return;
+    pthread_once(&refcnt_once, refcnt_key_init);
+    local->registered = !pthread_setspecific(refcnt_key, local);
+}
+
+static struct refcnt_queue *refcnt_queue_self(void)
+{
+    struct refcnt_queue *q = refcnt_self;
+
+    if (q)
+        return q;
+    refcnt_thread_register();
+    if (!refcnt_local.registered ||
+        !(q = malloc(sizeof(struct refcnt_queue))))
+        return NULL;
+    atomic_init(&q->head, NULL);
+    atomic_init(&q->refs, 1);
+    return refcnt_self = q;
+}
+
+static void refcnt_enqueue(refcnt_t *ref)
+{
+    struct refcnt_queue *q = ref->biased.owner;
+    refcnt_t *head = atomic_load_explicit(&q->head, memory_order_acquire);
+
+    do {
+        /* Synchronized with the exit of the owner, merge in its place */
+        if (head == REFCNT_QUEUE_DEAD) {
+            if (refcnt_merge(ref, REFCNT_QUEUED))
+                refcnt_free(ref);
+            return;
+        }
+        ref->biased.next = head;
+    } while (!atomic_compare_exchange_weak_explicit(&q->head, &head, ref,
+                                                    memory_order_release,
+                                                    memory_order_acquire));
+}
+
+static inline bool refcnt_is_owner(refcnt_t *ref)
+{
+    return ref->biased.owner == refcnt_self &&
+           !(atomic_load_explicit(&ref->biased.shared, memory_order_relaxed) &
+             REFCNT_MERGED);
+}
+
+static void refcnt_biased_unref(refcnt_t *ref)
+{
+    if (refcnt_is_owner(ref)) {
+        if (--ref->biased.count == 0 && refcnt_merge(ref, 0))
+            refcnt_free(ref);
+        refcnt_flush();
+        return;
+    }
+
+    /* The first to go below zero hands the object to the owner, which holds
+     * the references that are missing.
+     */
+    long old = atomic_load_explicit(&ref->biased.shared, memory_order_relaxed);
+    long new;
+    do {
+        new = old - REFCNT_ONE;
+        if (new < 0)
+            new |= REFCNT_QUEUED;
+    } while (!atomic_compare_exchange_weak_explicit(&ref->biased.shared, &old,
+                                                    new, memory_order_acq_rel,
+                                                    memory_order_relaxed));
+    if ((new & REFCNT_QUEUED) && !(old & REFCNT_QUEUED))
+        refcnt_enqueue(ref);
+    else if ((new & REFCNT_MERGED) && !(new & REFCNT_QUEUED) &&
+             REFCNT_NO_REF(new))
+        refcnt_free(ref);
+}
+
+/* Add "delta" to the shard of the current CPU, unless it is frozen */
+static bool refcnt_shard_add(refcnt_t *ref, long delta)
+{
+    int cpu = sched_getcpu();
+    atomic_long *count =
+        &ref->sharded.shards[(cpu < 0 ? 0 : cpu) % ref->sharded.n_shards]
+             .count;
+    long v = atomic_load_explicit(count, memory_order_relaxed);
+
+    do {
+        if (v == REFCNT_FROZEN)
+            return false;
+    } while (!atomic_compare_exchange_weak_explicit(
+        count, &v, v + delta, memory_order_release, memory_order_relaxed));
+    return true;
+}
+
+static bool refcnt_sharded_init(refcnt_t *ref)
 {
-    refcnt_t *ref = malloc(sizeof(refcnt_t) + len);
+    long n = sysconf(_SC_NPROCESSORS_CONF);
+
+    n = n < 1 ? 1 : n > REFCNT_MAX_SHARDS ? REFCNT_MAX_SHARDS : n;
+    ref->sharded.shards = aligned_alloc(64, n * sizeof(refcnt_shard_t));
+    if (!ref->sharded.shards)
+        return false;
+    for (long i = 0; i < n; i++)
+        atomic_init(&ref->sharded.shards[i].count, 0);
+    ref->sharded.n_shards = n;
+    atomic_init(&ref->sharded.central, REFCNT_ONE);
+    return true;
+}
+
+/* Drop a weak reference, or the one of all the strong references. Without a
+ * weak reference left, none can be taken, so the atomic is only needed when
+ * there are some.
+ */
+static void refcnt_weak_put(refcnt_t *ref)
+{
+    if (atomic_load_explicit(&ref->atomic.weak, memory_order_acquire) == 1 ||
+        atomic_fetch_sub_explicit(&ref->atomic.weak, 1,
+                                  memory_order_acq_rel) == 1)
+        refcnt_free(ref);
+}
+
+static maybe_unused void *refcnt_malloc_kind(size_t len, refcnt_kind_t kind)
+{
+    refcnt_t *ref = refcnt_alloc(len);
     if (!ref)
         return NULL;
 #ifdef REFCNT_CHECK
     ref->magic = REFCNT_MAGIC;
 #endif
-    atomic_init(&ref->refcount, 1);
+    ref->kind = kind;
+    switch (kind) {
+    case REFCNT_BIASED:
+        refcnt_flush();
+        if ((ref->biased.owner = refcnt_queue_self())) {
+            atomic_fetch_add_explicit(&ref->biased.owner->refs, 1,
+                                      memory_order_relaxed);
+            ref->biased.count = 1;
+            atomic_init(&ref->biased.shared, 0);
+            break;
+        }
+        /* Fall back to the default without a queue */
+        ref->kind = REFCNT_ATOMIC;
+        /* fallthrough */
+    case REFCNT_ATOMIC:
+        atomic_init(&ref->atomic.count, 1);
+        atomic_init(&ref->atomic.weak, 1);
+        break;
+    case REFCNT_SHARDED:
+        if (!refcnt_sharded_init(ref)) {
+            ref->kind = REFCNT_ATOMIC;
+            refcnt_destroy(ref);
+            return NULL;
+        }
+        break;
+    }
     return ref->data;
 }
 
+static maybe_unused void *refcnt_malloc(size_t len)
+{
+    return refcnt_malloc_kind(len, REFCNT_ATOMIC);
+}
+
 static maybe_unused void *refcnt_realloc(void *ptr, size_t len)
 {
-    refcnt_t *ref = (void *) (ptr - offsetof(refcnt_t, data));
-#ifdef REFCNT_CHECK
-    assert(ref->magic == REFCNT_MAGIC);
-#endif
+    refcnt_t *ref = refcnt_header(ptr);
+
+    /* A biased object must not be queued, as it moves. The owner merges its
+     * queue first, and another thread may merge for an owner that exited.
+     */
+    if (ref->kind == REFCNT_BIASED) {
+        if (ref->biased.owner == refcnt_self)
+            refcnt_flush();
+        else if (!(atomic_load(&ref->biased.shared) & REFCNT_MERGED)) {
+            assert(atomic_load(&ref->biased.owner->head) ==
+                       REFCNT_QUEUE_DEAD &&
+                   "Biased refcnt reallocated by another thread");
+            (void) refcnt_merge(ref, 0);
+        }
+    }
+    /* The block no longer fits its size class */
     ref = realloc(ref, sizeof(refcnt_t) + len);
     if (!ref)
         return NULL;
+    ref->size_class = 0;
     return ref->data;
 }
 
 static maybe_unused void *refcnt_ref(void *ptr)
 {
-    refcnt_t *ref = (void *) (ptr - offsetof(refcnt_t, data));
-#ifdef REFCNT_CHECK
-    assert(ref->magic == REFCNT_MAGIC && "Invalid refcnt pointer");
-#endif
-    atomic_fetch_add(&ref->refcount, 1);
+    refcnt_t *ref = refcnt_header(ptr);
+
+    switch (ref->kind) {
+    case REFCNT_ATOMIC:
+        atomic_fetch_add(&ref->atomic.count, 1);
+        break;
+    case REFCNT_BIASED:
+        if (refcnt_is_owner(ref))
+            ref->biased.count++;
+        else
+            atomic_fetch_add_explicit(&ref->biased.shared, REFCNT_ONE,
+                                      memory_order_relaxed);
+        break;
+    case REFCNT_SHARDED:
+        if (!refcnt_shard_add(ref, 1))
+            atomic_fetch_add_explicit(&ref->sharded.central, REFCNT_ONE,
+                                      memory_order_relaxed);
+        break;
+    }
     return ref->data;
 }
 
 static maybe_unused void refcnt_unref(void *ptr)
 {
-    refcnt_t *ref = (void *) (ptr - offsetof(refcnt_t, data));
-#ifdef REFCNT_CHECK
-    assert(ref->magic == REFCNT_MAGIC && "Invalid refcnt pointer");
-#endif
-    if (atomic_fetch_sub(&ref->refcount, 1) == 1)
-        free(ref);
+    refcnt_t *ref = refcnt_header(ptr);
+
+    switch (ref->kind) {
+    case REFCNT_ATOMIC:
+        if (atomic_fetch_sub(&ref->atomic.count, 1) == 1)
+            refcnt_weak_put(ref);
+        break;
+    case REFCNT_BIASED:
+        refcnt_biased_unref(ref);
+        break;
+    case REFCNT_SHARDED:
+        if (!refcnt_shard_add(ref, -1) &&
+            atomic_fetch_sub_explicit(&ref->sharded.central, REFCNT_ONE,
+                                      memory_order_acq_rel) ==
+                REFCNT_ONE + REFCNT_KILLED)
+            refcnt_free(ref);
+        break;
+    }
 }
 
-static maybe_unused char *refcnt_strdup(char *str)
+/* Drop the reference of the creator of a sharded object. The shards are
+ * folded into the central counter, which from then on counts every reference
+ * and frees the object once none is left.
+ */
+static maybe_unused void refcnt_kill(void *ptr)
 {
-    refcnt_t *ref = malloc(sizeof(refcnt_t) + strlen(str) + 1);
-    if (!ref)
+    refcnt_t *ref = refcnt_header(ptr);
+    long sum = 0;
+
+    assert(ref->kind == REFCNT_SHARDED);
+    for (unsigned int i = 0; i < ref->sharded.n_shards; i++)
+        sum += atomic_exchange_explicit(&ref->sharded.shards[i].count,
+                                        REFCNT_FROZEN, memory_order_acquire);
+
+    long delta = (sum - 1) * REFCNT_ONE + REFCNT_KILLED;
+    if (atomic_fetch_add_explicit(&ref->sharded.central, delta,
+                                  memory_order_acq_rel) +
+            delta ==
+        REFCNT_KILLED)
+        refcnt_free(ref);
+}
+
+/* Take a weak reference to an atomic object, from a strong one */
+static maybe_unused refcnt_weak_t *refcnt_weak(void *ptr)
+{
+    refcnt_t *ref = refcnt_header(ptr);
+
+    assert(ref->kind == REFCNT_ATOMIC && "Weak reference to a non-atomic");
+    atomic_fetch_add_explicit(&ref->atomic.weak, 1, memory_order_relaxed);
+    return ref;
+}
+
+/* Return a strong reference, or NULL once the last one was dropped */
+static maybe_unused void *refcnt_weak_upgrade(refcnt_weak_t *weak)
+{
+    unsigned int n =
+        atomic_load_explicit(&weak->atomic.count, memory_order_relaxed);
+
+    do {
+        if (!n)
+            return NULL;
+    } while (!atomic_compare_exchange_weak_explicit(
+        &weak->atomic.count, &n, n + 1, memory_order_acquire,
+        memory_order_relaxed));
+    return weak->data;
+}
+
+static maybe_unused void refcnt_weak_unref(refcnt_weak_t *weak)
+{
+    refcnt_weak_put(weak);
+}
+
+static maybe_unused char *refcnt_strdup_kind(char *str, refcnt_kind_t kind)
+{
+    char *data = refcnt_malloc_kind(strlen(str) + 1, kind);
+    if (!data)
         return NULL;
-#ifdef REFCNT_CHECK
-    ref->magic = REFCNT_MAGIC;
-#endif
-    atomic_init(&ref->refcount, 1);
-    strcpy(ref->data, str);
-    return ref->data;
+    strcpy(data, str);
+    return data;
+}
+
+static maybe_unused char *refcnt_strdup(char *str)
+{
+    return refcnt_strdup_kind(str, REFCNT_ATOMIC);
 }
 
 #ifdef REFCNT_TRACE
 #undef refcnt_malloc
+#undef refcnt_malloc_kind
 #undef refcnt_realloc
 #undef refcnt_ref
 #undef refcnt_unref
 #undef refcnt_strdup
+#undef refcnt_strdup_kind
 #define refcnt_malloc(len) _REFCNT_TRACE(refcnt_t_malloc(len))
+#define refcnt_malloc_kind(len, kind) \
+    _REFCNT_TRACE(refcnt_t_malloc_kind(len, kind))
 #define refcnt_realloc(ptr, len) _REFCNT_TRACE(refcnt_t_realloc(ptr, len))
 #define refcnt_ref(ptr) _REFCNT_TRACE(refcnt_t_ref(ptr))
 #define refcnt_unref(ptr) _REFCNT_TRACE(refcnt_t_unref(ptr))
 #define refcnt_strdup(ptr) _REFCNT_TRACE(refcnt_t_strdup(ptr))
+#define refcnt_strdup_kind(ptr, kind) \
+    _REFCNT_TRACE(refcnt_t_strdup_kind(ptr, kind))
 #endif
 
-#include <pthread.h>
 #include <stdio.h>
-#include <stdlib.h>
 
 #define N_ITERATIONS 100
 
@@ -145,6 +684,138 @@ static void *test_thread(void *arg)
 
 #define N_THREADS 64
 
+/* Take and drop many references to an object of another kind than atomic,
+ * then drop the one passed by the creator.
+ */
+static void *test_kind_thread(void *arg)
+{
+    char *str = arg;
+    char *refs[N_ITERATIONS];
+
+    for (int i = 0; i < N_ITERATIONS; i++)
+        refs[i] = refcnt_ref(str);
+    for (int i = 0; i < N_ITERATIONS; i++) {
+        assert(!strcmp(refs[i], "Hello, world!"));
+        refcnt_unref(refs[i]);
+    }
+    refcnt_unref(str);
+    return NULL;
+}
+
+static void test_kind(refcnt_kind_t kind)
+{
+    pthread_t threads[N_THREADS];
+    char *str = refcnt_strdup_kind("Hello, world!", kind);
+
+    /* The references of the threads are taken by the owner of biased ones,
+     * so that the threads bring the shared counter below zero.
+     */
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_create(&threads[i], NULL, test_kind_thread, refcnt_ref(str));
+    for (int i = 0; i < N_ITERATIONS; i++)
+        refcnt_unref(refcnt_ref(str));
+    if (kind == REFCNT_SHARDED)
+        refcnt_kill(str);
+    else
+        refcnt_unref(str);
+    for (int i = 0; i < N_THREADS; i++)
+        pthread_join(threads[i], NULL);
+    refcnt_flush();
+}
+
+/* The owner exits while other threads still hold references */
+static void *test_owner_thread(void *arg)
+{
+    char **str = arg;
+
+    *str = refcnt_strdup_kind("Hello, world!", REFCNT_BIASED);
+    refcnt_ref(*str);
+    refcnt_unref(*str);
+    return NULL;
+}
+
+static void test_owner_exit(void)
+{
+    pthread_t owner;
+    char *str;
+
+    pthread_create(&owner, NULL, test_owner_thread, &str);
+    pthread_join(owner, NULL);
+    refcnt_unref(refcnt_ref(str));
+    str = refcnt_realloc(str, 64);
+    strcat(str, " Again.");
+    assert(!strcmp(str, "Hello, world! Again."));
+    refcnt_unref(str);
+}
+
+/* A cache holds a weak reference, which fails to upgrade once the object is
+ * gone but keeps its memory.
+ */
+static void test_weak(void)
+{
+    char *str = refcnt_strdup("Hello, world!");
+    refcnt_weak_t *weak = refcnt_weak(str);
+
+    char *again = refcnt_weak_upgrade(weak);
+    assert(again == str);
+    refcnt_unref(again);
+    refcnt_unref(str);
+    assert(!refcnt_weak_upgrade(weak));
+    refcnt_weak_unref(weak);
+}
+
+#define N_NODES 1000
+
+/* Tear down a list of nodes with the release buffer, whose blocks are then
+ * recycled for the next list.
+ */
+struct node {
+    struct node *next;
+    int value;
+};
+
+static struct node *test_list(int n)
+{
+    struct node *head = NULL;
+
+    for (int i = 0; i < n; i++) {
+        struct node *node = refcnt_malloc(sizeof(struct node));
+        node->next = head;
+        node->value = i;
+        head = node;
+    }
+    return head;
+}
+
+static void test_release_buffer(void)
+{
+    refcnt_release_buffer(true);
+    struct node *head = test_list(N_NODES);
+    while (head) {
+        struct node *next = head->next;
+        refcnt_unref(head);
+        head = next;
+    }
+    assert(refcnt_local.n_pending == N_NODES % REFCNT_RELEASE_BATCH);
+    refcnt_release_flush();
+    assert(refcnt_local.n_pending == 0);
+
+    unsigned int c = 0;
+    while (REFCNT_CLASS_SIZE(c) < sizeof(refcnt_t) + sizeof(struct node))
+        c++;
+    assert(refcnt_local.n_pooled[c] == N_NODES);
+    head = test_list(N_NODES);
+    assert(refcnt_local.n_pooled[c] == 0);
+    for (int i = N_NODES - 1; head; i--) {
+        struct node *next = head->next;
+        assert(head->value == i);
+        refcnt_unref(head);
+        head = next;
+    }
+    refcnt_release_buffer(false);
+    assert(refcnt_local.n_pooled[c] == 0);
+}
+
 int main(int argc, char **argv)
 {
     /* Create threads */
@@ -172,5 +843,11 @@ int main(int argc, char **argv)
     // refcnt_ref(ptr);
 
     free(ptr);
+
+    test_kind(REFCNT_BIASED);
+    test_kind(REFCNT_SHARDED);
+    test_owner_exit();
+    test_weak();
+    test_release_buffer();
     return 0;
 }
@@ -1,12 +1,22 @@
+#define _GNU_SOURCE
 #include <assert.h>
+#include <errno.h>
 #include <fcntl.h>
+#include <linux/futex.h>
+#include <linux/mempolicy.h>
 #include <pthread.h>
+#include <sched.h>
+#include <signal.h>
 #include <stdatomic.h>
 #include <stdbool.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
 #include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/vfs.h>
+#include <sys/wait.h>
 #include <time.h>
 #include <unistd.h>
 
@@ -16,10 +26,67 @@ typedef struct {
     uint32_t size, gap;
 } ringbuf_element_t;
 
+/* Consumer wakeup, shared between processes.
+ *
+ * An idle consumer raises @sleeping and waits on the @seq futex. Producers
+ * check @sleeping after publishing, and only then bump @seq and wake it. The
+ * futex is not process-private, as producers live in other processes.
+ */
+typedef struct {
+    bool enabled;
+    atomic_uint sleeping;
+    atomic_uint seq;
+} ringbuf_notify_t;
+
+static inline void _ringbuf_notify(ringbuf_notify_t *notify)
+{
+    if (!notify->enabled)
+        return;
+    /* order the publication before the load of @sleeping; the consumer
+     * orders the store of @sleeping before looking at the ring again
+     */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (!atomic_load_explicit(&notify->sleeping, memory_order_relaxed))
+        return;
+    atomic_fetch_add_explicit(&notify->seq, 1, memory_order_release);
+    syscall(SYS_futex, &notify->seq, FUTEX_WAKE, 1, NULL, NULL, 0);
+}
+
+/* Sleep until _ringbuf_notify() if @empty(@ringbuf) still holds. Return 0 if
+ * the ring may now be readable, -1 on timeout.
+ */
+static inline int _ringbuf_wait(ringbuf_notify_t *notify,
+                                bool (*empty)(void *ringbuf),
+                                void *ringbuf,
+                                int timeout_ms)
+{
+    assert(notify->enabled);
+    const unsigned seq =
+        atomic_load_explicit(&notify->seq, memory_order_acquire);
+    atomic_store_explicit(&notify->sleeping, 1, memory_order_seq_cst);
+
+    int ret = 0;
+    if (empty(ringbuf)) {
+        struct timespec timeout = {
+            .tv_sec = timeout_ms / 1000,
+            .tv_nsec = (long) (timeout_ms % 1000) * 1000000,
+        };
+        if (syscall(SYS_futex, &notify->seq, FUTEX_WAIT, seq,
+                    timeout_ms >= 0 ? &timeout : NULL, NULL, 0) == -1 &&
+            errno == ETIMEDOUT)
+            ret = -1;
+    }
+
+    atomic_store_explicit(&notify->sleeping, 0, memory_order_relaxed);
+    return ret;
+}
+
 typedef struct {
     size_t size, mask, rsvd /* reserved */, gapd;
+    bool magic; /* buf is mapped twice in a row, records may cross the end */
     memory_order acquire, release;
     atomic_size_t head, tail;
+    ringbuf_notify_t notify;
     uint8_t buf[] __attribute__((aligned(sizeof(ringbuf_element_t))));
 } ringbuf_t;
 
@@ -45,6 +112,11 @@ static inline void ringbuf_init(ringbuf_t *ringbuf,
 
     ringbuf->size = body_size;
     ringbuf->mask = ringbuf->size - 1;
+    ringbuf->magic = false;
+
+    ringbuf->notify.enabled = false;
+    atomic_init(&ringbuf->notify.sleeping, 0);
+    atomic_init(&ringbuf->notify.seq, 0);
 }
 
 static inline ringbuf_t *ringbuf_new(size_t minimum, bool release_and_acquire)
@@ -105,7 +177,7 @@ static inline void *ringbuf_write_request_max(ringbuf_t *ringbuf,
     end = head + space;
 
     /* available region wraps over at the end of buffer */
-    if (end > ringbuf->size) {
+    if (end > ringbuf->size && !ringbuf->magic) {
         /* get first part of available buffer */
         uint8_t *buf1 = ringbuf->buf + head;
         const size_t len1 = ringbuf->size - head;
@@ -189,6 +261,7 @@ static inline void ringbuf_write_advance(ringbuf_t *ringbuf, size_t written)
     _ringbuf_write_advance_raw(
         ringbuf, head,
         ringbuf->gapd + sizeof(ringbuf_element_t) + RINGBUF_PAD(written));
+    _ringbuf_notify(&ringbuf->notify);
 }
 
 static inline void _ringbuf_read_advance_raw(ringbuf_t *ringbuf,
@@ -220,7 +293,8 @@ static inline const void *ringbuf_read_request(ringbuf_t *ringbuf,
     if (space > 0) { /* there may be chunks available for reading */
         const size_t end = tail + space; /* virtual end of available buffer */
 
-        if (end > ringbuf->size) { /* available buffer wraps around at end */
+        /* available buffer wraps around at end */
+        if (end > ringbuf->size && !ringbuf->magic) {
             /* first part of available buffer */
             const uint8_t *buf1 = ringbuf->buf + tail;
             const size_t len1 = ringbuf->size - tail;
@@ -270,6 +344,277 @@ static inline void ringbuf_read_advance(ringbuf_t *ringbuf)
         ringbuf, tail, sizeof(ringbuf_element_t) + RINGBUF_PAD(element->size));
 }
 
+static bool _ringbuf_empty(void *ringbuf)
+{
+    size_t toread;
+    return !ringbuf_read_request(ringbuf, &toread);
+}
+
+/* Wait for the producer while the ring is empty, for at most @timeout_ms
+ * milliseconds, or forever if negative. The ring must have been set up with
+ * notifications, see RINGBUF_SHM_NOTIFY. Return 0 if it may now be readable,
+ * -1 on timeout.
+ */
+static inline int ringbuf_read_wait(ringbuf_t *ringbuf, int timeout_ms)
+{
+    return _ringbuf_wait(&ringbuf->notify, _ringbuf_empty, ringbuf,
+                         timeout_ms);
+}
+
+/* Multi-producer, single-consumer mode.
+ *
+ * Producers reserve space with a single CAS on a 128-bit word holding the
+ * next free position and the header of the record reserved last. Every
+ * record starts with a 64-bit commit header, written by its producer right
+ * after the CAS and flipped from BUSY to COMMITTED once the payload is in
+ * place, so the consumer never sees a torn record. Records never wrap: a PAD
+ * record fills the end of the buffer when needed.
+ *
+ * Before reserving, a producer waits for the header of the previous record,
+ * as the reserve word forgets about it once overwritten. The consumer zeroes
+ * what it consumed, so a zero header means "not written yet".
+ *
+ * Headers carry the pid of their producer. A record whose producer is gone
+ * (kill() reports ESRCH, i.e. it was reaped) is skipped by the consumer,
+ * whether it died in the middle of the payload or before writing the header.
+ * Positions are monotonic byte counts, masked on access.
+ */
+typedef unsigned __int128 ringbuf_u128_t;
+
+enum { RINGBUF_MP_BUSY = 1, RINGBUF_MP_COMMITTED = 2, RINGBUF_MP_PAD = 3 };
+
+#define RINGBUF_MP_HDR(len, pid, state) \
+    ((uint64_t)(len) << 32 | (uint64_t)(pid) << 2 | (state))
+#define RINGBUF_MP_LEN(hdr) ((uint32_t)((hdr) >> 32))
+#define RINGBUF_MP_PID(hdr) ((pid_t)(((hdr) >> 2) & 0x3fffffff))
+#define RINGBUF_MP_STATE(hdr) ((unsigned) ((hdr) &3))
+/* Bytes taken in the buffer by a record */
+#define RINGBUF_MP_RECORD(hdr) \
+    (sizeof(uint64_t) + RINGBUF_PAD(RINGBUF_MP_LEN(hdr)))
+
+typedef struct {
+    size_t size, mask;
+    bool magic; /* buf is mapped twice in a row, records may cross the end */
+    /* next free position | header of the last reserved record << 64 */
+    ringbuf_u128_t reserve __attribute__((aligned(64)));
+    atomic_size_t tail __attribute__((aligned(64)));
+    ringbuf_notify_t notify;
+    uint8_t buf[] __attribute__((aligned(64)));
+} ringbuf_mp_t;
+
+static inline void ringbuf_mp_init(ringbuf_mp_t *ringbuf, size_t body_size)
+{
+    ringbuf->size = body_size;
+    ringbuf->mask = ringbuf->size - 1;
+    ringbuf->magic = false;
+    ringbuf->reserve = 0;
+    atomic_init(&ringbuf->tail, 0);
+    ringbuf->notify.enabled = false;
+    atomic_init(&ringbuf->notify.sleeping, 0);
+    atomic_init(&ringbuf->notify.seq, 0);
+    memset(ringbuf->buf, 0, body_size);
+}
+
+static inline ringbuf_mp_t *ringbuf_mp_new(size_t minimum)
+{
+    ringbuf_mp_t *ringbuf = NULL;
+
+    const size_t body_size = ringbuf_body_size(minimum);
+    const size_t total_size = sizeof(ringbuf_mp_t) + body_size;
+
+    if (posix_memalign((void **) &ringbuf, 64, total_size))
+        return NULL;
+    ringbuf_mp_init(ringbuf, body_size);
+    return ringbuf;
+}
+
+static inline void ringbuf_mp_free(ringbuf_mp_t *ringbuf)
+{
+    free(ringbuf);
+}
+
+static inline ringbuf_u128_t _ringbuf_mp_load_reserve(ringbuf_mp_t *ringbuf)
+{
+    /* cmpxchg16b is the only atomic 128-bit load; it writes back 0 over 0 */
+    return __sync_val_compare_and_swap(&ringbuf->reserve, 0, 0);
+}
+
+static inline uint64_t *_ringbuf_mp_header(ringbuf_mp_t *ringbuf, size_t pos)
+{
+    return (uint64_t *) (ringbuf->buf + (pos & ringbuf->mask));
+}
+
+static inline bool _ringbuf_mp_dead(pid_t pid)
+{
+    return kill(pid, 0) == -1 && errno == ESRCH;
+}
+
+/* Reserve a record of @len bytes and return a pointer to its payload, or NULL
+ * if the buffer is full, or blocked behind the record of a dead producer
+ * until the consumer skips it.
+ */
+static inline void *ringbuf_mp_write_request(ringbuf_mp_t *ringbuf,
+                                             size_t len)
+{
+    assert(ringbuf);
+    if (len > UINT32_MAX ||
+        sizeof(uint64_t) + RINGBUF_PAD(len) > ringbuf->size)
+        return NULL;
+
+    const pid_t pid = getpid();
+    ringbuf_u128_t old = _ringbuf_mp_load_reserve(ringbuf);
+    for (;;) {
+        const size_t pos = (uint64_t) old;
+        const uint64_t last = (uint64_t)(old >> 64);
+        const size_t tail =
+            atomic_load_explicit(&ringbuf->tail, memory_order_acquire);
+
+        /* wait for the previous record to have its header */
+        if (last) {
+            const size_t last_pos = pos - RINGBUF_MP_RECORD(last);
+            if ((intptr_t)(last_pos - tail) >= 0 &&
+                !__atomic_load_n(_ringbuf_mp_header(ringbuf, last_pos),
+                                 __ATOMIC_ACQUIRE)) {
+                if (_ringbuf_mp_dead(RINGBUF_MP_PID(last)))
+                    return NULL;
+                sched_yield();
+                old = _ringbuf_mp_load_reserve(ringbuf);
+                continue;
+            }
+        }
+
+        /* pad the end of the buffer if the record does not fit there */
+        const size_t offset = pos & ringbuf->mask;
+        uint64_t hdr = RINGBUF_MP_HDR(len, pid, RINGBUF_MP_BUSY);
+        if (!ringbuf->magic &&
+            offset + RINGBUF_MP_RECORD(hdr) > ringbuf->size)
+            hdr = RINGBUF_MP_HDR(ringbuf->size - offset - sizeof(uint64_t),
+                                 pid, RINGBUF_MP_PAD);
+
+        const size_t next = pos + RINGBUF_MP_RECORD(hdr);
+        if (next - tail > ringbuf->size)
+            return NULL; /* full */
+
+        const ringbuf_u128_t neu = next | (ringbuf_u128_t) hdr << 64;
+        const ringbuf_u128_t seen =
+            __sync_val_compare_and_swap(&ringbuf->reserve, old, neu);
+        if (seen != old) {
+            old = seen;
+            continue;
+        }
+
+        uint64_t *header = _ringbuf_mp_header(ringbuf, pos);
+        __atomic_store_n(header, hdr, __ATOMIC_RELEASE);
+        if (RINGBUF_MP_STATE(hdr) != RINGBUF_MP_PAD)
+            return header + 1;
+        old = neu;
+    }
+}
+
+/* Publish the record whose payload @ptr was returned by write_request */
+static inline void ringbuf_mp_write_advance(ringbuf_mp_t *ringbuf, void *ptr)
+{
+    assert(ringbuf);
+    uint64_t *header = (uint64_t *) ptr - 1;
+    const uint64_t hdr = __atomic_load_n(header, __ATOMIC_RELAXED);
+    assert(RINGBUF_MP_STATE(hdr) == RINGBUF_MP_BUSY);
+    __atomic_store_n(header, (hdr & ~3ULL) | RINGBUF_MP_COMMITTED,
+                     __ATOMIC_RELEASE);
+    _ringbuf_notify(&ringbuf->notify);
+}
+
+static inline void _ringbuf_mp_skip(ringbuf_mp_t *ringbuf,
+                                    size_t tail,
+                                    size_t record)
+{
+    /* only consumer is allowed to advance read tail */
+    memset(_ringbuf_mp_header(ringbuf, tail), 0, record);
+    atomic_store_explicit(&ringbuf->tail, tail + record,
+                          memory_order_release);
+}
+
+static inline const void *ringbuf_mp_read_request(ringbuf_mp_t *ringbuf,
+                                                  size_t *toread)
+{
+    assert(ringbuf);
+    for (;;) {
+        const size_t tail =
+            atomic_load_explicit(&ringbuf->tail, memory_order_relaxed);
+        const uint64_t *header = _ringbuf_mp_header(ringbuf, tail);
+        const uint64_t hdr = __atomic_load_n(header, __ATOMIC_ACQUIRE);
+
+        if (!hdr) {
+            /* empty, or the last record is reserved but has no header yet */
+            const ringbuf_u128_t rsv = _ringbuf_mp_load_reserve(ringbuf);
+            const uint64_t last = (uint64_t)(rsv >> 64);
+            if (last && (uint64_t) rsv - RINGBUF_MP_RECORD(last) == tail &&
+                _ringbuf_mp_dead(RINGBUF_MP_PID(last))) {
+                _ringbuf_mp_skip(ringbuf, tail, RINGBUF_MP_RECORD(last));
+                continue;
+            }
+            break;
+        }
+
+        switch (RINGBUF_MP_STATE(hdr)) {
+        case RINGBUF_MP_COMMITTED:
+            *toread = RINGBUF_MP_LEN(hdr);
+            return header + 1;
+        case RINGBUF_MP_PAD:
+            _ringbuf_mp_skip(ringbuf, tail, RINGBUF_MP_RECORD(hdr));
+            continue;
+        case RINGBUF_MP_BUSY:
+            if (_ringbuf_mp_dead(RINGBUF_MP_PID(hdr))) {
+                _ringbuf_mp_skip(ringbuf, tail, RINGBUF_MP_RECORD(hdr));
+                continue;
+            }
+            break; /* still being written */
+        }
+        break;
+    }
+
+    *toread = 0;
+    return NULL;
+}
+
+static inline void ringbuf_mp_read_advance(ringbuf_mp_t *ringbuf)
+{
+    assert(ringbuf);
+    const size_t tail =
+        atomic_load_explicit(&ringbuf->tail, memory_order_relaxed);
+    const uint64_t hdr =
+        __atomic_load_n(_ringbuf_mp_header(ringbuf, tail), __ATOMIC_RELAXED);
+    assert(RINGBUF_MP_STATE(hdr) == RINGBUF_MP_COMMITTED);
+
+    _ringbuf_mp_skip(ringbuf, tail, RINGBUF_MP_RECORD(hdr));
+}
+
+static bool _ringbuf_mp_empty(void *ringbuf)
+{
+    size_t toread;
+    return !ringbuf_mp_read_request(ringbuf, &toread);
+}
+
+/* A producer that dies with its record BUSY never notifies the consumer, so
+ * an infinite wait looks for dead producers every RINGBUF_MP_REAP_MS. They
+ * only count as dead once reaped: a consumer that is also their parent has
+ * to waitpid() them, with a finite timeout.
+ */
+#define RINGBUF_MP_REAP_MS 100
+
+/* Same as ringbuf_read_wait, for the multi-producer mode */
+static inline int ringbuf_mp_read_wait(ringbuf_mp_t *ringbuf, int timeout_ms)
+{
+    if (timeout_ms >= 0)
+        return _ringbuf_wait(&ringbuf->notify, _ringbuf_mp_empty, ringbuf,
+                             timeout_ms);
+
+    /* each round skips the records of dead producers before sleeping */
+    while (_ringbuf_wait(&ringbuf->notify, _ringbuf_mp_empty, ringbuf,
+                         RINGBUF_MP_REAP_MS) == -1)
+        ;
+    return 0;
+}
+
 /* Test program */
 
 static const struct timespec req = {.tv_sec = 0, .tv_nsec = 1};
@@ -323,7 +668,9 @@ static void *consumer_main(void *arg)
                 assert(*(const uint64_t *) src == cnt);
             ringbuf_read_advance(ringbuf);
             cnt++;
-        } /* else: buffer empty */
+        } else if (ringbuf->notify.enabled) { /* buffer empty */
+            ringbuf_read_wait(ringbuf, -1);
+        }
     }
 
     return NULL;
@@ -346,69 +693,267 @@ static void test_threaded()
 
 typedef struct _ringbuf_shm_t ringbuf_shm_t;
 
+/* Where and how the shared ring is placed in memory */
+enum {
+    /* Back the ring with huge pages: a file on hugetlbfs, or with
+     * RINGBUF_SHM_MEMFD, a memfd created with MFD_HUGETLB.
+     */
+    RINGBUF_SHM_HUGE = 1 << 0,
+    /* Anonymous memfd, shared with child processes rather than by name */
+    RINGBUF_SHM_MEMFD = 1 << 1,
+    /* Fault every page in up front, after the NUMA binding if any */
+    RINGBUF_SHM_PREFAULT = 1 << 2,
+    /* Map the buffer twice back to back, so that records never wrap and
+     * readers always get one contiguous span.
+     */
+    RINGBUF_SHM_MAGIC = 1 << 3,
+    /* Let the consumer sleep in ringbuf_read_wait(). Producers then pay for
+     * a full fence per record, and a futex wake while the consumer sleeps.
+     */
+    RINGBUF_SHM_NOTIFY = 1 << 4,
+};
+
+typedef struct {
+    unsigned flags;          /* RINGBUF_SHM_* */
+    int node;                /* NUMA node to bind the ring to, or -1 */
+    const char *hugetlbfs;   /* hugetlbfs mount, "/dev/hugepages" if NULL */
+} ringbuf_shm_opts_t;
+
 struct _ringbuf_shm_t {
-    char *name;
+    char *name; /* shm_open name, or hugetlbfs path */
     int fd;
+    unsigned flags;
+    void *map;
+    size_t map_size;
     ringbuf_t *ringbuf;
+    ringbuf_mp_t *mp; /* multi-producer mode */
 };
 
-static int ringbuf_shm_init(ringbuf_shm_t *ringbuf_shm,
-                            const char *name,
-                            size_t minimum,
-                            bool release_and_acquire)
+#define ALIGN_UP(x, a) (((x) + (a) -1) & ~((size_t)(a) -1))
+
+static int _ringbuf_shm_open(ringbuf_shm_t *ringbuf_shm,
+                             const char *name,
+                             const ringbuf_shm_opts_t *opts,
+                             bool *is_first)
 {
-    const size_t body_size = ringbuf_body_size(minimum);
-    const size_t total_size = sizeof(ringbuf_t) + body_size;
+    *is_first = true;
+    if (opts->flags & RINGBUF_SHM_MEMFD) {
+        ringbuf_shm->name = strdup(name);
+        if (!ringbuf_shm->name)
+            return -1;
+        unsigned mfd_flags = MFD_CLOEXEC;
+        if (opts->flags & RINGBUF_SHM_HUGE)
+            mfd_flags |= MFD_HUGETLB;
+        return ringbuf_shm->fd = memfd_create(name, mfd_flags);
+    }
+
+    if (opts->flags & RINGBUF_SHM_HUGE) {
+        const char *dir = opts->hugetlbfs ? opts->hugetlbfs : "/dev/hugepages";
+        if (asprintf(&ringbuf_shm->name, "%s/%s", dir,
+                     name + (name[0] == '/')) < 0) {
+            ringbuf_shm->name = NULL; /* undefined on failure, and freed */
+            return -1;
+        }
+        ringbuf_shm->fd = open(ringbuf_shm->name, O_RDWR | O_CREAT | O_EXCL,
+                               S_IRUSR | S_IWUSR);
+        if (ringbuf_shm->fd == -1) {
+            *is_first = false;
+            ringbuf_shm->fd = open(ringbuf_shm->name, O_RDWR);
+        }
+        return ringbuf_shm->fd;
+    }
 
     ringbuf_shm->name = strdup(name);
     if (!ringbuf_shm->name)
         return -1;
-
-    bool is_first = true;
     ringbuf_shm->fd = shm_open(ringbuf_shm->name, O_RDWR | O_CREAT | O_EXCL,
                                S_IRUSR | S_IWUSR);
     if (ringbuf_shm->fd == -1) {
-        is_first = false;
+        *is_first = false;
         ringbuf_shm->fd =
             shm_open(ringbuf_shm->name, O_RDWR, S_IRUSR | S_IWUSR);
     }
-    if (ringbuf_shm->fd == -1) {
-        free(ringbuf_shm->name);
-        return -1;
-    }
+    return ringbuf_shm->fd;
+}
 
-    if ((ftruncate(ringbuf_shm->fd, total_size) == -1) ||
-        ((ringbuf_shm->ringbuf = mmap(NULL, total_size, PROT_READ | PROT_WRITE,
-                                      MAP_SHARED, ringbuf_shm->fd, 0)) ==
-         MAP_FAILED)) {
+static void _ringbuf_shm_unlink(ringbuf_shm_t *ringbuf_shm)
+{
+    if (ringbuf_shm->flags & RINGBUF_SHM_MEMFD)
+        return;
+    if (ringbuf_shm->flags & RINGBUF_SHM_HUGE)
+        unlink(ringbuf_shm->name);
+    else
         shm_unlink(ringbuf_shm->name);
-        close(ringbuf_shm->fd);
+}
+
+/* Map a shared ring made of a @header_size bytes header directly followed by
+ * a @body_size bytes buffer, creating it if needed, and return the header.
+ *
+ * The layout of the object is padded so that the buffer starts on a page
+ * boundary, as the magic ring maps it a second time right after itself.
+ * Sizes are rounded up to the page size of the backing store, which is the
+ * huge page size on hugetlbfs.
+ */
+static void *_ringbuf_shm_map(ringbuf_shm_t *ringbuf_shm,
+                              const char *name,
+                              size_t header_size,
+                              size_t *body_size,
+                              const ringbuf_shm_opts_t *opts,
+                              bool *is_first)
+{
+    static const ringbuf_shm_opts_t defaults = {.node = -1};
+    if (!opts)
+        opts = &defaults;
+    ringbuf_shm->flags = opts->flags;
+
+    if (_ringbuf_shm_open(ringbuf_shm, name, opts, is_first) == -1) {
         free(ringbuf_shm->name);
+        return NULL;
+    }
+
+    struct statfs fs;
+    if (fstatfs(ringbuf_shm->fd, &fs) == -1)
+        goto fail_fd;
+    const size_t page = fs.f_bsize;
+    const bool magic = opts->flags & RINGBUF_SHM_MAGIC;
+
+    if (magic && *body_size < page)
+        *body_size = ringbuf_body_size(page);
+    const size_t header_span = magic ? ALIGN_UP(header_size, page) : header_size;
+    const size_t file_size = ALIGN_UP(header_span + *body_size, page);
+    if (ftruncate(ringbuf_shm->fd, file_size) == -1)
+        goto fail_fd;
+
+    /* reserve the whole range first, aligned to the page size, so that both
+     * views of the buffer can be placed next to each other
+     */
+    const size_t span = magic ? header_span + 2 * *body_size : file_size;
+    uint8_t *area = mmap(NULL, span + page, PROT_NONE,
+                         MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (area == MAP_FAILED)
+        goto fail_fd;
+    uint8_t *base = (uint8_t *) ALIGN_UP((uintptr_t) area, page);
+    if (base > area)
+        munmap(area, base - area);
+    munmap(base + span, area + page - base);
+
+    if (mmap(base, file_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+             ringbuf_shm->fd, 0) == MAP_FAILED)
+        goto fail_map;
+    if (magic && mmap(base + header_span + *body_size, *body_size,
+                      PROT_READ | PROT_WRITE, MAP_SHARED | MAP_FIXED,
+                      ringbuf_shm->fd, header_span) == MAP_FAILED)
+        goto fail_map;
+
+    if (opts->node >= 0) {
+        unsigned long nodemask[16] = {0};
+        if ((size_t) opts->node >= 8 * sizeof(nodemask))
+            goto fail_map;
+        nodemask[opts->node / 64] = 1UL << (opts->node % 64);
+        if (syscall(SYS_mbind, base, file_size, MPOL_BIND, nodemask,
+                    8 * sizeof(nodemask), MPOL_MF_MOVE) == -1)
+            goto fail_map;
+    }
+    if ((opts->flags & RINGBUF_SHM_PREFAULT) &&
+        madvise(base, file_size, MADV_POPULATE_WRITE) == -1) {
+        /* older kernels: fault the pages in by hand, without changing them */
+        for (size_t off = 0; off < file_size; off += page)
+            __atomic_fetch_add(base + off, 0, __ATOMIC_RELAXED);
+    }
+
+    ringbuf_shm->map = base;
+    ringbuf_shm->map_size = span;
+    ringbuf_shm->ringbuf = NULL;
+    ringbuf_shm->mp = NULL;
+    return base + header_span - header_size;
+
+fail_map:
+    munmap(base, span);
+fail_fd:
+    if (*is_first)
+        _ringbuf_shm_unlink(ringbuf_shm);
+    close(ringbuf_shm->fd);
+    free(ringbuf_shm->name);
+    return NULL;
+}
+
+static int ringbuf_shm_init_opts(ringbuf_shm_t *ringbuf_shm,
+                                 const char *name,
+                                 size_t minimum,
+                                 bool release_and_acquire,
+                                 const ringbuf_shm_opts_t *opts)
+{
+    size_t body_size = ringbuf_body_size(minimum);
+
+    bool is_first;
+    ringbuf_t *ringbuf = _ringbuf_shm_map(ringbuf_shm, name, sizeof(ringbuf_t),
+                                          &body_size, opts, &is_first);
+    if (!ringbuf)
         return -1;
+
+    if (is_first) {
+        ringbuf_init(ringbuf, body_size, release_and_acquire);
+        ringbuf->magic = opts && (opts->flags & RINGBUF_SHM_MAGIC);
+        ringbuf->notify.enabled = opts && (opts->flags & RINGBUF_SHM_NOTIFY);
     }
+    ringbuf_shm->ringbuf = ringbuf;
+
+    return 0;
+}
+
+static int ringbuf_shm_init(ringbuf_shm_t *ringbuf_shm,
+                            const char *name,
+                            size_t minimum,
+                            bool release_and_acquire)
+{
+    return ringbuf_shm_init_opts(ringbuf_shm, name, minimum,
+                                 release_and_acquire, NULL);
+}
+
+/* Same, for a ring written by several producer processes */
+static int ringbuf_mp_shm_init(ringbuf_shm_t *ringbuf_shm,
+                               const char *name,
+                               size_t minimum,
+                               const ringbuf_shm_opts_t *opts)
+{
+    size_t body_size = ringbuf_body_size(minimum);
+
+    bool is_first;
+    ringbuf_mp_t *ringbuf =
+        _ringbuf_shm_map(ringbuf_shm, name, sizeof(ringbuf_mp_t), &body_size,
+                         opts, &is_first);
+    if (!ringbuf)
+        return -1;
 
-    if (is_first)
-        ringbuf_init(ringbuf_shm->ringbuf, body_size, release_and_acquire);
+    if (is_first) {
+        ringbuf_mp_init(ringbuf, body_size);
+        ringbuf->magic = opts && (opts->flags & RINGBUF_SHM_MAGIC);
+        ringbuf->notify.enabled = opts && (opts->flags & RINGBUF_SHM_NOTIFY);
+    }
+    ringbuf_shm->mp = ringbuf;
 
     return 0;
 }
 
 static void ringbuf_shm_deinit(ringbuf_shm_t *ringbuf_shm)
 {
-    const size_t total_size = sizeof(ringbuf_t) + ringbuf_shm->ringbuf->size;
-
-    munmap(ringbuf_shm->ringbuf, total_size);
-    shm_unlink(ringbuf_shm->name);
+    munmap(ringbuf_shm->map, ringbuf_shm->map_size);
+    _ringbuf_shm_unlink(ringbuf_shm);
     close(ringbuf_shm->fd);
     free(ringbuf_shm->name);
 }
 
 static void test_shared()
 {
+    /* the parent creates the ring, so that the child finds it initialized */
+    const char *name = "/ringbuf_shm_test";
+    const ringbuf_shm_opts_t opts = {.flags = RINGBUF_SHM_NOTIFY, .node = -1};
+    ringbuf_shm_t ringbuf_shm;
+    assert(ringbuf_shm_init_opts(&ringbuf_shm, name, 8192, true, &opts) == 0);
+
     pid_t pid = fork();
     assert(pid != -1);
 
-    const char *name = "/ringbuf_shm_test";
     if (pid == 0) { /* child process */
         ringbuf_shm_t ringbuf_shm;
         assert(ringbuf_shm_init(&ringbuf_shm, name, 8192, true) == 0);
@@ -416,22 +961,128 @@ static void test_shared()
         consumer_main(ringbuf_shm.ringbuf);
 
         ringbuf_shm_deinit(&ringbuf_shm);
+        exit(0);
     } else { /* parent process */
-        ringbuf_shm_t ringbuf_shm;
-        assert(ringbuf_shm_init(&ringbuf_shm, name, 8192, true) == 0);
-
         producer_main(ringbuf_shm.ringbuf);
 
+        waitpid(pid, NULL, 0);
         ringbuf_shm_deinit(&ringbuf_shm);
     }
 }
 
+/* A producer and a consumer process sharing an anonymous magic ring, placed
+ * on huge pages and NUMA node 0 when the system allows it.
+ */
+static void test_shared_magic()
+{
+    static const unsigned tries[] = {
+        RINGBUF_SHM_MEMFD | RINGBUF_SHM_HUGE | RINGBUF_SHM_PREFAULT,
+        RINGBUF_SHM_MEMFD | RINGBUF_SHM_PREFAULT,
+    };
+    ringbuf_shm_t ringbuf_shm;
+    int i, ret = -1;
+    for (i = 0; ret && i < 2 * (int) (sizeof(tries) / sizeof(tries[0])); i++) {
+        ringbuf_shm_opts_t opts = {
+            .flags = tries[i / 2] | RINGBUF_SHM_MAGIC,
+            .node = i % 2 ? -1 : 0,
+        };
+        ret = ringbuf_shm_init_opts(&ringbuf_shm, "ringbuf_magic_test", 8192,
+                                    true, &opts);
+    }
+    assert(ret == 0 && ringbuf_shm.ringbuf->magic);
+
+    pid_t pid = fork();
+    assert(pid != -1);
+    if (pid == 0) {
+        consumer_main(ringbuf_shm.ringbuf);
+        exit(0);
+    }
+    producer_main(ringbuf_shm.ringbuf);
+    waitpid(pid, NULL, 0);
+
+    ringbuf_shm_deinit(&ringbuf_shm);
+}
+
+/* Several producer processes write into one ring read by the parent. Records
+ * hold the producer id and a sequence number in every word. The last producer
+ * dies in the middle of a record, which the consumer must skip.
+ */
+#define N_PRODUCERS 4
+#define DEAD_AFTER 1000
+
+static void mp_producer_main(ringbuf_mp_t *ringbuf, uint64_t id)
+{
+    for (uint64_t cnt = 0; cnt < iterations; cnt++) {
+        const size_t written = PAD(rand() * 1024.f / RAND_MAX) + 16;
+
+        uint64_t *ptr;
+        while (!(ptr = ringbuf_mp_write_request(ringbuf, written)))
+            sched_yield(); /* buffer full */
+        for (size_t i = 0; i < written / sizeof(uint64_t); i++) {
+            ptr[i] = id << 32 | cnt;
+            if (id == N_PRODUCERS - 1 && cnt == DEAD_AFTER && i == 1)
+                _exit(0); /* die with the record half written */
+        }
+        ringbuf_mp_write_advance(ringbuf, ptr);
+    }
+    _exit(0);
+}
+
+static void test_shared_mp()
+{
+    const char *name = "/ringbuf_shm_mp_test";
+    ringbuf_shm_t ringbuf_shm;
+    const ringbuf_shm_opts_t opts = {.flags = RINGBUF_SHM_NOTIFY, .node = -1};
+    assert(ringbuf_mp_shm_init(&ringbuf_shm, name, 8192, &opts) == 0);
+    ringbuf_mp_t *ringbuf = ringbuf_shm.mp;
+
+    for (uint64_t id = 0; id < N_PRODUCERS; id++) {
+        pid_t pid = fork();
+        assert(pid != -1);
+        if (pid == 0) {
+            srand(time(NULL) + id);
+            mp_producer_main(ringbuf, id);
+        }
+    }
+
+    uint64_t next[N_PRODUCERS] = {0};
+    int alive = N_PRODUCERS;
+    for (;;) {
+        const uint64_t *ptr;
+        size_t toread;
+        if ((ptr = ringbuf_mp_read_request(ringbuf, &toread))) {
+            const uint64_t id = ptr[0] >> 32;
+            assert(id < N_PRODUCERS && (ptr[0] & 0xffffffff) == next[id]);
+            for (size_t i = 0; i < toread / sizeof(uint64_t); i++)
+                assert(ptr[i] == ptr[0]); /* never torn */
+            next[id]++;
+            ringbuf_mp_read_advance(ringbuf);
+            continue;
+        }
+        /* buffer empty: reap producers, dead ones can then be skipped */
+        if (alive == 0)
+            break;
+        if (waitpid(-1, NULL, WNOHANG) > 0)
+            alive--;
+        else
+            ringbuf_mp_read_wait(ringbuf, 10);
+    }
+
+    for (uint64_t id = 0; id < N_PRODUCERS - 1; id++)
+        assert(next[id] == iterations);
+    assert(next[N_PRODUCERS - 1] == DEAD_AFTER);
+
+    ringbuf_shm_deinit(&ringbuf_shm);
+}
+
 int main(int argc, char **argv)
 {
     srand(time(NULL));
 
     test_threaded();
     test_shared();
+    test_shared_magic();
+    test_shared_mp();
 
     return 0;
 }
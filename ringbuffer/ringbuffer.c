@@ -5,16 +5,27 @@
  * - FIFO (First In First Out)
  * - Maximum size is fixed; the pointers are stored in a table.
  * - Lockless implementation.
+ * - Multi- or single-producer enqueue, multi- or single-consumer dequeue.
+ * - Bulk (all or nothing) and burst (as many as possible) operations on a
+ *   table of objects.
+ * - Optional blocking consumers, which spin, back off and then sleep on a
+ *   futex until the producer releases entries.
  *
  * The ring buffer implementation is not preemptable.
  */
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
+#include <sched.h>
 #include <stdbool.h>
 #include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <sys/syscall.h>
+#include <time.h>
+#include <unistd.h>
 
 /* typically 64 bytes on x86/x64 CPUs */
 #define CACHE_LINE_SIZE 64
@@ -33,20 +44,44 @@
  * values in a modulo-32bit base: that is why the overflow of the indexes is not
  * a problem.
  */
+/* Ring flags */
+#define RINGBUF_F_WAIT 0x1 /**< Consumers may sleep in ringbuf_sc_*_wait(). */
+
+/* Multi-producer and multi-consumer operations move the head with a CAS to
+ * reserve their entries, copy them, then wait for the operations that reserved
+ * before them to move the tail, and move it past their own entries.
+ *
+ * The producer and the consumer metadata are on their own cache lines. The
+ * single producer and the single consumer also keep the last tail they read on
+ * the other side, and only load the other line again when that cached index
+ * does not leave enough room or entries.
+ */
+enum ringbuf_queue_behavior {
+    RINGBUF_QUEUE_FIXED = 0, /**< Enqueue or dequeue exactly n objects. */
+    RINGBUF_QUEUE_VARIABLE,  /**< Enqueue or dequeue as many as possible. */
+};
+
 typedef struct {
     struct {                          /** Ring producer status. */
+        uint32_t flags;               /**< RINGBUF_F_* flags. */
         uint32_t watermark;           /**< Maximum items before EDQUOT. */
         uint32_t size;                /**< Size of ring buffer. */
         uint32_t mask;                /**< Mask (size - 1) of ring buffer. */
         volatile uint32_t head, tail; /**< Producer head and tail. */
+        uint32_t cons_tail;           /**< Cached cons.tail (single prod.). */
     } prod __attribute__((__aligned__(CACHE_LINE_SIZE)));
 
     struct {                          /** Ring consumer status. */
         uint32_t size;                /**< Size of the ring buffer. */
         uint32_t mask;                /**< Mask (size - 1) of ring buffer. */
         volatile uint32_t head, tail; /**< Consumer head and tail. */
+        uint32_t prod_tail;           /**< Cached prod.tail (single cons.). */
     } cons __attribute__((__aligned__(CACHE_LINE_SIZE)));
 
+    struct {                    /** Sleeping consumers (RINGBUF_F_WAIT). */
+        volatile int waiters;   /**< Consumers asleep on prod.tail. */
+    } wait __attribute__((__aligned__(CACHE_LINE_SIZE)));
+
     void *ring[] __attribute__((__aligned__(CACHE_LINE_SIZE)));
 } ringbuf_t;
 
@@ -92,15 +127,19 @@ ssize_t ringbuf_get_memsize(const unsigned count)
  *   The pointer to the ring buffer structure followed by the objects table.
  * @param count
  *   The number of elements in the ring buffer (must be a power of 2).
+ * @param flags
+ *   RINGBUF_F_WAIT to let consumers sleep while the ring is empty, or 0.
  * @return
  *   0 on success, or a negative value on error.
  */
-int ringbuf_init(ringbuf_t *r, const unsigned count)
+int ringbuf_init(ringbuf_t *r, const unsigned count, const unsigned flags)
 {
     memset(r, 0, sizeof(*r));
+    r->prod.flags = flags;
     r->prod.watermark = count, r->prod.size = r->cons.size = count;
     r->prod.mask = r->cons.mask = count - 1;
     r->prod.head = r->cons.head = 0, r->prod.tail = r->cons.tail = 0;
+    r->prod.cons_tail = r->cons.prod_tail = 0;
 
     return 0;
 }
@@ -112,6 +151,8 @@ int ringbuf_init(ringbuf_t *r, const unsigned count)
  *
  * @param count
  *   The size of the ring (must be a power of 2).
+ * @param flags
+ *   RINGBUF_F_WAIT to let consumers sleep while the ring is empty, or 0.
  * @return
  *   On success, the pointer to the new allocated ring buffer. NULL on error
  *   with errno set appropriately. Possible errno values include:
@@ -120,7 +161,7 @@ int ringbuf_init(ringbuf_t *r, const unsigned count)
  *    - EEXIST - a memzone with the same name already exists
  *    - ENOMEM - no appropriate memory area found in which to create memzone
  */
-ringbuf_t *ringbuf_create(const unsigned count)
+ringbuf_t *ringbuf_create(const unsigned count, const unsigned flags)
 {
     ssize_t ring_size = ringbuf_get_memsize(count);
     if (ring_size < 0)
@@ -128,7 +169,7 @@ ringbuf_t *ringbuf_create(const unsigned count)
 
     ringbuf_t *r = malloc(ring_size);
     if (r)
-        ringbuf_init(r, count);
+        ringbuf_init(r, count, flags);
     return r;
 }
 
@@ -160,8 +201,10 @@ void ringbuf_free(ringbuf_t *r)
             switch (n & 0x3) {                                             \
             case 3:                                                        \
                 r->ring[idx++] = obj_table[i++];                           \
+                __attribute__((fallthrough));                              \
             case 2:                                                        \
                 r->ring[idx++] = obj_table[i++];                           \
+                __attribute__((fallthrough));                              \
             case 1:                                                        \
                 r->ring[idx++] = obj_table[i++];                           \
             }                                                              \
@@ -191,8 +234,10 @@ void ringbuf_free(ringbuf_t *r)
             switch (n & 0x3) {                                           \
             case 3:                                                      \
                 obj_table[i++] = r->ring[idx++];                         \
+                __attribute__((fallthrough));                            \
             case 2:                                                      \
                 obj_table[i++] = r->ring[idx++];                         \
+                __attribute__((fallthrough));                            \
             case 1:                                                      \
                 obj_table[i++] = r->ring[idx++];                         \
             }                                                            \
@@ -204,6 +249,125 @@ void ringbuf_free(ringbuf_t *r)
         }                                                                \
     } while (0)
 
+/* Wake the consumer if it sleeps on prod.tail.
+ *
+ * The full fence orders the store to prod.tail before the load of the waiter
+ * count; the consumer does the opposite, so that either it sees the new tail
+ * or we see it waiting.
+ */
+static inline void ringbuf_wake(ringbuf_t *r)
+{
+    __atomic_thread_fence(__ATOMIC_SEQ_CST);
+    if (r->wait.waiters)
+        syscall(SYS_futex, &r->prod.tail, FUTEX_WAKE_PRIVATE, INT_MAX, NULL,
+                NULL, 0);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    asm volatile("pause" : : : "memory");
+#elif defined(__aarch64__)
+    asm volatile("yield" : : : "memory");
+#else
+    __compiler_barrier();
+#endif
+}
+
+/* Number of pauses before yielding the CPU while waiting for the tail, in
+ * case the thread we wait for was preempted.
+ */
+#define RINGBUF_PAUSE_REP_COUNT 1024
+
+/* Wait until the operations that reserved entries before @head committed
+ * them, i.e. the tail reached @head.
+ */
+static inline void ringbuf_wait_tail(volatile uint32_t *tail, uint32_t head)
+{
+    unsigned rep = 0;
+    while (__atomic_load_n(tail, __ATOMIC_RELAXED) != head) {
+        cpu_relax();
+        if (++rep == RINGBUF_PAUSE_REP_COUNT) {
+            rep = 0;
+            sched_yield();
+        }
+    }
+}
+
+/* Trim @n to the @avail entries for a variable operation.
+ * Return false if the operation cannot proceed.
+ */
+static inline bool ringbuf_fit(unsigned *n,
+                               uint32_t avail,
+                               enum ringbuf_queue_behavior behavior)
+{
+    if (*n <= avail)
+        return true;
+    if (behavior == RINGBUF_QUEUE_FIXED || avail == 0)
+        return false;
+    *n = avail;
+    return true;
+}
+
+/* Enqueue several objects on a ring buffer (multi-producers safe).
+ *
+ * @param r
+ *   A pointer to the ring buffer structure.
+ * @param obj_table
+ *   A pointer to a table of void * pointers (objects).
+ * @param n
+ *   The number of objects to add in the ring buffer from the obj_table.
+ * @param behavior
+ *   RINGBUF_QUEUE_FIXED to enqueue all the objects or none,
+ *   RINGBUF_QUEUE_VARIABLE to enqueue as many as possible.
+ * @return
+ *   Depend on the behavior value
+ *   if behavior = RINGBUF_QUEUE_FIXED
+ *   - 0: Success; objects enqueue.
+ *   - -EDQUOT: Quota exceeded. The objects have been enqueued, but the
+ *     high water mark is exceeded.
+ *   - -ENOBUFS: Not enough room in the ring to enqueue, no object is enqueued.
+ *   if behavior = RINGBUF_QUEUE_VARIABLE
+ *   - n: Actual number of objects enqueued.
+ */
+static inline int ringbuffer_mp_do_enqueue(ringbuf_t *r,
+                                           void *const *obj_table,
+                                           unsigned n,
+                                           enum ringbuf_queue_behavior behavior)
+{
+    uint32_t mask = r->prod.mask;
+    uint32_t prod_head, prod_next, free_entries;
+    const unsigned max = n;
+
+    /* The acquire loads of prod.head keep the load of cons.tail after them;
+     * an older cons.tail with a newer head would make free_entries wrap.
+     */
+    prod_head = __atomic_load_n(&r->prod.head, __ATOMIC_ACQUIRE);
+    do {
+        n = max;
+        uint32_t cons_tail = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+        free_entries = mask + cons_tail - prod_head;
+        if (!ringbuf_fit(&n, free_entries, behavior))
+            return behavior == RINGBUF_QUEUE_FIXED ? -ENOBUFS : 0;
+        prod_next = prod_head + n;
+    } while (!__atomic_compare_exchange_n(&r->prod.head, &prod_head, prod_next,
+                                          false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    /* write entries in ring buffer */
+    ENQUEUE_PTRS();
+
+    ringbuf_wait_tail(&r->prod.tail, prod_head);
+    __atomic_store_n(&r->prod.tail, prod_next, __ATOMIC_RELEASE);
+    if (r->prod.flags & RINGBUF_F_WAIT)
+        ringbuf_wake(r);
+
+    if (behavior == RINGBUF_QUEUE_VARIABLE)
+        return n;
+    /* if we exceed the watermark */
+    return ((mask + 1) - free_entries + n) > r->prod.watermark ? -EDQUOT : 0;
+}
+
 /* Enqueue several objects on a ring buffer (NOT multi-producers safe).
  *
  * @param r
@@ -212,44 +376,108 @@ void ringbuf_free(ringbuf_t *r)
  *   A pointer to a table of void * pointers (objects).
  * @param n
  *   The number of objects to add in the ring buffer from the obj_table.
+ * @param behavior
+ *   RINGBUF_QUEUE_FIXED to enqueue all the objects or none,
+ *   RINGBUF_QUEUE_VARIABLE to enqueue as many as possible.
  * @return
+ *   Depend on the behavior value
+ *   if behavior = RINGBUF_QUEUE_FIXED
  *   - 0: Success; objects enqueue.
  *   - -EDQUOT: Quota exceeded. The objects have been enqueued, but the
  *     high water mark is exceeded.
  *   - -ENOBUFS: Not enough room in the ring to enqueue, no object is enqueued.
+ *   if behavior = RINGBUF_QUEUE_VARIABLE
+ *   - n: Actual number of objects enqueued.
  */
 static inline int ringbuffer_sp_do_enqueue(ringbuf_t *r,
                                            void *const *obj_table,
-                                           const unsigned n)
+                                           unsigned n,
+                                           enum ringbuf_queue_behavior behavior)
 {
     uint32_t mask = r->prod.mask;
-    uint32_t prod_head = r->prod.head, cons_tail = r->cons.tail;
+    uint32_t prod_head = r->prod.head;
     /* The subtraction is done between two unsigned 32-bits value (the result
      * is always modulo 32 bits even if we have prod_head > cons_tail). So
      * @free_entries is always between 0 and size(ring) - 1.
      */
-    uint32_t free_entries = mask + cons_tail - prod_head;
+    uint32_t free_entries = mask + r->prod.cons_tail - prod_head;
+
+    /* Read the consumer's line only when the cached tail is not enough */
+    if (n > free_entries) {
+        r->prod.cons_tail = __atomic_load_n(&r->cons.tail, __ATOMIC_ACQUIRE);
+        free_entries = mask + r->prod.cons_tail - prod_head;
+    }
 
     /* check that we have enough room in ring buffer */
-    if ((n > free_entries))
-        return -ENOBUFS;
+    if (!ringbuf_fit(&n, free_entries, behavior))
+        return behavior == RINGBUF_QUEUE_FIXED ? -ENOBUFS : 0;
 
     uint32_t prod_next = prod_head + n;
     r->prod.head = prod_next;
 
     /* write entries in ring buffer */
     ENQUEUE_PTRS();
-    __compiler_barrier();
 
-    r->prod.tail = prod_next;
+    __atomic_store_n(&r->prod.tail, prod_next, __ATOMIC_RELEASE);
+    if (r->prod.flags & RINGBUF_F_WAIT)
+        ringbuf_wake(r);
 
+    if (behavior == RINGBUF_QUEUE_VARIABLE)
+        return n;
     /* if we exceed the watermark */
     return ((mask + 1) - free_entries + n) > r->prod.watermark ? -EDQUOT : 0;
 }
 
+/* Dequeue several objects from a ring buffer (multi-consumers safe).
+ *
+ * @param r
+ *   A pointer to the ring buffer structure.
+ * @param obj_table
+ *   A pointer to a table of void * pointers (objects) that will be filled.
+ * @param n
+ *   The number of objects to dequeue from the ring buffer to the obj_table.
+ * @param behavior
+ *   RINGBUF_QUEUE_FIXED to dequeue n objects or none,
+ *   RINGBUF_QUEUE_VARIABLE to dequeue as many as possible, up to n.
+ * @return
+ *   Depend on the behavior value
+ *   if behavior = RINGBUF_QUEUE_FIXED
+ *   - 0: Success; objects dequeued.
+ *   - -ENOENT: Not enough entries in the ring buffer to dequeue; no object is
+ *     dequeued.
+ *   if behavior = RINGBUF_QUEUE_VARIABLE
+ *   - n: Actual number of objects dequeued.
+ */
+static inline int ringbuffer_mc_do_dequeue(ringbuf_t *r,
+                                           void **obj_table,
+                                           unsigned n,
+                                           enum ringbuf_queue_behavior behavior)
+{
+    uint32_t mask = r->cons.mask;
+    uint32_t cons_head, cons_next;
+    const unsigned max = n;
+
+    /* See ringbuffer_mp_do_enqueue() for the ordering of the two loads */
+    cons_head = __atomic_load_n(&r->cons.head, __ATOMIC_ACQUIRE);
+    do {
+        n = max;
+        uint32_t prod_tail = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE);
+        if (!ringbuf_fit(&n, prod_tail - cons_head, behavior))
+            return behavior == RINGBUF_QUEUE_FIXED ? -ENOENT : 0;
+        cons_next = cons_head + n;
+    } while (!__atomic_compare_exchange_n(&r->cons.head, &cons_head, cons_next,
+                                          false, __ATOMIC_ACQUIRE,
+                                          __ATOMIC_ACQUIRE));
+
+    /* copy in table */
+    DEQUEUE_PTRS();
+
+    ringbuf_wait_tail(&r->cons.tail, cons_head);
+    __atomic_store_n(&r->cons.tail, cons_next, __ATOMIC_RELEASE);
+    return behavior == RINGBUF_QUEUE_FIXED ? 0 : (int) n;
+}
+
 /* Dequeue several objects from a ring buffer (NOT multi-consumers safe).
- * When the request objects are more than the available objects, only dequeue
- * the actual number of objects
  *
  * @param r
  *   A pointer to the ring buffer structure.
@@ -257,35 +485,111 @@ static inline int ringbuffer_sp_do_enqueue(ringbuf_t *r,
  *   A pointer to a table of void * pointers (objects) that will be filled.
  * @param n
  *   The number of objects to dequeue from the ring buffer to the obj_table.
+ * @param behavior
+ *   RINGBUF_QUEUE_FIXED to dequeue n objects or none,
+ *   RINGBUF_QUEUE_VARIABLE to dequeue as many as possible, up to n.
  * @return
+ *   Depend on the behavior value
+ *   if behavior = RINGBUF_QUEUE_FIXED
  *   - 0: Success; objects dequeued.
  *   - -ENOENT: Not enough entries in the ring buffer to dequeue; no object is
  *     dequeued.
+ *   if behavior = RINGBUF_QUEUE_VARIABLE
+ *   - n: Actual number of objects dequeued.
  */
 static inline int ringbuffer_sc_do_dequeue(ringbuf_t *r,
                                            void **obj_table,
-                                           const unsigned n)
+                                           unsigned n,
+                                           enum ringbuf_queue_behavior behavior)
 {
-    uint32_t mask = r->prod.mask;
-    uint32_t cons_head = r->cons.head, prod_tail = r->prod.tail;
+    uint32_t mask = r->cons.mask;
+    uint32_t cons_head = r->cons.head;
     /* The subtraction is done between two unsigned 32-bits value (the result
      * is always modulo 32 bits even if we have cons_head > prod_tail). So
      * @entries is always between 0 and size(ring) - 1.
      */
-    uint32_t entries = prod_tail - cons_head;
+    uint32_t entries = r->cons.prod_tail - cons_head;
 
-    if (n > entries)
-        return -ENOENT;
+    /* Read the producer's line only when the cached tail is not enough */
+    if (n > entries) {
+        r->cons.prod_tail = __atomic_load_n(&r->prod.tail, __ATOMIC_ACQUIRE);
+        entries = r->cons.prod_tail - cons_head;
+    }
+
+    if (!ringbuf_fit(&n, entries, behavior))
+        return behavior == RINGBUF_QUEUE_FIXED ? -ENOENT : 0;
 
     uint32_t cons_next = cons_head + n;
     r->cons.head = cons_next;
 
     /* copy in table */
     DEQUEUE_PTRS();
-    __compiler_barrier();
 
-    r->cons.tail = cons_next;
-    return 0;
+    __atomic_store_n(&r->cons.tail, cons_next, __ATOMIC_RELEASE);
+    return behavior == RINGBUF_QUEUE_FIXED ? 0 : (int) n;
+}
+
+/* Spin this many rounds, then back off with up to WAIT_PAUSE_MAX pauses per
+ * round, before going to sleep.
+ */
+#define WAIT_SPIN 64
+#define WAIT_PAUSE_MAX 1024
+
+/* Dequeue several objects from a ring buffer, waiting for them if needed
+ * (NOT multi-consumers safe). The ring must have been created with
+ * RINGBUF_F_WAIT.
+ *
+ * @param r
+ *   A pointer to the ring buffer structure.
+ * @param obj_table
+ *   A pointer to a table of void * pointers (objects) that will be filled.
+ * @param n
+ *   The number of objects to dequeue from the ring buffer to the obj_table.
+ * @param timeout_ms
+ *   How long to wait for the objects, or forever if negative.
+ * @return
+ *   - 0: Success; objects dequeued.
+ *   - -ETIMEDOUT: Not enough entries arrived in time; no object is dequeued.
+ */
+static int ringbuffer_sc_do_dequeue_wait(ringbuf_t *r,
+                                         void **obj_table,
+                                         const unsigned n,
+                                         int timeout_ms)
+{
+    for (int i = 0; i < WAIT_SPIN; i++) {
+        if (!ringbuffer_sc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_FIXED))
+            return 0;
+    }
+    for (int pause = 1; pause <= WAIT_PAUSE_MAX; pause <<= 1) {
+        for (int i = 0; i < pause; i++)
+            cpu_relax();
+        if (!ringbuffer_sc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_FIXED))
+            return 0;
+    }
+
+    struct timespec deadline;
+    if (timeout_ms >= 0) {
+        clock_gettime(CLOCK_MONOTONIC, &deadline);
+        deadline.tv_sec += timeout_ms / 1000;
+        deadline.tv_nsec += (long) (timeout_ms % 1000) * 1000000;
+        if (deadline.tv_nsec >= 1000000000)
+            deadline.tv_sec++, deadline.tv_nsec -= 1000000000;
+    }
+    for (;;) {
+        /* Announce we sleep before the last look, see ringbuf_wake() */
+        __atomic_fetch_add(&r->wait.waiters, 1, __ATOMIC_SEQ_CST);
+        uint32_t prod_tail = r->prod.tail;
+        long ret = 0;
+        if (prod_tail - r->cons.head < n)
+            ret = syscall(SYS_futex, &r->prod.tail, FUTEX_WAIT_BITSET_PRIVATE,
+                          prod_tail, timeout_ms >= 0 ? &deadline : NULL, NULL,
+                          FUTEX_BITSET_MATCH_ANY);
+        __atomic_fetch_sub(&r->wait.waiters, 1, __ATOMIC_RELAXED);
+        if (!ringbuffer_sc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_FIXED))
+            return 0;
+        if (ret == -1 && errno == ETIMEDOUT)
+            return -ETIMEDOUT;
+    }
 }
 
 /* Enqueue one object on a ring buffer (NOT multi-producers safe).
@@ -303,7 +607,7 @@ static inline int ringbuffer_sc_do_dequeue(ringbuf_t *r,
  */
 static inline int ringbuf_sp_enqueue(ringbuf_t *r, void *obj)
 {
-    return ringbuffer_sp_do_enqueue(r, &obj, 1);
+    return ringbuffer_sp_do_enqueue(r, &obj, 1, RINGBUF_QUEUE_FIXED);
 }
 
 /**
@@ -320,7 +624,149 @@ static inline int ringbuf_sp_enqueue(ringbuf_t *r, void *obj)
  */
 static inline int ringbuf_sc_dequeue(ringbuf_t *r, void **obj_p)
 {
-    return ringbuffer_sc_do_dequeue(r, obj_p, 1);
+    return ringbuffer_sc_do_dequeue(r, obj_p, 1, RINGBUF_QUEUE_FIXED);
+}
+
+/**
+ * Dequeue one object from a ring buffer, waiting for it if the ring buffer is
+ * empty (NOT multi-consumers safe).
+ *
+ * @param r
+ *   A pointer to the ring structure, created with RINGBUF_F_WAIT.
+ * @param obj_p
+ *   A pointer to a void * pointer (object) that will be filled.
+ * @param timeout_ms
+ *   How long to wait for an object, or forever if negative.
+ * @return
+ *   - 0: Success; objects dequeued.
+ *   - -ETIMEDOUT: The ring buffer stayed empty, no object is dequeued.
+ */
+static inline int ringbuf_sc_dequeue_wait(ringbuf_t *r,
+                                          void **obj_p,
+                                          int timeout_ms)
+{
+    return ringbuffer_sc_do_dequeue_wait(r, obj_p, 1, timeout_ms);
+}
+
+/* Enqueue one object on a ring buffer (multi-producers safe).
+ *
+ * @param r
+ *   A pointer to the ring buffer structure.
+ * @param obj
+ *   A pointer to the object to be added.
+ * @return
+ *   Same as ringbuf_sp_enqueue().
+ */
+static inline int ringbuf_mp_enqueue(ringbuf_t *r, void *obj)
+{
+    return ringbuffer_mp_do_enqueue(r, &obj, 1, RINGBUF_QUEUE_FIXED);
+}
+
+/* Dequeue one object from a ring buffer (multi-consumers safe).
+ *
+ * @param r
+ *   A pointer to the ring structure.
+ * @param obj_p
+ *   A pointer to a void * pointer (object) that will be filled.
+ * @return
+ *   Same as ringbuf_sc_dequeue().
+ */
+static inline int ringbuf_mc_dequeue(ringbuf_t *r, void **obj_p)
+{
+    return ringbuffer_mc_do_dequeue(r, obj_p, 1, RINGBUF_QUEUE_FIXED);
+}
+
+/* Enqueue all the @n objects of @obj_table, or none of them.
+ *
+ * @return
+ *   - 0: Success; objects enqueued.
+ *   - -EDQUOT: Quota exceeded. The objects have been enqueued, but the
+ *     high water mark is exceeded.
+ *   - -ENOBUFS: Not enough room in the ring buffer to enqueue; no object
+ *     is enqueued.
+ */
+static inline int ringbuf_mp_enqueue_bulk(ringbuf_t *r,
+                                          void *const *obj_table,
+                                          unsigned n)
+{
+    return ringbuffer_mp_do_enqueue(r, obj_table, n, RINGBUF_QUEUE_FIXED);
+}
+
+static inline int ringbuf_sp_enqueue_bulk(ringbuf_t *r,
+                                          void *const *obj_table,
+                                          unsigned n)
+{
+    return ringbuffer_sp_do_enqueue(r, obj_table, n, RINGBUF_QUEUE_FIXED);
+}
+
+/* Enqueue up to @n objects of @obj_table.
+ *
+ * @return
+ *   The number of objects enqueued, from 0 to n.
+ */
+static inline unsigned ringbuf_mp_enqueue_burst(ringbuf_t *r,
+                                                void *const *obj_table,
+                                                unsigned n)
+{
+    return ringbuffer_mp_do_enqueue(r, obj_table, n, RINGBUF_QUEUE_VARIABLE);
+}
+
+static inline unsigned ringbuf_sp_enqueue_burst(ringbuf_t *r,
+                                                void *const *obj_table,
+                                                unsigned n)
+{
+    return ringbuffer_sp_do_enqueue(r, obj_table, n, RINGBUF_QUEUE_VARIABLE);
+}
+
+/* Dequeue @n objects into @obj_table, or none of them.
+ *
+ * @return
+ *   - 0: Success; objects dequeued.
+ *   - -ENOENT: Not enough entries in the ring buffer to dequeue, no object
+ *     is dequeued.
+ */
+static inline int ringbuf_mc_dequeue_bulk(ringbuf_t *r,
+                                          void **obj_table,
+                                          unsigned n)
+{
+    return ringbuffer_mc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_FIXED);
+}
+
+static inline int ringbuf_sc_dequeue_bulk(ringbuf_t *r,
+                                          void **obj_table,
+                                          unsigned n)
+{
+    return ringbuffer_sc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_FIXED);
+}
+
+/* Dequeue up to @n objects into @obj_table.
+ *
+ * @return
+ *   The number of objects dequeued, from 0 to n.
+ */
+static inline unsigned ringbuf_mc_dequeue_burst(ringbuf_t *r,
+                                                void **obj_table,
+                                                unsigned n)
+{
+    return ringbuffer_mc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_VARIABLE);
+}
+
+static inline unsigned ringbuf_sc_dequeue_burst(ringbuf_t *r,
+                                                void **obj_table,
+                                                unsigned n)
+{
+    return ringbuffer_sc_do_dequeue(r, obj_table, n, RINGBUF_QUEUE_VARIABLE);
+}
+
+/* Return the number of entries in a ring buffer.
+ *
+ * @param r
+ *   A pointer to the ring structure.
+ */
+static inline unsigned ringbuf_count(const ringbuf_t *r)
+{
+    uint32_t prod_tail = r->prod.tail, cons_tail = r->cons.tail;
+    return (prod_tail - cons_tail) & r->prod.mask;
 }
 
 /* Test if a ring buffer is full.
@@ -352,24 +798,179 @@ static inline bool ringbuf_is_empty(const ringbuf_t *r)
 }
 
 #include <assert.h>
+#include <pthread.h>
+
+#define N_BURSTS 20
+#define BURST 16
+
+/* A bursty producer, idle long enough between bursts for the consumer to
+ * fall asleep.
+ */
+static void *producer(void *arg)
+{
+    ringbuf_t *r = arg;
+    for (intptr_t i = 0; i < N_BURSTS * BURST; i++) {
+        if (i % BURST == 0)
+            usleep(2000);
+        while (ringbuf_sp_enqueue(r, (void *) i) == -ENOBUFS)
+            ;
+    }
+    return NULL;
+}
+
+#define N_PRODUCERS 4
+#define N_CONSUMERS 4
+#define N_ITEMS (1 << 16) /* per producer */
+#define BATCH 8
+
+static _Atomic uintptr_t consumed_sum;
+static _Atomic unsigned consumed;
+
+/* Every producer enqueues the values 1 to N_ITEMS, in bulks and bursts */
+static void *mp_producer(void *arg)
+{
+    ringbuf_t *r = arg;
+    void *objs[BATCH];
+    uintptr_t v = 1;
+    while (v <= N_ITEMS) {
+        unsigned n = N_ITEMS + 1 - v < BATCH ? N_ITEMS + 1 - v : BATCH;
+        for (unsigned i = 0; i < n; i++)
+            objs[i] = (void *) (v + i);
+        if (v & BATCH)
+            n = ringbuf_mp_enqueue_burst(r, objs, n);
+        else if (ringbuf_mp_enqueue_bulk(r, objs, n) == -ENOBUFS)
+            n = 0;
+        if (!n)
+            sched_yield();
+        v += n;
+    }
+    return NULL;
+}
+
+static void *mc_consumer(void *arg)
+{
+    ringbuf_t *r = arg;
+    void *objs[BATCH];
+    uintptr_t sum = 0;
+    unsigned bursts = 0;
+    while (consumed < N_PRODUCERS * N_ITEMS) {
+        unsigned n = bursts++ & 1 ? ringbuf_mc_dequeue_burst(r, objs, BATCH)
+                     : ringbuf_mc_dequeue_bulk(r, objs, BATCH / 2) == 0
+                         ? BATCH / 2
+                         : 0;
+        if (!n) {
+            sched_yield();
+            continue;
+        }
+        for (unsigned i = 0; i < n; i++)
+            sum += (uintptr_t) objs[i];
+        consumed += n;
+    }
+    consumed_sum += sum;
+    return NULL;
+}
+
+/* Each value is dequeued once: the sum of all of them comes out */
+static void test_mpmc(void)
+{
+    pthread_t prod[N_PRODUCERS], cons[N_CONSUMERS];
+    ringbuf_t *r = ringbuf_create((1 << 8), 0);
+    assert(r);
+
+    for (int i = 0; i < N_CONSUMERS; i++)
+        pthread_create(&cons[i], NULL, mc_consumer, r);
+    for (int i = 0; i < N_PRODUCERS; i++)
+        pthread_create(&prod[i], NULL, mp_producer, r);
+    for (int i = 0; i < N_PRODUCERS; i++)
+        pthread_join(prod[i], NULL);
+
+    /* Fewer entries left than a bulk dequeue takes */
+    void *obj;
+    while (ringbuf_mc_dequeue(r, &obj) == 0) {
+        consumed_sum += (uintptr_t) obj;
+        consumed++;
+    }
+    for (int i = 0; i < N_CONSUMERS; i++)
+        pthread_join(cons[i], NULL);
+
+    assert(consumed == N_PRODUCERS * N_ITEMS);
+    assert(consumed_sum ==
+           (uintptr_t) N_PRODUCERS * N_ITEMS * (N_ITEMS + 1) / 2);
+    assert(ringbuf_is_empty(r));
+    ringbuf_free(r);
+}
+
+/* Bulk operations are all or nothing, bursts take what fits */
+static void test_bulk_burst(void)
+{
+    void *objs[64], *out[64];
+    ringbuf_t *r = ringbuf_create((1 << 5), 0);
+    assert(r);
+
+    for (uintptr_t i = 0; i < 64; i++)
+        objs[i] = (void *) i;
+    assert(ringbuf_sp_enqueue_bulk(r, objs, 32) == -ENOBUFS);
+    assert(ringbuf_sp_enqueue_bulk(r, objs, 20) == 0);
+    assert(ringbuf_sp_enqueue_burst(r, objs + 20, 20) == 11);
+    assert(ringbuf_is_full(r) && ringbuf_count(r) == 31);
+    assert(ringbuf_sp_enqueue_burst(r, objs, 1) == 0);
+
+    assert(ringbuf_sc_dequeue_bulk(r, out, 32) == -ENOENT);
+    assert(ringbuf_sc_dequeue_bulk(r, out, 25) == 0);
+    assert(ringbuf_sc_dequeue_burst(r, out + 25, 10) == 6);
+    assert(ringbuf_sc_dequeue_burst(r, out, 1) == 0);
+    for (uintptr_t i = 0; i < 31; i++)
+        assert(out[i] == (void *) i);
+
+    /* The indexes wrap around the end of the ring */
+    assert(ringbuf_mp_enqueue_bulk(r, objs, 30) == 0);
+    assert(ringbuf_mc_dequeue_burst(r, out, 64) == 30);
+    for (uintptr_t i = 0; i < 30; i++)
+        assert(out[i] == (void *) i);
+
+    ringbuf_free(r);
+}
 
 int main(void)
 {
-    ringbuf_t *r = ringbuf_create((1 << 6));
+    ringbuf_t *r = ringbuf_create((1 << 6), 0);
     if (!r) {
         printf("Fail to create ring buffer.\n");
         return -1;
     }
 
     for (int i = 0; !ringbuf_is_full(r); i++)
-        ringbuf_sp_enqueue(r, *(void **) &i);
+        ringbuf_sp_enqueue(r, (void *) (intptr_t) i);
 
     for (int i = 0; !ringbuf_is_empty(r); i++) {
         void *obj;
         ringbuf_sc_dequeue(r, &obj);
-        assert(i == *(int *) &obj);
+        assert(i == (int) (intptr_t) obj);
     }
 
     ringbuf_free(r);
+
+    r = ringbuf_create((1 << 6), RINGBUF_F_WAIT);
+    if (!r) {
+        printf("Fail to create ring buffer.\n");
+        return -1;
+    }
+
+    void *obj;
+    assert(ringbuf_sc_dequeue_wait(r, &obj, 10) == -ETIMEDOUT);
+
+    pthread_t tid;
+    pthread_create(&tid, NULL, producer, r);
+    for (intptr_t i = 0; i < N_BURSTS * BURST; i++) {
+        int ret = ringbuf_sc_dequeue_wait(r, &obj, -1);
+        assert(ret == 0 && obj == (void *) i);
+        (void) ret;
+    }
+    pthread_join(tid, NULL);
+
+    ringbuf_free(r);
+
+    test_bulk_burst();
+    test_mpmc();
     return 0;
 }
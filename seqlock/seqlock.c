@@ -113,6 +113,30 @@ void seqlock_release_wr(seqlock_t *sync)
     __atomic_store_n(sync, cur + 1, __ATOMIC_RELEASE);
 }
 
+/* Vector copies for the payloads aligned on VEC_SIZE */
+#if defined(__SSE2__)
+#include <emmintrin.h>
+#define VEC_SIZE 16
+#define VEC_COPY(_d, _s, _sz)                                         \
+    ({                                                                \
+        _mm_store_si128((__m128i *) (_d),                             \
+                        _mm_load_si128((const __m128i *) (_s)));      \
+        _d += VEC_SIZE;                                               \
+        _s += VEC_SIZE;                                               \
+        _sz -= VEC_SIZE;                                              \
+    })
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#define VEC_SIZE 16
+#define VEC_COPY(_d, _s, _sz)                                         \
+    ({                                                                \
+        vst1q_u8((uint8_t *) (_d), vld1q_u8((const uint8_t *) (_s))); \
+        _d += VEC_SIZE;                                               \
+        _s += VEC_SIZE;                                               \
+        _sz -= VEC_SIZE;                                              \
+    })
+#endif
+
 #define ATOMIC_COPY(_d, _s, _sz, _type)                                      \
     ({                                                                       \
         _type val = __atomic_load_n((const _type *) (_s), __ATOMIC_RELAXED); \
@@ -122,8 +146,39 @@ void seqlock_release_wr(seqlock_t *sync)
         _sz -= sizeof(_type);                                                \
     })
 
+#define WORD_ALIGN (sizeof(uintptr_t) - 1)
+
+/* The copy races with the writers, and a reader discards it when the sequence
+ * changed, so the copy need not be atomic as a whole: it only has to read
+ * every location once. The vector loads and stores are plain accesses, which
+ * the seqlock barriers keep within the critical section.
+ */
 static inline void atomic_memcpy(char *dst, const char *src, size_t sz)
 {
+#ifdef VEC_SIZE
+    if (!(((uintptr_t) dst | (uintptr_t) src) & (VEC_SIZE - 1))) {
+        while (sz >= 4 * VEC_SIZE) {
+            VEC_COPY(dst, src, sz);
+            VEC_COPY(dst, src, sz);
+            VEC_COPY(dst, src, sz);
+            VEC_COPY(dst, src, sz);
+        }
+        while (sz >= VEC_SIZE)
+            VEC_COPY(dst, src, sz);
+    }
+#endif
+
+    /* Words need both pointers aligned, which the head bytes do when they are
+     * misaligned by as much. Otherwise the copy goes byte by byte.
+     */
+    if (((uintptr_t) dst ^ (uintptr_t) src) & WORD_ALIGN) {
+        while (sz)
+            ATOMIC_COPY(dst, src, sz, uint8_t);
+        return;
+    }
+    while (sz && ((uintptr_t) dst & WORD_ALIGN))
+        ATOMIC_COPY(dst, src, sz, uint8_t);
+
 #if __SIZEOF_POINTER__ == 8
     while (sz >= sizeof(uint64_t))
         ATOMIC_COPY(dst, src, sz, uint64_t);
@@ -154,3 +209,49 @@ void seqlock_write(seqlock_t *sync, const void *src, void *data, size_t len)
     atomic_memcpy(data, src, len);
     seqlock_release_wr(sync);
 }
+
+seqlock_t seqlock_read_begin(const seqlock_t *sync)
+{
+    return seqlock_acquire_rd(sync);
+}
+
+bool seqlock_read_retry(const seqlock_t *sync, seqlock_t seq)
+{
+    return !seqlock_release_rd(sync, seq);
+}
+
+void seqlock_ticket_init(seqlock_ticket_t *lock)
+{
+    seqlock_init(&lock->seq);
+    lock->next = 0;
+    lock->owner = 0;
+}
+
+void seqlock_ticket_acquire_wr(seqlock_ticket_t *lock)
+{
+    uint32_t ticket = __atomic_fetch_add(&lock->next, 1, __ATOMIC_RELAXED);
+
+    /* Synchronize with the release of the previous writer */
+    while (__atomic_load_n(&lock->owner, __ATOMIC_ACQUIRE) != ticket)
+        spin_wait();
+
+    /* The only writer, no need for a CAS */
+    __atomic_store_n(&lock->seq, lock->seq + SEQLOCK_WRITER, __ATOMIC_RELAXED);
+    __atomic_thread_fence(__ATOMIC_RELEASE);
+}
+
+void seqlock_ticket_release_wr(seqlock_ticket_t *lock)
+{
+    seqlock_release_wr(&lock->seq);
+    __atomic_store_n(&lock->owner, lock->owner + 1, __ATOMIC_RELEASE);
+}
+
+void seqlock_ticket_write(seqlock_ticket_t *lock,
+                          const void *src,
+                          void *data,
+                          size_t len)
+{
+    seqlock_ticket_acquire_wr(lock);
+    atomic_memcpy(data, src, len);
+    seqlock_ticket_release_wr(lock);
+}
@@ -29,6 +29,26 @@ void seqlock_acquire_wr(seqlock_t *sync);
 /* Release a write seqlock */
 void seqlock_release_wr(seqlock_t *sync);
 
+/* Optimistic read of custom fields, without copying them:
+ *
+ *     do {
+ *         seq = seqlock_read_begin(&sync);
+ *         x = seqlock_load(&data->x);
+ *         y = seqlock_load(&data->y);
+ *     } while (seqlock_read_retry(&sync, seq));
+ *
+ * The fields may change under the reader, which must not act on them, e.g.
+ * follow a pointer, before seqlock_read_retry() returned false.
+ */
+seqlock_t seqlock_read_begin(const seqlock_t *sync);
+
+/* Return true if a write has occurred or is in progress since "seq" */
+bool seqlock_read_retry(const seqlock_t *sync, seqlock_t seq);
+
+/* Load or store a field of the protected data, up to the size of a pointer */
+#define seqlock_load(ptr) __atomic_load_n((ptr), __ATOMIC_RELAXED)
+#define seqlock_store(ptr, val) __atomic_store_n((ptr), (val), __ATOMIC_RELAXED)
+
 /* Perform an atomic read of the associated data
  * Will block for concurrent writes
  */
@@ -38,3 +58,24 @@ void seqlock_read(seqlock_t *sync, void *dst, const void *data, size_t len);
  * Will block for concurrent writes
  */
 void seqlock_write(seqlock_t *sync, const void *src, void *data, size_t len);
+
+/* A seqlock whose writers are served in FIFO order by an embedded ticket
+ * lock, so that none of them starves under contention. Readers use "seq"
+ * with the functions above; the writers must only use the functions below.
+ */
+typedef struct {
+    seqlock_t seq;
+    uint32_t next, owner;
+} seqlock_ticket_t;
+
+void seqlock_ticket_init(seqlock_ticket_t *lock);
+
+/* Acquire for writing, blocking until the earlier writers have released */
+void seqlock_ticket_acquire_wr(seqlock_ticket_t *lock);
+
+void seqlock_ticket_release_wr(seqlock_ticket_t *lock);
+
+void seqlock_ticket_write(seqlock_ticket_t *lock,
+                          const void *src,
+                          void *data,
+                          size_t len);
@@ -1,9 +1,100 @@
+#include <pthread.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <string.h>
 
 #include "expect.h"
 #include "seqlock.h"
 
+#define SNAPSHOT_WORDS 32 /* 256 bytes */
+#define N_WRITERS 4
+#define N_READERS 4
+#define N_WRITES 20000
+
+static seqlock_ticket_t snap_lock;
+static uint64_t snapshot[SNAPSHOT_WORDS] __attribute__((aligned(64)));
+static int writers_done;
+
+/* Every write fills the snapshot with one value, a torn read would mix two */
+static void *snap_writer(void *arg)
+{
+    uint64_t buf[SNAPSHOT_WORDS] __attribute__((aligned(64)));
+    uint64_t id = (uintptr_t) arg;
+
+    for (uint64_t i = 1; i <= N_WRITES; i++) {
+        for (int w = 0; w < SNAPSHOT_WORDS; w++)
+            buf[w] = i << 8 | id;
+        seqlock_ticket_write(&snap_lock, buf, snapshot, sizeof(snapshot));
+    }
+    __atomic_fetch_add(&writers_done, 1, __ATOMIC_RELEASE);
+    return NULL;
+}
+
+static void *snap_reader(void *arg)
+{
+    uint64_t buf[SNAPSHOT_WORDS] __attribute__((aligned(64)));
+    (void) arg;
+
+    while (__atomic_load_n(&writers_done, __ATOMIC_ACQUIRE) < N_WRITERS) {
+        seqlock_read(&snap_lock.seq, buf, snapshot, sizeof(snapshot));
+        for (int w = 1; w < SNAPSHOT_WORDS; w++)
+            EXPECT(buf[w] == buf[0]);
+
+        /* The same check on the fields, without copying them */
+        seqlock_t seq;
+        uint64_t first, last;
+        do {
+            seq = seqlock_read_begin(&snap_lock.seq);
+            first = seqlock_load(&snapshot[0]);
+            last = seqlock_load(&snapshot[SNAPSHOT_WORDS - 1]);
+        } while (seqlock_read_retry(&snap_lock.seq, seq));
+        EXPECT(first == last);
+    }
+    return NULL;
+}
+
+static void test_snapshot(void)
+{
+    pthread_t writers[N_WRITERS], readers[N_READERS];
+
+    seqlock_ticket_init(&snap_lock);
+    for (int i = 0; i < N_READERS; i++)
+        pthread_create(&readers[i], NULL, snap_reader, NULL);
+    for (int i = 0; i < N_WRITERS; i++)
+        pthread_create(&writers[i], NULL, snap_writer, (void *) (uintptr_t) i);
+    for (int i = 0; i < N_WRITERS; i++)
+        pthread_join(writers[i], NULL);
+    for (int i = 0; i < N_READERS; i++)
+        pthread_join(readers[i], NULL);
+
+    /* Every write bumped the sequence by two */
+    EXPECT(snap_lock.seq == 2 * N_WRITERS * N_WRITES);
+    EXPECT(snap_lock.owner == N_WRITERS * N_WRITES);
+}
+
+/* Copies of every alignment and length, around the vector and word paths */
+static void test_unaligned(void)
+{
+    char src[96] __attribute__((aligned(16)));
+    char dst[96] __attribute__((aligned(16)));
+    seqlock_t sync;
+
+    seqlock_init(&sync);
+    for (int i = 0; i < (int) sizeof(src); i++)
+        src[i] = i + 1;
+    for (int s = 0; s < 16; s++) {
+        for (int d = 0; d < 16; d++) {
+            for (int len = 0; len <= 64; len++) {
+                memset(dst, 0, sizeof(dst));
+                seqlock_read(&sync, dst + d, src + s, len);
+                EXPECT(memcmp(dst + d, src + s, len) == 0);
+                EXPECT(dst[d + len] == 0);
+                EXPECT(d == 0 || dst[d - 1] == 0);
+            }
+        }
+    }
+}
+
 int main(void)
 {
     seqlock_t sync;
@@ -19,5 +110,13 @@ int main(void)
     EXPECT(strncmp(data, "Mary had a little lamb", 23) == 0);
     EXPECT(data[23] == (char) 255);
 
+    s = seqlock_read_begin(&sync);
+    EXPECT(seqlock_read_retry(&sync, s) == false);
+    seqlock_write(&sync, "Its fleece was white", data, 20);
+    EXPECT(seqlock_read_retry(&sync, s) == true);
+
+    test_unaligned();
+    test_snapshot();
+
     return 0;
 }
@@ -5,6 +5,11 @@
  * Known issue: if one has multiple consumers, some of them will be swapped
  * off the CPU after grabbing curr_dequeue, and will have dequeued an element
  * from a different node, if that node ends up having free space.
+ *
+ * The nodes double in capacity up to a maximum. Once the backlog is drained,
+ * the producer keeps one empty node ahead and retires the others through
+ * QSBR, since a consumer swapped off may still hold one of them: consumers
+ * join with spmc_join() and pass quiescent states after each dequeue.
  */
 
 #include <assert.h>
@@ -15,6 +20,8 @@
 #include <stdint.h>
 #include <stdlib.h>
 
+#include "qsbr.h"
+
 typedef struct __spmc_node {
     size_t cap; /* One more than the number of slots available */
     _Atomic size_t front, back;
@@ -26,12 +33,16 @@ typedef void (*spmc_destructor_t)(uintptr_t);
 struct spmc_base {
     /* current node which enqueues/dequeues */
     spmc_node_t *_Atomic curr_enqueue, *_Atomic curr_dequeue;
-    uint8_t last_power;
+    uint8_t max_power;
     spmc_destructor_t destructor;
+    qsbr_t *qsbr;
+    qsbr_tls_t *producer; /* offline, it only retires nodes */
 };
 typedef struct spmc_base *spmc_ref_t;
+typedef qsbr_tls_t spmc_consumer_t;
 
 #define DEFAULT_INITIAL_POWER 6 /* Initial capacity: 64, as a power of two */
+#define DEFAULT_MAX_POWER 14    /* Largest node: 16384 slots, 128 KiB */
 
 #define SIZE_FROM_CAP(cap, offset) ((cap) * sizeof(uintptr_t) + (offset))
 
@@ -53,30 +64,57 @@ static void init_node(spmc_node_t *node, spmc_node_t *next, size_t cap)
     atomic_init(&node->next, next);
 }
 
-/* In the event initial_cap is 0, the spmc will select a default capacity.
- * Takes capacities as powers of two. i.e., initial_cap argument of 4 =>
- * an allocation of ~16 machine words.
+/* In the event initial_cap or max_cap is 0, the spmc will select a default
+ * capacity. Takes capacities as powers of two. i.e., initial_cap argument of
+ * 4 => an allocation of ~16 machine words.
  */
-spmc_ref_t spmc_new(size_t initial_cap, spmc_destructor_t destructor)
+spmc_ref_t spmc_new(size_t initial_cap,
+                    size_t max_cap,
+                    spmc_destructor_t destructor)
 {
     assert(initial_cap < sizeof(size_t) * CHAR_BIT);
+    assert(max_cap < sizeof(size_t) * CHAR_BIT);
     const uint8_t power = initial_cap ? initial_cap : DEFAULT_INITIAL_POWER;
     const size_t cap = 1 << power;
 
     /* Allocate spmc_base and head spmc_node in the same underlying buffer */
     spmc_ref_t spmc = malloc(
         SIZE_FROM_CAP(cap, sizeof(struct spmc_base) + sizeof(spmc_node_t)));
+    if (!spmc)
+        return NULL;
+    if (!(spmc->qsbr = qsbr_create()) ||
+        !(spmc->producer = qsbr_register(spmc->qsbr))) {
+        if (spmc->qsbr)
+            qsbr_destroy(spmc->qsbr);
+        free(spmc);
+        return NULL;
+    }
+    qsbr_offline(spmc->producer);
+
     spmc_node_t *const head = HEAD_OF(spmc);
     init_node(head, head, cap);
 
     atomic_init(&spmc->curr_enqueue, head);
     atomic_init(&spmc->curr_dequeue, head);
     spmc->destructor = destructor;
-    spmc->last_power = power;
+    spmc->max_power = max_cap ? max_cap : DEFAULT_MAX_POWER;
+    if (spmc->max_power < power)
+        spmc->max_power = power;
 
     return spmc;
 }
 
+/* Register the calling consumer, which must leave before spmc_delete() */
+spmc_consumer_t *spmc_join(spmc_ref_t spmc)
+{
+    return qsbr_register(spmc->qsbr);
+}
+
+void spmc_leave(spmc_consumer_t *consumer)
+{
+    qsbr_unregister(consumer);
+}
+
 /* Destroy the SPMC, freeing all nodes/elements now assoicated with it.
  * Assume all users of the channel are done with it.
  */
@@ -94,10 +132,39 @@ void spmc_delete(spmc_ref_t spmc)
              prev = node, node = node->next, free(prev))
             ;
     }
+    /* The retired nodes are freed with the QSBR */
+    qsbr_unregister(spmc->producer);
+    qsbr_destroy(spmc->qsbr);
+
     /* Also frees the head; it resides reside in the same buffer. */
     free(spmc);
 }
 
+/* The nodes from "keep" till "curr_dequeue" were drained, and consumers
+ * do not come back to them: keep the first one for the next writes, and
+ * retire the others. The head cannot be freed, it stays in the ring.
+ */
+static void spmc_trim(spmc_ref_t spmc,
+                      spmc_node_t *keep,
+                      spmc_node_t *curr_dequeue)
+{
+    spmc_node_t *prev = keep, *node;
+
+    while ((node = atomic_load_explicit(&prev->next, memory_order_relaxed)) !=
+           curr_dequeue) {
+        if (node == HEAD_OF(spmc)) {
+            prev = node;
+            continue;
+        }
+        atomic_store_explicit(
+            &prev->next,
+            atomic_load_explicit(&node->next, memory_order_relaxed),
+            memory_order_release);
+        qsbr_retire(spmc->producer, node,
+                    SIZE_FROM_CAP(node->cap, sizeof(spmc_node_t)), free);
+    }
+}
+
 /* Send (enqueue) an item onto the SPMC */
 bool spmc_enqueue(spmc_ref_t spmc, uintptr_t element)
 {
@@ -109,18 +176,21 @@ retry:
     if (!IS_WRITABLE(idx, node)) {
         spmc_node_t *const next =
             atomic_load_explicit(&node->next, memory_order_relaxed);
+        spmc_node_t *const curr_dequeue =
+            atomic_load_explicit(&spmc->curr_dequeue, memory_order_relaxed);
         /* Never move to write on top of the node that is currently being read;
          * In that case, items would be read out of order they were enqueued.
          */
-        if (next !=
-            atomic_load_explicit(&spmc->curr_dequeue, memory_order_relaxed)) {
+        if (next != curr_dequeue) {
+            spmc_trim(spmc, next, curr_dequeue);
             node = next;
             goto retry;
         }
 
-        const uint8_t power = ++spmc->last_power;
-        assert(power < sizeof(size_t) * CHAR_BIT);
-        const size_t cap = 1 << power;
+        /* Double the capacity, up to the maximum */
+        size_t cap = node->cap;
+        if (cap < (size_t) 1 << spmc->max_power)
+            cap <<= 1;
         spmc_node_t *new_node = malloc(SIZE_FROM_CAP(cap, sizeof(spmc_node_t)));
         if (!new_node)
             return false;
@@ -136,26 +206,66 @@ retry:
     return true;
 }
 
-/* Recieve (dequeue) an item from the SPMC */
-bool spmc_dequeue(spmc_ref_t spmc, uintptr_t *slot)
+/* Recieve (dequeue) up to n items from the SPMC, claimed with a single CAS.
+ * Return how many were stored in slots, 0 if the SPMC is empty.
+ */
+size_t spmc_trydequeue_batch(spmc_ref_t spmc,
+                             spmc_consumer_t *consumer,
+                             uintptr_t *slots,
+                             size_t n)
 {
     spmc_node_t *node =
         atomic_load_explicit(&spmc->curr_dequeue, memory_order_consume);
-    size_t idx;
-no_increment:
-    do {
+    size_t idx, count;
+
+    assert(n > 0);
+    for (;;) {
         idx = atomic_load_explicit(&node->front, memory_order_consume);
         if (!IS_READABLE(idx, node)) {
-            if (node != spmc->curr_enqueue)
+            if (node != spmc->curr_enqueue) {
                 atomic_compare_exchange_strong(
                     &spmc->curr_dequeue, &node,
                     atomic_load_explicit(&node->next, memory_order_consume));
-            goto no_increment;
-        } else
-            *slot = node->buf[INDEX_OF(idx, node)];
-    } while (
-        !atomic_compare_exchange_weak(&node->front, &(size_t){idx}, idx + 1));
-    return true;
+                continue;
+            }
+            count = 0;
+            break;
+        }
+
+        count = node->back - idx;
+        if (count > n)
+            count = n;
+        for (size_t i = 0; i < count; i++)
+            slots[i] = node->buf[INDEX_OF(idx + i, node)];
+        if (atomic_compare_exchange_weak(&node->front, &idx, idx + count))
+            break;
+    }
+
+    /* No node is referenced anymore */
+    qsbr_checkpoint(consumer);
+    return count;
+}
+
+/* Recieve (dequeue) up to n items from the SPMC, at least one, claimed with
+ * a single CAS. Return how many were stored in slots.
+ */
+size_t spmc_dequeue_batch(spmc_ref_t spmc,
+                          spmc_consumer_t *consumer,
+                          uintptr_t *slots,
+                          size_t n)
+{
+    size_t count;
+
+    /* Empty: let the grace periods go by while waiting */
+    while (!(count = spmc_trydequeue_batch(spmc, consumer, slots, n)))
+        ;
+    return count;
+}
+
+/* Recieve (dequeue) an item from the SPMC */
+bool spmc_dequeue(spmc_ref_t spmc, spmc_consumer_t *consumer, uintptr_t *slot)
+{
+    return spmc_dequeue_batch(spmc, consumer, slot, 1) == 1;
 }
 
 #include <pthread.h>
@@ -174,37 +284,74 @@ static void *producer_thread(void *arg)
 }
 
 #define N_MC_ITEMS (1024UL * 8)
-static _Atomic size_t observed_count[N_MC_ITEMS + 1];
+#define N_MC_THREADS 16
+/* Room for the sentinels, one per consumer */
+static _Atomic size_t observed_count[N_MC_ITEMS + N_MC_THREADS];
+
+#define BATCH 8
+static _Atomic int mc_batched; /* every other consumer dequeues in batches */
 
 static void *mc_thread(void *arg)
 {
     spmc_ref_t spmc = arg;
-    uintptr_t element = 0, greatest = 0;
+    spmc_consumer_t *consumer = spmc_join(spmc);
+    const size_t batch = atomic_fetch_add(&mc_batched, 1) % 2 ? BATCH : 1;
+    uintptr_t elements[BATCH], greatest = 0;
+    bool done = false;
 
-    for (;;) {
-        greatest = (greatest > element) ? greatest : element;
-        if (!spmc_dequeue(spmc, &element))
+    while (!done) {
+        size_t n = spmc_dequeue_batch(spmc, consumer, elements, batch);
+        if (!n)
             fprintf(stderr, "Failed to dequeue in mc_thread.\n");
-        else if (observed_count[element]++)
-            fprintf(stderr, "Consumed twice!\n");
-        else if (element < greatest)
-            fprintf(stderr, "%zu after %zu; bad order!\n", (size_t) element,
-                    (size_t) greatest);
-        printf("Observed %zu.\n", (size_t) element);
-
-        /* Test for sentinel signalling termination */
-        if (element >= (N_MC_ITEMS - 1)) {
-            spmc_enqueue(spmc, element + 1); /* notify other threads */
-            break;
+        for (size_t i = 0; i < n; i++) {
+            uintptr_t element = elements[i];
+            if (observed_count[element]++)
+                fprintf(stderr, "Consumed twice!\n");
+            else if (element < greatest)
+                fprintf(stderr, "%zu after %zu; bad order!\n",
+                        (size_t) element, (size_t) greatest);
+            greatest = (greatest > element) ? greatest : element;
+            printf("Observed %zu.\n", (size_t) element);
+
+            /* Test for sentinel signalling termination */
+            if (element >= (N_MC_ITEMS - 1)) {
+                spmc_enqueue(spmc, element + 1); /* notify other threads */
+                done = true;
+            }
         }
     }
+    spmc_leave(consumer);
     return NULL;
 }
 
-#define N_MC_THREADS 16
+/* Grow the ring with a backlog, drain it, and go on past the drained nodes,
+ * which get retired.
+ */
+#define N_BURST (1024UL * 64)
+static void burst_test(spmc_ref_t spmc)
+{
+    spmc_consumer_t *consumer = spmc_join(spmc);
+    uintptr_t elements[BATCH], expected = 0;
+
+    for (int round = 0; round < 4; round++) {
+        for (uintptr_t i = 0; i < N_BURST; i++)
+            spmc_enqueue(spmc, expected + i);
+        for (size_t n = 0; n < N_BURST;) {
+            size_t got = spmc_dequeue_batch(spmc, consumer, elements, BATCH);
+            for (size_t i = 0; i < got; i++, expected++) {
+                if (elements[i] != expected)
+                    fprintf(stderr, "Burst: %zu instead of %zu.\n",
+                            (size_t) elements[i], (size_t) expected);
+            }
+            n += got;
+        }
+    }
+    spmc_leave(consumer);
+}
+
 int main()
 {
-    spmc_ref_t spmc = spmc_new(0, NULL);
+    spmc_ref_t spmc = spmc_new(0, 0, NULL);
     pthread_t mc[N_MC_THREADS], producer;
 
     pthread_create(&producer, NULL, producer_thread, spmc);
@@ -221,5 +368,9 @@ int main()
         fprintf(stderr, "An item seen %zu times: %zu.\n", observed_count[i], i);
     }
     spmc_delete(spmc);
+
+    spmc = spmc_new(0, 0, NULL);
+    burst_test(spmc);
+    spmc_delete(spmc);
     return 0;
 }
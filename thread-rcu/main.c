@@ -47,6 +47,7 @@ static DEFINE_BARRIER(test_barrier);
 
 struct test {
     unsigned int count;
+    struct rcu_head rcu;
 };
 static struct test __rcu *dut;
 static atomic_uint gp_idx;
@@ -98,6 +99,18 @@ static void *reader_func(void *argv)
     pthread_exit(NULL);
 }
 
+/* Called after a grace period, readers can no longer see the old value */
+static void free_test(struct rcu_head *head)
+{
+    atomic_fetch_add_explicit(&gp_idx, 1, memory_order_release);
+    free(container_of(head, struct test, rcu));
+}
+
+static void free_late(struct rcu_head *head)
+{
+    free(container_of(head, struct test, rcu));
+}
+
 static void *updater_func(void *argv)
 {
     struct test *oldp;
@@ -111,9 +124,7 @@ static void *updater_func(void *argv)
         newval = malloc(sizeof(struct test));
         newval->count = i;
         oldp = rcu_assign_pointer(dut, newval);
-        synchronize_rcu();
-        atomic_fetch_add_explicit(&gp_idx, 1, memory_order_release);
-        free(oldp);
+        call_rcu(&oldp->rcu, free_test);
     }
 
     pthread_exit(NULL);
@@ -136,9 +147,15 @@ int main(int argc, char *argv[])
         pthread_join(reader[i], NULL);
     pthread_join(updater, NULL);
 
+    rcu_barrier();
     free(rcu_uncheck(dut));
     rcu_clean();
 
+    /* call_rcu() starts over after rcu_clean() */
+    call_rcu(&((struct test *) malloc(sizeof(struct test)))->rcu, free_late);
+    rcu_barrier();
+    rcu_clean();
+
     atomic_thread_fence(memory_order_seq_cst);
 
     printf("%u reader(s), %u update run(s), %u grace period(s)\n", N_READERS,
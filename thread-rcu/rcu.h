@@ -12,7 +12,10 @@
 /* lock primitives derived from POSIX Threads and compiler primitives */
 
 #include <pthread.h>
+#include <sched.h>
 #include <stdatomic.h>
+#include <stdbool.h>
+#include <stddef.h>
 #include <stdio.h>
 #include <stdlib.h>
 
@@ -52,6 +55,51 @@ static inline void spin_unlock(spinlock_t *sp)
 /* Compiler barrier, preventing the compiler from reordering memory accesses */
 #define barrier() __asm__ __volatile__("" : : : "memory")
 
+/* Asymmetric barriers
+ *
+ * With the membarrier() system call, the update-side forces a full barrier
+ * on every running thread of the process. The read-side then only needs a
+ * compiler barrier, smp_mb_light(), where it would otherwise need smp_mb(),
+ * and pays for it with a system call in the update-side, smp_mb_heavy(). The
+ * fallback where membarrier() is missing is a full barrier on both sides.
+ */
+#ifdef __linux__
+#include <linux/membarrier.h>
+#include <sys/syscall.h>
+#include <unistd.h>
+#endif
+
+static atomic_bool rcu_has_membarrier;
+
+static inline void rcu_membarrier_init(void)
+{
+#ifdef __linux__
+    long cmds = syscall(__NR_membarrier, MEMBARRIER_CMD_QUERY, 0, 0);
+    if (cmds > 0 && (cmds & MEMBARRIER_CMD_PRIVATE_EXPEDITED) &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_REGISTER_PRIVATE_EXPEDITED, 0,
+                 0))
+        atomic_store_explicit(&rcu_has_membarrier, true, memory_order_release);
+#endif
+}
+
+static inline void smp_mb_light(void)
+{
+    if (atomic_load_explicit(&rcu_has_membarrier, memory_order_relaxed))
+        barrier();
+    else
+        smp_mb();
+}
+
+static inline void smp_mb_heavy(void)
+{
+#ifdef __linux__
+    if (atomic_load_explicit(&rcu_has_membarrier, memory_order_acquire) &&
+        !syscall(__NR_membarrier, MEMBARRIER_CMD_PRIVATE_EXPEDITED, 0, 0))
+        return;
+#endif
+    smp_mb();
+}
+
 /* To access the shared variable use READ_ONCE() and WRITE_ONCE(). */
 
 /* READ_ONCE() close to those of a C11 volatile memory_order_relaxed atomic
@@ -110,6 +158,8 @@ static inline void spin_unlock(spinlock_t *sp)
 #include <stdlib.h>
 #include <unistd.h>
 
+#include "../hotstat/hotstat.h"
+
 #ifdef __CHECKER__
 #define __rcu __attribute__((noderef, address_space(__rcu)))
 #define rcu_check_sparse(p, space) ((void) (((typeof(*p) space *) p) == p))
@@ -128,132 +178,263 @@ static inline void spin_unlock(spinlock_t *sp)
 #define CACHE_LINE_SIZE 64
 #define __rcu_aligned __attribute__((aligned(2 * CACHE_LINE_SIZE)))
 
-/* Per-thread variable
+/* The reader counter: the low bits count the nested read-side critical
+ * sections, and RCU_GP_PHASE tells the grace period in which the outermost
+ * one started.
+ */
+#define RCU_GP_COUNT (1UL << 0)
+#define RCU_GP_PHASE (1UL << (sizeof(unsigned long) << 2))
+#define RCU_NEST_MASK (RCU_GP_PHASE - 1)
+
+/* Spins on a reader before the update-side yields the CPU to it */
+#define RCU_QS_ACTIVE_ATTEMPTS 100
+
+#ifdef RCU_PERCPU
+
+/* Per-CPU counters
  *
- * rcu_nesting is to distinguish where the current thread is in which grace
- * period. The reader will use the global variable rcu_nesting_idx to set up
- * the corresponding index of rcu_nesting for the read-side critical section.
- * It is a per-thread variable for optimizing the reader-side lock execution.
+ * With the slots below, the update-side scans as many readers as threads were
+ * alive at once, however few CPUs they run on. In this flavor, built with
+ * RCU_PERCPU, the outermost rcu_read_lock() and rcu_read_unlock() rather count
+ * themselves on the CPU they run on, in the counters of the phase they
+ * started in, as SRCU does. The counters are those of ../percpu, updated in
+ * restartable sequences, so that readers take no atomic read-modify-write and
+ * only write to the cache line of their CPU. The readers of a phase are gone
+ * once its unlocks, summed over the CPUs, add up to its locks.
  *
- * rcu_nesting uses two lowest bits of __next_rcu_nesting to determine the
- * grace period. Do not use __next_rcu_nesting directly. Use the helper macro
- * to access it.
+ * A reader keeps its nesting and its phase in a thread-local counter that
+ * nobody else reads, so it needs no slot, and there is no limit on threads.
  */
-struct rcu_node {
-    uintptr_t tid;
-    uintptr_t __next_rcu_nesting;
-} __rcu_aligned;
+#include "../percpu/percpu.h"
+
+#define RCU_PERCPU_LOCK(phase) (phase)
+#define RCU_PERCPU_UNLOCK(phase) (2 + (phase))
+#define __rcu_phase(ctr) (!!((ctr) & RCU_GP_PHASE))
 
 struct rcu_data {
-    unsigned int nr_thread;
-    struct rcu_node *head;
-    unsigned int rcu_nesting_idx;
-    spinlock_t lock;
+    unsigned long gp_ctr; /* RCU_GP_COUNT | phase */
+    spinlock_t lock;      /* serializes the update-side */
+    pthread_once_t key_once;
+    struct percpu readers;
 };
 
-/* Helper macro of next pointer and rcu_nesting */
-
-#define rcu_nesting(np, idx) \
-    (READ_ONCE((np)->__next_rcu_nesting) & (0x1 << ((idx) & (0x1))))
-#define rcu_set_nesting(np, idx)                                             \
-    do {                                                                     \
-        WRITE_ONCE(                                                          \
-            (np)->__next_rcu_nesting,                                        \
-            READ_ONCE((np)->__next_rcu_nesting) | (0x1 << ((idx) & (0x1)))); \
-    } while (0)
-#define rcu_unset_nesting(np)                                          \
-    do {                                                               \
-        smp_store_release(&(np)->__next_rcu_nesting,                   \
-                          READ_ONCE((np)->__next_rcu_nesting) & ~0x3); \
-    } while (0)
-#define rcu_next(np) \
-    ((struct rcu_node *) (READ_ONCE((np)->__next_rcu_nesting) & ~0x3))
-#define rcu_next_mask(nrn) ((struct rcu_node *) ((uintptr_t) (nrn) & ~0x3))
-
 static struct rcu_data rcu_data = {
-    .nr_thread = 0,
-    .head = NULL,
-    .rcu_nesting_idx = 0,
+    .gp_ctr = RCU_GP_COUNT,
     .lock = SPINLOCK_INIT,
+    .key_once = PTHREAD_ONCE_INIT,
 };
-static __thread struct rcu_node *__rcu_per_thread_ptr;
+static __thread unsigned long __rcu_per_thread_ctr;
 
-static inline struct rcu_node *__rcu_node_add(uintptr_t tid)
+static inline int rcu_init(void)
 {
-    struct rcu_node **indirect = &rcu_data.head;
-    struct rcu_node *node = malloc(sizeof(struct rcu_node));
+    pthread_once(&rcu_data.key_once, rcu_membarrier_init);
 
-    if (!node) {
-        fprintf(stderr, "__rcu_node_add: malloc failed\n");
-        abort();
+    return 0;
+}
+
+/* Nothing to release, the counts of a thread outlive it */
+static inline void rcu_exit(void) {}
+
+static inline void rcu_read_lock(void)
+{
+    unsigned long tmp = __rcu_per_thread_ctr;
+
+    if (tmp & RCU_NEST_MASK) {
+        __rcu_per_thread_ctr = tmp + RCU_GP_COUNT;
+        return;
     }
+    __rcu_per_thread_ctr = tmp = READ_ONCE(rcu_data.gp_ctr);
+    percpu_add(&rcu_data.readers, RCU_PERCPU_LOCK(__rcu_phase(tmp)), 1);
+
+    /* Order the count before the loads of the critical section */
+    smp_mb_light();
+}
+
+static inline void rcu_read_unlock(void)
+{
+    unsigned long tmp = __rcu_per_thread_ctr;
+
+    if ((tmp & RCU_NEST_MASK) != RCU_GP_COUNT) {
+        __rcu_per_thread_ctr = tmp - RCU_GP_COUNT;
+        return;
+    }
+    __rcu_per_thread_ctr = 0;
+    smp_mb_light();
+    percpu_add(&rcu_data.readers, RCU_PERCPU_UNLOCK(__rcu_phase(tmp)), 1);
+}
+
+/* No reader is left in @phase. The unlocks are summed first: a reader counts
+ * its lock before its unlock, so the locks summed next include the lock of
+ * every unlock seen, and the sums only match when the readers counted left.
+ */
+static inline bool __rcu_readers_gone(int phase)
+{
+    uint64_t unlocks = percpu_sum(&rcu_data.readers, RCU_PERCPU_UNLOCK(phase));
+
+    /* Pairs with the barriers of the readers, which may be compiler ones */
+    smp_mb_heavy();
+
+    return percpu_sum(&rcu_data.readers, RCU_PERCPU_LOCK(phase)) == unlocks;
+}
+
+static inline void synchronize_rcu(void)
+{
+    HOTSTAT_HISTOGRAM(gp_ns, "rcu.gp_ns");
+    uint64_t start = HOTSTAT_NOW();
 
-    node->tid = tid;
-    node->__next_rcu_nesting = 0;
+    smp_mb_heavy();
 
     spin_lock(&rcu_data.lock);
 
-    /* Read-side will write the rcu_nesting field in __next_rcu_nesting
-     * even if we lock the linked list. So, here we use READ_ONCE().
+    /* As with the slots, readers entering anew take the new phase. A reader
+     * that loaded the old phase before the flip may only count itself after
+     * the sums, it then sees the updates before this grace period, and the
+     * second flip makes sure the next one waits for it.
      */
-#define rro_mask(pp) rcu_next_mask(READ_ONCE((*pp)))
+    for (int flip = 0; flip < 2; flip++) {
+        int old = __rcu_phase(rcu_data.gp_ctr);
+
+        WRITE_ONCE(rcu_data.gp_ctr, rcu_data.gp_ctr ^ RCU_GP_PHASE);
+        smp_mb();
 
-    while (rro_mask(indirect)) {
-        if (rro_mask(indirect)->tid == node->tid) {
-            spin_unlock(&rcu_data.lock);
-            free(node);
-            return NULL;
+        for (int spins = 0; !__rcu_readers_gone(old); spins++) {
+            if (spins >= RCU_QS_ACTIVE_ATTEMPTS)
+                sched_yield();
+            else
+                barrier();
         }
-        indirect = (struct rcu_node **) &rro_mask(indirect)->__next_rcu_nesting;
     }
 
-#undef rro_mask
+    spin_unlock(&rcu_data.lock);
 
-    atomic_fetch_or_release((uintptr_t *) indirect, (uintptr_t) node);
-    rcu_data.nr_thread++;
+    smp_mb_heavy();
+    HOTSTAT_RECORD(gp_ns, HOTSTAT_NOW() - start);
+}
 
-    spin_unlock(&rcu_data.lock);
+#else
 
-    smp_mb();
+/* Per-thread variable
+ *
+ * Readers keep their state in a per-thread counter, as in the memb flavor of
+ * userspace RCU: the low bits count the nested read-side critical sections,
+ * and RCU_GP_PHASE tells the grace period in which the outermost one started.
+ * The outermost rcu_read_lock() copies the global counter, whose count is
+ * always one, and the nested ones only increment the own counter. Readers
+ * thus never write to shared cache lines.
+ *
+ * Each thread owns one slot of a fixed array. The slots are cache aligned, so
+ * that readers do not share a cache line, and slots freed by exited threads
+ * are reused by new ones.
+ */
+#ifndef RCU_MAX_THREADS
+#define RCU_MAX_THREADS 1024
+#endif
 
-    return node;
-}
+struct rcu_node {
+    unsigned long ctr;
+    atomic_bool in_use;
+} __rcu_aligned;
 
-static inline int rcu_init(void)
+struct rcu_data {
+    /* Slots at or above it were never used, they are not scanned */
+    atomic_uint nr_slots;
+    unsigned long gp_ctr; /* RCU_GP_COUNT | phase */
+    spinlock_t lock;      /* serializes the update-side */
+    pthread_once_t key_once;
+    pthread_key_t key;
+    struct rcu_node slots[RCU_MAX_THREADS];
+};
+
+static struct rcu_data rcu_data = {
+    .nr_slots = 0,
+    .gp_ctr = RCU_GP_COUNT,
+    .lock = SPINLOCK_INIT,
+    .key_once = PTHREAD_ONCE_INIT,
+};
+static __thread struct rcu_node *__rcu_per_thread_ptr;
+
+/* Give the slot back when its thread exits */
+static void __rcu_node_del(void *arg)
 {
-    uintptr_t tid = current_tid();
+    struct rcu_node *node = arg;
 
-    __rcu_per_thread_ptr = __rcu_node_add(tid);
+    smp_store_release(&node->ctr, 0);
+    atomic_store_explicit(&node->in_use, false, memory_order_release);
+}
 
-    return __rcu_per_thread_ptr ? 0 : -ENOMEM;
+static void __rcu_key_init(void)
+{
+    rcu_membarrier_init();
+    if (pthread_key_create(&rcu_data.key, __rcu_node_del)) {
+        fprintf(stderr, "__rcu_key_init: pthread_key_create failed\n");
+        abort();
+    }
 }
 
-static inline void rcu_clean(void)
+static inline struct rcu_node *__rcu_node_add(void)
 {
-    struct rcu_node *node, *tmp;
+    pthread_once(&rcu_data.key_once, __rcu_key_init);
 
-    spin_lock(&rcu_data.lock);
+    for (unsigned int i = 0; i < RCU_MAX_THREADS; i++) {
+        struct rcu_node *node = &rcu_data.slots[i];
+        bool expected = false;
+
+        if (atomic_load_explicit(&node->in_use, memory_order_relaxed) ||
+            !atomic_compare_exchange_strong(&node->in_use, &expected, true))
+            continue;
 
-    for (node = rcu_data.head; node; node = tmp) {
-        tmp = rcu_next_mask(node->__next_rcu_nesting);
-        free(rcu_next_mask(node));
+        /* Make the slot visible to the update-side before any read lock */
+        unsigned int n = atomic_load(&rcu_data.nr_slots);
+        while (n <= i &&
+               !atomic_compare_exchange_weak(&rcu_data.nr_slots, &n, i + 1))
+            ;
+        pthread_setspecific(rcu_data.key, node);
+
+        smp_mb();
+
+        return node;
     }
 
-    rcu_data.head = NULL;
-    rcu_data.nr_thread = 0;
+    return NULL;
+}
 
-    spin_unlock(&rcu_data.lock);
+static inline int rcu_init(void)
+{
+    if (__rcu_per_thread_ptr)
+        return 0;
+
+    __rcu_per_thread_ptr = __rcu_node_add();
+
+    return __rcu_per_thread_ptr ? 0 : -ENOMEM;
 }
 
-/* The per-thread reference count will only modified by their owner
- * thread but will read by other threads. So here we use WRITE_ONCE().
- *
- * We can change the set 1/0 to reference count to make rcu read-side lock
- * nesting. But here we simplified it to become once as time.
+/* Release the slot of the current thread before it exits */
+static inline void rcu_exit(void)
+{
+    if (!__rcu_per_thread_ptr)
+        return;
+
+    pthread_setspecific(rcu_data.key, NULL);
+    __rcu_node_del(__rcu_per_thread_ptr);
+    __rcu_per_thread_ptr = NULL;
+}
+
+/* The per-thread counter is only modified by its owner thread but read by
+ * the update-side. So here we use WRITE_ONCE().
  */
 static inline void rcu_read_lock(void)
 {
-    rcu_set_nesting(__rcu_per_thread_ptr, READ_ONCE(rcu_data.rcu_nesting_idx));
+    struct rcu_node *node = __rcu_per_thread_ptr;
+    unsigned long tmp = READ_ONCE(node->ctr);
+
+    if (tmp & RCU_NEST_MASK) {
+        WRITE_ONCE(node->ctr, tmp + RCU_GP_COUNT);
+        return;
+    }
+    WRITE_ONCE(node->ctr, READ_ONCE(rcu_data.gp_ctr));
+
+    /* Order the counter store before the loads of the critical section */
+    smp_mb_light();
 }
 
 /* It uses the smp_store_release().
@@ -261,52 +442,329 @@ static inline void rcu_read_lock(void)
  */
 static inline void rcu_read_unlock(void)
 {
-    rcu_unset_nesting(__rcu_per_thread_ptr);
+    struct rcu_node *node = __rcu_per_thread_ptr;
+    unsigned long tmp = READ_ONCE(node->ctr);
+
+    if ((tmp & RCU_NEST_MASK) != RCU_GP_COUNT) {
+        WRITE_ONCE(node->ctr, tmp - RCU_GP_COUNT);
+        return;
+    }
+    smp_mb_light();
+    smp_store_release(&node->ctr, tmp - RCU_GP_COUNT);
+}
+
+/* The reader is inside a critical section that started before the phase of
+ * the global counter was flipped.
+ */
+static inline bool __rcu_reader_old(struct rcu_node *node)
+{
+    unsigned long v = READ_ONCE(node->ctr);
+
+    return (v & RCU_NEST_MASK) && ((v ^ rcu_data.gp_ctr) & RCU_GP_PHASE);
 }
 
 static inline void synchronize_rcu(void)
 {
-    struct rcu_node *node;
-    int i;
+    HOTSTAT_HISTOGRAM(gp_ns, "rcu.gp_ns");
+    uint64_t start = HOTSTAT_NOW();
+    struct rcu_node *node, *end;
 
-    smp_mb();
+    smp_mb_heavy();
 
     spin_lock(&rcu_data.lock);
 
-    /* When rcu_nesting is set, the thread is in the read-side critical
-     * section. It is safe to plain access rcu_data.rcu_nesting_idx since
-     * it only modified by the update-side.
+    /* It is safe to plain access rcu_data.gp_ctr since it only modified by
+     * the update-side.
+     *
+     * Free slots have their counter cleared, so scanning them is harmless.
      *
-     * Again, if we want the read-side lock to be nesting, we need to change
-     * rcu_nesting to reference count.
+     * The phase is flipped before waiting, so that readers entering anew
+     * take the new one and cannot hold the update-side back. A reader may
+     * still have loaded the old phase before the flip and stored it after
+     * the scan, it would be missed by the next grace period if it was not for
+     * the second flip, which waits for the readers of the other phase.
      */
-    for (node = rcu_data.head; node; node = rcu_next(node)) {
-        while (rcu_nesting(node, rcu_data.rcu_nesting_idx)) {
-            barrier();
+    for (int flip = 0; flip < 2; flip++) {
+        /* Going to next grace period */
+        WRITE_ONCE(rcu_data.gp_ctr, rcu_data.gp_ctr ^ RCU_GP_PHASE);
+
+        /* Only orders the update-side itself, the readers were already
+         * fenced
+         */
+        smp_mb();
+
+        end = &rcu_data.slots[atomic_load(&rcu_data.nr_slots)];
+        for (node = rcu_data.slots; node < end; node++) {
+            for (int spins = 0; __rcu_reader_old(node); spins++) {
+                /* The reader may be waiting for the CPU we spin on */
+                if (spins >= RCU_QS_ACTIVE_ATTEMPTS)
+                    sched_yield();
+                else
+                    barrier();
+            }
         }
     }
 
-    /* Going to next grace period */
-    i = atomic_fetch_add_release(&rcu_data.rcu_nesting_idx, 1);
+    spin_unlock(&rcu_data.lock);
 
-    smp_mb();
+    smp_mb_heavy();
+    HOTSTAT_RECORD(gp_ns, HOTSTAT_NOW() - start);
+}
 
-    /* Some read-side threads may be in the linked list, but it enters the
-     * read-side critical section after the update-side checks it's nesting.
-     * It may cause a data race since the update-side will think all the reader
-     * passes through the critical section.
-     * To stay away from it, we check again after increasing the global index
-     * variable.
-     */
-    for (node = rcu_data.head; node; node = rcu_next(node)) {
-        while (rcu_nesting(node, i)) {
-            barrier();
+#endif /* RCU_PERCPU */
+
+static inline void rcu_cb_clean(void);
+
+/* Also stops the grace-period thread of call_rcu(), after running what it
+ * still has queued.
+ */
+static inline void rcu_clean(void)
+{
+    rcu_cb_clean();
+    rcu_exit();
+}
+
+/* Deferred callbacks
+ *
+ * call_rcu() queues a callback on a per-thread list and returns at once. A
+ * grace-period thread, started by the first call_rcu(), takes every queued
+ * callback at once, waits for a single grace period on behalf of the whole
+ * batch and then invokes them. Updaters thus never wait for the readers.
+ *
+ * Embed struct rcu_head in the protected object and use container_of() in
+ * the callback to get it back.
+ */
+struct rcu_head {
+    struct rcu_head *next;
+    void (*func)(struct rcu_head *head);
+};
+
+#ifndef container_of
+#define container_of(ptr, type, member) \
+    ((type *) ((char *) (ptr) - offsetof(type, member)))
+#endif
+
+/* Callbacks queued by one thread, only the owner pushes. The list is freed
+ * when its owner exits, or by rcu_cb_clean().
+ */
+struct rcu_cb_list {
+    struct rcu_head *_Atomic head;
+    struct rcu_cb_list *next;
+    struct rcu_cb_list **owner; /* __rcu_per_thread_cbs of the owner */
+};
+
+static struct {
+    struct rcu_cb_list *lists; /* every rcu_cb_list, protected by lock */
+    struct rcu_head *orphans;  /* left by exited threads, protected by lock */
+    pthread_mutex_t lock;
+    pthread_cond_t cond; /* wakes up the grace-period thread */
+    atomic_bool wanted;  /* callbacks were queued since the last batch */
+    bool running, stop;
+    pthread_t thread;
+    atomic_ulong queued, done; /* callbacks queued and invoked so far */
+    pthread_once_t key_once;
+    pthread_key_t key; /* frees the list of an exiting thread */
+} rcu_cb = {
+    .lock = PTHREAD_MUTEX_INITIALIZER,
+    .cond = PTHREAD_COND_INITIALIZER,
+    .key_once = PTHREAD_ONCE_INIT,
+};
+static __thread struct rcu_cb_list *__rcu_per_thread_cbs;
+
+/* Each list is newest first, reverse it in front of the batch */
+static inline struct rcu_head *__rcu_cb_splice(struct rcu_head *head,
+                                               struct rcu_head *batch)
+{
+    while (head) {
+        struct rcu_head *next = head->next;
+        head->next = batch;
+        batch = head;
+        head = next;
+    }
+    return batch;
+}
+
+/* Detach the callbacks of all threads, oldest first */
+static inline struct rcu_head *__rcu_cb_take(void)
+{
+    struct rcu_head *batch = __rcu_cb_splice(rcu_cb.orphans, NULL);
+
+    rcu_cb.orphans = NULL;
+    for (struct rcu_cb_list *l = rcu_cb.lists; l; l = l->next)
+        batch = __rcu_cb_splice(
+            atomic_exchange_explicit(&l->head, NULL, memory_order_acquire),
+            batch);
+    return batch;
+}
+
+static void *__rcu_gp_thread(void *arg)
+{
+    HOTSTAT_HISTOGRAM(batch, "rcu.cb_batch");
+
+    while (1) {
+        spin_lock(&rcu_cb.lock);
+        while (!atomic_load(&rcu_cb.wanted) && !rcu_cb.stop)
+            pthread_cond_wait(&rcu_cb.cond, &rcu_cb.lock);
+        if (!atomic_load(&rcu_cb.wanted) && rcu_cb.stop) {
+            spin_unlock(&rcu_cb.lock);
+            break;
+        }
+        /* Anything queued after this is left for the next batch */
+        atomic_store(&rcu_cb.wanted, false);
+        struct rcu_head *batch = __rcu_cb_take();
+        spin_unlock(&rcu_cb.lock);
+
+        if (!batch)
+            continue;
+
+        /* One grace period for the whole batch */
+        synchronize_rcu();
+
+        unsigned long n = 0;
+        while (batch) {
+            struct rcu_head *next = batch->next;
+            batch->func(batch);
+            batch = next;
+            n++;
         }
+        HOTSTAT_RECORD(batch, n);
+        atomic_fetch_add_explicit(&rcu_cb.done, n, memory_order_release);
     }
+    return NULL;
+}
 
-    spin_unlock(&rcu_data.lock);
+static inline void __rcu_gp_wake(void)
+{
+    if (!atomic_exchange(&rcu_cb.wanted, true)) {
+        spin_lock(&rcu_cb.lock);
+        pthread_cond_signal(&rcu_cb.cond);
+        spin_unlock(&rcu_cb.lock);
+    }
+}
 
-    smp_mb();
+/* The key destructor of an exiting thread: its callbacks, still counted and
+ * wanted, are left to the grace-period thread. The list is looked up again
+ * with the lock held, as rcu_cb_clean() may have freed it already.
+ */
+static void __rcu_cb_list_del(void *arg)
+{
+    spin_lock(&rcu_cb.lock);
+    struct rcu_cb_list *l = __rcu_per_thread_cbs, **p;
+    if (!l) {
+        spin_unlock(&rcu_cb.lock);
+        return;
+    }
+    for (p = &rcu_cb.lists; *p != l; p = &(*p)->next)
+        ;
+    *p = l->next;
+
+    struct rcu_head *head =
+        atomic_exchange_explicit(&l->head, NULL, memory_order_acquire);
+    if (head) {
+        struct rcu_head *tail = head;
+        while (tail->next)
+            tail = tail->next;
+        tail->next = rcu_cb.orphans;
+        rcu_cb.orphans = head;
+    }
+    __rcu_per_thread_cbs = NULL;
+    spin_unlock(&rcu_cb.lock);
+    free(l);
+}
+
+static void __rcu_cb_key_init(void)
+{
+    if (pthread_key_create(&rcu_cb.key, __rcu_cb_list_del)) {
+        fprintf(stderr, "__rcu_cb_key_init: pthread_key_create failed\n");
+        abort();
+    }
+}
+
+static inline struct rcu_cb_list *__rcu_cb_list_add(void)
+{
+    struct rcu_cb_list *l = malloc(sizeof(struct rcu_cb_list));
+
+    if (!l) {
+        fprintf(stderr, "__rcu_cb_list_add: malloc failed\n");
+        abort();
+    }
+    atomic_init(&l->head, NULL);
+    l->owner = &__rcu_per_thread_cbs;
+    pthread_once(&rcu_cb.key_once, __rcu_cb_key_init);
+    pthread_setspecific(rcu_cb.key, l);
+
+    spin_lock(&rcu_cb.lock);
+    l->next = rcu_cb.lists;
+    rcu_cb.lists = l;
+    if (!rcu_cb.running) {
+        if (pthread_create(&rcu_cb.thread, NULL, __rcu_gp_thread, NULL)) {
+            fprintf(stderr, "__rcu_cb_list_add: pthread_create failed\n");
+            abort();
+        }
+        rcu_cb.running = true;
+    }
+    spin_unlock(&rcu_cb.lock);
+
+    return l;
+}
+
+/* Invoke func(head) after a grace period, from the grace-period thread */
+static inline void call_rcu(struct rcu_head *head,
+                            void (*func)(struct rcu_head *head))
+{
+    struct rcu_cb_list *l = __rcu_per_thread_cbs;
+
+    if (!l)
+        l = __rcu_per_thread_cbs = __rcu_cb_list_add();
+
+    head->func = func;
+    head->next = atomic_load_explicit(&l->head, memory_order_relaxed);
+    while (!atomic_compare_exchange_weak_explicit(
+        &l->head, &head->next, head, memory_order_release,
+        memory_order_relaxed))
+        ;
+    atomic_fetch_add_explicit(&rcu_cb.queued, 1, memory_order_relaxed);
+
+    __rcu_gp_wake();
+}
+
+/* Wait until every callback queued so far has been invoked */
+static inline void rcu_barrier(void)
+{
+    unsigned long target = atomic_load(&rcu_cb.queued);
+
+    while (atomic_load_explicit(&rcu_cb.done, memory_order_acquire) < target) {
+        __rcu_gp_wake();
+        sched_yield();
+    }
+}
+
+/* Run the pending callbacks and stop the grace-period thread. No thread may
+ * call call_rcu() meanwhile; a later call_rcu() starts it again.
+ */
+static inline void rcu_cb_clean(void)
+{
+    struct rcu_cb_list *l, *tmp;
+
+    spin_lock(&rcu_cb.lock);
+    if (rcu_cb.running) {
+        rcu_cb.stop = true;
+        pthread_cond_signal(&rcu_cb.cond);
+        spin_unlock(&rcu_cb.lock);
+        pthread_join(rcu_cb.thread, NULL);
+        spin_lock(&rcu_cb.lock);
+        rcu_cb.running = rcu_cb.stop = false;
+    }
+
+    /* The owners still alive get a new list at their next call_rcu() */
+    for (l = rcu_cb.lists; l; l = tmp) {
+        tmp = l->next;
+        *l->owner = NULL;
+        free(l);
+    }
+    rcu_cb.lists = NULL;
+
+    spin_unlock(&rcu_cb.lock);
 }
 
 #define rcu_dereference(p)                                              \
@@ -1,3 +1,5 @@
+#define _GNU_SOURCE
+
 #include <stddef.h>
 
 /* coroutine status values */
@@ -89,57 +91,301 @@ struct cr {
 #include <errno.h>
 #include <fcntl.h>
 #include <netinet/in.h>
+#include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <sys/select.h>
 #include <sys/socket.h>
+#include <sys/uio.h>
 #include <unistd.h>
 
-typedef cr_queue(uint8_t, 4096) byte_queue_t;
+#define RELAY_CHUNK (64 * 1024)
+
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+
+/* A byte queue as a chain of page-sized segments. It grows under a burst, up
+ * to BQ_MAX_SEGS, and is filled with readv() and drained with writev() across
+ * several segments at a time. Empty segments may trail at the tail, ready for
+ * the next read.
+ */
+#define BQ_SEG_SIZE 4096
+#define BQ_MAX_SEGS 256  /* 1 MiB */
+#define BQ_READ_SEGS 16  /* per readv() */
+#define BQ_WRITE_SEGS 64 /* per writev() */
+#define BQ_SPARE_SEGS 16 /* kept once drained */
+
+struct bq_seg {
+    struct bq_seg *next;
+    size_t r, w;
+    uint8_t data[BQ_SEG_SIZE];
+};
+
+typedef struct {
+    struct bq_seg *head, *tail, *spare;
+    size_t len; /* bytes queued */
+    int n_segs, n_spare;
+} byte_queue_t;
 
-static void cr_proto(stdin_loop, byte_queue_t *out)
+static void bq_init(byte_queue_t *q)
 {
-    cr_local uint8_t b;
-    cr_local int r;
-    cr_begin();
-    for (;;) {
-        cr_sys(r = read(STDIN_FILENO, &b, 1));
-        if (r == 0) {
-            cr_wait(cr_queue_empty(out));
-            cr_exit(1);
+    q->head = q->tail = q->spare = NULL;
+    q->len = 0;
+    q->n_segs = q->n_spare = 0;
+}
+
+static bool bq_full(byte_queue_t *q)
+{
+    return q->n_segs == BQ_MAX_SEGS && q->tail->w == BQ_SEG_SIZE;
+}
+
+/* Append an empty segment, or return false at the limit or out of memory */
+static bool bq_grow(byte_queue_t *q)
+{
+    struct bq_seg *seg = q->spare;
+
+    if (q->n_segs == BQ_MAX_SEGS)
+        return false;
+    if (seg) {
+        q->spare = seg->next;
+        q->n_spare--;
+    } else if (!(seg = malloc(sizeof(struct bq_seg)))) {
+        return false;
+    }
+
+    seg->next = NULL;
+    seg->r = seg->w = 0;
+    if (q->tail)
+        q->tail->next = seg;
+    else
+        q->head = seg;
+    q->tail = seg;
+    q->n_segs++;
+    return true;
+}
+
+/* Read at most "max" bytes from "fd" into the free space at the tail */
+static ssize_t bq_read(byte_queue_t *q, int fd, size_t max)
+{
+    struct iovec iov[BQ_READ_SEGS];
+    struct bq_seg *seg;
+    int n = 0;
+
+    if (!q->tail || q->tail->w == BQ_SEG_SIZE)
+        bq_grow(q);
+    /* Find the first segment with room, then add room up to the limit */
+    for (seg = q->head; seg && seg->w == BQ_SEG_SIZE; seg = seg->next)
+        ;
+    for (size_t room = 0; seg && n < BQ_READ_SEGS && room < max;) {
+        iov[n].iov_base = seg->data + seg->w;
+        iov[n].iov_len = MIN(BQ_SEG_SIZE - seg->w, max - room);
+        room += iov[n++].iov_len;
+        if (!(seg = seg->next) && n < BQ_READ_SEGS && room < max && bq_grow(q))
+            seg = q->tail;
+    }
+    if (!n) {
+        errno = EAGAIN;
+        return -1;
+    }
+
+    ssize_t len = readv(fd, iov, n);
+    if (len <= 0)
+        return len;
+
+    q->len += len;
+    for (seg = q->head; seg->w == BQ_SEG_SIZE; seg = seg->next)
+        ;
+    for (size_t left = len; left; seg = seg->next) {
+        size_t k = MIN(BQ_SEG_SIZE - seg->w, left);
+        seg->w += k;
+        left -= k;
+    }
+    return len;
+}
+
+/* Write out the queued bytes from the head, across segments */
+static ssize_t bq_write(byte_queue_t *q, int fd)
+{
+    struct iovec iov[BQ_WRITE_SEGS];
+    int n = 0;
+
+    for (struct bq_seg *seg = q->head;
+         seg && seg->r < seg->w && n < BQ_WRITE_SEGS; seg = seg->next) {
+        iov[n].iov_base = seg->data + seg->r;
+        iov[n++].iov_len = seg->w - seg->r;
+    }
+
+    ssize_t len = writev(fd, iov, n);
+    if (len <= 0)
+        return len;
+
+    q->len -= len;
+    for (size_t left = len; left;) {
+        struct bq_seg *seg = q->head;
+        size_t k = MIN(seg->w - seg->r, left);
+        seg->r += k;
+        left -= k;
+        if (seg->r < seg->w)
+            break;
+
+        /* Drained: recycle it, or rewind it if it is the last one */
+        if (!seg->next) {
+            seg->r = seg->w = 0;
+            break;
+        }
+        q->head = seg->next;
+        q->n_segs--;
+        if (q->n_spare < BQ_SPARE_SEGS) {
+            seg->next = q->spare;
+            q->spare = seg;
+            q->n_spare++;
+        } else {
+            free(seg);
         }
-        cr_wait(!cr_queue_full(out));
-        cr_queue_push(out, b);
     }
-    cr_end();
+    return len;
 }
 
-static void cr_proto(socket_write_loop, byte_queue_t *in, int fd)
+static void bq_free(byte_queue_t *q)
 {
-    cr_local uint8_t *b;
-    cr_begin();
-    for (;;) {
-        cr_wait(!cr_queue_empty(in));
-        b = cr_queue_pop(in);
-        cr_sys(send(fd, b, 1, 0));
+    struct bq_seg *seg, *next;
+
+    for (seg = q->head; seg; seg = next) {
+        next = seg->next;
+        free(seg);
     }
-    cr_end();
+    for (seg = q->spare; seg; seg = next) {
+        next = seg->next;
+        free(seg);
+    }
+    bq_init(q);
 }
 
-static void cr_proto(socket_read_loop, int fd)
+/* A one-way relay from "in" to "out", through a pipe with splice(2) so that
+ * the data never crosses userspace, or through "queue" once either side
+ * turned out not to support it. All the state is here, not in cr_local
+ * variables, for the two directions to share the coroutine.
+ */
+struct relay {
+    int in, out;
+    int pipe[2];
+    bool copy;      /* through "queue" */
+    bool writing;   /* blocked on "out", else on "in" */
+    bool eof;       /* of "in", while copying */
+    size_t pending; /* bytes left in the pipe */
+    ssize_t n;
+    byte_queue_t queue;
+};
+
+static void relay_init(struct relay *r, int in, int out)
+{
+    r->in = in, r->out = out;
+    r->copy = r->writing = r->eof = false;
+    r->pending = 0;
+    bq_init(&r->queue);
+    if (pipe2(r->pipe, O_NONBLOCK | O_CLOEXEC) < 0)
+        r->copy = true;
+}
+
+/* A round of copying: read what the input has, the rest of the pipe first,
+ * until the queue is full, and write out what the queue holds. Return the
+ * bytes moved, 0 once the input ended and the queue is flushed, or -1 with
+ * errno set, to EAGAIN when neither side was ready.
+ */
+static ssize_t relay_copy(struct relay *r)
+{
+    ssize_t moved = 0, n;
+
+    if (!r->eof && !bq_full(&r->queue)) {
+        if (r->pending)
+            n = bq_read(&r->queue, r->pipe[0], r->pending);
+        else
+            n = bq_read(&r->queue, r->in, SIZE_MAX);
+        if (n > 0) {
+            moved += n;
+            r->pending -= MIN(r->pending, (size_t) n);
+        } else if (n == 0) {
+            r->eof = true;
+        } else if (errno != EAGAIN && errno != EWOULDBLOCK) {
+            return -1;
+        }
+    }
+
+    if (r->queue.len) {
+        n = bq_write(&r->queue, r->out);
+        if (n > 0)
+            moved += n;
+        else if (n < 0 && errno != EAGAIN && errno != EWOULDBLOCK)
+            return -1;
+    }
+
+    if (moved)
+        return moved;
+    if (r->eof && !r->queue.len)
+        return 0;
+    errno = EAGAIN;
+    return -1;
+}
+
+static void cr_proto(relay_loop, struct relay *r)
 {
-    cr_local uint8_t b;
-    cr_local int r;
     cr_begin();
+    while (!r->copy) {
+        r->writing = false;
+        cr_sys(r->n = splice(r->in, NULL, r->pipe[1], NULL, RELAY_CHUNK,
+                             SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+        if (r->n < 0 && errno == EINVAL) {
+            r->copy = true;
+            break;
+        }
+        if (r->n <= 0)
+            cr_exit(1);
+
+        r->pending = r->n;
+        r->writing = true;
+        while (r->pending) {
+            cr_sys(r->n = splice(r->pipe[0], NULL, r->out, NULL, r->pending,
+                                 SPLICE_F_MOVE | SPLICE_F_NONBLOCK));
+            if (r->n < 0 && errno == EINVAL) {
+                r->copy = true;
+                break;
+            }
+            if (r->n <= 0)
+                cr_exit(1);
+            r->pending -= r->n;
+        }
+    }
+
+    /* The fallback, after what is left in the pipe */
     for (;;) {
-        cr_sys(r = recv(fd, &b, 1, 0));
-        if (r == 0)
+        cr_sys(r->n = relay_copy(r));
+        if (r->n <= 0)
             cr_exit(1);
-        cr_sys(write(STDOUT_FILENO, &b, 1));
     }
     cr_end();
 }
 
+static void fd_poll(int fd, fd_set *fds, int *nfds)
+{
+    FD_SET(fd, fds);
+    if (fd >= *nfds)
+        *nfds = fd + 1;
+}
+
+/* Add the fds a blocked relay waits for */
+static void relay_poll(struct relay *r, fd_set *rfds, fd_set *wfds, int *nfds)
+{
+    if (!r->copy) {
+        fd_poll(r->writing ? r->out : r->in, r->writing ? wfds : rfds, nfds);
+        return;
+    }
+
+    if (!r->eof && !bq_full(&r->queue))
+        fd_poll(r->in, rfds, nfds);
+    if (r->queue.len)
+        fd_poll(r->out, wfds, nfds);
+}
+
 static int nonblock(int fd)
 {
     int flags = fcntl(fd, F_GETFL, 0);
@@ -183,26 +429,29 @@ int main(int argc, char *argv[])
     };
     connect(fd, (struct sockaddr *) &addr, sizeof(struct sockaddr_in));
 
-    byte_queue_t queue = cr_queue_init();
+    struct relay up, down;
+    relay_init(&up, STDIN_FILENO, fd);
+    relay_init(&down, fd, STDOUT_FILENO);
 
-    cr_context(stdin_loop) = cr_context_init();
-    cr_context(socket_read_loop) = cr_context_init();
-    cr_context(socket_write_loop) = cr_context_init();
+    struct cr up_ctx = cr_context_init(), down_ctx = cr_context_init();
 
-    while (cr_status(stdin_loop) == CR_BLOCKED &&
-           cr_status(socket_read_loop) == CR_BLOCKED) {
-        if (cr_queue_empty(&queue)) {
-            fd_set fds;
-            FD_ZERO(&fds);
-            FD_SET(STDIN_FILENO, &fds);
-            FD_SET(fd, &fds);
-            select(fd + 1, &fds, NULL, NULL, NULL);
-        }
-        cr_run(socket_read_loop, fd);
-        cr_run(socket_write_loop, &queue, fd);
-        cr_run(stdin_loop, &queue);
+    for (;;) {
+        cr_func_name(relay_loop)(&down_ctx, &down);
+        cr_func_name(relay_loop)(&up_ctx, &up);
+        if (up_ctx.status != CR_BLOCKED || down_ctx.status != CR_BLOCKED)
+            break;
+
+        fd_set rfds, wfds;
+        int nfds = 0;
+        FD_ZERO(&rfds);
+        FD_ZERO(&wfds);
+        relay_poll(&up, &rfds, &wfds, &nfds);
+        relay_poll(&down, &rfds, &wfds, &nfds);
+        select(nfds, &rfds, &wfds, NULL, NULL);
     }
 
+    bq_free(&up.queue);
+    bq_free(&down.queue);
     close(fd);
     return 0;
 }
@@ -10,6 +10,24 @@ typedef struct __threadpool *tpool_t;
  */
 tpool_t tpool_create(size_t count);
 
+/**
+ * How a pool hands tasks to its workers:
+ * - TPOOL_SHARED_QUEUE: a single job queue, protected by one mutex.
+ * - TPOOL_WORK_STEALING: each worker owns a Chase-Lev deque. Submissions
+ *   from outside the pool go to a lock-free injection stack, submissions
+ *   from a task go to the deque of its worker, and idle workers steal from
+ *   the others before parking on a futex.
+ */
+enum tpool_mode {
+    TPOOL_SHARED_QUEUE,
+    TPOOL_WORK_STEALING,
+};
+
+/**
+ * Same as tpool_create(), with the scheduling mode given by @mode.
+ */
+tpool_t tpool_create_mode(size_t count, enum tpool_mode mode);
+
 /**
  * Schedules the specific function to be executed.
  * If successful, a future object representing the execution of
@@ -17,6 +35,19 @@ tpool_t tpool_create(size_t count);
  */
 tpool_future_t tpool_apply(tpool_t pool, void *(*func)(void *), void *arg);
 
+/**
+ * Schedules @n tasks at once, task i running funcs[i](args[i]), with a single
+ * lock acquisition and wake-up. If @futures is not NULL, futures[i] receives
+ * the future of task i. Otherwise the tasks are fire-and-forget and no future
+ * is allocated. Either all tasks are scheduled and 0 is returned, or none and
+ * -1 is returned.
+ */
+int tpool_apply_batch(tpool_t pool,
+                      size_t n,
+                      void *(*funcs[])(void *),
+                      void *args[],
+                      tpool_future_t futures[]);
+
 /**
  * Wait for all pending tasks to complete before destroying the thread pool.
  */
@@ -38,9 +69,16 @@ void *tpool_future_get(tpool_future_t future, unsigned int seconds);
 int tpool_future_destroy(tpool_future_t future);
 
 #include <errno.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
+#include <stdbool.h>
 #include <stdlib.h>
+#include <sys/syscall.h>
 #include <time.h>
+#include <unistd.h>
+
+#include "deque.h"
 
 enum __future_flags {
     __FUTURE_RUNNING = 01,
@@ -48,12 +86,13 @@ enum __future_flags {
     __FUTURE_TIMEOUT = 04,
     __FUTURE_CANCELLED = 010,
     __FUTURE_DESTROYED = 020,
+    __FUTURE_WAITING = 040, /* someone may sleep on the flag */
 };
 
 typedef struct __threadtask {
     void *(*func)(void *);
     void *arg;
-    struct __tpool_future *future;
+    struct __tpool_future *future; /* NULL for fire-and-forget tasks */
     struct __threadtask *next;
 } threadtask_t;
 
@@ -63,74 +102,214 @@ typedef struct __jobqueue {
     pthread_mutex_t rwlock;
 } jobqueue_t;
 
+/* The flag is updated with atomic read-modify-writes only, and doubles as
+ * the futex word that tpool_future_get() sleeps on.
+ */
 struct __tpool_future {
-    int flag;
+    atomic_uint flag;
     void *result;
-    pthread_mutex_t mutex;
-    pthread_cond_t cond_finished;
 };
 
+/* A task of a work-stealing pool. The work_t is what goes through the
+ * deques; it has no argument, so it can sit at the end of the task.
+ */
+typedef struct {
+    threadtask_t task;
+    work_t work;
+} stealtask_t;
+
+typedef struct {
+    struct __threadpool *pool;
+    deque_t deque;
+    size_t id;
+} stealworker_t;
+
 struct __threadpool {
     size_t count;
     pthread_t *workers;
     jobqueue_t *jobqueue;
+
+    /* TPOOL_WORK_STEALING only */
+    enum tpool_mode mode;
+    stealworker_t *stealers;
+    _Atomic(threadtask_t *) inject; /* stack of external submissions */
+    atomic_uint epoch;              /* futex word, bumped on submission */
+    atomic_uint n_parked;
+    atomic_bool shutdown;
 };
 
+static long futex_wait(atomic_uint *uaddr,
+                       unsigned int val,
+                       const struct timespec *timeout)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, timeout, NULL,
+                   0);
+}
+
+static long futex_wake(atomic_uint *uaddr, int n)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+/* Tasks and futures are recycled through per-thread caches, which trade
+ * SLAB_BATCH objects at a time with a shared free list. Memory is taken
+ * from malloc SLAB_BATCH objects at a time and never given back, so a
+ * stale pointer to a recycled future still points to valid memory.
+ */
+#define SLAB_BATCH 64
+
+typedef struct __slab_obj {
+    struct __slab_obj *next;
+} slab_obj_t;
+
+typedef struct {
+    size_t size;
+    pthread_mutex_t lock;
+    slab_obj_t *free;
+} slab_t;
+
+typedef struct {
+    slab_obj_t *free;
+    size_t n;
+} slab_cache_t;
+
+enum { SLAB_TASK, SLAB_FUTURE, N_SLABS };
+
+static slab_t slabs[N_SLABS] = {
+    [SLAB_TASK] = {sizeof(stealtask_t), PTHREAD_MUTEX_INITIALIZER, NULL},
+    [SLAB_FUTURE] = {sizeof(struct __tpool_future), PTHREAD_MUTEX_INITIALIZER,
+                     NULL},
+};
+static __thread slab_cache_t slab_caches[N_SLABS];
+
+static void *slab_alloc(int kind)
+{
+    slab_t *slab = &slabs[kind];
+    slab_cache_t *cache = &slab_caches[kind];
+
+    if (!cache->free) {
+        pthread_mutex_lock(&slab->lock);
+        while (slab->free && cache->n < SLAB_BATCH) {
+            slab_obj_t *obj = slab->free;
+            slab->free = obj->next;
+            obj->next = cache->free, cache->free = obj;
+            cache->n++;
+        }
+        pthread_mutex_unlock(&slab->lock);
+    }
+    if (!cache->free) {
+        char *chunk = malloc(slab->size * SLAB_BATCH);
+        if (!chunk)
+            return NULL;
+        for (int i = 0; i < SLAB_BATCH; i++) {
+            slab_obj_t *obj = (slab_obj_t *) (chunk + i * slab->size);
+            obj->next = cache->free, cache->free = obj;
+        }
+        cache->n += SLAB_BATCH;
+    }
+
+    slab_obj_t *obj = cache->free;
+    cache->free = obj->next;
+    cache->n--;
+    return obj;
+}
+
+/* Move @n objects from the cache of this thread to the shared list */
+static void slab_spill(int kind, size_t n)
+{
+    slab_t *slab = &slabs[kind];
+    slab_cache_t *cache = &slab_caches[kind];
+    if (!n)
+        return;
+
+    slab_obj_t *first = cache->free, *last = first;
+    for (size_t i = 1; i < n; i++)
+        last = last->next;
+    cache->free = last->next;
+    cache->n -= n;
+
+    pthread_mutex_lock(&slab->lock);
+    last->next = slab->free;
+    slab->free = first;
+    pthread_mutex_unlock(&slab->lock);
+}
+
+static void slab_free(int kind, void *ptr)
+{
+    slab_cache_t *cache = &slab_caches[kind];
+    slab_obj_t *obj = ptr;
+    obj->next = cache->free, cache->free = obj;
+    if (++cache->n >= 2 * SLAB_BATCH)
+        slab_spill(kind, SLAB_BATCH);
+}
+
+/* Hand the caches of an exiting thread back to the shared lists */
+static void slab_flush(void)
+{
+    for (int kind = 0; kind < N_SLABS; kind++)
+        slab_spill(kind, slab_caches[kind].n);
+}
+
 static struct __tpool_future *tpool_future_create(void)
 {
-    struct __tpool_future *future = malloc(sizeof(struct __tpool_future));
+    struct __tpool_future *future = slab_alloc(SLAB_FUTURE);
     if (future) {
-        future->flag = 0;
+        atomic_init(&future->flag, 0);
         future->result = NULL;
-        pthread_mutex_init(&future->mutex, NULL);
-        pthread_condattr_t attr;
-        pthread_condattr_init(&attr);
-        pthread_cond_init(&future->cond_finished, &attr);
-        pthread_condattr_destroy(&attr);
     }
     return future;
 }
 
+/* Whoever sets the second of DESTROYED and FINISHED (or CANCELLED) frees
+ * the future, so exactly one side does it.
+ */
 int tpool_future_destroy(struct __tpool_future *future)
 {
     if (future) {
-        pthread_mutex_lock(&future->mutex);
-        if (future->flag & __FUTURE_FINISHED ||
-            future->flag & __FUTURE_CANCELLED) {
-            pthread_mutex_unlock(&future->mutex);
-            pthread_mutex_destroy(&future->mutex);
-            pthread_cond_destroy(&future->cond_finished);
-            free(future);
-        } else {
-            future->flag |= __FUTURE_DESTROYED;
-            pthread_mutex_unlock(&future->mutex);
-        }
+        unsigned int flag = atomic_fetch_or(&future->flag, __FUTURE_DESTROYED);
+        if (flag & (__FUTURE_FINISHED | __FUTURE_CANCELLED))
+            slab_free(SLAB_FUTURE, future);
     }
     return 0;
 }
 
 void *tpool_future_get(struct __tpool_future *future, unsigned int seconds)
 {
-    pthread_mutex_lock(&future->mutex);
+    struct timespec expire_time;
+    if (seconds) {
+        clock_gettime(CLOCK_MONOTONIC, &expire_time);
+        expire_time.tv_sec += seconds;
+    }
+
     /* turn off the timeout bit set previously */
-    future->flag &= ~__FUTURE_TIMEOUT;
-    while ((future->flag & __FUTURE_FINISHED) == 0) {
+    unsigned int flag =
+        atomic_fetch_and(&future->flag, ~__FUTURE_TIMEOUT) & ~__FUTURE_TIMEOUT;
+    while ((flag & __FUTURE_FINISHED) == 0) {
+        /* Tell the worker to wake us up before going to sleep */
+        if (!(flag & __FUTURE_WAITING)) {
+            flag = atomic_fetch_or(&future->flag, __FUTURE_WAITING) |
+                   __FUTURE_WAITING;
+            continue;
+        }
+
         if (seconds) {
-            struct timespec expire_time;
-            clock_gettime(CLOCK_MONOTONIC, &expire_time);
-            expire_time.tv_sec += seconds;
-            int status = pthread_cond_timedwait(&future->cond_finished,
-                                                &future->mutex, &expire_time);
-            if (status == ETIMEDOUT) {
-                future->flag |= __FUTURE_TIMEOUT;
-                pthread_mutex_unlock(&future->mutex);
+            struct timespec now, timeout;
+            clock_gettime(CLOCK_MONOTONIC, &now);
+            timeout.tv_sec = expire_time.tv_sec - now.tv_sec;
+            timeout.tv_nsec = expire_time.tv_nsec - now.tv_nsec;
+            if (timeout.tv_nsec < 0)
+                timeout.tv_sec--, timeout.tv_nsec += 1000000000L;
+            if (timeout.tv_sec < 0 ||
+                (futex_wait(&future->flag, flag, &timeout) &&
+                 errno == ETIMEDOUT)) {
+                atomic_fetch_or(&future->flag, __FUTURE_TIMEOUT);
                 return NULL;
             }
         } else
-            pthread_cond_wait(&future->cond_finished, &future->mutex);
+            futex_wait(&future->flag, flag, NULL);
+        flag = atomic_load_explicit(&future->flag, memory_order_acquire);
     }
 
-    pthread_mutex_unlock(&future->mutex);
     return future->result;
 }
 
@@ -150,17 +329,11 @@ static void jobqueue_destroy(jobqueue_t *jobqueue)
     threadtask_t *tmp = jobqueue->head;
     while (tmp) {
         jobqueue->head = jobqueue->head->next;
-        pthread_mutex_lock(&tmp->future->mutex);
-        if (tmp->future->flag & __FUTURE_DESTROYED) {
-            pthread_mutex_unlock(&tmp->future->mutex);
-            pthread_mutex_destroy(&tmp->future->mutex);
-            pthread_cond_destroy(&tmp->future->cond_finished);
-            free(tmp->future);
-        } else {
-            tmp->future->flag |= __FUTURE_CANCELLED;
-            pthread_mutex_unlock(&tmp->future->mutex);
-        }
-        free(tmp);
+        if (tmp->future &&
+            atomic_fetch_or(&tmp->future->flag, __FUTURE_CANCELLED) &
+                __FUTURE_DESTROYED)
+            slab_free(SLAB_FUTURE, tmp->future);
+        slab_free(SLAB_TASK, tmp);
         tmp = jobqueue->head;
     }
 
@@ -169,6 +342,50 @@ static void jobqueue_destroy(jobqueue_t *jobqueue)
     free(jobqueue);
 }
 
+/* Append the chain @first..@last to the queue, waking the workers once */
+static void jobqueue_push(jobqueue_t *jobqueue,
+                          threadtask_t *first,
+                          threadtask_t *last)
+{
+    last->next = NULL;
+    pthread_mutex_lock(&jobqueue->rwlock);
+    if (jobqueue->tail) {
+        jobqueue->tail->next = first;
+    } else {
+        jobqueue->head = first;
+        pthread_cond_broadcast(&jobqueue->cond_nonempty);
+    }
+    jobqueue->tail = last;
+    pthread_mutex_unlock(&jobqueue->rwlock);
+}
+
+/* Run a task unless it was cancelled, complete its future and free it */
+static void threadtask_run(threadtask_t *task)
+{
+    struct __tpool_future *future = task->future;
+    if (!future) {
+        task->func(task->arg);
+        slab_free(SLAB_TASK, task);
+        return;
+    }
+
+    if (atomic_fetch_or(&future->flag, __FUTURE_RUNNING) &
+        __FUTURE_CANCELLED) {
+        slab_free(SLAB_TASK, task);
+        return;
+    }
+
+    future->result = task->func(task->arg);
+    slab_free(SLAB_TASK, task);
+
+    unsigned int flag = atomic_fetch_or_explicit(
+        &future->flag, __FUTURE_FINISHED, memory_order_acq_rel);
+    if (flag & __FUTURE_DESTROYED)
+        slab_free(SLAB_FUTURE, future);
+    else if (flag & __FUTURE_WAITING)
+        futex_wake(&future->flag, INT_MAX);
+}
+
 static void __jobqueue_fetch_cleanup(void *arg)
 {
     pthread_mutex_t *mutex = (pthread_mutex_t *) arg;
@@ -188,62 +405,205 @@ static void *jobqueue_fetch(void *queue)
         pthread_setcancelstate(PTHREAD_CANCEL_ENABLE, &old_state);
         pthread_testcancel();
 
-        while (!jobqueue->tail)
+        while (!jobqueue->head)
             pthread_cond_wait(&jobqueue->cond_nonempty, &jobqueue->rwlock);
         pthread_setcancelstate(PTHREAD_CANCEL_DISABLE, &old_state);
-        if (jobqueue->head == jobqueue->tail) {
-            task = jobqueue->tail;
-            jobqueue->head = jobqueue->tail = NULL;
-        } else {
-            threadtask_t *tmp;
-            for (tmp = jobqueue->head; tmp->next != jobqueue->tail;
-                 tmp = tmp->next)
-                ;
-            task = tmp->next;
-            tmp->next = NULL;
-            jobqueue->tail = tmp;
-        }
+        task = jobqueue->head;
+        if (!(jobqueue->head = task->next))
+            jobqueue->tail = NULL;
         pthread_mutex_unlock(&jobqueue->rwlock);
 
         if (task->func) {
-            pthread_mutex_lock(&task->future->mutex);
-            if (task->future->flag & __FUTURE_CANCELLED) {
-                pthread_mutex_unlock(&task->future->mutex);
-                free(task);
-                continue;
-            } else {
-                task->future->flag |= __FUTURE_RUNNING;
-                pthread_mutex_unlock(&task->future->mutex);
-            }
-
-            void *ret_value = task->func(task->arg);
-            pthread_mutex_lock(&task->future->mutex);
-            if (task->future->flag & __FUTURE_DESTROYED) {
-                pthread_mutex_unlock(&task->future->mutex);
-                pthread_mutex_destroy(&task->future->mutex);
-                pthread_cond_destroy(&task->future->cond_finished);
-                free(task->future);
-            } else {
-                task->future->flag |= __FUTURE_FINISHED;
-                task->future->result = ret_value;
-                pthread_cond_broadcast(&task->future->cond_finished);
-                pthread_mutex_unlock(&task->future->mutex);
-            }
-            free(task);
+            threadtask_run(task);
         } else {
-            pthread_mutex_destroy(&task->future->mutex);
-            pthread_cond_destroy(&task->future->cond_finished);
-            free(task->future);
-            free(task);
+            slab_free(SLAB_TASK, task);
             break;
         }
     }
 
+    slab_flush();
     pthread_cleanup_pop(0);
     pthread_exit(NULL);
 }
 
+/* The worker running on this thread, if it belongs to a work-stealing pool */
+static __thread stealworker_t *current_stealer;
+
+static work_t *stealtask_run(work_t *work)
+{
+    stealtask_t *t =
+        (stealtask_t *) ((char *) work - offsetof(stealtask_t, work));
+    threadtask_run(&t->task);
+    return NULL;
+}
+
+/* Move every external submission to our own deque, oldest first, so that
+ * the other workers can steal them from us. Return whether there were any.
+ */
+static bool stealworker_drain(stealworker_t *self)
+{
+    struct __threadpool *pool = self->pool;
+    if (!atomic_load_explicit(&pool->inject, memory_order_relaxed))
+        return false;
+
+    threadtask_t *stack = atomic_exchange(&pool->inject, NULL);
+    if (!stack)
+        return false;
+    /* The stack is newest first, and take() pops the last pushed entry, so
+     * pushing in stack order runs the oldest submission first.
+     */
+    for (threadtask_t *next; stack; stack = next) {
+        next = stack->next;
+        push(&self->deque, &((stealtask_t *) stack)->work);
+    }
+    return true;
+}
+
+/* Find the next task for @self: own deque first, then the injection stack,
+ * then the other workers. Return NULL if there is nothing anywhere.
+ */
+static work_t *stealworker_find(stealworker_t *self)
+{
+    struct __threadpool *pool = self->pool;
+
+    while (1) {
+        work_t *work = take(&self->deque);
+        if (work != EMPTY)
+            return work;
+        if (stealworker_drain(self))
+            continue;
+
+        bool aborted = false;
+        for (size_t i = 1; i < pool->count; i++) {
+            size_t victim = (self->id + i) % pool->count;
+            work = steal(&pool->stealers[victim].deque);
+            if (work == ABORT)
+                aborted = true;
+            else if (work != EMPTY)
+                return work;
+        }
+        if (!aborted)
+            return NULL;
+    }
+}
+
+static void *stealworker_routine(void *arg)
+{
+    stealworker_t *self = arg;
+    struct __threadpool *pool = self->pool;
+    current_stealer = self;
+
+    while (1) {
+        work_t *work = stealworker_find(self);
+        if (work) {
+            work->code(work);
+            continue;
+        }
+
+        /* Announce that we park before checking for work a last time, so
+         * that a submitter either sees us parked or we see its task.
+         */
+        atomic_fetch_add(&pool->n_parked, 1);
+        unsigned int epoch = atomic_load(&pool->epoch);
+        if ((work = stealworker_find(self))) {
+            atomic_fetch_sub(&pool->n_parked, 1);
+            work->code(work);
+            continue;
+        }
+        if (atomic_load(&pool->shutdown)) {
+            atomic_fetch_sub(&pool->n_parked, 1);
+            break;
+        }
+        futex_wait(&pool->epoch, epoch, NULL);
+        atomic_fetch_sub(&pool->n_parked, 1);
+    }
+
+    slab_flush();
+    return NULL;
+}
+
+static void stealpool_wake(struct __threadpool *pool, int n)
+{
+    atomic_fetch_add(&pool->epoch, 1);
+    if (atomic_load(&pool->n_parked))
+        futex_wake(&pool->epoch, n);
+}
+
+/* Queue the chain of @n tasks starting at @first, linked oldest first */
+static void stealpool_push(struct __threadpool *pool,
+                           threadtask_t *first,
+                           size_t n)
+{
+    stealworker_t *self = current_stealer;
+    if (self && self->pool == pool) {
+        /* Spawned by a task: keep it local, idle workers will steal it */
+        for (threadtask_t *t = first, *next; n--; t = next) {
+            next = t->next;
+            push(&self->deque, &((stealtask_t *) t)->work);
+        }
+    } else {
+        /* The stack is newest first: reverse the chain, then push it whole */
+        threadtask_t *stack = NULL;
+        for (threadtask_t *t = first, *next; n--; t = next) {
+            next = t->next;
+            t->next = stack, stack = t;
+        }
+        threadtask_t *head = atomic_load(&pool->inject);
+        do {
+            first->next = head;
+        } while (!atomic_compare_exchange_weak(&pool->inject, &head, stack));
+    }
+}
+
+static struct __threadpool *stealpool_create(struct __threadpool *pool)
+{
+    if (!(pool->stealers = calloc(pool->count, sizeof(stealworker_t))))
+        return NULL;
+    atomic_init(&pool->inject, NULL);
+    atomic_init(&pool->epoch, 0);
+    atomic_init(&pool->n_parked, 0);
+    atomic_init(&pool->shutdown, false);
+    for (size_t i = 0; i < pool->count; i++) {
+        pool->stealers[i].pool = pool, pool->stealers[i].id = i;
+        init(&pool->stealers[i].deque, 64);
+    }
+
+    for (size_t i = 0; i < pool->count; i++) {
+        if (pthread_create(&pool->workers[i], NULL, stealworker_routine,
+                           &pool->stealers[i])) {
+            atomic_store(&pool->shutdown, true);
+            stealpool_wake(pool, INT_MAX);
+            for (size_t j = 0; j < i; j++)
+                pthread_join(pool->workers[j], NULL);
+            for (size_t j = 0; j < pool->count; j++)
+                destroy(&pool->stealers[j].deque);
+            free(pool->stealers);
+            return NULL;
+        }
+    }
+    return pool;
+}
+
+/* Workers leave once shutdown is set and no task is left anywhere, so every
+ * pending task completes before the pool is destroyed.
+ */
+static void stealpool_join(struct __threadpool *pool)
+{
+    atomic_store(&pool->shutdown, true);
+    stealpool_wake(pool, INT_MAX);
+    for (size_t i = 0; i < pool->count; i++)
+        pthread_join(pool->workers[i], NULL);
+    for (size_t i = 0; i < pool->count; i++)
+        destroy(&pool->stealers[i].deque);
+    free(pool->stealers);
+}
+
 struct __threadpool *tpool_create(size_t count)
+{
+    return tpool_create_mode(count, TPOOL_SHARED_QUEUE);
+}
+
+struct __threadpool *tpool_create_mode(size_t count, enum tpool_mode mode)
 {
     jobqueue_t *jobqueue = jobqueue_create();
     struct __threadpool *pool = malloc(sizeof(struct __threadpool));
@@ -254,7 +614,17 @@ struct __threadpool *tpool_create(size_t count)
         return NULL;
     }
 
-    pool->count = count, pool->jobqueue = jobqueue;
+    pool->count = count, pool->jobqueue = jobqueue, pool->mode = mode;
+    if (mode == TPOOL_WORK_STEALING) {
+        if ((pool->workers = malloc(count * sizeof(pthread_t))) &&
+            stealpool_create(pool))
+            return pool;
+        free(pool->workers);
+        jobqueue_destroy(jobqueue);
+        free(pool);
+        return NULL;
+    }
+
     if ((pool->workers = malloc(count * sizeof(pthread_t)))) {
         for (int i = 0; i < count; i++) {
             if (pthread_create(&pool->workers[i], NULL, jobqueue_fetch,
@@ -277,41 +647,84 @@ struct __threadpool *tpool_create(size_t count)
     return NULL;
 }
 
+int tpool_apply_batch(struct __threadpool *pool,
+                      size_t n,
+                      void *(*funcs[])(void *),
+                      void *args[],
+                      struct __tpool_future *futures[])
+{
+    threadtask_t *first = NULL, *last = NULL;
+    if (!n)
+        return 0;
+
+    /* Allocate everything first, so that the batch is queued all or nothing */
+    for (size_t i = 0; i < n; i++) {
+        threadtask_t *task = slab_alloc(SLAB_TASK);
+        struct __tpool_future *future = NULL;
+        if (task && futures && !(future = tpool_future_create())) {
+            slab_free(SLAB_TASK, task);
+            task = NULL;
+        }
+        if (!task) {
+            for (threadtask_t *next; first; first = next) {
+                next = first->next;
+                if (first->future)
+                    slab_free(SLAB_FUTURE, first->future);
+                slab_free(SLAB_TASK, first);
+            }
+            return -1;
+        }
+
+        task->func = funcs[i], task->arg = args[i], task->future = future;
+        task->next = NULL;
+        if (pool->mode == TPOOL_WORK_STEALING) {
+            stealtask_t *t = (stealtask_t *) task;
+            t->work.code = stealtask_run;
+            atomic_init(&t->work.join_count, 0);
+        }
+        if (last)
+            last->next = task;
+        else
+            first = task;
+        last = task;
+        if (futures)
+            futures[i] = future;
+    }
+
+    if (pool->mode == TPOOL_WORK_STEALING) {
+        stealpool_push(pool, first, n);
+        stealpool_wake(pool, n < pool->count ? n : pool->count);
+    } else {
+        jobqueue_push(pool->jobqueue, first, last);
+    }
+    return 0;
+}
+
 struct __tpool_future *tpool_apply(struct __threadpool *pool,
                                    void *(*func)(void *),
                                    void *arg)
 {
-    jobqueue_t *jobqueue = pool->jobqueue;
-    threadtask_t *new_head = malloc(sizeof(threadtask_t));
-    struct __tpool_future *future = tpool_future_create();
-    if (new_head && future) {
-        new_head->func = func, new_head->arg = arg, new_head->future = future;
-        pthread_mutex_lock(&jobqueue->rwlock);
-        if (jobqueue->head) {
-            new_head->next = jobqueue->head;
-            jobqueue->head = new_head;
-        } else {
-            jobqueue->head = jobqueue->tail = new_head;
-            pthread_cond_broadcast(&jobqueue->cond_nonempty);
-        }
-        pthread_mutex_unlock(&jobqueue->rwlock);
-    } else if (new_head) {
-        free(new_head);
-        return NULL;
-    } else if (future) {
-        tpool_future_destroy(future);
+    struct __tpool_future *future;
+    if (tpool_apply_batch(pool, 1, &func, &arg, &future))
         return NULL;
-    }
     return future;
 }
 
 int tpool_join(struct __threadpool *pool)
 {
     size_t num_threads = pool->count;
-    for (int i = 0; i < num_threads; i++)
-        tpool_apply(pool, NULL, NULL);
-    for (int i = 0; i < num_threads; i++)
-        pthread_join(pool->workers[i], NULL);
+    if (pool->mode == TPOOL_WORK_STEALING) {
+        stealpool_join(pool);
+    } else {
+        /* One stop task per worker, queued behind every pending task */
+        void *(*stop[num_threads])(void *);
+        void *args[num_threads];
+        for (int i = 0; i < num_threads; i++)
+            stop[i] = NULL, args[i] = NULL;
+        tpool_apply_batch(pool, num_threads, stop, args, NULL);
+        for (int i = 0; i < num_threads; i++)
+            pthread_join(pool->workers[i], NULL);
+    }
     free(pool->workers);
     jobqueue_destroy(pool->jobqueue);
     free(pool);
@@ -335,17 +748,23 @@ static void *bbp(void *arg)
     return (void *) product;
 }
 
-int main()
+static double bbp_pi(enum tpool_mode mode)
 {
     int bbp_args[PRECISION + 1];
+    void *args[PRECISION + 1];
+    void *(*funcs[PRECISION + 1])(void *);
     double bbp_sum = 0;
-    tpool_t pool = tpool_create(4);
+    tpool_t pool = tpool_create_mode(4, mode);
     tpool_future_t futures[PRECISION + 1];
 
     for (int i = 0; i <= PRECISION; i++) {
         bbp_args[i] = i;
-        futures[i] = tpool_apply(pool, bbp, (void *) &bbp_args[i]);
+        if (mode == TPOOL_SHARED_QUEUE)
+            futures[i] = tpool_apply(pool, bbp, (void *) &bbp_args[i]);
+        funcs[i] = bbp, args[i] = &bbp_args[i];
     }
+    if (mode == TPOOL_WORK_STEALING)
+        tpool_apply_batch(pool, PRECISION + 1, funcs, args, futures);
 
     for (int i = 0; i <= PRECISION; i++) {
         double *result = tpool_future_get(futures[i], 0 /* blocking wait */);
@@ -355,6 +774,43 @@ int main()
     }
 
     tpool_join(pool);
-    printf("PI calculated with %d terms: %.15f\n", PRECISION + 1, bbp_sum);
+    return bbp_sum;
+}
+
+#define N_DETACHED 10000
+
+static atomic_int n_detached;
+
+static void *count_detached(void *arg)
+{
+    atomic_fetch_add_explicit(&n_detached, 1, memory_order_relaxed);
+    return arg;
+}
+
+/* Fire-and-forget tasks: no future, tpool_join() waits for them */
+static int detached(enum tpool_mode mode)
+{
+    static void *(*funcs[N_DETACHED])(void *);
+    static void *args[N_DETACHED];
+    tpool_t pool = tpool_create_mode(4, mode);
+
+    atomic_store(&n_detached, 0);
+    for (int i = 0; i < N_DETACHED; i++)
+        funcs[i] = count_detached;
+    for (int i = 0; i < N_DETACHED; i += 100)
+        tpool_apply_batch(pool, 100, funcs + i, args + i, NULL);
+    tpool_join(pool);
+    return atomic_load(&n_detached);
+}
+
+int main()
+{
+    printf("PI calculated with %d terms: %.15f\n", PRECISION + 1,
+           bbp_pi(TPOOL_SHARED_QUEUE));
+    printf("PI calculated with %d terms (work stealing): %.15f\n",
+           PRECISION + 1, bbp_pi(TPOOL_WORK_STEALING));
+    printf("Detached tasks run: %d, %d (work stealing), expected %d\n",
+           detached(TPOOL_SHARED_QUEUE), detached(TPOOL_WORK_STEALING),
+           N_DETACHED);
     return 0;
 }
@@ -0,0 +1,168 @@
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <assert.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/socket.h>
+
+#include "uring.h"
+
+#define FILE_SIZE (1 << 20)
+#define DEPTH 32
+#define CHUNK 4096
+
+static char pattern(off_t off)
+{
+    return 'a' + off % 23;
+}
+
+/* Wait for the @n completions of the last batch, in @res by user_data */
+static void wait_all(struct uring *r, int n, int *res)
+{
+    while (n > 0) {
+        struct io_uring_cqe *cqe;
+        assert(uring_submit(r, 1) >= 0);
+        for (; (cqe = uring_cqe(r)); uring_cqe_seen(r), n--)
+            res[cqe->user_data] = cqe->res;
+    }
+}
+
+/* Deep queue of fixed reads from a fixed file, completing in any order */
+static void test_read_fixed(struct uring *r, char *buf)
+{
+    int res[DEPTH];
+
+    for (off_t base = 0; base < FILE_SIZE; base += DEPTH * CHUNK) {
+        for (int i = 0; i < DEPTH; i++) {
+            struct io_uring_sqe *sqe = uring_sqe(r);
+            assert(sqe);
+            uring_prep_read_fixed(sqe, 0, buf + i * CHUNK, CHUNK,
+                                  base + i * CHUNK, 0);
+            sqe->flags |= IOSQE_FIXED_FILE;
+            sqe->user_data = i;
+        }
+        wait_all(r, DEPTH, res);
+        for (int i = 0; i < DEPTH; i++) {
+            assert(res[i] == CHUNK);
+            for (int j = 0; j < CHUNK; j += 511)
+                assert(buf[i * CHUNK + j] == pattern(base + i * CHUNK + j));
+        }
+    }
+}
+
+/* A send and a fixed read on the two ends of a socket pair, in one batch */
+static void test_socket(struct uring *r, int tx, char *buf)
+{
+    static const char msg[] = "hello";
+    int res[2];
+    struct io_uring_sqe *sqe = uring_sqe(r);
+
+    uring_prep_send(sqe, tx, msg, sizeof(msg), MSG_NOSIGNAL);
+    sqe->user_data = 0;
+    sqe = uring_sqe(r);
+    uring_prep_read_fixed(sqe, 1, buf, CHUNK, -1, 0);
+    sqe->flags |= IOSQE_FIXED_FILE;
+    sqe->user_data = 1;
+    wait_all(r, 2, res);
+    assert(res[0] == sizeof(msg) && res[1] == sizeof(msg));
+    assert(!strcmp(buf, msg));
+}
+
+/* From the file to a socket through a pipe */
+static void test_splice(struct uring *r, int fd, int tx, int rx, char *buf)
+{
+    int p[2], res[1];
+
+    assert(!pipe(p));
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    uring_prep_splice(sqe, fd, CHUNK, p[1], -1, CHUNK, 0);
+    sqe->user_data = 0;
+    wait_all(r, 1, res);
+    assert(res[0] == CHUNK);
+
+    sqe = uring_sqe(r);
+    uring_prep_splice(sqe, p[0], -1, tx, -1, CHUNK, 0);
+    sqe->user_data = 0;
+    wait_all(r, 1, res);
+    assert(res[0] == CHUNK);
+
+    for (int got = 0, n; got < CHUNK; got += n)
+        assert((n = read(rx, buf + got, CHUNK - got)) > 0);
+    for (int j = 0; j < CHUNK; j++)
+        assert(buf[j] == pattern(CHUNK + j));
+    close(p[0]);
+    close(p[1]);
+}
+
+/* A connection accepted to a free slot of the file table, then closed */
+static void test_accept(struct uring *r)
+{
+    struct sockaddr_in addr = {.sin_family = AF_INET,
+                               .sin_addr.s_addr = htonl(INADDR_LOOPBACK)};
+    socklen_t len = sizeof(addr);
+    int res[1];
+
+    int l = socket(AF_INET, SOCK_STREAM, 0);
+    assert(l >= 0);
+    assert(!bind(l, (struct sockaddr *) &addr, sizeof(addr)));
+    assert(!listen(l, 1));
+    assert(!getsockname(l, (struct sockaddr *) &addr, &len));
+
+    int c = socket(AF_INET, SOCK_STREAM, 0);
+    assert(!connect(c, (struct sockaddr *) &addr, sizeof(addr)));
+
+    struct io_uring_sqe *sqe = uring_sqe(r);
+    uring_prep_accept_direct(sqe, l, 0, 0);
+    sqe->user_data = 0;
+    wait_all(r, 1, res);
+    assert(res[0] == 2); /* the first free slot */
+
+    sqe = uring_sqe(r);
+    uring_prep_close_direct(sqe, res[0]);
+    sqe->user_data = 0;
+    wait_all(r, 1, res);
+    assert(res[0] == 0);
+    close(c);
+    close(l);
+}
+
+int main(void)
+{
+    char name[] = "/tmp/test-uring-XXXXXX";
+    int fd = mkstemp(name), sv[2];
+    struct uring r;
+
+    assert(fd >= 0);
+    unlink(name);
+    char *data = malloc(FILE_SIZE);
+    for (off_t i = 0; i < FILE_SIZE; i++)
+        data[i] = pattern(i);
+    assert(write(fd, data, FILE_SIZE) == FILE_SIZE);
+    free(data);
+    assert(!socketpair(AF_UNIX, SOCK_STREAM, 0, sv));
+
+    if (uring_init(&r, DEPTH, 0)) {
+        perror("io_uring_setup");
+        return 1;
+    }
+    char *buf = aligned_alloc(4096, DEPTH * CHUNK);
+    struct iovec iov = {buf, DEPTH * CHUNK};
+    int files[4] = {fd, sv[1], -1, -1};
+    assert(!uring_register_buffers(&r, &iov, 1));
+    assert(!uring_register_files(&r, files, 4));
+
+    test_read_fixed(&r, buf);
+    test_socket(&r, sv[0], buf);
+    test_splice(&r, fd, sv[0], sv[1], buf);
+    test_accept(&r);
+
+    uring_exit(&r);
+    free(buf);
+    close(fd);
+    close(sv[0]);
+    close(sv[1]);
+    printf("OK\n");
+    return 0;
+}
@@ -0,0 +1,261 @@
+/* A minimal io_uring
+ *
+ * Just enough of io_uring for the I/O paths of the other directories, right
+ * on top of the system calls, as liburing is not a dependency of this tree:
+ * the submission and completion rings shared with the kernel, registered
+ * buffers and files, and the preparation of the operations in use.
+ *
+ * A ring belongs to one thread. It queues any number of SQEs with
+ * uring_sqe(), and uring_submit() hands them all to the kernel and waits for
+ * completions in a single io_uring_enter(), so that one system call is
+ * amortized over a whole batch of operations.
+ *
+ *     struct io_uring_sqe *sqe = uring_sqe(&ring);
+ *     uring_prep_read_fixed(sqe, 0, buf, len, off, 0);
+ *     sqe->flags |= IOSQE_FIXED_FILE;
+ *     sqe->user_data = tag;
+ *     uring_submit(&ring, 1);
+ *     for (struct io_uring_cqe *cqe; (cqe = uring_cqe(&ring));
+ *          uring_cqe_seen(&ring))
+ *         ... cqe->user_data, cqe->res ...
+ */
+
+#pragma once
+
+#include <errno.h>
+#include <linux/io_uring.h>
+#include <stdint.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/syscall.h>
+#include <sys/uio.h>
+#include <unistd.h>
+
+struct uring {
+    int fd;
+
+    /* Submission ring: the kernel consumes from khead, we fill from tail and
+     * publish it to ktail on submit
+     */
+    unsigned *sq_khead, *sq_ktail, *sq_array;
+    unsigned sq_mask, sq_entries, sq_tail;
+    struct io_uring_sqe *sqes;
+
+    /* Completion ring: the kernel fills up to ktail, we consume from khead */
+    unsigned *cq_khead, *cq_ktail;
+    unsigned cq_mask;
+    struct io_uring_cqe *cqes;
+
+    void *sq_ring, *cq_ring;
+    size_t sq_ring_len, cq_ring_len, sqes_len;
+};
+
+static inline void uring_exit(struct uring *r)
+{
+    if (r->sqes)
+        munmap(r->sqes, r->sqes_len);
+    if (r->cq_ring && r->cq_ring != r->sq_ring)
+        munmap(r->cq_ring, r->cq_ring_len);
+    if (r->sq_ring)
+        munmap(r->sq_ring, r->sq_ring_len);
+    if (r->fd >= 0)
+        close(r->fd);
+    memset(r, 0, sizeof(*r));
+    r->fd = -1;
+}
+
+static inline void *uring_mmap__(int fd, size_t len, off_t off)
+{
+    void *p =
+        mmap(NULL, len, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE, fd,
+             off);
+    return p == MAP_FAILED ? NULL : p;
+}
+
+/* Set up a ring of @entries SQEs and, if not 0, @cq_entries CQEs, twice as
+ * many otherwise. Return 0, or -1 with errno set.
+ */
+static inline int uring_init(struct uring *r, unsigned entries,
+                             unsigned cq_entries)
+{
+    struct io_uring_params p;
+    int err;
+
+    memset(&p, 0, sizeof(p));
+    if (cq_entries) {
+        p.flags |= IORING_SETUP_CQSIZE;
+        p.cq_entries = cq_entries;
+    }
+    memset(r, 0, sizeof(*r));
+    if ((r->fd = syscall(__NR_io_uring_setup, entries, &p)) < 0)
+        return -1;
+
+    r->sq_ring_len = p.sq_off.array + p.sq_entries * sizeof(unsigned);
+    r->cq_ring_len = p.cq_off.cqes + p.cq_entries * sizeof(struct io_uring_cqe);
+    if (p.features & IORING_FEAT_SINGLE_MMAP) {
+        if (r->cq_ring_len > r->sq_ring_len)
+            r->sq_ring_len = r->cq_ring_len;
+        r->cq_ring_len = r->sq_ring_len;
+    }
+    r->sqes_len = p.sq_entries * sizeof(struct io_uring_sqe);
+
+    if (!(r->sq_ring = uring_mmap__(r->fd, r->sq_ring_len, IORING_OFF_SQ_RING)))
+        goto fail;
+    r->cq_ring = p.features & IORING_FEAT_SINGLE_MMAP
+                     ? r->sq_ring
+                     : uring_mmap__(r->fd, r->cq_ring_len, IORING_OFF_CQ_RING);
+    if (!r->cq_ring ||
+        !(r->sqes = uring_mmap__(r->fd, r->sqes_len, IORING_OFF_SQES)))
+        goto fail;
+
+    char *sq = r->sq_ring, *cq = r->cq_ring;
+    r->sq_khead = (unsigned *) (sq + p.sq_off.head);
+    r->sq_ktail = (unsigned *) (sq + p.sq_off.tail);
+    r->sq_array = (unsigned *) (sq + p.sq_off.array);
+    r->sq_mask = *(unsigned *) (sq + p.sq_off.ring_mask);
+    r->sq_entries = p.sq_entries;
+    r->sq_tail = *r->sq_ktail;
+    r->cq_khead = (unsigned *) (cq + p.cq_off.head);
+    r->cq_ktail = (unsigned *) (cq + p.cq_off.tail);
+    r->cq_mask = *(unsigned *) (cq + p.cq_off.ring_mask);
+    r->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+
+    /* SQEs are used in ring order, so the indirection array is the identity */
+    for (unsigned i = 0; i < r->sq_entries; i++)
+        r->sq_array[i] = i;
+    return 0;
+
+fail:
+    err = errno;
+    uring_exit(r);
+    errno = err;
+    return -1;
+}
+
+/* The next free SQE, cleared, or NULL if the submission ring is full */
+static inline struct io_uring_sqe *uring_sqe(struct uring *r)
+{
+    unsigned head = __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+
+    if (r->sq_tail - head == r->sq_entries)
+        return NULL;
+
+    struct io_uring_sqe *sqe = &r->sqes[r->sq_tail++ & r->sq_mask];
+    memset(sqe, 0, sizeof(*sqe));
+    return sqe;
+}
+
+/* Submit every queued SQE and wait for at least @wait_nr completions.
+ * Return the number of SQEs submitted, or -1 with errno set.
+ */
+static inline int uring_submit(struct uring *r, unsigned wait_nr)
+{
+    __atomic_store_n(r->sq_ktail, r->sq_tail, __ATOMIC_RELEASE);
+    while (1) {
+        unsigned n =
+            r->sq_tail - __atomic_load_n(r->sq_khead, __ATOMIC_ACQUIRE);
+        int ret = syscall(__NR_io_uring_enter, r->fd, n, wait_nr,
+                          wait_nr ? IORING_ENTER_GETEVENTS : 0, NULL, 0);
+        if (ret >= 0 || errno != EINTR)
+            return ret;
+    }
+}
+
+/* The oldest completion not seen yet, or NULL */
+static inline struct io_uring_cqe *uring_cqe(struct uring *r)
+{
+    unsigned head = *r->cq_khead;
+
+    if (head == __atomic_load_n(r->cq_ktail, __ATOMIC_ACQUIRE))
+        return NULL;
+    return &r->cqes[head & r->cq_mask];
+}
+
+/* Give the completion of uring_cqe() back to the kernel */
+static inline void uring_cqe_seen(struct uring *r)
+{
+    __atomic_store_n(r->cq_khead, *r->cq_khead + 1, __ATOMIC_RELEASE);
+}
+
+/* Register @n buffers, used by the _fixed operations through their index */
+static inline int uring_register_buffers(struct uring *r,
+                                         const struct iovec *iov, unsigned n)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_BUFFERS, iov,
+                   n);
+}
+
+/* Register a table of @n files, used through their index along with
+ * IOSQE_FIXED_FILE. The slots set to -1 are left free for the direct
+ * descriptors.
+ */
+static inline int uring_register_files(struct uring *r, const int *fds,
+                                       unsigned n)
+{
+    return syscall(__NR_io_uring_register, r->fd, IORING_REGISTER_FILES, fds,
+                   n);
+}
+
+static inline void uring_prep_rw(struct io_uring_sqe *sqe, int op, int fd,
+                                 const void *addr, unsigned len, uint64_t off)
+{
+    sqe->opcode = op;
+    sqe->fd = fd;
+    sqe->addr = (uintptr_t) addr;
+    sqe->len = len;
+    sqe->off = off;
+}
+
+/* Read into the registered buffer @buf_index, which holds [buf, buf + len).
+ * @off is -1 for the files without a position, such as the sockets.
+ */
+static inline void uring_prep_read_fixed(struct io_uring_sqe *sqe, int fd,
+                                         void *buf, unsigned len, uint64_t off,
+                                         unsigned buf_index)
+{
+    uring_prep_rw(sqe, IORING_OP_READ_FIXED, fd, buf, len, off);
+    sqe->buf_index = buf_index;
+}
+
+static inline void uring_prep_send(struct io_uring_sqe *sqe, int fd,
+                                   const void *buf, size_t len, int flags)
+{
+    uring_prep_rw(sqe, IORING_OP_SEND, fd, buf, len, 0);
+    sqe->msg_flags = flags;
+}
+
+/* Accept to a free slot of the file table, whose index is the result. With
+ * IORING_ACCEPT_MULTISHOT in @ioprio, keep accepting for as long as the
+ * completions carry IORING_CQE_F_MORE.
+ */
+static inline void uring_prep_accept_direct(struct io_uring_sqe *sqe, int fd,
+                                            int flags, unsigned ioprio)
+{
+    uring_prep_rw(sqe, IORING_OP_ACCEPT, fd, NULL, 0, 0);
+    sqe->accept_flags = flags;
+    sqe->ioprio = ioprio;
+    sqe->file_index = IORING_FILE_INDEX_ALLOC;
+}
+
+/* Move @len bytes from @fd_in to @fd_out, one of them a pipe. An offset is -1
+ * for a pipe, and SPLICE_F_FD_IN_FIXED in @flags makes @fd_in an index in
+ * the file table, as IOSQE_FIXED_FILE does for @fd_out.
+ */
+static inline void uring_prep_splice(struct io_uring_sqe *sqe, int fd_in,
+                                     int64_t off_in, int fd_out,
+                                     int64_t off_out, unsigned len,
+                                     unsigned flags)
+{
+    uring_prep_rw(sqe, IORING_OP_SPLICE, fd_out, NULL, len, off_out);
+    sqe->splice_off_in = off_in;
+    sqe->splice_fd_in = fd_in;
+    sqe->splice_flags = flags;
+}
+
+/* Close the direct descriptor of the file table @slot */
+static inline void uring_prep_close_direct(struct io_uring_sqe *sqe,
+                                           unsigned slot)
+{
+    uring_prep_rw(sqe, IORING_OP_CLOSE, 0, NULL, 0, 0);
+    sqe->file_index = slot + 1;
+}
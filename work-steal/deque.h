@@ -0,0 +1,220 @@
+/* Chase-Lev work-stealing deque, shared by the work-stealing scheduler and
+ * other programs in this collection which schedule work on top of it.
+ *
+ * D. Chase and Y. Lev. Dynamic circular work-stealing deque. SPAA 2005.
+ * N. M. Le, A. Pop, A. Cohen and F. Zappa Nardelli. Correct and efficient
+ * work-stealing for weak memory models. PPoPP 2013.
+ *
+ * Only the owner of a deque may push() and take(); any thread may steal().
+ */
+
+#pragma once
+
+#include <stdatomic.h>
+#include <stdlib.h>
+
+struct work_internal;
+
+/* A 'task_t' represents a function pointer that accepts a pointer to a 'work_t'
+ * struct as input and returns another 'work_t' struct as output. The input to
+ * this function is always a pointer to the encompassing 'work_t' struct.
+ *
+ * It is worth considering whether to include information about the executing
+ * thread's identifier when invoking the task. This information might be
+ * beneficial for supporting thread-local accumulators in cases of commutative
+ * reductions. Additionally, it could be useful to determine the destination
+ * worker's queue for appending further tasks.
+ *
+ * The 'task_t' trampoline is responsible for delivering the subsequent unit of
+ * work to be executed. It returns the next work item if it is prepared for
+ * execution, or NULL if the task is not ready to proceed.
+ */
+typedef struct work_internal *(*task_t)(struct work_internal *);
+
+typedef struct work_internal {
+    task_t code;
+    atomic_int join_count;
+    void *args[];
+} work_t;
+
+/* These are non-NULL pointers that will result in page faults under normal
+ * circumstances, used to verify that nobody uses non-initialized entries.
+ */
+static work_t *const EMPTY = (work_t *) 0x100,
+                     *const ABORT = (work_t *) 0x200;
+
+/* work_t-stealing deque */
+
+typedef struct array_internal {
+    atomic_size_t size;
+    /* Owner-private once the array is retired, see resize() */
+    struct array_internal *retired_next;
+    size_t stamp;
+    _Atomic(work_t *) buffer[];
+} array_t;
+
+typedef struct {
+    /* Assume that they never overflow */
+    atomic_size_t top, bottom;
+    _Atomic(array_t *) array;
+    /* Arrays replaced by resize(), newest first. Owner-private. */
+    array_t *retired;
+    /* take() halves the array when it is less than a quarter full and
+     * larger than this. 0, the default, never shrinks.
+     */
+    size_t shrink_min;
+} deque_t;
+
+static inline void init(deque_t *q, int size_hint)
+{
+    /* Start at 1, so that take() on a fresh deque does not wrap bottom - 1
+     * around and mistake the empty deque for a full one.
+     */
+    atomic_init(&q->top, 1);
+    atomic_init(&q->bottom, 1);
+    array_t *a = malloc(sizeof(array_t) + sizeof(work_t *) * size_hint);
+    atomic_init(&a->size, size_hint);
+    atomic_init(&q->array, a);
+    q->retired = NULL;
+    q->shrink_min = 0;
+}
+
+static inline void resize(deque_t *q, size_t new_size)
+{
+    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    size_t old_size = a->size;
+    array_t *new = malloc(sizeof(array_t) + sizeof(work_t *) * new_size);
+    if (!new)
+        return; /* Keep the old array */
+    atomic_init(&new->size, new_size);
+    size_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    for (size_t i = t; i < b; i++)
+        new->buffer[i % new_size] = a->buffer[i % old_size];
+
+    /* Release, so that a thief seeing the new array also sees its content */
+    atomic_store_explicit(&q->array, new, memory_order_release);
+    /* The question arises as to the appropriate timing for releasing memory
+     * associated with the previous array denoted by *a. In the original Chase
+     * and Lev paper, this task was undertaken by the garbage collector, which
+     * presumably possessed knowledge about ongoing steal operations by other
+     * threads that might attempt to access data within the array.
+     *
+     * In our context, the responsible deallocation of *a cannot occur at this
+     * point, as another thread could potentially be in the process of reading
+     * from it. So *a is only retired here, with a zero stamp. The owner may
+     * tag retired arrays with stamp_retired() and free them with reclaim()
+     * once no thief can still see them, e.g. after a grace period. Unless it
+     * does, retired arrays are only released by destroy(), which is fine as
+     * long as the deque never shrinks: doubling bounds them by the memory of
+     * the live array.
+     */
+    a->stamp = 0;
+    a->retired_next = q->retired;
+    q->retired = a;
+}
+
+/* Tag the arrays retired since the last call with @stamp, which must not be
+ * zero. Only the owner may call this.
+ */
+static inline void stamp_retired(deque_t *q, size_t stamp)
+{
+    for (array_t *a = q->retired; a && !a->stamp; a = a->retired_next)
+        a->stamp = stamp;
+}
+
+/* Free the retired arrays tagged with a stamp below @safe. Only the owner may
+ * call this.
+ */
+static inline void reclaim(deque_t *q, size_t safe)
+{
+    for (array_t **p = &q->retired; *p;) {
+        array_t *a = *p;
+        if (a->stamp && a->stamp < safe) {
+            *p = a->retired_next;
+            free(a);
+        } else
+            p = &a->retired_next;
+    }
+}
+
+/* Free the arrays of a deque nobody uses anymore */
+static inline void destroy(deque_t *q)
+{
+    while (q->retired) {
+        array_t *a = q->retired;
+        q->retired = a->retired_next;
+        free(a);
+    }
+    free(atomic_load_explicit(&q->array, memory_order_relaxed));
+}
+
+static inline work_t *take(deque_t *q)
+{
+    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    if (q->shrink_min && a->size > q->shrink_min) {
+        /* A stale top only overestimates the count, which is safe */
+        size_t n = atomic_load_explicit(&q->bottom, memory_order_relaxed) -
+                   atomic_load_explicit(&q->top, memory_order_relaxed);
+        if (n < a->size / 4) {
+            resize(q, a->size / 2);
+            a = atomic_load_explicit(&q->array, memory_order_relaxed);
+        }
+    }
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
+    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
+    work_t *x;
+    if (t <= b) {
+        /* Non-empty queue */
+        x = atomic_load_explicit(&a->buffer[b % a->size], memory_order_relaxed);
+        if (t == b) {
+            /* Single last element in queue */
+            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
+                                                         memory_order_seq_cst,
+                                                         memory_order_relaxed))
+                /* Failed race */
+                x = EMPTY;
+            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+        }
+    } else { /* Empty queue */
+        x = EMPTY;
+        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+    }
+    return x;
+}
+
+static inline void push(deque_t *q, work_t *w)
+{
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
+    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
+    if (b - t > a->size - 1) { /* Full queue */
+        resize(q, a->size * 2);
+        a = atomic_load_explicit(&q->array, memory_order_relaxed);
+        if (b - t > a->size - 1)
+            abort(); /* Out of memory */
+    }
+    atomic_store_explicit(&a->buffer[b % a->size], w, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release);
+    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
+}
+
+static inline work_t *steal(deque_t *q)
+{
+    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
+    atomic_thread_fence(memory_order_seq_cst);
+    size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
+    work_t *x = EMPTY;
+    if (t < b) {
+        /* Non-empty queue */
+        array_t *a = atomic_load_explicit(&q->array, memory_order_consume);
+        x = atomic_load_explicit(&a->buffer[t % a->size], memory_order_relaxed);
+        if (!atomic_compare_exchange_strong_explicit(
+                &q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
+            /* Failed race */
+            return ABORT;
+    }
+    return x;
+}
@@ -11,163 +11,41 @@
  * Programming Parallel Applications in Cilk
  */
 
+#define _GNU_SOURCE /* pthread_setaffinity_np */
 #include <assert.h>
+#include <limits.h>
+#include <linux/futex.h>
 #include <pthread.h>
-#include <stdatomic.h>
+#include <sched.h>
 #include <stdbool.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
-struct work_internal;
-
-/* A 'task_t' represents a function pointer that accepts a pointer to a 'work_t'
- * struct as input and returns another 'work_t' struct as output. The input to
- * this function is always a pointer to the encompassing 'work_t' struct.
- *
- * It is worth considering whether to include information about the executing
- * thread's identifier when invoking the task. This information might be
- * beneficial for supporting thread-local accumulators in cases of commutative
- * reductions. Additionally, it could be useful to determine the destination
- * worker's queue for appending further tasks.
- *
- * The 'task_t' trampoline is responsible for delivering the subsequent unit of
- * work to be executed. It returns the next work item if it is prepared for
- * execution, or NULL if the task is not ready to proceed.
- */
-typedef struct work_internal *(*task_t)(struct work_internal *);
-
-typedef struct work_internal {
-    task_t code;
-    atomic_int join_count;
-    void *args[];
-} work_t;
-
-/* These are non-NULL pointers that will result in page faults under normal
- * circumstances, used to verify that nobody uses non-initialized entries.
- */
-static work_t *EMPTY = (work_t *) 0x100, *ABORT = (work_t *) 0x200;
-
-/* work_t-stealing deque */
-
-typedef struct {
-    atomic_size_t size;
-    _Atomic(work_t *) buffer[];
-} array_t;
-
-typedef struct {
-    /* Assume that they never overflow */
-    atomic_size_t top, bottom;
-    _Atomic(array_t *) array;
-} deque_t;
-
-void init(deque_t *q, int size_hint)
-{
-    atomic_init(&q->top, 0);
-    atomic_init(&q->bottom, 0);
-    array_t *a = malloc(sizeof(array_t) + sizeof(work_t *) * size_hint);
-    atomic_init(&a->size, size_hint);
-    atomic_init(&q->array, a);
-}
-
-void resize(deque_t *q)
-{
-    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
-    size_t old_size = a->size;
-    size_t new_size = old_size * 2;
-    array_t *new = malloc(sizeof(array_t) + sizeof(work_t *) * new_size);
-    atomic_init(&new->size, new_size);
-    size_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
-    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
-    for (size_t i = t; i < b; i++)
-        new->buffer[i % new_size] = a->buffer[i % old_size];
-
-    atomic_store_explicit(&q->array, new, memory_order_relaxed);
-    /* The question arises as to the appropriate timing for releasing memory
-     * associated with the previous array denoted by *a. In the original Chase
-     * and Lev paper, this task was undertaken by the garbage collector, which
-     * presumably possessed knowledge about ongoing steal operations by other
-     * threads that might attempt to access data within the array.
-     *
-     * In our context, the responsible deallocation of *a cannot occur at this
-     * point, as another thread could potentially be in the process of reading
-     * from it. Thus, we opt to abstain from freeing *a in this context,
-     * resulting in memory leakage. It is worth noting that our expansion
-     * strategy for these queues involves consistent doubling of their size;
-     * this design choice ensures that any leaked memory remains bounded by the
-     * memory actively employed by the functional queues.
-     */
-}
-
-work_t *take(deque_t *q)
-{
-    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed) - 1;
-    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
-    atomic_store_explicit(&q->bottom, b, memory_order_relaxed);
-    atomic_thread_fence(memory_order_seq_cst);
-    size_t t = atomic_load_explicit(&q->top, memory_order_relaxed);
-    work_t *x;
-    if (t <= b) {
-        /* Non-empty queue */
-        x = atomic_load_explicit(&a->buffer[b % a->size], memory_order_relaxed);
-        if (t == b) {
-            /* Single last element in queue */
-            if (!atomic_compare_exchange_strong_explicit(&q->top, &t, t + 1,
-                                                         memory_order_seq_cst,
-                                                         memory_order_relaxed))
-                /* Failed race */
-                x = EMPTY;
-            atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
-        }
-    } else { /* Empty queue */
-        x = EMPTY;
-        atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
-    }
-    return x;
-}
-
-void push(deque_t *q, work_t *w)
-{
-    size_t b = atomic_load_explicit(&q->bottom, memory_order_relaxed);
-    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
-    array_t *a = atomic_load_explicit(&q->array, memory_order_relaxed);
-    if (b - t > a->size - 1) { /* Full queue */
-        resize(q);
-        a = atomic_load_explicit(&q->array, memory_order_relaxed);
-    }
-    atomic_store_explicit(&a->buffer[b % a->size], w, memory_order_relaxed);
-    atomic_thread_fence(memory_order_release);
-    atomic_store_explicit(&q->bottom, b + 1, memory_order_relaxed);
-}
-
-work_t *steal(deque_t *q)
-{
-    size_t t = atomic_load_explicit(&q->top, memory_order_acquire);
-    atomic_thread_fence(memory_order_seq_cst);
-    size_t b = atomic_load_explicit(&q->bottom, memory_order_acquire);
-    work_t *x = EMPTY;
-    if (t < b) {
-        /* Non-empty queue */
-        array_t *a = atomic_load_explicit(&q->array, memory_order_consume);
-        x = atomic_load_explicit(&a->buffer[t % a->size], memory_order_relaxed);
-        if (!atomic_compare_exchange_strong_explicit(
-                &q->top, &t, t + 1, memory_order_seq_cst, memory_order_relaxed))
-            /* Failed race */
-            return ABORT;
-    }
-    return x;
-}
+#include "../hotstat/hotstat.h"
+#include "deque.h"
 
 #define N_THREADS 24
 deque_t *thread_queues;
 
 atomic_bool done;
 
+/* Whether workers report what they run */
+atomic_bool trace = true;
+
+/* Index of the worker running on this thread, -1 outside of the pool */
+static __thread int worker_id = -1;
+
 /* Returns the subsequent item available for processing, or NULL if no items
  * are remaining.
  */
 static work_t *do_one_work(int id, work_t *work)
 {
-    printf("work item %d running item %p\n", id, work);
+    if (atomic_load_explicit(&trace, memory_order_relaxed))
+        printf("work item %d running item %p\n", id, work);
     return (*(work->code)) (work);
 }
 
@@ -188,30 +66,256 @@ work_t *join_work(work_t *work)
     return NULL;
 }
 
+/* Retired deque arrays are freed with quiescent-state based reclamation.
+ * A worker holds no array between two deque operations, so every round of
+ * its scheduling loop is a quiescent state, at which it publishes the global
+ * epoch it last saw. An owner tags the arrays it retires with the epoch and
+ * moves the epoch forward; they can be freed once every worker has
+ * published a later epoch, as none of them can still be reading them.
+ */
+#define OFFLINE SIZE_MAX
+
+static atomic_size_t global_epoch = 1;
+
+static struct {
+    _Alignas(64) atomic_size_t epoch;
+} quiescent_epoch[N_THREADS];
+
+static void quiescent(int id)
+{
+    atomic_store(&quiescent_epoch[id].epoch, atomic_load(&global_epoch));
+}
+
+/* Come back from OFFLINE. Unless the epoch stays the same across our
+ * announcement, a reclaimer could have missed it while still seeing us
+ * offline, and we could see arrays it is freeing, so try again.
+ */
+static void quiescent_online(int id)
+{
+    size_t epoch;
+    do {
+        epoch = atomic_load(&global_epoch);
+        atomic_store(&quiescent_epoch[id].epoch, epoch);
+    } while (atomic_load(&global_epoch) != epoch);
+}
+
+static void reclaim_arrays(int id)
+{
+    deque_t *q = &thread_queues[id];
+    if (!q->retired)
+        return;
+    if (!q->retired->stamp)
+        stamp_retired(q, atomic_fetch_add(&global_epoch, 1));
+
+    size_t safe = OFFLINE;
+    for (int i = 0; i < N_THREADS; ++i) {
+        size_t epoch = atomic_load(&quiescent_epoch[i].epoch);
+        if (epoch < safe)
+            safe = epoch;
+    }
+    reclaim(q, safe);
+}
+
+/* Victim selection follows the topology, read from sysfs: workers first
+ * steal from workers sharing their L3 cache, then from their socket, and
+ * only go to other sockets after REMOTE_AFTER failed rounds. Worker i is
+ * pinned on CPU i modulo the number of CPUs.
+ */
+enum { SAME_L3, SAME_SOCKET, REMOTE, N_TIERS };
+
+#define REMOTE_AFTER 4
+#define BACKOFF_MAX 10 /* log2 of the longest pause between steal rounds */
+
+static int worker_cpu[N_THREADS];
+/* Victims of each worker, nearest first. victims[i][0..tier_end[i][t]) are
+ * all the victims of worker i in tiers up to t.
+ */
+static int victims[N_THREADS][N_THREADS - 1];
+static int tier_end[N_THREADS][N_TIERS];
+
+/* Consecutive failed steal rounds of this worker */
+static __thread unsigned steal_fails;
+
+static long cpu_attr(int cpu, const char *attr)
+{
+    char path[128];
+    long value = -1;
+    snprintf(path, sizeof(path), "/sys/devices/system/cpu/cpu%d/%s", cpu,
+             attr);
+    FILE *f = fopen(path, "r");
+    if (f) {
+        if (fscanf(f, "%ld", &value) != 1)
+            value = -1;
+        fclose(f);
+    }
+    return value;
+}
+
+static void topology_init(void)
+{
+    long n_cpus = sysconf(_SC_NPROCESSORS_ONLN), l3[N_THREADS],
+         socket[N_THREADS];
+    if (n_cpus < 1)
+        n_cpus = 1;
+
+    for (int i = 0; i < N_THREADS; ++i) {
+        worker_cpu[i] = i % n_cpus;
+        l3[i] = cpu_attr(worker_cpu[i], "cache/index3/id");
+        socket[i] = cpu_attr(worker_cpu[i], "topology/physical_package_id");
+    }
+
+    for (int id = 0; id < N_THREADS; ++id) {
+        int n = 0;
+        for (int tier = 0; tier < N_TIERS; ++tier) {
+            /* Start past ourselves, so that thieves spread over victims */
+            for (int k = 1; k < N_THREADS; ++k) {
+                int i = (id + k) % N_THREADS;
+                int t = socket[i] != socket[id] ? REMOTE
+                        : l3[i] == l3[id]       ? SAME_L3
+                                                : SAME_SOCKET;
+                if (t == tier)
+                    victims[id][n++] = i;
+            }
+            tier_end[id][tier] = n;
+        }
+    }
+}
+
+static void pin_worker(int id)
+{
+    cpu_set_t set;
+    CPU_ZERO(&set);
+    CPU_SET(worker_cpu[id], &set);
+    pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+}
+
+static inline void cpu_relax(void)
+{
+#if defined(__x86_64__) || defined(__i386__)
+    __builtin_ia32_pause();
+#elif defined(__aarch64__)
+    __asm__ __volatile__("yield");
+#endif
+}
+
+/* Pause for twice as long after every failed round, up to a limit */
+static void steal_backoff(void)
+{
+    unsigned shift = steal_fails < BACKOFF_MAX ? steal_fails : BACKOFF_MAX;
+    for (unsigned i = 0; i < 1U << shift; i++)
+        cpu_relax();
+}
+
+/* Idle workers park on an event count after PARK_AFTER failed rounds.
+ * A parking worker registers as a sleeper, reads the event count, looks at
+ * every queue one last time and sleeps only if the count has not moved.
+ * Whoever publishes work afterwards sees the sleeper, bumps the count and
+ * wakes it; with no sleeper, publishing costs a fence and a load.
+ */
+#define PARK_AFTER 32
+
+static atomic_uint park_epoch;
+static atomic_int n_sleepers;
+
+static long futex_wait(atomic_uint *uaddr, unsigned int val)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAIT_PRIVATE, val, NULL, NULL, 0);
+}
+
+static long futex_wake(atomic_uint *uaddr, int n)
+{
+    return syscall(SYS_futex, uaddr, FUTEX_WAKE_PRIVATE, n, NULL, NULL, 0);
+}
+
+static void wake_workers(int n)
+{
+    /* Order the publication of work before the check for sleepers */
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_load_explicit(&n_sleepers, memory_order_relaxed)) {
+        atomic_fetch_add(&park_epoch, 1);
+        futex_wake(&park_epoch, n);
+    }
+}
+
+/* Push an item on our own queue, where idle workers may steal it */
+static void spawn(deque_t *q, work_t *w)
+{
+    push(q, w);
+    wake_workers(1);
+}
+
+static bool any_work(void)
+{
+    for (int i = 0; i < N_THREADS; ++i)
+        if (atomic_load(&thread_queues[i].bottom) >
+            atomic_load(&thread_queues[i].top))
+            return true;
+    return false;
+}
+
+HOTSTAT_COUNTER(steals, "ws.steals");
+HOTSTAT_COUNTER(steal_aborts, "ws.steal_aborts");
+HOTSTAT_COUNTER(parks, "ws.parks");
+HOTSTAT_HISTOGRAM(park_ns, "ws.park_ns");
+
+static void park(int id)
+{
+    atomic_fetch_add(&n_sleepers, 1);
+    unsigned int epoch = atomic_load(&park_epoch);
+    if (!any_work() && !atomic_load(&done)) {
+        uint64_t start = HOTSTAT_NOW();
+        HOTSTAT_INC(parks);
+        /* A sleeping worker holds no array, let reclamation go on */
+        atomic_store(&quiescent_epoch[id].epoch, OFFLINE);
+        futex_wait(&park_epoch, epoch);
+        quiescent_online(id);
+        HOTSTAT_RECORD(park_ns, HOTSTAT_NOW() - start);
+    }
+    atomic_fetch_sub(&n_sleepers, 1);
+    steal_fails = 0;
+}
+
+/* Try to steal one item from the other workers, nearest first. Returns EMPTY
+ * if all their queues looked empty.
+ */
+static work_t *steal_work(int id)
+{
+    int tiers = steal_fails >= REMOTE_AFTER ? N_TIERS : REMOTE;
+    for (int k = 0; k < tier_end[id][tiers - 1]; ++k) {
+        work_t *stolen = steal(&thread_queues[victims[id][k]]);
+        if (stolen == ABORT) {
+            HOTSTAT_INC(steal_aborts);
+            k--;
+            continue; /* Try again at the same k */
+        } else if (stolen == EMPTY)
+            continue;
+
+        /* Found some work to do */
+        HOTSTAT_INC(steals);
+        steal_fails = 0;
+        return stolen;
+    }
+    steal_fails++;
+    return EMPTY;
+}
+
 void *thread(void *payload)
 {
     int id = *(int *) payload;
     deque_t *my_queue = &thread_queues[id];
+    worker_id = id;
+    pin_worker(id);
     while (true) {
+        quiescent(id);
+        reclaim_arrays(id);
+
         work_t *work = take(my_queue);
         if (work != EMPTY) {
+            steal_fails = 0;
             do_work(id, work);
         } else {
             /* Currently, there is no work present in my own queue */
-            work_t *stolen = EMPTY;
-            for (int i = 0; i < N_THREADS; ++i) {
-                if (i == id)
-                    continue;
-                stolen = steal(&thread_queues[i]);
-                if (stolen == ABORT) {
-                    i--;
-                    continue; /* Try again at the same i */
-                } else if (stolen == EMPTY)
-                    continue;
-
-                /* Found some work to do */
-                break;
-            }
+            work_t *stolen = steal_work(id);
             if (stolen == EMPTY) {
                 /* Despite the previous observation of all queues being devoid
                  * of tasks during the last examination, there exists
@@ -223,16 +327,185 @@ void *thread(void *payload)
                  */
                 if (atomic_load(&done))
                     break;
+                if (steal_fails >= PARK_AFTER)
+                    park(id);
+                else
+                    steal_backoff();
                 continue;
             } else {
                 do_work(id, stolen);
             }
         }
     }
-    printf("work item %d finished\n", id);
+    atomic_store(&quiescent_epoch[id].epoch, OFFLINE);
+    if (atomic_load(&trace))
+        printf("work item %d finished\n", id);
     return NULL;
 }
 
+/* Data-parallel loops.
+ * A range task runs the loop body over [begin, end) one grain at a time.
+ * Before each grain, if its own queue is empty, meaning that whatever it
+ * offered earlier has been stolen, it splits off the upper half of what is
+ * left as a new range task for idle workers to steal. Ranges are thus only
+ * split as much as there are thieves (lazy binary splitting), and a grain
+ * is just the granularity at which a worker checks for them.
+ *
+ * Every split adds one to the join count of the loop and every finished
+ * range removes one. The worker which started the loop runs other items
+ * until the count drops to zero, instead of blocking.
+ */
+typedef void (*range_body_t)(int tid, size_t begin, size_t end, void *ctx);
+
+struct range_loop {
+    range_body_t body;
+    void *ctx;
+    size_t grain;
+    atomic_size_t join_count;
+};
+
+static work_t *range_task(work_t *w);
+
+static work_t *range_new(struct range_loop *loop, size_t begin, size_t end)
+{
+    work_t *w = malloc(sizeof(work_t) + 3 * sizeof(void *));
+    if (w) {
+        w->code = &range_task;
+        w->join_count = 0;
+        w->args[0] = loop;
+        w->args[1] = (void *) (uintptr_t) begin;
+        w->args[2] = (void *) (uintptr_t) end;
+    }
+    return w;
+}
+
+/* Only the owner calls this, so a stale answer is at worst one split late */
+static bool queue_empty(deque_t *q)
+{
+    return atomic_load_explicit(&q->bottom, memory_order_relaxed) <=
+           atomic_load_explicit(&q->top, memory_order_relaxed);
+}
+
+static work_t *range_task(work_t *w)
+{
+    struct range_loop *loop = (struct range_loop *) w->args[0];
+    size_t begin = (uintptr_t) w->args[1], end = (uintptr_t) w->args[2];
+    deque_t *my_queue = &thread_queues[worker_id];
+    free(w);
+
+    while (begin < end) {
+        if (end - begin > loop->grain && queue_empty(my_queue)) {
+            size_t mid = begin + (end - begin) / 2;
+            work_t *upper = range_new(loop, mid, end);
+            if (upper) {
+                atomic_fetch_add(&loop->join_count, 1);
+                spawn(my_queue, upper);
+                end = mid;
+                continue;
+            }
+        }
+        size_t stop = end - begin > loop->grain ? begin + loop->grain : end;
+        loop->body(worker_id, begin, stop, loop->ctx);
+        begin = stop;
+    }
+
+    /* The loop is not touched again after this, its owner may return */
+    atomic_fetch_sub_explicit(&loop->join_count, 1, memory_order_release);
+    return NULL;
+}
+
+/* Run @body over [begin, end) in parallel, in chunks of at most @grain
+ * iterations, or an automatic size if @grain is 0. @body receives the id of
+ * the worker running it, to accumulate into per-worker state. Must be called
+ * from a worker, typically from inside a task; nested loops are fine.
+ */
+void parallel_for(size_t begin,
+                  size_t end,
+                  size_t grain,
+                  range_body_t body,
+                  void *ctx)
+{
+    assert(worker_id >= 0 && "parallel_for must run on a worker");
+    if (begin >= end)
+        return;
+    if (!grain && !(grain = (end - begin) / (8 * N_THREADS)))
+        grain = 1;
+
+    struct range_loop loop = {.body = body, .ctx = ctx, .grain = grain};
+    atomic_init(&loop.join_count, 1);
+    work_t *root = range_new(&loop, begin, end);
+    if (!root) {
+        body(worker_id, begin, end, ctx);
+        return;
+    }
+
+    /* Help with whatever is around until the loop is complete */
+    int id = worker_id;
+    work_t *work = root;
+    while (true) {
+        if (work != EMPTY)
+            do_work(id, work);
+        if (!atomic_load_explicit(&loop.join_count, memory_order_acquire))
+            break;
+        quiescent(id);
+        reclaim_arrays(id);
+        if ((work = take(&thread_queues[id])) == EMPTY)
+            work = steal_work(id);
+    }
+}
+
+/* Body of a reduction: fold [begin, end) into the accumulator @acc */
+typedef void (*reduce_body_t)(int tid,
+                              size_t begin,
+                              size_t end,
+                              void *acc,
+                              void *ctx);
+
+struct reduce_ctx {
+    reduce_body_t body;
+    void *ctx;
+    char *accs;
+    size_t stride;
+};
+
+static void reduce_range(int tid, size_t begin, size_t end, void *ctx)
+{
+    struct reduce_ctx *r = (struct reduce_ctx *) ctx;
+    r->body(tid, begin, end, r->accs + tid * r->stride, r->ctx);
+}
+
+/* Reduce [begin, end) to @result. Every worker folds its ranges into its
+ * own accumulator, which starts as a copy of the @size bytes of @identity,
+ * and the accumulators are then folded together with @combine, which must
+ * be associative and commutative. Returns 0 on success.
+ */
+int parallel_reduce(size_t begin,
+                    size_t end,
+                    size_t grain,
+                    reduce_body_t body,
+                    void (*combine)(void *dst, const void *src),
+                    const void *identity,
+                    size_t size,
+                    void *result,
+                    void *ctx)
+{
+    /* One cache line at least per accumulator, to avoid false sharing */
+    size_t stride = (size + 63) & ~(size_t) 63;
+    struct reduce_ctx r = {.body = body, .ctx = ctx, .stride = stride};
+    if (!(r.accs = aligned_alloc(64, stride * N_THREADS)))
+        return -1;
+    for (int i = 0; i < N_THREADS; ++i)
+        memcpy(r.accs + i * stride, identity, size);
+
+    parallel_for(begin, end, grain, reduce_range, &r);
+
+    memcpy(result, identity, size);
+    for (int i = 0; i < N_THREADS; ++i)
+        combine(result, r.accs + i * stride);
+    free(r.accs);
+    return 0;
+}
+
 work_t *print_task(work_t *w)
 {
     int *payload = (int *) w->args[0];
@@ -244,21 +517,95 @@ work_t *print_task(work_t *w)
     return join_work(cont);
 }
 
+/* Stop the workers once their queues are empty */
+static void finish(void)
+{
+    atomic_store(&done, true);
+    wake_workers(INT_MAX);
+}
+
 work_t *done_task(work_t *w)
 {
     free(w);
-    atomic_store(&done, true);
+    finish();
     return NULL;
 }
 
+#define N_ELEMS (1 << 20)
+
+static void fill_body(int tid, size_t begin, size_t end, void *ctx)
+{
+    double *a = (double *) ctx;
+    for (size_t i = begin; i < end; i++)
+        a[i] = i;
+}
+
+static void sum_body(int tid,
+                     size_t begin,
+                     size_t end,
+                     void *acc,
+                     void *ctx)
+{
+    double *a = (double *) ctx, sum = 0;
+    for (size_t i = begin; i < end; i++)
+        sum += a[i];
+    *(double *) acc += sum;
+}
+
+static void sum_combine(void *dst, const void *src)
+{
+    *(double *) dst += *(const double *) src;
+}
+
+work_t *parallel_task(work_t *w)
+{
+    static double a[N_ELEMS];
+    double zero = 0, sum;
+
+    parallel_for(0, N_ELEMS, 0, fill_body, a);
+    if (parallel_reduce(0, N_ELEMS, 0, sum_body, sum_combine, &zero,
+                        sizeof(double), &sum, a))
+        perror("parallel_reduce");
+    else
+        printf("parallel_reduce: sum %.0f, expected %.0f\n", sum,
+               (double) N_ELEMS * (N_ELEMS - 1) / 2);
+
+    free(w);
+    finish();
+    return NULL;
+}
+
+static void run_threads(void)
+{
+    pthread_t threads[N_THREADS];
+    int tids[N_THREADS];
+
+    /* Nobody may reclaim until every worker has gone through its loop */
+    for (int i = 0; i < N_THREADS; ++i)
+        atomic_store(&quiescent_epoch[i].epoch, 0);
+
+    for (int i = 0; i < N_THREADS; ++i) {
+        tids[i] = i;
+        if (pthread_create(&threads[i], NULL, thread, &tids[i]) != 0) {
+            perror("Failed to start the thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+
+    for (int i = 0; i < N_THREADS; ++i) {
+        if (pthread_join(threads[i], NULL) != 0) {
+            perror("Failed to join the thread");
+            exit(EXIT_FAILURE);
+        }
+    }
+}
+
 int main(int argc, char **argv)
 {
     /* Check that top and bottom are 64-bit so they never overflow */
     static_assert(sizeof(atomic_size_t) == 8,
                   "Assume atomic_size_t is 8 byte wide");
 
-    pthread_t threads[N_THREADS];
-    int tids[N_THREADS];
     thread_queues = malloc(N_THREADS * sizeof(deque_t));
     int nprints = 10;
 
@@ -267,9 +614,10 @@ int main(int argc, char **argv)
     done_work->code = &done_task;
     done_work->join_count = N_THREADS * nprints;
 
+    topology_init();
     for (int i = 0; i < N_THREADS; ++i) {
-        tids[i] = i;
         init(&thread_queues[i], 8);
+        thread_queues[i].shrink_min = 8;
         for (int j = 0; j < nprints; ++j) {
             work_t *work = malloc(sizeof(work_t) + 2 * sizeof(int *));
             work->code = &print_task;
@@ -282,21 +630,21 @@ int main(int argc, char **argv)
         }
     }
 
-    for (int i = 0; i < N_THREADS; ++i) {
-        if (pthread_create(&threads[i], NULL, thread, &tids[i]) != 0) {
-            perror("Failed to start the thread");
-            exit(EXIT_FAILURE);
-        }
-    }
-
-    for (int i = 0; i < N_THREADS; ++i) {
-        if (pthread_join(threads[i], NULL) != 0) {
-            perror("Failed to join the thread");
-            exit(EXIT_FAILURE);
-        }
-    }
+    run_threads();
     printf("Expect %d lines of output (including this one)\n",
            2 * N_THREADS * nprints + N_THREADS + 2);
 
+    /* Then a data-parallel loop, quietly, the number of splits varies */
+    atomic_store(&done, false);
+    atomic_store(&trace, false);
+    work_t *root = malloc(sizeof(work_t));
+    root->code = &parallel_task;
+    root->join_count = 0;
+    push(&thread_queues[0], root);
+    run_threads();
+
+    for (int i = 0; i < N_THREADS; ++i)
+        destroy(&thread_queues[i]);
+    free(thread_queues);
     return 0;
 }